@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench.h"
+#include "libcoro.h"
+#ifdef BENCH_THREAD_POOL
+#include "thread_pool.h"
+#endif
+
+/**
+ * Benchmark of libcoro: the cost of a yield, of a coroutine life (create,
+ * run to the end, reap and delete), and the memory per coroutine. Each is
+ * measured for 1, 10, ..., max N coroutines at once. The timings are
+ * repeated and reported as min/median/max per operation.
+ *
+ * Each N is measured in a forked process, so that it starts with an empty
+ * stack pool and the memory of the previous N does not count. The memory
+ * is taken on the first run, while all the N coroutines have started and
+ * not finished: the resident set of the process grown since before they
+ * were created (the touched stacks and the coroutine structures), and the
+ * mapped stacks, guard pages included.
+ *
+ * Usage: ./bench [--runs R] [--json FILE] [max N] [threads]. With
+ * threads > 0 the M:N scheduler of coro_sched_init_threads() is measured,
+ * or, built as bench_pool (see the Makefile), that of coro_sched_init_pool()
+ * on a thread pool of so many threads.
+ * The JSON file gets the same numbers, to compare between the commits.
+ * An N which would not fit into the free memory, judging by the memory
+ * per coroutine of the previous one, is skipped.
+ */
+
+enum {
+	BENCH_STACK_SIZE = 16 * 1024,
+	BENCH_RUNS_DEFAULT = 5,
+	BENCH_RUNS_MAX = 100,
+	/** About so many yields are made on each run, whatever N. */
+	BENCH_YIELDS_TOTAL = 1000000,
+	BENCH_YIELDS_MIN = 4,
+};
+
+/** Numbers of one N, passed from the forked process. */
+struct bench_result {
+	long count;
+	int runs;
+	double yield_ns[BENCH_RUNS_MAX];
+	double life_ns[BENCH_RUNS_MAX];
+	double rss_per_coro;
+	double mapped_per_coro;
+};
+
+static int bench_yields;
+/** How many coroutines of the run have started, and how many are asked. */
+static long bench_started;
+static long bench_count;
+static long bench_rss_start;
+static long bench_rss_peak;
+
+/** Resident set size of the process, bytes. */
+static long
+bench_rss(void)
+{
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL)
+		return 0;
+	long size, resident;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+static long long
+bench_yield_f(void *arg)
+{
+	(void)arg;
+	long started = __atomic_add_fetch(&bench_started, 1, __ATOMIC_RELAXED);
+	if (started == bench_count && bench_rss_peak == 0)
+		bench_rss_peak = bench_rss();
+	for (int i = 0; i < bench_yields; ++i)
+		coro_yield();
+	return 0;
+}
+
+static long long
+bench_life_f(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+/** Reap and delete all the coroutines, there must be @a count. */
+static void
+bench_reap(long count)
+{
+	long reaped = 0;
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL) {
+		coro_delete(c);
+		++reaped;
+	}
+	if (reaped != count) {
+		printf("Error: reaped %ld coroutines out of %ld\n", reaped, count);
+		exit(-1);
+	}
+}
+
+/** Run @a count coroutines, each doing bench_yields yields. */
+static double
+bench_yield(long count)
+{
+	bench_started = 0;
+	bench_count = count;
+	for (long i = 0; i < count; ++i)
+		coro_new_ex(bench_yield_f, NULL, BENCH_STACK_SIZE);
+	double start = bench_now();
+	bench_reap(count);
+	return (bench_now() - start) * 1e9 / ((double)count * bench_yields);
+}
+
+/** Create @a count coroutines which return at once, reap them all. */
+static double
+bench_life(long count)
+{
+	double start = bench_now();
+	for (long i = 0; i < count; ++i)
+		coro_new_ex(bench_life_f, NULL, BENCH_STACK_SIZE);
+	bench_reap(count);
+	return (bench_now() - start) * 1e9 / count;
+}
+
+static void
+bench_measure(long count, int runs, int threads, struct bench_result *res)
+{
+	if (threads > 0) {
+#ifdef BENCH_THREAD_POOL
+		struct thread_pool_options opts;
+		thread_pool_options_init(&opts, threads);
+		struct thread_pool *pool;
+		if (thread_pool_new_ext(&opts, &pool) != 0) {
+			printf("Error: can not create a pool of %d threads\n",
+			       threads);
+			exit(-1);
+		}
+		coro_sched_init_pool(pool);
+#else
+		coro_sched_init_threads(threads);
+#endif
+	} else {
+		coro_sched_init();
+	}
+	bench_yields = BENCH_YIELDS_TOTAL / count;
+	if (bench_yields < BENCH_YIELDS_MIN)
+		bench_yields = BENCH_YIELDS_MIN;
+	res->count = count;
+	res->runs = runs;
+	bench_rss_start = bench_rss();
+	bench_rss_peak = 0;
+	for (int i = 0; i < runs; ++i) {
+		res->yield_ns[i] = bench_yield(count);
+		if (i == 0) {
+			struct coro_stack_stats stats;
+			coro_stack_stats(&stats);
+			res->rss_per_coro =
+				(double)(bench_rss_peak - bench_rss_start) / count;
+			res->mapped_per_coro =
+				(double)stats.mapped_bytes_max / count;
+		}
+		res->life_ns[i] = bench_life(count);
+	}
+}
+
+/** Measure @a count in a child process. */
+static void
+bench_fork(long count, int runs, int threads, struct bench_result *res)
+{
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		exit(-1);
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		bench_measure(count, runs, threads, res);
+		if (write(fds[1], res, sizeof(*res)) != sizeof(*res))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	ssize_t got = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (got != sizeof(*res) || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0) {
+		printf("Error: the benchmark of %ld coroutines failed\n", count);
+		exit(-1);
+	}
+}
+
+/** Free physical memory, bytes. */
+static double
+bench_mem_available(void)
+{
+	return (double)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = BENCH_RUNS_DEFAULT;
+	const char *json_path = NULL;
+	while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--runs") == 0) {
+			runs = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--json") == 0) {
+			json_path = argv[2];
+		} else {
+			printf("Unknown option %s\n", argv[1]);
+			return -1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (runs < 1 || runs > BENCH_RUNS_MAX) {
+		printf("The number of runs must be in [1, %d]\n", BENCH_RUNS_MAX);
+		return -1;
+	}
+	long max_count = 1000000;
+	if (argc > 1)
+		max_count = strtol(argv[1], NULL, 10);
+	int threads = 0;
+	if (argc > 2)
+		threads = strtol(argv[2], NULL, 10);
+
+	FILE *json = NULL;
+	if (json_path != NULL) {
+		json = fopen(json_path, "w");
+		if (json == NULL) {
+			perror("fopen of the JSON file");
+			return -1;
+		}
+		fprintf(json, "{\"threads\": %d, \"runs\": %d, "
+			"\"stack_size\": %d, \"results\": [", threads, runs,
+			BENCH_STACK_SIZE);
+	}
+#ifdef BENCH_THREAD_POOL
+	if (threads > 0)
+		printf("M:N scheduler on a thread pool, %d threads\n", threads);
+#else
+	if (threads > 0)
+		printf("M:N scheduler, %d threads\n", threads);
+#endif
+	printf("%d runs, min/median/max ns per operation\n", runs);
+	printf("%8s %26s %26s %10s %10s\n", "coros", "yield",
+	       "create+run+delete", "RSS/coro", "mmap/coro");
+	double rss_per_coro = 0;
+	for (long count = 1; count <= max_count; count *= 10) {
+		if (rss_per_coro * count > bench_mem_available() * 0.8) {
+			printf("%8ld skipped: needs about %.0f MiB, more than "
+			       "there is free\n", count,
+			       rss_per_coro * count / (1 << 20));
+			break;
+		}
+		struct bench_result res;
+		bench_fork(count, runs, threads, &res);
+		bench_sort(res.yield_ns, runs);
+		bench_sort(res.life_ns, runs);
+		printf("%8ld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %10.0f "
+		       "%10.0f\n", count, res.yield_ns[0],
+		       bench_median(res.yield_ns, runs), res.yield_ns[runs - 1],
+		       res.life_ns[0], bench_median(res.life_ns, runs),
+		       res.life_ns[runs - 1], res.rss_per_coro,
+		       res.mapped_per_coro);
+		fflush(stdout);
+		rss_per_coro = res.rss_per_coro;
+		if (json == NULL)
+			continue;
+		fprintf(json, "%s\n  {\"coroutines\": %ld, ",
+			count == 1 ? "" : ",", count);
+		bench_json_stat(json, "yield_ns", res.yield_ns, runs);
+		fprintf(json, ", ");
+		bench_json_stat(json, "create_delete_ns", res.life_ns, runs);
+		fprintf(json, ", \"rss_bytes_per_coro\": %.0f, "
+			"\"mapped_bytes_per_coro\": %.0f}", res.rss_per_coro,
+			res.mapped_per_coro);
+	}
+	if (json != NULL) {
+		fprintf(json, "\n]}\n");
+		fclose(json);
+	}
+	return 0;
+}
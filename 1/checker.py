@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -7,14 +8,28 @@ parser = argparse.ArgumentParser(description = "Check that a file contains "\
 					       "not decreasing sequence of "\
 					       "numbers")
 parser.add_argument('-f', type=str, required=True, help="file name")
+parser.add_argument('--binary', action='store_true',
+		    help='the file is in the binary format of "solution --binary"')
 args = parser.parse_args()
 
 
-f = open(args.f, 'r')
-data = f.read()
-f.close()
-
-data = data.split()
+if args.binary:
+	f = open(args.f, 'rb')
+	magic, version, count = struct.unpack('<4sIQ', f.read(16))
+	if magic != b'IS32' or version != 1:
+		print('Error: not a binary file')
+		exit(1)
+	raw = f.read()
+	f.close()
+	if len(raw) != count * 4:
+		print('Error: expected {} numbers, got {} bytes'.format(count, len(raw)))
+		exit(1)
+	data = struct.unpack('<{}i'.format(count), raw)
+else:
+	f = open(args.f, 'r')
+	data = f.read()
+	f.close()
+	data = data.split()
 prev_number = -(1 << 31 - 1)
 for i in range(0, len(data)):
 	try:
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "coro_internal.h"
+
+/**
+ * Arena allocator of a coroutine. The memory is taken from chunks by
+ * bumping a pointer, a chunk is never freed alone: only by
+ * coro_arena_truncate() or together with the coroutine. So the memory of
+ * one coroutine stays together instead of being interleaved with the
+ * allocations of the others in the shared heap.
+ */
+
+enum {
+	/** Size of the first chunk, the next ones are twice bigger. */
+	CORO_ARENA_CHUNK_MIN = 64 * 1024,
+	/** The larger chunks are made just as big as requested. */
+	CORO_ARENA_CHUNK_MAX = 16 * 1024 * 1024,
+	CORO_ARENA_ALIGN = 16,
+};
+
+struct coro_arena_chunk {
+	/** The previous chunk, the older allocations. */
+	struct coro_arena_chunk *prev;
+	/** Position of the arena when the chunk was created. */
+	size_t base;
+	size_t size;
+	size_t used;
+	/** The memory itself. */
+	_Alignas(CORO_ARENA_ALIGN) char data[];
+};
+
+/** Arena of a thread without a scheduler, which has no coroutine. */
+static __thread struct coro_arena coro_arena_thread;
+
+static struct coro_arena *
+coro_arena_this(void)
+{
+	struct coro *c = coro_this();
+	return c != NULL ? &c->arena : &coro_arena_thread;
+}
+
+void *
+coro_arena_alloc(size_t size)
+{
+	struct coro_arena *a = coro_arena_this();
+	if (size > SIZE_MAX - CORO_ARENA_ALIGN) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = (size + CORO_ARENA_ALIGN - 1) & ~(size_t)(CORO_ARENA_ALIGN - 1);
+	struct coro_arena_chunk *top = a->top;
+	if (top == NULL || top->size - top->used < size) {
+		size_t chunk_size = CORO_ARENA_CHUNK_MIN;
+		if (top != NULL && top->size < CORO_ARENA_CHUNK_MAX)
+			chunk_size = top->size * 2;
+		else if (top != NULL)
+			chunk_size = CORO_ARENA_CHUNK_MAX;
+		if (chunk_size < size)
+			chunk_size = size;
+		struct coro_arena_chunk *chunk =
+			malloc(sizeof(*chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->prev = top;
+		chunk->base = a->used;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		a->top = top = chunk;
+	}
+	void *res = top->data + top->used;
+	top->used += size;
+	a->used = top->base + top->used;
+	return res;
+}
+
+size_t
+coro_arena_used(void)
+{
+	return coro_arena_this()->used;
+}
+
+void
+coro_arena_truncate(size_t used)
+{
+	struct coro_arena *a = coro_arena_this();
+	if (used >= a->used)
+		return;
+	struct coro_arena_chunk *top = a->top;
+	while (top != NULL && top->base >= used) {
+		struct coro_arena_chunk *prev = top->prev;
+		free(top);
+		top = prev;
+	}
+	a->top = top;
+	if (top != NULL)
+		top->used = used - top->base;
+	a->used = used;
+}
+
+void
+coro_arena_destroy(struct coro_arena *a)
+{
+	struct coro_arena_chunk *top = a->top;
+	while (top != NULL) {
+		struct coro_arena_chunk *prev = top->prev;
+		free(top);
+		top = prev;
+	}
+	a->top = NULL;
+	a->used = 0;
+}
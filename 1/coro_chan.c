@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "coro_internal.h"
+
+/**
+ * Bounded channels of libcoro. A message is a pointer. A coroutine which
+ * can not send or receive right now is parked in the wait queue of the
+ * channel and takes no turns in the run-queue until the other side (or
+ * coro_chan_close()) wakes it up.
+ *
+ * A sender never parks while there is a parked receiver: the message is
+ * handed to the receiver directly. And a receiver which takes a message
+ * from a full buffer moves the message of the first parked sender into
+ * the freed slot. So the order of the messages is the order of the sends.
+ */
+
+/** A coroutine parked in a channel. Lives on its stack. */
+struct coro_chan_waiter {
+	struct coro *c;
+	/** The message to send, or the received one. */
+	void *msg;
+	/** 0, when the message is passed, -1 if the channel is closed. */
+	int rc;
+	struct coro_chan_waiter *next;
+};
+
+/** FIFO of the parked coroutines. */
+struct coro_chan_queue {
+	struct coro_chan_waiter *head, *tail;
+};
+
+struct coro_chan {
+	/** Ring buffer of the messages. */
+	void **buf;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	bool is_closed;
+	struct coro_chan_queue senders;
+	struct coro_chan_queue receivers;
+};
+
+static void
+coro_chan_queue_push(struct coro_chan_queue *q, struct coro_chan_waiter *w)
+{
+	w->next = NULL;
+	if (q->tail != NULL)
+		q->tail->next = w;
+	else
+		q->head = w;
+	q->tail = w;
+}
+
+static struct coro_chan_waiter *
+coro_chan_queue_pop(struct coro_chan_queue *q)
+{
+	struct coro_chan_waiter *w = q->head;
+	if (w == NULL)
+		return NULL;
+	q->head = w->next;
+	if (q->head == NULL)
+		q->tail = NULL;
+	return w;
+}
+
+/** Complete the wait of @a w with @a rc and put it back to work. */
+static void
+coro_chan_wake(struct coro_chan_waiter *w, int rc)
+{
+	w->rc = rc;
+	coro_wakeup(w->c);
+}
+
+/** Park the current coroutine in @a q until it is woken up. */
+static int
+coro_chan_wait(struct coro_chan_queue *q, struct coro_chan_waiter *w)
+{
+	w->c = coro_this();
+	coro_chan_queue_push(q, w);
+	coro_park();
+	return w->rc;
+}
+
+struct coro_chan *
+coro_chan_new(size_t capacity)
+{
+	struct coro_chan *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL)
+		handle_error();
+	if (capacity > 0) {
+		ch->buf = malloc(capacity * sizeof(*ch->buf));
+		if (ch->buf == NULL)
+			handle_error();
+	}
+	ch->capacity = capacity;
+	return ch;
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+	ch->is_closed = true;
+	struct coro_chan_waiter *w;
+	while ((w = coro_chan_queue_pop(&ch->senders)) != NULL)
+		coro_chan_wake(w, -1);
+	while ((w = coro_chan_queue_pop(&ch->receivers)) != NULL)
+		coro_chan_wake(w, -1);
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+	coro_chan_close(ch);
+	free(ch->buf);
+	free(ch);
+}
+
+int
+coro_chan_send(struct coro_chan *ch, void *msg)
+{
+	if (ch->is_closed) {
+		errno = EPIPE;
+		return -1;
+	}
+	struct coro_chan_waiter *w = coro_chan_queue_pop(&ch->receivers);
+	if (w != NULL) {
+		w->msg = msg;
+		coro_chan_wake(w, 0);
+		return 0;
+	}
+	if (ch->count < ch->capacity) {
+		ch->buf[(ch->head + ch->count) % ch->capacity] = msg;
+		ch->count++;
+		return 0;
+	}
+	if (!coro_can_park()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	struct coro_chan_waiter self = {.msg = msg};
+	if (coro_chan_wait(&ch->senders, &self) != 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	return 0;
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void **msg)
+{
+	if (ch->count > 0) {
+		*msg = ch->buf[ch->head];
+		ch->head = (ch->head + 1) % ch->capacity;
+		ch->count--;
+		struct coro_chan_waiter *w = coro_chan_queue_pop(&ch->senders);
+		if (w != NULL) {
+			ch->buf[(ch->head + ch->count) % ch->capacity] = w->msg;
+			ch->count++;
+			coro_chan_wake(w, 0);
+		}
+		return 0;
+	}
+	/* Unbuffered channel: take the message right from the sender. */
+	struct coro_chan_waiter *w = coro_chan_queue_pop(&ch->senders);
+	if (w != NULL) {
+		*msg = w->msg;
+		coro_chan_wake(w, 0);
+		return 0;
+	}
+	if (ch->is_closed) {
+		errno = EPIPE;
+		return -1;
+	}
+	if (!coro_can_park()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	struct coro_chan_waiter self = {0};
+	if (coro_chan_wait(&ch->receivers, &self) != 0) {
+		errno = EPIPE;
+		return -1;
+	}
+	*msg = self.msg;
+	return 0;
+}
@@ -0,0 +1,148 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "coro_ctx.h"
+
+#ifdef CORO_BACKEND_UCONTEXT
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	if (getcontext(&ctx->uc) != 0) {
+		printf("Error %s\n", strerror(errno));
+		exit(-1);
+	}
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, entry, 0);
+}
+
+void
+coro_ctx_switch(struct coro_ctx *from, const struct coro_ctx *to)
+{
+	if (swapcontext(&from->uc, &to->uc) != 0) {
+		printf("Error %s\n", strerror(errno));
+		exit(-1);
+	}
+}
+
+#elif defined(__x86_64__)
+
+/*
+ * Frame saved on the stack of a suspended coroutine, from the lowest address:
+ * MXCSR (4 bytes) and x87 control word (2 bytes) padded to 8 bytes, then
+ * r15, r14, r13, r12, rbx, rbp and the return address.
+ */
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".type coro_ctx_switch, @function\n"
+	"coro_ctx_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+);
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	/*
+	 * 9 words: the control words slot, 6 registers, the entry address
+	 * and a fake return address of the entry. After the final 'ret' the
+	 * stack pointer is 8 modulo 16, as if 'entry' was called.
+	 */
+	uint64_t *sp = (uint64_t *)(top - 9 * sizeof(uint64_t));
+	memset(sp, 0, 9 * sizeof(uint64_t));
+	/* Default MXCSR and x87 control word, as set up by the ABI. */
+	uint32_t mxcsr = 0x1F80;
+	uint16_t fpucw = 0x037F;
+	memcpy(sp, &mxcsr, sizeof(mxcsr));
+	memcpy((char *)sp + 4, &fpucw, sizeof(fpucw));
+	sp[7] = (uint64_t)(uintptr_t)entry;
+	ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame saved on the stack of a suspended coroutine, from the lowest address:
+ * x19-x28, x29 (frame pointer), x30 (return address), d8-d15.
+ */
+__asm__(
+	".text\n"
+	".globl coro_ctx_switch\n"
+	".type coro_ctx_switch, %function\n"
+	"coro_ctx_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	ldr x2, [x1]\n"
+	"	mov sp, x2\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size coro_ctx_switch, .-coro_ctx_switch\n"
+);
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void))
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 160);
+	memset(sp, 0, 160);
+	/* x30 - the 'ret' of the first switch jumps into the entry. */
+	sp[11] = (uint64_t)(uintptr_t)entry;
+	ctx->sp = sp;
+}
+
+#endif
+
+#if defined(__ELF__) && !defined(CORO_BACKEND_UCONTEXT)
+/* The assembly above does not need an executable stack. */
+__asm__(".section .note.GNU-stack,\"\",%progbits\n.text\n");
+#endif
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Machine context of a coroutine and the primitive to switch between two
+ * contexts. The backend is chosen at build time:
+ *
+ *     -DCORO_BACKEND_UCONTEXT - portable getcontext/makecontext/swapcontext.
+ *
+ * Otherwise a hand-written assembly switch is used on x86-64 and aarch64. On
+ * other architectures the ucontext backend is selected automatically.
+ *
+ * The assembly backend saves only the callee-saved registers (plus the FPU
+ * control words on x86-64) and never enters the kernel, so a switch costs a
+ * few nanoseconds, while swapcontext makes a sigprocmask syscall each time.
+ */
+
+#if !defined(CORO_BACKEND_UCONTEXT) && !defined(__x86_64__) && \
+	!defined(__aarch64__)
+#define CORO_BACKEND_UCONTEXT
+#endif
+
+#ifdef CORO_BACKEND_UCONTEXT
+
+#include <ucontext.h>
+
+struct coro_ctx {
+	ucontext_t uc;
+};
+
+#else
+
+struct coro_ctx {
+	/** Saved stack pointer. The registers are stored on that stack. */
+	void *sp;
+};
+
+#endif
+
+/**
+ * Prepare @a ctx so that the first switch into it calls @a entry on the
+ * given stack. @a entry must never return.
+ */
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	      void (*entry)(void));
+
+/**
+ * Save the current context into @a from and continue from @a to. Returns
+ * when somebody switches back to @a from.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, const struct coro_ctx *to);
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdbool.h>
+#include "libcoro.h"
+#include "coro_ctx.h"
+#include "coro_stack.h"
+
+/**
+ * Internals of libcoro shared between its modules: the coroutine structure
+ * and the primitives to take a coroutine out of the run-queue and to put it
+ * back. They are not a part of the public API.
+ */
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+/** Arena of a coroutine, see coro_arena_alloc(). */
+struct coro_arena {
+	/** The newest chunk, the others are linked from it. */
+	struct coro_arena_chunk *top;
+	/** Bytes allocated, the position for coro_arena_truncate(). */
+	size_t used;
+};
+
+/** Main coroutine structure, its context. */
+struct coro {
+	/** A value, returned by func. */
+	long long ret;
+	/** Stack, used by the coroutine. Taken from the stack pool. */
+	struct coro_stack stack;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/** True, if the coroutine has finished. */
+	bool is_finished;
+	/** True, if it is out of the run-queue until coro_wakeup(). */
+	bool is_parked;
+	/**
+	 * True, if it is for coro_join() instead of coro_sched_wait(),
+	 * and the coroutine parked in coro_join() until it finishes.
+	 */
+	bool is_joinable;
+	struct coro *joiner;
+	long long switch_count;
+	/** Profile, collected when enabled by coro_stats_enable(). */
+	struct coro_stats stats;
+	/** When the current slice has started, or when it was suspended. */
+	uint64_t resumed_at;
+	uint64_t resumed_cpu;
+	uint64_t suspended_at;
+	/**
+	 * Relative deadline of coro_set_deadline(), 0 if none, and
+	 * when the coroutine was last suspended. Used by the EDF pick.
+	 */
+	uint64_t deadline_ns;
+	uint64_t queued_at;
+	/**
+	 * Of coro_set_quantum(): when the current slice ends, when the
+	 * clock was read last, and how many calls of coro_maybe_yield()
+	 * there are between the reads.
+	 */
+	uint64_t quantum_end;
+	uint64_t quantum_checked_at;
+	unsigned quantum_every;
+	/** Memory of coro_arena_alloc(), freed in coro_delete(). */
+	struct coro_arena arena;
+	/** Links in the coroutine list, used by scheduler. */
+	struct coro *next, *prev;
+};
+
+/**
+ * True, if the current context is a coroutine which can be parked, and not
+ * the scheduler itself.
+ */
+bool
+coro_can_park(void);
+
+/**
+ * Remove the current coroutine from the run-queue and switch to the next
+ * one. Returns when somebody calls coro_wakeup() on it.
+ */
+void
+coro_park(void);
+
+/**
+ * Put a parked coroutine to the end of the run-queue. Does nothing, if it
+ * is not parked.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * The M:N mode on the threads of a pool, see coro_sched_init_pool(). It is
+ * implemented in coro_pool.c, which is only linked together with the pool,
+ * so the rest of libcoro calls it through these. NULL in the other modes.
+ */
+struct coro_pool_hooks {
+	/** Have @a c, a new or a yielded coroutine, run by the pool. */
+	void (*schedule)(struct coro *c);
+	/**
+	 * Switch out the current coroutine until @a fd has @a events.
+	 * Returns -1 and sets errno as coro_io_wait_fd() does.
+	 */
+	int (*wait_fd)(int fd, uint32_t events);
+	/** Switch out the current coroutine for @a seconds. */
+	void (*sleep)(double seconds);
+};
+
+extern const struct coro_pool_hooks *coro_pool_hooks;
+
+/**
+ * Run @a c in the current thread until it yields or finishes, switching
+ * from the context @a sched. The context of @a c is completely saved once
+ * this returns, so only then it can be given to another thread.
+ */
+void
+coro_mt_run(struct coro *sched, struct coro *c);
+
+/** Hand a coroutine just finished in the M:N mode to coro_sched_wait(). */
+void
+coro_mt_finish(struct coro *c);
+
+/**
+ * True, if the current context is a coroutine of the M:N mode on a pool,
+ * which can be switched out to wait.
+ */
+bool
+coro_mt_can_park(void);
+
+/** Reactor hooks for the scheduler, implemented in coro_io.c. */
+
+/** True, if some coroutines are parked on I/O or sleep. */
+bool
+coro_io_has_waiters(void);
+
+/**
+ * Wake up the coroutines whose I/O is ready or whose sleep is over. If
+ * @a block is true, wait until at least one of them can be woken up.
+ */
+void
+coro_io_poll(bool block);
+
+/** Free the reactor resources. They are created again when needed. */
+void
+coro_io_destroy(void);
+
+/** Free all the memory of the arena. */
+void
+coro_arena_destroy(struct coro_arena *a);
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "coro_internal.h"
+
+/**
+ * I/O reactor of libcoro. A coroutine which would block on an fd is parked
+ * and registered in epoll, the scheduler polls it between the rounds of the
+ * run-queue. Regular files are always "ready" for epoll (in fact it refuses
+ * them), so their reads and writes are handed to a helper thread, which
+ * signals the completions through an eventfd registered in the same epoll.
+ */
+
+enum {
+	/** How many events are taken from epoll at once. */
+	CORO_IO_EVENTS = 64,
+};
+
+/**
+ * A read or a write of a regular file, performed by the helper thread.
+ * Lives on the stack of the parked coroutine.
+ */
+struct coro_file_job {
+	struct coro *c;
+	bool is_write;
+	int fd;
+	void *buf;
+	size_t size;
+	ssize_t res;
+	int err;
+	struct coro_file_job *next;
+};
+
+/** A coroutine parked in coro_sleep(). */
+struct coro_sleeper {
+	/** CLOCK_MONOTONIC time to wake up at, in nanoseconds. */
+	uint64_t deadline;
+	struct coro *c;
+};
+
+/** Epoll instance. Created on the first wait. */
+static int coro_io_epfd = -1;
+/** How many coroutines are parked on epoll. */
+static size_t coro_io_fd_waiting = 0;
+
+/** Binary min-heap of the sleeping coroutines by the deadline. */
+static struct coro_sleeper *coro_sleepers = NULL;
+static size_t coro_sleepers_count = 0;
+static size_t coro_sleepers_capacity = 0;
+
+/** Helper thread for the regular files. Started on the first job. */
+static struct {
+	pthread_t thread;
+	bool is_started;
+	bool is_stopping;
+	/** Protects the queues and is_stopping. */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/** Jobs to do, FIFO. */
+	struct coro_file_job *todo_head, *todo_tail;
+	/** Completed jobs, not yet seen by the scheduler. */
+	struct coro_file_job *done;
+	/** Written by the thread when @a done becomes not empty. */
+	int eventfd;
+	/** Jobs submitted and not yet returned to their coroutines. */
+	size_t pending;
+} coro_io_helper = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.eventfd = -1,
+};
+
+static uint64_t
+coro_io_now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		handle_error();
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+coro_io_epoll(void)
+{
+	if (coro_io_epfd < 0) {
+		coro_io_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (coro_io_epfd < 0)
+			handle_error();
+	}
+	return coro_io_epfd;
+}
+
+/**
+ * Park the current coroutine until @a fd has @a events. Returns -1 and
+ * sets errno, if the fd can not be waited for with epoll: EPERM for
+ * regular files, EEXIST if another coroutine waits for the same fd.
+ */
+static int
+coro_io_wait_fd(int fd, uint32_t events)
+{
+	int epfd = coro_io_epoll();
+	struct epoll_event ev;
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = coro_this();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return -1;
+	++coro_io_fd_waiting;
+	coro_park();
+	--coro_io_fd_waiting;
+	(void)epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	return 0;
+}
+
+static void *
+coro_io_helper_f(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&coro_io_helper.mutex);
+	while (true) {
+		struct coro_file_job *job = coro_io_helper.todo_head;
+		if (job == NULL) {
+			if (coro_io_helper.is_stopping)
+				break;
+			pthread_cond_wait(&coro_io_helper.cond,
+					  &coro_io_helper.mutex);
+			continue;
+		}
+		coro_io_helper.todo_head = job->next;
+		if (coro_io_helper.todo_head == NULL)
+			coro_io_helper.todo_tail = NULL;
+		pthread_mutex_unlock(&coro_io_helper.mutex);
+
+		do {
+			if (job->is_write)
+				job->res = write(job->fd, job->buf, job->size);
+			else
+				job->res = read(job->fd, job->buf, job->size);
+		} while (job->res < 0 && errno == EINTR);
+		job->err = errno;
+
+		pthread_mutex_lock(&coro_io_helper.mutex);
+		bool was_empty = coro_io_helper.done == NULL;
+		job->next = coro_io_helper.done;
+		coro_io_helper.done = job;
+		if (was_empty) {
+			uint64_t one = 1;
+			/* Can only fail on overflow, then it is readable. */
+			(void)write(coro_io_helper.eventfd, &one, sizeof(one));
+		}
+	}
+	pthread_mutex_unlock(&coro_io_helper.mutex);
+	return NULL;
+}
+
+static void
+coro_io_helper_start(void)
+{
+	coro_io_helper.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (coro_io_helper.eventfd < 0)
+		handle_error();
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	/* NULL tells the eventfd from the parked coroutines. */
+	ev.data.ptr = NULL;
+	if (epoll_ctl(coro_io_epoll(), EPOLL_CTL_ADD, coro_io_helper.eventfd,
+		      &ev) != 0)
+		handle_error();
+	coro_io_helper.is_stopping = false;
+	int rc = pthread_create(&coro_io_helper.thread, NULL,
+				coro_io_helper_f, NULL);
+	if (rc != 0) {
+		errno = rc;
+		handle_error();
+	}
+	coro_io_helper.is_started = true;
+}
+
+/** Do a regular file read or write in the helper thread. */
+static ssize_t
+coro_io_file(int fd, void *buf, size_t size, bool is_write)
+{
+	if (!coro_io_helper.is_started)
+		coro_io_helper_start();
+	struct coro_file_job job;
+	job.c = coro_this();
+	job.is_write = is_write;
+	job.fd = fd;
+	job.buf = buf;
+	job.size = size;
+	job.next = NULL;
+
+	pthread_mutex_lock(&coro_io_helper.mutex);
+	if (coro_io_helper.todo_tail != NULL)
+		coro_io_helper.todo_tail->next = &job;
+	else
+		coro_io_helper.todo_head = &job;
+	coro_io_helper.todo_tail = &job;
+	pthread_cond_signal(&coro_io_helper.cond);
+	pthread_mutex_unlock(&coro_io_helper.mutex);
+
+	++coro_io_helper.pending;
+	coro_park();
+	--coro_io_helper.pending;
+	errno = job.err;
+	return job.res;
+}
+
+static ssize_t
+coro_io_do(int fd, void *buf, size_t size, bool is_write)
+{
+	ssize_t rc;
+	do {
+		if (is_write)
+			rc = write(fd, buf, size);
+		else
+			rc = read(fd, buf, size);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+
+static ssize_t
+coro_io(int fd, void *buf, size_t size, bool is_write)
+{
+	/*
+	 * On a pool the workers are the pool's: the coroutine is switched
+	 * out to wait, and a regular file is just read in place.
+	 */
+	bool is_pool = coro_mt_can_park();
+	if (!coro_can_park() && !is_pool)
+		return coro_io_do(fd, buf, size, is_write);
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -1;
+	bool is_nonblock = (flags & O_NONBLOCK) != 0;
+	uint32_t events = is_write ? EPOLLOUT : EPOLLIN;
+	while (true) {
+		if (is_nonblock) {
+			ssize_t rc = coro_io_do(fd, buf, size, is_write);
+			if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return rc;
+		}
+		int rc = is_pool ? coro_pool_hooks->wait_fd(fd, events) :
+			 coro_io_wait_fd(fd, events);
+		if (rc != 0) {
+			if (errno == EPERM && is_pool)
+				return coro_io_do(fd, buf, size, is_write);
+			if (errno == EPERM)
+				return coro_io_file(fd, buf, size, is_write);
+			if (errno != EEXIST)
+				return -1;
+			/*
+			 * Somebody else is parked on this fd. Rare, so just
+			 * poll it once per round of the run-queue.
+			 */
+			struct pollfd pfd = {.fd = fd, .events = events};
+			while (poll(&pfd, 1, 0) == 0)
+				coro_yield();
+		}
+		/* Ready, a blocking fd won't block now. */
+		if (!is_nonblock)
+			return coro_io_do(fd, buf, size, is_write);
+	}
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+	return coro_io(fd, buf, size, false);
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+	return coro_io(fd, (void *)buf, size, true);
+}
+
+static bool
+coro_sleeper_less(size_t a, size_t b)
+{
+	return coro_sleepers[a].deadline < coro_sleepers[b].deadline;
+}
+
+static void
+coro_sleeper_swap(size_t a, size_t b)
+{
+	struct coro_sleeper tmp = coro_sleepers[a];
+	coro_sleepers[a] = coro_sleepers[b];
+	coro_sleepers[b] = tmp;
+}
+
+static void
+coro_sleepers_push(uint64_t deadline, struct coro *c)
+{
+	if (coro_sleepers_count == coro_sleepers_capacity) {
+		size_t cap = coro_sleepers_capacity * 2 + 8;
+		struct coro_sleeper *s = realloc(coro_sleepers,
+						 cap * sizeof(*s));
+		if (s == NULL)
+			handle_error();
+		coro_sleepers = s;
+		coro_sleepers_capacity = cap;
+	}
+	size_t i = coro_sleepers_count++;
+	coro_sleepers[i].deadline = deadline;
+	coro_sleepers[i].c = c;
+	while (i > 0 && coro_sleeper_less(i, (i - 1) / 2)) {
+		coro_sleeper_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void
+coro_sleepers_pop(void)
+{
+	coro_sleepers[0] = coro_sleepers[--coro_sleepers_count];
+	size_t i = 0;
+	while (true) {
+		size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+		if (l < coro_sleepers_count && coro_sleeper_less(l, min))
+			min = l;
+		if (r < coro_sleepers_count && coro_sleeper_less(r, min))
+			min = r;
+		if (min == i)
+			break;
+		coro_sleeper_swap(i, min);
+		i = min;
+	}
+}
+
+void
+coro_sleep(double seconds)
+{
+	if (seconds < 0)
+		seconds = 0;
+	uint64_t ns = seconds * 1e9;
+	if (coro_mt_can_park()) {
+		coro_pool_hooks->sleep(seconds);
+		return;
+	}
+	if (!coro_can_park()) {
+		struct timespec ts = {
+			.tv_sec = ns / 1000000000,
+			.tv_nsec = ns % 1000000000,
+		};
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+		return;
+	}
+	coro_sleepers_push(coro_io_now() + ns, coro_this());
+	coro_park();
+}
+
+bool
+coro_io_has_waiters(void)
+{
+	return coro_io_fd_waiting > 0 || coro_io_helper.pending > 0 ||
+	       coro_sleepers_count > 0;
+}
+
+/** Wake up the sleepers whose time has come. Returns how many. */
+static size_t
+coro_io_wake_sleepers(uint64_t now)
+{
+	size_t count = 0;
+	while (coro_sleepers_count > 0 && coro_sleepers[0].deadline <= now) {
+		coro_wakeup(coro_sleepers[0].c);
+		coro_sleepers_pop();
+		++count;
+	}
+	return count;
+}
+
+/** Return the completed file jobs to their coroutines. */
+static void
+coro_io_wake_files(void)
+{
+	uint64_t cnt;
+	(void)read(coro_io_helper.eventfd, &cnt, sizeof(cnt));
+	pthread_mutex_lock(&coro_io_helper.mutex);
+	struct coro_file_job *job = coro_io_helper.done;
+	coro_io_helper.done = NULL;
+	pthread_mutex_unlock(&coro_io_helper.mutex);
+	while (job != NULL) {
+		/* The job dies as soon as its coroutine runs. */
+		struct coro_file_job *next = job->next;
+		coro_wakeup(job->c);
+		job = next;
+	}
+}
+
+void
+coro_io_poll(bool block)
+{
+	int timeout = 0;
+	if (coro_io_wake_sleepers(coro_io_now()) == 0 && block) {
+		timeout = -1;
+		if (coro_sleepers_count > 0) {
+			/*
+			 * Read again, so the deadline may have passed since
+			 * the wakeups. Round up, not to wake up before it.
+			 */
+			uint64_t now = coro_io_now();
+			uint64_t deadline = coro_sleepers[0].deadline;
+			if (deadline <= now) {
+				timeout = 0;
+			} else {
+				uint64_t ms = (deadline - now + 999999) / 1000000;
+				timeout = ms < INT_MAX ? (int)ms : INT_MAX;
+			}
+		}
+	}
+	if (coro_io_epfd < 0) {
+		/* Only the sleepers, nothing to poll. */
+		if (timeout > 0)
+			coro_sleep(timeout / 1000.);
+	} else if (coro_io_fd_waiting > 0 || coro_io_helper.pending > 0 ||
+		   timeout > 0) {
+		struct epoll_event evs[CORO_IO_EVENTS];
+		int n = epoll_wait(coro_io_epfd, evs, CORO_IO_EVENTS, timeout);
+		if (n < 0 && errno != EINTR)
+			handle_error();
+		for (int i = 0; i < n; ++i) {
+			if (evs[i].data.ptr == NULL)
+				coro_io_wake_files();
+			else
+				coro_wakeup(evs[i].data.ptr);
+		}
+	}
+	if (timeout != 0)
+		coro_io_wake_sleepers(coro_io_now());
+}
+
+void
+coro_io_destroy(void)
+{
+	if (coro_io_helper.is_started) {
+		pthread_mutex_lock(&coro_io_helper.mutex);
+		coro_io_helper.is_stopping = true;
+		pthread_cond_signal(&coro_io_helper.cond);
+		pthread_mutex_unlock(&coro_io_helper.mutex);
+		pthread_join(coro_io_helper.thread, NULL);
+		close(coro_io_helper.eventfd);
+		coro_io_helper.eventfd = -1;
+		coro_io_helper.is_started = false;
+	}
+	if (coro_io_epfd >= 0) {
+		close(coro_io_epfd);
+		coro_io_epfd = -1;
+	}
+	free(coro_sleepers);
+	coro_sleepers = NULL;
+	coro_sleepers_count = coro_sleepers_capacity = 0;
+}
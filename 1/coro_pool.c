@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <float.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "coro_internal.h"
+#include "thread_pool.h"
+
+/**
+ * The M:N mode of libcoro on a thread pool, see coro_sched_init_pool().
+ * Each time a coroutine is to run, it is pushed to the pool as a new
+ * detached task, which switches into it and returns when it yields. Only
+ * then its context is saved, so only then the task pushes it again, or
+ * registers what it waits for: the pool itself queues it after a sleep,
+ * and a poller thread after an fd is ready.
+ */
+
+enum {
+	/** How many events the poller takes from epoll at once. */
+	CORO_POOL_EVENTS = 64,
+};
+
+/** What the current coroutine switches out to wait for. */
+struct coro_pool_wait {
+	/** The fd and its events, or a sleep if @a fd is -1. */
+	int fd;
+	uint32_t events;
+	double seconds;
+	/** -1 with @a err if the fd can not be waited for. */
+	int rc;
+	int err;
+};
+
+static struct thread_pool *coro_pool;
+/**
+ * Set by a coroutine right before it switches out to wait, and taken by
+ * the task which ran it. Lives on the stack of the coroutine.
+ */
+static __thread struct coro_pool_wait *coro_pool_wait_this;
+
+/** Epoll of the coroutines waiting for their fds, see coro_pool_poller_f(). */
+static int coro_pool_epfd = -1;
+static pthread_once_t coro_pool_poller_once = PTHREAD_ONCE_INIT;
+
+static void
+coro_pool_schedule(struct coro *c);
+
+/** Push @a task after @a delay and detach it. Waits for room in a full pool. */
+static void
+coro_pool_push(struct thread_task *task, double delay)
+{
+	int err = delay > 0 ? thread_pool_push_after(coro_pool, task, delay) :
+		  thread_pool_push_task_timed(coro_pool, task, DBL_MAX);
+	if (err != 0) {
+		printf("Error: a coroutine can not be pushed to the pool: %d\n",
+		       err);
+		exit(-1);
+	}
+	(void)thread_task_detach(task);
+}
+
+/** Run the coroutine @a arg until it yields, and have it run again. */
+static void *
+coro_pool_task_f(void *arg)
+{
+	struct coro *c = arg;
+	/* Only the context is used, see coro_is_sched(). */
+	struct coro sched;
+	sched.func = NULL;
+	coro_pool_wait_this = NULL;
+	coro_mt_run(&sched, c);
+	struct coro_pool_wait *wait = coro_pool_wait_this;
+	coro_pool_wait_this = NULL;
+	if (c->is_finished) {
+		coro_mt_finish(c);
+	} else if (wait == NULL) {
+		coro_pool_schedule(c);
+	} else if (wait->fd < 0) {
+		struct thread_task *task;
+		(void)thread_task_new(&task, coro_pool_task_f, c);
+		coro_pool_push(task, wait->seconds);
+	} else {
+		struct epoll_event ev;
+		ev.events = wait->events | EPOLLONESHOT;
+		ev.data.ptr = c;
+		/* Once it is added, the coroutine may run in another thread. */
+		if (epoll_ctl(coro_pool_epfd, EPOLL_CTL_ADD, wait->fd, &ev) != 0) {
+			wait->rc = -1;
+			wait->err = errno;
+			coro_pool_schedule(c);
+		}
+	}
+	return NULL;
+}
+
+static void
+coro_pool_schedule(struct coro *c)
+{
+	struct thread_task *task;
+	(void)thread_task_new(&task, coro_pool_task_f, c);
+	coro_pool_push(task, 0);
+}
+
+/** Push the coroutines whose fds are ready. Runs for ever. */
+static void *
+coro_pool_poller_f(void *arg)
+{
+	(void)arg;
+	while (true) {
+		struct epoll_event evs[CORO_POOL_EVENTS];
+		int n = epoll_wait(coro_pool_epfd, evs, CORO_POOL_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			handle_error();
+		for (int i = 0; i < n; ++i)
+			coro_pool_schedule(evs[i].data.ptr);
+	}
+	return NULL;
+}
+
+static void
+coro_pool_poller_start(void)
+{
+	coro_pool_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (coro_pool_epfd < 0)
+		handle_error();
+	pthread_t thread;
+	int rc = pthread_create(&thread, NULL, coro_pool_poller_f, NULL);
+	if (rc != 0) {
+		errno = rc;
+		handle_error();
+	}
+	(void)pthread_detach(thread);
+}
+
+/** Switch out the current coroutine with @a wait for its task to do. */
+static void
+coro_pool_switch_out(struct coro_pool_wait *wait)
+{
+	coro_pool_wait_this = wait;
+	coro_yield();
+}
+
+static int
+coro_pool_wait_fd(int fd, uint32_t events)
+{
+	pthread_once(&coro_pool_poller_once, coro_pool_poller_start);
+	struct coro_pool_wait wait = {
+		.fd = fd, .events = events, .seconds = 0, .rc = 0, .err = 0,
+	};
+	coro_pool_switch_out(&wait);
+	if (wait.rc != 0) {
+		errno = wait.err;
+		return -1;
+	}
+	(void)epoll_ctl(coro_pool_epfd, EPOLL_CTL_DEL, fd, NULL);
+	return 0;
+}
+
+static void
+coro_pool_sleep(double seconds)
+{
+	struct coro_pool_wait wait = {
+		.fd = -1, .events = 0, .seconds = seconds, .rc = 0, .err = 0,
+	};
+	coro_pool_switch_out(&wait);
+}
+
+static const struct coro_pool_hooks coro_pool_hooks_impl = {
+	.schedule = coro_pool_schedule,
+	.wait_fd = coro_pool_wait_fd,
+	.sleep = coro_pool_sleep,
+};
+
+void
+coro_sched_init_pool(struct thread_pool *pool)
+{
+	coro_sched_init();
+	coro_pool = pool;
+	coro_pool_hooks = &coro_pool_hooks_impl;
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "libcoro.h"
+#include "coro_stack.h"
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+enum {
+	/**
+	 * How many free guarded stacks of one size are kept in the pool.
+	 * The rest are unmapped right away.
+	 */
+	CORO_STACK_POOL_MAX = 1024,
+	/** How many unguarded stacks are carved out of one chunk. */
+	CORO_STACK_CHUNK = 64,
+};
+
+/** A free stack. The link is stored in the stack memory itself. */
+struct coro_stack_free {
+	struct coro_stack_free *next;
+	bool is_guarded;
+};
+
+/** A chunk the unguarded stacks are carved out of. */
+struct coro_stack_chunk {
+	char *base;
+	struct coro_stack_chunk *next;
+};
+
+/** Free stacks of one size. */
+struct coro_stack_bucket {
+	/** Usable size of each stack in the bucket. */
+	size_t size;
+	/** Number of guarded stacks in @a head. */
+	size_t guarded_count;
+	struct coro_stack_free *head;
+	/** Not yet used part of the last unguarded chunk. */
+	char *chunk_pos;
+	size_t chunk_left;
+	/** All the chunks, to unmap them with the pool. */
+	struct coro_stack_chunk *chunks;
+	struct coro_stack_bucket *next;
+};
+
+/** Buckets of the free stacks. There are only a few sizes normally. */
+static struct coro_stack_bucket *coro_stack_buckets = NULL;
+static struct coro_stack_stats coro_stack_stat = {0};
+/** How many guarded stacks may be mapped at once. */
+static size_t coro_stack_guarded_max = 0;
+static size_t coro_stack_guarded_count = 0;
+static size_t coro_page_size = 0;
+/** The pool is shared by the scheduler threads, see coro_sched_init_threads(). */
+static pthread_mutex_t coro_stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+coro_stack_init(void)
+{
+	coro_page_size = (size_t)sysconf(_SC_PAGESIZE);
+	/* The default of the kernel, if the real one can't be read. */
+	long max_map_count = 65530;
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%ld", &max_map_count) != 1)
+			max_map_count = 65530;
+		fclose(f);
+	}
+	/* Half of the mappings, two mappings per guarded stack. */
+	coro_stack_guarded_max = max_map_count / 4;
+}
+
+static struct coro_stack_bucket *
+coro_stack_bucket_find(size_t size)
+{
+	struct coro_stack_bucket *b = coro_stack_buckets;
+	for (; b != NULL; b = b->next) {
+		if (b->size == size)
+			return b;
+	}
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		handle_error();
+	b->size = size;
+	b->next = coro_stack_buckets;
+	coro_stack_buckets = b;
+	return b;
+}
+
+static void
+coro_stack_account_map(size_t bytes)
+{
+	coro_stack_stat.mapped_bytes += bytes;
+	if (coro_stack_stat.mapped_bytes > coro_stack_stat.mapped_bytes_max)
+		coro_stack_stat.mapped_bytes_max = coro_stack_stat.mapped_bytes;
+}
+
+static void *
+coro_stack_map_guarded(size_t size)
+{
+	size_t page = coro_page_size;
+	char *base = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	/* Stacks grow down, so the guard is the lowest page. */
+	if (mprotect(base, page, PROT_NONE) != 0) {
+		(void)munmap(base, size + page);
+		return NULL;
+	}
+	++coro_stack_guarded_count;
+	++coro_stack_stat.mapped_count;
+	coro_stack_account_map(size + page);
+	return base + page;
+}
+
+static void *
+coro_stack_carve(struct coro_stack_bucket *b)
+{
+	if (b->chunk_left == 0) {
+		size_t bytes = b->size * CORO_STACK_CHUNK;
+		char *chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+				   -1, 0);
+		struct coro_stack_chunk *c = malloc(sizeof(*c));
+		if (chunk == MAP_FAILED || c == NULL)
+			handle_error();
+		c->base = chunk;
+		c->next = b->chunks;
+		b->chunks = c;
+		b->chunk_pos = chunk;
+		b->chunk_left = CORO_STACK_CHUNK;
+		++coro_stack_stat.mapped_count;
+		coro_stack_account_map(bytes);
+	}
+	void *stack = b->chunk_pos;
+	b->chunk_pos += b->size;
+	--b->chunk_left;
+	++coro_stack_stat.unguarded_count;
+	return stack;
+}
+
+void
+coro_stack_get(struct coro_stack *stack, size_t size)
+{
+	pthread_mutex_lock(&coro_stack_mutex);
+	if (coro_page_size == 0)
+		coro_stack_init();
+	size_t page = coro_page_size;
+	size = (size + page - 1) & ~(page - 1);
+	if (size == 0)
+		size = page;
+	stack->size = size;
+
+	struct coro_stack_bucket *b = coro_stack_bucket_find(size);
+	if (b->head != NULL) {
+		struct coro_stack_free *f = b->head;
+		b->head = f->next;
+		stack->is_guarded = f->is_guarded;
+		stack->base = f;
+		if (f->is_guarded)
+			--b->guarded_count;
+		--coro_stack_stat.cached;
+		++coro_stack_stat.reused_count;
+	} else {
+		stack->base = NULL;
+		if (coro_stack_guarded_count < coro_stack_guarded_max)
+			stack->base = coro_stack_map_guarded(size);
+		stack->is_guarded = stack->base != NULL;
+		if (stack->base == NULL)
+			stack->base = coro_stack_carve(b);
+	}
+	if (++coro_stack_stat.used > coro_stack_stat.used_max)
+		coro_stack_stat.used_max = coro_stack_stat.used;
+	pthread_mutex_unlock(&coro_stack_mutex);
+}
+
+void
+coro_stack_put(const struct coro_stack *stack)
+{
+	pthread_mutex_lock(&coro_stack_mutex);
+	--coro_stack_stat.used;
+	struct coro_stack_bucket *b = coro_stack_bucket_find(stack->size);
+	/*
+	 * Unguarded stacks are parts of bigger chunks and can't be unmapped
+	 * one by one, so they always stay in the pool.
+	 */
+	if (!stack->is_guarded || b->guarded_count < CORO_STACK_POOL_MAX) {
+		struct coro_stack_free *f = stack->base;
+		f->next = b->head;
+		f->is_guarded = stack->is_guarded;
+		b->head = f;
+		if (stack->is_guarded)
+			++b->guarded_count;
+		++coro_stack_stat.cached;
+		pthread_mutex_unlock(&coro_stack_mutex);
+		return;
+	}
+	size_t page = coro_page_size;
+	if (munmap((char *)stack->base - page, stack->size + page) != 0)
+		handle_error();
+	--coro_stack_guarded_count;
+	coro_stack_stat.mapped_bytes -= stack->size + page;
+	pthread_mutex_unlock(&coro_stack_mutex);
+}
+
+void
+coro_stack_pool_destroy(void)
+{
+	pthread_mutex_lock(&coro_stack_mutex);
+	if (coro_stack_stat.used > 0) {
+		pthread_mutex_unlock(&coro_stack_mutex);
+		return;
+	}
+	size_t page = coro_page_size;
+	struct coro_stack_bucket *b = coro_stack_buckets;
+	while (b != NULL) {
+		/* The unguarded ones go with their chunks. */
+		for (struct coro_stack_free *f = b->head; f != NULL;) {
+			struct coro_stack_free *next = f->next;
+			if (f->is_guarded) {
+				if (munmap((char *)f - page, b->size + page) != 0)
+					handle_error();
+				--coro_stack_guarded_count;
+				coro_stack_stat.mapped_bytes -= b->size + page;
+			}
+			f = next;
+		}
+		for (struct coro_stack_chunk *c = b->chunks; c != NULL;) {
+			struct coro_stack_chunk *next = c->next;
+			size_t bytes = b->size * CORO_STACK_CHUNK;
+			if (munmap(c->base, bytes) != 0)
+				handle_error();
+			coro_stack_stat.mapped_bytes -= bytes;
+			free(c);
+			c = next;
+		}
+		struct coro_stack_bucket *next = b->next;
+		free(b);
+		b = next;
+	}
+	coro_stack_buckets = NULL;
+	coro_stack_stat.cached = 0;
+	pthread_mutex_unlock(&coro_stack_mutex);
+}
+
+void
+coro_stack_stats(struct coro_stack_stats *stats)
+{
+	pthread_mutex_lock(&coro_stack_mutex);
+	*stats = coro_stack_stat;
+	pthread_mutex_unlock(&coro_stack_mutex);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Pool of coroutine stacks. Each stack is a separate anonymous mapping with
+ * a PROT_NONE guard page below it. Stacks returned to the pool are kept for
+ * reuse by the coroutines created later, grouped by their size.
+ *
+ * Every guarded stack costs two kernel mappings, and their number is limited
+ * by vm.max_map_count. Once the guarded stacks take half of that limit, the
+ * new stacks are carved out of big unguarded chunks instead.
+ */
+
+struct coro_stack {
+	/** Lowest usable address. */
+	void *base;
+	/** Usable size, a multiple of the page size. */
+	size_t size;
+	/** True, if it is a separate mapping with a guard page. */
+	bool is_guarded;
+};
+
+/**
+ * Take a stack of at least @a size usable bytes, either from the pool or
+ * mapping a new one.
+ */
+void
+coro_stack_get(struct coro_stack *stack, size_t size);
+
+/** Return a stack obtained from coro_stack_get(). */
+void
+coro_stack_put(const struct coro_stack *stack);
+
+/**
+ * Unmap the stacks kept in the pool and free the pool itself. Does
+ * nothing while some stack is still taken by a coroutine. The pool is
+ * filled anew by the next coro_stack_get().
+ */
+void
+coro_stack_pool_destroy(void);
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "coro_internal.h"
+
+/**
+ * Wait groups of libcoro. The coroutines waiting for the counter to get
+ * to 0 are parked in a list of the group, and are all put back to the
+ * run-queue when it does.
+ */
+
+/** A coroutine parked in a wait group. Lives on its stack. */
+struct coro_wg_waiter {
+	struct coro *c;
+	/** False once it is taken out of the list to be woken up. */
+	bool is_queued;
+	struct coro_wg_waiter *next;
+};
+
+struct coro_wg {
+	long count;
+	struct coro_wg_waiter *waiters;
+};
+
+struct coro_wg *
+coro_wg_new(void)
+{
+	struct coro_wg *wg = calloc(1, sizeof(*wg));
+	if (wg == NULL)
+		handle_error();
+	return wg;
+}
+
+void
+coro_wg_delete(struct coro_wg *wg)
+{
+	free(wg);
+}
+
+void
+coro_wg_add(struct coro_wg *wg, long count)
+{
+	wg->count += count;
+	if (wg->count < 0) {
+		printf("Critical error - wait group counter below 0!\n");
+		exit(-1);
+	}
+	if (wg->count > 0)
+		return;
+	struct coro_wg_waiter *w = wg->waiters;
+	wg->waiters = NULL;
+	while (w != NULL) {
+		struct coro_wg_waiter *next = w->next;
+		w->is_queued = false;
+		coro_wakeup(w->c);
+		w = next;
+	}
+}
+
+void
+coro_wg_done(struct coro_wg *wg)
+{
+	coro_wg_add(wg, -1);
+}
+
+int
+coro_wg_wait(struct coro_wg *wg)
+{
+	if (wg->count == 0)
+		return 0;
+	if (!coro_can_park()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	/*
+	 * The counter may grow again before this one runs: then it
+	 * waits for the next 0. Woken up by coro_resume() on the way, it
+	 * is still in the list.
+	 */
+	struct coro_wg_waiter self = {.c = coro_this()};
+	while (wg->count > 0) {
+		if (!self.is_queued) {
+			self.next = wg->waiters;
+			wg->waiters = &self;
+			self.is_queued = true;
+		}
+		coro_park();
+	}
+	return 0;
+}
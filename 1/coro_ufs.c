@@ -0,0 +1,63 @@
+#include "coro_ufs.h"
+#include "libcoro.h"
+#include "userfs.h"
+
+/**
+ * Do a read or a write of @a size bytes as the ufs calls of at most
+ * CORO_UFS_CHUNK, at the position of the descriptor if @a offset is -1.
+ */
+static ssize_t
+coro_ufs_io(int fd, char *buf, size_t size, off_t offset, bool is_write)
+{
+	size_t done = 0;
+	do {
+		size_t len = size - done;
+		if (len > CORO_UFS_CHUNK)
+			len = CORO_UFS_CHUNK;
+		if (done > 0)
+			coro_maybe_yield();
+		ssize_t rc;
+		if (offset < 0 && is_write)
+			rc = ufs_write(fd, buf + done, len);
+		else if (offset < 0)
+			rc = ufs_read(fd, buf + done, len);
+		else if (is_write)
+			rc = ufs_pwrite(fd, buf + done, len, offset + done);
+		else
+			rc = ufs_pread(fd, buf + done, len, offset + done);
+		if (rc < 0)
+			return done > 0 ? (ssize_t)done : -1;
+		done += rc;
+		if ((size_t)rc < len)
+			break;
+	} while (done < size);
+	return done;
+}
+
+ssize_t
+coro_ufs_read(int fd, char *buf, size_t size)
+{
+	return coro_ufs_io(fd, buf, size, -1, false);
+}
+
+ssize_t
+coro_ufs_write(int fd, const char *buf, size_t size)
+{
+	return coro_ufs_io(fd, (char *)buf, size, -1, true);
+}
+
+ssize_t
+coro_ufs_pread(int fd, char *buf, size_t size, off_t offset)
+{
+	if (offset < 0)
+		return ufs_pread(fd, buf, size, offset);
+	return coro_ufs_io(fd, buf, size, offset, false);
+}
+
+ssize_t
+coro_ufs_pwrite(int fd, const char *buf, size_t size, off_t offset)
+{
+	if (offset < 0)
+		return ufs_pwrite(fd, buf, size, offset);
+	return coro_ufs_io(fd, (char *)buf, size, offset, true);
+}
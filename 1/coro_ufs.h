@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * The reads and writes of the userfs of the assignment 3 for the
+ * coroutines, linked together with ../3/userfs.c. The fs is in memory,
+ * so a call never waits for a device, but a big one copies for long
+ * and holds the lock of the file all that time: in the M:N mode of
+ * coro_sched_init_pool() the readers of the file on the other workers
+ * block on it, and with one thread nobody else runs meanwhile.
+ *
+ * So these split the call into ufs calls of at most CORO_UFS_CHUNK
+ * bytes and call coro_maybe_yield() between them, with no lock of the
+ * fs held. The coroutine is switched out once its time slice is over,
+ * see coro_set_quantum(), and may continue on another worker. The
+ * errors are those of the ufs calls, ufs_errno() is valid right after
+ * the return as it is not yielded after the last call. Outside the
+ * coroutines, they are the calls of the fs done in pieces.
+ */
+
+enum {
+	/** The most bytes copied by a ufs call between the yields. */
+	CORO_UFS_CHUNK = 64 * 1024,
+};
+
+/**
+ * Same as ufs_read(), yielding between the chunks. Stops at the end
+ * of the file. Returns -1 only if nothing is read, otherwise how much.
+ */
+ssize_t
+coro_ufs_read(int fd, char *buf, size_t size);
+
+/**
+ * Same as ufs_write(), yielding between the chunks. Returns -1 only
+ * if nothing is written, otherwise how much: the other descriptors may
+ * see the file in between the chunks.
+ */
+ssize_t
+coro_ufs_write(int fd, const char *buf, size_t size);
+
+/** Same as coro_ufs_read(), but of ufs_pread() at @a offset. */
+ssize_t
+coro_ufs_pread(int fd, char *buf, size_t size, off_t offset);
+
+/** Same as coro_ufs_write(), but of ufs_pwrite() at @a offset. */
+ssize_t
+coro_ufs_pwrite(int fd, const char *buf, size_t size, off_t offset);
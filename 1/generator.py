@@ -1,5 +1,6 @@
 import random
 import argparse
+import struct
 
 maxint = 1 << 31
 
@@ -7,10 +8,23 @@ parser = argparse.ArgumentParser(description = "Generate random numbers file")
 parser.add_argument('-f', type=str, required=True, help="file name")
 parser.add_argument('-c', type=int, required=True, help='number count')
 parser.add_argument('-m', type=int, default=maxint, help='maximal number')
+parser.add_argument('--binary', action='store_true',
+		    help='write the binary format of "solution --binary": '\
+			 'a header and little-endian int32 numbers')
 args = parser.parse_args()
 random.seed()
 
 
+if args.binary:
+	f = open(args.f, 'wb')
+	f.write(struct.pack('<4sIQ', b'IS32', 1, args.c))
+	# Numbers above the int32 range would not fit.
+	top = min(args.m, maxint - 1)
+	for i in range(0, args.c):
+		f.write(struct.pack('<i', random.randint(0, top)))
+	f.close()
+	exit(0)
+
 f = open(args.f, 'w')
 
 for i in range(0, args.c):
@@ -1,32 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include "libcoro.h"
-
-#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
-
-/** Main coroutine structure, its context. */
-struct coro {
-	/** A value, returned by func. */
-	long long ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/** True, if the coroutine has finished. */
-	bool is_finished;
-	long long switch_count;
-	/** Links in the coroutine list, used by scheduler. */
-	struct coro *next, *prev;
-};
+#include "coro_internal.h"
 
 /**
  * Scheduler is a main coroutine - it catches and returns dead
@@ -38,22 +18,108 @@ static struct coro coro_sched;
  * coroutine finish.
  */
 static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
+/** Which coroutine works at this moment, in this thread. */
+static __thread struct coro *coro_this_ptr = NULL;
+/**
+ * Run-queue: list of all the not finished coroutines, in the
+ * order they are switched to by coro_yield().
+ */
 static struct coro *coro_list = NULL;
+/** Last coroutine in the run-queue. */
+static struct coro *coro_list_tail = NULL;
+/**
+ * Queue of the finished coroutines, not yet returned by
+ * coro_sched_wait(). Linked via `next`.
+ */
+static struct coro *coro_finished_head = NULL;
+static struct coro *coro_finished_tail = NULL;
 /**
  * If a coroutine exits, the pointer to the next one is stored here
  * to designate that it is the next coroutine to switch to from
  * `coro_sched_wait`. Otherwise set to `NULL`.
  */
 static struct coro *coro_saved_next = NULL;
+
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * A worker thread of the M:N mode, see coro_sched_init_threads().
+ * Runs coroutines from its own run-queue, and steals them from the
+ * other workers when it is empty. A coroutine always yields to the
+ * scheduler context of the worker it runs on, and the worker puts it
+ * back to the end of its queue, so the next time the coroutine can
+ * be continued by another thread.
  */
-static sigjmp_buf start_point;
+struct coro_worker {
+	/** Context of the worker loop. */
+	struct coro sched;
+	/** Protects the run-queue. */
+	pthread_mutex_t mutex;
+	struct coro *head, *tail;
+	pthread_t thread;
+};
+
+/** State of the M:N mode. */
+static struct {
+	/** Number of the workers. 0 means the single-threaded mode. */
+	int count;
+	struct coro_worker *workers;
+	/** Protects the finished queue and @a alive. */
+	pthread_mutex_t mutex;
+	/** Signaled for the idle workers when a coroutine is queued. */
+	pthread_cond_t work_cond;
+	/** Signaled for coro_sched_wait() when a coroutine finishes. */
+	pthread_cond_t finished_cond;
+	struct coro *finished_head, *finished_tail;
+	/** Created and not finished coroutines. */
+	size_t alive;
+	/**
+	 * Coroutines in all the run-queues and the number of the
+	 * workers sleeping on @a work_cond. Both are atomic, so a
+	 * queued coroutine is never missed by a worker going to sleep.
+	 */
+	long runnable;
+	long idle;
+	/** Where to queue a coroutine created outside the workers. */
+	unsigned next_worker;
+} coro_mt = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.finished_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/** Worker of this thread. NULL if it is not a worker. */
+static __thread struct coro_worker *coro_worker_this = NULL;
+/**
+ * The context a coroutine of the M:N mode switches out to in this
+ * thread, see coro_mt_run().
+ */
+static __thread struct coro *coro_mt_sched_this = NULL;
+
+const struct coro_pool_hooks *coro_pool_hooks = NULL;
+
+/** True in the M:N mode, on the workers of its own or of a pool. */
+static inline bool
+coro_is_mt(void)
+{
+	return coro_mt.count > 0 || coro_pool_hooks != NULL;
+}
+
+/** Profiling mode, see coro_stats_enable(). */
+static enum {
+	CORO_STATS_OFF,
+	CORO_STATS_COLLECT,
+	CORO_STATS_DUMP,
+} coro_stats_mode = CORO_STATS_OFF;
+
+/** How many not finished coroutines have a deadline. */
+static size_t coro_deadline_count = 0;
+
+/** Of coro_set_quantum(), 0 if off. */
+static uint64_t coro_quantum_ns = 0;
+/** Most calls of coro_maybe_yield() between the clock reads. */
+enum { CORO_QUANTUM_MAX_EVERY = 1 << 16 };
+
+/* 1 for the first call to check, whatever the thread */
+__thread unsigned coro_quantum_left = 1;
 
 /** Add a new coroutine to the beginning of the list. */
 static void
@@ -63,9 +129,24 @@ coro_list_add(struct coro *c)
 	c->prev = NULL;
 	if (coro_list != NULL)
 		coro_list->prev = c;
+	else
+		coro_list_tail = c;
 	coro_list = c;
 }
 
+/** Add a coroutine to the end of the list. */
+static void
+coro_list_append(struct coro *c)
+{
+	c->next = NULL;
+	c->prev = coro_list_tail;
+	if (coro_list_tail != NULL)
+		coro_list_tail->next = c;
+	else
+		coro_list = c;
+	coro_list_tail = c;
+}
+
 /** Remove a coroutine from the list. */
 static void
 coro_list_delete(struct coro *c)
@@ -77,6 +158,35 @@ coro_list_delete(struct coro *c)
 		next->prev = prev;
 	if (prev == NULL)
 		coro_list = next;
+	if (next == NULL)
+		coro_list_tail = prev;
+}
+
+/** Append a coroutine to the queue of the finished ones. */
+static void
+coro_finished_push(struct coro *c)
+{
+	c->next = NULL;
+	c->prev = coro_finished_tail;
+	if (coro_finished_tail != NULL)
+		coro_finished_tail->next = c;
+	else
+		coro_finished_head = c;
+	coro_finished_tail = c;
+}
+
+/** Pop the oldest finished coroutine. NULL, if there are none. */
+static struct coro *
+coro_finished_pop(void)
+{
+	struct coro *c = coro_finished_head;
+	if (c == NULL)
+		return NULL;
+	coro_finished_head = c->next;
+	if (coro_finished_head == NULL)
+		coro_finished_tail = NULL;
+	c->next = c->prev = NULL;
+	return c;
 }
 
 long long
@@ -100,25 +210,267 @@ coro_is_finished(const struct coro *c)
 void
 coro_delete(struct coro *c)
 {
-	free(c->stack);
+	/*
+	 * A suspended one is deleted not finished: its deadline would
+	 * keep coro_yield() on the EDF scan forever.
+	 */
+	coro_set_deadline(c, 0);
+	coro_stack_put(&c->stack);
+	coro_arena_destroy(&c->arena);
 	free(c);
 }
 
+static uint64_t
+coro_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	if (clock_gettime(clock, &ts) != 0)
+		handle_error();
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Scheduler contexts have no function, unlike the coroutines. */
+static inline bool
+coro_is_sched(const struct coro *c)
+{
+	return c->func == NULL;
+}
+
+/**
+ * Account a switch from one context to another: the end of the slice
+ * of @a from and the start of the slice of @a to.
+ */
+static void
+coro_stats_switch(struct coro *from, struct coro *to)
+{
+	if (coro_stats_mode == CORO_STATS_OFF)
+		return;
+	uint64_t now = coro_clock_ns(CLOCK_MONOTONIC);
+	uint64_t cpu = coro_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	if (!coro_is_sched(from)) {
+		struct coro_stats *st = &from->stats;
+		uint64_t slice = now - from->resumed_at;
+		st->run_ns += slice;
+		st->cpu_ns += cpu - from->resumed_cpu;
+		++st->slice_count;
+		if (slice > st->slice_max_ns)
+			st->slice_max_ns = slice;
+		uint64_t us = slice / 1000;
+		int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+		if (bucket >= CORO_SLICE_HIST_SIZE)
+			bucket = CORO_SLICE_HIST_SIZE - 1;
+		++st->slice_hist[bucket];
+		from->suspended_at = now;
+	}
+	if (!coro_is_sched(to)) {
+		to->stats.wait_ns += now - to->suspended_at;
+		to->resumed_at = now;
+		to->resumed_cpu = cpu;
+	}
+}
+
+void
+coro_stats_enable(bool is_dump)
+{
+	coro_stats_mode = is_dump ? CORO_STATS_DUMP : CORO_STATS_COLLECT;
+}
+
+void
+coro_stats(const struct coro *c, struct coro_stats *stats)
+{
+	*stats = c->stats;
+	stats->switch_count = c->switch_count;
+}
+
+/** Print the profile of a finished coroutine to stderr. */
+static void
+coro_stats_dump(const struct coro *c)
+{
+	const struct coro_stats *st = &c->stats;
+	fprintf(stderr, "coro %p: %lld switches, cpu %.3fms, run %.3fms, "
+		"wait %.3fms, %llu slices, max %.3fus\n", (const void *)c,
+		c->switch_count, st->cpu_ns / 1e6, st->run_ns / 1e6,
+		st->wait_ns / 1e6, (unsigned long long)st->slice_count,
+		st->slice_max_ns / 1e3);
+	fprintf(stderr, "coro %p: slices:", (const void *)c);
+	for (int i = 0; i < CORO_SLICE_HIST_SIZE; ++i) {
+		if (st->slice_hist[i] == 0)
+			continue;
+		if (i == 0)
+			fprintf(stderr, " <1us");
+		else if (i == CORO_SLICE_HIST_SIZE - 1)
+			fprintf(stderr, " >=%lluus", 1ULL << (i - 1));
+		else
+			fprintf(stderr, " %llu-%lluus", 1ULL << (i - 1), 1ULL << i);
+		fprintf(stderr, ":%llu", (unsigned long long)st->slice_hist[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+void
+coro_set_quantum(double quantum)
+{
+	coro_quantum_ns = quantum > 0 ? quantum * 1e9 : 0;
+}
+
+/**
+ * Start the slice of @a to, which the current thread switches to. By
+ * the switching side, as in the M:N mode @a to may come from another
+ * thread.
+ */
+static void
+coro_quantum_start(struct coro *to)
+{
+	if (coro_quantum_ns == 0 || coro_is_sched(to)) {
+		coro_quantum_left = CORO_QUANTUM_MAX_EVERY;
+		return;
+	}
+	uint64_t now = coro_clock_ns(CLOCK_MONOTONIC);
+	to->quantum_end = now + coro_quantum_ns;
+	to->quantum_checked_at = now;
+	coro_quantum_left = to->quantum_every;
+}
+
+void
+coro_quantum_check(void)
+{
+	struct coro *c = coro_this_ptr;
+	if (coro_quantum_ns == 0 || c == NULL || coro_is_sched(c)) {
+		coro_quantum_left = CORO_QUANTUM_MAX_EVERY;
+		return;
+	}
+	uint64_t now = coro_clock_ns(CLOCK_MONOTONIC);
+	uint64_t since = now - c->quantum_checked_at;
+	/* About 4 reads a slice, for it to end a quarter late at most */
+	if (since > 0) {
+		uint64_t every = c->quantum_every * coro_quantum_ns / 4 / since;
+		c->quantum_every = every < 1 ? 1 : every > CORO_QUANTUM_MAX_EVERY ?
+				   CORO_QUANTUM_MAX_EVERY : every;
+	}
+	c->quantum_checked_at = now;
+	if (now >= c->quantum_end) {
+		/* The switch back starts a new slice */
+		coro_yield();
+		return;
+	}
+	coro_quantum_left = c->quantum_every;
+}
+
 /** Switch the current coroutine to an arbitrary one. */
 static void
 coro_yield_to(struct coro *to)
 {
 	struct coro *from = coro_this_ptr;
 	++from->switch_count;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
+	coro_stats_switch(from, to);
+	coro_quantum_start(to);
+	if (coro_deadline_count > 0)
+		from->queued_at = coro_clock_ns(CLOCK_MONOTONIC);
+	coro_this_ptr = to;
+	coro_ctx_switch(&from->ctx, &to->ctx);
 	coro_this_ptr = from;
 }
 
+/**
+ * Switch from a coroutine to the worker loop of the current thread.
+ * When the switch returns, the coroutine may be running in another
+ * thread already: noinline, so no thread-local address cached in the
+ * caller is used after that.
+ */
+static void __attribute__((noinline))
+coro_mt_switch_out(struct coro *c)
+{
+	coro_ctx_switch(&c->ctx, &coro_mt_sched_this->ctx);
+}
+
+void
+coro_mt_run(struct coro *sched, struct coro *c)
+{
+	/* Nested, if a coroutine runs another one while it joins a task. */
+	struct coro *outer_sched = coro_mt_sched_this;
+	struct coro *outer = coro_this_ptr;
+	coro_mt_sched_this = sched;
+	coro_this_ptr = c;
+	coro_stats_switch(sched, c);
+	coro_quantum_start(c);
+	coro_ctx_switch(&sched->ctx, &c->ctx);
+	coro_stats_switch(c, sched);
+	coro_this_ptr = outer;
+	coro_mt_sched_this = outer_sched;
+}
+
+void
+coro_mt_finish(struct coro *c)
+{
+	pthread_mutex_lock(&coro_mt.mutex);
+	c->next = NULL;
+	if (coro_mt.finished_tail != NULL)
+		coro_mt.finished_tail->next = c;
+	else
+		coro_mt.finished_head = c;
+	coro_mt.finished_tail = c;
+	--coro_mt.alive;
+	pthread_cond_signal(&coro_mt.finished_cond);
+	pthread_mutex_unlock(&coro_mt.mutex);
+}
+
+bool
+coro_mt_can_park(void)
+{
+	return coro_pool_hooks != NULL && coro_this_ptr != NULL &&
+	       !coro_is_sched(coro_this_ptr);
+}
+
+/**
+ * Earliest deadline first: the coroutine of the run-queue which is
+ * due first. The scheduler takes part too, if @a with_sched is true.
+ */
+static struct coro *
+coro_edf_pick(bool with_sched)
+{
+	struct coro *best = with_sched ? &coro_sched : NULL;
+	uint64_t best_due = with_sched ? coro_sched.queued_at : UINT64_MAX;
+	for (struct coro *c = coro_list; c != NULL; c = c->next) {
+		uint64_t due = c->queued_at + c->deadline_ns;
+		if (best == NULL || due < best_due) {
+			best = c;
+			best_due = due;
+		}
+	}
+	return best;
+}
+
+void
+coro_set_deadline(struct coro *c, double deadline)
+{
+	if (coro_is_mt())
+		return;
+	uint64_t ns = deadline > 0 ? deadline * 1e9 : 0;
+	if (ns == 0 && c->deadline_ns != 0)
+		--coro_deadline_count;
+	else if (ns != 0 && c->deadline_ns == 0)
+		++coro_deadline_count;
+	c->deadline_ns = ns;
+}
+
 void
 coro_yield(void)
 {
+	if (coro_is_mt()) {
+		struct coro *c = coro_this_ptr;
+		++c->switch_count;
+		coro_mt_switch_out(c);
+		return;
+	}
 	struct coro *from = coro_this_ptr;
+	if (coro_deadline_count > 0 && from != &coro_sched) {
+		/* Compare against the time it is suspended at. */
+		from->queued_at = coro_clock_ns(CLOCK_MONOTONIC);
+		struct coro *to = coro_edf_pick(true);
+		if (to != from)
+			coro_yield_to(to);
+		return;
+	}
 	struct coro *to = from->next;
 	if (to == NULL)
 		coro_yield_to(&coro_sched);
@@ -133,19 +485,176 @@ coro_sched_init(void)
 	coro_this_ptr = &coro_sched;
 }
 
+/** Put a coroutine to the end of a worker run-queue. */
+static void
+coro_worker_push(struct coro_worker *w, struct coro *c)
+{
+	pthread_mutex_lock(&w->mutex);
+	c->next = NULL;
+	c->prev = w->tail;
+	if (w->tail != NULL)
+		w->tail->next = c;
+	else
+		w->head = c;
+	w->tail = c;
+	pthread_mutex_unlock(&w->mutex);
+
+	__atomic_add_fetch(&coro_mt.runnable, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_mt.idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&coro_mt.mutex);
+		pthread_cond_signal(&coro_mt.work_cond);
+		pthread_mutex_unlock(&coro_mt.mutex);
+	}
+}
+
+/**
+ * Take a coroutine from a worker run-queue. The owner takes the
+ * oldest one, a thief takes the newest one.
+ */
+static struct coro *
+coro_worker_pop(struct coro_worker *w, bool is_steal)
+{
+	pthread_mutex_lock(&w->mutex);
+	struct coro *c = is_steal ? w->tail : w->head;
+	if (c != NULL) {
+		if (c->prev != NULL)
+			c->prev->next = c->next;
+		else
+			w->head = c->next;
+		if (c->next != NULL)
+			c->next->prev = c->prev;
+		else
+			w->tail = c->prev;
+		c->next = c->prev = NULL;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return c;
+}
+
+/** Next coroutine for a worker: its own or a stolen one. */
+static struct coro *
+coro_worker_take(struct coro_worker *w)
+{
+	struct coro *c = coro_worker_pop(w, false);
+	int self = w - coro_mt.workers;
+	for (int i = 1; c == NULL && i < coro_mt.count; ++i)
+		c = coro_worker_pop(&coro_mt.workers[(self + i) % coro_mt.count],
+				    true);
+	if (c != NULL)
+		__atomic_sub_fetch(&coro_mt.runnable, 1, __ATOMIC_SEQ_CST);
+	return c;
+}
+
+/** Sleep until some coroutine is queued. */
+static void
+coro_worker_idle(void)
+{
+	pthread_mutex_lock(&coro_mt.mutex);
+	__atomic_add_fetch(&coro_mt.idle, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&coro_mt.runnable, __ATOMIC_SEQ_CST) <= 0)
+		pthread_cond_wait(&coro_mt.work_cond, &coro_mt.mutex);
+	__atomic_sub_fetch(&coro_mt.idle, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&coro_mt.mutex);
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_worker *w = arg;
+	coro_worker_this = w;
+	coro_this_ptr = &w->sched;
+	while (true) {
+		struct coro *c = coro_worker_take(w);
+		if (c == NULL) {
+			coro_worker_idle();
+			continue;
+		}
+		coro_mt_run(&w->sched, c);
+		/*
+		 * The coroutine context is saved completely only now, so
+		 * only now it can be given to another thread.
+		 */
+		if (!c->is_finished)
+			coro_worker_push(w, c);
+		else
+			coro_mt_finish(c);
+	}
+	return NULL;
+}
+
+void
+coro_sched_init_threads(int thread_count)
+{
+	coro_sched_init();
+	if (thread_count < 1)
+		thread_count = 1;
+	coro_mt.workers = calloc(thread_count, sizeof(*coro_mt.workers));
+	if (coro_mt.workers == NULL)
+		handle_error();
+	for (int i = 0; i < thread_count; ++i)
+		pthread_mutex_init(&coro_mt.workers[i].mutex, NULL);
+	coro_mt.count = thread_count;
+	for (int i = 0; i < thread_count; ++i) {
+		int rc = pthread_create(&coro_mt.workers[i].thread, NULL,
+					coro_worker_f, &coro_mt.workers[i]);
+		if (rc != 0) {
+			errno = rc;
+			handle_error();
+		}
+	}
+}
+
+/** coro_sched_wait() of the M:N mode. */
+static struct coro *
+coro_mt_wait(void)
+{
+	pthread_mutex_lock(&coro_mt.mutex);
+	while (coro_mt.finished_head == NULL && coro_mt.alive > 0)
+		pthread_cond_wait(&coro_mt.finished_cond, &coro_mt.mutex);
+	struct coro *c = coro_mt.finished_head;
+	if (c != NULL) {
+		coro_mt.finished_head = c->next;
+		if (coro_mt.finished_head == NULL)
+			coro_mt.finished_tail = NULL;
+		c->next = NULL;
+	}
+	pthread_mutex_unlock(&coro_mt.mutex);
+	if (c != NULL && coro_stats_mode == CORO_STATS_DUMP)
+		coro_stats_dump(c);
+	return c;
+}
+
 struct coro *
 coro_sched_wait(void)
 {
-	while (coro_list != NULL) {
-		for (struct coro *c = coro_list; c != NULL; c = c->next) {
-			if (c->is_finished) {
-				coro_list_delete(c);
-				return c;
-			}
+	if (coro_is_mt()) {
+		struct coro *c = coro_mt_wait();
+		if (c == NULL)
+			coro_stack_pool_destroy();
+		return c;
+	}
+	while (coro_list != NULL || coro_finished_head != NULL ||
+	       coro_io_has_waiters()) {
+		struct coro *c = coro_finished_pop();
+		if (c != NULL) {
+			if (coro_stats_mode == CORO_STATS_DUMP)
+				coro_stats_dump(c);
+			return c;
 		}
+		/*
+		 * Once per round of the run-queue check the I/O. When
+		 * all the coroutines are parked, wait for it.
+		 */
+		if (coro_io_has_waiters())
+			coro_io_poll(coro_list == NULL);
+		if (coro_list == NULL)
+			continue;
 
 		struct coro *to;
-		if (coro_saved_next) {
+		if (coro_deadline_count > 0) {
+			coro_saved_next = NULL;
+			to = coro_edf_pick(false);
+		} else if (coro_saved_next) {
 			to = coro_saved_next;
 			coro_saved_next = NULL;
 		} else {
@@ -156,6 +665,8 @@ coro_sched_wait(void)
 		coro_yield_to(to);
 		is_sched_waiting = false;
 	}
+	coro_io_destroy();
+	coro_stack_pool_destroy();
 	return NULL;
 }
 
@@ -165,113 +676,162 @@ coro_this(void)
 	return coro_this_ptr;
 }
 
+bool
+coro_can_park(void)
+{
+	return !coro_is_mt() && coro_this_ptr != NULL &&
+	       coro_this_ptr != &coro_sched;
+}
+
+void
+coro_park(void)
+{
+	struct coro *c = coro_this_ptr;
+	struct coro *to = c->next;
+	coro_list_delete(c);
+	c->is_parked = true;
+	coro_yield_to(to != NULL ? to : &coro_sched);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+	if (!c->is_parked)
+		return;
+	c->is_parked = false;
+	coro_list_append(c);
+}
+
+void
+coro_suspend(void)
+{
+	if (!coro_can_park()) {
+		printf("Critical error - not a coroutine to suspend!\n");
+		exit(-1);
+	}
+	coro_park();
+}
+
+void
+coro_resume(struct coro *c)
+{
+	coro_wakeup(c);
+}
+
+void
+coro_set_joinable(struct coro *c)
+{
+	c->is_joinable = true;
+}
+
+long long
+coro_join(struct coro *c)
+{
+	if (!coro_can_park() || c == coro_this_ptr || !c->is_joinable ||
+	    c->joiner != NULL) {
+		printf("Critical error - can not join the coroutine!\n");
+		exit(-1);
+	}
+	if (c->is_finished)
+		return c->ret;
+	c->joiner = coro_this_ptr;
+	/* Woken up by coro_body(), or by coro_resume() on the way. */
+	while (!c->is_finished)
+		coro_park();
+	return c->ret;
+}
+
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Entry point of every coroutine. The context of a new coroutine is
+ * prepared so that the first switch into it lands here, on its own
+ * stack.
  */
 static void
-coro_body(int signum)
+coro_body(void)
 {
-	(void)signum;
 	struct coro *c = coro_this_ptr;
-	coro_this_ptr = NULL;
-	/*
-	 * On an invokation jump back to the constructor right
-	 * after remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finaly start work.
-	 */
-	coro_this_ptr = c;
 	c->ret = c->func(c->func_arg);
 	c->is_finished = true;
+	coro_set_deadline(c, 0);
+	if (coro_is_mt()) {
+		/* The worker moves it to the finished queue. */
+		coro_mt_switch_out(c);
+		abort();
+	}
 
 	// Fair round-robin: save the next coroutine to continue with.
 	coro_saved_next = c->next;
+	coro_list_delete(c);
+	/* A joinable one is only woken up, it is nowhere till joined. */
+	if (!c->is_joinable)
+		coro_finished_push(c);
+	else if (c->joiner != NULL)
+		coro_wakeup(c->joiner);
 
-	/* Can not return - 'ret' address is invalid already! */
+	/* Can not return - there is no caller on this stack! */
 	if (! is_sched_waiting) {
 		printf("Critical error - no place to return!\n");
 		exit(-1);
 	}
-	siglongjmp(coro_sched.ctx, 1);
+	coro_stats_switch(c, &coro_sched);
+	coro_this_ptr = &coro_sched;
+	coro_ctx_switch(&c->ctx, &coro_sched.ctx);
+	/* Nobody ever switches back to a finished coroutine. */
+	abort();
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
+{
+	return coro_new_ex(func, func_arg, 1024 * 1024);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
 {
 	struct coro *c = (struct coro *) malloc(sizeof(*c));
+	if (c == NULL)
+		handle_error();
 	c->ret = 0;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
+	coro_stack_get(&c->stack, stack_size);
 	c->func = func;
 	c->func_arg = func_arg;
 	c->is_finished = false;
+	c->is_parked = false;
+	c->is_joinable = false;
+	c->joiner = NULL;
 	c->switch_count = 0;
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-	/* Jump onto the stack and remember its position. */
-	struct coro *old_this = coro_this_ptr;
-	coro_this_ptr = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (coro_this_ptr != NULL)
-			sigsuspend(&suss);
-	}
-	coro_this_ptr = old_this;
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-		sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->resumed_at = c->resumed_cpu = 0;
+	c->suspended_at = coro_stats_mode == CORO_STATS_OFF ? 0 :
+			  coro_clock_ns(CLOCK_MONOTONIC);
+	c->deadline_ns = 0;
+	c->queued_at = coro_deadline_count == 0 ? 0 :
+		       coro_clock_ns(CLOCK_MONOTONIC);
+	c->quantum_end = c->quantum_checked_at = 0;
+	c->quantum_every = 1;
+	c->arena.top = NULL;
+	c->arena.used = 0;
+	coro_ctx_make(&c->ctx, c->stack.base, c->stack.size, coro_body);
 
 	/* Now scheduler can work with that coroutine. */
-	coro_list_add(c);
+	if (!coro_is_mt()) {
+		coro_list_add(c);
+		return c;
+	}
+	pthread_mutex_lock(&coro_mt.mutex);
+	++coro_mt.alive;
+	pthread_mutex_unlock(&coro_mt.mutex);
+	if (coro_pool_hooks != NULL) {
+		coro_pool_hooks->schedule(c);
+		return c;
+	}
+	struct coro_worker *w = coro_worker_this;
+	if (w == NULL) {
+		unsigned i = __atomic_fetch_add(&coro_mt.next_worker, 1,
+						__ATOMIC_RELAXED);
+		w = &coro_mt.workers[i % coro_mt.count];
+	}
+	coro_worker_push(w, c);
 	return c;
 }
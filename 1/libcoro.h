@@ -1,6 +1,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 struct coro;
 typedef long long (*coro_f)(void *);
@@ -9,9 +12,49 @@ typedef long long (*coro_f)(void *);
 void
 coro_sched_init(void);
 
+/**
+ * Make current context scheduler and start @a thread_count worker
+ * threads (M:N mode). The coroutines run in the workers: each has
+ * its own run-queue and steals from the others when it is idle. A
+ * coroutine can continue in another thread after coro_yield(), so
+ * the shared data needs synchronization, and the order of the
+ * coroutines is not defined. coro_read(), coro_write() and
+ * coro_sleep() just block the worker thread in this mode.
+ *
+ * The current thread only reaps the coroutines with
+ * coro_sched_wait(). Can be called once instead of coro_sched_init().
+ */
+void
+coro_sched_init_threads(int thread_count);
+
+struct thread_pool;
+
+/**
+ * Make current context scheduler and run the coroutines as tasks of
+ * @a pool (the thread pool of the assignment 4, linked together with
+ * coro_pool.c), in the M:N mode as coro_sched_init_threads(). A
+ * coroutine holds a worker of the pool only while it runs: each time
+ * it yields, it is pushed as a new task, to be continued by any
+ * worker. coro_read(), coro_write() and coro_sleep() switch it out,
+ * until the fd is ready or the time is over, instead of blocking the
+ * worker. Regular files are still read and written in place.
+ *
+ * A coroutine must not yield or wait while it holds a lock, or inside
+ * a task the pool runs on its stack while it waits in
+ * thread_pool_parallel_for() and the like. The pool can be
+ * deleted once thread_pool_shutdown() returns after the last coroutine
+ * is reaped. Can be called once instead of coro_sched_init().
+ */
+void
+coro_sched_init_pool(struct thread_pool *pool);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines, or all of them are suspended by coro_suspend()
+ * or wait in channels, wait groups and joins: then nothing can run
+ * until somebody resumes them, and the caller can do that and call it
+ * again. The joinable coroutines are not returned, see coro_join().
+ * Once all the coroutines are deleted, NULL frees the pooled stacks.
  */
 struct coro *
 coro_sched_wait(void);
@@ -27,6 +70,15 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but the stack has at least @a stack_size
+ * usable bytes. The size is rounded up to whole pages. Stacks are
+ * protected with a guard page, so an overflow crashes instead of
+ * corrupting the memory.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
 /** Return status of the coroutine. */
 long long
 coro_status(const struct coro *c);
@@ -45,3 +97,280 @@ coro_delete(struct coro *c);
 /** Switch to another not finished coroutine. */
 void
 coro_yield(void);
+
+/**
+ * Take the current coroutine out of the run-queue until somebody
+ * calls coro_resume() on it, for the code which has a reactor of its
+ * own instead of coro_read() and coro_write(). Only a coroutine can be
+ * suspended, and not in the M:N mode.
+ */
+void
+coro_suspend(void);
+
+/**
+ * Put @a c, suspended by coro_suspend(), to the end of the run-queue.
+ * Can be called by a coroutine and by the scheduler, between the calls
+ * of coro_sched_wait(). Does nothing if @a c is not suspended.
+ */
+void
+coro_resume(struct coro *c);
+
+/**
+ * Make @a c joinable: coro_sched_wait() never returns it, instead a
+ * coroutine is to call coro_join() on it, and to delete it then. To
+ * be called before it can finish, right after coro_new(). Not in the
+ * M:N mode.
+ */
+void
+coro_set_joinable(struct coro *c);
+
+/**
+ * Wait until the joinable @a c has finished and return its status.
+ * The joining coroutine is parked meanwhile. Only a coroutine can
+ * join, and only one can join @a c.
+ */
+long long
+coro_join(struct coro *c);
+
+/**
+ * Ask to resume @a c at most @a deadline seconds after it yields.
+ * Not positive @a deadline removes it.
+ *
+ * While at least one coroutine has a deadline, coro_yield() switches
+ * to the coroutine with the earliest one (EDF) instead of the next one
+ * in the round robin. The coroutines without a deadline, and the
+ * scheduler, are due right when they yield, so they keep their turns
+ * and are never starved. The EDF pick is a scan of the run-queue,
+ * meant for a moderate number of coroutines. Ignored in the M:N mode.
+ */
+void
+coro_set_deadline(struct coro *c, double deadline);
+
+/**
+ * Give the coroutines time slices of @a quantum seconds for
+ * coro_maybe_yield(): once a coroutine has run that long since it was
+ * switched to, it yields there. Not positive @a quantum turns it off,
+ * which is the default. Each switch into a coroutine costs a clock read
+ * while it is on.
+ */
+void
+coro_set_quantum(double quantum);
+
+/** Of coro_maybe_yield(): the calls left until the clock is read. */
+extern __thread unsigned coro_quantum_left;
+
+/** The slow path of coro_maybe_yield(). */
+void
+coro_quantum_check(void);
+
+/**
+ * Yield if the time slice of the current coroutine is over, see
+ * coro_set_quantum(), for the hot loops to call each unit of work. The
+ * clock is only read every so many calls, as many as took about a
+ * quarter of the quantum the last time, so a call costs a decrement and
+ * a compare. Outside the coroutines it does nothing.
+ */
+static inline void
+coro_maybe_yield(void)
+{
+	if (--coro_quantum_left == 0)
+		coro_quantum_check();
+}
+
+/** Same as coro_maybe_yield(), for @a count units of work at once. */
+static inline void
+coro_maybe_yield_n(unsigned count)
+{
+	if (coro_quantum_left <= count)
+		coro_quantum_check();
+	else
+		coro_quantum_left -= count;
+}
+
+/**
+ * Same as read(2), but when @a fd is not ready, the current
+ * coroutine is parked and the others work meanwhile. Regular files
+ * are read by a helper thread while the coroutine is parked. Called
+ * not from a coroutine, just blocks.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+/** Same as coro_read(), but for write(2). */
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+/**
+ * Park the current coroutine for at least @a seconds. The others
+ * work meanwhile.
+ */
+void
+coro_sleep(double seconds);
+
+/**
+ * Channel to pass pointers between coroutines, FIFO. At most
+ * @a capacity messages are buffered, 0 makes every send wait for a
+ * receiver. A coroutine waiting in a channel is parked: it is out of
+ * the run-queue until the other side wakes it up. Not for the M:N
+ * mode.
+ */
+struct coro_chan;
+
+/** Create a channel with room for @a capacity messages. */
+struct coro_chan *
+coro_chan_new(size_t capacity);
+
+/**
+ * Close the channel. The waiting senders fail, the receivers get the
+ * buffered messages and then fail too.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+/** Close the channel and free it. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Send @a msg, waiting while the buffer is full. Returns 0 on
+ * success, -1 with EPIPE if the channel is closed, and with EAGAIN
+ * if it is full and the caller can not wait (it is not a coroutine).
+ */
+int
+coro_chan_send(struct coro_chan *ch, void *msg);
+
+/**
+ * Receive a message into @a msg, waiting while there are none.
+ * Returns 0 on success, -1 with EPIPE if the channel is closed and
+ * empty, and with EAGAIN if it is empty and the caller can not wait.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void **msg);
+
+/**
+ * Wait group: a counter of the jobs still running, the coroutines
+ * waiting for it to get to 0 are parked until then. Like the
+ * channels, not for the M:N mode.
+ */
+struct coro_wg;
+
+/** Create a wait group with the counter 0. */
+struct coro_wg *
+coro_wg_new(void);
+
+/** Free the wait group. Nobody must be waiting for it. */
+void
+coro_wg_delete(struct coro_wg *wg);
+
+/**
+ * Add @a count to the counter, negative to take away. All the waiters
+ * are woken up once it gets to 0. Below 0 is a critical error.
+ */
+void
+coro_wg_add(struct coro_wg *wg, long count);
+
+/** Same as coro_wg_add(wg, -1): a job is done. */
+void
+coro_wg_done(struct coro_wg *wg);
+
+/**
+ * Wait until the counter is 0. Returns 0, and -1 with EAGAIN if it is
+ * not and the caller can not wait (it is not a coroutine).
+ */
+int
+coro_wg_wait(struct coro_wg *wg);
+
+/**
+ * Allocate @a size bytes in the arena of the current coroutine. The
+ * memory is aligned to 16 bytes and lives until coro_delete() of the
+ * coroutine or coro_arena_truncate(), there is no free of a single
+ * allocation. Returns NULL on error, like malloc(3). Not in a
+ * coroutine, the arena of the thread is used, it is freed only by
+ * coro_arena_truncate().
+ */
+void *
+coro_arena_alloc(size_t size);
+
+/** Position of the arena of the current coroutine. */
+size_t
+coro_arena_used(void);
+
+/**
+ * Free everything allocated in the arena of the current coroutine
+ * since coro_arena_used() returned @a used.
+ */
+void
+coro_arena_truncate(size_t used);
+
+enum {
+	/**
+	 * Buckets of the slice length histogram. Bucket 0 is for the
+	 * slices shorter than 1us, bucket i is for [2^(i-1), 2^i) us, the
+	 * last one also takes all the longer slices.
+	 */
+	CORO_SLICE_HIST_SIZE = 16,
+};
+
+/**
+ * Profile of a coroutine. A slice is the time between a switch into
+ * the coroutine and the switch out of it.
+ */
+struct coro_stats {
+	long long switch_count;
+	/** CPU time of the thread while the coroutine was running. */
+	uint64_t cpu_ns;
+	/** Wall time while the coroutine was running. */
+	uint64_t run_ns;
+	/**
+	 * Wall time while it was not running: in the run-queue or
+	 * parked on I/O.
+	 */
+	uint64_t wait_ns;
+	uint64_t slice_count;
+	uint64_t slice_max_ns;
+	uint64_t slice_hist[CORO_SLICE_HIST_SIZE];
+};
+
+/**
+ * Start profiling the coroutines, see coro_stats(). It costs two
+ * clock reads per switch, so it is off by default. If @a is_dump is
+ * true, the profile of each finished coroutine is printed to stderr
+ * when coro_sched_wait() returns it. Must be called before the
+ * coroutines are created.
+ */
+void
+coro_stats_enable(bool is_dump);
+
+/**
+ * Fill @a stats with the profile of @a c. Only the switch count is
+ * collected, if profiling is not enabled.
+ */
+void
+coro_stats(const struct coro *c, struct coro_stats *stats);
+
+/** Statistics of the coroutine stack pool. */
+struct coro_stack_stats {
+	/** Stacks owned by coroutines right now. */
+	size_t used;
+	/** High-water mark of @a used. */
+	size_t used_max;
+	/** Stacks kept in the pool for reuse. */
+	size_t cached;
+	/** Bytes mapped for stacks (used and cached), guards included. */
+	size_t mapped_bytes;
+	/** High-water mark of @a mapped_bytes. */
+	size_t mapped_bytes_max;
+	/** How many mmap calls were made for stacks. */
+	size_t mapped_count;
+	/**
+	 * How many stacks were created without a guard page, because
+	 * the process is close to its limit of memory mappings.
+	 */
+	size_t unguarded_count;
+	/** How many stacks were taken from the pool instead of mmap. */
+	size_t reused_count;
+};
+
+/** Fill @a stats with the current stack pool statistics. */
+void
+coro_stack_stats(struct coro_stack_stats *stats);
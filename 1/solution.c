@@ -1,8 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include "libcoro.h"
+#include "perf_region.h"
+#ifdef SORT_THREAD_POOL
+#include "thread_pool.h"
+#endif
 
 #define SWAP(type, a, b) { type swap_tmp = (a); (a) = (b); (b) = swap_tmp; }
 
@@ -46,270 +60,2160 @@ inline static bool timespec_less(const struct timespec a, const struct timespec
     return a.tv_sec < b.tv_sec;
 }
 
-struct timespec coro_yield_timered() {
-    struct timespec start = must_clock_monotonic();
-    coro_yield();
-    struct timespec stop = must_clock_monotonic();
-    return timespec_diff(stop, start);
+inline static long long timespec_ns(const struct timespec a) {
+    return a.tv_sec * 1000LL * 1000 * 1000 + a.tv_nsec;
+}
+
+// The sorting engine of `int`, which yields when the time slice is over, see sort_impl.h
+#define SORT_NAME sort_int
+#define SORT_TYPE int
+#define SORT_KEY(x) SORT_KEY_I32(x)
+#define SORT_YIELD_N(n) coro_maybe_yield_n(n)
+#include "sort_impl.h"
+
+// With `--radix`, the arrays shorter than this are still sorted by `sort_int_merge_sort`: the
+// passes over the histograms cost more than the sort itself. Can be tuned with -DRADIX_SORT_MIN=...
+#ifndef RADIX_SORT_MIN
+#define RADIX_SORT_MIN 2048
+#endif
+
+/** Sort `arr` with the engine chosen by `is_radix`. Same contract as `sort_int_merge_sort`. */
+static int *sort_numbers(int *arr, int *aux, int len, bool is_radix) {
+    if (is_radix && len >= RADIX_SORT_MIN)
+        return sort_int_radix_sort(arr, aux, len);
+    return sort_int_merge_sort(arr, aux, len);
 }
 
+
 /**
- * Merge function. Can be used both for merging two already sorted arrays, when given subsort=false,
- * and for performing a complete merge sort (O(N*logN)) of an array, when given subsort=true.
+ * Loser tree (tournament tree) over `k` sorted arrays. Internal nodes `1..k-1` store the losers of
+ * the matches played in them, `tree[0]` stores the overall winner: the array with the smallest
+ * head. Leaf `i` (array `i`) is node `k + i`. Taking the winner out replays only the matches on the
+ * path from its leaf to the root, so the next winner is found in `log2(k)` comparisons.
+ */
+struct loser_tree {
+    int k;
+    int *tree;
+    const int **pos;
+    const int **end;
+};
+
+/** Whether the head of array `a` goes before the head of array `b`. Exhausted arrays always lose. */
+inline static bool loser_tree_beats(const struct loser_tree *t, int a, int b) {
+    if (t->pos[a] == t->end[a])
+        return false;
+    if (t->pos[b] == t->end[b])
+        return true;
+    return *t->pos[a] <= *t->pos[b];
+}
+
+/** Play the matches in the subtree of `node`, returning the winner of it. */
+static int loser_tree_build(struct loser_tree *t, int node) {
+    if (node >= t->k)
+        return node - t->k;
+    int a = loser_tree_build(t, 2 * node);
+    int b = loser_tree_build(t, 2 * node + 1);
+    if (loser_tree_beats(t, a, b)) {
+        t->tree[node] = b;
+        return a;
+    }
+    t->tree[node] = a;
+    return b;
+}
+
+/** Replay the matches on the path of `winner`, whose head has changed, and store the new winner. */
+inline static void loser_tree_replay(struct loser_tree *t, int winner) {
+    for (int node = (winner + t->k) / 2; node >= 1; node /= 2) {
+        if (loser_tree_beats(t, t->tree[node], winner))
+            SWAP(int, t->tree[node], winner);
+    }
+    t->tree[0] = winner;
+}
+
+/** Allocate a loser tree for `k` inputs. Returns 0 on success, -1 on failure (after reporting it). */
+static int loser_tree_alloc(struct loser_tree *t, int k) {
+    t->k = k;
+    t->tree = malloc(sizeof (int) * k);
+    t->pos = malloc(sizeof (int *) * k);
+    t->end = malloc(sizeof (int *) * k);
+    if (t->tree == NULL || t->pos == NULL || t->end == NULL) {
+        perror("malloc for the loser tree");
+        free(t->tree);
+        free(t->pos);
+        free(t->end);
+        return -1;
+    }
+    return 0;
+}
+
+static void loser_tree_free(struct loser_tree *t) {
+    free(t->tree);
+    free(t->pos);
+    free(t->end);
+}
+
+/**
+ * Merge `k` sorted arrays into `out` with a loser tree: O(total * log(k)) in a single pass over
+ * the memory.
  *
- * If subsort=true, the original arrays is reordered somehow (not necessarily sorted).
- * If subsort=false, the original arrays is unmodified.
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+int merge_k(int *out, const int **arrays, const int *sizes, int k) {
+    if (k == 0)
+        return 0;
+    struct loser_tree t;
+    if (loser_tree_alloc(&t, k) != 0)
+        return -1;
+
+    long long total = 0;
+    for (int i = 0; i < k; ++i) {
+        t.pos[i] = arrays[i];
+        t.end[i] = arrays[i] + sizes[i];
+        total += sizes[i];
+    }
+    t.tree[0] = loser_tree_build(&t, 1);
+
+    for (long long n = 0; n < total; ++n) {
+        int winner = t.tree[0];
+        *out++ = *t.pos[winner]++;
+        loser_tree_replay(&t, winner);
+    }
+
+    loser_tree_free(&t);
+    return 0;
+}
+
+
+/** A sorted run, spilled to a temporary file by the external sort (`--mem-limit`). */
+struct spill_run {
+    int fd;
+    off_t offset;
+    size_t count;
+    // The runs of one input file share a spill file, the first of them owns its descriptor
+    bool owns_fd;
+};
+
+/** All the spilled runs. Appended to by the workers, merged by `main`. */
+struct spill_runs {
+    struct spill_run *items;
+    int count;
+    int capacity;
+};
+
+/**
+ * Where a file is loaded and sorted: a slice of the output arena, which is shared by all the files.
+ * The final merge reads them all from there, they are not copied on the way. `capacity` is an upper
+ * bound of the count of the numbers in the file, known up front from its size. `data` is `NULL` if
+ * there is no arena, then the file is loaded to the heap.
+ */
+struct output_slot {
+    int *data;
+    size_t capacity;
+};
+
+struct sort_file_inp {
+    int worker_id;
+    // The indices of the files to sort come from the distributor through this channel
+    struct coro_chan *files;
+    char **filenames;
+    // The file being sorted now, `NULL` while waiting
+    char *filename;
+    struct timespec latency;
+    // Whether the file is in the `--binary` format rather than text
+    bool is_binary;
+    // With `--radix`: sort by `sort_int_radix_sort` instead of `sort_int_merge_sort`
+    bool is_radix;
+    // With `--edf`: the average size of the input files, the deadline is scaled by it. 0 otherwise
+    double mean_file_size;
+    // External sort: how many numbers to sort in memory at once; 0 if the files are sorted whole
+    size_t run_capacity;
+    struct spill_runs *runs;
+    // With `--cache`: also store each sorted file to the cache
+    bool is_cache;
+    // With `--top`: the numbers go to this heap of the worker instead of being sorted. `NULL` otherwise
+    struct top_heap *top;
+
+    // The file `i` is sorted in `slots[i]`, the pointer to the result is stored to
+    // `resulting_arrays[i]`. It is in the heap (for `main` to free), if the slot was too small
+    const struct output_slot *slots;
+    int **resulting_arrays;
+    int *resulting_arrays_sizes;
+};
+
+struct sort_file_res {
+    int worker_id;
+    int switch_count;
+    struct timespec time_spent;
+
+    // Achieved latency: the time slices between the yields inside `sort_int_merge`
+    long long slices_count;
+    double slice_avg_us;
+    double slice_max_us;
+};
+
+/**
+ * Open an input file to be read through, telling the kernel so: the readahead of a sequential
+ * file is twice the default one.
+ */
+static int open_input(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0)
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+/**
+ * Start reading the input file which is to be sorted next into the page cache, while the current
+ * ones are. Only a hint: the kernel queues the reads and returns, and nothing is reported if the
+ * file can't be opened, it is then reported when read. On a cold cache the next files are then
+ * read in parallel with the current ones, and not each after the previous is done.
+ */
+static void prefetch_input(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    (void)close(fd);
+}
+
+/**
+ * Read the whole file into a NUL-terminated buffer in the coroutine arena. The reads go through
+ * `coro_read`, so the other coroutines keep working while the file is being loaded. The buffer is
+ * sized by `fstat`, so a regular file is read into it at once, and a small read into the stack
+ * finds its end: the buffer grows only if the file turns out bigger.
  *
- * WARNING: requires that libcoro has been initialized with `coro_sched_init()` before `merge` is called.
+ * Returns `NULL` on error (after reporting it).
+ */
+static char *read_whole_file(const char *filename, size_t *size) {
+    int fd = open_input(filename);
+    if (fd < 0) {
+        perror("open of input file");
+        return NULL;
+    }
+
+    size_t capacity = 64 * 1024, len = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        capacity = st.st_size;
+    char *buf = coro_arena_alloc(capacity + 1);
+    while (buf != NULL) {
+        char probe[4096];
+        bool is_full = len == capacity;
+        /* Once full (at the size of a regular file), probe for the end before growing */
+        ssize_t got = is_full ? coro_read(fd, probe, sizeof(probe)) :
+            coro_read(fd, buf + len, capacity - len);
+        if (got < 0) {
+            perror("read of input file");
+            (void)close(fd);
+            return NULL;
+        }
+        if (got == 0)
+            break;
+        if (is_full) {
+            // More than it was told. The arena can't grow a block, the old one stays till the truncate
+            capacity = capacity * 2 + got;
+            char *bigger = coro_arena_alloc(capacity + 1);
+            if (bigger != NULL) {
+                memcpy(bigger, buf, len);
+                memcpy(bigger + len, probe, got);
+            }
+            buf = bigger;
+        }
+        len += got;
+    }
+    (void)close(fd);
+
+    if (buf == NULL) {
+        perror("coro_arena_alloc for input file contents");
+        return NULL;
+    }
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
+
+/**
+ * Header of the `--binary` files. It is followed by `count` int32 values. All the fields and the
+ * values are little-endian.
+ */
+struct binary_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+};
+
+#define BINARY_MAGIC "IS32"
+#define BINARY_VERSION 1
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define le32(x) __builtin_bswap32(x)
+#define le64(x) __builtin_bswap64(x)
+#else
+#define le32(x) (x)
+#define le64(x) (x)
+#endif
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+/** `--hugepages`: the big arrays of the numbers are in the huge pages. Set once, in `main`. */
+static bool is_hugepages = false;
+
+/**
+ * With `--hugepages`, ask for the transparent huge pages for the array `ptr` of `size` bytes, right
+ * after its allocation and before it is touched: 100M numbers are 100K pages of 4KiB for the TLB,
+ * and only 200 of 2MiB. Only the part of it aligned to the huge pages can be in them, and it stays
+ * freed by `free`. The kernel without them (or with them disabled) keeps the normal pages.
+ */
+static void hugepages_advise(void *ptr, size_t size) {
+    if (!is_hugepages || ptr == NULL)
+        return;
+    uintptr_t start = ((uintptr_t)ptr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (start < end)
+        (void)madvise((void *)start, end - start, MADV_HUGEPAGE);
+}
+
+/** `coro_read` exactly `size` bytes unless EOF. Returns how many were read, -1 on error. */
+static ssize_t read_full(int fd, void *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = coro_read(fd, (char *)buf + done, size - done);
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+
+/** `pread` exactly `size` bytes. Returns 0 on success, -1 on error or EOF. */
+static int pread_full(int fd, void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = pread(fd, (char *)buf + done, size - done, offset + done);
+        if (got <= 0)
+            return -1;
+        done += got;
+    }
+    return 0;
+}
+
+/**
+ * Read and check the header of a `--binary` file.
  *
- * Returns a `struct timespec` that represents the total time spent sleeping in `coro_yield`.
+ * Returns the number of values in the file, -1 on error (after reporting it).
  */
-struct timespec merge(int *out, int *from1, int len1, int *from2, int len2,
-        bool subsort, struct timespec latency) {
+static long long read_binary_header(int fd, const char *filename) {
+    struct binary_header header;
+    ssize_t got = read_full(fd, &header, sizeof (header));
+    if (got != sizeof (header) || memcmp(header.magic, BINARY_MAGIC, 4) != 0 ||
+            le32(header.version) != BINARY_VERSION || le64(header.count) > INT32_MAX) {
+        (void)fprintf(stderr, "Error: %s is not a binary input file\n", filename);
+        return -1;
+    }
+    return le64(header.count);
+}
+
+/** Convert `n` little-endian values read from a `--binary` file in place. */
+inline static void binary_to_host(int *arr, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        arr[i] = le32((uint32_t)arr[i]);
+}
 
-    // Used to determine when to switch
-    struct timespec next_switch = timespec_add(must_clock_monotonic(), latency);
+/**
+ * `--range=lo..hi`: only the numbers in [lo, hi] are kept. The others are dropped right as they are
+ * read, so they are neither sorted nor merged. The whole `int` range by default. Set once, in `main`.
+ */
+static int range_lo = INT_MIN, range_hi = INT_MAX;
 
-    // Used to accumulate the waiting time (for the return value)
-    struct timespec wait_time = {0};
+inline static bool is_in_range(int val) {
+    return val >= range_lo && val <= range_hi;
+}
+
+/**
+ * Same as `binary_to_host`, dropping the numbers out of the `--range` on the way.
+ *
+ * Returns how many numbers are left at the start of `arr`.
+ */
+static size_t binary_to_host_in_range(int *arr, size_t n) {
+    if (range_lo == INT_MIN && range_hi == INT_MAX) {
+        binary_to_host(arr, n);
+        return n;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        // Branchless: which of the numbers are dropped is just as unpredictable as it is for sorting
+        int val = le32((uint32_t)arr[i]);
+        arr[kept] = val;
+        kept += is_in_range(val);
+    }
+    return kept;
+}
 
-    if (subsort) {
-        if (len1 > 1) {
-            int *tmp = malloc(sizeof (int) * len1);
-            if (!tmp) {
-                perror("Temp array malloc inside merge");
-                return wait_time;
+/**
+ * Read a `--binary` file straight into an int array.
+ *
+ * Returns the array and stores its length to `count`; `NULL` on error (after reporting it).
+ */
+static int *read_binary_file(const char *filename, const struct output_slot *slot, int *count) {
+    int fd = open_input(filename);
+    if (fd < 0) {
+        perror("open of input file");
+        return NULL;
+    }
+
+    long long header_count = read_binary_header(fd, filename);
+    if (header_count < 0) {
+        (void)close(fd);
+        return NULL;
+    }
+    size_t n = header_count;
+
+    // At least one element, so that an empty result is still a non-NULL array
+    bool is_in_slot = slot != NULL && slot->data != NULL && n <= slot->capacity;
+    int *arr = is_in_slot ? slot->data : malloc(sizeof (int) * (n > 0 ? n : 1));
+    if (arr == NULL) {
+        perror("malloc for the binary input");
+        (void)close(fd);
+        return NULL;
+    }
+    if (!is_in_slot)
+        hugepages_advise(arr, sizeof (int) * n);
+    ssize_t got = read_full(fd, arr, sizeof (int) * n);
+    (void)close(fd);
+    if (got != (ssize_t)(sizeof (int) * n)) {
+        if (got < 0)
+            perror("read of input file");
+        else
+            (void)fprintf(stderr, "Error: %s is truncated\n", filename);
+        if (!is_in_slot)
+            free(arr);
+        return NULL;
+    }
+    *count = binary_to_host_in_range(arr, n);
+    return arr;
+}
+
+#define PARSE_SAMPLE 4096
+
+inline static bool is_digit(char c) {
+    return (unsigned char)(c - '0') <= 9;
+}
+
+inline static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * Parse at most `capacity` whitespace-separated decimal integers of the NUL-terminated text at
+ * `*text` into `arr`, moving `*text` past them. Stops at the first thing which is not a number,
+ * like a `fscanf("%d")` loop would: then `*text` points to it (or to the NUL). The numbers out of
+ * the `--range` are skipped.
+ *
+ * Yields when the time slice is over. Returns how many numbers were stored.
+ */
+static size_t parse_ints_into(const char **text, int *arr, size_t capacity) {
+    const char *p = *text;
+    size_t n = 0;
+    while (n < capacity) {
+        while (is_space(*p))
+            ++p;
+        const char *number = p;
+        bool is_negative = *p == '-';
+        if (is_negative || *p == '+')
+            ++p;
+        if (!is_digit(*p)) {
+            p = number;
+            break;
+        }
+        unsigned val = 0;
+        do {
+            val = val * 10 + (*p++ - '0');
+        } while (is_digit(*p));
+
+        arr[n] = is_negative ? -val : val;
+        n += is_in_range(arr[n]);
+        coro_maybe_yield();
+    }
+    *text = p;
+    return n;
+}
+
+/**
+ * Parse the whitespace-separated decimal integers of the NUL-terminated `text` of `size` bytes.
+ *
+ * The numbers go to `slot`, if it's given. Otherwise (or if they don't fit, in case the file has
+ * grown) the heap array is pre-sized from the average length of the numbers in the first
+ * `PARSE_SAMPLE` bytes, so normally it is allocated once. Yields when the time slice is over.
+ *
+ * Returns the array and stores its length to `count`; `NULL` on error (after reporting it).
+ */
+static int *parse_ints(const char *text, size_t size, const struct output_slot *slot, int *count) {
+    const char *p = text;
+    size_t n = 0;
+    if (slot != NULL && slot->data != NULL) {
+        n = parse_ints_into(&p, slot->data, slot->capacity);
+        if (n < slot->capacity) {
+            *count = n;
+            return slot->data;
+        }
+    }
+
+    size_t sample = size < PARSE_SAMPLE ? size : PARSE_SAMPLE;
+    size_t sample_numbers = 0;
+    for (size_t i = 0; i < sample; ++i) {
+        if (is_digit(text[i]) && !is_digit(text[i + 1]))
+            ++sample_numbers;
+    }
+    size_t capacity = 16;
+    if (sample_numbers > 0)
+        capacity += (double)size * sample_numbers / sample * 1.05;
+
+    if (capacity <= n)
+        capacity = 2 * n;
+    int *arr = malloc(sizeof (int) * capacity);
+    if (arr == NULL) {
+        perror("malloc for the parsed numbers");
+        return NULL;
+    }
+    hugepages_advise(arr, sizeof (int) * capacity);
+    if (n > 0)
+        memcpy(arr, slot->data, sizeof (int) * n);
+
+    while (1) {
+        n += parse_ints_into(&p, arr + n, capacity - n);
+        if (n < capacity)
+            break;
+        capacity *= 2;
+        int *bigger = realloc(arr, sizeof (int) * capacity);
+        if (bigger == NULL) {
+            perror("realloc for the parsed numbers");
+            free(arr);
+            return NULL;
+        }
+        arr = bigger;
+        hugepages_advise(arr, sizeof (int) * capacity);
+    }
+
+    *count = n;
+    return arr;
+}
+
+#define EXTERNAL_TEXT_CHUNK (1 << 20)
+
+/** `coro_write` all of `size` bytes. Returns 0 on success, -1 on error. */
+static int write_full(int fd, const void *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t written = coro_write(fd, (const char *)buf + done, size - done);
+        if (written < 0)
+            return -1;
+        done += written;
+    }
+    return 0;
+}
+
+/** Create an anonymous temporary file in `$TMPDIR` (`/tmp` by default). Returns -1 on error. */
+static int spill_file_create(void) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+    char path[4096];
+    (void)snprintf(path, sizeof (path), "%s/sort_spill_XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp for a spill file");
+        return -1;
+    }
+    // Nobody else needs the name, and so the file is deleted even if we crash
+    (void)unlink(path);
+    return fd;
+}
+
+/** State of the external sort of one input file. */
+struct spill_state {
+    int fd;
+    off_t offset;
+    int *run;
+    int *aux;
+    size_t run_len;
+    // Totals of the spilled runs
+    int runs_count;
+    size_t numbers;
+};
+
+/** Sort the numbers collected in `state->run` and append them to the spill file as a new run. */
+static int spill_run(struct sort_file_inp *dnp, struct spill_state *state) {
+    if (state->run_len == 0)
+        return 0;
+    bool is_first = state->fd < 0;
+    if (is_first) {
+        state->fd = spill_file_create();
+        if (state->fd < 0)
+            return -1;
+    }
+
+    int *sorted = sort_numbers(state->run, state->aux, state->run_len, dnp->is_radix);
+    size_t bytes = sizeof (int) * state->run_len;
+    if (write_full(state->fd, sorted, bytes) != 0) {
+        perror("write of a spill file");
+        return -1;
+    }
+
+    struct spill_runs *runs = dnp->runs;
+    if (runs->count == runs->capacity) {
+        int capacity = runs->capacity * 2 + 16;
+        struct spill_run *items = realloc(runs->items, sizeof (*items) * capacity);
+        if (items == NULL) {
+            perror("realloc for the spill runs");
+            return -1;
+        }
+        runs->items = items;
+        runs->capacity = capacity;
+    }
+    runs->items[runs->count++] = (struct spill_run){ .fd = state->fd, .offset = state->offset,
+        .count = state->run_len, .owns_fd = is_first };
+    state->offset += bytes;
+    ++state->runs_count;
+    state->numbers += state->run_len;
+    state->run_len = 0;
+    return 0;
+}
+
+/**
+ * Parse the text file `fd` chunk by chunk into `*numbers`, which has room for `capacity` of them,
+ * counting them in `*count`. Each time it is full, `full(ctx)` takes them: it sets `*count` to 0,
+ * and may point `*numbers` to another buffer. What is left in the end is for the caller. The text
+ * chunk is taken from the coroutine arena and left there.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int read_text_numbers(int fd, int **numbers, size_t *count, size_t capacity,
+        int (*full)(void *ctx), void *ctx, size_t *bytes) {
+    char *text = coro_arena_alloc(EXTERNAL_TEXT_CHUNK + 1);
+    if (text == NULL) {
+        perror("coro_arena_alloc for the text chunk");
+        return -1;
+    }
+
+    int rc = 0;
+    size_t len = 0;
+    bool is_eof = false;
+    while (!is_eof || len > 0) {
+        if (!is_eof) {
+            ssize_t got = coro_read(fd, text + len, EXTERNAL_TEXT_CHUNK - len);
+            if (got < 0) {
+                perror("read of input file");
+                rc = -1;
+                break;
             }
-            struct timespec slept = merge(tmp, from1, len1/2, from1 + len1/2, len1 - len1/2, subsort, latency);
-            wait_time = timespec_add(wait_time, slept);
-            memcpy(from1, tmp, sizeof (int) * len1);
-            free(tmp);
-        }
-        if (len2 > 1) {
-            int *tmp = malloc(sizeof (int) * len2);
-            if (!tmp) {
-                perror("Temp array malloc inside merge");
-                return wait_time;
+            is_eof = got == 0;
+            len += got;
+            *bytes += got;
+        }
+
+        // Only the complete numbers: up to the last whitespace, unless the file is over. If there
+        // is none in the whole chunk, it is not a number anyway.
+        size_t cut = len;
+        if (!is_eof) {
+            while (cut > 0 && !is_space(text[cut - 1]))
+                --cut;
+            if (cut == 0 && len == EXTERNAL_TEXT_CHUNK)
+                cut = len;
+        }
+        char saved = text[cut];
+        text[cut] = '\0';
+
+        const char *p = text;
+        while (1) {
+            *count += parse_ints_into(&p, *numbers + *count, capacity - *count);
+            if (*count < capacity)
+                break;
+            if (full(ctx) != 0) {
+                rc = -1;
+                break;
             }
-            struct timespec slept = merge(tmp, from2, len2/2, from2 + len2/2, len2 - len2/2, subsort, latency);
-            wait_time = timespec_add(wait_time, slept);
-            memcpy(from2, tmp, sizeof (int) * len2);
-            free(tmp);
         }
+        // Stopped at something which is not a number: the rest of the file is ignored
+        if (rc != 0 || *p != '\0')
+            break;
+
+        text[cut] = saved;
+        memmove(text, text + cut, len - cut);
+        len -= cut;
+    }
+
+    return rc;
+}
+
+/** What `spill_text_file` gives `read_text_numbers` to spill the full runs. */
+struct spill_ctx {
+    struct sort_file_inp *dnp;
+    struct spill_state *state;
+};
+
+static int spill_full(void *ctx) {
+    struct spill_ctx *sc = ctx;
+    return spill_run(sc->dnp, sc->state);
+}
+
+/** Parse the text file `fd` chunk by chunk, spilling a run each time `state->run` is full. */
+static int spill_text_file(struct sort_file_inp *dnp, int fd, struct spill_state *state, size_t *bytes) {
+    struct spill_ctx ctx = { .dnp = dnp, .state = state };
+    return read_text_numbers(fd, &state->run, &state->run_len, dnp->run_capacity, spill_full, &ctx,
+            bytes);
+}
+
+/** Read the binary file `fd` run by run. */
+static int spill_binary_file(struct sort_file_inp *dnp, int fd, struct spill_state *state, size_t *bytes) {
+    long long left = read_binary_header(fd, dnp->filename);
+    if (left < 0)
+        return -1;
+    *bytes += sizeof (struct binary_header);
+    while (left > 0) {
+        size_t n = (size_t)left < dnp->run_capacity ? (size_t)left : dnp->run_capacity;
+        ssize_t got = read_full(fd, state->run, sizeof (int) * n);
+        if (got != (ssize_t)(sizeof (int) * n)) {
+            if (got < 0)
+                perror("read of input file");
+            else
+                (void)fprintf(stderr, "Error: %s is truncated\n", dnp->filename);
+            return -1;
+        }
+        *bytes += got;
+        state->run_len = binary_to_host_in_range(state->run, n);
+        coro_maybe_yield_n(n);
+        left -= n;
+        if (spill_run(dnp, state) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * External sort of `dnp->filename`: the file is read in runs of `dnp->run_capacity` numbers, each
+ * of them is sorted and appended to a temporary spill file, registered in `dnp->runs`. The buffers
+ * are taken from the coroutine arena and given back to it in the end.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int sort_file_external(struct sort_file_inp *dnp, size_t *numbers,
+        size_t *bytes) {
+    int fd = open_input(dnp->filename);
+    if (fd < 0) {
+        perror("open of input file");
+        return -1;
     }
 
-    const int *i = from1, *j = from2;
-    while (i < from1 + len1 && j < from2 + len2) {
-        int mn;
-        if (*i < *j)
-            mn = *i++;
+    size_t arena_mark = coro_arena_used();
+    struct spill_state state = { .fd = -1 };
+    state.run = coro_arena_alloc(sizeof (int) * dnp->run_capacity);
+    state.aux = coro_arena_alloc(sizeof (int) * dnp->run_capacity);
+    int rc = -1;
+    if (state.run == NULL || state.aux == NULL) {
+        perror("coro_arena_alloc for a run");
+    } else {
+        *bytes = 0;
+        if (dnp->is_binary)
+            rc = spill_binary_file(dnp, fd, &state, bytes);
         else
-            mn = *j++;
+            rc = spill_text_file(dnp, fd, &state, bytes);
+        if (rc == 0)
+            rc = spill_run(dnp, &state);
+    }
+    (void)close(fd);
+    coro_arena_truncate(arena_mark);
+
+    *numbers = state.numbers;
+    (void)fprintf(stderr, "Worker %d has spilled %d runs\n", dnp->worker_id, state.runs_count);
+    return rc;
+}
+
+/**
+ * Read the whole file into memory: to the `slot`, or to the heap if there is none or it is too
+ * small. `worker_id` is only used for logging.
+ *
+ * Returns the array and stores its length to `count`; `NULL` on error (after reporting it).
+ */
+static int *load_numbers(int worker_id, const char *filename, bool is_binary,
+        const struct output_slot *slot, int *count) {
+    struct timespec load_start = must_clock_monotonic();
+
+    // The text is scratch memory of the coroutine arena
+    size_t arena_mark = coro_arena_used();
+    size_t text_size;
+    int arr_idx;
+    int *unsorted;
+    if (is_binary) {
+        unsorted = read_binary_file(filename, slot, &arr_idx);
+        text_size = sizeof (struct binary_header) + sizeof (int) * arr_idx;
+    } else {
+        char *text = read_whole_file(filename, &text_size);
+        if (text == NULL)
+            return NULL;
+        unsorted = parse_ints(text, text_size, slot, &arr_idx);
+        coro_arena_truncate(arena_mark);
+    }
+    if (unsorted == NULL)
+        return NULL;
+
+    double load_sec = timespec_ns(timespec_diff(must_clock_monotonic(), load_start)) / 1e9;
+    (void)fprintf(stderr, "Worker %d has read %d numbers (%zu bytes) in %.3fms, %.1f MB/s\n",
+            worker_id, arr_idx, text_size, load_sec * 1000,
+            load_sec > 0 ? text_size / load_sec / 1e6 : 0);
+
+    *count = arr_idx;
+    return unsorted;
+}
 
-        *out++ = mn;
+/**
+ * Read the whole file and sort it in memory. `worker_id` is only used for logging.
+ *
+ * Returns the sorted array and stores its length to `count`; `NULL` on error (after reporting it).
+ */
+static int *load_and_sort(int worker_id, const char *filename, bool is_binary, bool is_radix,
+        const struct output_slot *slot, int *count) {
+    int arr_idx;
+    int *unsorted = load_numbers(worker_id, filename, is_binary, slot, &arr_idx);
+    if (unsorted == NULL)
+        return NULL;
+
+    // The merge sort buffer is scratch memory of the coroutine arena, only the result is in the
+    // slot or on the heap, as it outlives the coroutine
+    size_t arena_mark = coro_arena_used();
+    int *aux = coro_arena_alloc(sizeof (int) * arr_idx);
+    if (aux == NULL) {
+        perror("coro_arena_alloc for the merge sort buffer");
+        if (slot == NULL || unsorted != slot->data)
+            free(unsorted);
+        return NULL;
+    }
+    hugepages_advise(aux, sizeof (int) * arr_idx);
 
-        // If it's time to, yield, adding the wait time to `wait_time` and updating `next_switch`
-        if (timespec_less(next_switch, /*now*/must_clock_monotonic())) {
-            wait_time = timespec_add(wait_time, coro_yield_timered());
-            next_switch = timespec_add(must_clock_monotonic(), latency);
+    if (arr_idx > 0) {
+        int *sorted = sort_numbers(unsorted, aux, arr_idx, is_radix);
+        if (sorted == aux)
+            memcpy(unsorted, aux, sizeof (int) * arr_idx);
+    }
+    coro_arena_truncate(arena_mark);
+
+    *count = arr_idx;
+    return unsorted;
+}
+
+/**
+ * `--top=K`: the biggest `capacity` numbers a worker has seen so far, in a binary min-heap, so that
+ * the smallest of them (the one to be pushed out) is at the root. The files are not sorted at all:
+ * each number is either dropped at once, after a single comparison with the root, or takes its
+ * place in O(log(K)).
+ */
+struct top_heap {
+    int *data;
+    size_t count;
+    size_t capacity;
+};
+
+static void top_heap_sift_down(struct top_heap *h, size_t i) {
+    int val = h->data[i];
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= h->count)
+            break;
+        if (child + 1 < h->count && h->data[child + 1] < h->data[child])
+            ++child;
+        if (val <= h->data[child])
+            break;
+        h->data[i] = h->data[child];
+        i = child;
+    }
+    h->data[i] = val;
+}
+
+/** Offer the `n` numbers of `arr` to the heap. Yields when the time slice is over. */
+static void top_heap_push_n(struct top_heap *h, const int *arr, size_t n) {
+    size_t i = 0;
+    // Filling up: the heap is built once it is full, or at the end of the numbers
+    for (; i < n && h->count < h->capacity; ++i)
+        h->data[h->count++] = arr[i];
+    if (i > 0) {
+        for (size_t j = h->count / 2; j-- > 0;)
+            top_heap_sift_down(h, j);
+        coro_maybe_yield_n(i);
+    }
+    for (; i < n; ++i) {
+        if (arr[i] > h->data[0]) {
+            h->data[0] = arr[i];
+            top_heap_sift_down(h, 0);
         }
+        coro_maybe_yield();
+    }
+}
+
+/*
+ * The cache of the sorted files (`--cache`): each file sorted is also stored to `SORT_CACHE_DIR`,
+ * next to the output, as a run in the `--binary` byte order. It is keyed by the real path of the
+ * file, its mtime and size; the next run takes the file from there instead of sorting it again, if
+ * none of them has changed. The cached runs are `mmap`ed, so it is the final merge which reads
+ * them, once.
+ */
+
+#define SORT_CACHE_DIR "out.cache"
+#define SORT_CACHE_MAGIC "SC32"
+#define SORT_CACHE_VERSION 1
+// Converted by this many numbers at a time when stored on a big-endian machine
+#define SORT_CACHE_CHUNK 4096
+
+/**
+ * Header of a cache file. It is followed by the real path of the sorted file, `path_len` bytes,
+ * and the `count` int32 values from the next multiple of 8 on. Little-endian, like the `--binary`
+ * files.
+ */
+struct sort_cache_header {
+    char magic[4];
+    uint32_t version;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t count;
+    uint32_t path_len;
+    // The same file read as text and as `--binary` gives different numbers (or an error)
+    uint32_t is_binary;
+};
+
+/** A sorted file taken from the cache: the numbers are in the mapping of `map_size` bytes. */
+struct sort_cache_run {
+    void *map;
+    size_t map_size;
+};
+
+inline static size_t sort_cache_data_offset(size_t path_len) {
+    return (sizeof (struct sort_cache_header) + path_len + 7) / 8 * 8;
+}
+
+/**
+ * The real path of `filename` to `key` (of `PATH_MAX` bytes), and the name of its cache file, by
+ * the FNV-1a hash of the key, to `path` (also of `PATH_MAX`).
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int sort_cache_path(const char *filename, char *key, char *path) {
+    if (realpath(filename, key) == NULL) {
+        perror("realpath of input file");
+        return -1;
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = key; *c != '\0'; ++c)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    (void)snprintf(path, PATH_MAX, "%s/%016llx.run", SORT_CACHE_DIR, (unsigned long long)hash);
+    return 0;
+}
+
+/**
+ * The sorted numbers of `filename` read as text or `--binary`, by `is_binary`, from the cache, if
+ * they are there and up to date. The mapping
+ * is stored to `run` for `sort_cache_release`.
+ *
+ * Returns the numbers and stores their count to `count`; `NULL` if they have to be sorted anew.
+ */
+static int *sort_cache_load(const char *filename, bool is_binary, int *count, struct sort_cache_run *run) {
+    char key[PATH_MAX], path[PATH_MAX];
+    struct stat st, cache_st;
+    if (stat(filename, &st) != 0 || sort_cache_path(filename, key, path) != 0)
+        return NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;  // Never sorted, or the cache has been removed
+
+    struct sort_cache_header header;
+    size_t key_len = strlen(key);
+    char stored_key[PATH_MAX];
+    bool is_valid = pread_full(fd, &header, sizeof (header), 0) == 0 &&
+            memcmp(header.magic, SORT_CACHE_MAGIC, 4) == 0 &&
+            le32(header.version) == SORT_CACHE_VERSION &&
+            (int64_t)le64(header.mtime_sec) == st.st_mtim.tv_sec &&
+            (int64_t)le64(header.mtime_nsec) == st.st_mtim.tv_nsec &&
+            le64(header.size) == (uint64_t)st.st_size && le64(header.count) <= INT32_MAX &&
+            le32(header.path_len) == key_len && le32(header.is_binary) == is_binary &&
+            pread_full(fd, stored_key, key_len, sizeof (header)) == 0 &&
+            memcmp(stored_key, key, key_len) == 0;
+    size_t offset = sort_cache_data_offset(key_len);
+    size_t n = le64(header.count);
+    is_valid = is_valid && fstat(fd, &cache_st) == 0 &&
+            (uint64_t)cache_st.st_size == offset + sizeof (int) * n;
+    if (!is_valid) {
+        (void)close(fd);
+        return NULL;
+    }
+
+    // Private and writable: on a big-endian machine the numbers are converted in its pages
+    void *map = mmap(NULL, cache_st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    (void)close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap of a cache file");
+        return NULL;
+    }
+    (void)madvise(map, cache_st.st_size, MADV_SEQUENTIAL);
+    int *arr = (int *)((char *)map + offset);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    binary_to_host(arr, n);
+#endif
+
+    run->map = map;
+    run->map_size = cache_st.st_size;
+    *count = n;
+    return arr;
+}
+
+static void sort_cache_release(struct sort_cache_run *run) {
+    if (run->map != NULL)
+        (void)munmap(run->map, run->map_size);
+    run->map = NULL;
+}
+
+/**
+ * Store the `count` sorted numbers of `filename`, which was as `st` before it was read (as text or
+ * `--binary`, by `is_binary`), to the cache. It is written to a temporary file renamed over the old one, so that an interrupted run
+ * leaves the cache valid. The writes go through `coro_write`.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int sort_cache_store(const char *filename, bool is_binary, const struct stat *st, const int *arr,
+        size_t count) {
+    char key[PATH_MAX], path[PATH_MAX], tmp_path[PATH_MAX + 8];
+    if (sort_cache_path(filename, key, path) != 0)
+        return -1;
+    (void)snprintf(tmp_path, sizeof (tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open of a cache file");
+        return -1;
     }
 
-    while (i < from1 + len1) {
-        *out++ = *i++;
-        // If it's time to, yield, adding the wait time to `wait_time` and updating `next_switch`
-        if (timespec_less(next_switch, /*now*/must_clock_monotonic())) {
-            wait_time = timespec_add(wait_time, coro_yield_timered());
-            next_switch = timespec_add(must_clock_monotonic(), latency);
+    size_t key_len = strlen(key);
+    size_t offset = sort_cache_data_offset(key_len);
+    char head[sizeof (struct sort_cache_header) + PATH_MAX + 8];
+    memset(head, 0, offset);
+    struct sort_cache_header header = {
+        .version = le32(SORT_CACHE_VERSION), .mtime_sec = le64(st->st_mtim.tv_sec),
+        .mtime_nsec = le64(st->st_mtim.tv_nsec), .size = le64(st->st_size), .count = le64(count),
+        .path_len = le32(key_len), .is_binary = le32(is_binary),
+    };
+    memcpy(header.magic, SORT_CACHE_MAGIC, 4);
+    memcpy(head, &header, sizeof (header));
+    memcpy(head + sizeof (header), key, key_len);
+
+    int rc = write_full(fd, head, offset);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int chunk[SORT_CACHE_CHUNK];
+    for (size_t i = 0; i < count && rc == 0; i += SORT_CACHE_CHUNK) {
+        size_t n = count - i < SORT_CACHE_CHUNK ? count - i : SORT_CACHE_CHUNK;
+        for (size_t j = 0; j < n; ++j)
+            chunk[j] = le32((uint32_t)arr[i + j]);
+        rc = write_full(fd, chunk, sizeof (int) * n);
+    }
+#else
+    if (rc == 0)
+        rc = write_full(fd, arr, sizeof (int) * count);
+#endif
+    if (rc != 0)
+        perror("write of a cache file");
+    if (close(fd) != 0 && rc == 0) {
+        perror("close of a cache file");
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp_path, path) != 0) {
+        perror("rename of a cache file");
+        rc = -1;
+    }
+    if (rc != 0)
+        (void)unlink(tmp_path);
+    return rc;
+}
+
+static long long
+sort_file(void *data)
+{
+    struct timespec start = must_clock_monotonic();
+    // The wait before the first run, since `coro_new`, is before `start`
+    struct coro_stats stats;
+    coro_stats(coro_this(), &stats);
+    uint64_t start_wait_ns = stats.wait_ns;
+
+    struct sort_file_inp *dnp = (struct sort_file_inp *)data;
+
+    (void)fprintf(stderr, "Worker %d has entered sort_file()\n", dnp->worker_id);
+
+
+    while (1) {
+        // Parked until the distributor sends a file. The waiting does not count as work
+        void *msg;
+        int rc = coro_chan_recv(dnp->files, &msg);
+        if (rc != 0) {
+            // The channel is closed, which means there are no files left. Nothing to be done
+            (void)fprintf(stderr, "Worker %d didn't receive a file. Terminating\n", dnp->worker_id);
+            break;
+        }
+        size_t file_idx = (uintptr_t)msg;
+        dnp->filename = dnp->filenames[file_idx];
+        (void)fprintf(stderr, "Worker %d got file %s. Starting the work\n", dnp->worker_id, dnp->filename);
+
+        if (dnp->mean_file_size > 0) {
+            // The bigger the file, the sooner the worker has to be resumed, so that the
+            // workers finish at about the same time
+            struct stat st;
+            double size = stat(dnp->filename, &st) == 0 && st.st_size > 0 ? st.st_size : 1;
+            double deadline = timespec_ns(dnp->latency) / 1e9 * dnp->mean_file_size / size;
+            coro_set_deadline(coro_this(), deadline);
         }
+
+        if (dnp->top != NULL) {
+            int count;
+            int *array = load_numbers(dnp->worker_id, dnp->filename, dnp->is_binary, NULL, &count);
+            if (array == NULL)
+                return -1;
+            top_heap_push_n(dnp->top, array, count);
+            free(array);
+        } else if (dnp->run_capacity > 0) {
+            struct timespec sort_start = must_clock_monotonic();
+            size_t numbers, bytes;
+            if (sort_file_external(dnp, &numbers, &bytes) != 0)
+                return -1;
+            double sec = timespec_ns(timespec_diff(must_clock_monotonic(), sort_start)) / 1e9;
+            (void)fprintf(stderr, "Worker %d has sorted %zu numbers (%zu bytes) in %.3fms, %.1f MB/s\n",
+                    dnp->worker_id, numbers, bytes, sec * 1000, sec > 0 ? bytes / sec / 1e6 : 0);
+        } else {
+            // The key is of the file as it was before reading, so that a change meanwhile is seen
+            struct stat st;
+            bool is_cache = dnp->is_cache && stat(dnp->filename, &st) == 0;
+            int *array = load_and_sort(dnp->worker_id, dnp->filename, dnp->is_binary, dnp->is_radix,
+                    &dnp->slots[file_idx], &dnp->resulting_arrays_sizes[file_idx]);
+            if (array == NULL)
+                return -1;
+            dnp->resulting_arrays[file_idx] = array;
+            // Not an error for the sort itself: the file is sorted again next time
+            if (is_cache && sort_cache_store(dnp->filename, dnp->is_binary, &st, array,
+                    dnp->resulting_arrays_sizes[file_idx]) != 0)
+                (void)fprintf(stderr, "Worker %d couldn't cache %s\n", dnp->worker_id, dnp->filename);
+            (void)fprintf(stderr, "Worker %d has finished processing %s\n", dnp->worker_id, dnp->filename);
+        }
+
+        dnp->filename = NULL;
+        coro_set_deadline(coro_this(), 0);  // Nothing to hurry with while waiting
+    }
+
+    struct timespec stop = must_clock_monotonic();
+
+    // Shift start time as if there was no waiting since, be it for a file or for the turn to run
+    coro_stats(coro_this(), &stats);
+    start = timespec_add(start, timespec_from_double((stats.wait_ns - start_wait_ns) / 1e9));
+
+    // Lives in the arena till `coro_delete`, after `main` has read it
+    struct sort_file_res *res = coro_arena_alloc(sizeof (struct sort_file_res));
+    if (res == NULL) {
+        perror("coro_arena_alloc for struct sort_file_res");
+        return -1;
     }
-    while (j < from2 + len2) {
-        *out++ = *j++;
-        // If it's time to, yield, adding the wait time to `wait_time` and updating `next_switch`
-        if (timespec_less(next_switch, /*now*/must_clock_monotonic())) {
-            wait_time = timespec_add(wait_time, coro_yield_timered());
-            next_switch = timespec_add(must_clock_monotonic(), latency);
+
+    res->worker_id = dnp->worker_id;
+    res->switch_count = coro_switch_count(coro_this());
+    res->time_spent = timespec_diff(stop, start);
+    res->slices_count = stats.slice_count;
+    res->slice_avg_us = stats.slice_count ? stats.run_ns / 1000. / stats.slice_count : 0;
+    res->slice_max_us = stats.slice_max_ns / 1000.;
+    return (long long)res;
+}
+
+
+struct distributor_inp {
+    struct coro_chan *files;
+    char **filenames;
+    size_t files_count;
+    // With `--cache`: the files taken from the cache, which are not to be sorted. `NULL` otherwise
+    const bool *is_cached;
+    // With `--processes`: the files are taken from this counter, shared with the other processes,
+    // instead of all in order. `NULL` otherwise
+    unsigned *next_file;
+};
+
+long long distributor(void *data) {
+    /*
+     * The distributor sends the indices of the files to the workers through a channel and
+     * closes it when the files are over. Whichever worker is free takes the next file, the
+     * others are parked in the channel meanwhile and take no turns. Having received the close,
+     * a worker terminates. The workers store the sorted arrays themselves, by the file index.
+     *
+     * A file sent is prefetched: it waits in the channel for a worker, or is taken at once, and
+     * either way is read from the page cache sooner.
+     */
+
+    struct distributor_inp *input = (struct distributor_inp *)data;
+
+    for (size_t n = 0; n < input->files_count; ++n) {
+        size_t i = n;
+        if (input->next_file != NULL) {
+            i = __atomic_fetch_add(input->next_file, 1, __ATOMIC_RELAXED);
+            if (i >= input->files_count)
+                break;
+        }
+        if (input->is_cached != NULL && input->is_cached[i])
+            continue;
+        prefetch_input(input->filenames[i]);
+        if (coro_chan_send(input->files, (void *)(uintptr_t)i) != 0) {
+            perror("coro_chan_send of a file to sort");
+            return -1;
         }
     }
+    coro_chan_close(input->files);
 
-    return wait_time;
+    return 0;
 }
 
 
-struct sort_file_inp {
-    int worker_id;
-    // `filename` set to `NULL` represents that the worker is waiting for a file;
-    // `filename` set to `(char *)-1` represents a worker in an invalid state (uninitialized / terminated);
-    // other values of `filename` shall be treated naturally.
-    char *filename;
-    struct timespec latency;
+struct thread_pool;
+void output_arr(const int *arr, int size, struct thread_pool *pool, int segments_count);
+void output_arr_binary(const int *arr, int size);
 
+#ifdef SORT_THREAD_POOL
+
+/** A file to sort in the thread pool. */
+struct pool_sort_job {
+    int id;
+    const char *filename;
+    // The file of the task after all the running ones, prefetched by this one. `NULL` if none
+    const char *next_filename;
+    bool is_binary;
+    bool is_radix;
     int *array;
     int arr_size;
 };
 
-struct sort_file_res {
-    int worker_id;
-    int switch_count;
-    struct timespec time_spent;
+static void *pool_sort_task(void *arg) {
+    struct pool_sort_job *job = arg;
+    if (job->next_filename != NULL)
+        prefetch_input(job->next_filename);
+    job->array = load_and_sort(job->id, job->filename, job->is_binary, job->is_radix, NULL,
+            &job->arr_size);
+    return job->array;
+}
+
+/** Count of the elements `<= val` (or `< val`, if `is_strict`) in the sorted `arr`. */
+static int count_le(const int *arr, int size, long long val, bool is_strict) {
+    int lo = 0, hi = size;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (is_strict ? arr[mid] < val : arr[mid] <= val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Multiway merge path: find the prefixes of the `k` sorted arrays which together form the first
+ * `rank` elements of their merge, storing the prefix lengths to `cuts`. The boundary value is
+ * found with a binary search over the values, and its duplicates are spread over the arrays.
+ */
+static void merge_path_split(const int **arrays, const int *sizes, int k, long long rank, int *cuts) {
+    long long lo = INT32_MIN, hi = INT32_MAX;
+    // The smallest value with at least `rank` elements <= it
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        long long le = 0;
+        for (int i = 0; i < k; ++i)
+            le += count_le(arrays[i], sizes[i], mid, false);
+        if (le >= rank)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    long long need = rank;
+    for (int i = 0; i < k; ++i) {
+        cuts[i] = count_le(arrays[i], sizes[i], lo, true);
+        need -= cuts[i];
+    }
+    for (int i = 0; i < k && need > 0; ++i) {
+        int equal = count_le(arrays[i], sizes[i], lo, false) - cuts[i];
+        int take = equal < need ? equal : need;
+        cuts[i] += take;
+        need -= take;
+    }
+}
+
+/** One segment of the parallel final merge. */
+struct pool_merge_job {
+    int *out;
+    int k;
+    const int **arrays;
+    int *sizes;
 };
 
-static long long
-sort_file(void *data)
-{
+static void *pool_merge_task(void *arg) {
+    struct pool_merge_job *job = arg;
+    return merge_k(job->out, job->arrays, job->sizes, job->k) == 0 ? job : NULL;
+}
+
+static double elapsed_ms(struct timespec since) {
+    return timespec_ns(timespec_diff(must_clock_monotonic(), since)) / 1e6;
+}
+
+/**
+ * Sort the files with `threads_count` threads of the thread pool from the assignment 4 instead of
+ * the coroutines. Each file is a task; then the output is split into `threads_count` equal
+ * segments by the merge path, and each segment is merged by its own task.
+ */
+static int sort_in_thread_pool(char **filenames, int files_count, int threads_count, bool is_binary,
+        bool is_radix) {
     struct timespec start = must_clock_monotonic();
+    if (threads_count > TPOOL_MAX_THREADS)
+        threads_count = TPOOL_MAX_THREADS;
+    struct thread_pool *pool;
+    if (thread_pool_new(threads_count, &pool) != 0) {
+        fputs("Error: can't create a thread pool\n", stderr);
+        return 1;
+    }
+
+    struct pool_sort_job sort_jobs[files_count];
+    struct thread_task *tasks[files_count > threads_count ? files_count : threads_count];
+    int rc = 0;
+    for (int i = 0; i < files_count; ++i) {
+        sort_jobs[i] = (struct pool_sort_job){ .id = i, .filename = filenames[i], .is_binary = is_binary,
+            .is_radix = is_radix };
+        if (i + threads_count < files_count)
+            sort_jobs[i].next_filename = filenames[i + threads_count];
+        (void)thread_task_new(&tasks[i], pool_sort_task, &sort_jobs[i]);
+        if (thread_pool_push_task(pool, tasks[i]) != 0) {
+            fputs("Error: can't push a task\n", stderr);
+            return 1;
+        }
+    }
+    long long total = 0;
+    const int *arrays[files_count];
+    int sizes[files_count];
+    for (int i = 0; i < files_count; ++i) {
+        void *res;
+        (void)thread_task_join(tasks[i], &res);
+        (void)thread_task_delete(tasks[i]);
+        if (res == NULL)
+            rc = 1;
+        arrays[i] = sort_jobs[i].array;
+        sizes[i] = sort_jobs[i].arr_size;
+        total += sizes[i];
+    }
+    double sort_ms = elapsed_ms(start);
+
+    struct timespec merge_start = must_clock_monotonic();
+    int *sorted = malloc(sizeof (int) * (total > 0 ? total : 1));
+    int *cuts = malloc(sizeof (int) * files_count * (threads_count + 1));
+    int *seg_sizes = malloc(sizeof (int) * files_count * threads_count);
+    const int **seg_arrays = malloc(sizeof (int *) * files_count * threads_count);
+    if (sorted == NULL || cuts == NULL || seg_sizes == NULL || seg_arrays == NULL) {
+        perror("malloc for the parallel merge");
+        return 1;
+    }
+    hugepages_advise(sorted, sizeof (int) * total);
+    for (int t = 0; t <= threads_count && rc == 0; ++t)
+        merge_path_split(arrays, sizes, files_count, total * t / threads_count, cuts + t * files_count);
+
+    struct pool_merge_job merge_jobs[threads_count];
+    for (int t = 0; t < threads_count && rc == 0; ++t) {
+        const int *from = cuts + t * files_count, *to = from + files_count;
+        for (int i = 0; i < files_count; ++i) {
+            seg_arrays[t * files_count + i] = arrays[i] + from[i];
+            seg_sizes[t * files_count + i] = to[i] - from[i];
+        }
+        merge_jobs[t] = (struct pool_merge_job){ .out = sorted + total * t / threads_count,
+            .k = files_count, .arrays = seg_arrays + t * files_count, .sizes = seg_sizes + t * files_count };
+        (void)thread_task_new(&tasks[t], pool_merge_task, &merge_jobs[t]);
+        if (thread_pool_push_task(pool, tasks[t]) != 0) {
+            fputs("Error: can't push a task\n", stderr);
+            return 1;
+        }
+    }
+    for (int t = 0; t < threads_count && rc == 0; ++t) {
+        void *res;
+        (void)thread_task_join(tasks[t], &res);
+        (void)thread_task_delete(tasks[t]);
+        if (res == NULL)
+            rc = 1;
+    }
+    double merge_ms = elapsed_ms(merge_start);
+
+    struct timespec output_start = must_clock_monotonic();
+    if (rc == 0) {
+        if (is_binary)
+            output_arr_binary(sorted, total);
+        else
+            output_arr(sorted, total, pool, threads_count);
+    }
+    double output_ms = elapsed_ms(output_start);
+    (void)thread_pool_delete(pool);
+
+    printf("Thread pool of %d threads: sorted in %.3fms, merged in %.3fms, written in %.3fms, "
+            "total %.3fms\n", threads_count, sort_ms, merge_ms, output_ms, elapsed_ms(start));
+    for (int i = 0; i < files_count; ++i)
+        free((int *)arrays[i]);
+    free(sorted);
+    free(cuts);
+    free(seg_sizes);
+    free(seg_arrays);
+    return rc;
+}
+
+#endif
+int merge_runs(const struct spill_runs *runs, size_t mem_limit, bool is_binary, bool is_unique);
+int merge_k_output(const int **arrays, const int *sizes, int k, bool is_binary, bool is_unique);
+
+/**
+ * Set the capacities of the `slots` of the files. The bound of the numbers count of a text file is
+ * half its size rounded up (a digit and a separator per number, none after the last one), of a
+ * binary file it's a quarter. One more is left, for `parse_ints` to see the numbers end. The bound can
+ * be much bigger than the real count, but the pages which are never written to are not backed by
+ * memory, so only the virtual address space is reserved in excess.
+ *
+ * Returns the total capacity; 0 if some file has no size.
+ */
+static size_t measure_output_slots(char **filenames, int count, bool is_binary, struct output_slot *slots) {
+    size_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        struct stat st;
+        if (stat(filenames[i], &st) != 0 || !S_ISREG(st.st_mode))
+            return 0;
+        size_t size = st.st_size;
+        slots[i].capacity = (is_binary ? size / sizeof (int) : (size + 1) / 2) + 1;
+        total += slots[i].capacity;
+    }
+    return total;
+}
+
+/** Cut the `arena` into the `slots` measured by `measure_output_slots`. */
+static void place_output_slots(int *arena, int count, struct output_slot *slots) {
+    size_t offset = 0;
+    for (int i = 0; i < count; ++i) {
+        slots[i].data = arena + offset;
+        offset += slots[i].capacity;
+    }
+}
+
+/**
+ * Allocate the output arena and cut it into `slots` for the files.
+ *
+ * Returns the arena to `free`; `NULL` if some file has no size (then the files are loaded to the
+ * heap as usual).
+ */
+static int *alloc_output_slots(char **filenames, int count, bool is_binary, struct output_slot *slots) {
+    size_t total = measure_output_slots(filenames, count, is_binary, slots);
+    if (total == 0)
+        return NULL;
+    int *arena = malloc(sizeof (int) * total);
+    if (arena == NULL)
+        return NULL;
+    hugepages_advise(arena, sizeof (int) * total);
+    place_output_slots(arena, count, slots);
+    return arena;
+}
+
+/*
+ * `--processes=N`: the files are sorted by N processes, `main` and N - 1 children forked by it, each
+ * with its own heap and its own coroutines. The slots of all the files are in a `memfd` mapped by
+ * all of them, so a child sorts a file right where `main` merges it from: nothing is sent back. The
+ * processes take the files one at a time from a counter in the same memory.
+ */
+
+/** The beginning of the memory shared by the `--processes`, the slots of the files follow it. */
+struct process_share {
+    // The next file to be sorted, by whichever process takes it first
+    unsigned next_file;
+    // The count of the numbers a child has sorted into the slot of each file, -1 if none
+    int counts[];
+};
+
+/**
+ * Create the shared memory for the `--processes` and cut `slots` for the files in it. The size of
+ * the mapping is stored to `map_size`.
+ *
+ * Returns the mapping; `NULL` on error (after reporting it).
+ */
+static struct process_share *process_share_new(char **filenames, int count, bool is_binary,
+        struct output_slot *slots, size_t *map_size) {
+    size_t total = measure_output_slots(filenames, count, is_binary, slots);
+    if (total == 0) {
+        fputs("Error: --processes needs the regular input files\n", stderr);
+        return NULL;
+    }
+    size_t header = offsetof(struct process_share, counts) + sizeof (int) * count;
+    header = (header + 63) & ~(size_t)63;
+    *map_size = header + sizeof (int) * total;
+
+    int fd = memfd_create("sort", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+    struct process_share *share = MAP_FAILED;
+    if (ftruncate(fd, *map_size) != 0)
+        perror("ftruncate of the memfd");
+    else if ((share = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        perror("mmap of the memfd");
+    (void)close(fd);
+    if (share == MAP_FAILED)
+        return NULL;
+
+    share->next_file = 0;
+    for (int i = 0; i < count; ++i)
+        share->counts[i] = -1;
+    place_output_slots((int *)((char *)share + header), count, slots);
+    return share;
+}
+
+/**
+ * Fork the `count - 1` children of the `--processes`, their pids go to `pids`. Returns the index of
+ * the process in the child (from 1), 0 in `main`; -1 if a fork has failed (after reporting it), then
+ * the children forked are in `pids` still.
+ */
+static int fork_processes(int count, pid_t *pids) {
+    // Or the child would have a copy of the output buffered so far, and would print it again
+    (void)fflush(stdout);
+    for (int i = 1; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork of a sorting process");
+            for (int j = i; j < count; ++j)
+                pids[j] = -1;
+            return -1;
+        }
+        if (pid == 0)
+            return i;
+        pids[i] = pid;
+    }
+    return 0;
+}
+
+/**
+ * In `main`: wait for the children of the `--processes`, and point the results of the files they
+ * have sorted to the slots. `resulting_arrays[i]` is `NULL` for them so far.
+ *
+ * Returns 0 on success, -1 if some child or some file has failed (after reporting it).
+ */
+static int join_processes(int count, const pid_t *pids, const struct process_share *share,
+        const struct output_slot *slots, int files_count, int **resulting_arrays, int *resulting_arrays_sizes) {
+    int rc = 0;
+    for (int i = 1; i < count; ++i) {
+        int status;
+        if (pids[i] < 0) {
+            rc = -1;
+        } else if (waitpid(pids[i], &status, 0) < 0) {
+            perror("waitpid of a sorting process");
+            rc = -1;
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            (void)fprintf(stderr, "Error: sorting process %d has failed\n", i);
+            rc = -1;
+        }
+    }
+    for (int i = 0; i < files_count && rc == 0; ++i) {
+        if (resulting_arrays[i] != NULL)
+            continue;  // Sorted by `main` itself
+        if (share->counts[i] < 0) {
+            fputs("Error: a file has not been sorted by any process\n", stderr);
+            rc = -1;
+            break;
+        }
+        resulting_arrays[i] = slots[i].data;
+        resulting_arrays_sizes[i] = share->counts[i];
+    }
+    return rc;
+}
+
+/**
+ * Reorder the files from the largest to the smallest (insertion sort: there are few of them).
+ *
+ * Returns their average size in bytes.
+ */
+static double sort_by_size_desc(char **filenames, int count) {
+    off_t sizes[count];
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        struct stat st;
+        sizes[i] = stat(filenames[i], &st) == 0 ? st.st_size : 0;
+        total += sizes[i];
+    }
+    for (int i = 1; i < count; ++i) {
+        for (int j = i; j > 0 && sizes[j - 1] < sizes[j]; --j) {
+            SWAP(off_t, sizes[j - 1], sizes[j]);
+            SWAP(char *, filenames[j - 1], filenames[j]);
+        }
+    }
+    return count > 0 ? total / count : 0;
+}
+
+/**
+ * Parse a size like `512M`: a number of bytes, optionally with a binary K/M/G suffix.
+ *
+ * Returns 0 on error.
+ */
+static size_t parse_size(const char *str) {
+    char *end;
+    double val = strtod(str, &end);
+    switch (*end) {
+    case 'G': case 'g': val *= 1024;  // fallthrough
+    case 'M': case 'm': val *= 1024;  // fallthrough
+    case 'K': case 'k': val *= 1024;
+        ++end;
+        break;
+    }
+    if (*end != '\0' || val < 1)
+        return 0;
+    return val;
+}
+
+/**
+ * Parse the `--range` of the numbers to keep: `lo..hi`, either of them can be omitted for no bound
+ * on that side. Sets `range_lo` and `range_hi`.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_range(const char *str) {
+    const char *dots = strstr(str, "..");
+    if (dots == NULL)
+        return -1;
+    long long lo = INT_MIN, hi = INT_MAX;
+    char *end = (char *)dots;
+    if (dots != str)
+        lo = strtoll(str, &end, 10);
+    if (end != dots)
+        return -1;
+    if (dots[2] != '\0') {
+        hi = strtoll(dots + 2, &end, 10);
+        if (*end != '\0')
+            return -1;
+    }
+    if (lo < INT_MIN || hi > INT_MAX || lo > hi)
+        return -1;
+    range_lo = lo;
+    range_hi = hi;
+    return 0;
+}
+
+/**
+ * Final phase of `--top`: merge the heaps of the `count` workers and output the biggest `k` numbers
+ * of them sorted, which are the same as the last `k` numbers of the whole sorted output. Frees the
+ * heaps.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int output_top(struct top_heap *tops, int count, size_t k, bool is_binary, bool is_radix) {
+    size_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += tops[i].count;
+    int *all = malloc(sizeof (int) * (total > 0 ? total : 1));
+    int *aux = malloc(sizeof (int) * (total > 0 ? total : 1));
+    int rc = 0;
+    if (all == NULL || aux == NULL) {
+        perror("malloc for the top numbers");
+        rc = -1;
+    } else {
+        size_t n = 0;
+        for (int i = 0; i < count; ++i) {
+            memcpy(all + n, tops[i].data, sizeof (int) * tops[i].count);
+            n += tops[i].count;
+        }
+        int *sorted = total > 0 ? sort_numbers(all, aux, total, is_radix) : all;
+        size_t shown = total < k ? total : k;
+        printf("Top: %zu of the %zu numbers kept by the workers\n", shown, total);
+        if (is_binary)
+            output_arr_binary(sorted + total - shown, shown);
+        else
+            output_arr(sorted + total - shown, shown, NULL, 1);
+    }
+    free(all);
+    free(aux);
+    for (int i = 0; i < count; ++i)
+        free(tops[i].data);
+    return rc;
+}
+
+/*
+ * The pipeline sort (`--pipeline`): instead of the phases one after another (load and sort all the
+ * files, then merge them), the work flows through four kinds of stages connected by bounded
+ * channels, so that all of them run at once:
+ *
+ *     reader -> chunks -> sorters -> runs -> merger -> blocks -> writer
+ *
+ * The reader parses the files into chunks of `PIPELINE_CHUNK` numbers, independent of the file
+ * boundaries. Each sorter sorts the chunks it takes. The merger merges the sorted runs as they
+ * come, and when they are all there, streams the final k-way merge of what is left as blocks to
+ * the writer. The channels are short, so a slow stage holds back the ones before it instead of
+ * the memory growing.
+ *
+ * All the stages are coroutines, the file reads and writes go through `coro_read` and `coro_write`,
+ * so they are done by the I/O thread of libcoro while the CPU stages go on with their time slices.
+ */
+
+#define PIPELINE_CHUNK (1 << 17)
+#define PIPELINE_BLOCK (1 << 16)
+
+/** What the stages pass each other: a chunk to sort, a sorted run or a block of the output. */
+struct pipeline_piece {
+    int *data;
+    size_t count;
+};
+
+/** When a stage (all the coroutines of it) started and finished. */
+struct pipeline_stage {
+    struct timespec start;
+    struct timespec end;
+    bool is_started;
+};
+
+struct pipeline {
+    char **filenames;
+    int files_count;
+    bool is_binary;
+    bool is_radix;
+    struct timespec latency;
+
+    struct coro_chan *chunks;
+    struct coro_chan *runs;
+    struct coro_chan *blocks;
+    // The sorters still running. The reader, done with the chunks, waits for them to close `runs`
+    struct coro_wg *sorting;
+    // The count of all the numbers, known to the writer when the first block comes
+    long long total;
+    bool is_failed;
 
-    struct sort_file_inp *dnp = (struct sort_file_inp *)data;
+    struct pipeline_stage reader, sorters, merger, writer;
+};
 
-    (void)fprintf(stderr, "Worker %d has entered sort_file()\n", dnp->worker_id);
+static void pipeline_stage_start(struct pipeline_stage *stage) {
+    if (!stage->is_started)
+        stage->start = must_clock_monotonic();
+    stage->is_started = true;
+}
 
-    dnp->filename = NULL;  // Initialized.
+static void pipeline_stage_end(struct pipeline_stage *stage) {
+    stage->end = must_clock_monotonic();
+}
 
-    while (1) {
-        coro_yield();
+/** A stage has failed: everything still moving through the pipeline is dropped. */
+static void pipeline_fail(struct pipeline *p) {
+    p->is_failed = true;
+    coro_chan_close(p->chunks);
+    coro_chan_close(p->runs);
+    coro_chan_close(p->blocks);
+}
 
-        if (dnp->filename == NULL) {
-            // Still not assigned, which means there are no files left. Nothing to be done
-            (void)fprintf(stderr, "Worker %d didn't receive a file. Terminating\n", dnp->worker_id);
-            dnp->filename = (char *)-1;  // Termination indication
-            break;
-        } else {
-            (void)fprintf(stderr, "Worker %d got file %s. Starting the work\n", dnp->worker_id, dnp->filename);
-        }
+static struct pipeline_piece *pipeline_piece_new(size_t capacity) {
+    struct pipeline_piece *piece = malloc(sizeof (*piece));
+    int *data = malloc(sizeof (int) * (capacity > 0 ? capacity : 1));
+    if (piece == NULL || data == NULL) {
+        perror("malloc for a pipeline piece");
+        free(piece);
+        free(data);
+        return NULL;
+    }
+    piece->data = data;
+    piece->count = 0;
+    return piece;
+}
 
-        FILE *f = fopen(dnp->filename, "r");
-        if (f == NULL) {
-            perror("fopen of input file");
-            return -1;
-        }
+static void pipeline_piece_delete(struct pipeline_piece *piece) {
+    free(piece->data);
+    free(piece);
+}
 
-        // The previous values of array and arr_size were taken by distributor
-        int *unsorted = NULL;
-        int arr_size = 0;
-        int arr_idx = 0;
-
-        int val;
-        while(1 == fscanf(f, "%d", &val)) {
-            if (arr_idx >= arr_size) {
-                arr_size = 1 + arr_size * 2;
-                unsorted = (int *)realloc(unsorted, arr_size * sizeof (int));
-                if (unsorted == NULL) {
-                    perror("reallocarray");
-                    return -1;
-                }
-            }
-            unsorted[arr_idx++] = val;
-        }
+/** Send `piece` to `ch`, deleting it if it can't be sent. Returns 0 on success, -1 otherwise. */
+static int pipeline_send(struct coro_chan *ch, struct pipeline_piece *piece) {
+    if (coro_chan_send(ch, piece) == 0)
+        return 0;
+    pipeline_piece_delete(piece);
+    return -1;
+}
+
+/** Delete the pieces left in `ch` after a failure. */
+static void pipeline_drain(struct coro_chan *ch) {
+    void *msg;
+    while (coro_chan_recv(ch, &msg) == 0)
+        pipeline_piece_delete(msg);
+}
+
+/** The chunk the reader is filling, it becomes a piece when it is sent. */
+struct pipeline_reader {
+    struct pipeline *p;
+    int *data;
+    size_t count;
+};
 
-        (void)fclose(f);
-        (void)fprintf(stderr, "Worker %d has read %d numbers\n", dnp->worker_id, arr_idx);
+/** Send the chunk to the sorters, if there is anything in it, and start a new one. */
+static int pipeline_reader_flush(void *ctx) {
+    struct pipeline_reader *r = ctx;
+    if (r->count == 0)
+        return 0;
+    struct pipeline_piece *piece = pipeline_piece_new(PIPELINE_CHUNK);
+    if (piece == NULL)
+        return -1;
+    SWAP(int *, piece->data, r->data);
+    piece->count = r->count;
+    r->count = 0;
+    return pipeline_send(r->p->chunks, piece);
+}
 
-        dnp->array = malloc(sizeof (int) * arr_idx);
-        if (dnp->array == NULL) {
-            perror("malloc for new dnp->sorted array");
+/** Read the binary file `fd` into the chunks. */
+static int pipeline_read_binary(struct pipeline_reader *r, int fd, const char *filename) {
+    long long left = read_binary_header(fd, filename);
+    if (left < 0)
+        return -1;
+    while (left > 0) {
+        size_t room = PIPELINE_CHUNK - r->count;
+        size_t n = (size_t)left < room ? (size_t)left : room;
+        int *to = r->data + r->count;
+        ssize_t got = read_full(fd, to, sizeof (int) * n);
+        if (got != (ssize_t)(sizeof (int) * n)) {
+            if (got < 0)
+                perror("read of input file");
+            else
+                (void)fprintf(stderr, "Error: %s is truncated\n", filename);
             return -1;
         }
+        r->count += binary_to_host_in_range(to, n);
+        coro_maybe_yield_n(n);
+        left -= n;
+        if (r->count == PIPELINE_CHUNK && pipeline_reader_flush(r) != 0)
+            return -1;
+    }
+    return 0;
+}
 
-        // Truncate the unread numbers. There is no memory safety problem: libc still remembers
-        // the actual amount of memory to free.
-        dnp->arr_size = arr_idx;
-
-        struct timespec wait_time = merge(dnp->array, unsorted, arr_idx, NULL, 0, true, dnp->latency);
+static long long pipeline_reader_f(void *arg) {
+    struct pipeline *p = arg;
+    pipeline_stage_start(&p->reader);
 
-        free(unsorted);
+    struct pipeline_reader r = { .p = p, .data = malloc(sizeof (int) * PIPELINE_CHUNK) };
+    int rc = 0;
+    if (r.data == NULL) {
+        perror("malloc for a pipeline chunk");
+        rc = -1;
+    }
+    for (int i = 0; i < p->files_count && rc == 0; ++i) {
+        if (i + 1 < p->files_count)
+            prefetch_input(p->filenames[i + 1]);
+        int fd = open_input(p->filenames[i]);
+        if (fd < 0) {
+            perror("open of input file");
+            rc = -1;
+            break;
+        }
+        size_t arena_mark = coro_arena_used();
+        size_t bytes = 0;
+        if (p->is_binary)
+            rc = pipeline_read_binary(&r, fd, p->filenames[i]);
+        else
+            rc = read_text_numbers(fd, &r.data, &r.count, PIPELINE_CHUNK, pipeline_reader_flush, &r,
+                    &bytes);
+        coro_arena_truncate(arena_mark);
+        (void)close(fd);
+    }
+    if (rc == 0)
+        rc = pipeline_reader_flush(&r);
+    free(r.data);
+
+    if (rc != 0)
+        pipeline_fail(p);
+    coro_chan_close(p->chunks);
+    pipeline_stage_end(&p->reader);
+
+    (void)coro_wg_wait(p->sorting);
+    coro_chan_close(p->runs);
+    pipeline_stage_end(&p->sorters);
+    return rc;
+}
 
-        // Shift start time as if there was no waiting
-        start = timespec_add(start, wait_time);
+static long long pipeline_sorter_f(void *arg) {
+    struct pipeline *p = arg;
+    pipeline_stage_start(&p->sorters);
 
-        (void)fprintf(stderr, "Worker %d has finished processing %s\n", dnp->worker_id, dnp->filename);
-        dnp->filename = NULL;  // Signal that I want the next file
+    int rc = 0;
+    int *aux = malloc(sizeof (int) * PIPELINE_CHUNK);
+    if (aux == NULL) {
+        perror("malloc for the merge sort buffer");
+        rc = -1;
+    }
+    void *msg;
+    while (rc == 0 && coro_chan_recv(p->chunks, &msg) == 0) {
+        struct pipeline_piece *piece = msg;
+        int *sorted = sort_numbers(piece->data, aux, piece->count, p->is_radix);
+        // The chunks and the buffer are of the same size, so the sorted one simply becomes the run
+        if (sorted == aux)
+            SWAP(int *, piece->data, aux);
+        if (pipeline_send(p->runs, piece) != 0)
+            rc = -1;
     }
+    free(aux);
 
-    struct timespec stop = must_clock_monotonic();
+    if (rc != 0)
+        pipeline_fail(p);
+    coro_wg_done(p->sorting);
+    return rc;
+}
 
-    struct sort_file_res *res = malloc(sizeof (struct sort_file_res));
-    if (res == NULL) {
-        perror("malloc for struct sort_file_res");
+/**
+ * The final merge of the runs left on the merger's stack: streamed to the writer block by block.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int pipeline_merge_out(struct pipeline *p, struct pipeline_piece **stack, int k) {
+    struct loser_tree t;
+    if (k == 0)
+        return 0;
+    if (loser_tree_alloc(&t, k) != 0)
         return -1;
+    long long left = 0;
+    for (int i = 0; i < k; ++i) {
+        t.pos[i] = stack[i]->data;
+        t.end[i] = stack[i]->data + stack[i]->count;
+        left += stack[i]->count;
+    }
+    t.tree[0] = loser_tree_build(&t, 1);
+
+    int rc = 0;
+    while (left > 0) {
+        size_t n = left < PIPELINE_BLOCK ? left : PIPELINE_BLOCK;
+        struct pipeline_piece *block = pipeline_piece_new(n);
+        if (block == NULL) {
+            rc = -1;
+            break;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            int winner = t.tree[0];
+            block->data[i] = *t.pos[winner]++;
+            loser_tree_replay(&t, winner);
+        }
+        block->count = n;
+        coro_maybe_yield_n(n);
+        left -= n;
+        if (pipeline_send(p->blocks, block) != 0) {
+            rc = -1;
+            break;
+        }
     }
 
-    res->worker_id = dnp->worker_id;
-    res->switch_count = coro_switch_count(coro_this());
-    res->time_spent = timespec_diff(stop, start);
-    return (long long)res;
+    loser_tree_free(&t);
+    return rc;
 }
 
+/**
+ * The runs are kept on a stack with the sizes decreasing from the bottom: a new run is merged with
+ * the top one while it is not smaller, like the carries of a binary counter. So each number is
+ * merged O(log(runs)) times, and the merging goes on while the files are still being read.
+ */
+static long long pipeline_merger_f(void *arg) {
+    struct pipeline *p = arg;
+    pipeline_stage_start(&p->merger);
+
+    // The sizes at least double down the stack, so 64 levels are more than any count of numbers
+    struct pipeline_piece *stack[64];
+    int top = 0;
+    int rc = 0;
+    void *msg;
+    while (coro_chan_recv(p->runs, &msg) == 0) {
+        stack[top++] = msg;
+        while (top >= 2 && stack[top - 2]->count <= stack[top - 1]->count) {
+            struct pipeline_piece *a = stack[top - 2], *b = stack[top - 1];
+            struct pipeline_piece *merged = pipeline_piece_new(a->count + b->count);
+            if (merged == NULL) {
+                rc = -1;
+                break;
+            }
+            sort_int_merge(merged->data, a->data, a->count, b->data, b->count);
+            merged->count = a->count + b->count;
+            pipeline_piece_delete(a);
+            pipeline_piece_delete(b);
+            stack[--top - 1] = merged;
+        }
+        if (rc != 0)
+            break;
+    }
 
-struct distributor_inp {
-    struct sort_file_inp *dnps;
-    int workers_count;
+    if (rc == 0 && !p->is_failed) {
+        p->total = 0;
+        for (int i = 0; i < top; ++i)
+            p->total += stack[i]->count;
+        rc = pipeline_merge_out(p, stack, top);
+    }
+    for (int i = 0; i < top; ++i)
+        pipeline_piece_delete(stack[i]);
+
+    if (rc != 0)
+        pipeline_fail(p);
+    coro_chan_close(p->blocks);
+    pipeline_stage_end(&p->merger);
+    return rc;
+}
 
-    char **filenames;
-    size_t files_count;
+static int write_binary_header(int fd, uint64_t count) {
+    struct binary_header header = { .version = le32(BINARY_VERSION), .count = le64(count) };
+    memcpy(header.magic, BINARY_MAGIC, 4);
+    return write_full(fd, &header, sizeof (header));
+}
 
-    // At least `files_count` elements must be allocated for `resulting_arrays*`
-    int **resulting_arrays;
-    int *resulting_arrays_sizes;
-};
+// "00" to "99": the digits are formatted by pairs, with half the divisions
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
 
-long long distributor(void *data) {
-    /*
-     * The idea is as follows. My (patched) version of libcoro guarantees that the coroutines are
-     * executed in the same order, wrapping (i.e. round robin manner where coroutines never only
-     * join or quit, never swap). If a coroutine returns, the control is first handed to the
-     * scheduler, then passed onto the former-next of the returned coroutine.
-     *
-     * When a worker coroutine is done processing a file, it signals so by setting its
-     * `input->filename` to `NULL` and gives control to the next coroutine. When the yields wrap,
-     * the execution reaches the distributor coroutine (this one), which sets the `filename`s for
-     * all workers which are ready. The arrays produced by the worker coroutines are collected by
-     * `distributor` to its input's `->resulting_arrays`.
-     *
-     * When the distributor is out of files, it continues to collect the sorted arrays, counting
-     * each worker getting free. As they are not given new files, the free workers will terminate,
-     * **setting `->filename` to `-1`** (that is to make it simpler to distinguish between the
-     * coroutines which just requested a new file from the ones that already terminated without
-     * getting one previously).
-     * The distributor counts the number of terminated workers and, when they are all finished,
-     * returns `0LL`.
-     */
+/** The count of the decimal digits of `u`. Branchless. */
+inline static size_t count_digits(unsigned u) {
+    return 1 + (u >= 10) + (u >= 100) + (u >= 1000) + (u >= 10000) + (u >= 100000) + (u >= 1000000) +
+        (u >= 10000000) + (u >= 100000000) + (u >= 1000000000);
+}
 
-    struct distributor_inp *input = (struct distributor_inp *)data;
+/** The length of `val` formatted by `format_int`. */
+inline static size_t format_int_len(int val) {
+    return (val < 0) + count_digits(val < 0 ? -(unsigned)val : (unsigned)val);
+}
+
+/** Format `val` to `out`, which has room for it. Returns the length. */
+inline static size_t format_int(char *out, int val) {
+    unsigned u = val < 0 ? -(unsigned)val : (unsigned)val;
+    size_t len = (val < 0) + count_digits(u);
+    *out = '-';
+    // From the last digit back
+    char *p = out + len;
+    while (u >= 100) {
+        unsigned q = u / 100;
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * (u - q * 100), 2);
+        u = q;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * u, 2);
+    } else {
+        *--p = '0' + u;
+    }
+    return len;
+}
 
-    int alive_workers_count = input->workers_count;
-
-    size_t next_file = 0;
-    size_t next_res = 0;
-
-    while (alive_workers_count) {
-        for (int i = 0; i < input->workers_count; ++i) {
-            // 0. Find a worker that is in a valid state and wants a file
-            if (input->dnps[i].filename == NULL) {
-                // 1. If there is a new result (i.e. not the very first round of worker), store it
-                if (input->dnps[i].array != NULL) {
-                    input->resulting_arrays[next_res] = input->dnps[i].array;
-                    input->resulting_arrays_sizes[next_res] = input->dnps[i].arr_size;
-                    ++next_res;
-                }
-
-                // 2. If there is a file to process, give it to the worker, otherwise
-                // consider it terminated.
-                if (next_file < input->files_count) {
-                    input->dnps[i].filename = input->filenames[next_file++];
-                } else {
-                    alive_workers_count--;
-                }
+static long long pipeline_writer_f(void *arg) {
+    struct pipeline *p = arg;
+    pipeline_stage_start(&p->writer);
+
+    const char *name = p->is_binary ? "out.bin" : "out.txt";
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    // At most 11 characters and the separator per number
+    char *text = p->is_binary ? NULL : coro_arena_alloc(12 * PIPELINE_BLOCK);
+    int rc = 0;
+    if (fd < 0) {
+        perror("open of the output file");
+        rc = -1;
+    } else if (!p->is_binary && text == NULL) {
+        perror("coro_arena_alloc for the output");
+        rc = -1;
+    }
+    bool is_open = rc == 0;
+
+    bool is_first = true;
+    void *msg;
+    while (rc == 0 && coro_chan_recv(p->blocks, &msg) == 0) {
+        struct pipeline_piece *block = msg;
+        if (p->is_binary) {
+            // The merger has counted all the numbers before sending the first block
+            if (is_first)
+                rc = write_binary_header(fd, p->total);
+            for (size_t i = 0; i < block->count; ++i)
+                block->data[i] = le32((uint32_t)block->data[i]);
+            if (rc == 0)
+                rc = write_full(fd, block->data, sizeof (int) * block->count);
+        } else {
+            size_t len = 0;
+            for (size_t i = 0; i < block->count; ++i) {
+                if (!is_first || i > 0)
+                    text[len++] = ' ';
+                len += format_int(text + len, block->data[i]);
             }
+            coro_maybe_yield_n(block->count);
+            rc = write_full(fd, text, len);
         }
-
-        coro_yield();
+        is_first = false;
+        pipeline_piece_delete(block);
+    }
+    if (rc == 0 && !p->is_failed) {
+        if (!p->is_binary)
+            rc = write_full(fd, "\n", 1);
+        else if (is_first)
+            rc = write_binary_header(fd, 0);
+    }
+    if (rc != 0 && is_open)
+        perror("write of the output file");
+    if (fd >= 0 && close(fd) != 0 && rc == 0) {
+        perror("close of the output file");
+        rc = -1;
     }
 
-    return 0;
+    if (rc != 0)
+        pipeline_fail(p);
+    pipeline_stage_end(&p->writer);
+    return rc;
+}
+
+inline static double pipeline_ms(struct timespec t, struct timespec start) {
+    return timespec_ns(timespec_diff(t, start)) / 1e6;
 }
 
+/**
+ * Sort the files by the pipeline of a reader, `sorters_count` sorters, a merger and a writer, see
+ * above. Requires `coro_sched_init()`, waits for all the coroutines there are.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+static int sort_pipeline(char **filenames, int files_count, int sorters_count, bool is_binary,
+        bool is_radix, struct timespec latency) {
+    struct timespec start = must_clock_monotonic();
+    struct pipeline p = {
+        .filenames = filenames, .files_count = files_count, .is_binary = is_binary,
+        .is_radix = is_radix, .latency = latency, .sorting = coro_wg_new(),
+        // A chunk in flight for each sorter, and one block being merged while one is written
+        .chunks = coro_chan_new(sorters_count), .runs = coro_chan_new(sorters_count),
+        .blocks = coro_chan_new(2),
+    };
+    if (p.chunks == NULL || p.runs == NULL || p.blocks == NULL) {
+        perror("coro_chan_new for the pipeline");
+        p.is_failed = true;
+    } else {
+        coro_wg_add(p.sorting, sorters_count);
+        coro_new(pipeline_reader_f, &p);
+        for (int i = 0; i < sorters_count; ++i)
+            coro_new(pipeline_sorter_f, &p);
+        coro_new(pipeline_merger_f, &p);
+        coro_new(pipeline_writer_f, &p);
+    }
 
-void output_arr(const int *arr, int size);
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        if (coro_status(c) != 0)
+            p.is_failed = true;
+        coro_delete(c);
+    }
+    struct pipeline_stage *stages[] = { &p.reader, &p.sorters, &p.merger, &p.writer };
+    const char *names[] = { "reader", "sorters", "merger", "writer" };
+    for (int i = 0; i < 4; ++i) {
+        if (stages[i]->is_started)
+            (void)printf("Pipeline %s: %.3fms to %.3fms\n", names[i],
+                    pipeline_ms(stages[i]->start, start), pipeline_ms(stages[i]->end, start));
+    }
+    (void)printf("Pipeline total: %.3fms\n", pipeline_ms(must_clock_monotonic(), start));
+
+    struct coro_chan *chans[] = { p.chunks, p.runs, p.blocks };
+    for (int i = 0; i < 3; ++i) {
+        if (chans[i] == NULL)
+            continue;
+        coro_chan_close(chans[i]);
+        pipeline_drain(chans[i]);
+        coro_chan_delete(chans[i]);
+    }
+    coro_wg_delete(p.sorting);
+    return p.is_failed ? -1 : 0;
+}
 
 int
 main(int argc, char **argv)
@@ -317,6 +2221,74 @@ main(int argc, char **argv)
     _Static_assert (sizeof (long long) == sizeof (void *), "`long long` is expected to be pointer-sized: "
             "coroutine functions can't return pointers");
 
+    // Options go before the positional arguments
+    bool is_binary = false;
+    bool is_thread_pool = false;
+    bool is_coro_stats_dump = false;
+    bool is_edf = false;
+    bool is_radix = false;
+    bool is_pipeline = false;
+    bool is_cache = false;
+    bool is_unique = false;
+    size_t top_k = 0;  // All of the numbers
+    int processes_count = 0;  // Only this one
+    size_t mem_limit = 0;  // Not external sort
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--binary") == 0) {
+            is_binary = true;
+        } else if (strcmp(argv[1], "--coro-stats") == 0) {
+            is_coro_stats_dump = true;
+        } else if (strcmp(argv[1], "--edf") == 0) {
+            is_edf = true;
+        } else if (strcmp(argv[1], "--radix") == 0) {
+            is_radix = true;
+        } else if (strcmp(argv[1], "--pipeline") == 0) {
+            is_pipeline = true;
+        } else if (strcmp(argv[1], "--cache") == 0) {
+            is_cache = true;
+        } else if (strcmp(argv[1], "--hugepages") == 0) {
+            is_hugepages = true;
+        } else if (strcmp(argv[1], "--unique") == 0) {
+            is_unique = true;
+        } else if (strncmp(argv[1], "--top=", 6) == 0) {
+            char *end;
+            long long k = strtoll(argv[1] + 6, &end, 10);
+            if (*end != '\0' || k < 1 || k > INT_MAX) {
+                (void)fprintf(stderr, "Error: invalid count %s\n", argv[1] + 6);
+                return 1;
+            }
+            top_k = k;
+        } else if (strncmp(argv[1], "--processes=", 12) == 0) {
+            char *end;
+            long count = strtol(argv[1] + 12, &end, 10);
+            if (*end != '\0' || count < 1 || count > 1024) {
+                (void)fprintf(stderr, "Error: invalid processes count %s\n", argv[1] + 12);
+                return 1;
+            }
+            processes_count = count;
+        } else if (strncmp(argv[1], "--range=", 8) == 0) {
+            if (parse_range(argv[1] + 8) != 0) {
+                (void)fprintf(stderr, "Error: invalid range %s\n", argv[1] + 8);
+                return 1;
+            }
+#ifdef SORT_THREAD_POOL
+        } else if (strcmp(argv[1], "--thread-pool") == 0) {
+            is_thread_pool = true;
+#endif
+        } else if (strncmp(argv[1], "--mem-limit=", 12) == 0) {
+            mem_limit = parse_size(argv[1] + 12);
+            if (mem_limit == 0) {
+                (void)fprintf(stderr, "Error: invalid memory limit %s\n", argv[1] + 12);
+                return 1;
+            }
+        } else {
+            (void)fprintf(stderr, "Unknown option %s\n", argv[1]);
+            return 1;
+        }
+        --argc;
+        ++argv;
+    }
+
     if (argc <= 3) {
         fputs("Too few command-line arguments\n", stderr);
         return 1;
@@ -341,33 +2313,170 @@ main(int argc, char **argv)
 
     struct timespec latency = timespec_from_double(latency_usec / 1000. / 1000.);
 
+    if (is_pipeline && (is_thread_pool || mem_limit > 0 || is_edf)) {
+        fputs("Error: --pipeline doesn't support --thread-pool, --mem-limit and --edf\n", stderr);
+        return 1;
+    }
+    if (is_cache && (is_thread_pool || mem_limit > 0 || is_pipeline)) {
+        fputs("Error: --cache doesn't support --thread-pool, --mem-limit and --pipeline\n", stderr);
+        return 1;
+    }
+
+    if ((top_k > 0 || is_unique) && (is_thread_pool || is_pipeline)) {
+        fputs("Error: --top and --unique don't support --thread-pool and --pipeline\n", stderr);
+        return 1;
+    }
+    if (top_k > 0 && (is_unique || mem_limit > 0 || is_cache)) {
+        fputs("Error: --top doesn't support --unique, --mem-limit and --cache\n", stderr);
+        return 1;
+    }
+    if (processes_count > 0 && (is_thread_pool || is_pipeline || mem_limit > 0 || is_cache || top_k > 0)) {
+        fputs("Error: --processes doesn't support --thread-pool, --pipeline, --mem-limit, --cache and "
+                "--top\n", stderr);
+        return 1;
+    }
+    // The cache would keep the files without the numbers out of the range, for the runs without it
+    if (is_cache && (range_lo != INT_MIN || range_hi != INT_MAX)) {
+        fputs("Error: --range doesn't support --cache\n", stderr);
+        return 1;
+    }
+
+    if (is_thread_pool) {
+#ifdef SORT_THREAD_POOL
+        if (mem_limit > 0) {
+            fputs("Error: --thread-pool doesn't support --mem-limit\n", stderr);
+            return 1;
+        }
+        return sort_in_thread_pool(argv + 3, files_count, workers_count, is_binary, is_radix);
+#endif
+    }
+
+    // External sort: each worker gets an equal share of the memory limit for its text chunk and
+    // the two buffers of the merge sort
+    size_t run_capacity = 0;
+    struct spill_runs runs = {0};
+    if (mem_limit > 0) {
+        size_t share = mem_limit / workers_count;
+        run_capacity = share > EXTERNAL_TEXT_CHUNK ? (share - EXTERNAL_TEXT_CHUNK) / (2 * sizeof (int)) : 0;
+        if (run_capacity < 1024)
+            run_capacity = 1024;
+        printf("External sort: at most %zu numbers per run\n", run_capacity);
+    }
+
+    // Deadline scheduling: the files are given out largest first, and the workers with the bigger
+    // files get the earlier deadlines
+    double mean_file_size = 0;
+    if (is_edf) {
+        mean_file_size = sort_by_size_desc(argv + 3, files_count);
+        if (mean_file_size <= 0)
+            mean_file_size = 1;
+    }
+
     /* Initialize our coroutine global cooperative scheduler. */
     coro_sched_init();
+    // Switches are rare here (once per slice), so the profiling is cheap enough to always collect
+    coro_stats_enable(is_coro_stats_dump);
+    // The sorting loops yield with `coro_maybe_yield` once a worker has run for this long
+    coro_set_quantum(latency_usec / 1000. / 1000.);
+
+    if (is_pipeline)
+        return sort_pipeline(argv + 3, files_count, workers_count, is_binary, is_radix, latency) == 0 ? 0 : 1;
+
+    int *resulting_arrays[files_count];
+    int resulting_arrays_sizes[files_count];
+    for (int i = 0; i < files_count; ++i) {
+        resulting_arrays[i] = NULL;
+        resulting_arrays_sizes[i] = 0;
+    }
+
+    // The files up to date in the cache are not sorted at all, the merge reads them from there
+    struct sort_cache_run cached_runs[files_count];
+    bool is_cached[files_count];
+    memset(cached_runs, 0, sizeof (cached_runs));
+    memset(is_cached, 0, sizeof (is_cached));
+    if (is_cache) {
+        if (mkdir(SORT_CACHE_DIR, 0755) != 0 && errno != EEXIST) {
+            perror("mkdir of the cache");
+            return 1;
+        }
+        int cached_count = 0;
+        for (int i = 0; i < files_count; ++i) {
+            resulting_arrays[i] = sort_cache_load(argv[3 + i], is_binary, &resulting_arrays_sizes[i],
+                    &cached_runs[i]);
+            is_cached[i] = resulting_arrays[i] != NULL;
+            cached_count += is_cached[i];
+        }
+        (void)printf("Cache: %d of %d files are up to date\n", cached_count, files_count);
+    }
+
+    // The output arena: the in-memory sort loads the files right into their slots of it
+    struct output_slot slots[files_count];
+    int *output_arena = mem_limit > 0 || top_k > 0 || processes_count > 0 ? NULL :
+        alloc_output_slots(argv + 3, files_count, is_binary, slots);
+    if (output_arena == NULL)
+        memset(slots, 0, sizeof (slots));
+
+    // With `--processes`, the slots are in the shared memory instead, and the children are forked
+    struct process_share *share = NULL;
+    size_t share_size = 0;
+    pid_t pids[processes_count > 0 ? processes_count : 1];
+    int process_id = 0;
+    if (processes_count > 0) {
+        share = process_share_new(argv + 3, files_count, is_binary, slots, &share_size);
+        if (share == NULL)
+            return 1;
+        process_id = fork_processes(processes_count, pids);
+        if (process_id < 0) {
+            (void)join_processes(processes_count, pids, share, slots, 0, NULL, NULL);
+            return 1;
+        }
+    }
+
+    // Buffers a file for each worker, so the distributor does not wake up on each hand-off. Not
+    // with `--processes`: a file buffered in one process could be sorted sooner by another one
+    struct coro_chan *files = coro_chan_new(share != NULL ? 0 : workers_count);
 
     struct sort_file_inp inputs[workers_count];
+    struct top_heap tops[workers_count];
     for (int i = 0; i < workers_count; ++i) {
-        inputs[i].filename = (char *)-1;  // Worker is in invalid state: not yet initialized
-        inputs[i].worker_id = i;  // Only used for logging
+        if (top_k > 0) {
+            tops[i] = (struct top_heap){ .data = malloc(sizeof (int) * top_k), .capacity = top_k };
+            if (tops[i].data == NULL) {
+                perror("malloc for a top heap");
+                return 1;
+            }
+        }
+        inputs[i].files = files;
+        inputs[i].filenames = argv + 3;
+        inputs[i].filename = NULL;
+        inputs[i].worker_id = process_id * workers_count + i;  // Only used for logging
         inputs[i].latency = latency;
-        inputs[i].array = NULL;
-        inputs[i].arr_size = 0;
+        inputs[i].is_binary = is_binary;
+        inputs[i].is_radix = is_radix;
+        inputs[i].mean_file_size = mean_file_size;
+        inputs[i].run_capacity = run_capacity;
+        inputs[i].runs = &runs;
+        inputs[i].is_cache = is_cache;
+        inputs[i].top = top_k > 0 ? &tops[i] : NULL;
+        inputs[i].slots = slots;
+        inputs[i].resulting_arrays = resulting_arrays;
+        inputs[i].resulting_arrays_sizes = resulting_arrays_sizes;
         coro_new(sort_file, (void *)&inputs[i]);
     }
 
-    int *resulting_arrays[files_count];
-    int resulting_arrays_sizes[files_count];
-
-    struct distributor_inp distr_inp = { .dnps = inputs, .workers_count = workers_count,
-        .filenames = argv + 3, .files_count = files_count, .resulting_arrays = resulting_arrays,
-        .resulting_arrays_sizes = resulting_arrays_sizes};
+    struct distributor_inp distr_inp = { .files = files, .filenames = argv + 3,
+        .files_count = files_count, .is_cached = is_cache ? is_cached : NULL,
+        .next_file = share != NULL ? &share->next_file : NULL };
 
     coro_new(distributor, (void *)&distr_inp);
 
     /* Wait for all the coroutines to end. */
+    bool is_failed = false;
     struct coro *c;
     while ((c = coro_sched_wait()) != NULL) {
         long long status = coro_status(c);
         if (status == -1) {
+            is_failed = true;
             (void)printf("Error: a coroutine terminated with an error\n");
         } else if (status == 0) {
             (void)printf("Distributor has terminated\n");
@@ -377,52 +2486,481 @@ main(int argc, char **argv)
             double us = res->time_spent.tv_sec * 1000 * 1000 + res->time_spent.tv_nsec / 1000.;
             (void)printf("Coroutine %d finished in %.3fus with %d switches\n",
                     res->worker_id, us, res->switch_count);
-            free(res);
+            (void)printf("Coroutine %d latency: requested %.3fus, achieved %.3fus on average and "
+                    "%.3fus at most over %lld slices\n", res->worker_id, latency_usec,
+                    res->slice_avg_us, res->slice_max_us, res->slices_count);
+
+            // The slices as seen by libcoro also include the file loading and all the other code
+            struct coro_stats stats;
+            coro_stats(c, &stats);
+            double slice_max_us = stats.slice_max_ns / 1000.;
+            (void)printf("Coroutine %d profile: cpu %.3fus, waited %.3fus, longest slice %.3fus: "
+                    "the latency target is %s\n", res->worker_id, stats.cpu_ns / 1000.,
+                    stats.wait_ns / 1000., slice_max_us, slice_max_us <= latency_usec ? "met" : "missed");
         }
         coro_delete(c);
     }
 
-    // Total merge. The arrays are added one by one to the previously merged part
-    // (poined to by sorted2) and saved as the new merged part (pointed to by sorted1).
-    // Then they are swapped.
+    coro_chan_delete(files);
+
+    struct coro_stack_stats stack_stats;
+    coro_stack_stats(&stack_stats);
+    (void)printf("Coroutine stacks: at most %zu used at once, at most %zu KiB mapped, %zu reused\n",
+            stack_stats.used_max, stack_stats.mapped_bytes_max / 1024, stack_stats.reused_count);
+
+    if (process_id > 0) {
+        // A child: the files it has sorted are to be found in their slots
+        for (int i = 0; i < files_count && !is_failed; ++i) {
+            if (resulting_arrays[i] == NULL)
+                continue;
+            if (resulting_arrays[i] != slots[i].data) {
+                (void)fprintf(stderr, "Error: %s has grown bigger than its slot\n", argv[3 + i]);
+                is_failed = true;
+            }
+            share->counts[i] = resulting_arrays_sizes[i];
+        }
+        exit(is_failed ? 1 : 0);
+    }
+    if (share != NULL && join_processes(processes_count, pids, share, slots, files_count,
+            resulting_arrays, resulting_arrays_sizes) != 0)
+        return 1;
+
+    if (top_k > 0)
+        return output_top(tops, workers_count, top_k, is_binary, is_radix) == 0 ? 0 : 1;
+
+    if (mem_limit > 0) {
+        int rc = merge_runs(&runs, mem_limit, is_binary, is_unique);
+        for (int i = 0; i < runs.count; ++i) {
+            if (runs.items[i].owns_fd)
+                (void)close(runs.items[i].fd);
+        }
+        free(runs.items);
+        return rc == 0 ? 0 : 1;
+    }
+
+    // Total merge: all the sorted arrays at once, straight to the output file, so the merged
+    // array is never in memory. The coroutines have all finished by now, so there is nobody to
+    // yield to.
+    int rc = merge_k_output((const int **)resulting_arrays, resulting_arrays_sizes, files_count,
+            is_binary, is_unique);
 
-    long long total = 0;
     for (int i = 0; i < files_count; ++i) {
-        total += resulting_arrays_sizes[i];
+        if (is_cached[i])
+            sort_cache_release(&cached_runs[i]);
+        else if (resulting_arrays[i] != slots[i].data)
+            free(resulting_arrays[i]);  // Didn't fit into the slot
+    }
+    free(output_arena);
+    if (share != NULL)
+        (void)munmap(share, share_size);
+
+    return rc == 0 ? 0 : 1;
+}
+
+/** Buffered writer of the output file, for the results which do not fit into memory. */
+struct output_stream {
+    FILE *f;
+    bool is_binary;
+    // The count in the header, and the count written. They differ if the `--unique` merge has
+    // dropped some, then the header is written again when closing
+    uint64_t header_count;
+    uint64_t count;
+};
+
+#define OUTPUT_BUFFER (1 << 20)
+
+static int output_stream_open(struct output_stream *out, bool is_binary, uint64_t count) {
+    const char *name = is_binary ? "out.bin" : "out.txt";
+    out->is_binary = is_binary;
+    out->header_count = count;
+    out->count = 0;
+    out->f = fopen(name, "w");
+    if (out->f == NULL) {
+        perror("fopen of the output file");
+        return -1;
+    }
+    (void)setvbuf(out->f, NULL, _IOFBF, OUTPUT_BUFFER);
+    if (is_binary) {
+        struct binary_header header = { .version = le32(BINARY_VERSION), .count = le64(count) };
+        memcpy(header.magic, BINARY_MAGIC, 4);
+        (void)fwrite(&header, sizeof (header), 1, out->f);
     }
+    return 0;
+}
 
-    int sorted1_[total];
-    int sorted2_[total];
+inline static void output_stream_put(struct output_stream *out, int val) {
+    ++out->count;
+    if (out->is_binary) {
+        uint32_t le = le32((uint32_t)val);
+        (void)fwrite(&le, sizeof (le), 1, out->f);
+    } else {
+        char text[12];
+        size_t len = format_int(text, val);
+        text[len++] = ' ';
+        (void)fwrite(text, 1, len, out->f);
+    }
+}
 
-    int *sorted1 = sorted1_, *sorted2 = sorted2_;
-    int len1 = 0, len2 = 0;
+/** Same as `output_stream_put` for `n` values. Byte-swaps `vals` in place on big-endian machines. */
+static void output_stream_put_n(struct output_stream *out, int *vals, int n) {
+    out->count += n;
+    if (out->is_binary) {
+        for (int i = 0; i < n; ++i)
+            vals[i] = le32((uint32_t)vals[i]);
+        (void)fwrite(vals, sizeof (*vals), n, out->f);
+    } else {
+        // At most 11 characters and the separator per number
+        char text[12 * 256];
+        for (int i = 0; i < n; i += 256) {
+            size_t len = 0;
+            for (int j = i; j < n && j < i + 256; ++j) {
+                len += format_int(text + len, vals[j]);
+                text[len++] = ' ';
+            }
+            (void)fwrite(text, 1, len, out->f);
+        }
+    }
+}
 
-    for (int i = 0; i < files_count; ++i) {
-        (void)merge(sorted1, sorted2, len2, resulting_arrays[i], resulting_arrays_sizes[i], false, latency);
-        len1 = resulting_arrays_sizes[i] + len2;
-        free(resulting_arrays[i]);  // Won't use this again
-        SWAP(int *, sorted1, sorted2);
-        SWAP(int, len1, len2);
+static int output_stream_close(struct output_stream *out) {
+    if (!out->is_binary) {
+        (void)fseek(out->f, -1, SEEK_CUR);
+        (void)fputc('\n', out->f);
+    } else if (out->count != out->header_count) {
+        struct binary_header header = { .version = le32(BINARY_VERSION), .count = le64(out->count) };
+        memcpy(header.magic, BINARY_MAGIC, 4);
+        (void)fseek(out->f, 0, SEEK_SET);
+        (void)fwrite(&header, sizeof (header), 1, out->f);
+    }
+    bool is_failed = ferror(out->f);
+    if (fclose(out->f) != 0 || is_failed) {
+        perror("write of the output file");
+        return -1;
     }
+    return 0;
+}
 
-    // Now the sorted array is in `sorted2`
-    output_arr(sorted2, len2);
+/** A run being merged: the buffered part of it and what remains in the spill file. */
+struct run_reader {
+    int *buf;
+    off_t offset;
+    size_t left;
+};
 
+/** Read the next piece of a run into its buffer, pointing the loser tree input `i` to it. */
+static int run_reader_refill(struct run_reader *r, size_t buf_count, const struct spill_run *run,
+        struct loser_tree *t, int i) {
+    size_t n = r->left < buf_count ? r->left : buf_count;
+    if (pread_full(run->fd, r->buf, sizeof (int) * n, r->offset) != 0) {
+        perror("read of a spill file");
+        return -1;
+    }
+    r->offset += sizeof (int) * n;
+    r->left -= n;
+    t->pos[i] = r->buf;
+    t->end[i] = r->buf + n;
     return 0;
 }
 
-void output_arr(const int *arr, int size) {
-    FILE *f = fopen("out.txt", "w");
-    if (f == NULL) {
-        perror("fopen out.txt");
+/**
+ * Final phase of the external sort: a streaming k-way merge of all the spilled runs into the
+ * output file. Each run is read with large sequential reads into its own buffer; together the
+ * buffers take about `mem_limit` bytes. With `is_unique`, a number equal to the previous one is
+ * dropped.
+ *
+ * Returns 0 on success, -1 on failure (after reporting it).
+ */
+int merge_runs(const struct spill_runs *runs, size_t mem_limit, bool is_binary, bool is_unique) {
+    int k = runs->count;
+    uint64_t total = 0;
+    for (int i = 0; i < k; ++i)
+        total += runs->items[i].count;
+
+    struct output_stream out;
+    if (output_stream_open(&out, is_binary, total) != 0)
+        return -1;
+    if (k == 0)
+        return output_stream_close(&out);
+
+    size_t buf_count = mem_limit / sizeof (int) / k;
+    if (buf_count < 1024)
+        buf_count = 1024;
+    printf("External sort: merging %d runs with %zu KiB buffers\n", k, buf_count * sizeof (int) / 1024);
+
+    struct loser_tree t;
+    struct run_reader *readers = calloc(k, sizeof (*readers));
+    if (readers == NULL || loser_tree_alloc(&t, k) != 0) {
+        perror("malloc for the run readers");
+        free(readers);
+        (void)output_stream_close(&out);
+        return -1;
+    }
+
+    int rc = 0;
+    int last = 0;
+    for (int i = 0; i < k && rc == 0; ++i) {
+        readers[i].buf = malloc(sizeof (int) * buf_count);
+        readers[i].offset = runs->items[i].offset;
+        readers[i].left = runs->items[i].count;
+        if (readers[i].buf == NULL) {
+            perror("malloc for a run buffer");
+            rc = -1;
+        } else {
+            rc = run_reader_refill(&readers[i], buf_count, &runs->items[i], &t, i);
+        }
+    }
+
+    if (rc == 0) {
+        t.tree[0] = loser_tree_build(&t, 1);
+        for (uint64_t n = 0; n < total; ++n) {
+            int winner = t.tree[0];
+            int val = *t.pos[winner]++;
+            if (!is_unique || n == 0 || val != last)
+                output_stream_put(&out, val);
+            last = val;
+            if (t.pos[winner] == t.end[winner] && readers[winner].left > 0) {
+                rc = run_reader_refill(&readers[winner], buf_count, &runs->items[winner], &t, winner);
+                if (rc != 0)
+                    break;
+            }
+            loser_tree_replay(&t, winner);
+        }
+    }
+
+    for (int i = 0; i < k; ++i)
+        free(readers[i].buf);
+    free(readers);
+    loser_tree_free(&t);
+    if (output_stream_close(&out) != 0)
+        rc = -1;
+    return rc;
+}
+
+/** A segment of the array for `output_arr`, and where its text goes. */
+struct output_segment {
+    const int *arr;
+    size_t count;
+    // The length of the text: each number is followed by a separator
+    size_t len;
+    // Where in the mapping of the output file, once all the lengths are known
+    char *text;
+};
+
+static void *output_segment_measure(void *arg) {
+    struct output_segment *seg = arg;
+    size_t len = 0;
+    for (size_t i = 0; i < seg->count; ++i)
+        len += format_int_len(seg->arr[i]) + 1;
+    seg->len = len;
+    return seg;
+}
+
+static void *output_segment_format(void *arg) {
+    struct output_segment *seg = arg;
+    char *p = seg->text;
+    for (size_t i = 0; i < seg->count; ++i) {
+        p += format_int(p, seg->arr[i]);
+        *p++ = ' ';
+    }
+    return seg;
+}
+
+/**
+ * Run `fn` for each of the `count` segments: as the tasks of the `pool`, if there is one, or right
+ * here.
+ */
+static void output_segments_run(struct output_segment *segs, int count, void *(*fn)(void *),
+        struct thread_pool *pool) {
+#ifdef SORT_THREAD_POOL
+    if (pool != NULL) {
+        struct thread_task *tasks[count];
+        int pushed = 0;
+        for (; pushed < count; ++pushed) {
+            (void)thread_task_new(&tasks[pushed], fn, &segs[pushed]);
+            if (thread_pool_push_task(pool, tasks[pushed]) != 0) {
+                (void)thread_task_delete(tasks[pushed]);
+                break;
+            }
+        }
+        for (int i = 0; i < pushed; ++i) {
+            void *res;
+            (void)thread_task_join(tasks[i], &res);
+            (void)thread_task_delete(tasks[i]);
+        }
+        for (int i = pushed; i < count; ++i)
+            (void)fn(&segs[i]);
+        return;
+    }
+#else
+    (void)pool;
+#endif
+    for (int i = 0; i < count; ++i)
+        (void)fn(&segs[i]);
+}
+
+/**
+ * Write `out.txt`. The array is cut into `segments_count` segments, and the text length of each is
+ * counted first. Then the file is sized to them all with `ftruncate` and `mmap`ed, and each segment
+ * is formatted into its place of the mapping: no `stdio` buffer and no `write` copy in between. With
+ * a `pool`, the segments are counted and formatted by its threads in parallel, otherwise here.
+ */
+void output_arr(const int *arr, int size, struct thread_pool *pool, int segments_count) {
+    int fd = open("out.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open out.txt");
+        return;
+    }
+    if (size == 0) {
+        if (write_full(fd, "\n", 1) != 0)
+            perror("write out.txt");
+        (void)close(fd);
+        return;
+    }
+
+    if (segments_count < 1 || pool == NULL)
+        segments_count = 1;
+    if (segments_count > size)
+        segments_count = size;
+    struct output_segment segs[segments_count];
+    for (int i = 0; i < segments_count; ++i) {
+        size_t from = (size_t)size * i / segments_count, to = (size_t)size * (i + 1) / segments_count;
+        segs[i] = (struct output_segment){ .arr = arr + from, .count = to - from };
+    }
+    output_segments_run(segs, segments_count, output_segment_measure, pool);
+
+    size_t total = 0;
+    for (int i = 0; i < segments_count; ++i)
+        total += segs[i].len;
+    char *map = MAP_FAILED;
+    if (ftruncate(fd, total) != 0)
+        perror("ftruncate out.txt");
+    else if ((map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        perror("mmap out.txt");
+    (void)close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    size_t offset = 0;
+    for (int i = 0; i < segments_count; ++i) {
+        segs[i].text = map + offset;
+        offset += segs[i].len;
+    }
+    output_segments_run(segs, segments_count, output_segment_format, pool);
+    // The separator after the last number
+    map[total - 1] = '\n';
+    (void)munmap(map, total);
+}
+
+/**
+ * Write `out.bin` in the `--binary` format. The header and the array go to the file with `writev`
+ * in large chunks, without copying (on little-endian machines).
+ */
+void output_arr_binary(const int *arr, int size) {
+    int fd = open("out.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open out.bin");
+        return;
+    }
+
+    struct binary_header header = { .version = le32(BINARY_VERSION), .count = le64((uint64_t)size) };
+    memcpy(header.magic, BINARY_MAGIC, 4);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    int *swapped = malloc(sizeof (int) * (size > 0 ? size : 1));
+    if (swapped == NULL) {
+        perror("malloc for out.bin");
+        (void)close(fd);
         return;
     }
+    for (int i = 0; i < size; ++i)
+        swapped[i] = le32((uint32_t)arr[i]);
+    arr = swapped;
+#endif
+
+    // The kernel writes at most ~2GB at once, so the data goes in 1GB pieces
+    const size_t chunk = 1 << 30;
+    const char *data = (const char *)arr;
+    size_t data_left = sizeof (int) * (size_t)size;
+    struct iovec iov[2] = { { .iov_base = &header, .iov_len = sizeof (header) } };
+    while (iov[0].iov_len > 0 || data_left > 0) {
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = data_left < chunk ? data_left : chunk;
+        int first = iov[0].iov_len == 0;  // Skip the header once it is written
+        ssize_t written = writev(fd, iov + first, 2 - first);
+        if (written < 0) {
+            perror("writev out.bin");
+            break;
+        }
+        size_t header_part = (size_t)written < iov[0].iov_len ? (size_t)written : iov[0].iov_len;
+        iov[0].iov_base = (char *)iov[0].iov_base + header_part;
+        iov[0].iov_len -= header_part;
+        data += written - header_part;
+        data_left -= written - header_part;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    free(swapped);
+#endif
+    (void)close(fd);
+}
+
+#define OUTPUT_CHUNK 4096
+
+/**
+ * Merge the `k` sorted arrays to the output file, through a small chunk instead of the whole
+ * merged array. With `is_unique`, a number equal to the previous one is dropped as it comes out of
+ * the loser tree.
+ *
+ * Returns 0 on success, -1 on error (after reporting it).
+ */
+int merge_k_output(const int **arrays, const int *sizes, int k, bool is_binary, bool is_unique) {
+    long long total = 0;
+    for (int i = 0; i < k; ++i)
+        total += sizes[i];
+
+    struct output_stream out;
+    if (output_stream_open(&out, is_binary, total) != 0)
+        return -1;
+    if (k == 0)
+        return output_stream_close(&out);
 
-    for (int i = 0; i < size; ++i) {
-        (void)fprintf(f, "%d ", arr[i]);
+    struct loser_tree t;
+    if (loser_tree_alloc(&t, k) != 0) {
+        (void)output_stream_close(&out);
+        return -1;
+    }
+    for (int i = 0; i < k; ++i) {
+        t.pos[i] = arrays[i];
+        t.end[i] = arrays[i] + sizes[i];
+    }
+    t.tree[0] = loser_tree_build(&t, 1);
+
+    int chunk[OUTPUT_CHUNK];
+    // Below any `int`: the first number is always kept
+    long long last = (long long)INT_MIN - 1;
+    while (total > 0) {
+        int n = total < OUTPUT_CHUNK ? total : OUTPUT_CHUNK;
+        int kept = 0;
+        if (is_unique) {
+            for (int i = 0; i < n; ++i) {
+                int winner = t.tree[0];
+                int val = *t.pos[winner]++;
+                chunk[kept] = val;
+                kept += val != last;
+                last = val;
+                loser_tree_replay(&t, winner);
+            }
+        } else {
+            for (kept = 0; kept < n; ++kept) {
+                int winner = t.tree[0];
+                chunk[kept] = *t.pos[winner]++;
+                loser_tree_replay(&t, winner);
+            }
+        }
+        output_stream_put_n(&out, chunk, kept);
+        total -= n;
     }
 
-    (void)fseek(f, -1, SEEK_CUR);
-    (void)fputc('\n', f);
-    (void)fclose(f);
+    loser_tree_free(&t);
+    return output_stream_close(&out);
 }
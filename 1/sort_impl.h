@@ -0,0 +1,202 @@
+/*
+ * The sorting engine of the sorter, for the elements of any type: a "template" to be included
+ * after defining
+ *
+ *   SORT_NAME       - the prefix of the functions, e.g. `sort_i64` for `sort_i64_merge_sort`;
+ *   SORT_TYPE       - the type of the elements;
+ *   SORT_LESS(a, b) - optional: whether the element `a` goes before `b`, `(a) < (b)` by default;
+ *   SORT_KEY(x)     - optional: an unsigned key of the element `x` of SORT_KEY_BITS bits (32 by
+ *                     default, or 64), ordered as the elements are, for the radix sort. See
+ *                     `SORT_KEY_I32` and the like below for the common ones;
+ *   SORT_YIELD_N(n) - optional: called after each `n` elements done, e.g. `coro_maybe_yield_n(n)`
+ *                     for a sort to share the thread with the other coroutines. Nothing by
+ *                     default.
+ *
+ * It defines, all `inline static`, the same as the ones of `int` in solution.c:
+ *
+ *   void  NAME_merge(TYPE *out, const TYPE *from1, size_t len1, const TYPE *from2, size_t len2);
+ *   TYPE *NAME_merge_sort(TYPE *arr, TYPE *aux, size_t len);
+ *   TYPE *NAME_radix_sort(TYPE *arr, TYPE *aux, size_t len);  // With SORT_KEY only
+ *
+ * and undefines the parameters, so that it can be included again for another type. The
+ * comparisons and the keys are expanded right in the loops: there are no calls through pointers
+ * like those of qsort(3). Both sorts are stable, so e.g. the records of the same key stay in the
+ * order of the input.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "perf_region.h"
+
+#if !defined(SORT_NAME) || !defined(SORT_TYPE)
+#error "SORT_NAME and SORT_TYPE must be defined before including sort_impl.h"
+#endif
+
+#ifndef SORT_IMPL_COMMON
+#define SORT_IMPL_COMMON
+
+// Runs of at most this many elements are sorted by insertion sort before merging.
+// Can be tuned with -DSORT_SMALL_RUN=...
+#ifndef SORT_SMALL_RUN
+#define SORT_SMALL_RUN 16
+#endif
+
+#define SORT_RADIX_BITS 8
+#define SORT_RADIX_BUCKETS (1 << SORT_RADIX_BITS)
+// The elements are scattered in blocks of this many between the `SORT_YIELD_N` calls
+#define SORT_RADIX_BLOCK 256
+
+// The keys of the common fixed-width types for SORT_KEY: flipping the sign bit orders the
+// negatives first
+#define SORT_KEY_U32(x) ((uint32_t)(x))
+#define SORT_KEY_I32(x) ((uint32_t)(x) ^ 0x80000000u)
+#define SORT_KEY_U64(x) ((uint64_t)(x))
+#define SORT_KEY_I64(x) ((uint64_t)(x) ^ 0x8000000000000000u)
+
+#define SORT_CAT_(a, b) a##_##b
+#define SORT_CAT(a, b) SORT_CAT_(a, b)
+
+#endif
+
+#define SORT_FN(name) SORT_CAT(SORT_NAME, name)
+
+#ifndef SORT_LESS
+#define SORT_LESS(a, b) ((a) < (b))
+#endif
+#ifndef SORT_YIELD_N
+#define SORT_YIELD_N(n) ((void)(n))
+#endif
+
+/**
+ * Merge two already sorted arrays into `out`, which must not overlap with them. On a tie the
+ * element of `from1` goes first.
+ */
+inline static void SORT_FN(merge)(SORT_TYPE *out, const SORT_TYPE *from1, size_t len1,
+        const SORT_TYPE *from2, size_t len2) {
+    PERF_REGION_BEGIN(merge);
+    const SORT_TYPE *i = from1, *j = from2;
+    while (i < from1 + len1 && j < from2 + len2) {
+        // Branchless: on random data the comparison is unpredictable
+        bool take_j = SORT_LESS(*j, *i);
+        *out++ = take_j ? *j : *i;
+        j += take_j;
+        i += !take_j;
+        SORT_YIELD_N(1);
+    }
+
+    while (i < from1 + len1) {
+        *out++ = *i++;
+        SORT_YIELD_N(1);
+    }
+    while (j < from2 + len2) {
+        *out++ = *j++;
+        SORT_YIELD_N(1);
+    }
+    PERF_REGION_END(merge);
+}
+
+inline static void SORT_FN(insertion_sort)(SORT_TYPE *arr, size_t len) {
+    for (size_t i = 1; i < len; ++i) {
+        SORT_TYPE val = arr[i];
+        size_t j = i;
+        for (; j > 0 && SORT_LESS(val, arr[j - 1]); --j)
+            arr[j] = arr[j - 1];
+        arr[j] = val;
+    }
+}
+
+/**
+ * Bottom-up merge sort of `arr`, using `aux` (of the same size) as the only auxiliary buffer. First
+ * the runs of `SORT_SMALL_RUN` elements are sorted in place, then runs of doubling width are merged
+ * pairwise from one buffer to the other, and the buffers swap roles after every pass.
+ *
+ * Returns the buffer that ends up holding the sorted data: either `arr` or `aux`. The other one
+ * contains garbage.
+ */
+inline static SORT_TYPE *SORT_FN(merge_sort)(SORT_TYPE *arr, SORT_TYPE *aux, size_t len) {
+    for (size_t lo = 0; lo < len; lo += SORT_SMALL_RUN) {
+        size_t run = len - lo < SORT_SMALL_RUN ? len - lo : SORT_SMALL_RUN;
+        SORT_FN(insertion_sort)(arr + lo, run);
+        SORT_YIELD_N(run);
+    }
+
+    SORT_TYPE *from = arr, *to = aux;
+    for (size_t width = SORT_SMALL_RUN; width < len; width *= 2) {
+        for (size_t lo = 0; lo < len; lo += 2 * width) {
+            size_t mid = lo + width < len ? lo + width : len;
+            size_t hi = mid + width < len ? mid + width : len;
+            SORT_FN(merge)(to + lo, from + lo, mid - lo, from + mid, hi - mid);
+        }
+        SORT_TYPE *swap_tmp = from;
+        from = to;
+        to = swap_tmp;
+    }
+    return from;
+}
+
+#ifdef SORT_KEY
+
+#ifndef SORT_KEY_BITS
+#define SORT_KEY_BITS 32
+#endif
+
+/**
+ * LSD radix sort of `arr` by 8-bit digits of `SORT_KEY`, using `aux` (of the same size) as the
+ * only auxiliary buffer. The histograms of all the digits are counted by a single read of the
+ * array, then each pass scatters the elements from one buffer to the other by one digit. A pass
+ * where all the elements have the same digit is skipped. The histograms are local, so the
+ * concurrent sorts (of the thread pool) don't share them.
+ *
+ * Returns the buffer that ends up holding the sorted data: either `arr` or `aux`.
+ */
+inline static SORT_TYPE *SORT_FN(radix_sort)(SORT_TYPE *arr, SORT_TYPE *aux, size_t len) {
+    enum { passes = SORT_KEY_BITS / SORT_RADIX_BITS };
+    size_t hist[passes][SORT_RADIX_BUCKETS];
+    memset(hist, 0, sizeof (hist));
+    for (size_t lo = 0; lo < len; lo += SORT_RADIX_BLOCK) {
+        size_t hi = lo + SORT_RADIX_BLOCK < len ? lo + SORT_RADIX_BLOCK : len;
+        for (size_t i = lo; i < hi; ++i) {
+            uint64_t key = SORT_KEY(arr[i]);
+            for (int pass = 0; pass < passes; ++pass)
+                ++hist[pass][(key >> (pass * SORT_RADIX_BITS)) & (SORT_RADIX_BUCKETS - 1)];
+        }
+        SORT_YIELD_N(hi - lo);
+    }
+
+    SORT_TYPE *from = arr, *to = aux;
+    for (int pass = 0; pass < passes && len > 0; ++pass) {
+        int shift = pass * SORT_RADIX_BITS;
+        if (hist[pass][((uint64_t)SORT_KEY(from[0]) >> shift) & (SORT_RADIX_BUCKETS - 1)] == len)
+            continue;
+
+        size_t offset[SORT_RADIX_BUCKETS];
+        size_t sum = 0;
+        for (int d = 0; d < SORT_RADIX_BUCKETS; ++d) {
+            offset[d] = sum;
+            sum += hist[pass][d];
+        }
+        for (size_t lo = 0; lo < len; lo += SORT_RADIX_BLOCK) {
+            size_t hi = lo + SORT_RADIX_BLOCK < len ? lo + SORT_RADIX_BLOCK : len;
+            for (size_t i = lo; i < hi; ++i)
+                to[offset[((uint64_t)SORT_KEY(from[i]) >> shift) & (SORT_RADIX_BUCKETS - 1)]++] =
+                    from[i];
+            SORT_YIELD_N(hi - lo);
+        }
+        SORT_TYPE *swap_tmp = from;
+        from = to;
+        to = swap_tmp;
+    }
+    return from;
+}
+
+#endif
+
+#undef SORT_FN
+#undef SORT_NAME
+#undef SORT_TYPE
+#undef SORT_LESS
+#undef SORT_KEY
+#undef SORT_KEY_BITS
+#undef SORT_YIELD_N
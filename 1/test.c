@@ -0,0 +1,152 @@
+#include "coro_ufs.h"
+#include "libcoro.h"
+#include "userfs.h"
+#include "unit.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The calls of coro_ufs.h by several coroutines over one fs. The time
+ * slices are as short as it gets, so each coro_maybe_yield() between
+ * the chunks switches to the next coroutine.
+ */
+
+enum {
+	CORO_COUNT = 3,
+	/* 4 chunks, the last one short. */
+	FILE_SIZE = CORO_UFS_CHUNK * 3 + 100,
+	TAIL = 10,
+};
+
+struct ufs_coro_ctx {
+	int id;
+	/* How many coroutines started writing when its write returned. */
+	int started_seen;
+	ssize_t written, read, tail, past_end;
+	long long switches_written, switches_read, switches_tail;
+	bool is_equal;
+};
+
+static int writes_started = 0;
+
+static char
+ufs_coro_byte(int id, size_t pos)
+{
+	return (char)(id * 31 + pos % 251);
+}
+
+static long long
+ufs_coro_f(void *arg)
+{
+	struct ufs_coro_ctx *ctx = arg;
+	struct coro *self = coro_this();
+	char name[16];
+	snprintf(name, sizeof(name), "file%d", ctx->id);
+	int fd = ufs_open(name, UFS_CREATE);
+	unit_fail_if(fd < 0);
+	char *data = malloc(FILE_SIZE);
+	char *buf = malloc(FILE_SIZE + CORO_UFS_CHUNK);
+	unit_fail_if(data == NULL || buf == NULL);
+	for (size_t i = 0; i < FILE_SIZE; ++i)
+		data[i] = ufs_coro_byte(ctx->id, i);
+
+	++writes_started;
+	long long switches = coro_switch_count(self);
+	ctx->written = coro_ufs_write(fd, data, FILE_SIZE);
+	ctx->switches_written = coro_switch_count(self) - switches;
+	ctx->started_seen = writes_started;
+
+	/* More than there is: a short read at the end of the file. */
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open(name, 0);
+	unit_fail_if(fd < 0);
+	switches = coro_switch_count(self);
+	ctx->read = coro_ufs_read(fd, buf, FILE_SIZE + CORO_UFS_CHUNK);
+	ctx->switches_read = coro_switch_count(self) - switches;
+	ctx->is_equal = ctx->read == FILE_SIZE && memcmp(buf, data, FILE_SIZE) == 0;
+
+	switches = coro_switch_count(self);
+	ctx->tail = coro_ufs_pread(fd, buf, CORO_UFS_CHUNK * 2, FILE_SIZE - TAIL);
+	ctx->switches_tail = coro_switch_count(self) - switches;
+	ctx->is_equal = ctx->is_equal && ctx->tail == TAIL &&
+			memcmp(buf, data + FILE_SIZE - TAIL, TAIL) == 0;
+	ctx->past_end = coro_ufs_pread(fd, buf, CORO_UFS_CHUNK, FILE_SIZE);
+
+	unit_fail_if(ufs_close(fd) != 0);
+	free(buf);
+	free(data);
+	return 0;
+}
+
+static void
+test_coro_ufs(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	coro_set_quantum(1e-9);
+	struct ufs_coro_ctx ctxs[CORO_COUNT];
+	for (int i = 0; i < CORO_COUNT; ++i) {
+		ctxs[i] = (struct ufs_coro_ctx){.id = i};
+		coro_new(ufs_coro_f, &ctxs[i]);
+	}
+	struct coro *c;
+	while ((c = coro_sched_wait()) != NULL)
+		coro_delete(c);
+	coro_set_quantum(0);
+
+	bool is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].written == FILE_SIZE;
+	unit_check(is_ok, "written in full");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].switches_written == 3;
+	unit_check(is_ok, "a write yields between its chunks");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].started_seen == CORO_COUNT;
+	unit_check(is_ok, "the writes go in turns");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].read == FILE_SIZE && ctxs[i].switches_read == 3;
+	unit_check(is_ok, "a read stops at the end of the file");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].tail == TAIL && ctxs[i].switches_tail == 0;
+	unit_check(is_ok, "a short read at the end does not yield");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].past_end == 0;
+	unit_check(is_ok, "nothing past the end");
+	is_ok = true;
+	for (int i = 0; i < CORO_COUNT; ++i)
+		is_ok = is_ok && ctxs[i].is_equal;
+	unit_check(is_ok, "each reads what it wrote");
+
+	/* Outside the coroutines: the same calls, in pieces. */
+	int fd = ufs_open("file0", 0);
+	unit_fail_if(fd < 0);
+	char *buf = malloc(FILE_SIZE);
+	unit_fail_if(buf == NULL);
+	unit_check(coro_ufs_pread(fd, buf, FILE_SIZE, 0) == FILE_SIZE &&
+		   buf[FILE_SIZE - 1] == ufs_coro_byte(0, FILE_SIZE - 1),
+		   "read outside the coroutines");
+	unit_check(coro_ufs_pread(fd, buf, 1, -1) == -1, "a negative offset fails");
+	free(buf);
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_coro_ufs();
+
+	unit_test_finish();
+	return 0;
+}
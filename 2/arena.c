@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <stdalign.h>
+#include <string.h>
+
+#include "arena.h"
+
+enum {
+    ARENA_CHUNK_MIN = 4096,
+    ARENA_ALIGN = alignof(max_align_t),
+};
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    alignas(ARENA_ALIGN) char data[];
+};
+
+inline static size_t arena_align(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = arena_align(size);
+    struct arena_chunk *c = a->cur;
+    while (!c || c->size - c->used < size) {
+        if (c && c->next) {
+            // A chunk left from before the reset. If it is too small, it is skipped
+            c = c->next;
+            c->used = 0;
+            continue;
+        }
+
+        // Each new chunk is twice bigger, so there are few of them however large the command is
+        size_t chunk_size = c ? 2 * c->size : ARENA_CHUNK_MIN;
+        if (chunk_size < size)
+            chunk_size = size;
+        struct arena_chunk *chunk = malloc(sizeof (*chunk) + chunk_size);
+        if (!chunk)
+            return NULL;
+        *chunk = (struct arena_chunk){.next = NULL, .size = chunk_size, .used = 0};
+        if (c)
+            c->next = chunk;
+        else
+            a->head = chunk;
+        c = chunk;
+    }
+    a->cur = c;
+    void *res = c->data + c->used;
+    c->used += size;
+    return res;
+}
+
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t new_size) {
+    struct arena_chunk *c = a->cur;
+    if (ptr && (char *)ptr + arena_align(old_size) == c->data + c->used) {
+        size_t start = (char *)ptr - c->data;
+        if (c->size - start >= arena_align(new_size)) {
+            c->used = start + arena_align(new_size);
+            return ptr;
+        }
+    }
+    void *res = arena_alloc(a, new_size);
+    if (res && ptr)
+        memcpy(res, ptr, old_size < new_size ? old_size : new_size);
+    return res;
+}
+
+void arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->head)
+        a->head->used = 0;
+}
+
+void arena_destroy(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = a->cur = NULL;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Arena allocator: the memory is taken from large chunks by bumping a pointer, and is only
+ * freed all at once. Used for the parsed commands, which are allocated piece by piece
+ * and die together.
+ */
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *head;
+    // The chunk being allocated from. The chunks after it are free, left from before the reset
+    struct arena_chunk *cur;
+};
+
+/**
+ * Allocate `size` bytes in the arena, aligned for any type. The memory is not initialized.
+ * Returns `NULL` if out of memory.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * Grow the allocation `ptr` of `old_size` bytes to `new_size` bytes, like `realloc`. It is
+ * extended in place if it is the last allocation, otherwise copied (the old copy is not freed).
+ * `ptr` may be `NULL`. Returns `NULL` if out of memory, then `ptr` is intact.
+ */
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t new_size);
+
+/** Free everything allocated in the arena at once. The chunks are kept for the reuse. */
+void arena_reset(struct arena *a);
+
+/** Free the arena with all the chunks. It may be used again afterwards. */
+void arena_destroy(struct arena *a);
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "arena.h"
+#include "parse_command.h"
+#include "errors.h"
+
+/*
+ * Benchmark of the shell.
+ *
+ * The parse throughput: the lines of a generated script of typical commands (words, quotes,
+ * escapes, pipes, redirects, `&&`, `||` and `&`) are parsed with `parse_command_line`, reported
+ * in commands/s and MB/s.
+ *
+ * The latency of the execution: the shell (`./a.out`) is given pipelines of 1, 5 and 20 stages
+ * of `/bin/true` one at a time, and `&&`/`||` chains of the builtins and of `/bin/true`. Each
+ * command is followed by an `echo` whose output marks that it is over. The time from writing the
+ * command to reading the mark is reported as percentiles.
+ *
+ * The throughput of a pipeline: 1 GiB goes through `head -c ... /dev/zero | cat`, with the default
+ * pipes and with `SHELL_PIPE_SIZE`. The context switches of the shell and its stages are reported
+ * per GiB, along with the time.
+ *
+ * Usage: ./bench [--runs N] [--chain N] [--shell PATH] [--json FILE]. The runs are of each
+ * pipeline. The JSON file gets the same numbers, to compare between the commits.
+ */
+
+enum {
+    BENCH_PARSE_LINES = 100000,
+    BENCH_PARSE_RUNS = 5,
+    BENCH_RUNS_DEFAULT = 200,
+    BENCH_CHAIN_DEFAULT = 10000,
+    BENCH_CHAIN_RUNS = 5,
+    BENCH_OUT_SIZE = 4096,
+    BENCH_PIPE_BYTES = 1 << 30,
+};
+
+static const char bench_mark[] = "@bench@\n";
+
+static FILE *bench_json_file = NULL;
+static const char *bench_json_sep = "";
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_double_cmp(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/// Start a result in the JSON, named `name`: the fields are to follow, then `}`
+static bool bench_json_begin(const char *name) {
+    if (!bench_json_file)
+        return false;
+    fprintf(bench_json_file, "%s\n  {\"name\": \"%s\"", bench_json_sep, name);
+    bench_json_sep = ",";
+    return true;
+}
+
+/// Sort the `count` seconds of `values` and print their percentiles, in ms
+static void bench_print_percentiles(const char *name, double *values, size_t count) {
+    qsort(values, count, sizeof (*values), bench_double_cmp);
+    printf("%-28s %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, values[0] * 1e3,
+           values[count / 2] * 1e3, values[count * 9 / 10] * 1e3, values[count * 99 / 100] * 1e3,
+           values[count - 1] * 1e3);
+    if (bench_json_begin(name))
+        fprintf(bench_json_file, ", \"latency_ms\": {\"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+                "\"p99\": %.3f, \"max\": %.3f}}", values[0] * 1e3, values[count / 2] * 1e3,
+                values[count * 9 / 10] * 1e3, values[count * 99 / 100] * 1e3,
+                values[count - 1] * 1e3);
+}
+
+/// Append the `i`-th command of the generated script to `out`, returns the end of it
+static char *bench_command(char *out, size_t i) {
+    static const char *const templates[] = {
+        "echo hello world %zu",
+        "ls -la /tmp/dir%zu | grep -v total | wc -l",
+        "echo \"a quoted string %zu\" 'and a single one' esc\\ aped > out.txt",
+        "make -j4 target%zu && ./a.out --flag || echo failed",
+        "cat file%zu >> log.txt &",
+        "printf '%%s\\n' a b c d e f g h i j k l m n o p %zu",
+        "grep -r \"pattern with \\\"quotes\\\"\" src/%zu | sort | uniq -c | sort -rn | head",
+    };
+    return out + sprintf(out, templates[i % (sizeof templates / sizeof (*templates))], i) + 1;
+}
+
+static void bench_parse(void) {
+    // The commands separated by '\0', copied anew before each run, as they are parsed in place
+    size_t capacity = BENCH_PARSE_LINES * 128;
+    char *script = malloc(capacity), *work = malloc(capacity);
+    if (!script || !work) {
+        fprintf(stderr, "Out of memory for the script\n");
+        exit(EXIT_FAILURE);
+    }
+    char *end = script;
+    for (size_t i = 0; i < BENCH_PARSE_LINES; ++i)
+        end = bench_command(end, i);
+    size_t size = end - script;
+
+    struct arena arena = {};
+    double times[BENCH_PARSE_RUNS];
+    for (int run = 0; run < BENCH_PARSE_RUNS; ++run) {
+        memcpy(work, script, size);
+        double start = bench_now();
+        for (char *cmd = work; cmd < work + size; ) {
+            // The length is taken before the terminators of the words are written inside
+            size_t len = strlen(cmd);
+            struct parse_result res = parse_command_line(cmd, &arena);
+            if (res.err) {
+                fprintf(stderr, "Failed to parse %s: %s\n", script + (cmd - work), res.err);
+                exit(EXIT_FAILURE);
+            }
+            arena_reset(&arena);
+            cmd += len + 1;
+        }
+        times[run] = bench_now() - start;
+    }
+    arena_destroy(&arena);
+    qsort(times, BENCH_PARSE_RUNS, sizeof (*times), bench_double_cmp);
+    double median = times[BENCH_PARSE_RUNS / 2];
+    printf("parse_command_line: %d commands, %.1f MB, median of %d runs:\n", BENCH_PARSE_LINES,
+           size / 1e6, BENCH_PARSE_RUNS);
+    printf("%12.0f commands/s %10.1f MB/s\n\n", BENCH_PARSE_LINES / median, size / 1e6 / median);
+    // The runs as rates: the slowest is the min
+    if (bench_json_begin("parse"))
+        fprintf(bench_json_file, ", \"commands_per_s\": {\"min\": %.0f, \"median\": %.0f, "
+                "\"max\": %.0f}}", BENCH_PARSE_LINES / times[BENCH_PARSE_RUNS - 1],
+                BENCH_PARSE_LINES / median, BENCH_PARSE_LINES / times[0]);
+    free(script);
+    free(work);
+}
+
+/// The shell being measured, reading the commands from a pipe
+struct bench_shell {
+    pid_t pid;
+    int in, out;
+};
+
+static void bench_shell_start(struct bench_shell *sh, const char *path) {
+    int in[2], out[2];
+    if (0 > pipe(in) || 0 > pipe(out)) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    sh->pid = fork();
+    if (sh->pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (sh->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl(path, path, (char *)NULL);
+        perror("exec of the shell");
+        _exit(EXIT_FAILURE);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->in = in[1];
+    sh->out = out[0];
+}
+
+static void bench_shell_stop(struct bench_shell *sh) {
+    close(sh->in);
+    close(sh->out);
+    int status;
+    waitpid(sh->pid, &status, 0);
+}
+
+static void bench_write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("write to the shell");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        size -= n;
+    }
+}
+
+/// Run `cmd` in the shell, returns how long it took, seconds
+static double bench_shell_run(struct bench_shell *sh, const char *cmd) {
+    double start = bench_now();
+    bench_write_all(sh->in, cmd, strlen(cmd));
+    bench_write_all(sh->in, "\necho @bench@\n", sizeof "\necho @bench@\n" - 1);
+
+    // The commands print nothing, but whatever they do is skipped up to the mark
+    char buf[BENCH_OUT_SIZE];
+    size_t len = 0, mark_len = sizeof bench_mark - 1;
+    while (len < mark_len || memcmp(buf + len - mark_len, bench_mark, mark_len)) {
+        if (len == sizeof buf) {
+            memmove(buf, buf + len - mark_len, mark_len);
+            len = mark_len;
+        }
+        ssize_t n = read(sh->out, buf + len, sizeof buf - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "The shell is gone\n");
+            exit(EXIT_FAILURE);
+        }
+        len += n;
+    }
+    return bench_now() - start;
+}
+
+/// `count` commands, alternately `a` and `b`, joined with alternately `sep_a` and `sep_b`, allocated
+static char *bench_join(const char *a, const char *sep_a, const char *b, const char *sep_b,
+                        size_t count) {
+    size_t step = strlen(a) + strlen(b) + strlen(sep_a) + strlen(sep_b);
+    char *line = malloc(count * step + 1), *out = line;
+    if (!line) {
+        fprintf(stderr, "Out of memory for the command\n");
+        exit(EXIT_FAILURE);
+    }
+    *out = '\0';
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0)
+            out = stpcpy(out, i % 2 ? sep_a : sep_b);
+        out = stpcpy(out, i % 2 ? b : a);
+    }
+    return line;
+}
+
+/// Time `BENCH_CHAIN_RUNS` runs of `count` commands `a && b || a && b ...`, each of which runs
+static void bench_chain(struct bench_shell *sh, const char *what, const char *a, const char *b,
+                        size_t count, double *times) {
+    char *line = bench_join(a, " && ", b, " || ", count);
+    for (int i = 0; i < BENCH_CHAIN_RUNS; ++i)
+        times[i] = bench_shell_run(sh, line);
+    char name[64];
+    snprintf(name, sizeof name, "&&/|| chain of %zu %s", count, what);
+    bench_print_percentiles(name, times, BENCH_CHAIN_RUNS);
+    free(line);
+}
+
+static void bench_exec(const char *shell, int runs, size_t chain) {
+    const char *true_path = access("/bin/true", X_OK) == 0 ? "/bin/true" : "/usr/bin/true";
+    struct bench_shell sh;
+    bench_shell_start(&sh, shell);
+    // Warm up: the first commands fault the shell in and fill the PATH cache
+    for (int i = 0; i < 10; ++i)
+        bench_shell_run(&sh, true_path);
+
+    printf("%s, ms per command:\n", shell);
+    printf("%-28s %10s %10s %10s %10s %10s\n", "", "min", "p50", "p90", "p99", "max");
+    double *times = malloc((runs > BENCH_CHAIN_RUNS ? runs : BENCH_CHAIN_RUNS) * sizeof (*times));
+    if (!times) {
+        fprintf(stderr, "Out of memory for the times\n");
+        exit(EXIT_FAILURE);
+    }
+    static const int stages[] = {1, 5, 20};
+    for (size_t s = 0; s < sizeof stages / sizeof (*stages); ++s) {
+        char *line = bench_join(true_path, " | ", true_path, " | ", stages[s]);
+        for (int i = 0; i < runs; ++i)
+            times[i] = bench_shell_run(&sh, line);
+        char name[64];
+        snprintf(name, sizeof name, "pipeline of %d", stages[s]);
+        bench_print_percentiles(name, times, runs);
+        free(line);
+    }
+
+    // `a` succeeds and `b` fails, so every command of the chain runs
+    bench_chain(&sh, "builtins", "true", "false", chain, times);
+    const char *false_path = access("/bin/false", X_OK) == 0 ? "/bin/false" : "/usr/bin/false";
+    bench_chain(&sh, "spawned", true_path, false_path, chain, times);
+    free(times);
+    bench_shell_stop(&sh);
+}
+
+/// The context switches of the children waited for so far, voluntary and not
+static long bench_children_switches(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+/// Move `BENCH_PIPE_BYTES` through a pipeline of a shell run with `SHELL_PIPE_SIZE` of `pipe_size`
+static void bench_pipe_run(const char *shell, const char *pipe_size) {
+    if (pipe_size)
+        setenv("SHELL_PIPE_SIZE", pipe_size, 1);
+    else
+        unsetenv("SHELL_PIPE_SIZE");
+    char cmd[128];
+    snprintf(cmd, sizeof cmd, "head -c %d /dev/zero | cat > /dev/null", BENCH_PIPE_BYTES);
+
+    long switches = bench_children_switches();
+    struct bench_shell sh;
+    bench_shell_start(&sh, shell);
+    double time = bench_shell_run(&sh, cmd);
+    bench_shell_stop(&sh);
+    switches = bench_children_switches() - switches;
+
+    double gib = (double)BENCH_PIPE_BYTES / (1 << 30);
+    char name[64];
+    snprintf(name, sizeof name, "pipes of %s", pipe_size ? pipe_size : "the default");
+    printf("%-28s %10.3f %10.0f\n", name, time * 1e3 / gib, switches / gib);
+    if (bench_json_begin(name))
+        fprintf(bench_json_file, ", \"ms_per_gib\": %.3f, \"csw_per_gib\": %.0f}",
+                time * 1e3 / gib, switches / gib);
+    unsetenv("SHELL_PIPE_SIZE");
+}
+
+static void bench_pipe(const char *shell) {
+    printf("%s, a pipeline of 1 GiB:\n", shell);
+    printf("%-28s %10s %10s\n", "", "ms/GiB", "csw/GiB");
+    bench_pipe_run(shell, NULL);
+    bench_pipe_run(shell, "256K");
+    bench_pipe_run(shell, "1M");
+}
+
+int main(int argc, char **argv) {
+    int runs = BENCH_RUNS_DEFAULT;
+    size_t chain = BENCH_CHAIN_DEFAULT;
+    const char *shell = "./a.out";
+    const char *json_path = NULL;
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--runs") == 0) {
+            runs = strtol(argv[2], NULL, 10);
+        } else if (strcmp(argv[1], "--chain") == 0) {
+            chain = strtoul(argv[2], NULL, 10);
+        } else if (strcmp(argv[1], "--shell") == 0) {
+            shell = argv[2];
+        } else if (strcmp(argv[1], "--json") == 0) {
+            json_path = argv[2];
+        } else {
+            printf("Unknown option %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (runs < 1 || chain < 2) {
+        printf("There must be at least 1 run and a chain of 2 commands\n");
+        return EXIT_FAILURE;
+    }
+    if (json_path) {
+        bench_json_file = fopen(json_path, "w");
+        if (!bench_json_file) {
+            perror("fopen");
+            return EXIT_FAILURE;
+        }
+        fprintf(bench_json_file, "{\"runs\": %d, \"chain\": %zu, \"results\": [", runs, chain);
+    }
+    signal(SIGPIPE, SIG_IGN);  // The shell failing is reported
+    bench_parse();
+    bench_exec(shell, runs, chain);
+    bench_pipe(shell);
+    if (bench_json_file) {
+        fprintf(bench_json_file, "\n]}\n");
+        fclose(bench_json_file);
+    }
+    return 0;
+}
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "builtins.h"
+#include "loadable.h"
+#include "coproc.h"
+#include "history.h"
+
+#define STATUS_EXITED(code) ((code) << 8)
+
+/// Write all of `buf` to `fd`, see builtins.h
+int builtin_write(const char *name, int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buf, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            if (errno == EPIPE)
+                return SIGPIPE;
+            fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+            return STATUS_EXITED(EXIT_FAILURE);
+        }
+        buf += written;
+        size -= written;
+    }
+    return STATUS_EXITED(EXIT_SUCCESS);
+}
+
+/// The sole argument is `--help` or `--version`, which the coreutils commands answer
+static bool is_info_request(char **argv) {
+    return argv[1] && !argv[2] && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "--version"));
+}
+
+static int builtin_true(char **argv, int out_fd) {
+    (void)argv, (void)out_fd;
+    return STATUS_EXITED(EXIT_SUCCESS);
+}
+
+static int builtin_false(char **argv, int out_fd) {
+    (void)argv, (void)out_fd;
+    return STATUS_EXITED(EXIT_FAILURE);
+}
+
+/// Is `arg` an option of coreutils echo (`-n`, `-e`, `-E` or a combination)?
+static bool is_echo_option(const char *arg) {
+    return arg[0] == '-' && arg[1] && !arg[strspn(arg + 1, "neE") + 1];
+}
+
+/// Parse the options of echo. Returns `false` if the escapes are enabled, they are not supported
+static bool echo_options(char **argv, char ***args, bool *newline) {
+    bool escapes = false;
+    *newline = true;
+    for (argv++; *argv && is_echo_option(*argv); argv++) {
+        for (const char *c = *argv + 1; *c; ++c) {
+            if (*c == 'n') *newline = false;
+            else escapes = *c == 'e';
+        }
+    }
+    *args = argv;
+    return !escapes;
+}
+
+static int builtin_echo(char **argv, int out_fd) {
+    char **args;
+    bool newline;
+    (void)echo_options(argv, &args, &newline);
+
+    // Gather the whole output, so that it is written at once, like by the buffered stdout
+    size_t size = newline;
+    for (char **arg = args; *arg; ++arg)
+        size += strlen(*arg) + 1;
+    char small[256] = "";  // Initialized for -O2, which can not see it is not read when empty
+    char *buf = size <= sizeof small ? small : malloc(size);
+    if (!buf) {
+        fprintf(stderr, "echo: memory exhausted\n");
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    for (char **arg = args; *arg; ++arg) {
+        if (arg != args)
+            buf[len++] = ' ';
+        size_t arg_len = strlen(*arg);
+        memcpy(buf + len, *arg, arg_len);
+        len += arg_len;
+    }
+    if (newline)
+        buf[len++] = '\n';
+
+    int status = builtin_write("echo", out_fd, buf, len);
+    if (buf != small)
+        free(buf);
+    return status;
+}
+
+static int builtin_pwd(char **argv, int out_fd) {
+    (void)argv;
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        fprintf(stderr, "pwd: %s\n", strerror(errno));
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    size_t len = strlen(cwd);
+    cwd[len] = '\n';  // In place of the terminator: the output is not a string anyway
+    int status = builtin_write("pwd", out_fd, cwd, len + 1);
+    free(cwd);
+    return status;
+}
+
+/// Are the arguments of `cat` plain files (and no options), which the builtin handles?
+static bool is_cat_of_files(char **argv) {
+    if (!argv[1])
+        return false;  // Copies the standard input
+    for (char **arg = argv + 1; *arg; ++arg) {
+        struct stat st;
+        if ((*arg)[0] == '-' || 0 != stat(*arg, &st) || !S_ISREG(st.st_mode))
+            return false;
+    }
+    return true;
+}
+
+bool is_cat_of_file(char **argv) {
+    return !strcmp(argv[0], "cat") && argv[1] && !argv[2] && is_cat_of_files(argv);
+}
+
+/// Copy the rest of `in_fd` to `out_fd` in the kernel. Returns `false` with `errno` on error
+static bool cat_copy(int in_fd, int out_fd, bool is_out_regular) {
+    // Whichever of the calls the files support, then plain read and write
+    bool use_range = is_out_regular, use_sendfile = true;
+    while (1) {
+        ssize_t copied;
+        if (use_range)
+            copied = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0);
+        else if (use_sendfile)
+            copied = sendfile(out_fd, in_fd, NULL, 1 << 30);
+        else
+            break;
+        if (copied == 0)
+            return true;
+        if (copied > 0)
+            continue;
+        if (errno == EINTR)
+            continue;
+        // `copy_file_range` does not take an output opened with `O_APPEND`
+        if (errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+                !(use_range && errno == EBADF))
+            return false;
+        if (use_range)
+            use_range = false;
+        else
+            use_sendfile = false;
+    }
+
+    char buf[64 * 1024];
+    while (1) {
+        ssize_t got = read(in_fd, buf, sizeof buf);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return got == 0;
+        for (ssize_t done = 0; done < got; ) {
+            ssize_t written = write(out_fd, buf + done, got - done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return false;
+            done += written;
+        }
+    }
+}
+
+static int builtin_cat(char **argv, int out_fd) {
+    struct stat out_st;
+    bool is_out_regular = 0 == fstat(out_fd, &out_st) && S_ISREG(out_st.st_mode);
+    int status = STATUS_EXITED(EXIT_SUCCESS);
+    for (char **arg = argv + 1; *arg; ++arg) {
+        int fd = open(*arg, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", *arg, strerror(errno));
+            status = STATUS_EXITED(EXIT_FAILURE);
+            continue;
+        }
+        struct stat st;
+        if (is_out_regular && 0 == fstat(fd, &st) && st.st_dev == out_st.st_dev &&
+                st.st_ino == out_st.st_ino && st.st_size > 0) {
+            // Like coreutils: copying a file to its own end would never finish
+            fprintf(stderr, "cat: %s: input file is output file\n", *arg);
+            status = STATUS_EXITED(EXIT_FAILURE);
+        } else if (!cat_copy(fd, out_fd, is_out_regular)) {
+            int err = errno;
+            (void)close(fd);
+            if (err == EPIPE)
+                return SIGPIPE;
+            fprintf(stderr, "cat: %s\n", strerror(err));
+            return STATUS_EXITED(EXIT_FAILURE);
+        }
+        (void)close(fd);
+    }
+    return status;
+}
+
+/*
+ * The expressions of test(1), as POSIX defines them by the number of arguments (up to four),
+ * with the usual unary file and string operators and the binary string and integer ones.
+ * The rest (`-a`, `-o`, `-nt`, ...), and the malformed expressions, which coreutils report
+ * with its own messages, are left to it.
+ */
+
+/// Result of a `test` expression, or `TEST_UNSUPPORTED`
+enum { TEST_TRUE, TEST_FALSE, TEST_UNSUPPORTED };
+
+static int test_bool(bool b) {
+    return b ? TEST_TRUE : TEST_FALSE;
+}
+
+static int test_negate(int res) {
+    return res == TEST_UNSUPPORTED ? res : test_bool(res == TEST_FALSE);
+}
+
+static bool is_test_unary(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("nzefdsrwxLhpSbcgku", op[1]);
+}
+
+static int test_unary(char op, const char *arg) {
+    if (op == 'n' || op == 'z')
+        return test_bool((*arg != '\0') == (op == 'n'));
+
+    struct stat st;
+    if (op == 'L' || op == 'h')
+        return test_bool(lstat(arg, &st) == 0 && S_ISLNK(st.st_mode));
+    if (op == 'r' || op == 'w' || op == 'x')
+        return test_bool(eaccess(arg, op == 'r' ? R_OK : op == 'w' ? W_OK : X_OK) == 0);
+    if (stat(arg, &st) != 0)
+        return TEST_FALSE;
+    switch (op) {
+    case 'e': return TEST_TRUE;
+    case 'f': return test_bool(S_ISREG(st.st_mode));
+    case 'd': return test_bool(S_ISDIR(st.st_mode));
+    case 's': return test_bool(st.st_size > 0);
+    case 'p': return test_bool(S_ISFIFO(st.st_mode));
+    case 'S': return test_bool(S_ISSOCK(st.st_mode));
+    case 'b': return test_bool(S_ISBLK(st.st_mode));
+    case 'c': return test_bool(S_ISCHR(st.st_mode));
+    case 'g': return test_bool(st.st_mode & S_ISGID);
+    case 'k': return test_bool(st.st_mode & S_ISVTX);
+    case 'u': return test_bool(st.st_mode & S_ISUID);
+    }
+    return TEST_UNSUPPORTED;
+}
+
+/// Parse a plain decimal integer which surely fits. Returns `false` for anything else
+static bool test_integer(const char *s, long long *value) {
+    const char *digits = s + (*s == '-');
+    size_t len = strspn(digits, "0123456789");
+    if (len == 0 || len > 18 || digits[len])
+        return false;
+    *value = strtoll(s, NULL, 10);
+    return true;
+}
+
+static bool is_test_binary(const char *op) {
+    static const char *const ops[] = {"=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (size_t i = 0; i < sizeof ops / sizeof *ops; ++i) {
+        if (!strcmp(op, ops[i]))
+            return true;
+    }
+    return false;
+}
+
+static int test_binary(const char *a, const char *op, const char *b) {
+    if (op[0] != '-')
+        return test_bool(!strcmp(a, b) == (op[0] != '!'));
+
+    long long x, y;
+    if (!test_integer(a, &x) || !test_integer(b, &y))
+        return TEST_UNSUPPORTED;
+    if (!strcmp(op, "-eq")) return test_bool(x == y);
+    if (!strcmp(op, "-ne")) return test_bool(x != y);
+    if (!strcmp(op, "-lt")) return test_bool(x < y);
+    if (!strcmp(op, "-le")) return test_bool(x <= y);
+    if (!strcmp(op, "-gt")) return test_bool(x > y);
+    return test_bool(x >= y);
+}
+
+static int test_eval(int argc, char **argv) {
+    switch (argc) {
+    case 0:
+        return TEST_FALSE;
+    case 1:
+        return test_bool(argv[0][0] != '\0');
+    case 2:
+        if (!strcmp(argv[0], "!"))
+            return test_negate(test_eval(1, argv + 1));
+        if (is_test_unary(argv[0]))
+            return test_unary(argv[0][1], argv[1]);
+        return TEST_UNSUPPORTED;
+    case 3:
+        if (is_test_binary(argv[1]))
+            return test_binary(argv[0], argv[1], argv[2]);
+        if (!strcmp(argv[0], "!"))
+            return test_negate(test_eval(2, argv + 1));
+        if (!strcmp(argv[0], "(") && !strcmp(argv[2], ")"))
+            return test_eval(1, argv + 1);
+        return TEST_UNSUPPORTED;
+    case 4:
+        if (!strcmp(argv[0], "!"))
+            return test_negate(test_eval(3, argv + 1));
+        if (!strcmp(argv[0], "(") && !strcmp(argv[3], ")"))
+            return test_eval(2, argv + 1);
+        return TEST_UNSUPPORTED;
+    }
+    return TEST_UNSUPPORTED;
+}
+
+/// The expression of `test` or `[`, without the closing `]`. Returns `false` if malformed
+static bool test_args(char **argv, int *argc) {
+    int count = 0;
+    while (argv[count + 1])
+        ++count;
+    if (!strcmp(argv[0], "[")) {
+        if (count == 0 || strcmp(argv[count], "]"))
+            return false;  // The error message is left to coreutils
+        --count;
+    }
+    *argc = count;
+    return true;
+}
+
+static int builtin_test(char **argv, int out_fd) {
+    (void)out_fd;
+    int argc;
+    (void)test_args(argv, &argc);
+    // Not `TEST_UNSUPPORTED`: it was checked by `find_builtin`
+    return STATUS_EXITED(test_eval(argc, argv + 1));
+}
+
+/// `history [N]`: the last N commands (all of them without N), numbered like by bash
+static int builtin_history(char **argv, int out_fd) {
+    size_t count = 0;
+    if (argv[1]) {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(argv[1], &end, 10);
+        if (errno || end == argv[1] || *end || argv[1][0] == '-' || argv[2]) {
+            fprintf(stderr, "history: usage: history [N]\n");
+            return STATUS_EXITED(EXIT_FAILURE);
+        }
+        count = n;
+    }
+
+    history_sync();
+    size_t total = history_count();
+    size_t i = count && count < total ? total - count : 0;
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buf, &size);
+    if (!out) {
+        fprintf(stderr, "history: %s\n", strerror(errno));
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    for (; i < total; ++i)
+        fprintf(out, "%5zu  %s\n", i + 1, history_entry(i));
+    if (fclose(out)) {
+        free(buf);
+        fprintf(stderr, "history: %s\n", strerror(ENOMEM));
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    int status = builtin_write("history", out_fd, buf, size);
+    free(buf);
+    return status;
+}
+
+builtin_f find_extension_builtin(const char *name) {
+    builtin_f f = loadable_find(name);
+    if (!f && coproc_find(name))
+        f = coproc_request;
+    return f;
+}
+
+builtin_f find_builtin(char **argv, bool background) {
+    const char *name = argv[0];
+    builtin_f extension = find_extension_builtin(name);
+    if (extension)
+        return extension;
+    // The coreutils commands behave differently in the POSIX mode
+    bool is_posix = getenv("POSIXLY_CORRECT") != NULL;
+
+    if (!strcmp(name, "true") || !strcmp(name, "false")) {
+        if (is_info_request(argv))
+            return NULL;
+        return name[0] == 't' ? builtin_true : builtin_false;
+    } else if (!strcmp(name, "echo")) {
+        char **args;
+        bool newline;
+        if (is_posix || is_info_request(argv) || !echo_options(argv, &args, &newline))
+            return NULL;
+        return builtin_echo;
+    } else if (!strcmp(name, "pwd")) {
+        return is_posix || argv[1] ? NULL : builtin_pwd;
+    } else if (!strcmp(name, "test") || !strcmp(name, "[")) {
+        int argc;
+        if ((name[0] == '[' && is_info_request(argv)) || !test_args(argv, &argc) ||
+                test_eval(argc, argv + 1) == TEST_UNSUPPORTED)
+            return NULL;
+        return builtin_test;
+    } else if (!strcmp(name, "cat")) {
+        return !background && is_cat_of_files(argv) ? builtin_cat : NULL;
+    } else if (!strcmp(name, "history")) {
+        return builtin_history;
+    }
+    return NULL;
+}
+
+int run_builtin(builtin_f f, char **argv, int out_fd) {
+    // A write to a pipe without the reader must fail with `EPIPE` instead of killing the shell.
+    // The signal it raises is discarded before it is unblocked
+    sigset_t pipe_set, old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    int status = f(argv, out_fd);
+
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE) && !sigismember(&old_set, SIGPIPE)) {
+        const struct timespec zero = {0, 0};
+        (void)sigtimedwait(&pipe_set, NULL, &zero);
+    }
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    return status;
+}
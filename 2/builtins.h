@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Builtin versions of the simple commands scripts call in tight loops: `echo`, `true`, `false`,
+ * `pwd` and `test` (`[`). They are run by the shell itself instead of fork and exec, and
+ * produce the same output and exit status as the coreutils ones. The argument combinations
+ * they do not reproduce exactly (e.g. `echo -e`, `--help`) are left to the real command.
+ *
+ * `cat` of plain files is a builtin too: the data is copied by the kernel (`copy_file_range`,
+ * `sendfile`), without a pass through userspace buffers.
+ *
+ * `history` lists the commands of the interactive shells, see history.h.
+ *
+ * The builtins loaded by `enable -f` (see loadable.h) and the requests to the coprocesses of
+ * `coproc` (see coproc.h) are found here too, before the ones above.
+ */
+
+/**
+ * A builtin writes its output to `out_fd` and returns the resulting status in the format
+ * of `waitpid`. It ignores the standard input.
+ */
+typedef int (*builtin_f)(char **argv, int out_fd);
+
+/**
+ * The builtin which can run `argv`, `NULL` if it shall be executed as usual. For a job in the
+ * `background` the ones which may take long (`cat`) are not used, as the shell would wait.
+ */
+builtin_f find_builtin(char **argv, bool background);
+
+/**
+ * The builtin of the loaded ones or of the coprocesses named `name`, `NULL` if none. They have no
+ * executable, so they are run in the child of the shell too where it runs the stage itself.
+ */
+builtin_f find_extension_builtin(const char *name);
+
+/**
+ * Is `argv` the builtin `cat` of a single file? Then its output is just the file, so the next
+ * stage of a pipeline can read the file right away instead.
+ */
+bool is_cat_of_file(char **argv);
+
+/**
+ * Run the builtin `f`. If the reader of `out_fd` is gone, it fails as if killed by `SIGPIPE`,
+ * but the shell is not.
+ */
+int run_builtin(builtin_f f, char **argv, int out_fd);
+
+/**
+ * Write all of `buf` to `out_fd` for the builtin `name`. Returns the status: success, a write
+ * error (reported), or `SIGPIPE` if the reader is gone.
+ */
+int builtin_write(const char *name, int out_fd, const char *buf, size_t size);
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "builtins.h"
+#include "coproc.h"
+
+#define STATUS_EXITED(code) ((code) << 8)
+
+enum {
+    COPROC_BUF_MIN = 4096,
+};
+
+struct coproc {
+    char *name;
+    char *command;  // The command line, to be listed
+    pid_t pid;
+    int to_fd;  // Its standard input
+    int from_fd;  // Its standard output
+    // What is read from it beyond the last answer
+    char *buf;
+    size_t len;
+    size_t capacity;
+};
+
+// A few of them, looked up by the name for each command
+static struct {
+    struct coproc *items;
+    size_t count;
+    size_t capacity;
+} table;
+
+static struct coproc *find(const char *name) {
+    for (size_t i = 0; i < table.count; ++i) {
+        if (!strcmp(table.items[i].name, name))
+            return &table.items[i];
+    }
+    return NULL;
+}
+
+bool coproc_find(const char *name) {
+    return table.count && find(name);
+}
+
+/// Close the pipes of `c`, terminate it if it is still there, reap it and remove it from the table
+static void drop(struct coproc *c) {
+    (void)close(c->to_fd);
+    (void)close(c->from_fd);
+    (void)kill(c->pid, SIGTERM);
+    (void)waitpid(c->pid, NULL, 0);
+    free(c->name);
+    free(c->command);
+    free(c->buf);
+    *c = table.items[--table.count];
+}
+
+/// The words of `argv` joined by spaces and followed by `end`, allocated
+static char *join(char **argv, const char *end) {
+    size_t size = strlen(end) + 1;
+    for (char **arg = argv; *arg; ++arg)
+        size += strlen(*arg) + 1;
+    char *line = malloc(size);
+    if (!line)
+        return NULL;
+    char *out = line;
+    for (char **arg = argv; *arg; ++arg)
+        out = stpcpy(stpcpy(out, arg == argv ? "" : " "), *arg);
+    strcpy(out, end);
+    return line;
+}
+
+/// Start the coprocess `name` of the command `argv`. Returns `false` if failed, reported
+static bool start(const char *name, char **argv) {
+    if (find(name)) {
+        fprintf(stderr, "coproc: %s: already running\n", name);
+        return false;
+    }
+    if (table.count == table.capacity) {
+        size_t capacity = table.capacity ? 2 * table.capacity : 8;
+        struct coproc *items = realloc(table.items, capacity * sizeof (*items));
+        if (!items) {
+            fprintf(stderr, "coproc: out of memory\n");
+            return false;
+        }
+        table.items = items;
+        table.capacity = capacity;
+    }
+    struct coproc c = {.name = strdup(name), .command = join(argv, "")};
+    if (!c.name || !c.command) {
+        fprintf(stderr, "coproc: out of memory\n");
+        goto err_free;
+    }
+
+    // The ends of the shell are close-on-exec: only the coprocess has the others
+    int to[2], from[2];
+    if (0 > pipe2(to, O_CLOEXEC)) {
+        fprintf(stderr, "coproc: failed to open pipe: %s\n", strerror(errno));
+        goto err_free;
+    }
+    if (0 > pipe2(from, O_CLOEXEC)) {
+        fprintf(stderr, "coproc: failed to open pipe: %s\n", strerror(errno));
+        (void)close(to[0]);
+        (void)close(to[1]);
+        goto err_free;
+    }
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (!err)
+        err = posix_spawn_file_actions_adddup2(&actions, to[0], STDIN_FILENO);
+    if (!err)
+        err = posix_spawn_file_actions_adddup2(&actions, from[1], STDOUT_FILENO);
+    if (!err) {
+        err = posix_spawnp(&c.pid, argv[0], &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    (void)close(to[0]);
+    (void)close(from[1]);
+    if (err) {
+        fprintf(stderr, "coproc: failed to exec %s: %s\n", argv[0], strerror(err));
+        (void)close(to[1]);
+        (void)close(from[0]);
+        goto err_free;
+    }
+    c.to_fd = to[1];
+    c.from_fd = from[0];
+    table.items[table.count++] = c;
+    return true;
+
+err_free:
+    free(c.name);
+    free(c.command);
+    return false;
+}
+
+int coproc_request(char **argv, int out_fd) {
+    struct coproc *c = find(argv[0]);
+    char *line = join(argv + 1, "\n");
+    if (!line) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    // A write to the exited one fails with `EPIPE`, see `run_builtin`
+    size_t size = strlen(line);
+    bool is_gone = false;
+    for (size_t pos = 0; pos < size && !is_gone;) {
+        ssize_t written = write(c->to_fd, line + pos, size - pos);
+        if (written < 0 && errno == EINTR)
+            continue;
+        is_gone = written < 0;
+        pos += written;
+    }
+    free(line);
+
+    // The answer is up to the line break. What is read after it is left to the next one
+    size_t scanned = 0;
+    char *nl = NULL;
+    while (!is_gone) {
+        if (c->len > scanned && (nl = memchr(c->buf + scanned, '\n', c->len - scanned)))
+            break;
+        scanned = c->len;
+        if (c->len == c->capacity) {
+            size_t capacity = c->capacity ? 2 * c->capacity : COPROC_BUF_MIN;
+            char *buf = realloc(c->buf, capacity);
+            if (!buf) {
+                fprintf(stderr, "%s: out of memory\n", c->name);
+                return STATUS_EXITED(EXIT_FAILURE);
+            }
+            c->buf = buf;
+            c->capacity = capacity;
+        }
+        ssize_t n = read(c->from_fd, c->buf + c->len, c->capacity - c->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        is_gone = n <= 0;
+        if (!is_gone)
+            c->len += n;
+    }
+
+    size_t answer = nl ? (size_t)(nl - c->buf) + 1 : c->len;
+    int status = builtin_write(c->name, out_fd, c->buf, answer);
+    if (is_gone) {
+        fprintf(stderr, "%s: the coprocess has exited\n", c->name);
+        drop(c);
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    c->len -= answer;
+    memmove(c->buf, c->buf + answer, c->len);
+    return status;
+}
+
+int coproc_builtin(char **argv) {
+    if (!argv[1]) {
+        for (size_t i = 0; i < table.count; ++i)
+            printf("%s\t%d\t%s\n", table.items[i].name, (int)table.items[i].pid,
+                   table.items[i].command);
+        fflush(stdout);  // The commands write to the same file directly
+        return STATUS_EXITED(EXIT_SUCCESS);
+    }
+    if (!strcmp(argv[1], "-d") && argv[2]) {
+        bool is_ok = true;
+        for (char **name = argv + 2; *name; ++name) {
+            struct coproc *c = find(*name);
+            if (c) {
+                drop(c);
+            } else {
+                fprintf(stderr, "coproc: %s: no such coprocess\n", *name);
+                is_ok = false;
+            }
+        }
+        return STATUS_EXITED(is_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    if (argv[1][0] == '-' || !argv[2]) {
+        fprintf(stderr, "coproc: usage: coproc [NAME COMMAND [ARG...]] [-d NAME...]\n");
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    return STATUS_EXITED(start(argv[1], argv + 2) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
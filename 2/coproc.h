@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * The coprocesses: long-lived children of the shell which it talks to over pipes, so a command
+ * called again and again is started once. `coproc NAME COMMAND [ARG...]` starts COMMAND with its
+ * standard input and output connected to the shell. From then on the command `NAME ARG...` is
+ * a request to it: the arguments joined by spaces are written to it as a line, and the line it
+ * answers with is the output. So it is for the commands reading a line and answering it with
+ * a line right away, like `bc`, `sed -u` or a script of the own. It is run as a builtin (see
+ * builtins.h), in the background jobs too, and waits for the answer.
+ *
+ * A coprocess which has exited is dropped on its next request, which fails. `coproc -d NAME`
+ * closes its input and terminates it, `coproc` lists them all.
+ */
+
+/** Is there the coprocess `name`? */
+bool coproc_find(const char *name);
+
+/** The request to the coprocess `argv[0]`, a `builtin_f`. */
+int coproc_request(char **argv, int out_fd);
+
+/**
+ * The `coproc` builtin: `coproc NAME COMMAND [ARG...]`, `coproc -d NAME...` and `coproc`, see
+ * above. Returns the status in the format of `waitpid`.
+ */
+int coproc_builtin(char **argv);
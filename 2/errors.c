@@ -5,4 +5,5 @@ const char err_trailing_redir[] = "Parse error: redirect at the end of the comma
 const char err_invalid_filename[] = "Parse error: redirection filename contains special characters";
 const char err_invalid_operator[] = "Parse error: invalid operator";
 const char err_argless_command[] = "Parse error: encountered a command with no arguments (a pipe at the end of the command?)";
+const char err_ambiguous_redirect[] = "Expansion error: ambiguous redirect";
 const char err_input_is_over[] = "";  // Never printed to user
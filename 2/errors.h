@@ -1,3 +1,3 @@
 extern const char err_oom[], err_trailing_backslash[], err_unclosed_quot[],
        err_trailing_redir[], err_invalid_filename[], err_invalid_operator[],
-       err_argless_command[], err_input_is_over[];
+       err_argless_command[], err_ambiguous_redirect[], err_input_is_over[];
@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "expand.h"
+#include "errors.h"
+#include "tokenizer.h"
+
+enum {
+    EXPAND_DIR_BATCH = 32 * 1024,  // Of a `getdents64`
+    EXPAND_BUF_MIN = 256,
+    EXPAND_DIRS_MIN = 16,
+};
+
+/// Of the characters each mark is put instead of
+static const char mark_chars[MARK_END] = {
+    [MARK_STAR] = '*', [MARK_QUESTION] = '?', [MARK_BRACKET] = '[',
+    [MARK_VAR] = '$', [MARK_VAR_QUOTED] = '$',
+};
+
+/// A record of `getdents64`
+struct dirent64_raw {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_entry {
+    const char *name;
+    unsigned char type;  // `DT_*`
+};
+
+struct expand_dir {
+    char *path;  // `NULL` for a free slot
+    // The entries as the directory lists them, none if it could not be read
+    struct dir_entry *entries;
+    size_t count;
+};
+
+/// A string on the heap, as long as the longest one made in it
+struct expand_buf {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+/// The state of expanding the words of a stage
+struct expander {
+    struct expand_cache *cache;
+    struct arena *arena;
+    // The field of the word being made
+    struct expand_buf field;
+    // The path being matched against the pattern, a directory ending with '/' but at its end
+    struct expand_buf path;
+    // The name of a variable, null-terminated for `getenv`
+    struct expand_buf name;
+    // The new `argv` being made in the arena
+    char **argv;
+    int argc;
+    int capacity;
+};
+
+inline static bool is_mark(char c) {
+    return (unsigned char)c - 1 < MARK_END - 1;
+}
+
+inline static bool is_glob_mark(char c) {
+    return c == MARK_STAR || c == MARK_QUESTION || c == MARK_BRACKET;
+}
+
+static bool has_marks(const char *s) {
+    for (; *s; ++s) {
+        if (is_mark(*s))
+            return true;
+    }
+    return false;
+}
+
+static bool has_glob_marks(const char *s, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (is_glob_mark(s[i]))
+            return true;
+    }
+    return false;
+}
+
+void expand_unmark(char *s) {
+    for (; *s; ++s) {
+        if (is_mark(*s))
+            *s = mark_chars[(unsigned char)*s];
+    }
+}
+
+/// Append `len` characters of `s` to `b`, keeping it null-terminated. Returns `false` if out of memory
+static bool buf_put(struct expand_buf *b, const char *s, size_t len) {
+    if (b->len + len >= b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : EXPAND_BUF_MIN;
+        while (b->len + len >= capacity)
+            capacity *= 2;
+        char *data = realloc(b->data, capacity);
+        if (!data)
+            return false;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return true;
+}
+
+/// Cut `b` to its first `len` characters
+inline static void buf_truncate(struct expand_buf *b, size_t len) {
+    b->len = len;
+    if (b->data)
+        b->data[len] = '\0';
+}
+
+/// Append the word `word` to the new `argv`. Returns `false` if out of memory
+static bool push_arg(struct expander *ex, char *word) {
+    if (ex->argc + 1 >= ex->capacity) {
+        int capacity = ex->capacity ? 2 * ex->capacity : 8;
+        char **argv = arena_realloc(ex->arena, ex->argv, ex->capacity * sizeof (char *),
+                                    capacity * sizeof (char *));
+        if (!argv)
+            return false;
+        ex->argv = argv;
+        ex->capacity = capacity;
+    }
+    ex->argv[ex->argc++] = word;
+    ex->argv[ex->argc] = NULL;
+    return true;
+}
+
+/// Copy `len` characters of `s` to the arena and append them to the new `argv`
+static bool push_copy(struct expander *ex, const char *s, size_t len) {
+    char *word = arena_alloc(ex->arena, len + 1);
+    if (!word)
+        return false;
+    memcpy(word, s, len);
+    word[len] = '\0';
+    return push_arg(ex, word);
+}
+
+static uint64_t hash_path(const char *path) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (; *path; ++path)
+        h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+    return h;
+}
+
+static struct expand_dir *find_slot(struct expand_dir *dirs, size_t capacity, const char *path) {
+    size_t i = hash_path(path) & (capacity - 1);
+    while (dirs[i].path && strcmp(dirs[i].path, path))
+        i = (i + 1) & (capacity - 1);
+    return &dirs[i];
+}
+
+/// Double the table of `c`, the old one is left to the arena. Returns `false` if out of memory
+static bool cache_grow(struct expand_cache *c) {
+    size_t capacity = c->capacity ? 2 * c->capacity : EXPAND_DIRS_MIN;
+    struct expand_dir *dirs = arena_alloc(c->arena, capacity * sizeof (*dirs));
+    if (!dirs)
+        return false;
+    for (size_t i = 0; i < capacity; ++i)
+        dirs[i].path = NULL;
+    for (size_t i = 0; i < c->capacity; ++i) {
+        if (c->dirs[i].path)
+            *find_slot(dirs, capacity, c->dirs[i].path) = c->dirs[i];
+    }
+    c->dirs = dirs;
+    c->capacity = capacity;
+    return true;
+}
+
+/**
+ * Read the entries of the directory `path` to `d`: the records of a batch are copied to the arena
+ * as they are, and the entries point to the names in there. A directory which can not be read
+ * has no entries. Returns `false` if out of memory.
+ */
+static bool dir_read(struct arena *arena, struct expand_dir *d, const char *path) {
+    d->entries = NULL;
+    d->count = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return true;
+    alignas(8) char batch[EXPAND_DIR_BATCH];
+    struct dir_entry *entries = NULL;
+    size_t capacity = 0;
+    bool is_ok = true;
+    long n;
+    while (is_ok && (n = syscall(SYS_getdents64, fd, batch, sizeof batch)) > 0) {
+        char *records = arena_alloc(arena, n);
+        is_ok = records;
+        if (is_ok)
+            memcpy(records, batch, n);
+        for (long pos = 0; is_ok && pos < n;) {
+            const struct dirent64_raw *rec = (const struct dirent64_raw *)(records + pos);
+            pos += rec->d_reclen;
+            if (d->count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                struct dir_entry *grown = realloc(entries, capacity * sizeof (*entries));
+                is_ok = grown;
+                if (!is_ok)
+                    break;
+                entries = grown;
+            }
+            entries[d->count++] = (struct dir_entry){.name = rec->d_name, .type = rec->d_type};
+        }
+    }
+    (void)close(fd);
+    if (is_ok && d->count) {
+        d->entries = arena_alloc(arena, d->count * sizeof (*entries));
+        is_ok = d->entries;
+        if (is_ok)
+            memcpy(d->entries, entries, d->count * sizeof (*entries));
+    }
+    free(entries);
+    return is_ok;
+}
+
+/// The directory `path` from the cache, read into it if not there. `NULL` if out of memory
+static const struct expand_dir *cache_dir(struct expand_cache *c, const char *path) {
+    if (c->capacity) {
+        struct expand_dir *d = find_slot(c->dirs, c->capacity, path);
+        if (d->path)
+            return d;
+    }
+    if (2 * (c->count + 1) > c->capacity && !cache_grow(c))
+        return NULL;
+    struct expand_dir *d = find_slot(c->dirs, c->capacity, path);
+    size_t len = strlen(path);
+    char *copy = arena_alloc(c->arena, len + 1);
+    if (!copy || !dir_read(c->arena, d, path))
+        return NULL;
+    d->path = memcpy(copy, path, len + 1);
+    ++c->count;
+    return d;
+}
+
+/**
+ * The fnmatch(3) pattern of the `len` characters of `s`, allocated: the marks are the special
+ * characters, and the rest are escaped where they would be special.
+ */
+static char *fnmatch_pattern(const char *s, size_t len) {
+    char *pattern = malloc(2 * len + 1);
+    if (!pattern)
+        return NULL;
+    char *out = pattern;
+    for (size_t i = 0; i < len; ++i) {
+        if (is_mark(s[i])) {
+            *out++ = mark_chars[(unsigned char)s[i]];
+            continue;
+        }
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+            *out++ = '\\';
+        *out++ = s[i];
+    }
+    *out = '\0';
+    return pattern;
+}
+
+inline static bool may_be_dir(unsigned char type) {
+    return type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN;
+}
+
+/**
+ * Append the paths of `ex->path` followed by what matches `pattern` to the new `argv`. Returns
+ * how many there are, or -1 if out of memory.
+ */
+static long glob_from(struct expander *ex, const char *pattern) {
+    struct expand_buf *path = &ex->path;
+    size_t base = path->len;
+    const char *slash = strchr(pattern, '/');
+    size_t len = slash ? (size_t)(slash - pattern) : strlen(pattern);
+
+    long count = 0;
+    if (!has_glob_marks(pattern, len)) {
+        // Just a name: the directories are not read for it, the path is looked up at the end
+        if (!buf_put(path, pattern, len) || (slash && !buf_put(path, "/", 1)))
+            count = -1;
+        else if (slash)
+            count = glob_from(ex, slash + 1);
+        else if (!faccessat(AT_FDCWD, path->data, F_OK, AT_SYMLINK_NOFOLLOW))
+            count = push_copy(ex, path->data, path->len) ? 1 : -1;
+        buf_truncate(path, base);
+        return count;
+    }
+
+    const struct expand_dir *dir = cache_dir(ex->cache, base ? path->data : ".");
+    char *name_pattern = dir ? fnmatch_pattern(pattern, len) : NULL;
+    if (!name_pattern)
+        return -1;
+    // The table of the cache may grow inside, so its entries are taken out
+    const struct dir_entry *entries = dir->entries;
+    size_t entry_count = dir->count;
+    for (size_t i = 0; i < entry_count && count >= 0; ++i) {
+        const char *name = entries[i].name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if ((slash && !may_be_dir(entries[i].type)) || fnmatch(name_pattern, name, FNM_PERIOD))
+            continue;
+        long matched;
+        if (!buf_put(path, name, strlen(name)) || (slash && !buf_put(path, "/", 1)))
+            matched = -1;
+        else if (slash)
+            matched = glob_from(ex, slash + 1);
+        else
+            matched = push_copy(ex, path->data, path->len) ? 1 : -1;
+        count = matched < 0 ? -1 : count + matched;
+        buf_truncate(path, base);
+    }
+    free(name_pattern);
+    return count;
+}
+
+static int arg_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Append the field made in `ex->field` to the new `argv`: the paths it matches if it is a pattern,
+ * otherwise the field itself, unmarked. Returns `false` if out of memory.
+ */
+static bool push_field(struct expander *ex) {
+    struct expand_buf *field = &ex->field;
+    if (has_glob_marks(field->data, field->len)) {
+        int first = ex->argc;
+        const char *pattern = field->data;
+        buf_truncate(&ex->path, 0);
+        if (*pattern == '/') {
+            if (!buf_put(&ex->path, "/", 1))
+                return false;
+            ++pattern;
+        }
+        long count = glob_from(ex, pattern);
+        if (count < 0)
+            return false;
+        if (count > 0) {
+            qsort(ex->argv + first, count, sizeof (char *), arg_cmp);
+            return true;
+        }
+    }
+    expand_unmark(field->data);
+    return push_copy(ex, field->data, field->len);
+}
+
+inline static bool is_name_start(char c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+inline static bool is_name_char(char c) {
+    return is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+/**
+ * The value of the variable whose name starts at `*s`, right after a `$`, moving `*s` past it.
+ * `NULL` if it is no name, so the `$` is literal. An unset variable is empty. Returns `""` with
+ * `*is_oom` set if out of memory.
+ */
+static const char *var_value(struct expander *ex, const char **s, bool *is_oom) {
+    const char *start = *s;
+    bool is_braced = *start == '{';
+    if (is_braced)
+        ++start;
+    if (!is_name_start(*start))
+        return NULL;
+    const char *end = start + 1;
+    while (is_name_char(*end))
+        ++end;
+    if (is_braced && *end != '}')
+        return NULL;
+    *s = end + is_braced;
+    buf_truncate(&ex->name, 0);
+    if (!buf_put(&ex->name, start, end - start)) {
+        *is_oom = true;
+        return "";
+    }
+    const char *value = getenv(ex->name.data);
+    return value ? value : "";
+}
+
+/**
+ * Append the words which `word` expands to to the new `argv`. Between the variables the word is
+ * copied to the field, the value of a variable outside of the double quotes ends a field at each
+ * run of the whitespace. Returns `false` if out of memory.
+ */
+static bool expand_word(struct expander *ex, char *word) {
+    if (!has_marks(word))
+        return push_arg(ex, word);
+    struct expand_buf *field = &ex->field;
+    buf_truncate(field, 0);
+    // The field is there, even if it is empty: it is not just empty variables
+    bool is_field = false;
+    bool is_oom = false;
+    for (const char *c = word; *c && !is_oom;) {
+        if (*c != MARK_VAR && *c != MARK_VAR_QUOTED) {
+            size_t len = 1;
+            while (c[len] && c[len] != MARK_VAR && c[len] != MARK_VAR_QUOTED)
+                ++len;
+            is_oom = !buf_put(field, c, len);
+            is_field = true;
+            c += len;
+            continue;
+        }
+        bool is_quoted = *c++ == MARK_VAR_QUOTED;
+        const char *value = var_value(ex, &c, &is_oom);
+        if (!value) {
+            is_oom = !buf_put(field, "$", 1);
+            is_field = true;
+        } else if (is_quoted) {
+            is_oom = is_oom || !buf_put(field, value, strlen(value));
+            is_field = true;
+        } else {
+            while (*value && !is_oom) {
+                size_t len = strcspn(value, " \t\n");
+                if (len) {
+                    is_oom = !buf_put(field, value, len);
+                    is_field = true;
+                    value += len;
+                    continue;
+                }
+                if (is_field) {
+                    is_oom = !push_field(ex);
+                    buf_truncate(field, 0);
+                    is_field = false;
+                }
+                value += strspn(value, " \t\n");
+            }
+        }
+    }
+    if (!is_oom && is_field)
+        is_oom = !push_field(ex);
+    return !is_oom;
+}
+
+/// Expand `pc->outfile`, which shall be a single word then. Uses the new `argv` of `ex`
+static const char *expand_outfile(struct expander *ex, struct piped_commands *pc) {
+    char **argv = ex->argv;
+    int argc = ex->argc, capacity = ex->capacity;
+    ex->argv = NULL;
+    ex->argc = ex->capacity = 0;
+    const char *err = NULL;
+    if (!expand_word(ex, pc->outfile))
+        err = err_oom;
+    else if (ex->argc != 1)
+        err = err_ambiguous_redirect;
+    else
+        pc->outfile = ex->argv[0];
+    ex->argv = argv;
+    ex->argc = argc;
+    ex->capacity = capacity;
+    return err;
+}
+
+const char *expand_pipeline(struct piped_commands *pc, struct expand_cache *cache) {
+    struct expander ex = {.cache = cache, .arena = cache->arena};
+    const char *err = NULL;
+    for (; pc && !err; pc = pc->next) {
+        if (!pc->needs_expand)
+            continue;
+        ex.argv = NULL;
+        ex.argc = ex.capacity = 0;
+        for (int i = 0; i < pc->_argc && !err; ++i) {
+            if (!expand_word(&ex, pc->argv[i]))
+                err = err_oom;
+        }
+        if (!err && pc->outfile)
+            err = expand_outfile(&ex, pc);
+        if (!err && !ex.argc && !push_arg(&ex, "true"))
+            err = err_oom;
+        if (err)
+            break;
+        pc->argv = ex.argv;
+        pc->_argc = ex.argc;
+        pc->needs_expand = false;
+    }
+    free(ex.field.data);
+    free(ex.path.data);
+    free(ex.name.data);
+    return err;
+}
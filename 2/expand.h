@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "parse_command.h"
+
+/*
+ * The expansions of the words, right before a pipeline is run: the variables (`$NAME` and
+ * `${NAME}`) to their values from the environment, then the glob patterns (`*`, `?` and `[...]`)
+ * to the paths they match, sorted. What is to be expanded is marked by the lexer (see
+ * `enum expand_mark`), so the quoted and escaped characters are literal.
+ *
+ * A variable outside of double quotes is split into words at the whitespace, an unset one is
+ * empty, and a word which is nothing but empty variables is gone. The values are not expanded
+ * any further: a `*` in one is just a character. A pattern matching nothing stays as it is, like
+ * in bash without `nullglob`. A name starting with a dot is only matched by a dot, and `.` and
+ * `..` are never matched.
+ *
+ * Each directory of the patterns is read once, with `getdents64` in big batches, and its entries
+ * are kept in the cache for all the words of the pipeline: so `ls dir/[ab].c dir/?.h | grep x?`
+ * reads `dir` and `.` once each. The cache is not kept to the next pipeline of the line, which
+ * may be run after this one has changed the directories (`touch a; ls *`).
+ *
+ * The new `argv` arrays, the words and the cache are allocated in the arena of the command.
+ */
+
+struct expand_dir;
+
+/** The directories read for a pipeline. Zero-initialized with the arena. */
+struct expand_cache {
+    struct arena *arena;
+    // Open addressing, the capacity is a power of two, at most half full
+    struct expand_dir *dirs;
+    size_t capacity;
+    size_t count;
+};
+
+/**
+ * Expand the words of the stages of `pc` which need it, replacing their `argv` and `outfile`.
+ * A stage left with no words is `true`, so the rest is run and the file still created. Returns
+ * `NULL` on success, otherwise `err_oom`, or `err_ambiguous_redirect` if the file name became
+ * several words or none.
+ */
+const char *expand_pipeline(struct piped_commands *pc, struct expand_cache *cache);
+
+/** Replace the marks in `s` by the characters they are of, e.g. to show the command. */
+void expand_unmark(char *s);
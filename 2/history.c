@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+enum {
+    // The chains of the commands by their first `HISTORY_KEY_LEN` bytes, a power of two
+    HISTORY_BUCKETS = 4096,
+    HISTORY_MIN_CAPACITY = 256,
+};
+
+// The end of a chain
+#define HISTORY_NONE UINT32_MAX
+
+static struct {
+    bool is_open;
+    int fd;
+    const char *data;
+    size_t mapped;
+    // The bytes indexed: up to the end of the last whole command
+    size_t indexed;
+
+    // Of each command: where it starts, and the previous command of its chains
+    size_t *offsets;
+    uint32_t *older_byte, *older_key;
+    size_t count, capacity;
+
+    // The last command of each chain: the ones of the same first byte, and of the same key
+    uint32_t heads_byte[256];
+    uint32_t heads_key[HISTORY_BUCKETS];
+} hist;
+
+static size_t key_bucket(const char *s) {
+    // FNV-1a of the first `HISTORY_KEY_LEN` bytes
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < HISTORY_KEY_LEN; ++i)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    return (h ^ (h >> 32)) & (HISTORY_BUCKETS - 1);
+}
+
+/// Add the command at `offset` of `len` bytes to the index. Returns `false` if out of memory
+static bool index_command(size_t offset, size_t len) {
+    if (hist.count == hist.capacity) {
+        if (hist.capacity >= HISTORY_NONE / 2)
+            return false;
+        size_t capacity = hist.capacity ? 2 * hist.capacity : HISTORY_MIN_CAPACITY;
+        size_t *offsets = realloc(hist.offsets, capacity * sizeof (*offsets));
+        if (offsets)
+            hist.offsets = offsets;
+        uint32_t *older_byte = realloc(hist.older_byte, capacity * sizeof (*older_byte));
+        if (older_byte)
+            hist.older_byte = older_byte;
+        uint32_t *older_key = realloc(hist.older_key, capacity * sizeof (*older_key));
+        if (older_key)
+            hist.older_key = older_key;
+        if (!offsets || !older_byte || !older_key)
+            return false;
+        hist.capacity = capacity;
+    }
+
+    uint32_t i = hist.count++;
+    const char *s = hist.data + offset;
+    hist.offsets[i] = offset;
+    unsigned char byte = s[0];
+    hist.older_byte[i] = hist.heads_byte[byte];
+    hist.heads_byte[byte] = i;
+    hist.older_key[i] = HISTORY_NONE;
+    if (len >= HISTORY_KEY_LEN) {
+        size_t bucket = key_bucket(s);
+        hist.older_key[i] = hist.heads_key[bucket];
+        hist.heads_key[bucket] = i;
+    }
+    return true;
+}
+
+void history_sync(void) {
+    if (!hist.is_open)
+        return;
+    struct stat st;
+    if (0 > fstat(hist.fd, &st) || (size_t)st.st_size <= hist.mapped)
+        return;
+    size_t size = st.st_size;
+    void *data = hist.data ? mremap((void *)hist.data, hist.mapped, size, MREMAP_MAYMOVE)
+                           : mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0);
+    if (data == MAP_FAILED)
+        return;
+    hist.data = data;
+    hist.mapped = size;
+
+    // A command being appended by another shell is indexed once it is whole
+    const char *end;
+    while ((end = memchr(hist.data + hist.indexed, '\0', hist.mapped - hist.indexed))) {
+        size_t len = end - (hist.data + hist.indexed);
+        if (!index_command(hist.indexed, len))
+            break;
+        hist.indexed += len + 1;
+    }
+}
+
+bool history_open(const char *path) {
+    history_close();
+    hist.fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist.fd < 0) {
+        fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    hist.is_open = true;
+    memset(hist.heads_byte, 0xff, sizeof hist.heads_byte);
+    memset(hist.heads_key, 0xff, sizeof hist.heads_key);
+    history_sync();
+    return true;
+}
+
+void history_close(void) {
+    if (!hist.is_open)
+        return;
+    if (hist.data)
+        (void)munmap((void *)hist.data, hist.mapped);
+    (void)close(hist.fd);
+    free(hist.offsets);
+    free(hist.older_byte);
+    free(hist.older_key);
+    memset(&hist, 0, sizeof hist);
+}
+
+size_t history_count(void) {
+    return hist.count;
+}
+
+const char *history_entry(size_t i) {
+    return hist.data + hist.offsets[i];
+}
+
+void history_add(const char *line) {
+    if (!hist.is_open || line[0] == ' ')
+        return;
+    const char *c = line;
+    while (isspace((unsigned char)*c))
+        ++c;
+    if (!*c)
+        return;
+    history_sync();
+    if (hist.count && !strcmp(history_entry(hist.count - 1), line))
+        return;
+
+    // The '\0' too, at once
+    size_t size = strlen(line) + 1;
+    while (size > 0) {
+        ssize_t written = write(hist.fd, line, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0) {
+            fprintf(stderr, "history: write error: %s\n", strerror(errno));
+            break;
+        }
+        line += written;
+        size -= written;
+    }
+    history_sync();
+}
+
+size_t history_search(const char *prefix, size_t prefix_len, size_t before) {
+    if (before > hist.count)
+        before = hist.count;
+    if (prefix_len == 0)
+        return before ? before - 1 : hist.count;
+
+    bool by_key = prefix_len >= HISTORY_KEY_LEN;
+    const uint32_t *older = by_key ? hist.older_key : hist.older_byte;
+    uint32_t i;
+    if (before < hist.count && !strncmp(history_entry(before), prefix, prefix_len)) {
+        // A match found before is in the same chain: go on from it
+        i = older[before];
+    } else {
+        i = by_key ? hist.heads_key[key_bucket(prefix)] : hist.heads_byte[(unsigned char)*prefix];
+        while (i != HISTORY_NONE && i >= before)
+            i = older[i];
+    }
+    for (; i != HISTORY_NONE; i = older[i]) {
+        if (!strncmp(history_entry(i), prefix, prefix_len))
+            return i;
+    }
+    return hist.count;
+}
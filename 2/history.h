@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The history of the interactive command lines, kept in a file: `SHELL_HISTORY`, by default
+ * `~/.shell_history`. The file is append-only, the commands terminated by '\0', each appended by
+ * a single `write` so that the shells sharing the file do not interleave them. It is mapped, not
+ * read: the commands are used right from the mapping, and what other shells have appended is
+ * mapped in as the file grows.
+ *
+ * The commands are indexed by their first bytes, so a search by a prefix goes through the ones
+ * of the same first byte (or the same first `HISTORY_KEY_LEN` bytes for a longer prefix) rather
+ * than through the whole history.
+ */
+
+enum {
+    HISTORY_KEY_LEN = 4,
+};
+
+/**
+ * Map the history file `path`, creating it if there is none. Returns `false` if failed (it is
+ * reported): then there is no history, nothing is stored.
+ */
+bool history_open(const char *path);
+
+/** Unmap and close the file. */
+void history_close(void);
+
+/**
+ * Append `line` to the history, unless it is blank, starts with a space (to be kept out of it)
+ * or is the same as the last one.
+ */
+void history_add(const char *line);
+
+/** Map in what has been appended to the file by other shells. */
+void history_sync(void);
+
+/** The number of the commands in the history, the oldest is 0. */
+size_t history_count(void);
+
+/** The command `i`, valid until the next call of the history. */
+const char *history_entry(size_t i);
+
+/**
+ * The newest command before the command `before` (`history_count()` for all of them) which
+ * starts with the `prefix_len` bytes of `prefix`. Returns `history_count()` if there is none.
+ */
+size_t history_search(const char *prefix, size_t prefix_len, size_t before);
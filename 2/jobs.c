@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "jobs.h"
+#include "expand.h"
+#include "exit_status.h"
+
+enum {
+    // Finished jobs nobody has asked about are forgotten beyond so many, the oldest first
+    JOBS_DONE_MAX = 1024,
+    JOBS_EVENTS = 16,
+    // Status of `wait` for an unknown job, as in bash
+    JOBS_STATUS_UNKNOWN = 127 << 8,
+};
+
+struct job;
+
+struct job_stage {
+    struct job *job;
+    pid_t pid;  // -1 if not started
+    int fd;  // The pidfd in the epoll, -1 if there is none: then it is reaped with `waitpid`
+    bool is_running;
+    int status;
+};
+
+struct job {
+    int id;
+    char *text;  // The command line
+    size_t running;  // Stages not reaped yet
+    size_t count;
+    struct job_stage stages[];
+};
+
+static struct job_table {
+    struct job **jobs;  // In the order of start
+    size_t count, capacity;
+    size_t running;  // Jobs with running stages
+    size_t done;  // Finished jobs
+    size_t polled;  // Running stages with a pidfd
+    size_t unpolled;  // And without one
+    size_t limit;
+    int epoll;
+} table = {.epoll = -1};
+
+inline static int pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+void jobs_set_limit(size_t limit) {
+    table.limit = limit;
+}
+
+int jobs_fd(void) {
+    return table.polled > 0 ? table.epoll : -1;
+}
+
+static int job_status(const struct job *job) {
+    return job->stages[job->count - 1].status;
+}
+
+static void stage_exited(struct job_stage *stage, int status) {
+    stage->is_running = false;
+    stage->status = status;
+    if (stage->fd >= 0) {
+        (void)close(stage->fd);  // Removes it from the epoll too
+        --table.polled;
+    } else {
+        --table.unpolled;
+    }
+    if (0 == --stage->job->running) {
+        --table.running;
+        ++table.done;
+    }
+}
+
+static struct job_stage *find_stage(pid_t pid) {
+    for (size_t i = 0; i < table.count; ++i) {
+        struct job *job = table.jobs[i];
+        for (size_t j = 0; j < job->count; ++j) {
+            if (job->stages[j].pid == pid)
+                return &job->stages[j];
+        }
+    }
+    return NULL;
+}
+
+static void job_remove(struct job *job) {
+    size_t i = 0;
+    while (table.jobs[i] != job)
+        ++i;
+    memmove(table.jobs + i, table.jobs + i + 1, (table.count - i - 1) * sizeof (*table.jobs));
+    --table.count;
+    if (job->running)
+        --table.running;
+    else
+        --table.done;
+    free(job->text);
+    free(job);
+}
+
+void jobs_destroy(void) {
+    for (size_t i = 0; i < table.count; ++i) {
+        for (size_t j = 0; j < table.jobs[i]->count; ++j) {
+            if (table.jobs[i]->stages[j].fd >= 0)
+                (void)close(table.jobs[i]->stages[j].fd);
+        }
+        free(table.jobs[i]->text);
+        free(table.jobs[i]);
+    }
+    if (table.epoll >= 0)
+        (void)close(table.epoll);
+    free(table.jobs);
+    table = (struct job_table){.epoll = -1};
+}
+
+void jobs_forget(void) {
+    size_t limit = table.limit;
+    jobs_destroy();
+    table.limit = limit;
+}
+
+/// Reap the stages whose pidfds are ready, waiting for `timeout` ms for the first one
+static void jobs_poll(int timeout) {
+    struct epoll_event events[JOBS_EVENTS];
+    int ready;
+    while (0 < (ready = epoll_wait(table.epoll, events, JOBS_EVENTS, timeout))) {
+        for (int i = 0; i < ready; ++i) {
+            struct job_stage *stage = events[i].data.ptr;
+            int status = EXITSTATUS_BEDA;
+            (void)waitpid(stage->pid, &status, 0);
+            stage_exited(stage, status);
+        }
+        timeout = 0;
+    }
+}
+
+void jobs_reap(void) {
+    if (table.polled > 0)
+        jobs_poll(0);
+    for (size_t i = 0; table.unpolled > 0 && i < table.count; ++i) {
+        struct job *job = table.jobs[i];
+        for (size_t j = 0; j < job->count; ++j) {
+            struct job_stage *stage = &job->stages[j];
+            int status;
+            if (stage->is_running && stage->fd < 0 && 0 < waitpid(stage->pid, &status, WNOHANG))
+                stage_exited(stage, status);
+        }
+    }
+}
+
+/// Block until some stage exits. There must be running jobs
+static void jobs_block(void) {
+    if (!table.unpolled) {
+        jobs_poll(-1);
+        return;
+    }
+    // Without a pidfd for some of them, wait for any child
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid > 0) {
+        struct job_stage *stage = find_stage(pid);
+        if (stage && stage->is_running)
+            stage_exited(stage, status);
+    } else if (errno == ECHILD) {
+        // They are gone somehow, do not wait forever
+        for (size_t i = 0; i < table.count; ++i) {
+            for (size_t j = 0; j < table.jobs[i]->count; ++j) {
+                struct job_stage *stage = &table.jobs[i]->stages[j];
+                if (stage->is_running)
+                    stage_exited(stage, EXITSTATUS_BEDA);
+            }
+        }
+    }
+}
+
+void jobs_reserve(void) {
+    jobs_reap();
+    while (table.limit && table.running >= table.limit)
+        jobs_block();
+}
+
+/// Append the command line of `pc` to `out`, or only count its length if `out` is `NULL`
+static size_t pipeline_text(const struct piped_commands *pc, char *out) {
+    size_t len = 0;
+    for (const struct piped_commands *cur = pc; cur; cur = cur->next) {
+        for (char **arg = cur->argv; *arg; ++arg) {
+            const char *sep = cur != pc && arg == cur->argv ? " | " : arg != cur->argv ? " " : "";
+            len += strlen(sep) + strlen(*arg);
+            if (out)
+                out = stpcpy(stpcpy(out, sep), *arg);
+        }
+        if (cur->outfile) {
+            const char *redirect = cur->append ? " >> " : " > ";
+            len += strlen(redirect) + strlen(cur->outfile);
+            if (out)
+                out = stpcpy(stpcpy(out, redirect), cur->outfile);
+        }
+    }
+    return len;
+}
+
+/// The command line of the job `sc`, allocated
+static char *job_text(const struct sequenced_commands *sc) {
+    size_t size = 1;
+    for (const struct sequenced_commands *cur = sc; cur; cur = cur->next) {
+        size += pipeline_text(cur->p_head, NULL) + sizeof " && ";
+        if (cur->run_next == NOWAIT || cur->run_next == UNCONDITIONAL)
+            break;
+    }
+    char *text = malloc(size);
+    if (!text)
+        return NULL;
+    char *out = text;
+    for (const struct sequenced_commands *cur = sc; cur; cur = cur->next) {
+        out += pipeline_text(cur->p_head, out);
+        if (cur->run_next == NOWAIT || cur->run_next == UNCONDITIONAL)
+            break;
+        out = stpcpy(out, cur->run_next == SKIP_FAILURE ? " && " : " || ");
+    }
+    *out = '\0';
+    // The words of a job in the background are expanded in its own shell
+    expand_unmark(text);
+    return text;
+}
+
+void jobs_add(const struct sequenced_commands *sc, const pid_t *pids, size_t count, int status) {
+    // Keep the table bounded for the scripts which never ask about their jobs
+    for (size_t i = 0; table.done >= JOBS_DONE_MAX && i < table.count; ) {
+        if (table.jobs[i]->running)
+            ++i;
+        else
+            job_remove(table.jobs[i]);
+    }
+
+    struct job *job = malloc(sizeof (*job) + count * sizeof (*job->stages));
+    char *text = job ? job_text(sc) : NULL;
+    if (table.count == table.capacity && text) {
+        size_t capacity = table.capacity ? 2 * table.capacity : 16;
+        struct job **jobs = realloc(table.jobs, capacity * sizeof (*jobs));
+        if (jobs) {
+            table.jobs = jobs;
+            table.capacity = capacity;
+        }
+    }
+    if (!text || table.count == table.capacity) {
+        // Can not be tracked: rather than leave zombies behind, wait for it right away
+        fprintf(stderr, "Out of memory for the job table, waiting for the job\n");
+        for (size_t i = 0; i < count; ++i) {
+            if (pids[i] >= 0)
+                (void)waitpid(pids[i], NULL, 0);
+        }
+        free(text);
+        free(job);
+        return;
+    }
+
+    if (table.epoll < 0)
+        table.epoll = epoll_create1(EPOLL_CLOEXEC);
+    *job = (struct job){.id = table.count ? table.jobs[table.count - 1]->id + 1 : 1, .text = text,
+                        .count = count};
+    for (size_t i = 0; i < count; ++i) {
+        struct job_stage *stage = &job->stages[i];
+        *stage = (struct job_stage){.job = job, .pid = pids[i], .fd = -1, .status = status};
+        if (pids[i] < 0)
+            continue;
+        stage->is_running = true;
+        ++job->running;
+        stage->fd = table.epoll < 0 ? -1 : pidfd_open(pids[i]);
+        if (stage->fd >= 0) {
+            struct epoll_event ev = {.events = EPOLLIN, .data = {.ptr = stage}};
+            if (0 == epoll_ctl(table.epoll, EPOLL_CTL_ADD, stage->fd, &ev)) {
+                ++table.polled;
+                continue;
+            }
+            (void)close(stage->fd);
+            stage->fd = -1;
+        }
+        ++table.unpolled;
+    }
+    table.jobs[table.count++] = job;
+    if (job->running)
+        ++table.running;
+    else
+        ++table.done;
+}
+
+/// The job `spec` (`%N` or a pid) and, for a pid, its stage. `NULL` if there is no such
+static struct job *find_job(const char *spec, struct job_stage **stage) {
+    *stage = NULL;
+    char *end;
+    long id = strtol(spec + (spec[0] == '%'), &end, 10);
+    if (end == spec + (spec[0] == '%') || *end)
+        return NULL;
+    if (spec[0] != '%') {
+        *stage = find_stage((pid_t)id);
+        return *stage ? (*stage)->job : NULL;
+    }
+    for (size_t i = 0; i < table.count; ++i) {
+        if (table.jobs[i]->id == id)
+            return table.jobs[i];
+    }
+    return NULL;
+}
+
+int jobs_wait_builtin(char **argv) {
+    jobs_reap();
+    if (!argv[1]) {
+        while (table.running > 0)
+            jobs_block();
+        while (table.count > 0)
+            job_remove(table.jobs[0]);
+        return EXITSTATUS_DEFAULT;
+    }
+
+    if (!strcmp(argv[1], "-n") && !argv[2]) {
+        while (1) {
+            for (size_t i = 0; i < table.count; ++i) {
+                struct job *job = table.jobs[i];
+                if (!job->running) {
+                    int status = job_status(job);
+                    job_remove(job);
+                    return status;
+                }
+            }
+            if (!table.running)
+                return JOBS_STATUS_UNKNOWN;
+            jobs_block();
+        }
+    }
+
+    int status = EXITSTATUS_DEFAULT;
+    for (char **spec = argv + 1; *spec; ++spec) {
+        struct job_stage *stage;
+        struct job *job = find_job(*spec, &stage);
+        if (!job) {
+            if (**spec == '%')
+                fprintf(stderr, "wait: %s: no such job\n", *spec);
+            else
+                fprintf(stderr, "wait: pid %s is not a child of this shell\n", *spec);
+            status = JOBS_STATUS_UNKNOWN;
+            continue;
+        }
+        while (stage ? stage->is_running : job->running > 0)
+            jobs_block();
+        status = stage ? stage->status : job_status(job);
+        if (!job->running)
+            job_remove(job);
+    }
+    return status;
+}
+
+/// The state of `job` as bash shows it
+static void print_state(const struct job *job) {
+    int status = job_status(job);
+    if (job->running)
+        printf("%-24s", "Running");
+    else if (WIFEXITED(status) && !WEXITSTATUS(status))
+        printf("%-24s", "Done");
+    else if (WIFEXITED(status))
+        printf("Exit %-19d", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        printf("%-24s", strsignal(WTERMSIG(status)));
+    else
+        printf("%-24s", "Unknown");
+}
+
+int jobs_print_builtin(char **argv) {
+    bool is_pids = argv[1] && !strcmp(argv[1], "-p");
+    if (argv[1] && (!is_pids || argv[2])) {
+        fprintf(stderr, "jobs: usage: jobs [-p]\n");
+        return 2 << 8;
+    }
+    jobs_reap();
+    for (size_t i = 0; i < table.count; ++i) {
+        const struct job *job = table.jobs[i];
+        if (is_pids) {
+            for (size_t j = 0; j < job->count; ++j) {
+                if (job->stages[j].pid >= 0) {
+                    printf("%d\n", (int)job->stages[j].pid);
+                    break;
+                }
+            }
+            continue;
+        }
+        // The current job is the latest one, the previous is before it
+        char mark = i + 1 == table.count ? '+' : i + 2 == table.count ? '-' : ' ';
+        printf("[%d]%c  ", job->id, mark);
+        print_state(job);
+        printf("%s%s\n", job->text, job->running ? " &" : "");
+    }
+    fflush(stdout);  // The commands write to the same file directly
+
+    // The finished jobs are reported once
+    for (size_t i = 0; !is_pids && i < table.count; ) {
+        if (table.jobs[i]->running)
+            ++i;
+        else
+            job_remove(table.jobs[i]);
+    }
+    return EXITSTATUS_DEFAULT;
+}
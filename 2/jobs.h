@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "parse_command.h"
+
+/*
+ * The table of the background jobs (pipelines started with `&`). The shell learns that a stage
+ * of a job has exited from its pidfd, which is in an epoll (see `jobs_fd`): nothing is scanned.
+ * A finished job stays in the table until its status is taken by `wait` or shown by `jobs`.
+ *
+ * At most `jobs_set_limit` jobs run at once: a job started beyond that waits for another one
+ * to finish first. So a script fanning out work with `&` keeps that many processes busy.
+ */
+
+/** Run at most `limit` jobs at once, 0 is no limit. */
+void jobs_set_limit(size_t limit);
+
+/** Wait until one more job may be started. */
+void jobs_reserve(void);
+
+/**
+ * Add the job `sc` to the table: the commands up to and including the one followed by `&`.
+ * `pids` are the processes of its `count` stages, -1 for the ones not started: if it is the last
+ * stage, `status` is the status of the job.
+ */
+void jobs_add(const struct sequenced_commands *sc, const pid_t *pids, size_t count, int status);
+
+/**
+ * A file descriptor which becomes readable when a stage of a job has exited, then `jobs_reap`
+ * shall be called. -1 if no jobs are running.
+ */
+int jobs_fd(void);
+
+/** Forget all the jobs, in a forked shell: they are not its children. */
+void jobs_forget(void);
+
+/** Free the table at the exit of the shell. The jobs still running are left to run. */
+void jobs_destroy(void);
+
+/** Reap the exited stages of the jobs, without blocking. */
+void jobs_reap(void);
+
+/**
+ * The `wait` builtin: `wait` waits for all the jobs, `wait -n` for any one, `wait ID...` for
+ * the given ones, either a job `%N` or a pid. Returns the status in the format of `waitpid`.
+ */
+int jobs_wait_builtin(char **argv);
+
+/** The `jobs` builtin, with `-p` the pids only. Returns the status like `jobs_wait_builtin`. */
+int jobs_print_builtin(char **argv);
@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "line_edit.h"
+#include "history.h"
+#include "path_cache.h"
+
+enum {
+    LINE_BUF_MIN = 256,
+    TERM_WIDTH_DEFAULT = 80,
+};
+
+/// The commands of the shell itself, sorted, for the completion
+static const char *const shell_commands[] = {
+    "cd", "coproc", "enable", "exit", "hash", "history", "jobs", "wait",
+};
+
+/// The characters to be escaped in a completed word
+static const char word_specials[] = " \t\n\\'\"$*?[]&;|<>()#`";
+
+static void term_write(const char *s, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(STDOUT_FILENO, s, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return;
+        s += written;
+        size -= written;
+    }
+}
+
+static void term_puts(const char *s) {
+    term_write(s, strlen(s));
+}
+
+static void beep(void) {
+    term_puts("\a");
+}
+
+/// Is `c` a continuation byte of a UTF-8 character?
+inline static bool is_utf8_tail(char c) {
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+/// The number of the characters (not bytes, the continuation ones aside) of `s`
+static size_t columns(const char *s, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i)
+        count += !is_utf8_tail(s[i]);
+    return count;
+}
+
+/// Make room for `size` bytes of the line and its terminator. Returns `false` if out of memory
+static bool reserve(struct line_edit *ed, size_t size) {
+    if (size + 1 <= ed->capacity)
+        return true;
+    size_t capacity = ed->capacity ? ed->capacity : LINE_BUF_MIN;
+    while (capacity < size + 1)
+        capacity *= 2;
+    char *buf = realloc(ed->buf, capacity);
+    if (!buf)
+        return false;
+    ed->buf = buf;
+    ed->capacity = capacity;
+    return true;
+}
+
+/// Draw the prompt and the line again, the cursor where it is in the line
+static void refresh(struct line_edit *ed) {
+    size_t prompt_len = strlen(ed->prompt);
+    char *out = malloc(prompt_len + ed->len + 32);
+    if (!out)
+        return;
+    size_t n = 0;
+    out[n++] = '\r';
+    memcpy(out + n, ed->prompt, prompt_len);
+    n += prompt_len;
+    memcpy(out + n, ed->buf, ed->len);
+    n += ed->len;
+    // Clear to the end of the screen line, then back to the cursor
+    memcpy(out + n, "\x1b[K", 3);
+    n += 3;
+    size_t back = columns(ed->buf + ed->cursor, ed->len - ed->cursor);
+    if (back)
+        n += sprintf(out + n, "\x1b[%zuD", back);
+    term_write(out, n);
+    free(out);
+}
+
+/// Replace `count` bytes at `at` with `size` bytes of `s`, the cursor after them
+static bool replace(struct line_edit *ed, size_t at, size_t count, const char *s, size_t size) {
+    if (!reserve(ed, ed->len - count + size))
+        return false;
+    memmove(ed->buf + at + size, ed->buf + at + count, ed->len - at - count);
+    memcpy(ed->buf + at, s, size);
+    ed->len = ed->len - count + size;
+    ed->buf[ed->len] = '\0';
+    ed->cursor = at + size;
+    return true;
+}
+
+/// Make the line `s`, the cursor at its end
+static void set_line(struct line_edit *ed, const char *s, size_t size) {
+    if (replace(ed, 0, ed->len, s, size))
+        refresh(ed);
+}
+
+static void erase(struct line_edit *ed, size_t from, size_t to) {
+    memmove(ed->buf + from, ed->buf + to, ed->len - to + 1);
+    ed->len -= to - from;
+    ed->cursor = from;
+    refresh(ed);
+}
+
+static size_t prev_char(const struct line_edit *ed, size_t at) {
+    while (at > 0 && is_utf8_tail(ed->buf[--at]))
+        ;
+    return at;
+}
+
+static size_t next_char(const struct line_edit *ed, size_t at) {
+    while (at < ed->len && is_utf8_tail(ed->buf[++at]))
+        ;
+    return at;
+}
+
+static void raw_mode(struct line_edit *ed) {
+    if (ed->is_raw || 0 > tcgetattr(STDIN_FILENO, &ed->cooked))
+        return;
+    struct termios raw = ed->cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cflag |= CS8;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    // Not flushed: the keys typed while the previous command ran are for this line
+    ed->is_raw = 0 == tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+}
+
+void line_edit_stop(struct line_edit *ed) {
+    if (ed->is_raw)
+        (void)tcsetattr(STDIN_FILENO, TCSADRAIN, &ed->cooked);
+    ed->is_raw = false;
+}
+
+void line_edit_start(struct line_edit *ed, const char *prompt) {
+    ed->prompt = prompt;
+    ed->len = ed->cursor = 0;
+    ed->esc_len = 0;
+    ed->shown_count = 0;
+    ed->is_tab_again = false;
+    if (reserve(ed, 0))
+        ed->buf[0] = '\0';
+    history_sync();
+    raw_mode(ed);
+    term_puts(prompt);
+}
+
+/// Up: the previous command starting with what was typed before the search
+static void history_prev(struct line_edit *ed) {
+    if (ed->shown_count == 0) {
+        if (ed->typed_capacity < ed->len + 1) {
+            char *typed = realloc(ed->typed, ed->len + 1);
+            if (!typed)
+                return;
+            ed->typed = typed;
+            ed->typed_capacity = ed->len + 1;
+        }
+        memcpy(ed->typed, ed->buf, ed->len);
+        ed->typed_len = ed->len;
+    }
+    if (ed->shown_count == ed->shown_capacity) {
+        size_t capacity = ed->shown_capacity ? 2 * ed->shown_capacity : 16;
+        size_t *shown = realloc(ed->shown, capacity * sizeof (*shown));
+        if (!shown)
+            return;
+        ed->shown = shown;
+        ed->shown_capacity = capacity;
+    }
+
+    size_t count = history_count();
+    size_t i = ed->shown_count ? ed->shown[ed->shown_count - 1] : count;
+    // The same command again is skipped
+    do
+        i = history_search(ed->typed, ed->typed_len, i);
+    while (i < count && !strcmp(history_entry(i), ed->buf));
+    if (i == count) {
+        beep();
+        return;
+    }
+    ed->shown[ed->shown_count++] = i;
+    const char *entry = history_entry(i);
+    set_line(ed, entry, strlen(entry));
+}
+
+/// Down: back to the next command shown, or to the line typed
+static void history_next(struct line_edit *ed) {
+    if (ed->shown_count == 0) {
+        beep();
+        return;
+    }
+    if (--ed->shown_count == 0) {
+        set_line(ed, ed->typed, ed->typed_len);
+    } else {
+        const char *entry = history_entry(ed->shown[ed->shown_count - 1]);
+        set_line(ed, entry, strlen(entry));
+    }
+}
+
+static void add_match(const char *name, void *arg) {
+    struct line_edit *ed = arg;
+    if (ed->match_count == ed->match_capacity) {
+        size_t capacity = ed->match_capacity ? 2 * ed->match_capacity : 64;
+        char **matches = realloc(ed->matches, capacity * sizeof (*matches));
+        if (!matches)
+            return;
+        ed->matches = matches;
+        ed->match_capacity = capacity;
+    }
+    char *copy = strdup(name);
+    if (copy)
+        ed->matches[ed->match_count++] = copy;
+}
+
+static void clear_matches(struct line_edit *ed) {
+    for (size_t i = 0; i < ed->match_count; ++i)
+        free(ed->matches[i]);
+    ed->match_count = 0;
+}
+
+static int match_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/// The files in the directory of `word` starting with its last part, as `word` with the rest
+static void complete_file(struct line_edit *ed, const char *word, bool is_command) {
+    const char *slash = strrchr(word, '/');
+    size_t dir_len = slash ? (size_t)(slash - word) + 1 : 0;
+    const char *base = word + dir_len;
+    size_t base_len = strlen(base);
+    char *dir_path = dir_len ? strndup(word, dir_len) : strdup(".");
+    DIR *d = dir_path ? opendir(dir_path) : NULL;
+    free(dir_path);
+    if (!d)
+        return;
+    for (struct dirent *ent; (ent = readdir(d)); ) {
+        const char *name = ent->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, "..") || strncmp(name, base, base_len) ||
+                (name[0] == '.' && base[0] != '.'))
+            continue;
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = 0 == fstatat(dirfd(d), name, &st, 0) && S_ISDIR(st.st_mode);
+        }
+        if (is_command && !is_dir && 0 != faccessat(dirfd(d), name, X_OK, 0))
+            continue;
+        char *match;
+        if (0 > asprintf(&match, "%.*s%s%s", (int)dir_len, word, name, is_dir ? "/" : ""))
+            continue;
+        add_match(match, ed);
+        free(match);
+    }
+    (void)closedir(d);
+}
+
+/// List the candidates under the line, in columns, then the line again
+static void list_matches(struct line_edit *ed, size_t skip) {
+    struct winsize ws;
+    size_t width = 0 == ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_col ? ws.ws_col
+                                                                          : TERM_WIDTH_DEFAULT;
+    size_t column = 0;
+    for (size_t i = 0; i < ed->match_count; ++i) {
+        size_t len = columns(ed->matches[i] + skip, strlen(ed->matches[i] + skip));
+        column = len + 2 > column ? len + 2 : column;
+    }
+    size_t per_row = width / column ? width / column : 1;
+    term_puts("\n");
+    for (size_t i = 0; i < ed->match_count; ++i) {
+        const char *name = ed->matches[i] + skip;
+        term_puts(name);
+        bool is_last = i + 1 == ed->match_count || (i + 1) % per_row == 0;
+        if (is_last) {
+            term_puts("\n");
+        } else {
+            for (size_t pad = columns(name, strlen(name)); pad < column; ++pad)
+                term_puts(" ");
+        }
+    }
+    refresh(ed);
+}
+
+/// Tab: complete the word before the cursor
+static void complete(struct line_edit *ed) {
+    size_t start = ed->cursor;
+    while (start > 0 && (!strchr(" \t;|&<>", ed->buf[start - 1]) ||
+                         (start > 1 && ed->buf[start - 2] == '\\')))
+        --start;
+    size_t before = start;
+    while (before > 0 && (ed->buf[before - 1] == ' ' || ed->buf[before - 1] == '\t'))
+        --before;
+    bool is_command = before == 0 || strchr(";|&", ed->buf[before - 1]);
+
+    // The word as it is meant, without the escapes
+    char *word = malloc(ed->cursor - start + 1);
+    if (!word)
+        return;
+    size_t word_len = 0;
+    for (size_t i = start; i < ed->cursor; ++i) {
+        if (ed->buf[i] == '\\' && i + 1 < ed->cursor)
+            ++i;
+        word[word_len++] = ed->buf[i];
+    }
+    word[word_len] = '\0';
+
+    clear_matches(ed);
+    if (is_command && !strchr(word, '/')) {
+        (void)path_cache_complete(word, add_match, ed);
+        for (size_t i = 0; i < sizeof shell_commands / sizeof *shell_commands; ++i) {
+            if (!strncmp(shell_commands[i], word, word_len))
+                add_match(shell_commands[i], ed);
+        }
+    } else {
+        complete_file(ed, word, is_command);
+    }
+    if (ed->match_count == 0) {
+        free(word);
+        beep();
+        return;
+    }
+    qsort(ed->matches, ed->match_count, sizeof (*ed->matches), match_cmp);
+    size_t unique = 1;
+    for (size_t i = 1; i < ed->match_count; ++i) {
+        if (strcmp(ed->matches[i], ed->matches[unique - 1]))
+            ed->matches[unique++] = ed->matches[i];
+        else
+            free(ed->matches[i]);
+    }
+    ed->match_count = unique;
+
+    // The longest common part
+    const char *first = ed->matches[0], *last = ed->matches[ed->match_count - 1];
+    size_t common = 0;
+    while (first[common] && first[common] == last[common])
+        ++common;
+    if (common > word_len) {
+        bool is_whole = ed->match_count == 1 && first[common - 1] != '/';
+        char *escaped = malloc(2 * common + 2);
+        if (escaped) {
+            size_t n = 0;
+            for (size_t i = 0; i < common; ++i) {
+                if (strchr(word_specials, first[i]))
+                    escaped[n++] = '\\';
+                escaped[n++] = first[i];
+            }
+            if (is_whole)
+                escaped[n++] = ' ';
+            if (replace(ed, start, ed->cursor - start, escaped, n))
+                refresh(ed);
+            free(escaped);
+        }
+    } else if (ed->is_tab_again && ed->match_count > 1) {
+        // The files are listed by their names, without the directory
+        const char *slash = strrchr(word, '/');
+        list_matches(ed, slash ? (size_t)(slash - word) + 1 : 0);
+    } else {
+        beep();
+    }
+    free(word);
+}
+
+/// The escape sequence in `ed->esc` is complete: handle its key
+static void escape_key(struct line_edit *ed) {
+    const char *seq = ed->esc + 1;
+    if (!strcmp(seq, "[A") || !strcmp(seq, "OA")) {
+        history_prev(ed);
+    } else if (!strcmp(seq, "[B") || !strcmp(seq, "OB")) {
+        history_next(ed);
+    } else if (!strcmp(seq, "[C") || !strcmp(seq, "OC")) {
+        ed->cursor = next_char(ed, ed->cursor);
+        refresh(ed);
+    } else if (!strcmp(seq, "[D") || !strcmp(seq, "OD")) {
+        ed->cursor = prev_char(ed, ed->cursor);
+        refresh(ed);
+    } else if (!strcmp(seq, "[H") || !strcmp(seq, "OH") || !strcmp(seq, "[1~") ||
+               !strcmp(seq, "[7~")) {
+        ed->cursor = 0;
+        refresh(ed);
+    } else if (!strcmp(seq, "[F") || !strcmp(seq, "OF") || !strcmp(seq, "[4~") ||
+               !strcmp(seq, "[8~")) {
+        ed->cursor = ed->len;
+        refresh(ed);
+    } else if (!strcmp(seq, "[3~")) {
+        if (ed->cursor < ed->len)
+            erase(ed, ed->cursor, next_char(ed, ed->cursor));
+    }
+}
+
+/// Take the next byte of an escape sequence. Returns `false` if it is not complete yet
+static bool escape_byte(struct line_edit *ed, char c) {
+    ed->esc[ed->esc_len++] = c;
+    ed->esc[ed->esc_len] = '\0';
+    if (ed->esc_len == 2)
+        return c != '[' && c != 'O';  // Alt with a key otherwise, not supported
+    bool is_final = ed->esc[1] == 'O' || (c >= 0x40 && c <= 0x7e);
+    if (is_final)
+        escape_key(ed);
+    return is_final || ed->esc_len + 1 == sizeof ed->esc;
+}
+
+/// Handle the key `c`. Returns the status of the line
+static enum line_edit_status key(struct line_edit *ed, char c) {
+    bool is_tab = false;
+    bool is_search = false;
+    if (ed->esc_len) {
+        if (escape_byte(ed, c))
+            ed->esc_len = 0;
+        // Up and Down are the only ones keeping the search going
+        is_search = ed->shown_count && (!strcmp(ed->esc, "\x1b[A") || !strcmp(ed->esc, "\x1bOA") ||
+                                        !strcmp(ed->esc, "\x1b[B") || !strcmp(ed->esc, "\x1bOB"));
+        if (ed->esc_len)
+            return LINE_EDIT_MORE;
+    } else switch (c) {
+    case '\r':
+    case '\n':
+        ed->cursor = ed->len;
+        refresh(ed);
+        term_puts("\n");
+        line_edit_stop(ed);
+        if (!reserve(ed, ed->len + 1))
+            return LINE_EDIT_EOF;
+        ed->buf[ed->len++] = '\n';
+        ed->buf[ed->len] = '\0';
+        return LINE_EDIT_DONE;
+    case '\x1b':
+        ed->esc[0] = c;
+        ed->esc_len = 1;
+        is_search = ed->shown_count > 0;
+        break;
+    case CTRL('D'):
+        if (ed->len == 0) {
+            term_puts("\n");
+            line_edit_stop(ed);
+            return LINE_EDIT_EOF;
+        }
+        if (ed->cursor < ed->len)
+            erase(ed, ed->cursor, next_char(ed, ed->cursor));
+        break;
+    case CTRL('C'):
+        term_puts("^C\n");
+        ed->len = ed->cursor = 0;
+        ed->buf[0] = '\0';
+        term_puts(ed->prompt);
+        break;
+    case 0x7f:
+    case CTRL('H'):
+        if (ed->cursor > 0)
+            erase(ed, prev_char(ed, ed->cursor), ed->cursor);
+        break;
+    case CTRL('A'):
+        ed->cursor = 0;
+        refresh(ed);
+        break;
+    case CTRL('E'):
+        ed->cursor = ed->len;
+        refresh(ed);
+        break;
+    case CTRL('B'):
+        ed->cursor = prev_char(ed, ed->cursor);
+        refresh(ed);
+        break;
+    case CTRL('F'):
+        ed->cursor = next_char(ed, ed->cursor);
+        refresh(ed);
+        break;
+    case CTRL('K'):
+        ed->len = ed->cursor;
+        ed->buf[ed->len] = '\0';
+        refresh(ed);
+        break;
+    case CTRL('U'):
+        erase(ed, 0, ed->cursor);
+        break;
+    case CTRL('W'): {
+        size_t from = ed->cursor;
+        while (from > 0 && ed->buf[from - 1] == ' ')
+            --from;
+        while (from > 0 && ed->buf[from - 1] != ' ')
+            --from;
+        erase(ed, from, ed->cursor);
+        break;
+    }
+    case CTRL('L'):
+        term_puts("\x1b[H\x1b[2J");
+        refresh(ed);
+        break;
+    case CTRL('P'):
+        history_prev(ed);
+        is_search = true;
+        break;
+    case CTRL('N'):
+        history_next(ed);
+        is_search = true;
+        break;
+    case '\t':
+        complete(ed);
+        is_tab = true;
+        break;
+    default:
+        if ((unsigned char)c < ' ')
+            break;  // The other control keys are ignored
+        if (replace(ed, ed->cursor, 0, &c, 1)) {
+            if (ed->cursor == ed->len)
+                term_write(&c, 1);  // Typed at the end: no need to draw the line again
+            else
+                refresh(ed);
+        }
+    }
+    if (!is_search)
+        ed->shown_count = 0;
+    ed->is_tab_again = is_tab;
+    return LINE_EDIT_MORE;
+}
+
+enum line_edit_status line_edit_feed(struct line_edit *ed, const char *keys, size_t size,
+                                     size_t *used) {
+    for (size_t i = 0; i < size; ++i) {
+        enum line_edit_status status = key(ed, keys[i]);
+        if (status != LINE_EDIT_MORE) {
+            *used = i + 1;
+            return status;
+        }
+    }
+    *used = size;
+    return LINE_EDIT_MORE;
+}
+
+void line_edit_destroy(struct line_edit *ed) {
+    line_edit_stop(ed);
+    clear_matches(ed);
+    free(ed->matches);
+    free(ed->shown);
+    free(ed->typed);
+    free(ed->buf);
+    *ed = (struct line_edit){};
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <termios.h>
+
+/*
+ * The line editor of the interactive shell, when stdin and stdout are a terminal. The keys
+ * are fed to it as they are read, so that the shell keeps reaping the background jobs while
+ * waiting for them (see main.c). A line is edited in the raw mode of the terminal, which is
+ * restored once it is entered.
+ *
+ * The keys are those of readline: the arrows, Home, End and Delete, Ctrl-A, -E, -B, -F, -D, -H,
+ * -K, -U, -W, -L and Ctrl-C to drop the line. Up and Down (Ctrl-P, Ctrl-N) go through the
+ * commands of the history starting with what has been typed, see history.h.
+ *
+ * Tab completes the word before the cursor: a command from `PATH` (see `path_cache_complete`,
+ * so `PATH` is not read again on each key) or a builtin at the start of a command, a file name
+ * otherwise. The longest common part of the candidates is inserted, the second Tab lists them.
+ */
+
+enum line_edit_status {
+    LINE_EDIT_MORE,
+    // The line is in `buf`
+    LINE_EDIT_DONE,
+    // Ctrl-D on an empty line
+    LINE_EDIT_EOF,
+};
+
+/** Zero-initialized. */
+struct line_edit {
+    // The line, null-terminated. Once done, it is followed by '\n' (counted in `len`)
+    char *buf;
+    size_t len, capacity;
+    size_t cursor;
+    const char *prompt;
+
+    // An escape sequence of a key being read
+    char esc[16];
+    size_t esc_len;
+
+    // The history search: the line it started from, and the commands shown since, a stack
+    char *typed;
+    size_t typed_len, typed_capacity;
+    size_t *shown;
+    size_t shown_count, shown_capacity;
+
+    // The candidates of a completion, and whether the last key was Tab
+    char **matches;
+    size_t match_count, match_capacity;
+    bool is_tab_again;
+
+    struct termios cooked;
+    bool is_raw;
+};
+
+/** Start a new line: switch the terminal to the raw mode and show the `prompt`. */
+void line_edit_start(struct line_edit *ed, const char *prompt);
+
+/**
+ * Handle the keys: the `size` bytes of `keys` as read from the terminal, of which it takes
+ * as many as `*used` (up to the end of the line). Once the line is done or it is the end of the
+ * input, the terminal is back in the mode it was.
+ */
+enum line_edit_status line_edit_feed(struct line_edit *ed, const char *keys, size_t size,
+                                     size_t *used);
+
+/** Restore the terminal, if still in the raw mode: e.g. as the input is over. */
+void line_edit_stop(struct line_edit *ed);
+
+/** Free the memory. */
+void line_edit_destroy(struct line_edit *ed);
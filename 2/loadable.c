@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "loadable.h"
+
+#define STATUS_EXITED(code) ((code) << 8)
+
+static const char symbol_prefix[] = "shell_builtin_";
+
+struct loadable {
+    char *name;
+    char *file;
+    builtin_f f;
+    void *handle;  // Of its own `dlopen`, which counts the references to the file
+};
+
+// A few of them, looked up by the name for each command
+static struct {
+    struct loadable *items;
+    size_t count;
+    size_t capacity;
+} table;
+
+static struct loadable *find(const char *name) {
+    for (size_t i = 0; i < table.count; ++i) {
+        if (!strcmp(table.items[i].name, name))
+            return &table.items[i];
+    }
+    return NULL;
+}
+
+builtin_f loadable_find(const char *name) {
+    struct loadable *l = table.count ? find(name) : NULL;
+    return l ? l->f : NULL;
+}
+
+/// A name is a part of a C identifier, so it can be of the function
+static bool is_valid_name(const char *name) {
+    if (!*name)
+        return false;
+    for (const char *c = name; *c; ++c) {
+        if (!(*c == '_' || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+                (*c >= '0' && *c <= '9')))
+            return false;
+    }
+    return true;
+}
+
+/// Load the builtin `name` of `file`, replacing the loaded one. Returns `false` if failed, reported
+static bool load(const char *file, const char *name) {
+    if (!is_valid_name(name)) {
+        fprintf(stderr, "enable: %s: not a valid builtin name\n", name);
+        return false;
+    }
+    struct loadable *l = find(name);
+    if (!l && table.count == table.capacity) {
+        size_t capacity = table.capacity ? 2 * table.capacity : 8;
+        struct loadable *items = realloc(table.items, capacity * sizeof (*items));
+        if (!items) {
+            fprintf(stderr, "enable: out of memory\n");
+            return false;
+        }
+        table.items = items;
+        table.capacity = capacity;
+    }
+    char *file_copy = strdup(file);
+    char *name_copy = l ? NULL : strdup(name);
+    if (!file_copy || (!l && !name_copy)) {
+        fprintf(stderr, "enable: out of memory\n");
+        free(file_copy);
+        free(name_copy);
+        return false;
+    }
+
+    void *handle = dlopen(file, RTLD_NOW | RTLD_LOCAL);
+    builtin_f f = NULL;
+    if (!handle) {
+        fprintf(stderr, "enable: cannot open shared object %s: %s\n", file, dlerror());
+    } else {
+        char symbol[sizeof symbol_prefix + strlen(name)];
+        strcpy(stpcpy(symbol, symbol_prefix), name);
+        f = (builtin_f)dlsym(handle, symbol);
+        if (!f) {
+            fprintf(stderr, "enable: %s: not found in %s\n", symbol, file);
+            (void)dlclose(handle);
+        }
+    }
+    if (!f) {
+        free(file_copy);
+        free(name_copy);
+        return false;
+    }
+
+    if (l) {
+        (void)dlclose(l->handle);
+        free(l->file);
+    } else {
+        l = &table.items[table.count++];
+        l->name = name_copy;
+    }
+    l->file = file_copy;
+    l->f = f;
+    l->handle = handle;
+    return true;
+}
+
+/// Unload the builtin `name`. Returns `false` if there is none, reported
+static bool unload(const char *name) {
+    struct loadable *l = find(name);
+    if (!l) {
+        fprintf(stderr, "enable: %s: not a loaded builtin\n", name);
+        return false;
+    }
+    (void)dlclose(l->handle);
+    free(l->name);
+    free(l->file);
+    *l = table.items[--table.count];
+    return true;
+}
+
+int loadable_builtin(char **argv) {
+    if (!argv[1]) {
+        for (size_t i = 0; i < table.count; ++i)
+            printf("enable -f %s %s\n", table.items[i].file, table.items[i].name);
+        fflush(stdout);  // The commands write to the same file directly
+        return STATUS_EXITED(EXIT_SUCCESS);
+    }
+    bool is_load = !strcmp(argv[1], "-f");
+    if ((!is_load && strcmp(argv[1], "-d")) || !argv[2] || (is_load && !argv[3])) {
+        fprintf(stderr, "enable: usage: enable [-f FILE NAME...] [-d NAME...]\n");
+        return STATUS_EXITED(EXIT_FAILURE);
+    }
+    bool is_ok = true;
+    for (char **name = argv + (is_load ? 3 : 2); *name; ++name)
+        is_ok = (is_load ? load(argv[2], *name) : unload(*name)) && is_ok;
+    return STATUS_EXITED(is_ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
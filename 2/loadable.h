@@ -0,0 +1,26 @@
+#pragma once
+
+#include "builtins.h"
+
+/*
+ * The builtins loaded from shared objects, like the loadable builtins of bash: `enable -f FILE
+ * NAME...` opens FILE with dlopen(3), and from then on the command NAME runs the function
+ * `shell_builtin_NAME` of it right in the shell, without a fork or an exec. It is a `builtin_f`:
+ * it writes to `out_fd`, does not read the standard input, and returns the status in the format
+ * of `waitpid`. It is run in the background jobs too, so it shall be quick.
+ *
+ * A loadable builtin is defined with `LOADABLE_BUILTIN(NAME)`, see loadable_basename.c, and built
+ * with `-shared -fPIC`. It comes before the builtins of the shell of the same name.
+ */
+
+/** The definition of the function of the loadable builtin `name`. */
+#define LOADABLE_BUILTIN(name) int shell_builtin_##name(char **argv, int out_fd)
+
+/** The loaded builtin `name`, `NULL` if there is none. */
+builtin_f loadable_find(const char *name);
+
+/**
+ * The `enable` builtin: `enable -f FILE NAME...` loads the builtins, `enable -d NAME...` unloads
+ * them, and `enable` lists the loaded ones. Returns the status in the format of `waitpid`.
+ */
+int loadable_builtin(char **argv);
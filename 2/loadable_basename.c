@@ -0,0 +1,48 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loadable.h"
+
+/*
+ * An example of a loadable builtin, see loadable.h: `basename NAME [SUFFIX]`, as of coreutils,
+ * for the scripts calling it on each file. `make loadable`, then `enable -f ./basename.so basename`.
+ */
+
+LOADABLE_BUILTIN(basename) {
+    if (!argv[1] || (argv[2] && argv[3])) {
+        fprintf(stderr, "basename: usage: basename NAME [SUFFIX]\n");
+        return EXIT_FAILURE << 8;
+    }
+    const char *name = argv[1];
+    size_t end = strlen(name);
+    while (end > 1 && name[end - 1] == '/')
+        --end;
+    size_t start = end;
+    while (start > 0 && name[start - 1] != '/')
+        --start;
+    if (start == end && end > 0)
+        start = end - 1;  // Just slashes: it is "/"
+    // The suffix is removed unless it is all there is
+    const char *suffix = argv[2];
+    size_t suffix_len = suffix ? strlen(suffix) : 0;
+    if (suffix_len && suffix_len < end - start &&
+            !memcmp(name + end - suffix_len, suffix, suffix_len))
+        end -= suffix_len;
+
+    char line[end - start + 1];
+    memcpy(line, name + start, end - start);
+    line[end - start] = '\n';
+    for (size_t pos = 0; pos < sizeof line;) {
+        ssize_t written = write(out_fd, line + pos, sizeof line - pos);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return errno == EPIPE ? SIGPIPE : EXIT_FAILURE << 8;
+        pos += written;
+    }
+    return EXIT_SUCCESS << 8;
+}
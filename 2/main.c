@@ -1,4 +1,5 @@
 #define _GNU_SOURCE
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,180 +9,421 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 #include <inttypes.h>
 
+#include "arena.h"
 #include "parse_command.h"
 #include "run_command.h"
+#include "jobs.h"
+#include "path_cache.h"
+#include "script_cache.h"
+#include "profile.h"
 #include "errors.h"
 #include "exit_status.h"
+#include "history.h"
+#include "line_edit.h"
 
 
+enum {
+    READ_BUF_SIZE = 64 * 1024,
+    CMD_BUF_MIN = 256,
+    KEYS_BUF_SIZE = 256,
+};
+
+#define PROMPT "$> "
+#define PROMPT_CONTINUED "> "
+
 /**
- * `sza_excl` shall not include the null terminator (i.e. be equal to `strlen`);
- * `szb_incl` shall include the null terminator (i.e. be `strlen` + 1).
- *
- * `a` must be either a pointer to a `malloc`-allocated string, or `NULL` (in the
- * latter case `sza_excl` shall be zero). It will be reallocated (the previous pointer
- * is invalidated), unless an error.
+ * The script is read from stdin with `read(2)` by large chunks. A command line is assembled
+ * in `cmd`, which is reused for all the commands: the parsed command points into it, so it
+ * is valid until the next command is read.
  *
- * `b` must be a pointer to a string (allocation does not matter, `b` is not freed).
- *
- * `a` is freed even if reallocation failed.
+ * On a terminal, the lines are edited by `editor` instead (see line_edit.h), and each one
+ * entered is put to `buf` as if read.
  */
-char *realloc_append_always_free(char *a, const char *b, size_t sza_excl, size_t szb_incl) {
-    char *res = realloc(a, sza_excl + szb_incl);
-    if (res == NULL) {
-        free(a);
-        return NULL;
-    }
-    memcpy(res + sza_excl, b, szb_incl);
-    return res;
-}
-
-struct parse_result read_and_parse_command_line(char **to_free) {
-    /*
-     * Just like the string coloring algorithm, this implementation
-     * gives the performance that is far from optimal but results in
-     * a simple and easy to read code.
-     */
+struct script_reader {
+    char buf[READ_BUF_SIZE];
+    size_t pos, len;
+    bool is_eof;
 
-    struct parse_result res = {};
-    char *prev = NULL;
-    size_t prev_len = 0;
+    char *cmd;
+    size_t cmd_capacity;
 
-    // `prev_dup` stores the `strdup`ed version of `prev` that is fed into
-    // `parse_command_line`. It shall not be freed before the corresponding
-    // `struct parse_result` is destroyed.
-    char *prev_dup = NULL;
-
-    // Keep reading lines until a complete command is consumed (or the input is over)
-    while (1) {
-        char *s;
-        int sres = scanf("%m[^\n]", &s);
+    // `NULL` if not interactive
+    struct line_edit *editor;
+    const char *prompt;
+    bool is_editing;
+    // The keys read and not yet handled by the editor
+    char keys[KEYS_BUF_SIZE];
+    size_t keys_pos, keys_len;
+    // The part of the line entered already put to `buf`
+    size_t line_pos;
+    // The lines of the command as entered, for the history
+    char *typed;
+    size_t typed_len, typed_capacity;
+};
 
-        if (sres == 0) {
-            // Scanf didn't read anything but it's not a `EOF`, therefore, it's a
-            // newline character.
+/// Wait for the input, reaping the background jobs as they finish meanwhile
+static void reader_wait(void) {
+    for (int job_fd; (job_fd = jobs_fd()) >= 0; ) {
+        struct pollfd fds[] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = job_fd, .events = POLLIN},
+        };
+        int ready = poll(fds, 2, -1);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready > 0 && fds[1].revents)
+            jobs_reap();
+        // If `poll` has failed, just block in `read`
+        if (ready <= 0 || fds[0].revents)
+            return;
+    }
+}
 
-            char c = getc(stdin);
-            assert(c == '\n');
+/// Append the line entered to `r->typed`. Returns `false` if out of memory
+static bool reader_keep_typed(struct script_reader *r, const char *line, size_t len) {
+    if (r->typed_len + len + 1 > r->typed_capacity) {
+        size_t capacity = r->typed_capacity ? r->typed_capacity : CMD_BUF_MIN;
+        while (capacity < r->typed_len + len + 1)
+            capacity *= 2;
+        char *typed = realloc(r->typed, capacity);
+        if (!typed)
+            return false;
+        r->typed = typed;
+        r->typed_capacity = capacity;
+    }
+    memcpy(r->typed + r->typed_len, line, len);
+    r->typed_len += len;
+    r->typed[r->typed_len] = '\0';
+    return true;
+}
 
-            if (prev[prev_len] == '\\') {
-                // If a backslash symbol follows the string instead of a NULL terminator,
-                // it means the last input ended with a backslash, thus, the current newline
-                // character should not be stored as pasrt of the command, so, do nothing.
-                continue;
-            } else {
-                // Otherwise, we're inside a quotation right now, so the newline character
-                // should be preserved.
-                prev = realloc_append_always_free(prev, "\n", prev_len, 2);
-                if (prev) {
-                    ++prev_len;
-                    continue;
-                } else {
-                    res.err = err_oom;
-                    break;
-                }
-            }
-        } else if (sres == EOF) {
-            // The input is over. If it failed on the first iteration (empty `prev`),
-            // indicate that the input is over, otherwise return the previous results
-            // (below).
-            if (!prev)
-                res.err = err_input_is_over;
+/// `reader_fill` of the interactive shell: the lines come from the editor
+static bool reader_fill_edited(struct script_reader *r) {
+    struct line_edit *ed = r->editor;
+    while (r->pos == r->len && !r->is_eof) {
+        if (!r->is_editing && r->line_pos < ed->len) {
+            size_t n = ed->len - r->line_pos < sizeof r->buf ? ed->len - r->line_pos
+                                                               : sizeof r->buf;
+            memcpy(r->buf, ed->buf + r->line_pos, n);
+            r->line_pos += n;
+            r->pos = 0;
+            r->len = n;
             break;
-        } else {
-            // Successful input. Combine with the previous data and attempt to parse.
-
-            if (s[0] == '#' && res.err != err_unclosed_quot) {  // Looks like a comment
-                free(s);
-                // Consume the newline character here to not confuse the parser with it
-                char c = getc(stdin);
-                assert(c == '\n');
+        }
+        if (!r->is_editing) {
+            fflush(stdout);  // The builtins may have printed something
+            line_edit_start(ed, r->prompt);
+            r->is_editing = true;
+        }
+        if (r->keys_pos == r->keys_len) {
+            reader_wait();
+            ssize_t got = read(STDIN_FILENO, r->keys, sizeof r->keys);
+            if (got < 0 && errno == EINTR)
                 continue;
+            if (got <= 0) {
+                line_edit_stop(ed);
+                r->is_eof = true;
+                break;
             }
+            r->keys_pos = 0;
+            r->keys_len = got;
+        }
+        size_t used;
+        enum line_edit_status status = line_edit_feed(ed, r->keys + r->keys_pos,
+                                                      r->keys_len - r->keys_pos, &used);
+        r->keys_pos += used;
+        if (status == LINE_EDIT_EOF) {
+            r->is_editing = false;
+            r->is_eof = true;
+        } else if (status == LINE_EDIT_DONE) {
+            r->is_editing = false;
+            r->line_pos = 0;
+            (void)reader_keep_typed(r, ed->buf, ed->len);
+        }
+    }
+    return r->pos < r->len;
+}
 
-            size_t s_len = strlen(s);
-            prev = realloc_append_always_free(prev, s, prev_len, s_len + 1);
-            free(s);
+/// Make sure there is unread data in the buffer. Returns `false` if the input is over
+static bool reader_fill(struct script_reader *r) {
+    if (r->editor)
+        return reader_fill_edited(r);
+    while (r->pos == r->len && !r->is_eof) {
+        // Reap the background jobs as they finish, even while waiting for the input
+        reader_wait();
+        ssize_t got = read(STDIN_FILENO, r->buf, sizeof r->buf);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            r->is_eof = true;
+            break;
+        }
+        r->pos = 0;
+        r->len = got;
+    }
+    return r->pos < r->len;
+}
 
-            if (!prev || !(prev_dup = strdup(prev))) {
-                // Out of memory. Report it.
-                res.err = err_oom;
-                break;
-            } else {
-                prev_len += s_len;
-                res = parse_command_line(prev_dup);
-
-                if (res.err) {
-                    free(prev_dup);
-                    prev_dup = NULL;
-
-                    // Note: here it is safe to compare strings as pointers because `res.err`
-                    // may only be assigned to a global constant defined in errors.c
-
-                    if (res.err == err_trailing_backslash || res.err == err_unclosed_quot) {
-                        if (res.err == err_trailing_backslash) {
-                            // Remove backslash from the final command
-                            --prev_len;
-                        }
-
-                        continue;
-                    } else {
-                        // If another error, report it.
-                        break;
-                    }
-                } else {
-                    /* Parsed successfully! Just exit the loop below. */
+/// Skip the whitespace (line breaks included) and the comment lines. Returns `false` if the
+/// input is over
+static bool reader_skip_to_command(struct script_reader *r) {
+    while (reader_fill(r)) {
+        char c = r->buf[r->pos];
+        if (c == '#') {
+            // A comment, up to the end of the line
+            while (reader_fill(r)) {
+                char *nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+                if (nl) {
+                    r->pos = nl - r->buf;
                     break;
                 }
+                r->pos = r->len;
             }
+        } else if (!isspace((unsigned char)c)) {
+            return true;
+        } else {
+            ++r->pos;
         }
+    }
+    return false;
+}
 
-        // Unreachable: either a `continue` or a `break` in every
-        // possible branch outcome above.
-        assert(false);
+/**
+ * Make room for `size` bytes in `r->cmd`, of which the first `used` are kept. If `p` is not
+ * `NULL`, it is parsing `r->cmd` and is moved along with it. Returns `false` if out of memory.
+ */
+static bool reader_reserve(struct script_reader *r, size_t used, size_t size,
+                           struct command_parser *p) {
+    if (size <= r->cmd_capacity)
+        return true;
+    size_t capacity = r->cmd_capacity ? r->cmd_capacity : CMD_BUF_MIN;
+    while (capacity < size)
+        capacity *= 2;
+    char *cmd = malloc(capacity);
+    if (!cmd)
+        return false;
+    if (used) {
+        memcpy(cmd, r->cmd, used);
+        if (p)
+            parser_rebase(p, r->cmd, cmd);
     }
+    free(r->cmd);
+    r->cmd = cmd;
+    r->cmd_capacity = capacity;
+    return true;
+}
 
-    // Either failed to `scanf` this time (so return results of the previous iteration),
-    // or an error (other than quotation/backslash thing) occurred this time (so return it),
-    // or everything successful! (so return it).
-    free(prev);  // Note: `prev` is either a good thing that came from `realloc_append_always_free`,
-                 // or `NULL` that came from `realloc_append_always_free`.
-    *to_free = prev_dup;
+/**
+ * Read the rest of the line (the line break is consumed but not stored) to `r->cmd`
+ * at `at`, null-terminated. `p` is as for `reader_reserve`. Returns `false` if out of memory.
+ */
+static bool reader_read_line(struct script_reader *r, size_t at, struct command_parser *p) {
+    while (reader_fill(r)) {
+        char *chunk = r->buf + r->pos;
+        size_t avail = r->len - r->pos;
+        char *nl = memchr(chunk, '\n', avail);
+        size_t n = nl ? (size_t)(nl - chunk) : avail;
+        if (!reader_reserve(r, at, at + n + 1, p))
+            return false;
+        memcpy(r->cmd + at, chunk, n);
+        at += n;
+        r->pos += n;
+        if (nl) {
+            ++r->pos;
+            break;
+        }
+    }
+    if (!reader_reserve(r, at, at + 1, p))
+        return false;
+    r->cmd[at] = '\0';
+    return true;
+}
+
+/// Add the command just read to the history, as it was entered
+static void reader_add_history(struct script_reader *r) {
+    if (!r->typed_len)
+        return;
+    // The empty lines before it are of no command, the line break after it is not its
+    char *typed = r->typed;
+    while (*typed == '\n')
+        ++typed;
+    if (r->typed[r->typed_len - 1] == '\n')
+        r->typed[r->typed_len - 1] = '\0';
+    history_add(typed);
+}
+
+/**
+ * Read and parse the next command, which may span several lines: through an unclosed quotation
+ * (the line break is then part of the command) or a backslash at the end of a line (then both
+ * are dropped). Each line is parsed once, continuing from where the previous one stopped, so
+ * the time is linear in the length of the command.
+ */
+static struct parse_result read_and_parse_command_line(struct script_reader *r,
+                                                      struct arena *arena) {
+    r->prompt = PROMPT;
+    r->typed_len = 0;
+    if (!reader_skip_to_command(r))
+        return (struct parse_result){.err = err_input_is_over};
+    if (!reader_read_line(r, 0, NULL))
+        return (struct parse_result){.err = err_oom};
+
+    struct command_parser p;
+    parser_start(&p, r->cmd, arena);
+    struct parse_result res = parser_run(&p);
+    while (res.err == err_trailing_backslash || res.err == err_unclosed_quot) {
+        r->prompt = PROMPT_CONTINUED;
+        if (!reader_fill(r))
+            break;  // The input is over in the middle of the command
+
+        size_t at = parser_tail(&p) - r->cmd;
+        if (res.err == err_unclosed_quot) {
+            // Inside of a quotation the line break is preserved
+            if (!reader_reserve(r, at, at + 1, &p))
+                return (struct parse_result){.err = err_oom};
+            r->cmd[at++] = '\n';
+        }
+        if (!reader_read_line(r, at, &p))
+            return (struct parse_result){.err = err_oom};
+        res = parser_run(&p);
+    }
+    if (r->editor)
+        reader_add_history(r);
     return res;
 }
 
 
-int main() {
+/// Parse the limit of the jobs at once, from `-j N` or `SHELL_MAX_JOBS`. Returns `false` if invalid
+static bool parse_max_jobs(const char *s, size_t *limit) {
+    char *end;
+    errno = 0;
+    uintmax_t n = strtoumax(s, &end, 10);
+    if (errno || end == s || *end || s[0] == '-')
+        return false;
+    *limit = (size_t)n;
+    return true;
+}
+
+
+/**
+ * Parse a size, from `SHELL_REDIR_BUFSZ` or `SHELL_PIPE_SIZE`: bytes, or with a `K`, `M` or `G`
+ * suffix. Returns `false` if invalid
+ */
+static bool parse_size(const char *s, size_t *size) {
+    char *end;
+    errno = 0;
+    uintmax_t n = strtoumax(s, &end, 10);
+    if (errno || end == s || s[0] == '-')
+        return false;
+    int shift = 0;
+    switch (*end) {
+    case 'K': shift = 10; ++end; break;
+    case 'M': shift = 20; ++end; break;
+    case 'G': shift = 30; ++end; break;
+    }
+    if (*end || n > SIZE_MAX >> shift)
+        return false;
+    *size = (size_t)n << shift;
+    return true;
+}
+
+/**
+ * Parse the whole script into `cache`, and save it. Returns `false` if out of memory, then
+ * the script is to be read again.
+ */
+static bool parse_script(struct script_reader *r, struct arena *arena, struct script_cache *cache) {
+    bool is_ok = true;
+    struct parse_result p;
+    while (is_ok && (p = read_and_parse_command_line(r, arena)).err != err_input_is_over) {
+        is_ok = script_cache_add(cache, &p);
+        arena_reset(arena);
+    }
+    if (is_ok)
+        script_cache_save(cache);
+    return is_ok;
+}
+
+
+int main(int argc, char **argv) {
     int exit_status = EXITSTATUS_DEFAULT;
+    profile_init();
 
-    while (1) {
-        (void)scanf(" ");  // Skip whitespace between commands
-        if (feof(stdin)) {
-            // In old enough libc the `scanf(" ")` is unable
-            // do detect EOF which causes counter-intuitive behavior
-            // in further attempts to scan input. Thus this separate
-            // check: if the input has finished while attempting to
-            // skip whitespace, break outright.
-            break;
+    // At most so many `&` jobs run at once, 0 is no limit
+    size_t max_jobs = 0;
+    const char *env_max_jobs = getenv("SHELL_MAX_JOBS");
+    if (env_max_jobs && *env_max_jobs && !parse_max_jobs(env_max_jobs, &max_jobs))
+        fprintf(stderr, "Invalid SHELL_MAX_JOBS: %s\n", env_max_jobs);
+    int opt;
+    while (-1 != (opt = getopt(argc, argv, "j:"))) {
+        if (opt != 'j' || !parse_max_jobs(optarg, &max_jobs)) {
+            fprintf(stderr, "Usage: %s [-j MAX_JOBS]\n", argv[0]);
+            return EXIT_FAILURE;
         }
+    }
+    jobs_set_limit(max_jobs);
+    // The redirects are written by a stage of their own with a buffer of so many bytes
+    size_t redirect_buffer = 0;
+    const char *env_redirect_buffer = getenv("SHELL_REDIR_BUFSZ");
+    if (env_redirect_buffer && *env_redirect_buffer &&
+            !parse_size(env_redirect_buffer, &redirect_buffer))
+        fprintf(stderr, "Invalid SHELL_REDIR_BUFSZ: %s\n", env_redirect_buffer);
+    run_set_redirect_buffer(redirect_buffer);
+    // The pipes between the stages are so big
+    size_t pipe_size = 0;
+    const char *env_pipe_size = getenv("SHELL_PIPE_SIZE");
+    if (env_pipe_size && *env_pipe_size && !parse_size(env_pipe_size, &pipe_size))
+        fprintf(stderr, "Invalid SHELL_PIPE_SIZE: %s\n", env_pipe_size);
+    run_set_pipe_size(pipe_size);
+    static struct script_reader reader;
+    static struct line_edit editor;
+    // The parsed command lines, one at a time
+    struct arena arena = {};
 
-        char *to_free;
-        struct parse_result p = read_and_parse_command_line(&to_free);
+    // With `SHELL_PARSE_CACHE`, the commands come from the cache
+    static struct script_cache cache;
+    bool is_cached = script_cache_open(&cache);
+    if (is_cached && !cache.is_mapped && !parse_script(&reader, &arena, &cache)) {
+        script_cache_close(&cache);
+        is_cached = false;
+        (void)lseek(STDIN_FILENO, 0, SEEK_SET);
+        reader.pos = reader.len = 0;
+        reader.is_eof = false;
+    }
+    // Typed on a terminal: edited, with the history
+    if (!is_cached && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+        reader.editor = &editor;
+        const char *history_path = getenv("SHELL_HISTORY");
+        char *home_history = NULL;
+        if (!history_path && getenv("HOME") &&
+                0 <= asprintf(&home_history, "%s/.shell_history", getenv("HOME")))
+            history_path = home_history;
+        if (history_path && *history_path)
+            (void)history_open(history_path);
+        free(home_history);
+    }
+
+    while (1) {
+        struct parse_result p = is_cached ? script_cache_next(&cache, &arena)
+                                          : read_and_parse_command_line(&reader, &arena);
         if (p.err == err_input_is_over) {
             break;
         } else if (p.err) {
             printf(": %s\n", p.err);
         } else {
-            exit_status = process_sequenced_commands(&p.s_head);
-            // DO NOT USE `p.s_head` here: it was consumed and destroyed by
-            // `process_sequenced_commands`.
+            exit_status = process_sequenced_commands(&p.s_head, &arena);
         }
-
-        // The consumed input string must be freed regardless of parsing success
-        free(to_free);
+        arena_reset(&arena);
     }
+    arena_destroy(&arena);
+    script_cache_close(&cache);
+    free(reader.cmd);
+    line_edit_destroy(&editor);
+    history_close();
+    free(reader.typed);
+    path_cache_destroy();
+    jobs_destroy();
 
     if (WIFEXITED(exit_status))
         return WEXITSTATUS(exit_status);
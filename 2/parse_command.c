@@ -1,292 +1,229 @@
 #include <stdbool.h>
-#include <stdlib.h>
-#include <assert.h>
-#include <string.h>
-#include <ctype.h>
+#include <stddef.h>
 
 #include "tokenizer.h"
 #include "errors.h"
 #include "parse_command.h"
 
-void destroy_piped_commands(struct piped_commands *pc) {
-    free(pc->argv);
-    if (pc->next)
-        destroy_piped_commands(pc->next);
-    free(pc->next);
-}
-
-void destroy_sequenced_commands(struct sequenced_commands *sc) {
-    if (sc->next)
-        destroy_sequenced_commands(sc->next);
-    if (sc->p_head)
-        destroy_piped_commands(sc->p_head);
-    free(sc->p_head);
-    free(sc->next);
-}
-
+/// Allocate and default-initialize a `struct piped_commands`
+static struct piped_commands *new_pc(struct arena *arena);
 
-size_t advance_whitespace(const char *s);
+/// Append `arg` to the `argv` of `pc`, keeping it `NULL`-terminated. Returns `false` if out of memory
+static bool pc_push_arg(struct arena *arena, struct piped_commands *pc, int *capacity, char *arg);
 
-bool is_operator(const char *op, const char *s) {
-    int i = 0;
-    for (; op[i] && s[i]; ++i) {
-        if (op[i] != s[i])
-            return false;
-    }
-    if (!op[i] && !is_cm_special(s[i]))
-        return true;
-    return false;
+struct parse_result parse_command_line(char *cmd, struct arena *arena) {
+    struct command_parser p;
+    parser_start(&p, cmd, arena);
+    return parser_run(&p);
 }
 
+void parser_start(struct command_parser *p, char *cmd, struct arena *arena) {
+    *p = (struct command_parser){.res = {.err = NULL, .s_head = {}}, .arena = arena};
+    lexer_init(&p->lx, cmd);
+    p->s_cur = &p->res.s_head;
+    p->last_sequencing = UNCONDITIONAL;
+}
 
-/// Allocate and default-initialize a `struct piped_commands`
-static struct piped_commands *new_pc();
-
-struct parse_result parse_command_line(char *cmd) {
-    struct parse_result res = {.err = NULL, .s_head = {}};
-    goto normal;
-
-err_out:
-    destroy_sequenced_commands(&res.s_head);
-    return res;
-
-normal:
+char *parser_tail(struct command_parser *p) {
+    return p->lx.pos;
+}
 
-    res.s_head.p_head = new_pc();
-    if (!res.s_head.p_head) {
-        res.err = err_oom;
-        goto err_out;
-    }
+/// Move `ptr` along with the string, unless it is `NULL`
+inline static char *rebase_ptr(char *ptr, const char *from, char *to) {
+    return ptr ? to + (ptr - from) : NULL;
+}
 
-    char color[strlen(cmd) + 1];
-    if (!escape_and_color(cmd, color)) {
-        res.err = err_trailing_backslash;
-        goto err_out;
+void parser_rebase(struct command_parser *p, const char *from, char *to) {
+    for (struct sequenced_commands *sc = &p->res.s_head; sc; sc = sc->next) {
+        for (struct piped_commands *pc = sc->p_head; pc; pc = pc->next) {
+            for (int i = 0; i < pc->_argc; ++i)
+                pc->argv[i] = rebase_ptr(pc->argv[i], from, to);
+            pc->outfile = rebase_ptr(pc->outfile, from, to);
+        }
     }
+    p->lx.out = rebase_ptr(p->lx.out, from, to);
+    p->lx.pos = rebase_ptr(p->lx.pos, from, to);
+    p->lx.word = rebase_ptr(p->lx.word, from, to);
+}
 
-    // We are about to make three passes:
-    // 1. During the first pass we will allocate the proper tree of `sequenced_commands`
-    //    and `piped_commands` and count the number of command-line arguments each command
-    //    will have (but not assign them yet). Most parse errors are detected at this pass.
-    // 2. During the second pass we will allocate and assign the command-line arguments
-    //    for the commands. The arguments pointers will point inside the given `cmd`.
-    //    The "argless command" error is detected at this pass.
-    // 3. During the third pass we will ensure all the specified command-line arguments are
-    //    NULL-terminated (by setting some chars of `cmd` to '\0').
+struct parse_result parser_run(struct command_parser *p) {
+    // A single pass: the lexer produces the tokens (the words are unquoted and null-terminated
+    // right inside `cmd`), and the tree of `sequenced_commands` and `piped_commands` is built as
+    // they come.
     //
-    // The first and second steps are not combined together to simplify the implementation by
-    // avoiding reallocations: in the first pass I allocate the tree and count all the arguments,
-    // then assign them all in the second step.
+    // The errors are prioritized as follows. A trailing backslash is reported first, whatever else
+    // is wrong: the line is to be continued anyway. Then the first syntax error in the order of
+    // the input, an unclosed quotation mark included (which is always the last one). The commands
+    // without arguments are reported last, as they may be fixed by the continuation of an
+    // unclosed quotation. So after a syntax error the rest of the input is still read, but the
+    // tree is not built anymore.
     //
-    // The second and third steps are not combined because in some cases (e.g. "echo 123>f")
-    // blind-ly null-terminating arguments (e.g. "123") in-place will break the
-    // command's semantics. It is quite tricky to handle if the command is being read in the
-    // same run.
-
-    int pos = 0;
-    struct sequenced_commands *s_cur = &res.s_head;
-    struct piped_commands *p_cur = s_cur->p_head;
-    while (1) {  // First pass: build the tree
-        pos += advance_whitespace(cmd + pos);
+    // An unfinished command keeps all the state in `p`, and its parsing is continued from the
+    // same point when the input is continued.
+
+    struct parse_result *res = &p->res;
+    if (!p->p_cur) {
+        res->s_head.p_head = p->p_cur = new_pc(p->arena);
+        if (!p->p_cur) {
+            res->err = err_oom;
+            return *res;
+        }
+    } else {
+        res->err = NULL;
+        lexer_resume(&p->lx);
+    }
 
-        int read = next_token(cmd + pos);
-        if (read < 0) {
-            // Unclosed quotation mark
-            res.err = err_unclosed_quot;
+    while (1) {
+        struct token tok;
+        const char *lex_err = lexer_next(&p->lx, &tok);
+        if (lex_err) {
+            if (lex_err == err_trailing_backslash)
+                res->err = lex_err;
+            else
+                res->err = p->syntax_err ? p->syntax_err : lex_err;
+            if (res->err == lex_err)
+                return *res;  // Unfinished, may be continued
             goto err_out;
-        } else if (read == 0) {
-            break;
+        }
+        if (p->syntax_err) {
+            if (tok.type == TOKEN_END)
+                break;
+            continue;
         }
 
-        if (is_operator(">", cmd+pos) || is_operator(">>", cmd+pos)) {
-            p_cur->append = (bool)(read - 1);
-            read += advance_whitespace(cmd + pos + read);
-            int next_read = next_token(cmd + pos + read);
-            if (!next_read) {
-                res.err = err_trailing_redir;
-                goto err_out;
-            }
-            if (is_cm_special(cmd[pos + read])) {
-                res.err = err_invalid_filename;
+        if (p->is_redirect) {
+            p->is_redirect = false;
+            if (tok.type == TOKEN_END)
+                p->syntax_err = err_trailing_redir;
+            else if (tok.type != TOKEN_WORD)
+                p->syntax_err = err_invalid_filename;
+            else
+                p->p_cur->outfile = tok.word;
+            p->p_cur->needs_expand |= tok.type == TOKEN_WORD && tok.has_marks;
+            continue;
+        }
+
+        if (tok.type == TOKEN_END)
+            break;
+
+        switch (tok.type) {
+        case TOKEN_WORD:
+            p->p_cur->needs_expand |= tok.has_marks;
+            if (!pc_push_arg(p->arena, p->p_cur, &p->argv_capacity, tok.word)) {
+                res->err = err_oom;
                 goto err_out;
             }
-            p_cur->outfile = cmd + pos + read;
-            read += next_read;
-        } else if (is_operator("|", cmd+pos)) {
-            p_cur->next = new_pc();
-            if (!p_cur->next) {
-                res.err = err_oom;
+            break;
+
+        case TOKEN_REDIRECT:
+        case TOKEN_APPEND:
+            p->p_cur->append = tok.type == TOKEN_APPEND;
+            p->is_redirect = true;
+            break;
+
+        case TOKEN_PIPE:
+            p->is_argless = p->is_argless || !p->p_cur->_argc;
+            p->p_cur->next = new_pc(p->arena);
+            if (!p->p_cur->next) {
+                res->err = err_oom;
                 goto err_out;
             }
-            p_cur = p_cur->next;
-        } else if (is_operator("||", cmd+pos) || is_operator("&&", cmd+pos) ||
-                    is_operator(";", cmd+pos) || is_operator("&", cmd+pos)) {
-            s_cur->next = calloc(1, sizeof (*s_cur->next));
+            p->p_cur = p->p_cur->next;
+            p->argv_capacity = 0;
+            break;
+
+        case TOKEN_OR:
+        case TOKEN_AND:
+        case TOKEN_SEQUENCE:
+        case TOKEN_BACKGROUND: {
+            p->is_argless = p->is_argless || !p->p_cur->_argc;
+            struct sequenced_commands *s_cur = p->s_cur;
+            s_cur->next = arena_alloc(p->arena, sizeof (*s_cur->next));
             if (!s_cur->next) {
-                res.err = err_oom;
+                res->err = err_oom;
                 goto err_out;
             }
-            if (cmd[pos] == '|') s_cur->run_next = SKIP_SUCCESS;
-            else if (cmd[pos+1] == '&') s_cur->run_next = SKIP_FAILURE;
-            else if (cmd[pos] == '&') s_cur->run_next = NOWAIT;
+            if (tok.type == TOKEN_OR) s_cur->run_next = SKIP_SUCCESS;
+            else if (tok.type == TOKEN_AND) s_cur->run_next = SKIP_FAILURE;
+            else if (tok.type == TOKEN_BACKGROUND) s_cur->run_next = NOWAIT;
             else s_cur->run_next = UNCONDITIONAL;
-            s_cur = s_cur->next;
-            s_cur->p_head = new_pc();
+            p->last_sequencing = s_cur->run_next;
+            p->s_cur = s_cur = s_cur->next;
+            *s_cur = (struct sequenced_commands){.next = NULL};
+            s_cur->p_head = new_pc(p->arena);
             if (!s_cur->p_head) {
-                res.err = err_oom;
+                res->err = err_oom;
                 goto err_out;
             }
-            p_cur = s_cur->p_head;
-        } else if (is_cm_special(cmd[pos])) {
-            // Comprised of command-special characters but is not a valid operator.
-            // (note: it's sufficient to check just the first char due to the tokenizer
-            // properties)
-            res.err = err_invalid_operator;
-            goto err_out;
-        } else {
-            // Normal-character argument
-            p_cur->_argc++;
+            p->p_cur = s_cur->p_head;
+            p->argv_capacity = 0;
+            break;
         }
 
-        pos += read;
+        default:
+            // Comprised of command-special characters but is not a valid operator
+            p->syntax_err = err_invalid_operator;
+            break;
+        }
     }
 
-    pos = 0;
-    s_cur = &res.s_head;
-    p_cur = s_cur->p_head;
-    int cur_arg = 0;
-    p_cur->argv = (char **)malloc((p_cur->_argc + 1) * sizeof (char *));
-    if (!p_cur->argv) {
-        res.err = err_oom;
+    if (p->syntax_err) {
+        res->err = p->syntax_err;
         goto err_out;
     }
-    enum sequencing_type last_sequencing = UNCONDITIONAL;
-    while (1) {  // Second pass: allocate and fill in `argv`s
-        pos += advance_whitespace(cmd + pos);
-
-        int read = next_token(cmd + pos);
-        // read < 0 is impossible - checked in the previous loop
-        assert(read >= 0);
-        if (read == 0)
-            break;
-
-        if (is_operator(">", cmd+pos) || is_operator(">>", cmd+pos)) {
-            // Skip the file name
-            read += advance_whitespace(cmd + pos + read);
-            read += next_token(cmd + pos + read);
-        } else if (is_cm_special(cmd[pos])) {
-            if (!p_cur->_argc) {
-                res.err = err_argless_command;
-                goto err_out;
-            }
-
-            // argv shall be NULL-terminated
-            p_cur->argv[cur_arg] = NULL;
-
-            if (is_operator("|", cmd+pos)) {
-                p_cur = p_cur->next;
-                cur_arg = 0;
-            } else if (is_operator("||", cmd+pos) || is_operator("&&", cmd+pos) ||
-                        is_operator(";", cmd+pos) || is_operator("&", cmd+pos)) {
-                last_sequencing = s_cur->run_next;
-                s_cur = s_cur->next;
-                p_cur = s_cur->p_head;
-                cur_arg = 0;
-            }
-
-            p_cur->argv = (char **)malloc((p_cur->_argc + 1) * sizeof (char *));
-            if (!p_cur->argv) {
-                res.err = err_oom;
-                goto err_out;
-            }
-        } else {
-            p_cur->argv[cur_arg++] = cmd + pos;
-        }
-
-        pos += read;
+    if (p->is_argless) {
+        res->err = err_argless_command;
+        goto err_out;
     }
-    // Last command's argv shall be NULL-terminated too!
-    p_cur->argv[cur_arg] = NULL;
 
+    struct piped_commands *p_cur = p->p_cur;
     if (!p_cur->_argc) {
         // If the last command does not have any arguments, this may be intended.
         // It shall be allowed if the command ends with either a ';' or an '&'.
         // Thus, `p_cur` must be the only `piped_commands` in the current
         // `sequenced_commands`, and the previous `sequenced_commands` shall have
         // an appropriate `.run_next` (it was saved to `last_sequencing`).
-        if ((last_sequencing == UNCONDITIONAL || last_sequencing == NOWAIT) &&
+        if ((p->last_sequencing == UNCONDITIONAL || p->last_sequencing == NOWAIT) &&
                 !p_cur->outfile &&  /* No outfile should've been sepcified (e.g. 'echo 1; >f')  */
-                s_cur->p_head == p_cur) {
+                p->s_cur->p_head == p_cur) {
             // The input is valid. To make the execution correct, turn `p_cur` into a stub command
-            free(p_cur->argv);
-            p_cur->argv = malloc(2 * sizeof (char *));
-            if (!p_cur->argv) {
-                res.err = err_oom;
+            if (!pc_push_arg(p->arena, p_cur, &p->argv_capacity, "true")) {  // Stub command
+                res->err = err_oom;
                 goto err_out;
             }
-            p_cur->_argc = 1;
-            p_cur->argv[0] = "true";  // Stub command
-            p_cur->argv[1] = NULL;
         } else {
             // The input is invalid
-            res.err = err_argless_command;
+            res->err = err_argless_command;
             goto err_out;
         }
     }
-    if ((last_sequencing != UNCONDITIONAL && last_sequencing != NOWAIT) ||
-            (s_cur->p_head != p_cur)) {
-        if (!p_cur->_argc) {
-            res.err = err_argless_command;
-        }
-    }
 
-    int terminated_times = 0;
-    pos = 0;
-    bool done = false;
-    while (!done) {  // Third pass: null-terminate args
-        pos += advance_whitespace(cmd + pos);
+    return *res;
 
-        int read = next_token(cmd + pos);
-        assert(read >= 0);
-        if (read == 0)
-            break;
-        int old = pos;
-        pos += read;
-        // If the just read token is a usual argument or a file name, terminate its string.
-        if (!is_cm_special(cmd[old])) {
-            done = cmd[pos] == '\0';
-            cmd[pos++] = '\0';
-            ++terminated_times;
-        }
-    }
-
-    // Finally, restore the escaped characters from colors. There is no problem to do it
-    // even this late because:
-    // - The first two runs had no effect on `cmd` at all
-    // - In the last run, we only set some characters to '\0' and we know for sure those
-    //   were either whitespaces or (not escaped) command-special characters. The length
-    //   did not change. Thus, the escaped characters will be restored on their proper
-    //   places.
-    //
-    // Note that `uncolor_unquote` _will_ shift `cmd`. That's why it returns the shift
-    // so that we can align it with `color`. We won't need it here, though :)
-
-    int str_shift = 0;
-    for (int i = 0; i < terminated_times; ++i) {
-        size_t nshift = strlen(cmd + str_shift) + 1;
-        (void)uncolor_unquote(cmd + str_shift, color + str_shift);
-        str_shift += nshift;
-    }
-
-    return res;
+err_out:
+    // The tree is left to the arena
+    return *res;
 }
 
-inline static struct piped_commands *new_pc() {
-    return (struct piped_commands *)calloc(1, sizeof (struct piped_commands));
+inline static struct piped_commands *new_pc(struct arena *arena) {
+    struct piped_commands *pc = arena_alloc(arena, sizeof (struct piped_commands));
+    if (pc)
+        *pc = (struct piped_commands){.argv = NULL};
+    return pc;
 }
 
-size_t advance_whitespace(const char *s) {
-    size_t res = 0;
-    for (; isspace(s[res]); ++res);
-    return res;
+static bool pc_push_arg(struct arena *arena, struct piped_commands *pc, int *capacity, char *arg) {
+    if (pc->_argc + 1 >= *capacity) {
+        // The argv being filled is usually the last allocation, so it grows in place
+        int new_capacity = *capacity ? 2 * *capacity : 4;
+        char **argv = arena_realloc(arena, pc->argv, *capacity * sizeof (char *),
+                                    new_capacity * sizeof (char *));
+        if (!argv)
+            return false;
+        pc->argv = argv;
+        *capacity = new_capacity;
+    }
+    pc->argv[pc->_argc++] = arg;
+    pc->argv[pc->_argc] = NULL;
+    return true;
 }
@@ -2,28 +2,36 @@
 
 #include <stdbool.h>
 
+#include "arena.h"
+#include "tokenizer.h"
+
+/*
+ * The parsed command is allocated in an arena, given to the parser: the structures, and the
+ * `argv` arrays. So it is freed all at once with `arena_reset`, there is nothing to destroy.
+ * The elements of `argv` and `outfile` point to (parts of) the parsed string.
+ */
+
 /**
  * A linked list of commands piped into each other.
  * For the last command in the pipe sequence, `.next` is `NULL`.
  */
 struct piped_commands {
-    // `argv` itself is owned by this struct, thus shall be freed before freeing
-    // the struct. The _elements_ of `argv`, in turn, are _not_ owned by the struct:
-    // they point to (parts of the same) string allocated independently of this
-    // struct.
     char **argv;
 
     // The number of arguments in `argv` before the `NULL` terminator
     int _argc;
 
-    // Command to pipe this to. Owned by the struct. `NULL` if shouldn't pipe.
+    // Command to pipe this to. `NULL` if shouldn't pipe.
     struct piped_commands *next;
 
-    // Path to file to redirect to. Not owned by the struct. `NULL` if shouldn't redirect.
+    // Path to file to redirect to. `NULL` if shouldn't redirect.
     char *outfile;
 
     // Append to `outfile`?
     bool append;
+
+    // Some of `argv` or `outfile` has the marks of the expansions, see `expand_pipeline`
+    bool needs_expand;
 };
 
 enum sequencing_type {
@@ -48,31 +56,54 @@ struct sequenced_commands {
     struct sequenced_commands *next;
 };
 
+struct parse_result {
+    const char *err;
+    struct sequenced_commands s_head;
+};
+
+/**
+ * Parses the given command line into a `struct sequenced_commands`, allocated
+ * in `arena`. Returns a `struct parse_result`. On success, `.s_head` is the
+ * parsed command and `.err` is `NULL`. The value of `.s_head` is valid until
+ * the arena is reset.
+ * On error, `.err` is set to the error message, `.s_head` is an invalid object
+ * that shall not be used. The memory is not freed until the arena is reset either.
+ */
+struct parse_result parse_command_line(char *cmd, struct arena *arena);
+
 /**
- * Cleanup all the memory owned by `pc` and its children.
- * Invalidates the object but does not free `pc` itself.
+ * State of parsing a command line which may be continued: for the input read line by line,
+ * where the command may span several lines. Each part of the line is only parsed once.
  */
-void destroy_piped_commands(struct piped_commands *pc);
+struct command_parser {
+    struct parse_result res;
+    struct arena *arena;
+    struct lexer lx;
+    struct sequenced_commands *s_cur;
+    struct piped_commands *p_cur;
+    int argv_capacity;
+    enum sequencing_type last_sequencing;
+    const char *syntax_err;
+    bool is_argless;
+    bool is_redirect;  // The previous token was `>` or `>>`, the next one is the file name
+};
 
+/** Start parsing `cmd` into `arena`, just like `parse_command_line` does. */
+void parser_start(struct command_parser *p, char *cmd, struct arena *arena);
 
 /**
- * Cleanup all the memory owned by `sc` and its children.
- * Invalidates the object but does not free `sc` itself.
+ * Parse the string to its end. The result is the same as of `parse_command_line`, except
+ * for `err_trailing_backslash` and `err_unclosed_quot`: then the command is unfinished,
+ * `.s_head` shall not be used, and the parser may be continued. To continue, write the
+ * continuation of the input at `parser_tail` (see `lexer_resume`) and call `parser_run` again.
  */
-void destroy_sequenced_commands(struct sequenced_commands *sc);
-
+struct parse_result parser_run(struct command_parser *p);
 
-struct parse_result {
-    const char *err;
-    struct sequenced_commands s_head;
-};
+/** Where the continuation of an unfinished command shall be written. */
+char *parser_tail(struct command_parser *p);
 
 /**
- * Parses the given command line into a `struct sequenced_commands`. Returns
- * a `struct parse_result`. On success, `.s_head` is the parsed command and
- * `.err` is `NULL`. The value of `.s_head` shall be destroyed with
- * `destroy_sequenced_commands` to free the resources.
- * On error, `.err` is set to the error message, `.s_head` is an invalid object
- * that shall not be used nor destroyed.
+ * The string of an unfinished command was copied from `from` to `to` (`from` is still valid).
+ * Move the parsed command there too.
  */
-struct parse_result parse_command_line(char *cmd);
+void parser_rebase(struct command_parser *p, const char *from, char *to);
@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "path_cache.h"
+
+struct path_dir {
+    char *path;
+    struct timespec mtime;
+    bool exists;
+    // The value of `epoch` when the directory was last checked
+    unsigned checked;
+    /*
+     * The names in the directory, sorted, once it has been read for a completion: the lookups
+     * then skip the directories not having the name instead of trying a `stat` in each. `NULL`
+     * if not read. They are of the directory as of `names_mtime`.
+     */
+    char **names;
+    char *names_data;
+    size_t name_count;
+    struct timespec names_mtime;
+};
+
+struct path_entry {
+    char *name;  // `NULL` for a free slot
+    char *path;
+    // Index of the directory the command was found in
+    size_t dir;
+    unsigned hits;
+};
+
+static struct {
+    // The value of `PATH` the directories were taken from
+    char *path_env;
+    struct path_dir *dirs;
+    size_t dir_count;
+
+    // Open addressing, the capacity is a power of two, at most half full
+    struct path_entry *entries;
+    size_t capacity;
+    size_t count;
+
+    unsigned epoch;
+} cache;
+
+static uint64_t hash_name(const char *name) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name; ++name)
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    return h;
+}
+
+static struct path_entry *find_slot(struct path_entry *entries, size_t capacity, const char *name) {
+    size_t i = hash_name(name) & (capacity - 1);
+    while (entries[i].name && strcmp(entries[i].name, name))
+        i = (i + 1) & (capacity - 1);
+    return &entries[i];
+}
+
+static void free_entries(void) {
+    if (!cache.entries)
+        return;
+    for (size_t i = 0; i < cache.capacity; ++i) {
+        free(cache.entries[i].name);
+        free(cache.entries[i].path);
+    }
+    memset(cache.entries, 0, cache.capacity * sizeof (*cache.entries));
+    cache.count = 0;
+}
+
+static void free_names(struct path_dir *dir) {
+    free(dir->names);
+    free(dir->names_data);
+    dir->names = NULL;
+    dir->names_data = NULL;
+    dir->name_count = 0;
+}
+
+static void free_dirs(void) {
+    for (size_t i = 0; i < cache.dir_count; ++i) {
+        free(cache.dirs[i].path);
+        free_names(&cache.dirs[i]);
+    }
+    free(cache.dirs);
+    free(cache.path_env);
+    cache.dirs = NULL;
+    cache.dir_count = 0;
+    cache.path_env = NULL;
+}
+
+void path_cache_flush(void) {
+    free_entries();
+    // Taken from `PATH` and checked again by the next lookup
+    free_dirs();
+}
+
+void path_cache_destroy(void) {
+    path_cache_flush();
+    free(cache.entries);
+    cache.entries = NULL;
+    cache.capacity = 0;
+}
+
+void path_cache_tick(void) {
+    ++cache.epoch;
+}
+
+static void stat_dir(struct path_dir *dir) {
+    struct stat st;
+    dir->exists = 0 == stat(dir->path, &st);
+    dir->mtime = dir->exists ? st.st_mtim : (struct timespec){0, 0};
+    dir->checked = cache.epoch;
+}
+
+/// Take the directories from `path_env`. Returns `false` if out of memory
+static bool load_dirs(const char *path_env) {
+    path_cache_flush();
+    cache.path_env = strdup(path_env);
+    size_t count = 1;
+    for (const char *c = path_env; *c; ++c)
+        count += *c == ':';
+    cache.dirs = calloc(count, sizeof (*cache.dirs));
+    if (!cache.path_env || !cache.dirs) {
+        free(cache.path_env);
+        cache.path_env = NULL;
+        return false;
+    }
+    for (const char *begin = path_env; count--; ) {
+        const char *end = strchrnul(begin, ':');
+        struct path_dir *dir = &cache.dirs[cache.dir_count];
+        dir->path = strndup(begin, end - begin);
+        if (!dir->path)
+            return false;
+        ++cache.dir_count;
+        stat_dir(dir);
+        begin = end + 1;
+    }
+    return true;
+}
+
+/// Have the first `count` directories stayed the same? Checked once per epoch
+static bool dirs_unchanged(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        struct path_dir *dir = &cache.dirs[i];
+        if (dir->checked == cache.epoch)
+            continue;
+        struct timespec old = dir->mtime;
+        bool existed = dir->exists;
+        stat_dir(dir);
+        if (existed != dir->exists || old.tv_sec != dir->mtime.tv_sec ||
+                old.tv_nsec != dir->mtime.tv_nsec)
+            return false;
+    }
+    return true;
+}
+
+/// Check all the directories not checked in this epoch. A changed one drops the cached commands
+static void refresh_dirs(void) {
+    bool is_changed = false;
+    // Each call checks the directories up to the first changed one
+    while (!dirs_unchanged(cache.dir_count))
+        is_changed = true;
+    if (is_changed)
+        free_entries();
+}
+
+/// Are the names of `dir` read, and of it as it is now? It must have been checked in this epoch
+static bool names_fresh(const struct path_dir *dir) {
+    return dir->names && dir->exists && dir->names_mtime.tv_sec == dir->mtime.tv_sec &&
+        dir->names_mtime.tv_nsec == dir->mtime.tv_nsec;
+}
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/// Read the names of `dir`, checked in this epoch. Returns `false` if failed or out of memory
+static bool read_names(struct path_dir *dir) {
+    free_names(dir);
+    DIR *d = opendir(dir->path);
+    if (!d)
+        return false;
+    size_t size = 0, capacity = 4096;
+    char *data = malloc(capacity);
+    size_t count = 0;
+    for (struct dirent *ent; data && (ent = readdir(d)); ) {
+        // What surely is not a command
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..") || ent->d_type == DT_DIR ||
+                ent->d_type == DT_FIFO || ent->d_type == DT_SOCK || ent->d_type == DT_CHR ||
+                ent->d_type == DT_BLK)
+            continue;
+        size_t len = strlen(ent->d_name) + 1;
+        if (size + len > capacity) {
+            char *grown = realloc(data, 2 * capacity + len);
+            if (!grown) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+            capacity = 2 * capacity + len;
+        }
+        memcpy(data + size, ent->d_name, len);
+        size += len;
+        ++count;
+    }
+    (void)closedir(d);
+    char **names = data ? malloc((count ? count : 1) * sizeof (*names)) : NULL;
+    if (!names) {
+        free(data);
+        return false;
+    }
+    for (size_t i = 0, at = 0; i < count; ++i, at += strlen(data + at) + 1)
+        names[i] = data + at;
+    qsort(names, count, sizeof (*names), name_cmp);
+    dir->names = names;
+    dir->names_data = data;
+    dir->name_count = count;
+    dir->names_mtime = dir->mtime;
+    return true;
+}
+
+/// The index of the first name of `dir` not less than `name`
+static size_t names_lower_bound(const struct path_dir *dir, const char *name) {
+    size_t lo = 0, hi = dir->name_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(dir->names[mid], name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool is_executable(const char *path) {
+    struct stat st;
+    return 0 == stat(path, &st) && S_ISREG(st.st_mode) && 0 == access(path, X_OK);
+}
+
+/// Add `name` found in the directory `dir` to the cache. Does nothing if out of memory
+static struct path_entry *insert(const char *name, char *path, size_t dir) {
+    if (2 * (cache.count + 1) > cache.capacity) {
+        size_t capacity = cache.capacity ? 2 * cache.capacity : 64;
+        struct path_entry *entries = calloc(capacity, sizeof (*entries));
+        if (!entries)
+            return NULL;
+        for (size_t i = 0; i < cache.capacity; ++i) {
+            if (cache.entries[i].name)
+                *find_slot(entries, capacity, cache.entries[i].name) = cache.entries[i];
+        }
+        free(cache.entries);
+        cache.entries = entries;
+        cache.capacity = capacity;
+    }
+    struct path_entry *e = find_slot(cache.entries, cache.capacity, name);
+    e->name = strdup(name);
+    if (!e->name)
+        return NULL;
+    e->path = path;
+    e->dir = dir;
+    e->hits = 0;
+    ++cache.count;
+    return e;
+}
+
+/// Take the directories from `PATH` if it has changed. Returns `false` if unset or out of memory
+static bool sync_path_env(void) {
+    const char *path_env = getenv("PATH");
+    if (!path_env)
+        return false;
+    if (!cache.path_env || strcmp(cache.path_env, path_env))
+        return load_dirs(path_env);
+    return true;
+}
+
+/// The path of `name` in `dir`, allocated. `NULL` if out of memory
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (!path)
+        return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+const char *path_cache_lookup(const char *name) {
+    if (!*name || strchr(name, '/') || !sync_path_env())
+        return NULL;
+
+    if (cache.count) {
+        struct path_entry *e = find_slot(cache.entries, cache.capacity, name);
+        if (e->name) {
+            if (dirs_unchanged(e->dir + 1)) {
+                ++e->hits;
+                return e->path;
+            }
+            path_cache_flush();
+            if (!sync_path_env())
+                return NULL;
+        }
+    }
+
+    for (size_t i = 0; i < cache.dir_count; ++i) {
+        struct path_dir *dir = &cache.dirs[i];
+        if (dir->path[0] != '/')
+            return NULL;  // Relative to the current directory, which changes
+        if (dir->names) {
+            if (dir->checked != cache.epoch)
+                refresh_dirs();
+            size_t at = names_lower_bound(dir, name);
+            if (names_fresh(dir) && (at == dir->name_count || strcmp(dir->names[at], name)))
+                continue;
+        }
+        char *path = join_path(dir->path, name);
+        if (!path)
+            return NULL;
+        if (is_executable(path)) {
+            struct path_entry *e = insert(name, path, i);
+            if (!e) {
+                free(path);
+                return NULL;
+            }
+            e->hits = 1;
+            return e->path;
+        }
+        free(path);
+    }
+    return NULL;
+}
+
+void path_cache_forget(const char *name) {
+    if (!cache.count)
+        return;
+    struct path_entry *e = find_slot(cache.entries, cache.capacity, name);
+    if (!e->name)
+        return;
+    // Removal from open addressing: rehash the rest of the cluster
+    free(e->name);
+    free(e->path);
+    e->name = NULL;
+    --cache.count;
+    size_t i = e - cache.entries;
+    for (i = (i + 1) & (cache.capacity - 1); cache.entries[i].name;
+            i = (i + 1) & (cache.capacity - 1)) {
+        struct path_entry moved = cache.entries[i];
+        cache.entries[i].name = NULL;
+        *find_slot(cache.entries, cache.capacity, moved.name) = moved;
+    }
+}
+
+void path_cache_print(void) {
+    if (!cache.count) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < cache.capacity; ++i) {
+        if (cache.entries[i].name)
+            printf("%4u\t%s\n", cache.entries[i].hits, cache.entries[i].path);
+    }
+}
+
+/// A name found by `path_cache_complete`, and the directory it is in
+struct completion {
+    const char *name;
+    size_t dir;
+};
+
+static int completion_cmp(const void *a, const void *b) {
+    const struct completion *x = a, *y = b;
+    int cmp = strcmp(x->name, y->name);
+    return cmp ? cmp : (x->dir > y->dir) - (x->dir < y->dir);
+}
+
+bool path_cache_complete(const char *prefix, void (*fn)(const char *name, void *arg), void *arg) {
+    if (!sync_path_env())
+        return true;
+    refresh_dirs();
+    size_t prefix_len = strlen(prefix);
+    struct completion *found = NULL;
+    size_t count = 0, capacity = 0;
+    bool is_ok = true;
+    for (size_t i = 0; is_ok && i < cache.dir_count; ++i) {
+        struct path_dir *dir = &cache.dirs[i];
+        if (dir->path[0] != '/' || !dir->exists)
+            continue;
+        if (!names_fresh(dir) && !read_names(dir))
+            continue;
+        for (size_t at = names_lower_bound(dir, prefix); at < dir->name_count &&
+                !strncmp(dir->names[at], prefix, prefix_len); ++at) {
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 64;
+                struct completion *grown = realloc(found, capacity * sizeof (*found));
+                if (!grown) {
+                    is_ok = false;
+                    break;
+                }
+                found = grown;
+            }
+            found[count++] = (struct completion){.name = dir->names[at], .dir = i};
+        }
+    }
+
+    // The first directory of a name is the one it runs from, as long as it is executable there
+    if (count)
+        qsort(found, count, sizeof (*found), completion_cmp);
+    for (size_t i = 0; is_ok && i < count; ) {
+        size_t next = i + 1;
+        while (next < count && !strcmp(found[next].name, found[i].name))
+            ++next;
+        for (size_t j = i; j < next; ++j) {
+            char *path = join_path(cache.dirs[found[j].dir].path, found[j].name);
+            if (!path) {
+                is_ok = false;
+                break;
+            }
+            bool is_command = is_executable(path);
+            free(path);
+            if (is_command) {
+                fn(found[j].name, arg);
+                break;
+            }
+        }
+        i = next;
+    }
+    free(found);
+    return is_ok;
+}
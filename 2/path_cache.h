@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+
+/*
+ * A cache of the `PATH` lookups, just like `hash` of bash: a command name is resolved to
+ * the absolute path of the executable once, and executed right by that path afterwards,
+ * instead of `execvp` trying each `PATH` directory on every call.
+ *
+ * A directory changed since (its mtime) drops the cache, as a command may have appeared
+ * or disappeared in it. The directories in front of a cached command and its own are
+ * checked at most once per `path_cache_tick`. A different `PATH` drops the cache too.
+ *
+ * A completion reads the directories, once per their mtime, and keeps their names: the lookups
+ * then try only the directories having the name, and the next completions read nothing again.
+ */
+
+/**
+ * The path of the executable `name` would run, `NULL` if it is not cached and can not be found
+ * (or `name` is a path itself, or the search involves a relative `PATH` entry): then
+ * it should be executed with the usual `PATH` search. The result is valid until the next call.
+ */
+const char *path_cache_lookup(const char *name);
+
+/** Drop `name` from the cache, e.g. as its cached path failed to execute. */
+void path_cache_forget(const char *name);
+
+/** Drop the whole cache, like `hash -r`. */
+void path_cache_flush(void);
+
+/** Free the cache, at the exit of the shell. */
+void path_cache_destroy(void);
+
+/** A new command line is being run: the directories shall be checked again. */
+void path_cache_tick(void);
+
+/** Print the cache like `hash` without arguments does. */
+void path_cache_print(void);
+
+/**
+ * Call `fn` for each command in `PATH` whose name starts with `prefix`, once per name, in the
+ * order of the names. Returns `false` if out of memory, then some may have been left out.
+ */
+bool path_cache_complete(const char *prefix, void (*fn)(const char *name, void *arg), void *arg);
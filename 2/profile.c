@@ -0,0 +1,130 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+struct command_profile {
+    char *name;
+    long calls;
+    double wall, user, sys;
+    long max_rss;
+};
+
+static struct {
+    bool is_enabled;
+    pid_t shell_pid;  // The report is printed by the shell, not by its forked children
+    struct command_profile *commands;
+    size_t count, capacity;
+} profile;
+
+static double tv_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void tv_add(struct timeval *to, struct timeval tv) {
+    to->tv_sec += tv.tv_sec;
+    to->tv_usec += tv.tv_usec;
+    if (to->tv_usec >= 1000000) {
+        to->tv_usec -= 1000000;
+        ++to->tv_sec;
+    }
+}
+
+double profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void pipeline_usage_add(struct pipeline_usage *usage, const struct rusage *ru) {
+    tv_add(&usage->user, ru->ru_utime);
+    tv_add(&usage->sys, ru->ru_stime);
+    if (ru->ru_maxrss > usage->max_rss)
+        usage->max_rss = ru->ru_maxrss;
+}
+
+static void print_time(const char *name, double seconds) {
+    int minutes = (int)(seconds / 60);
+    fprintf(stderr, "%s\t%dm%.3fs\n", name, minutes, seconds - 60 * minutes);
+}
+
+void pipeline_usage_print(const struct pipeline_usage *usage, double wall) {
+    // The format of bash, with the memory in addition
+    fprintf(stderr, "\n");
+    print_time("real", wall);
+    print_time("user", tv_seconds(usage->user));
+    print_time("sys", tv_seconds(usage->sys));
+    fprintf(stderr, "maxrss\t%ldK\n", usage->max_rss);
+}
+
+bool profile_is_enabled(void) {
+    return profile.is_enabled;
+}
+
+void profile_record(const char *name, double wall, const struct rusage *ru) {
+    struct command_profile *cp = NULL;
+    for (size_t i = 0; i < profile.count; ++i) {
+        if (!strcmp(profile.commands[i].name, name)) {
+            cp = &profile.commands[i];
+            break;
+        }
+    }
+    if (!cp) {
+        if (profile.count == profile.capacity) {
+            size_t capacity = profile.capacity ? 2 * profile.capacity : 16;
+            struct command_profile *commands =
+                realloc(profile.commands, capacity * sizeof (*commands));
+            if (!commands)
+                return;  // The profile is not worth failing the command
+            profile.commands = commands;
+            profile.capacity = capacity;
+        }
+        char *copy = strdup(name);
+        if (!copy)
+            return;
+        cp = &profile.commands[profile.count++];
+        *cp = (struct command_profile){.name = copy};
+    }
+    ++cp->calls;
+    cp->wall += wall;
+    cp->user += tv_seconds(ru->ru_utime);
+    cp->sys += tv_seconds(ru->ru_stime);
+    if (ru->ru_maxrss > cp->max_rss)
+        cp->max_rss = ru->ru_maxrss;
+}
+
+static int compare_cost(const void *a, const void *b) {
+    const struct command_profile *x = a, *y = b;
+    if (x->wall != y->wall)
+        return x->wall < y->wall ? 1 : -1;
+    double cpu_x = x->user + x->sys, cpu_y = y->user + y->sys;
+    return cpu_x < cpu_y ? 1 : cpu_x > cpu_y ? -1 : 0;
+}
+
+static void profile_report(void) {
+    if (getpid() != profile.shell_pid)
+        return;
+    qsort(profile.commands, profile.count, sizeof (*profile.commands), compare_cost);
+    fprintf(stderr, "%-20s %8s %12s %12s %12s %12s\n", "command", "calls", "wall, s", "user, s",
+            "sys, s", "maxrss, K");
+    for (size_t i = 0; i < profile.count; ++i) {
+        const struct command_profile *cp = &profile.commands[i];
+        fprintf(stderr, "%-20s %8ld %12.3f %12.3f %12.3f %12ld\n", cp->name, cp->calls, cp->wall,
+                cp->user, cp->sys, cp->max_rss);
+        free(cp->name);
+    }
+    free(profile.commands);
+}
+
+void profile_init(void) {
+    const char *env = getenv("SHELL_PROFILE");
+    if (!env || strcmp(env, "1"))
+        return;
+    profile.is_enabled = true;
+    profile.shell_pid = getpid();
+    atexit(profile_report);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/resource.h>
+
+/*
+ * Resource accounting of the commands: the `time` keyword in front of a pipeline, and the
+ * profile of the whole script with `SHELL_PROFILE=1`, reported per command name at exit.
+ * The usage of a command comes from `wait4`; the builtins are measured in the shell.
+ */
+
+/// Resources used by the stages of a pipeline
+struct pipeline_usage {
+    struct timeval user, sys;
+    long max_rss;  // KiB, the largest of the stages
+};
+
+/** Add the usage `ru` of a stage to `usage`. */
+void pipeline_usage_add(struct pipeline_usage *usage, const struct rusage *ru);
+
+/** Print the report of the `time` keyword to stderr, `wall` is in seconds. */
+void pipeline_usage_print(const struct pipeline_usage *usage, double wall);
+
+/** Start profiling if `SHELL_PROFILE=1`, the report is printed at exit. */
+void profile_init(void);
+
+bool profile_is_enabled(void);
+
+/** Account a stage `name` which has run for `wall` seconds and used `ru`. */
+void profile_record(const char *name, double wall, const struct rusage *ru);
+
+/** Monotonic time, seconds. */
+double profile_now(void);
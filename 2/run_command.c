@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,12 +7,25 @@
 #include <string.h>
 #include <assert.h>
 #include <stdarg.h>
-#include <linux/sched.h>
+#include <spawn.h>
 #include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
 #include <inttypes.h>
+#include <limits.h>
 
 #include "parse_command.h"
 #include "run_command.h"
+#include "expand.h"
+#include "builtins.h"
+#include "loadable.h"
+#include "coproc.h"
+#include "path_cache.h"
+#include "profile.h"
+#include "jobs.h"
 #include "exit_status.h"
 
 __attribute__((noreturn)) void die(const char *fmt, ...) {
@@ -22,57 +36,19 @@ __attribute__((noreturn)) void die(const char *fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
-pid_t sibling_fork() {
-    struct clone_args args = {
-        .flags = CLONE_PARENT
-    };
-
-    return (pid_t)syscall(SYS_clone3, &args, sizeof args);
-}
-
 /**
- * Run commands with output piped into each other, with last one possibly redirected to
- * a file.
- *
- * `pc` points to the linked list of `struct piped_commands` to be executed.
- *
- * `write_my_pid_fd` must be a writable file descriptor, where the pids of the
- * current process and all created siblings will be written (as a binary sequence of `pid_t`
- * values, no padding). Giving a value less than zero disables this feature.
+ * Run a stage of a pipeline, in a forked child of the shell: it reads `in_fd` (stdin if -1)
+ * and writes to `out_fd`, or to the `outfile` of `pc`, or to stdout. The descriptors are
+ * close-on-exec, so only the stdin and stdout made of them remain. The stages run by the shell
+ * itself (`cd`, `exit`, and the loaded builtins and the coprocesses) do so here.
  */
-__attribute__((noreturn)) void process_piped_commands(const struct piped_commands *const pc,
-                                                      int write_my_pid_fd) {
-    // Let the big brother know I should be reaped.
-    if (write_my_pid_fd >= 0) {
-        pid_t self = getpid();
-        size_t written = write(write_my_pid_fd, &self, sizeof self);
-        assert(written == sizeof self);
-    }
-
-    if(pc->next) {
-        int fildes[2];
-        if (0 > pipe(fildes)) {
-            die("Failed to open pipe: %s\n", strerror(errno));
-        }
-
-        pid_t pid = sibling_fork();
-        if (0 > pid) {
-            die("Failed to clone3 from %s: %s\n", pc->argv[0], strerror(errno));
-        } else if (0 == pid) {
-            // Child
-            dup2(fildes[0], STDIN_FILENO);
-            close(fildes[0]);
-            close(fildes[1]);
-            process_piped_commands(pc->next, write_my_pid_fd);
-            // `process_piped_commands` always either terminates or `exec`s
-            assert(false);
-        } else {
-            // Parent
-            (void)close(write_my_pid_fd);  // Descriptor may be invalid but I don't care
-            dup2(fildes[1], STDOUT_FILENO);
-            close(fildes[0]);
-            close(fildes[1]);
-        }
+__attribute__((noreturn)) static void run_stage(const struct piped_commands *const pc, int in_fd,
+                                                int out_fd) {
+    if (in_fd >= 0 && 0 > dup2(in_fd, STDIN_FILENO))
+        die("Failed to dup2 for %s: %s\n", pc->argv[0], strerror(errno));
+    if (out_fd >= 0) {
+        if (0 > dup2(out_fd, STDOUT_FILENO))
+            die("Failed to dup2 for %s: %s\n", pc->argv[0], strerror(errno));
     } else if(pc->outfile) {
         int fd = open(pc->outfile, O_CREAT | (pc->append ? O_APPEND : O_TRUNC) | O_WRONLY,
                 S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
@@ -87,7 +63,7 @@ __attribute__((noreturn)) void process_piped_commands(const struct piped_command
     }
 
     if (!strcmp(pc->argv[0], "cd")) {
-        if (pc->argv[1] != NULL || pc->argv[2] == NULL) {
+        if (pc->argv[1] != NULL && pc->argv[2] == NULL) {
             if (0 > chdir(pc->argv[1])) {
                 die("Failed to chdir to %s: %s\n", pc->argv[1], strerror(errno));
             }
@@ -113,14 +89,24 @@ __attribute__((noreturn)) void process_piped_commands(const struct piped_command
             exit(EXIT_SUCCESS);
         }
     }
+    builtin_f extension = find_extension_builtin(pc->argv[0]);
+    if (extension) {
+        int status = run_builtin(extension, pc->argv, STDOUT_FILENO);
+        exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    }
+    const char *path = path_cache_lookup(pc->argv[0]);
+    if (path)
+        execve(path, pc->argv, environ);
+    // Not cached, or failed by the cached path: search again
     execvp(pc->argv[0], pc->argv);
     die("Failed to exec %s: %s\n", pc->argv[0], strerror(errno));
 }
 
 /**
  * Returns `true` if `pc` was a special action, thus, no need to perform anything else.
+ * The actions which have a status set `*exit_status`.
  */
-bool handle_special(const struct piped_commands *const pc) {
+bool handle_special(const struct piped_commands *const pc, int *exit_status) {
     if (pc->next)
         return false;
 
@@ -141,6 +127,8 @@ bool handle_special(const struct piped_commands *const pc) {
             exit_code = EXIT_SUCCESS;
         }
 
+        path_cache_destroy();
+        jobs_destroy();
         exit(exit_code);
         assert(false);
         // Would be
@@ -155,16 +143,541 @@ bool handle_special(const struct piped_commands *const pc) {
             fprintf(stderr, "cd must get exatly one argument\n");
         }
         return true;
+    } else if (!strcmp(pc->argv[0], "hash")) {
+        if (pc->argv[1] && !strcmp(pc->argv[1], "-r") && !pc->argv[2]) {
+            path_cache_flush();
+        } else if (pc->argv[1] && pc->argv[1][0] == '-') {
+            fprintf(stderr, "hash: usage: hash [-r] [name ...]\n");
+        } else if (!pc->argv[1]) {
+            path_cache_print();
+            fflush(stdout);  // The commands write to the same file directly
+        } else {
+            for (char **name = pc->argv + 1; *name; ++name) {
+                if (!path_cache_lookup(*name))
+                    fprintf(stderr, "hash: %s: not found\n", *name);
+            }
+        }
+        return true;
+    } else if (!strcmp(pc->argv[0], "wait")) {
+        *exit_status = jobs_wait_builtin(pc->argv);
+        return true;
+    } else if (!strcmp(pc->argv[0], "jobs")) {
+        *exit_status = jobs_print_builtin(pc->argv);
+        return true;
+    } else if (!strcmp(pc->argv[0], "enable")) {
+        *exit_status = loadable_builtin(pc->argv);
+        return true;
+    } else if (!strcmp(pc->argv[0], "coproc")) {
+        *exit_status = coproc_builtin(pc->argv);
+        return true;
+    }
+    return false;
+}
+
+
+inline static int pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+/// A stage of a pipeline started by `spawn_piped_commands`
+struct stage {
+    const char *name;
+    pid_t pid;  // -1 if not spawned
+    builtin_f builtin;  // Run by the shell itself instead, if not `NULL`
+    int out_fd;  // Output of the builtin, -1 for stdout
+    int status;  // Status of the builtin
+};
+
+/**
+ * Reap the stage `name` with `pid`, started at `start`. Its resources are added to `usage`
+ * and to the profile. `status` may be `NULL`.
+ */
+static void reap_stage(const char *name, pid_t pid, int *status, double start,
+                       struct pipeline_usage *usage) {
+    struct rusage ru;
+    if (0 > wait4(pid, status, 0, &ru))
+        return;
+    pipeline_usage_add(usage, &ru);
+    if (profile_is_enabled())
+        profile_record(name, profile_now() - start, &ru);
+}
+
+/**
+ * Wait for all the spawned `stages` of a pipeline with a single `poll` of their pidfds, and set
+ * `*exit_status` to the status of the last one, or of the failure if it has not started. The
+ * exited stages are reaped in any order. Their resources are accounted in `usage`, they have
+ * started at `start`.
+ */
+static void wait_stages(const struct stage *stages, size_t count, int *exit_status, double start,
+                        struct pipeline_usage *usage) {
+    struct pollfd *fds = malloc(count * sizeof (*fds));
+    size_t running = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pid_t pid = stages[i].pid;
+        int fd = pid < 0 || !fds ? -1 : pidfd_open(pid);
+        if (fd >= 0) {
+            fds[i] = (struct pollfd){.fd = fd, .events = POLLIN};
+            ++running;
+        } else {
+            // Not started, or there is no pidfd: just block in `wait4` for it
+            if (pid >= 0)
+                reap_stage(stages[i].name, pid, i == count - 1 ? exit_status : NULL, start, usage);
+            if (fds)
+                fds[i] = (struct pollfd){.fd = -1};  // Ignored by `poll`
+        }
+    }
+    if (stages[count - 1].builtin)
+        *exit_status = stages[count - 1].status;
+    else if (stages[count - 1].pid < 0)
+        *exit_status = EXIT_FAILURE << 8;
+
+    while (running > 0) {
+        if (0 > poll(fds, count, -1)) {
+            if (errno == EINTR)
+                continue;
+            die("Failed to poll the children: %s\n", strerror(errno));
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            reap_stage(stages[i].name, stages[i].pid, i == count - 1 ? exit_status : NULL, start,
+                       usage);
+            (void)close(fds[i].fd);
+            fds[i].fd = -1;
+            --running;
+        }
+    }
+    free(fds);
+}
+
+/**
+ * Returns `true` if some of `pc` is run by the shell itself in a child (see
+ * `run_stage`), so it can not be spawned.
+ */
+static bool needs_fork(const struct piped_commands *pc) {
+    for (; pc; pc = pc->next) {
+        if (!strcmp(pc->argv[0], "cd") || !strcmp(pc->argv[0], "exit"))
+            return true;
     }
     return false;
 }
 
+/// The buffer of the redirect writer, 0 for none, see `run_set_redirect_buffer`
+static size_t redirect_buffer;
+
+/// The capacity of the pipes between the stages, 0 for the default one, see `run_set_pipe_size`
+static int pipe_size;
+
+void run_set_pipe_size(size_t size) {
+    // At most what an unprivileged process may ask for
+    size_t max = 0;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f) {
+        if (1 != fscanf(f, "%zu", &max))
+            max = 0;
+        fclose(f);
+    }
+    if (max && size > max)
+        size = max;
+    pipe_size = size > INT_MAX ? INT_MAX : (int)size;
+}
+
+/**
+ * `pipe2` with `O_CLOEXEC`, resized to `pipe_size`. The pipe stays at the default size if it
+ * can not be resized, e.g. past the user's limit of the pipe pages.
+ */
+static int open_pipe(int fildes[2]) {
+    if (0 > pipe2(fildes, O_CLOEXEC))
+        return -1;
+    if (pipe_size)
+        (void)fcntl(fildes[1], F_SETPIPE_SZ, pipe_size);
+    return 0;
+}
+
+enum {
+    REDIRECT_ALIGN = 4096,
+    // The input pausing for so long writes out what is buffered
+    REDIRECT_IDLE_MS = 50,
+    // A truncated file is preallocated so many buffers ahead
+    REDIRECT_PREALLOC = 8,
+};
 
-void reap_daemonized_kids();
+void run_set_redirect_buffer(size_t size) {
+    redirect_buffer = (size + REDIRECT_ALIGN - 1) / REDIRECT_ALIGN * REDIRECT_ALIGN;
+}
 
+/// The file written by the redirect writer
+struct redirect_file {
+    const char *name;
+    int fd;
+    // A regular file: the chunks are preallocated and written back as they are done
+    bool is_regular;
+    // Preallocated up to, -1 if not to be
+    off_t allocated;
+    // The last chunk written, which is being written back
+    off_t chunk_start, chunk_end;
+};
 
-int process_sequenced_commands(struct sequenced_commands *const sc) {
+/** Append `len` bytes of `buf` to the file as a chunk. Returns `false` on error. */
+static bool redirect_flush(struct redirect_file *f, const char *buf, size_t len) {
+    if (f->allocated >= 0 && f->chunk_end + (off_t)len > f->allocated) {
+        // Not every file system can: then the writes just allocate as usual
+        off_t size = (off_t)REDIRECT_PREALLOC * redirect_buffer;
+        f->allocated = fallocate(f->fd, FALLOC_FL_KEEP_SIZE, f->chunk_end, size) == 0 ?
+                       f->chunk_end + size : -1;
+    }
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(f->fd, buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        done += n;
+    }
+    if (!f->is_regular)
+        return true;
+    // Appended, so the chunk is right before the offset
+    off_t end = lseek(f->fd, 0, SEEK_CUR);
+    if (end < 0)
+        return true;
+    // The previous chunk has had the time of this one to get to the disk: wait for the rest and
+    // drop it from the page cache. This one is only started
+    if (f->chunk_end > f->chunk_start) {
+        off_t prev_len = f->chunk_end - f->chunk_start;
+        (void)sync_file_range(f->fd, f->chunk_start, prev_len, SYNC_FILE_RANGE_WAIT_BEFORE |
+                              SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        (void)posix_fadvise(f->fd, f->chunk_start, prev_len, POSIX_FADV_DONTNEED);
+    }
+    f->chunk_start = end - (off_t)len;
+    f->chunk_end = end;
+    (void)sync_file_range(f->fd, f->chunk_start, len, SYNC_FILE_RANGE_WRITE);
+    return true;
+}
+
+/**
+ * The writer stage of a redirect to `name`, in a forked child of the shell: copies the stdin to
+ * the stdout, which is the file, through a buffer of `redirect_buffer` bytes. It is written out
+ * when full, at the end of the input, and when the input pauses for `REDIRECT_IDLE_MS`.
+ */
+__attribute__((noreturn)) static void redirect_writer(const char *name, bool is_append) {
+    struct stat st;
+    struct redirect_file f = {.name = name, .fd = STDOUT_FILENO, .allocated = -1};
+    f.is_regular = fstat(f.fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (f.is_regular) {
+        f.chunk_start = f.chunk_end = st.st_size;
+        // What is preallocated past the end is given back in the end, which would be racy
+        // with the other writers of an appended file
+        if (!is_append)
+            f.allocated = 0;
+    }
+    // Aligned for the device, or a single page if out of memory
+    static char page[REDIRECT_ALIGN] __attribute__((aligned(REDIRECT_ALIGN)));
+    char *buf = aligned_alloc(REDIRECT_ALIGN, redirect_buffer);
+    size_t capacity = buf ? redirect_buffer : sizeof (page);
+    if (!buf)
+        buf = page;
+
+    size_t used = 0;
+    bool is_ok = true;
+    while (is_ok) {
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        if (used > 0 && poll(&pfd, 1, REDIRECT_IDLE_MS) == 0) {
+            is_ok = redirect_flush(&f, buf, used);
+            used = 0;
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, buf + used, capacity - used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+        if (used == capacity) {
+            is_ok = redirect_flush(&f, buf, used);
+            used = 0;
+        }
+    }
+    if (is_ok && used > 0)
+        is_ok = redirect_flush(&f, buf, used);
+    if (!is_ok) {
+        fprintf(stderr, "Failed to write to %s: %s\n", name, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    // Truncating to the same size gives back the blocks preallocated past it
+    if (f.allocated > f.chunk_end)
+        (void)ftruncate(f.fd, f.chunk_end);
+    _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start the writer stage for the redirect of `pc` to `file_fd` (see `redirect_writer`), setting
+ * `*pid`. Returns the pipe to write to instead, which takes the ownership of `file_fd`, or
+ * `file_fd` itself if the writer could not be started.
+ */
+static int start_redirect_writer(const struct piped_commands *pc, int file_fd, pid_t *pid) {
+    int fildes[2];
+    if (0 > open_pipe(fildes))
+        return file_fd;
+    fflush(stdout);  // Not to be written by the child too
+    *pid = fork();
+    if (*pid == 0) {
+        // Nothing of the shell is held open, e.g. the read end of the previous stage
+        if (0 > dup2(fildes[0], STDIN_FILENO) || 0 > dup2(file_fd, STDOUT_FILENO))
+            die("Failed to dup2 for the redirect to %s: %s\n", pc->outfile, strerror(errno));
+        (void)syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+        redirect_writer(pc->outfile, pc->append);
+    }
+    (void)close(fildes[0]);
+    if (*pid < 0) {
+        (void)close(fildes[1]);
+        return file_fd;
+    }
+    (void)close(file_fd);
+    return fildes[1];
+}
+
+/**
+ * Run commands with output piped into each other, just like `fork_piped_commands`, but
+ * spawn them right from the shell with `posix_spawnp`. It does not copy the address space
+ * of the shell (it is a `vfork` inside), and the pipes and the redirect are wired by the
+ * file actions. The stages are children of the shell, as with `fork_piped_commands`.
+ *
+ * The builtins (see builtins.h) are not spawned but run by the shell, after the other stages
+ * have been started: so a builtin writing to a pipe does not wait for a reader which is not
+ * there yet. They do not read their input, like the real ones, so their pipe ends are closed.
+ *
+ * With `run_set_redirect_buffer`, the redirect of the last stage goes through a writer stage,
+ * which is waited for along with it.
+ *
+ * If `job` is `NULL`, the stages are waited for, and `*exit_status` is set to the status of the last
+ * one. A stage which could not be started counts as failed, like the one which failed
+ * to `exec` in `run_stage`. The resources used are added to `usage`. Returns
+ * `false` if out of memory, having started nothing.
+ */
+static bool spawn_piped_commands(const struct piped_commands *pc,
+                                 const struct sequenced_commands *job, int *exit_status,
+                                 struct pipeline_usage *usage) {
+    size_t count = 0;
+    for (const struct piped_commands *cur = pc; cur; cur = cur->next)
+        ++count;
+    struct stage *stages = malloc(count * sizeof (*stages));
+    if (!stages)
+        return false;
+
+    const struct piped_commands *head = pc;
+    double start = profile_now();
+    int in_fd = -1;  // Read end of the pipe from the previous stage
+    pid_t writer = -1;  // The writer stage of the redirect, if any
+    for (size_t i = 0; i < count; ++i, pc = pc->next) {
+        struct stage *stage = &stages[i];
+        *stage = (struct stage){.name = pc->argv[0], .pid = -1, .builtin = find_builtin(pc->argv, job != NULL),
+                                .out_fd = -1};
+        int fildes[2] = {-1, -1};
+        int out_fd = -1;
+        if (pc->next && is_cat_of_file(pc->argv)) {
+            // The next stage reads the file itself: no `cat` and no pipe copying it. If it
+            // can not be opened, the builtin reports it
+            int fd = open(pc->argv[1], O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                stage->builtin = NULL;
+                if (in_fd >= 0)
+                    (void)close(in_fd);
+                in_fd = fd;
+                continue;
+            }
+        }
+        if (pc->next) {
+            if (0 > open_pipe(fildes)) {
+                // Neither this stage nor the next ones are started
+                fprintf(stderr, "Failed to open pipe: %s\n", strerror(errno));
+                count = i + 1;
+            }
+            out_fd = fildes[1];
+        } else if (pc->outfile) {
+            out_fd = open(pc->outfile,
+                          O_CREAT | (pc->append ? O_APPEND : O_TRUNC) | O_WRONLY | O_CLOEXEC,
+                          S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+            if (out_fd < 0) {
+                fprintf(stderr, "Failed to open file %s: %s\n", pc->outfile, strerror(errno));
+            } else if (redirect_buffer && !stage->builtin) {
+                out_fd = start_redirect_writer(pc, out_fd, &writer);
+            }
+        }
+
+        if (stage->builtin) {
+            if (out_fd >= 0 || (!pc->next && !pc->outfile)) {
+                stage->out_fd = out_fd;
+                out_fd = -1;  // Left open for the builtin
+            } else {
+                stage->builtin = NULL;  // Not to be run: the output is not there
+            }
+        } else if (out_fd >= 0 || (!pc->next && !pc->outfile)) {
+            posix_spawn_file_actions_t actions;
+            int err = posix_spawn_file_actions_init(&actions);
+            if (!err && in_fd >= 0)
+                err = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+            if (!err && out_fd >= 0)
+                err = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+            const char *path = err ? NULL : path_cache_lookup(pc->argv[0]);
+            if (path) {
+                err = posix_spawn(&stage->pid, path, &actions, NULL, pc->argv, environ);
+                if (err)
+                    path_cache_forget(pc->argv[0]);  // And search again
+            }
+            if (!path || err)
+                err = posix_spawnp(&stage->pid, pc->argv[0], &actions, NULL, pc->argv, environ);
+            if (err) {
+                fprintf(stderr, "Failed to exec %s: %s\n", pc->argv[0], strerror(err));
+                stage->pid = -1;
+            }
+            posix_spawn_file_actions_destroy(&actions);
+        }
+
+        // The ends given to the stage are not needed in the shell anymore
+        if (in_fd >= 0)
+            (void)close(in_fd);
+        if (out_fd >= 0)
+            (void)close(out_fd);
+        in_fd = fildes[0];
+    }
+
+    pc = head;
+    for (size_t i = 0; i < count; ++i, pc = pc->next) {
+        struct stage *stage = &stages[i];
+        if (!stage->builtin)
+            continue;
+        int out_fd = stage->out_fd >= 0 ? stage->out_fd : STDOUT_FILENO;
+        // The shell's own time is the builtin's. Its memory is the shell's, which is not counted
+        struct rusage before, after, ru = {};
+        (void)getrusage(RUSAGE_SELF, &before);
+        double builtin_start = profile_now();
+        stage->status = run_builtin(stage->builtin, pc->argv, out_fd);
+        (void)getrusage(RUSAGE_SELF, &after);
+        timersub(&after.ru_utime, &before.ru_utime, &ru.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &ru.ru_stime);
+        pipeline_usage_add(usage, &ru);
+        if (profile_is_enabled())
+            profile_record(stage->name, profile_now() - builtin_start, &ru);
+        if (stage->out_fd >= 0)
+            (void)close(stage->out_fd);
+    }
+
+    if (!job) {
+        wait_stages(stages, count, exit_status, start, usage);
+        // Done right after the last stage, as it is the writer's end of the input
+        if (writer >= 0)
+            reap_stage("redirect", writer, NULL, start, usage);
+    } else {
+        // The writer is a stage of the job too, before the last one which the status is of
+        size_t total = count + (writer >= 0);
+        pid_t *pids = malloc(total * sizeof (*pids));
+        int status = stages[count - 1].builtin ? stages[count - 1].status : EXIT_FAILURE << 8;
+        for (size_t i = 0; i < count; ++i) {
+            if (pids)
+                pids[i] = stages[i].pid;
+            else if (stages[i].pid >= 0)
+                (void)waitpid(stages[i].pid, NULL, 0);  // Can not be tracked, wait right away
+        }
+        if (pids && writer >= 0) {
+            pids[count] = pids[count - 1];
+            pids[count - 1] = writer;
+        } else if (writer >= 0) {
+            (void)waitpid(writer, NULL, 0);
+        }
+        if (pids)
+            jobs_add(job, pids, total, status);
+        free(pids);
+    }
+    free(stages);
+    return true;
+}
+
+/**
+ * Run `pc` in forked children of the shell, a stage each (see `run_stage`). The shell forks
+ * them all one after another, making the pipe to the next stage right before, so at most two
+ * pipe ends are open in it. If `job` is `NULL`, the stages are waited for, `*exit_status` is set
+ * to the status of the last one, and the resources used are added to `usage`. Otherwise they are
+ * added to the job table as `job`. Returns `false` if failed to start. Allocates nothing on
+ * the heap, as it is the fallback for when the memory is over.
+ */
+static bool fork_piped_commands(struct piped_commands *pc, const struct sequenced_commands *job,
+                                int *exit_status, struct pipeline_usage *usage) {
+    size_t count = 0;
+    for (const struct piped_commands *cur = pc; cur; cur = cur->next)
+        ++count;
+    pid_t pids[count];
+
+    double start = profile_now();
+    fflush(stdout);  // Not to be written by the children too
+    bool is_ok = true;
+    int in_fd = -1;  // Read end of the pipe from the previous stage
+    const struct piped_commands *cur = pc;
+    for (size_t i = 0; i < count; ++i, cur = cur->next) {
+        int fildes[2] = {-1, -1};
+        pids[i] = -1;
+        if (is_ok && cur->next && 0 > open_pipe(fildes)) {
+            fprintf(stderr, "Failed to open pipe: %s\n", strerror(errno));
+            is_ok = false;
+        }
+        if (is_ok) {
+            pids[i] = fork();
+            if (pids[i] == 0)
+                run_stage(cur, in_fd, fildes[1]);
+            if (pids[i] < 0) {
+                fprintf(stderr, "Couldn't fork\n");
+                is_ok = false;
+            }
+        }
+        // The ends given to the stage are not needed in the shell anymore
+        if (in_fd >= 0)
+            (void)close(in_fd);
+        if (fildes[1] >= 0)
+            (void)close(fildes[1]);
+        in_fd = fildes[0];
+    }
+
+    if (!is_ok)
+        *exit_status = EXITSTATUS_BEDA;
+    if (job) {
+        jobs_add(job, pids, count, EXITSTATUS_BEDA);
+    } else {
+        cur = pc;
+        for (size_t i = 0; i < count; ++i, cur = cur->next) {
+            if (pids[i] >= 0)
+                reap_stage(cur->argv[0], pids[i], i == count - 1 ? exit_status : NULL, start, usage);
+        }
+    }
+    return is_ok;
+}
+
+/**
+ * Run the and-or list from `sc` to `end`, which is followed by `&`, in the background: in a forked
+ * shell, which is a single job. Returns `false` if failed to start.
+ */
+static bool fork_sequenced_commands(struct sequenced_commands *sc, struct sequenced_commands *end,
+                                    struct arena *arena) {
+    fflush(stdout);  // Not to be written by both
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Couldn't fork\n");
+        return false;
+    } else if (pid == 0) {
+        // The jobs of the shell are not the children of this one
+        jobs_forget();
+        end->next = NULL;
+        end->run_next = UNCONDITIONAL;
+        int status = process_sequenced_commands(sc, arena);
+        if (WIFEXITED(status))
+            exit(WEXITSTATUS(status));
+        exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : EXIT_FAILURE);
+    }
+    jobs_add(sc, &pid, 1, EXITSTATUS_BEDA);
+    return true;
+}
+
+int process_sequenced_commands(struct sequenced_commands *const sc, struct arena *arena) {
     int exit_status = EXITSTATUS_DEFAULT;
+    path_cache_tick();
     enum sequencing_type run_next = UNCONDITIONAL;
 
     struct sequenced_commands *sc_cur = sc;
@@ -175,67 +688,57 @@ int process_sequenced_commands(struct sequenced_commands *const sc) {
                 (!success && run_next == SKIP_FAILURE))
             continue;
 
-        if (handle_special(sc_cur->p_head)) {
-            // `sc_cur->p_head` was a special command (e.g. cd or exit) - we performed
-            // it in `handle_special`. Nothing else to do.
+        // `&` puts to the background the whole and-or list before it
+        struct sequenced_commands *end = sc_cur;
+        while ((end->run_next == SKIP_SUCCESS || end->run_next == SKIP_FAILURE) && end->next)
+            end = end->next;
+        if (end != sc_cur && end->run_next == NOWAIT) {
+            jobs_reserve();  // Within the limit of the jobs at once
+            if (!fork_sequenced_commands(sc_cur, end, arena))
+                break;
+            sc_cur = end;
             continue;
         }
 
-        // Children will write their pids into this pipe, I will wait for them.
-        // It would not be safe to just do the correct number of `wait`s, as the
-        // children (after `exec`) may create new siblings, which will turn to my
-        // children, which would lead to a mess.
-        //
-        // Instead, before children `exec`, they write their pid to the stream,
-        // I read it from here and reap them.
-        int children_pids_pipe[2];
-        if (run_next == NOWAIT) {
-            children_pids_pipe[0] = children_pids_pipe[1] = -1;
-        } else {
-            int err = pipe(children_pids_pipe);
-            if(err) {
-                fprintf(stderr, "Failed to pipe: %s\n", strerror(errno));
-                exit_status = EXITSTATUS_BEDA;
-                goto handle_out;
-            }
+        struct piped_commands *pc = sc_cur->p_head;
+        struct expand_cache dirs = {.arena = arena};
+        const char *expand_err = expand_pipeline(pc, &dirs);
+        if (expand_err) {
+            fprintf(stderr, "%s\n", expand_err);
+            exit_status = EXIT_FAILURE << 8;
+            continue;
         }
-
-        pid_t res = fork();
-        switch (res) {
-            case 0:
-                // Child
-                process_piped_commands(sc_cur->p_head, children_pids_pipe[1]);
-                // Won't return
-                assert(false);
-            case -1:
-                fprintf(stderr, "Couldn't fork\n");
-                exit_status = EXITSTATUS_BEDA;
-                goto handle_out;
+        // The `time` keyword: report the resources of the pipeline after it
+        bool is_timed = !strcmp(pc->argv[0], "time") && (pc->_argc > 1 || !pc->next);
+        if (is_timed) {
+            ++pc->argv;
+            --pc->_argc;
         }
+        struct pipeline_usage usage = {};
+        double start = profile_now();
 
-        if (run_next != NOWAIT) {
-            int err = close(children_pids_pipe[1]);
-            assert(!err);  // If failed to close, will self-deadlock below
+        const struct sequenced_commands *job = sc_cur->run_next == NOWAIT ? sc_cur : NULL;
+        if (job)
+            jobs_reserve();
 
-            pid_t child;
-            size_t readb;
-            while (0 != (readb = read(children_pids_pipe[0], &child, sizeof child))) {
-                assert(readb == sizeof child);  // Expect no errors to occur
-                int res = waitpid(child, &exit_status, 0);
-                assert(res > 0);
-            }
-            (void)close(children_pids_pipe[0]);
+        // `time` alone times nothing
+        bool is_ok = true;
+        if (!pc->_argc) {
+            exit_status = EXITSTATUS_DEFAULT;
+        } else if (handle_special(pc, &exit_status)) {
+            // `pc` was a special command (e.g. cd or exit) - we performed
+            // it in `handle_special`. Nothing else to do.
+        } else if (needs_fork(pc) ||
+                   // Out of memory for the spawn, try the fork, which needs no memory of its own
+                   !spawn_piped_commands(pc, job, &exit_status, &usage)) {
+            is_ok = fork_piped_commands(pc, job, &exit_status, &usage);
         }
-    }
 
-handle_out:
-    destroy_sequenced_commands(sc);
-
-    reap_daemonized_kids();
+        if (is_timed)
+            pipeline_usage_print(&usage, profile_now() - start);
+        if (!is_ok)
+            break;
+    }
 
     return exit_status;
 }
-
-void reap_daemonized_kids() {
-    while (0 < waitpid(0, NULL, WNOHANG));
-}
@@ -1,8 +1,32 @@
 #pragma once
 
+#include <stddef.h>
 #include <sys/types.h>
 
+#include "arena.h"
 #include "parse_command.h"
 
-int process_sequenced_commands(struct sequenced_commands *sc);
-void process_piped_commands(const struct piped_commands *pc, int write_my_pid_fd);
+/**
+ * Run the command line `sc`, expanding the words of each pipeline right before it is run (see
+ * expand.h) in `arena`, the one of the command. Returns the status of the last pipeline run.
+ */
+int process_sequenced_commands(struct sequenced_commands *sc, struct arena *arena);
+
+/**
+ * Write the redirects of the spawned pipelines through a writer stage with a buffer of `size`
+ * bytes (rounded up to a page), 0 for none: the last command writes to a pipe, and a child of
+ * the shell writes the file in big aligned chunks, preallocating it ahead with `fallocate`,
+ * starting the writeback of each chunk with `sync_file_range` and dropping it from the page
+ * cache after the next one. So a pipeline writing gigabytes does not fill the page cache with
+ * dirty pages. What is buffered is written out as soon as the input pauses. The builtins and
+ * the stages run in the forked shell write to the file directly.
+ */
+void run_set_redirect_buffer(size_t size);
+
+/**
+ * Make the pipes between the stages of the pipelines `size` bytes big (the kernel rounds it up to
+ * a power of two pages), 0 for the default 64 KiB. It is capped by `/proc/sys/fs/pipe-max-size`.
+ * A pipeline moving a lot of data then switches between its stages once per so many bytes, not
+ * per 64 KiB.
+ */
+void run_set_pipe_size(size_t size);
@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "script_cache.h"
+#include "errors.h"
+
+/*
+ * The cache file is the header and the commands, as a stream of 32-bit words in the native byte
+ * order (the cache is local). A command is
+ *
+ *     tag                    0 for a command, otherwise the number of the parse error
+ *     sequenced count        then each of them:
+ *         run_next
+ *         piped count        then each of them:
+ *             argc
+ *             flags          REDIRECT_*, EXPAND_WORDS
+ *             argc strings, then outfile if redirected
+ *
+ * where a string is its length, the characters and '\0', padded to a word. The checksum of
+ * the header covers the commands: so a damaged file is not used, and they are read unchecked.
+ */
+
+enum {
+    CACHE_VERSION = 2,
+    CACHE_BUF_MIN = 4096,
+    CACHE_TAG_COMMAND = 0,
+    REDIRECT_TO_FILE = 1,
+    REDIRECT_APPEND = 2,
+    EXPAND_WORDS = 4,
+};
+
+static const char cache_magic[8] = "shpcache";
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t script_size;
+    uint64_t script_hash;
+    uint64_t checksum;
+};
+
+/// The parse errors which may be stored, by their tags, starting from 1
+static const char *const cache_errors[] = {
+    err_trailing_backslash, err_unclosed_quot, err_trailing_redir, err_invalid_filename,
+    err_invalid_operator, err_argless_command,
+};
+
+/// FNV-1a, over 64-bit words rather than bytes: the script is hashed on each run
+static uint64_t cache_hash(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + sizeof (uint64_t) <= size; i += sizeof (uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    return hash;
+}
+
+/// The path of the cache file of `c`, allocated
+static char *cache_path(const struct script_cache *c) {
+    char *path;
+    if (0 > asprintf(&path, "%s/%016llx.cache", c->dir, (unsigned long long)c->script_hash))
+        return NULL;
+    return path;
+}
+
+/// Map the cache file of `c`, if it is there and valid
+static bool cache_map(struct script_cache *c) {
+    char *path = cache_path(c);
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    char *data = MAP_FAILED;
+    if (0 == fstat(fd, &st) && (size_t)st.st_size >= sizeof (struct cache_header)) {
+        // Writable for the commands to be built right on it: the copy is private
+        data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    (void)close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const struct cache_header *header = (const struct cache_header *)data;
+    size_t size = st.st_size;
+    if (memcmp(header->magic, cache_magic, sizeof cache_magic) || header->version != CACHE_VERSION ||
+            header->script_size != c->script_size || header->script_hash != c->script_hash ||
+            header->checksum != cache_hash(data + sizeof (*header), size - sizeof (*header))) {
+        (void)munmap(data, size);
+        return false;
+    }
+    c->data = data;
+    c->size = c->capacity = size;
+    c->is_mapped = true;
+    return true;
+}
+
+/// Append `size` bytes of `src` to `c`, padded to a word
+static bool cache_put(struct script_cache *c, const void *src, size_t size) {
+    size_t padded = (size + 3) & ~(size_t)3;
+    if (c->size + padded > c->capacity) {
+        size_t capacity = c->capacity ? c->capacity : CACHE_BUF_MIN;
+        while (capacity < c->size + padded)
+            capacity *= 2;
+        char *data = realloc(c->data, capacity);
+        if (!data)
+            return false;
+        c->data = data;
+        c->capacity = capacity;
+    }
+    memcpy(c->data + c->size, src, size);
+    memset(c->data + c->size + size, 0, padded - size);
+    c->size += padded;
+    return true;
+}
+
+static bool cache_put_u32(struct script_cache *c, uint32_t value) {
+    return cache_put(c, &value, sizeof value);
+}
+
+static bool cache_put_str(struct script_cache *c, const char *s) {
+    size_t len = strlen(s);
+    return cache_put_u32(c, (uint32_t)len) && cache_put(c, s, len + 1);
+}
+
+bool script_cache_open(struct script_cache *c) {
+    *c = (struct script_cache){.dir = getenv("SHELL_PARSE_CACHE")};
+    if (!c->dir || !*c->dir)
+        return false;
+    // The whole script must be there: a regular file, not read yet
+    struct stat st;
+    if (0 > fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+            0 != lseek(STDIN_FILENO, 0, SEEK_CUR))
+        return false;
+    char *script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (script == MAP_FAILED)
+        return false;
+    c->script_size = st.st_size;
+    c->script_hash = cache_hash(script, st.st_size);
+    (void)munmap(script, st.st_size);
+
+    if (cache_map(c)) {
+        // As if read, like when it is parsed
+        (void)lseek(STDIN_FILENO, 0, SEEK_END);
+    } else if (!cache_put(c, &(struct cache_header){}, sizeof (struct cache_header))) {
+        // The header is filled in on save
+        return false;
+    }
+    c->pos = sizeof (struct cache_header);
+    return true;
+}
+
+bool script_cache_add(struct script_cache *c, const struct parse_result *res) {
+    if (res->err) {
+        for (size_t i = 0; i < sizeof cache_errors / sizeof (*cache_errors); ++i) {
+            if (res->err == cache_errors[i])
+                return cache_put_u32(c, (uint32_t)i + 1);
+        }
+        return false;  // Out of memory, it is not the result of the script
+    }
+
+    uint32_t s_count = 0;
+    for (const struct sequenced_commands *sc = &res->s_head; sc; sc = sc->next)
+        ++s_count;
+    if (!cache_put_u32(c, CACHE_TAG_COMMAND) || !cache_put_u32(c, s_count))
+        return false;
+    for (const struct sequenced_commands *sc = &res->s_head; sc; sc = sc->next) {
+        uint32_t p_count = 0;
+        for (const struct piped_commands *pc = sc->p_head; pc; pc = pc->next)
+            ++p_count;
+        if (!cache_put_u32(c, sc->run_next) || !cache_put_u32(c, p_count))
+            return false;
+        for (const struct piped_commands *pc = sc->p_head; pc; pc = pc->next) {
+            uint32_t flags = (pc->outfile ? REDIRECT_TO_FILE : 0) | (pc->append ? REDIRECT_APPEND : 0) |
+                             (pc->needs_expand ? EXPAND_WORDS : 0);
+            if (!cache_put_u32(c, pc->_argc) || !cache_put_u32(c, flags))
+                return false;
+            for (int i = 0; i < pc->_argc; ++i) {
+                if (!cache_put_str(c, pc->argv[i]))
+                    return false;
+            }
+            if (pc->outfile && !cache_put_str(c, pc->outfile))
+                return false;
+        }
+    }
+    return true;
+}
+
+void script_cache_save(struct script_cache *c) {
+    struct cache_header *header = (struct cache_header *)c->data;
+    *header = (struct cache_header){.version = CACHE_VERSION, .script_size = c->script_size,
+                                    .script_hash = c->script_hash,
+                                    .checksum = cache_hash(c->data + sizeof (*header), c->size - sizeof (*header))};
+    memcpy(header->magic, cache_magic, sizeof cache_magic);
+
+    // Written aside and renamed: a concurrent run never sees a part of it
+    char *path = cache_path(c), *tmp_path = NULL;
+    if (!path || 0 > asprintf(&tmp_path, "%s.XXXXXX", path)) {
+        free(path);
+        fprintf(stderr, "Failed to save the parse cache: %s\n", strerror(ENOMEM));
+        return;
+    }
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    bool is_ok = fd >= 0;
+    for (size_t written = 0; is_ok && written < c->size; ) {
+        ssize_t n = write(fd, c->data + written, c->size - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        is_ok = n > 0;
+        written += is_ok ? (size_t)n : 0;
+    }
+    if (fd >= 0 && 0 > close(fd))
+        is_ok = false;
+    if (is_ok && 0 > rename(tmp_path, path))
+        is_ok = false;
+    if (!is_ok) {
+        fprintf(stderr, "Failed to save the parse cache %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            (void)unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(path);
+}
+
+static uint32_t cache_get_u32(struct script_cache *c) {
+    uint32_t value;
+    memcpy(&value, c->data + c->pos, sizeof value);
+    c->pos += sizeof value;
+    return value;
+}
+
+static char *cache_get_str(struct script_cache *c) {
+    size_t len = cache_get_u32(c);
+    char *s = c->data + c->pos;
+    c->pos += (len + 1 + 3) & ~(size_t)3;
+    return s;
+}
+
+struct parse_result script_cache_next(struct script_cache *c, struct arena *arena) {
+    if (c->pos >= c->size)
+        return (struct parse_result){.err = err_input_is_over};
+    uint32_t tag = cache_get_u32(c);
+    if (tag != CACHE_TAG_COMMAND)
+        return (struct parse_result){.err = cache_errors[tag - 1]};
+
+    // Out of memory, the rest of the command is still read to get to the next one
+    bool is_oom = false;
+    struct parse_result res = {};
+    struct sequenced_commands *sc = &res.s_head;
+    uint32_t s_count = cache_get_u32(c);
+    for (uint32_t i = 0; i < s_count; ++i) {
+        if (i > 0 && !is_oom) {
+            struct sequenced_commands *next = arena_alloc(arena, sizeof (*next));
+            if (next)
+                sc = sc->next = next;
+            is_oom = !next;
+        }
+        enum sequencing_type run_next = cache_get_u32(c);
+        uint32_t p_count = cache_get_u32(c);
+        struct piped_commands **link = &sc->p_head;
+        if (!is_oom)
+            *sc = (struct sequenced_commands){.run_next = run_next};
+        for (uint32_t j = 0; j < p_count; ++j) {
+            int argc = (int)cache_get_u32(c);
+            uint32_t flags = cache_get_u32(c);
+            struct piped_commands *pc = is_oom ? NULL : arena_alloc(arena, sizeof (*pc));
+            char **argv = pc ? arena_alloc(arena, (argc + 1) * sizeof (*argv)) : NULL;
+            is_oom = !argv;
+            for (int k = 0; k < argc; ++k) {
+                char *arg = cache_get_str(c);
+                if (!is_oom)
+                    argv[k] = arg;
+            }
+            char *outfile = flags & REDIRECT_TO_FILE ? cache_get_str(c) : NULL;
+            if (is_oom)
+                continue;
+            argv[argc] = NULL;
+            *pc = (struct piped_commands){.argv = argv, ._argc = argc, .outfile = outfile,
+                                          .append = flags & REDIRECT_APPEND,
+                                          .needs_expand = flags & EXPAND_WORDS};
+            *link = pc;
+            link = &pc->next;
+        }
+    }
+    return is_oom ? (struct parse_result){.err = err_oom} : res;
+}
+
+void script_cache_close(struct script_cache *c) {
+    if (c->is_mapped)
+        (void)munmap(c->data, c->size);
+    else
+        free(c->data);
+    *c = (struct script_cache){};
+}
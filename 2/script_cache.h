@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "parse_command.h"
+
+/*
+ * A cache of the parsed scripts, for the ones run again and again. With `SHELL_PARSE_CACHE=DIR`
+ * the commands of a script are parsed once and stored serialized in DIR, in a file named by
+ * the hash of the script. The next run of the same script maps that file and builds the
+ * commands right from it, the script is not parsed. A changed script has another hash, so
+ * the cache file of the old one is just not used anymore.
+ *
+ * Only a script given as a regular file on stdin (`shell < script`) is cached. It is then
+ * parsed as a whole before the first command is run, the parse errors are stored as well:
+ * so the commands run from the cache in the same order either way.
+ */
+
+/// The serialized commands of a script: mapped from the cache file, or just parsed
+struct script_cache {
+    char *data;
+    size_t size, capacity;
+    size_t pos;  // Of the next command to read
+    bool is_mapped;
+    const char *dir;
+    uint64_t script_hash;
+    uint64_t script_size;
+};
+
+/**
+ * Look the script on stdin up in the cache. Returns `false` if it shall not be cached. Otherwise
+ * `c` either has the commands from the cache (`c->is_mapped`, and stdin is read to its end),
+ * or is empty: then the commands shall be added with `script_cache_add` and saved with
+ * `script_cache_save`.
+ */
+bool script_cache_open(struct script_cache *c);
+
+/** Append the parsed command `res` (or its error) to `c`. Returns `false` if out of memory. */
+bool script_cache_add(struct script_cache *c, const struct parse_result *res);
+
+/**
+ * Write `c` to the cache directory, for the next runs. Even if failed (it is reported), `c`
+ * remains usable.
+ */
+void script_cache_save(struct script_cache *c);
+
+/**
+ * The next command of `c`, allocated in `arena` like `parse_command_line` does: the words point
+ * to the data of `c`. `err_input_is_over` after the last one.
+ */
+struct parse_result script_cache_next(struct script_cache *c, struct arena *arena);
+
+/** Free or unmap the commands. */
+void script_cache_close(struct script_cache *c);
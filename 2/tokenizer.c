@@ -1,134 +1,312 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
-#include <stdio.h>
-#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "tokenizer.h"
+#include "errors.h"
+
+const unsigned char char_classes[256] = {
+    ['\0'] = CHAR_END,
+    [' '] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\n'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\v'] = CHAR_SPACE,
+    ['>'] = CHAR_OPERATOR, ['|'] = CHAR_OPERATOR, ['&'] = CHAR_OPERATOR, [';'] = CHAR_OPERATOR,
+    ['"'] = CHAR_QUOTE, ['\''] = CHAR_QUOTE,
+    ['\\'] = CHAR_BACKSLASH,
+    ['*'] = CHAR_EXPAND, ['?'] = CHAR_EXPAND, ['['] = CHAR_EXPAND, ['$'] = CHAR_EXPAND,
+};
+
+/// The mark of each character of `CHAR_EXPAND` outside of quotes
+static const char expand_marks[256] = {
+    ['*'] = MARK_STAR, ['?'] = MARK_QUESTION, ['['] = MARK_BRACKET, ['$'] = MARK_VAR,
+};
+
+/*
+ * The runs of the characters which are just copied (the usual ones outside of quotes, anything
+ * but the quotation mark, the backslash and the `$` of double quotes inside of them) are found a vector at a time:
+ * a bit mask of the characters ending the run is computed for a whole block. The blocks are
+ * aligned, so a block never crosses a page boundary, and reading past the end of the string
+ * is safe. Without SSE2 or NEON, the characters are checked one by one.
+ */
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+enum { SCAN_BLOCK = 16 };
+
+// The reads past the end of the string are deliberate
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address))
+
+#if defined(__SSE2__)
+// A bit per character
+enum { SCAN_MASK_BITS = 1 };
+typedef __m128i scan_vec;
 
-bool is_word_separator(char c) {
-    return (bool)strchr(WHITESPACE COMMAND_SPECIAL, c);
+inline static scan_vec scan_eq(scan_vec x, char c) {
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(c));
 }
 
-bool is_cm_special(char c) {
-    return c && (bool)strchr(COMMAND_SPECIAL, c);
+inline static scan_vec scan_or(scan_vec a, scan_vec b) {
+    return _mm_or_si128(a, b);
 }
 
-static bool is_special(char c) {
-    return is_cm_special(c) || c == '\'' || c == '"' || c == '\\';
+/// The bytes from '\t' to '\r', which are the whitespace together with ' '
+inline static scan_vec scan_is_tab_to_cr(scan_vec x) {
+    scan_vec d = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8('\r' - '\t')), d);
 }
 
-bool escape_and_color(char *const original, char *const color) {
-    // Invariant: `write <= read`. In case of backslash, the string
-    // is "shifted" back (and the corresponding char is colored).
-    int read = 0, write = 0;
-    char in_quot = '\0';
-    for (; original[read]; ++read, ++write) {
-        // So damn sad that I had to make `escape_and_color` quotation aware :(
-        if (original[read] == in_quot)
-            in_quot = '\0';
-        else if (!in_quot && (original[read] == '\'' || original[read] == '"'))
-            in_quot = original[read];
+SCAN_NO_SANITIZE inline static scan_vec scan_load(const char *p) {
+    return _mm_load_si128((const __m128i *)p);
+}
 
-        if (original[read] == '\\') {
-            if (!original[read + 1]) {
-                color[write] = '\0';  // Make sure when the string is restored this is not overwritten
-                return false;
-            }
+inline static uint64_t scan_bits(scan_vec m) {
+    return (unsigned)_mm_movemask_epi8(m);
+}
+#else
+// NEON has no byte mask: narrowing by 4 bits keeps a nibble per character
+enum { SCAN_MASK_BITS = 4 };
+typedef uint8x16_t scan_vec;
 
-            // Additional complication here: if inside a quotation and the following character
-            // is not special, then both backslash and that character shall be preserved.
-            if (!in_quot || is_special(original[read + 1]))
-                ++read;
-
-            // The actual escaped symbol is stored in `color[write]` and will
-            // be interpreted as a raw literal;
-            // In the original string the corresponding character is replaced with
-            // a placeholder. The value of the placeholder doesn't really matter,
-            // except it must not be a character treated specially by our shell.
-            color[write] = original[read];
-            original[write] = '_';
-        } else {
-            // If not a backslash, store the character as is and make sure to
-            // mark it as uncolored.
-            original[write] = original[read];
-            color[write] = '\0';
-        }
+inline static scan_vec scan_eq(scan_vec x, char c) {
+    return vceqq_u8(x, vdupq_n_u8((uint8_t)c));
+}
+
+inline static scan_vec scan_or(scan_vec a, scan_vec b) {
+    return vorrq_u8(a, b);
+}
+
+inline static scan_vec scan_is_tab_to_cr(scan_vec x) {
+    return vcleq_u8(vsubq_u8(x, vdupq_n_u8('\t')), vdupq_n_u8('\r' - '\t'));
+}
+
+SCAN_NO_SANITIZE inline static scan_vec scan_load(const char *p) {
+    return vld1q_u8((const uint8_t *)p);
+}
+
+inline static uint64_t scan_bits(scan_vec m) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+#endif
+
+/// Mask of the characters of the block `p` ending a run: see `lexer_span`
+SCAN_NO_SANITIZE inline static uint64_t scan_block(const char *p, char quot) {
+    scan_vec x = scan_load(p);
+    scan_vec m = scan_or(scan_eq(x, '\0'), scan_eq(x, '\\'));
+    if (quot == '"')
+        m = scan_or(m, scan_eq(x, '$'));
+    if (quot)
+        return scan_bits(scan_or(m, scan_eq(x, quot)));
+    m = scan_or(m, scan_or(scan_eq(x, ' '), scan_is_tab_to_cr(x)));
+    m = scan_or(m, scan_or(scan_eq(x, '>'), scan_eq(x, '|')));
+    m = scan_or(m, scan_or(scan_eq(x, '&'), scan_eq(x, ';')));
+    m = scan_or(m, scan_or(scan_eq(x, '"'), scan_eq(x, '\'')));
+    m = scan_or(m, scan_or(scan_eq(x, '*'), scan_eq(x, '?')));
+    m = scan_or(m, scan_or(scan_eq(x, '['), scan_eq(x, '$')));
+    return scan_bits(m);
+}
+
+/**
+ * The length of the run of characters at `s` which are copied as they are: the usual ones if
+ * `quot` is '\0', otherwise all but `quot`, the backslash, the end of string and the `$` of
+ * double quotes.
+ */
+SCAN_NO_SANITIZE static size_t lexer_span(const char *s, char quot) {
+    const char *p = (const char *)((uintptr_t)s & ~(uintptr_t)(SCAN_BLOCK - 1));
+    uint64_t mask = scan_block(p, quot) >> (s - p) * SCAN_MASK_BITS;
+    while (!mask) {
+        p += SCAN_BLOCK;
+        mask = scan_block(p, quot);
+        if (mask)
+            return p - s + __builtin_ctzll(mask) / SCAN_MASK_BITS;
+    }
+    return __builtin_ctzll(mask) / SCAN_MASK_BITS;
+}
+
+#else
+
+static size_t lexer_span(const char *s, char quot) {
+    const char *p = s;
+    if (quot) {
+        while (*p && *p != quot && *p != '\\' && (*p != '$' || quot != '"'))
+            ++p;
+    } else {
+        while (char_class(*p) == CHAR_USUAL)
+            ++p;
     }
-    original[write] = original[read];  // Copy the `\0` too
-    return true;
+    return p - s;
 }
 
-int next_token(const char *const inp) {
-    int pos = 0;
+#endif
+
+void lexer_init(struct lexer *lx, char *s) {
+    lx->out = lx->pos = s;
+    lx->cur = *s;
+    lx->word = NULL;
+}
 
-    char quot_fmt[] = "%*[^\1]%n";
-    const size_t quot = 4;
-    assert(quot_fmt[quot] == '\1');
+void lexer_resume(struct lexer *lx) {
+    lx->cur = *lx->pos;
+}
 
-    do {
-        // Try to read a non-special token
+inline static void lexer_advance(struct lexer *lx) {
+    lx->cur = *++lx->pos;
+}
+
+/**
+ * Copy the current character, which is just copied, together with the run of such characters
+ * after it (see `lexer_span`).
+ */
+inline static void lexer_copy_run(struct lexer *lx) {
+    // The characters after the current one are never overwritten yet
+    size_t n = 1 + lexer_span(lx->pos + 1, lx->quot);
+    *lx->out = lx->cur;
+    if (lx->out != lx->pos)
+        memmove(lx->out + 1, lx->pos + 1, n - 1);
+    lx->out += n;
+    lx->pos += n;
+    lx->cur = *lx->pos;
+}
 
-        int read = 0;
-        // Read symbols that are neither a whitespace nor command-special
-        // nor a quotation mark.
-        (void)sscanf(inp + pos, "%*[^\"'" WHITESPACE COMMAND_SPECIAL "]%n",
-            &read);
+/** The character after the current one. It is never overwritten yet. */
+inline static char lexer_peek(const struct lexer *lx) {
+    return lx->pos[1];
+}
+
+/**
+ * Read a word starting at the current character, unquoting and unescaping it to `lx->out`.
+ *
+ * Outside of quotes a backslash makes the next character usual. Inside of quotes it only does so
+ * for a special character (or the `$` inside of double quotes), otherwise both the backslash and
+ * that character are preserved. The characters to be expanded are marked (see above). A word
+ * is over at a whitespace, a command-special character or the end of string outside of quotes, so
+ * e.g. `123"456"789` is a single word.
+ *
+ * If the string is over in the middle of the word, it is continued on the next call.
+ */
+static const char *lexer_word(struct lexer *lx, struct token *tok) {
+    if (!lx->word) {
+        lx->word = lx->out;
+        lx->quot = '\0';
+        lx->is_quoted = false;
+        lx->has_marks = false;
+    }
+    tok->type = TOKEN_WORD;
+    tok->word = lx->word;
+    while (1) {
+        char c = lx->cur;
+        enum char_class cls = char_class(c);
+        if (lx->quot) {
+            if (c == lx->quot) {
+                lx->quot = '\0';
+                lexer_advance(lx);
+                continue;
+            }
+            if (cls == CHAR_END)
+                return err_unclosed_quot;
+            if (cls == CHAR_BACKSLASH) {
+                char next = lexer_peek(lx);
+                if (!next)
+                    return err_trailing_backslash;
+                if (char_class(next) >= CHAR_OPERATOR || (next == '$' && lx->quot == '"')) {
+                    // Escaped special character: take it literally
+                    lexer_advance(lx);
+                    c = next;
+                }
+                *lx->out++ = c;
+                lexer_advance(lx);
+                continue;
+            }
+            if (c == '$' && lx->quot == '"') {
+                *lx->out++ = MARK_VAR_QUOTED;
+                lx->has_marks = true;
+                lexer_advance(lx);
+                continue;
+            }
+            lexer_copy_run(lx);
+            continue;
+        }
 
-        // If the next character is not a quotation mark, nothing to read further
-        pos += read;
-        if (inp[pos] != '"' && inp[pos] != '\'')
+        switch (cls) {
+        case CHAR_QUOTE:
+            lx->quot = c;
+            lx->is_quoted = true;
+            lexer_advance(lx);
+            break;
+        case CHAR_BACKSLASH:
+            if (!lexer_peek(lx)) {
+                // Nothing of the word yet: the continuation starts just as a new token
+                if (lx->out == lx->word && !lx->is_quoted)
+                    lx->word = NULL;
+                return err_trailing_backslash;
+            }
+            lexer_advance(lx);
+            *lx->out++ = lx->cur;
+            lexer_advance(lx);
+            break;
+        case CHAR_USUAL:
+            lexer_copy_run(lx);
             break;
+        case CHAR_EXPAND:
+            *lx->out++ = expand_marks[(unsigned char)c];
+            lx->has_marks = true;
+            lexer_advance(lx);
+            break;
+        default:
+            // The word is over. The terminator may overwrite the current character, which is
+            // already saved in `lx->cur`
+            *lx->out++ = '\0';
+            tok->has_marks = lx->has_marks;
+            lx->word = NULL;
+            return NULL;
+        }
+    }
+}
+
+/** Read the longest sequence of command-special characters and recognize the operator. */
+static void lexer_operator(struct lexer *lx, struct token *tok) {
+    char first = lx->cur;
+    int len = 0;
+    for (; char_class(lx->cur) == CHAR_OPERATOR; ++len)
+        lexer_advance(lx);
+    bool is_double = len == 2 && lx->pos[-1] == first;
 
-        // If _is_ a quotation, read until the next quotation mark
-        quot_fmt[quot] = inp[pos];
-        ++pos;
-        read = 0;
-        int res = sscanf(inp + pos, quot_fmt, &read);
-        if (res == EOF || inp[pos + read] != quot_fmt[quot]) {
-            return -1;
+    tok->type = TOKEN_INVALID_OPERATOR;
+    if (len == 1) {
+        switch (first) {
+        case '>': tok->type = TOKEN_REDIRECT; break;
+        case '|': tok->type = TOKEN_PIPE; break;
+        case '&': tok->type = TOKEN_BACKGROUND; break;
+        case ';': tok->type = TOKEN_SEQUENCE; break;
         }
-        pos += read + 1;  // +1 for the quotation mark
-
-        // Now that we have read the stuff to the quotation, it still doesn't
-        // mean the argument is over! For example, in the command
-        // `cat 123"456"789` there's just one command-line argument to cat,
-        // according to bash. So, unless the next character is an argument
-        // separator (or the end of string), should continue parsing.
-    } while (!is_word_separator(inp[pos]));
-
-    // If we read something then this token is a literal string, just
-    // return it.
-    if (pos)
-        return pos;
-
-    // But! The current token could be special, try to scan it here.
-
-    // Try to read, modifying `pos` directly. Regardless of `sscanf`'s success,
-    // should return the position we moved to (which remains zero in case there
-    // was nothing to scan).
-    (void)sscanf(inp, "%*[" COMMAND_SPECIAL "]%n", &pos);
-    return pos;
-}
-
-int uncolor_unquote(char *const s, const char *const color) {
-    int read = 0, write = 0;
-    char current_quote = '\0';
-    for (; s[read]; ++read, ++write) {
-        if (s[read] == current_quote) {
-            current_quote = '\0';
-            ++read;
-        } else if (!current_quote && (s[read] == '"' || s[read] == '\'')) {
-            current_quote = s[read++];
+    } else if (is_double) {
+        switch (first) {
+        case '>': tok->type = TOKEN_APPEND; break;
+        case '|': tok->type = TOKEN_OR; break;
+        case '&': tok->type = TOKEN_AND; break;
         }
+    }
+}
 
-        if (!s[read])
-            break;
+const char *lexer_next(struct lexer *lx, struct token *tok) {
+    if (lx->word)
+        return lexer_word(lx, tok);
+
+    while (char_class(lx->cur) == CHAR_SPACE)
+        lexer_advance(lx);
 
-        if (color[read])
-            s[write] = color[read];
-        else
-            s[write] = s[read];
+    switch (char_class(lx->cur)) {
+    case CHAR_END:
+        tok->type = TOKEN_END;
+        return NULL;
+    case CHAR_OPERATOR:
+        lexer_operator(lx, tok);
+        return NULL;
+    default:
+        return lexer_word(lx, tok);
     }
-    s[write] = s[read];  // Copy the last '\0' too
-    return read - write;
 }
@@ -12,70 +12,104 @@
  * high-level special symbols are referred to as _command-special_.
  *
  * Parser-special symbols are: backalsh (\) and quotation marks (" or ').
- * Command-special symbols are: vertical slash (|) and
- * the greater symbol (>).
+ * Command-special symbols are: vertical slash (|), ampersand (&), semicolon (;)
+ * and the greater symbol (>).
  * Usual symbols are all the non-special characters, except for '\0'.
- * The null character is treated as an end of string, unless stated otherwise.
+ * The null character is treated as an end of string.
  *
- * The parsing process is implemented using the character coloring, which is
- * rather memory-inefficient (requires O(N) auxilary memory) but quite
- * convenient to implemented.
- */
-
-/**
- * Accepts two parameters: the NULL-terminated input string `original` and
- * a character array `color`, which must have the capacity to store `original`
- * (i.e. of size `strlen(original) + 1`), may not be initialized.
- *
- * The original string is modified such that the _escaping_ backslashes are
- * removed (the rest of the string is shifted) and the _escaped_ characters
- * are replaced with some placeholder, while the actual character is stored
- * in the corresponding element of `color`. For the usual (non-placeholder)
- * characters the value of `color` is `\0`.
+ * The lexer makes a single pass over the string. The characters are classified
+ * by a lookup table and fed to a state machine, which produces the tokens one
+ * by one. The words are unquoted and unescaped in place: the string shrinks
+ * as it is read (the decoded word is never longer than its source), and each
+ * word is null-terminated right where it ends. So no auxiliary memory is needed.
  *
- * Such an approach allows to easily tokenize the original string (all the
- * escaped special characters are removed, if any special characters are left,
- * they really should be treated as special); after the tokenization it is
- * easy to restore the escaped symbols to get the desired literal string.
+ * The characters to be expanded before the command is run (see expand.h) are marked in the
+ * decoded word: each unquoted `*`, `?` and `[` and each `$` outside of single quotes is replaced
+ * by one of `enum expand_mark`. So the quoted and escaped ones stay literal, and the word does not
+ * grow. The marks are control characters, which are not expected in the commands themselves.
  *
- * If the original string ends with a backslash, returns `false` (the
- * `original` and `color` are still modified in this case). Otherwise,
- * the parse is successful and `true` is returned.
+ * When the string is over inside of a word (an unclosed quotation mark or a trailing backslash),
+ * the lexer keeps its state, so that the continuation of the input may be written right at
+ * `pos` and the lexing resumed without going over the beginning again.
  */
-bool escape_and_color(char *original, char *color);
 
+enum char_class {
+    CHAR_USUAL,  // Zero: the characters which are not in the table
+    CHAR_END,  // '\0'
+    CHAR_SPACE,  // According to isspace(3)
+    CHAR_EXPAND,  // Usual, but marked if unquoted: `*`, `?`, `[` and `$`
+    CHAR_OPERATOR,  // Command-special
+    CHAR_QUOTE,
+    CHAR_BACKSLASH,
+};
 
-#define WHITESPACE " \f\n\r\t\v"  // According to isspace(3)
-#define COMMAND_SPECIAL ">|&;"
+enum expand_mark {
+    MARK_STAR = 1,
+    MARK_QUESTION,
+    MARK_BRACKET,
+    MARK_VAR,  // `$` outside of quotes: the value is split into words
+    MARK_VAR_QUOTED,  // `$` inside of double quotes
+    MARK_END,
+};
 
-/**
- * Returns `true` if the given character is either a whitespace
- * (as in isspace(3)), or a string terminator `\0`, or a command-special
- * character, which indicates that the current token is over.
- */
-bool is_word_separator(char c);
+extern const unsigned char char_classes[256];
 
-/**
- * Returns `true` if the given character is command-special.
- */
-bool is_cm_special(char c);
+inline static enum char_class char_class(char c) {
+    return (enum char_class)char_classes[(unsigned char)c];
+}
+
+enum token_type {
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_REDIRECT,  // >
+    TOKEN_APPEND,  // >>
+    TOKEN_PIPE,  // |
+    TOKEN_OR,  // ||
+    TOKEN_AND,  // &&
+    TOKEN_SEQUENCE,  // ;
+    TOKEN_BACKGROUND,  // &
+    TOKEN_INVALID_OPERATOR,  // Command-special characters making no valid operator
+};
+
+struct token {
+    enum token_type type;
+    // For `TOKEN_WORD`: the null-terminated unquoted and unescaped word, inside the lexed string
+    char *word;
+    // The word has some of `enum expand_mark`
+    bool has_marks;
+};
 
+struct lexer {
+    // Next character to write the decoded word to. Never ahead of `pos`
+    char *out;
+    // The current character and its position. The character is kept separately, as the '\0'
+    // ending the previous word may have been written over it
+    char *pos;
+    char cur;
+    // The word which the string was over in the middle of, `NULL` between the words
+    char *word;
+    // The open quotation mark of `word`, or '\0'
+    char quot;
+    // `word` had quotation marks, so it is a word even if empty
+    bool is_quoted;
+    // `word` has some of `enum expand_mark`
+    bool has_marks;
+};
+
+/** Start lexing the null-terminated string `s`, which will be modified in place. */
+void lexer_init(struct lexer *lx, char *s);
 
 /**
- * Finds the next token and returns its length.
- * Input string must not begin with whitespace.
- *
- * If there is an unclosed quotation, `-1` is returned. If there is nothing
- * left to read (or `*inp` is a whitespace symbol), 0 is returned.
+ * Read the next token to `tok`. Returns `NULL` on success, otherwise one of the
+ * parse errors: `err_unclosed_quot` or `err_trailing_backslash`. After `TOKEN_END`
+ * the lexer shall not be used anymore, after an error it may be resumed.
  */
-int next_token(const char *inp);
-
+const char *lexer_next(struct lexer *lx, struct token *tok);
 
 /**
- * Removes the quotation marks from the original null-terminated string, shifting
- * its other characters to the left, and restores the escaped characters from
- * `color` (if there was an escaped quotation mark, it is restored as if a usual
- * character). Returns the number of quotation marks found (i.e. the left shift
- * of the end of the string).
+ * Continue lexing after an error of `lexer_next`: the input shall have been continued
+ * right at `lx->pos`. For `err_trailing_backslash` it is the backslash, which is thus dropped
+ * (together with the line break, which is not written), for `err_unclosed_quot` it is the
+ * end of the string.
  */
-int uncolor_unquote(char *s, const char *color);
+void lexer_resume(struct lexer *lx);
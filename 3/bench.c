@@ -0,0 +1,500 @@
+#include "bench.h"
+#include "perf_region.h"
+#include "userfs.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_HEAP_HELP
+#include "heap_help/heap_help.h"
+#endif
+
+/*
+ * Benchmark of userfs.
+ *
+ * The rate of ufs_open() and ufs_close() of existing files, for 1K,
+ * 10K and 100K files in the filesystem.
+ *
+ * The sequential ufs_write() and ufs_read() of a BENCH_SEQ_SIZE file,
+ * in chunks of 512 bytes to 1 MB, reported in GB/s.
+ *
+ * The latency of ufs_pread() of BENCH_RECORD bytes at random offsets,
+ * as percentiles.
+ *
+ * The cost of the TLB misses: ufs_pread() of BENCH_TLB_READ bytes at
+ * random offsets of a BENCH_TLB_SIZE file, without and with
+ * UFS_NEW_HUGEPAGES, with how much of the file is in the huge pages.
+ * Built with `make PERF=1` the misses themselves are counted, in the
+ * regions tlb_normal and tlb_huge.
+ *
+ * The latency of the last ufs_close() of a deleted file of
+ * BENCH_DELETE_SIZE, and the slowest of the BENCH_DELETE_OPS pairs of
+ * ufs_open() and ufs_close() after it, which may reclaim its memory.
+ *
+ * The memory taken by the files of 100 bytes, 4 KB and 1 MB: the
+ * growth of the resident set per byte stored. Built with heap_help
+ * (bench_heap, see the Makefile), only this is run, reporting the heap
+ * allocations per file too; heap_help is too slow for the rest.
+ *
+ * Used by several threads at once: each thread
+ * has its own descriptor of a shared file of BENCH_FILE_SIZE, and a
+ * file of its own. Of each BENCH_MIX operations, one is a write of a
+ * record to the own file, the rest are reads of BENCH_RECORD bytes at
+ * random offsets of the shared one. Reported in operations/s, for
+ * 1, 2, 4 and 8 threads.
+ *
+ * Then the same with a filesystem per thread (ufs_new() with
+ * UFS_NEW_SINGLE_THREAD), each with its copy of the shared file: no
+ * locks are taken, and nothing is shared between the threads.
+ *
+ * Usage: ./bench [--ops N] [--mix N] [--json FILE]. The ops are of each
+ * thread. The JSON file gets the same numbers, to compare between the
+ * commits.
+ */
+
+enum {
+	BENCH_FILE_SIZE = 16 * 1024 * 1024,
+	BENCH_SEQ_SIZE = 64 * 1024 * 1024,
+	BENCH_RECORD = 4096,
+	BENCH_OPEN_OPS = 1000000,
+	BENCH_PREAD_OPS = 1000000,
+	BENCH_DELETE_SIZE = 100 * 1024 * 1024,
+	BENCH_DELETE_OPS = 10000,
+	BENCH_TLB_SIZE = 96 * 1024 * 1024,
+	BENCH_TLB_READ = 64,
+	BENCH_TLB_OPS = 4000000,
+	BENCH_OPS_DEFAULT = 200000,
+	BENCH_MIX_DEFAULT = 5,
+	BENCH_MAX_THREADS = 8,
+};
+
+static int bench_ops = BENCH_OPS_DEFAULT;
+static int bench_mix = BENCH_MIX_DEFAULT;
+static FILE *bench_json_file = NULL;
+static const char *bench_json_sep = "";
+
+struct bench_thread {
+	pthread_t tid;
+	int id;
+	struct ufs *fs;
+	long failed;
+};
+
+/** Resident set size of the process, bytes. */
+static size_t
+bench_rss(void)
+{
+	long pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*d %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/** The anonymous memory of the process in the huge pages, bytes. */
+static size_t
+bench_anon_huge(void)
+{
+	size_t kb = 0;
+	char line[256];
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			break;
+	}
+	if (f)
+		fclose(f);
+	return kb * 1024;
+}
+
+/** Start a result in the JSON, named `name`: the fields are to follow, then `}`. */
+static bool
+bench_json_begin(const char *name)
+{
+	if (bench_json_file == NULL)
+		return false;
+	fprintf(bench_json_file, "%s\n  {\"name\": \"%s\"", bench_json_sep, name);
+	bench_json_sep = ",";
+	return true;
+}
+
+static void
+bench_json_end(void)
+{
+	if (bench_json_file == NULL)
+		return;
+	fprintf(bench_json_file, "\n]}\n");
+	fclose(bench_json_file);
+}
+
+/** Create the file "shared" in `fs`. */
+static void
+bench_fill(struct ufs *fs)
+{
+	int fd = ufs_open_in(fs, "shared", UFS_CREATE);
+	static char chunk[1024 * 1024];
+	for (int i = 0; i < BENCH_FILE_SIZE / (int)sizeof(chunk); ++i) {
+		memset(chunk, 'a' + i % 26, sizeof(chunk));
+		ufs_write_in(fs, fd, chunk, sizeof(chunk));
+	}
+	ufs_close_in(fs, fd);
+}
+
+static void
+bench_open(void)
+{
+	printf("ufs_open + ufs_close of a random existing file:\n");
+	for (int count = 1000; count <= 100000; count *= 10) {
+		struct ufs *fs = ufs_new(UFS_NEW_SINGLE_THREAD);
+		char name[32];
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "file%d", i);
+			ufs_close_in(fs, ufs_open_in(fs, name, UFS_CREATE));
+		}
+		unsigned seed = count;
+		double start = bench_now();
+		for (int i = 0; i < BENCH_OPEN_OPS; ++i) {
+			sprintf(name, "file%d", rand_r(&seed) % count);
+			ufs_close_in(fs, ufs_open_in(fs, name, 0));
+		}
+		double elapsed = bench_now() - start;
+		printf("%7d files: %12.0f pairs/s\n", count, BENCH_OPEN_OPS / elapsed);
+		sprintf(name, "open/%d", count);
+		if (bench_json_begin(name))
+			fprintf(bench_json_file, ", \"pairs_per_s\": %.0f}", BENCH_OPEN_OPS / elapsed);
+		ufs_free(fs);
+	}
+}
+
+static void
+bench_seq(void)
+{
+	printf("Sequential I/O of a %d MB file, GB/s:\n", BENCH_SEQ_SIZE >> 20);
+	printf("%10s %10s %10s\n", "chunk", "write", "read");
+	char *chunk = malloc(1024 * 1024);
+	memset(chunk, 'x', 1024 * 1024);
+	static const size_t sizes[] = {512, 4096, 64 * 1024, 1024 * 1024};
+	for (size_t k = 0; k < sizeof(sizes) / sizeof(*sizes); ++k) {
+		size_t size = sizes[k];
+		struct ufs *fs = ufs_new(UFS_NEW_SINGLE_THREAD);
+		int fd = ufs_open_in(fs, "file", UFS_CREATE);
+		double start = bench_now();
+		PERF_REGION_BEGIN(seq_write);
+		for (size_t done = 0; done < BENCH_SEQ_SIZE; done += size)
+			ufs_write_in(fs, fd, chunk, size);
+		PERF_REGION_END(seq_write);
+		double write_time = bench_now() - start;
+		ufs_seek_in(fs, fd, 0, UFS_SEEK_SET);
+		start = bench_now();
+		for (size_t done = 0; done < BENCH_SEQ_SIZE; done += size)
+			ufs_read_in(fs, fd, chunk, size);
+		double read_time = bench_now() - start;
+		printf("%10zu %10.2f %10.2f\n", size, BENCH_SEQ_SIZE / write_time / 1e9,
+		       BENCH_SEQ_SIZE / read_time / 1e9);
+		char name[32];
+		sprintf(name, "seq/%zu", size);
+		if (bench_json_begin(name))
+			fprintf(bench_json_file, ", \"write_gb_per_s\": %.3f, \"read_gb_per_s\": %.3f}",
+				BENCH_SEQ_SIZE / write_time / 1e9, BENCH_SEQ_SIZE / read_time / 1e9);
+		ufs_free(fs);
+	}
+	free(chunk);
+}
+
+static void
+bench_pread(void)
+{
+	struct ufs *fs = ufs_new(UFS_NEW_SINGLE_THREAD);
+	bench_fill(fs);
+	int fd = ufs_open_in(fs, "shared", UFS_READ_ONLY);
+	char buf[BENCH_RECORD];
+	double *times = malloc(BENCH_PREAD_OPS * sizeof(*times));
+	unsigned seed = 1;
+	for (int i = 0; i < BENCH_PREAD_OPS; ++i) {
+		off_t at = rand_r(&seed) % (BENCH_FILE_SIZE - BENCH_RECORD);
+		double start = bench_now();
+		ufs_pread_in(fs, fd, buf, sizeof(buf), at);
+		times[i] = bench_now() - start;
+	}
+	qsort(times, BENCH_PREAD_OPS, sizeof(*times), bench_double_cmp);
+	printf("ufs_pread of %d bytes at random, ns: p50 %.0f, p90 %.0f, p99 %.0f, max %.0f\n",
+	       BENCH_RECORD, times[BENCH_PREAD_OPS / 2] * 1e9, times[BENCH_PREAD_OPS * 9 / 10] * 1e9,
+	       times[BENCH_PREAD_OPS * 99 / 100] * 1e9, times[BENCH_PREAD_OPS - 1] * 1e9);
+	if (bench_json_begin("pread")) {
+		for (int i = 0; i < BENCH_PREAD_OPS; ++i)
+			times[i] *= 1e9;
+		fprintf(bench_json_file, ", ");
+		bench_json_percentiles(bench_json_file, "latency_ns", times, BENCH_PREAD_OPS);
+		fprintf(bench_json_file, "}");
+	}
+	free(times);
+	ufs_free(fs);
+}
+
+static void
+bench_delete(void)
+{
+	struct ufs *fs = ufs_new(0);
+	int fd = ufs_open_in(fs, "deleted", UFS_CREATE);
+	char *chunk = malloc(1024 * 1024);
+	memset(chunk, 'x', 1024 * 1024);
+	for (int i = 0; i < BENCH_DELETE_SIZE / (1024 * 1024); ++i)
+		ufs_write_in(fs, fd, chunk, 1024 * 1024);
+	free(chunk);
+	ufs_delete_in(fs, "deleted");
+	ufs_close_in(fs, ufs_open_in(fs, "other", UFS_CREATE));
+	double start = bench_now();
+	ufs_close_in(fs, fd);
+	double close_time = bench_now() - start, max = 0;
+	for (int i = 0; i < BENCH_DELETE_OPS; ++i) {
+		start = bench_now();
+		ufs_close_in(fs, ufs_open_in(fs, "other", 0));
+		double t = bench_now() - start;
+		max = t > max ? t : max;
+	}
+	printf("The last ufs_close of a deleted %d MB file: %.0f us, "
+	       "then ufs_open + ufs_close: max %.0f us\n", BENCH_DELETE_SIZE >> 20, close_time * 1e6,
+	       max * 1e6);
+	if (bench_json_begin("delete"))
+		fprintf(bench_json_file, ", \"close_us\": %.0f, \"reopen_max_us\": %.0f}",
+			close_time * 1e6, max * 1e6);
+	ufs_free(fs);
+}
+
+/** A BENCH_TLB_SIZE file in a new filesystem of `flags`. */
+static struct ufs *
+bench_tlb_fill(int flags, int *fd)
+{
+	struct ufs *fs = ufs_new(flags | UFS_NEW_SINGLE_THREAD);
+	*fd = ufs_open_in(fs, "file", UFS_CREATE);
+	static char chunk[1024 * 1024];
+	memset(chunk, 'x', sizeof(chunk));
+	for (int i = 0; i < BENCH_TLB_SIZE / (int)sizeof(chunk); ++i)
+		ufs_write_in(fs, *fd, chunk, sizeof(chunk));
+	return fs;
+}
+
+/** ns per read of BENCH_TLB_OPS at random. */
+static double
+bench_tlb_reads(struct ufs *fs, int fd)
+{
+	char buf[BENCH_TLB_READ];
+	unsigned seed = 1;
+	double start = bench_now();
+	for (int i = 0; i < BENCH_TLB_OPS; ++i) {
+		off_t at = rand_r(&seed) % (BENCH_TLB_SIZE - BENCH_TLB_READ);
+		ufs_pread_in(fs, fd, buf, sizeof(buf), at);
+	}
+	return (bench_now() - start) / BENCH_TLB_OPS * 1e9;
+}
+
+/** The line of bench_tlb(), with the huge pages taken since `huge` of bench_anon_huge(). */
+static void
+bench_tlb_print(const char *name, const char *key, double ns, size_t huge)
+{
+	size_t now = bench_anon_huge();
+	printf("%12s: %6.1f ns, %3zu MB in the huge pages\n", name, ns,
+	       (now > huge ? now - huge : 0) >> 20);
+	if (bench_json_begin(key))
+		fprintf(bench_json_file, ", \"pread_ns\": %.1f}", ns);
+}
+
+static void
+bench_tlb(void)
+{
+	printf("ufs_pread of %d bytes at random of a %d MB file:\n", BENCH_TLB_READ,
+	       BENCH_TLB_SIZE >> 20);
+	int fd;
+	size_t huge = bench_anon_huge();
+	struct ufs *fs = bench_tlb_fill(0, &fd);
+	PERF_REGION_BEGIN(tlb_normal);
+	double ns = bench_tlb_reads(fs, fd);
+	PERF_REGION_END(tlb_normal);
+	bench_tlb_print("normal pages", "tlb/normal", ns, huge);
+	ufs_free(fs);
+
+	huge = bench_anon_huge();
+	fs = bench_tlb_fill(UFS_NEW_HUGEPAGES, &fd);
+	PERF_REGION_BEGIN(tlb_huge);
+	ns = bench_tlb_reads(fs, fd);
+	PERF_REGION_END(tlb_huge);
+	bench_tlb_print("huge pages", "tlb/huge", ns, huge);
+	ufs_free(fs);
+}
+
+/** Memory of `count` files of `size` bytes each. */
+static void
+bench_memory_of(int count, size_t size)
+{
+	char *data = malloc(size), name[32];
+	memset(data, 'x', size);
+	struct ufs *fs = ufs_new(UFS_NEW_SINGLE_THREAD);
+#ifdef BENCH_HEAP_HELP
+	uint64_t allocs = heaph_get_alloc_count();
+#endif
+	size_t rss = bench_rss();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open_in(fs, name, UFS_CREATE);
+		ufs_write_in(fs, fd, data, size);
+		ufs_close_in(fs, fd);
+	}
+	double stored = (double)count * size;
+	printf("%7d files of %7zu bytes: %6.2f bytes per byte stored", count, size,
+	       (bench_rss() - rss) / stored);
+#ifdef BENCH_HEAP_HELP
+	printf(", %.2f heap allocations per file",
+	       (double)(heaph_get_alloc_count() - allocs) / count);
+#endif
+	printf("\n");
+	sprintf(name, "memory/%zu", size);
+	if (bench_json_begin(name)) {
+		fprintf(bench_json_file, ", \"bytes_per_byte\": %.3f", (bench_rss() - rss) / stored);
+#ifdef BENCH_HEAP_HELP
+		fprintf(bench_json_file, ", \"allocs_per_file\": %.2f",
+			(double)(heaph_get_alloc_count() - allocs) / count);
+#endif
+		fprintf(bench_json_file, "}");
+	}
+	ufs_free(fs);
+	free(data);
+}
+
+static void
+bench_memory(int scale)
+{
+	printf("Memory, the growth of the resident set:\n");
+	bench_memory_of(200000 / scale, 100);
+	bench_memory_of(10000 / scale, 4096);
+	bench_memory_of(64, 1024 * 1024);
+}
+
+static void *
+bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	char name[32], buf[BENCH_RECORD];
+	memset(buf, 'a' + t->id, sizeof(buf));
+	sprintf(name, "own%d", t->id);
+	struct ufs *fs = t->fs;
+	int shared = ufs_open_in(fs, "shared", UFS_READ_ONLY);
+	int own = ufs_open_in(fs, name, UFS_CREATE);
+	unsigned seed = t->id;
+	for (int i = 0; i < bench_ops; ++i) {
+		if (i % bench_mix == 0) {
+			if (ufs_write_in(fs, own, buf, sizeof(buf)) != sizeof(buf))
+				++t->failed;
+			// Not to grow past the limit of a file
+			if (i % (bench_mix * 1024) == 0)
+				ufs_seek_in(fs, own, 0, UFS_SEEK_SET);
+		} else {
+			off_t at = rand_r(&seed) % (BENCH_FILE_SIZE - BENCH_RECORD);
+			if (ufs_pread_in(fs, shared, buf, sizeof(buf), at) != sizeof(buf))
+				++t->failed;
+		}
+	}
+	ufs_close_in(fs, own);
+	ufs_close_in(fs, shared);
+	ufs_delete_in(fs, name);
+	return NULL;
+}
+
+/** Run `threads` on `fs`, or each on its own filesystem if it is NULL. */
+static void
+bench_run(int threads, struct ufs *fs)
+{
+	struct bench_thread t[BENCH_MAX_THREADS];
+	for (int i = 0; i < threads; ++i) {
+		t[i] = (struct bench_thread){.id = i, .fs = fs};
+		if (!fs) {
+			t[i].fs = ufs_new(UFS_NEW_SINGLE_THREAD);
+			bench_fill(t[i].fs);
+		}
+	}
+	double start = bench_now();
+	for (int i = 0; i < threads; ++i) {
+		if (pthread_create(&t[i].tid, NULL, bench_worker, &t[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	long failed = 0;
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(t[i].tid, NULL);
+		failed += t[i].failed;
+	}
+	double elapsed = bench_now() - start;
+	for (int i = 0; i < threads && !fs; ++i)
+		ufs_free(t[i].fs);
+	printf("%d threads: %12.0f ops/s, %.3f s%s\n", threads,
+	       (double)bench_ops * threads / elapsed, elapsed, failed ? ", FAILED" : "");
+	char name[32];
+	sprintf(name, "mix/%s/%d", fs ? "shared" : "own", threads);
+	if (bench_json_begin(name))
+		fprintf(bench_json_file, ", \"ops_per_s\": %.0f}",
+			(double)bench_ops * threads / elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *json_path = NULL;
+	while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--ops") == 0) {
+			bench_ops = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--mix") == 0) {
+			bench_mix = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--json") == 0) {
+			json_path = argv[2];
+		} else {
+			printf("Unknown option %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (bench_ops < 1 || bench_mix < 1) {
+		printf("There must be at least 1 operation and 1 in the mix\n");
+		return EXIT_FAILURE;
+	}
+	if (json_path != NULL) {
+		bench_json_file = fopen(json_path, "w");
+		if (bench_json_file == NULL) {
+			perror("fopen");
+			return EXIT_FAILURE;
+		}
+		fprintf(bench_json_file, "{\"ops\": %d, \"mix\": %d, \"results\": [", bench_ops,
+			bench_mix);
+	}
+#ifdef BENCH_HEAP_HELP
+	bench_memory(1);
+	bench_json_end();
+	return 0;
+#endif
+	bench_open();
+	bench_seq();
+	bench_pread();
+	bench_delete();
+	bench_tlb();
+	bench_memory(1);
+
+	struct ufs *fs = ufs_new(0);
+	bench_fill(fs);
+	printf("%d ops per thread, 1 in %d a %d byte write, the rest %d byte reads:\n",
+	       bench_ops, bench_mix, BENCH_RECORD, BENCH_RECORD);
+	for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2)
+		bench_run(threads, fs);
+	ufs_free(fs);
+	printf("A filesystem per thread:\n");
+	for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2)
+		bench_run(threads, NULL);
+	bench_json_end();
+	return 0;
+}
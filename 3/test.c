@@ -2,7 +2,9 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +72,196 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_many_files(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[32];
+	unit_msg("create %d files, delete every other one while the rest are added", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "many%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+		if (i % 2) {
+			sprintf(name, "many%d", i - 1);
+			unit_fail_if(ufs_delete(name) != 0);
+		}
+	}
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		sprintf(name, "many%d", i);
+		int fd = ufs_open(name, 0);
+		ok = (fd == -1) == (i % 2 == 0);
+		if (fd != -1)
+			unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_check(ok, "exactly the files not deleted are found");
+
+	int ghost = ufs_open("many1", 0);
+	unit_fail_if(ghost == -1);
+	unit_fail_if(ufs_write(ghost, "old", 3) != 3);
+	unit_check(ufs_delete("many1") == 0, "delete an open file");
+	unit_check(ufs_open("many1", 0) == -1, "it is not found");
+	int fd = ufs_open("many1", UFS_CREATE);
+	unit_check(fd != -1, "a new one is created by its name");
+	char buf[8];
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 0, "the new one is empty");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(ghost) != 0);
+
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "many%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("many1", 0) == -1, "all are deleted");
+
+	unit_test_finish();
+}
+
+static void
+test_seek(void)
+{
+	unit_test_start();
+
+	char buf[16];
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_seek(fd, 0, 100) == -1, "seek with invalid whence");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1, "seek before the start");
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "seek invalid fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 10, "position is after the write");
+	unit_check(ufs_seek(fd, -4, UFS_SEEK_END) == 6, "seek from the end");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 4, "read from there");
+	unit_check(memcmp(buf, "6789", 4) == 0, "the tail");
+	unit_check(ufs_seek(fd, 2, UFS_SEEK_SET) == 2, "seek from the start");
+	unit_fail_if(ufs_write(fd, "ab", 2) != 2);
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_CUR) == 3, "seek back");
+	unit_check(ufs_read(fd, buf, 2) == 2 && memcmp(buf, "b4", 2) == 0,
+		   "overwritten in the middle");
+
+	unit_check(ufs_pread(fd, buf, 3, 0) == 3 && memcmp(buf, "01a", 3) == 0,
+		   "pread at an offset");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 5, "pread does not move");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 100) == 0, "pread past the end is EOF");
+	unit_check(ufs_pwrite(fd, "xy", 2, 12) == 2, "pwrite past the end");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 14, "the file is extended");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 8) == 6 &&
+		   memcmp(buf, "89\0\0xy", 6) == 0, "the gap reads as zeros");
+	unit_check(ufs_pread(fd, buf, 1, -1) == -1, "pread at a negative offset");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	unit_msg("random reads of a big file");
+	const int block = 4096, count = 1000;
+	for (int i = 0; i < count; ++i) {
+		int v[block / sizeof(int)];
+		for (size_t j = 0; j < sizeof(v) / sizeof(*v); ++j)
+			v[j] = i;
+		unit_fail_if(ufs_pwrite(fd, (char *)v, block, (off_t)i * block) != block);
+	}
+	bool ok = true;
+	for (int k = 0; k < count && ok; ++k) {
+		int i = (k * 7919) % count, v;
+		off_t at = (off_t)i * block + (k % (block / sizeof(int))) * sizeof(int);
+		ok = ufs_pread(fd, (char *)&v, sizeof(v), at) == sizeof(v) && v == i;
+	}
+	unit_check(ok, "read back at random offsets");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_vectored(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_writev(fd, NULL, -1) == -1, "writev with negative count");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	const int count = 10000;
+	char rec[count][8];
+	struct iovec iov[count];
+	for (int i = 0; i < count; ++i) {
+		iov[i].iov_base = rec[i];
+		iov[i].iov_len = sprintf(rec[i], "%d;", i);
+	}
+	size_t total = 0;
+	for (int i = 0; i < count; ++i)
+		total += iov[i].iov_len;
+	unit_check(ufs_writev(fd, iov, count) == (ssize_t)total,
+		   "write many small records at once");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == (off_t)total, "position is after them");
+
+	char got[count][8];
+	memset(got, 0, sizeof(got));
+	for (int i = 0; i < count; ++i)
+		iov[i].iov_base = got[i];
+	unit_fail_if(ufs_seek(fd, 0, UFS_SEEK_SET) != 0);
+	unit_check(ufs_readv(fd, iov, count) == (ssize_t)total, "read them back at once");
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i)
+		ok = memcmp(got[i], rec[i], iov[i].iov_len) == 0;
+	unit_check(ok, "the same records");
+
+	char tail[4];
+	struct iovec last[2] = {{got[0], 1}, {tail, sizeof(tail)}};
+	unit_fail_if(ufs_seek(fd, -3, UFS_SEEK_END) == -1);
+	unit_check(ufs_readv(fd, last, 2) == 3, "readv stops at EOF");
+	unit_check(ufs_readv(fd, last, 2) == 0, "then it is EOF");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_many_descriptors(void)
+{
+	unit_test_start();
+
+	const int count = 50000;
+	static int fd[50000];
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		fd[i] = ufs_open("file", UFS_CREATE);
+		ok = fd[i] == i;
+	}
+	unit_check(ok, "the descriptors are taken in order");
+	for (int i = 0; i < count; i += 3)
+		unit_fail_if(ufs_close(fd[i]) != 0);
+	ok = true;
+	for (int i = 0; i < count && ok; i += 3)
+		ok = ufs_open("file", 0) == i;
+	unit_check(ok, "the lowest closed one is taken each time");
+
+	unit_msg("close from the top, so the table is shrunk");
+	for (int i = count - 1; i >= 10; --i)
+		unit_fail_if(ufs_close(fd[i]) != 0);
+	unit_check(ufs_close(count - 1) == -1, "the closed one is invalid");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_open("file", 0) == 10, "the next one is after the open ones");
+	unit_fail_if(ufs_close(10) != 0);
+	for (int i = 0; i < 10; ++i)
+		unit_fail_if(ufs_close(fd[i]) != 0);
+	unit_check(ufs_open("file", 0) == 0, "all are closed");
+	unit_fail_if(ufs_close(0) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -265,6 +457,26 @@ test_delete(void)
 
 	unit_fail_if(ufs_delete("tmp") != 0);
 
+	/* A big one is freed along the next operations, and its memory reused. */
+	static char big[1024 * 1024], read_buf[sizeof(big)];
+	fd1 = ufs_open("big", UFS_CREATE);
+	memset(big, 'x', sizeof(big));
+	bool ok = true;
+	for (int i = 0; i < 30 && ok; ++i)
+		ok = ufs_write(fd1, big, sizeof(big)) == sizeof(big);
+	unit_fail_if(!ok);
+	unit_check(ufs_delete("big") == 0 && ufs_close(fd1) == 0, "delete and close a big file");
+	fd1 = ufs_open("big", UFS_CREATE);
+	memset(big, 'y', sizeof(big));
+	for (int i = 0; i < 30 && ok; ++i)
+		ok = ufs_write(fd1, big, sizeof(big)) == sizeof(big);
+	for (int i = 0; i < 30 && ok; ++i)
+		ok = ufs_pread(fd1, read_buf, sizeof(read_buf), i * sizeof(big)) == sizeof(big) &&
+		     memcmp(read_buf, big, sizeof(big)) == 0;
+	unit_check(ok, "a new one is written meanwhile");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+
 	unit_test_finish();
 }
 
@@ -441,6 +653,659 @@ test_resize(void)
 #endif
 }
 
+static void
+test_resize_holes(void)
+{
+#ifdef NEED_RESIZE
+	unit_test_start();
+
+	char buf[4096];
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	memset(buf, 'x', sizeof(buf));
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+
+	unit_check(ufs_resize(fd, 50 * 1024 * 1024) == 0, "extend to 50 MB");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == 50 * 1024 * 1024, "the size is changed");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 30 * 1024 * 1024) == sizeof(buf),
+		   "read in the middle of the hole");
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(buf) && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "it is zeros");
+
+	unit_check(ufs_resize(fd, 100) == 0, "shrink into the data");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 100, "the position is at the new end");
+	unit_check(ufs_resize(fd, 200) == 0, "extend again");
+	memset(buf, 'y', sizeof(buf));
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 200, "read it all");
+	ok = true;
+	for (int i = 0; i < 200 && ok; ++i)
+		ok = buf[i] == (i < 100 ? 'x' : 0);
+	unit_check(ok, "the cut off data is not back, it is zeros");
+
+	unit_check(ufs_resize(fd, 0) == 0, "truncate");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 0, "nothing to read");
+	unit_check(ufs_resize(fd, 100 * 1024 * 1024 + 1) == -1, "too big");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_small_files(void)
+{
+	unit_test_start();
+
+	char buf[1024], read_buf[1024];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buf, 100) == 100, "write a small file");
+	unit_check(ufs_pwrite(fd, buf + 100, 50, 100) == 50, "append to it");
+	unit_check(ufs_pread(fd, read_buf, sizeof(read_buf), 0) == 150, "read it");
+	unit_check(memcmp(read_buf, buf, 150) == 0, "the data is there");
+
+	unit_check(ufs_pwrite(fd, buf + 150, sizeof(buf) - 150, 150) == sizeof(buf) - 150,
+		   "outgrow it");
+	unit_check(ufs_pread(fd, read_buf, sizeof(read_buf), 0) == sizeof(buf), "read it all");
+	unit_check(memcmp(read_buf, buf, sizeof(buf)) == 0, "the data is kept");
+
+#ifdef NEED_RESIZE
+	unit_check(ufs_resize(fd, 0) == 0 && ufs_resize(fd, 10) == 0, "truncate and extend");
+	unit_check(ufs_pwrite(fd, "x", 1, 20) == 1, "write after a gap");
+	unit_check(ufs_pread(fd, read_buf, sizeof(read_buf), 0) == 21, "read it");
+	bool ok = read_buf[20] == 'x';
+	for (int i = 0; i < 20 && ok; ++i)
+		ok = read_buf[i] == 0;
+	unit_check(ok, "the old data is not back, it is zeros");
+#endif
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_write_buffer(void)
+{
+	unit_test_start();
+
+	/* Many short writes, across the pieces the buffer is committed in. */
+	enum { CHUNK = 100, COUNT = 3000 };
+	char buf[CHUNK], read_buf[CHUNK];
+	int fd = ufs_open("buffered", UFS_CREATE);
+	int fd2 = ufs_open("buffered", 0);
+	unit_fail_if(fd == -1 || fd2 == -1);
+	bool ok = true;
+	for (int i = 0; i < COUNT && ok; ++i) {
+		memset(buf, 'a' + i % 26, sizeof(buf));
+		ok = ufs_write(fd, buf, sizeof(buf)) == sizeof(buf);
+	}
+	unit_check(ok, "short writes");
+	for (int i = 0; i < COUNT && ok; ++i) {
+		ok = ufs_read(fd2, read_buf, sizeof(read_buf)) == sizeof(read_buf);
+		for (int j = 0; j < CHUNK && ok; ++j)
+			ok = read_buf[j] == 'a' + i % 26;
+	}
+	unit_check(ok, "all seen by another descriptor");
+
+	unit_check(ufs_write(fd, "tail", 4) == 4, "write while another one reads");
+	unit_check(ufs_read(fd2, read_buf, sizeof(read_buf)) == 4 &&
+		   memcmp(read_buf, "tail", 4) == 0, "the tail is seen");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_END) == CHUNK * COUNT + 4, "and so is the size");
+
+	unit_check(ufs_seek(fd, 10, UFS_SEEK_SET) == 10 && ufs_write(fd, "xy", 2) == 2 &&
+		   ufs_write(fd2, "z", 1) == 1, "overwrite by both");
+	unit_check(ufs_pread(fd, read_buf, 4, 10) == 4 && memcmp(read_buf, "xyaa", 4) == 0,
+		   "the own write is seen");
+	unit_check(ufs_pread(fd, read_buf, 1, CHUNK * COUNT + 4) == 1 && read_buf[0] == 'z',
+		   "the other one too");
+
+#ifdef NEED_RESIZE
+	unit_check(ufs_write(fd, "data", 4) == 4 && ufs_resize(fd2, 12) == 0,
+		   "shrink after a short write");
+	unit_check(ufs_pread(fd2, read_buf, sizeof(read_buf), 0) == 12 &&
+		   memcmp(read_buf + 10, "xy", 2) == 0, "it is not written back");
+#endif
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	/* Closed before it is committed otherwise. */
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_SET) == 0 && ufs_write(fd, "last", 4) == 4,
+		   "write right before close");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("buffered", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, read_buf, 4) == 4 && memcmp(read_buf, "last", 4) == 0,
+		   "committed on close");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("buffered") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 3 * 1024 * 1024 };
+	char *buf = malloc(SIZE), *read_buf = malloc(SIZE + 3);
+	unit_fail_if(!buf || !read_buf);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, buf, SIZE) != SIZE);
+
+	unit_check(ufs_clone("none", "dst") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_clone("src", "src") == -1, "clone to an existing file");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	unit_check(ufs_clone("dst", "dst2") == 0, "clone of a clone");
+
+	int dst = ufs_open("dst", 0);
+	unit_fail_if(dst == -1);
+	unit_check(ufs_read(dst, read_buf, SIZE) == SIZE, "the clone has the size");
+	unit_check(memcmp(read_buf, buf, SIZE) == 0, "and the data");
+
+	// Both files change apart
+	unit_fail_if(ufs_pwrite(fd, "SRC", 3, 10) != 3);
+	unit_fail_if(ufs_pwrite(dst, "DST", 3, SIZE - 3) != 3);
+	unit_fail_if(ufs_pwrite(dst, "DST", 3, SIZE) != 3);
+	unit_check(ufs_pread(fd, read_buf, SIZE + 3, 0) == SIZE, "the source keeps its size");
+	bool ok = memcmp(read_buf, buf, 10) == 0 && memcmp(read_buf + 10, "SRC", 3) == 0 &&
+		  memcmp(read_buf + 13, buf + 13, SIZE - 13) == 0;
+	unit_check(ok, "the source has its write only");
+	unit_check(ufs_pread(dst, read_buf, SIZE + 3, 0) == SIZE + 3, "the clone is extended");
+	ok = memcmp(read_buf, buf, SIZE - 3) == 0 && memcmp(read_buf + SIZE - 3, "DSTDST", 6) == 0;
+	unit_check(ok, "the clone has its writes only");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("dst") != 0);
+	fd = ufs_open("dst2", 0);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read(fd, read_buf, SIZE) == SIZE, "the clone of the clone outlives them");
+	unit_check(memcmp(read_buf, buf, SIZE) == 0, "with the data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("dst2") != 0);
+
+	free(buf);
+	free(read_buf);
+	unit_test_finish();
+}
+
+/** `true` if the `iovcnt` pieces of `iov` are `size` bytes of `buf`. */
+static bool
+iov_equals(const struct iovec *iov, int iovcnt, const char *buf, size_t size)
+{
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len > size || memcmp(iov[i].iov_base, buf, iov[i].iov_len) != 0)
+			return false;
+		buf += iov[i].iov_len;
+		size -= iov[i].iov_len;
+	}
+	return size == 0;
+}
+
+static void
+test_map(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 3 * 1024 * 1024, HOLE = 100 * 1000 };
+	char *buf = malloc(SIZE);
+	unit_fail_if(buf == NULL);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	memset(buf, 0, HOLE);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_pwrite(fd, buf + HOLE, SIZE - HOLE, HOLE) != SIZE - HOLE);
+
+	struct iovec *iov;
+	int iovcnt;
+	unit_check(ufs_map(fd, -1, 1, &iov, &iovcnt) == -1, "map at a negative offset");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_map(fd, 0, SIZE + 10, &iov, &iovcnt) == SIZE, "map the whole file");
+	unit_check(iovcnt > 1 && iov_equals(iov, iovcnt, buf, SIZE), "with the hole and the data");
+	struct iovec *part;
+	int partcnt;
+	unit_check(ufs_map(fd, 1000, 5000, &part, &partcnt) == 5000, "map a part");
+	unit_check(iov_equals(part, partcnt, buf + 1000, 5000), "it is the part");
+	ufs_unmap(part);
+	unit_check(ufs_map(fd, SIZE, 1, &part, &partcnt) == 0 && partcnt == 0, "map at the end");
+	ufs_unmap(part);
+
+	// The mapping keeps the data, and outlives the file
+	unit_fail_if(ufs_pwrite(fd, "new", 3, SIZE / 2) != 3);
+	unit_fail_if(ufs_pwrite(fd, "new", 3, 10) != 3);
+	unit_check(iov_equals(iov, iovcnt, buf, SIZE), "a write goes to a copy");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(iov_equals(iov, iovcnt, buf, SIZE), "the file is deleted");
+	ufs_unmap(iov);
+
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_write(fd, "small", 5) != 5);
+	unit_check(ufs_map(fd, 1, 10, &iov, &iovcnt) == 4, "map a small file");
+	unit_fail_if(ufs_pwrite(fd, "SMALL", 5, 0) != 5);
+	unit_check(iov_equals(iov, iovcnt, "mall", 4), "it keeps the data too");
+	ufs_unmap(iov);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+
+	free(buf);
+	unit_test_finish();
+}
+
+static void
+test_ring(void)
+{
+	unit_test_start();
+
+	struct ufs_ring *ring = ufs_ring_new(3);
+	struct ufs_sqe *sqe = ufs_get_sqe(ring);
+	sqe->op = UFS_OP_OPEN;
+	sqe->path = "ring";
+	sqe->flags = UFS_CREATE;
+	sqe->user_data = 1;
+	sqe = ufs_get_sqe(ring);
+	sqe->op = UFS_OP_OPEN;
+	sqe->path = "none";
+	sqe->user_data = 2;
+	unit_check(ufs_submit(ring) == 2, "submit the opens");
+	struct ufs_cqe cqes[4];
+	unit_check(ufs_reap(ring, cqes, 4) == 2, "reap them");
+	unit_check(cqes[0].user_data == 1 && cqes[0].res >= 0, "the file is opened");
+	unit_check(cqes[1].user_data == 2 && cqes[1].res == -1 &&
+		   cqes[1].error == UFS_ERR_NO_FILE, "the error is in the completion");
+	int fd = cqes[0].res;
+
+	// The writes at the position, then a read at an offset
+	char data[] = "0123456789", buf[16] = {0};
+	for (int i = 0; i < 3; ++i) {
+		sqe = ufs_get_sqe(ring);
+		sqe->op = UFS_OP_WRITE;
+		sqe->fd = fd;
+		sqe->buf = data + i * 3;
+		sqe->len = 3;
+		sqe->user_data = 10 + i;
+	}
+	sqe = ufs_get_sqe(ring);
+	sqe->op = UFS_OP_READ;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->len = sizeof(buf);
+	sqe->offset = 2;
+	unit_check(ufs_get_sqe(ring) == NULL, "the ring is full");
+	unit_check(ufs_submit(ring) == 4, "submit the batch");
+	unit_check(ufs_get_sqe(ring) == NULL, "until the completions are reaped");
+	unit_check(ufs_reap(ring, cqes, 3) == 3, "reap a part");
+	unit_check(cqes[0].res == 3 && cqes[2].res == 3 && cqes[2].user_data == 12, "written");
+	unit_check(ufs_reap(ring, cqes, 4) == 1, "reap the rest");
+	unit_check(cqes[0].res == 7 && memcmp(buf, "2345678", 7) == 0, "read at an offset");
+	unit_check(ufs_reap(ring, cqes, 4) == 0, "nothing is left");
+
+	sqe = ufs_get_sqe(ring);
+	sqe->op = UFS_OP_CLOSE;
+	sqe->fd = fd;
+	sqe = ufs_get_sqe(ring);
+	sqe->op = UFS_OP_READ;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->len = 1;
+	unit_check(ufs_submit(ring) == 2 && ufs_reap(ring, cqes, 4) == 2, "close and read");
+	unit_check(cqes[0].res == 0 && cqes[1].res == -1 && cqes[1].error == UFS_ERR_NO_FILE,
+		   "the descriptor is closed");
+	ufs_ring_free(ring);
+	unit_fail_if(ufs_delete("ring") != 0);
+
+	unit_test_finish();
+}
+
+/** The count of the entries of `path`, and how many of them are directories. */
+static int
+count_entries(const char *path, int *dirs)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	*dirs = 0;
+	for (const struct ufs_dirent *e; (e = ufs_readdir(dir)) != NULL; ++count)
+		*dirs += e->is_dir;
+	ufs_closedir(dir);
+	return count;
+}
+
+static void
+test_directories(void)
+{
+	unit_test_start();
+
+	int dirs;
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a/b") == 0, "mkdir inside");
+	unit_check(ufs_mkdir("a") == -1, "mkdir twice");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_mkdir("x/y") == -1, "mkdir with no parent");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_mkdir("a//c") == -1 && ufs_mkdir("a/") == -1 && ufs_mkdir("") == -1,
+		   "mkdir of empty components");
+
+	int fd = ufs_open("a/b/file", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a directory");
+	unit_check(ufs_write(fd, "data", 4) == 4, "write to it");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("x/file", UFS_CREATE) == -1, "create with no directory");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_open("a/b/file/f", UFS_CREATE) == -1, "a file is not a directory");
+	unit_check(ufs_open("a", UFS_CREATE) == -1, "a directory can not be opened");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_mkdir("a/b/file") == -1, "mkdir over a file");
+	unit_check(ufs_open("file", 0) == -1, "the file is only in its directory");
+
+	unit_check(ufs_clone("a/b/file", "a/copy") == 0, "clone to another directory");
+	unit_check(ufs_clone("a/b", "a/b2") == -1, "no clone of a directory");
+	unit_check(ufs_clone("a/b/file", "x/copy") == -1, "no clone to no directory");
+	unit_check(count_entries("a", &dirs) == 2 && dirs == 1, "list a directory");
+	struct ufs_dir *dir = ufs_opendir("a/b");
+	unit_fail_if(dir == NULL);
+	const struct ufs_dirent *e = ufs_readdir(dir);
+	unit_check(e && strcmp(e->name, "file") == 0 && !e->is_dir, "the name is without the path");
+	unit_check(ufs_readdir(dir) == NULL, "the end of the listing");
+	ufs_closedir(dir);
+	unit_check(count_entries("", &dirs) >= 1, "list the root");
+	unit_check(ufs_opendir("a/copy") == NULL, "a file can not be listed");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_opendir("none") == NULL, "no directory to list");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	unit_check(ufs_delete("a/b") == -1, "a directory is not deleted as a file");
+	unit_check(ufs_rmdir("a/copy") == -1, "a file is not deleted as a directory");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_rmdir("a/b") == -1, "rmdir of a directory with entries");
+	unit_check(ufs_errno() == UFS_ERR_NOT_EMPTY, "errno is set");
+	fd = ufs_open("a/b/file", 0);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_delete("a/b/file") != 0);
+	unit_check(ufs_rmdir("a/b") == 0, "rmdir of an emptied one");
+	char buf[4];
+	unit_check(ufs_read(fd, buf, 4) == 4 && memcmp(buf, "data", 4) == 0,
+		   "an open file outlives its directory");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rmdir("a/b") == -1, "rmdir twice");
+	unit_check(count_entries("a", &dirs) == 1 && dirs == 0, "removed from the listing");
+	unit_fail_if(ufs_delete("a/copy") != 0);
+	unit_check(ufs_rmdir("a") == 0, "rmdir of the top one");
+	unit_check(ufs_mkdir("a/b") == -1, "its children are gone with it");
+
+	unit_test_finish();
+}
+
+static void
+test_instances(void)
+{
+	unit_test_start();
+
+	struct ufs *a = ufs_new(0), *b = ufs_new(UFS_NEW_SINGLE_THREAD);
+	int fa = ufs_open_in(a, "file", UFS_CREATE);
+	unit_fail_if(fa == -1);
+	unit_check(ufs_open_in(b, "file", 0) == -1, "the files are of their filesystem");
+	unit_check(ufs_open("file", 0) == -1, "not of the default one");
+	int fb = ufs_open_in(b, "file", UFS_CREATE);
+	unit_check(fb == fa, "the descriptors are of their filesystem");
+	unit_fail_if(ufs_write_in(a, fa, "aaa", 3) != 3);
+	unit_fail_if(ufs_write_in(b, fb, "bb", 2) != 2);
+
+	char buf[8];
+	unit_check(ufs_pread_in(a, fa, buf, sizeof(buf), 0) == 3 && memcmp(buf, "aaa", 3) == 0,
+		   "the data is of its file");
+	unit_check(ufs_pread_in(b, fb, buf, sizeof(buf), 0) == 2 && memcmp(buf, "bb", 2) == 0,
+		   "the data of the other one");
+	unit_check(ufs_close_in(b, fb) == 0 && ufs_close_in(b, fb) == -1, "close in one");
+	unit_check(ufs_read_in(a, fa, buf, 1) == 0, "the other one is still open");
+
+	ufs_free(b);
+	unit_check(ufs_delete_in(a, "file") == 0, "delete the open file");
+	ufs_free(a);
+
+	unit_test_finish();
+}
+
+enum { CONCURRENT_SIZE = 300 * 1024, CONCURRENT_CHUNK = 4096, CONCURRENT_ROUNDS = 200 };
+
+static _Atomic bool concurrent_done;
+
+struct concurrent_reader {
+	pthread_t tid;
+	char buf[CONCURRENT_SIZE];
+	/** The reads which are not of a single rewrite. */
+	long torn;
+};
+
+/** Read the file while it is rewritten: every read must be of one rewrite. */
+static void *
+concurrent_reader(void *arg)
+{
+	struct concurrent_reader *r = arg;
+	int fd = ufs_open("concurrent", UFS_READ_ONLY);
+	while (!concurrent_done) {
+		ssize_t rc = ufs_pread(fd, r->buf, CONCURRENT_SIZE, 0);
+		r->torn += rc != CONCURRENT_SIZE || memcmp(r->buf, r->buf + 1, rc - 1) != 0;
+		/* The last chunks, the rest of all the reads. */
+		ufs_seek(fd, CONCURRENT_SIZE - 3 * CONCURRENT_CHUNK / 2, UFS_SEEK_SET);
+		while ((rc = ufs_read(fd, r->buf, CONCURRENT_CHUNK)) > 0)
+			r->torn += memcmp(r->buf, r->buf + 1, rc - 1) != 0;
+		r->torn += ufs_seek(fd, 0, UFS_SEEK_CUR) != CONCURRENT_SIZE;
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+static void
+test_concurrent_reads(void)
+{
+	unit_test_start();
+
+	static char buf[CONCURRENT_SIZE];
+	int fd = ufs_open("concurrent", UFS_CREATE);
+	memset(buf, 'a', sizeof(buf));
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	static struct concurrent_reader readers[2];
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(pthread_create(&readers[i].tid, NULL, concurrent_reader, &readers[i]) != 0);
+
+	/* Rewritten whole, while the table of descriptors grows under the readers. */
+	bool ok = true;
+	int fds[100];
+	for (int r = 0; r < CONCURRENT_ROUNDS && ok; ++r) {
+		memset(buf, 'a' + r % 26, sizeof(buf));
+		ok = ufs_pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf);
+		for (int i = 0; i < 100 && r % 20 == 0; ++i)
+			fds[i] = ufs_open("concurrent", 0);
+		for (int i = 0; i < 100 && r % 20 == 0; ++i)
+			ok = ok && ufs_close(fds[i]) == 0;
+	}
+	concurrent_done = true;
+	for (int i = 0; i < 2; ++i)
+		pthread_join(readers[i].tid, NULL);
+	unit_check(ok, "rewrite while read");
+	unit_check(readers[0].torn == 0 && readers[1].torn == 0, "the reads are never torn");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("concurrent") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 2 * 1024 * 1024, COPIES = 3 };
+	struct ufs *fs = ufs_new(UFS_NEW_DEDUP);
+	char *buf = malloc(SIZE);
+	unit_fail_if(buf == NULL);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	const char *names[COPIES] = {"a", "b", "c"};
+	int fds[COPIES];
+	for (int k = 0; k < COPIES; ++k) {
+		fds[k] = ufs_open_in(fs, names[k], UFS_CREATE);
+		unit_fail_if(fds[k] == -1);
+		unit_fail_if(ufs_write_in(fs, fds[k], buf, SIZE) != SIZE);
+		unit_fail_if(ufs_close_in(fs, fds[k]) != 0);
+		fds[k] = ufs_open_in(fs, names[k], 0);
+		unit_fail_if(fds[k] == -1);
+	}
+
+	struct iovec *iov[COPIES];
+	int iovcnt[COPIES];
+	for (int k = 0; k < COPIES; ++k)
+		unit_fail_if(ufs_map_in(fs, fds[k], 0, SIZE, &iov[k], &iovcnt[k]) != SIZE);
+	bool is_shared = iovcnt[0] > 1;
+	for (int k = 1; k < COPIES && is_shared; ++k) {
+		// The last extent is not full
+		for (int j = 0; j < iovcnt[0] - 1 && is_shared; ++j)
+			is_shared = iov[k][j].iov_base == iov[0][j].iov_base;
+	}
+	unit_check(is_shared, "the identical files share the extents");
+	for (int k = 0; k < COPIES; ++k)
+		ufs_unmap(iov[k]);
+
+	unit_check(ufs_pwrite_in(fs, fds[1], "new", 3, 0) == 3, "write to one");
+	char read_buf[8];
+	unit_check(ufs_pread_in(fs, fds[0], read_buf, 3, 0) == 3 && memcmp(read_buf, buf, 3) == 0 &&
+		   ufs_pread_in(fs, fds[2], read_buf, 3, 0) == 3 && memcmp(read_buf, buf, 3) == 0,
+		   "the others keep the data");
+	unit_check(ufs_pread_in(fs, fds[1], read_buf, 3, 0) == 3 &&
+		   memcmp(read_buf, "new", 3) == 0, "it has its own copy");
+
+	unit_check(ufs_close_in(fs, fds[0]) == 0 && ufs_delete_in(fs, "a") == 0,
+		   "delete one of them");
+	unit_check(ufs_pread_in(fs, fds[2], read_buf, 3, SIZE - 3) == 3 &&
+		   memcmp(read_buf, buf + SIZE - 3, 3) == 0, "the rest still have it");
+	/* Back to the same data, shared on close again. */
+	unit_check(ufs_pwrite_in(fs, fds[1], buf, 3, 0) == 3, "write it back");
+	for (int k = 1; k < COPIES; ++k)
+		unit_fail_if(ufs_close_in(fs, fds[k]) != 0);
+	int fd = ufs_open_in(fs, "b", 0);
+	unit_check(ufs_pread_in(fs, fd, read_buf, 3, 0) == 3 && memcmp(read_buf, buf, 3) == 0,
+		   "the data is the same");
+	unit_fail_if(ufs_close_in(fs, fd) != 0);
+
+	free(buf);
+	ufs_free(fs);
+	unit_test_finish();
+}
+
+static void
+test_hugepages(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 8 * 1024 * 1024, EXTENT = 1024 * 1024 };
+	struct ufs *fs = ufs_new(UFS_NEW_HUGEPAGES);
+	char *buf = malloc(SIZE), *read_buf = malloc(SIZE);
+	unit_fail_if(buf == NULL || read_buf == NULL);
+	for (int i = 0; i < SIZE; ++i)
+		buf[i] = 'a' + i % 26;
+	for (int round = 0; round < 2; ++round) {
+		int fd = ufs_open_in(fs, "file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write_in(fs, fd, buf, SIZE) != SIZE);
+		unit_fail_if(ufs_seek_in(fs, fd, 0, UFS_SEEK_SET) != 0);
+		unit_check(ufs_read_in(fs, fd, read_buf, SIZE) == SIZE &&
+			   memcmp(read_buf, buf, SIZE) == 0, "the data is there");
+		struct iovec *iov;
+		int iovcnt;
+		unit_fail_if(ufs_map_in(fs, fd, 0, SIZE, &iov, &iovcnt) != SIZE);
+		/* The biggest extents are the halves of the aligned slabs. */
+		bool is_aligned = true;
+		for (int j = 0; j < iovcnt; ++j) {
+			if (iov[j].iov_len == EXTENT)
+				is_aligned = is_aligned && (uintptr_t)iov[j].iov_base % EXTENT == 0;
+		}
+		unit_check(is_aligned, "the extents are in the aligned slabs");
+		ufs_unmap(iov);
+		unit_fail_if(ufs_close_in(fs, fd) != 0);
+		/* The second round takes the memory of the first one. */
+		unit_check(ufs_delete_in(fs, "file") == 0, "delete the file");
+	}
+	free(read_buf);
+	free(buf);
+	ufs_free(fs);
+	unit_test_finish();
+}
+
+static void
+test_persistence(void)
+{
+	unit_test_start();
+
+	const char *path = "userfs_test.img";
+	unlink(path);
+	unit_fail_if(ufs_mount(path) != 0);
+	unit_check(ufs_mount(path) == -1, "mount twice");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+
+	char buf[8192];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("kept", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buf, sizeof(buf)) == sizeof(buf), "write to the image");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_close(fd) != 0);
+	unit_fail_if(ufs_mkdir("dir") != 0 || ufs_mkdir("dir/sub") != 0);
+	fd = ufs_open("dir/sub/file", UFS_CREATE);
+	unit_fail_if(fd == -1 || ufs_close(fd) != 0);
+	unit_check(ufs_sync() == 0, "sync");
+	fd = ufs_open("ghost", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_write(fd, buf, 100) == 100, "write to a deleted file");
+	unit_fail_if(ufs_delete("ghost") != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path) != 0);
+	unit_check(ufs_open("ghost", 0) == -1, "the deleted file is gone");
+	fd = ufs_open("empty", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, 1) == 0, "the empty file is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	int dirs;
+	unit_check(count_entries("dir", &dirs) == 1 && dirs == 1, "the directories are kept");
+	fd = ufs_open("dir/sub/file", 0);
+	unit_check(fd != -1 && ufs_close(fd) == 0, "with the files in them");
+	fd = ufs_open("kept", 0);
+	unit_fail_if(fd == -1);
+	char read_buf[sizeof(buf) + 1];
+	unit_check(ufs_read(fd, read_buf, sizeof(read_buf)) == sizeof(buf), "the size is kept");
+	unit_check(memcmp(read_buf, buf, sizeof(buf)) == 0, "the data is kept");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("kept") != 0);
+	ufs_destroy();
+
+	unit_fail_if(ufs_mount(path) != 0);
+	unit_check(ufs_open("kept", 0) == -1, "the deletion is kept");
+	ufs_destroy();
+	unlink(path);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -449,14 +1314,30 @@ main(void)
 	test_open();
 	test_close();
 	test_io();
+	test_seek();
+	test_vectored();
 	test_delete();
 	test_stress_open();
+	test_many_files();
+	test_many_descriptors();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_resize_holes();
+	test_small_files();
+	test_write_buffer();
+	test_clone();
+	test_map();
+	test_ring();
+	test_directories();
+	test_instances();
+	test_concurrent_reads();
+	test_dedup();
+	test_hugepages();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
+	test_persistence();
 
 	unit_test_finish();
 	return 0;
@@ -2,32 +2,128 @@
 #include <stddef.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/**
+ * A file is stored in extents, each allocated at once: the first one
+ * is UFS_BLOCK_SIZE bytes, each next one is twice the previous, up to
+ * UFS_EXTENT_MAX bytes. So a small file takes little memory, and a big
+ * one is a few big chunks. Both may be set at build time, as powers
+ * of two.
+ *
+ * An extent which was never written is not allocated: the hole reads
+ * as zeros. The bytes of the allocated extents past the end of the
+ * file are garbage, they are zeroed when the file is extended over
+ * them. So extending allocates nothing, and appending zeroes nothing.
+ *
+ * Until a file has any extents, its first UFS_INLINE_SIZE bytes are in
+ * the file itself: a small file takes no extent at all.
+ */
+#ifndef UFS_BLOCK_SIZE
+#define UFS_BLOCK_SIZE 512
+#endif
+#ifndef UFS_EXTENT_MAX
+#define UFS_EXTENT_MAX (1024 * 1024)
+#endif
+#ifndef UFS_INLINE_SIZE
+#define UFS_INLINE_SIZE 256
+#endif
+/** The size of the data of a new image, see ufs_mount(). */
+#ifndef UFS_IMAGE_SIZE
+#define UFS_IMAGE_SIZE (1024LL * 1024 * 1024)
+#endif
 
 enum {
-	BLOCK_SIZE = 512,
+	BLOCK_SIZE = UFS_BLOCK_SIZE,
+	EXTENT_MAX = UFS_EXTENT_MAX,
+	INLINE_SIZE = UFS_INLINE_SIZE,
+	/** How many times the extents are doubled, until EXTENT_MAX. */
+	EXTENT_DOUBLINGS = __builtin_ctz(EXTENT_MAX / BLOCK_SIZE),
+	/** The size of the extents before the first one of EXTENT_MAX. */
+	EXTENT_DOUBLING_SIZE = EXTENT_MAX - BLOCK_SIZE,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
-	BLOCKS_PER_FILE = MAX_FILE_SIZE / BLOCK_SIZE
+	/** Initial number of slots in the file table, a power of two. */
+	FILE_TABLE_MIN = 16,
+	/** How many slots of the old table are moved to the new one per operation. */
+	FILE_TABLE_MIGRATE = 16,
+	/** The file tables, each with its own lock, a power of two. */
+	FILE_TABLE_SHARDS = 16,
+	/** The descriptors are tracked in bit sets of words of so many bits. */
+	FD_WORD_BITS = 64,
+	/** The table of descriptors is never shrunk below that. */
+	FD_CAPACITY_MIN = FD_WORD_BITS,
+	/** The extents of each size, from BLOCK_SIZE to EXTENT_MAX. */
+	EXTENT_CLASSES = EXTENT_DOUBLINGS + 1,
+	/** How many bytes of the freed big extents are kept for reuse. */
+	EXTENT_POOL_MAX = 64 * 1024 * 1024,
+	/** The extents up to this size are carved from slabs of SLAB_SIZE. */
+	SLAB_EXTENT_MAX = 256 * 1024,
+	SLAB_SIZE = 2 * 1024 * 1024,
+	/** The mappings of at least this size may be in huge pages. */
+	HUGE_PAGE_SIZE = 2 * 1024 * 1024,
+	/**
+	 * The write-back buffer of a descriptor, see ufs_write_in(): the
+	 * writes shorter than it are gathered there, and committed to the
+	 * file in the pieces of the file aligned to it.
+	 */
+	WRITE_BUFFER_SIZE = 64 * 1024,
+	/** Initial number of buckets in the dedup table, a power of two. */
+	DEDUP_TABLE_MIN = 64,
+	/**
+	 * How many bytes of the extents of the deleted files are freed per
+	 * operation, see reclaim_step(). The files of at most so many are
+	 * freed at once.
+	 */
+	RECLAIM_BYTES = 1024 * 1024,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
-
-struct block {
-	int idx;
-	/** Block memory. */
-	char *memory;
-	/** How many bytes are occupied. */
-	size_t occupied;
-	/** Previous block in the file. */
-	struct block *prev;
-	/** Next block in the file. */
-	struct block *next;
-};
+/**
+ * Thread safety. The locks of a filesystem, each taken before the ones
+ * below it:
+ *
+ * - the lock of a shard of the file tables, for finding, creating and
+ *   deleting the files of that shard;
+ * - fd_lock, taken for writing to open and close the descriptors, and
+ *   to destroy the files; for reading, to use the descriptors;
+ * - the lock of a file, taken for reading to read it and for writing
+ *   to change it. It also guards the positions of its descriptors;
+ * - reclaim_lock, for the deleted files to be freed;
+ * - extent_pool.lock.
+ *
+ * So the readers of a file never wait for each other, and the files
+ * are written in parallel. A descriptor must not be used by several
+ * threads at once (but its file may be, by other descriptors). None
+ * of the locks are taken in a filesystem of a single thread.
+ *
+ * ufs_read() and ufs_pread() take none of them either, as long as no
+ * one writes the file meanwhile: the table of descriptors and each file
+ * have a seqlock, `seq`, odd while they are written under the locks
+ * above, and a reader which finds it changed goes the locked way, see
+ * filedesc_read_optimistic(). So the readers write nothing shared. For
+ * them, what is read stays mapped, if not the same: the old maps of the
+ * extents are kept till the file is destroyed, the old tables of the
+ * descriptors till the filesystem is, and the memory of the big extents
+ * over EXTENT_POOL_MAX is only released, not unmapped.
+ */
+
+/** Error code. Set from any function on any error, in each thread. */
+static _Thread_local enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+_Static_assert(!(BLOCK_SIZE & (BLOCK_SIZE - 1)) && !(EXTENT_MAX & (EXTENT_MAX - 1)) &&
+	       BLOCK_SIZE <= EXTENT_MAX, "the extent sizes must be powers of two");
+_Static_assert(BLOCK_SIZE >= sizeof (void *), "a free extent must fit a link");
 
 enum {
 	PERM_WR = 1,
@@ -36,48 +132,143 @@ enum {
 };
 typedef unsigned char permbits;
 
+/**
+ * The entries of a directory, in no order. Each one knows its place
+ * here, so it is removed in O(1): the last one is moved there. The
+ * files are found by their whole paths in the file tables, so this is
+ * only to list them.
+ */
+struct dir {
+	struct file **entries;
+	size_t count;
+	size_t capacity;
+	pthread_mutex_t lock;
+};
+
+/** A snapshot of the entries of a directory, see ufs_opendir(). Their names follow. */
+struct ufs_dir {
+	size_t count;
+	size_t pos;
+	struct ufs_dirent entries[];
+};
+
+/** The count of the files sharing an extent, see ufs_clone(). */
+struct extent_share {
+	atomic_size_t refs;
+	/**
+	 * `true` if it is in the dedup table, see UFS_NEW_DEDUP: then the
+	 * data, its size and hash, and the next one in its bucket there.
+	 */
+	bool is_indexed;
+	char *extent;
+	size_t size;
+	uint64_t hash;
+	struct extent_share *next;
+};
+
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * The extents of the file, see extent_size(). NULL is a hole. The
+	 * previous map is kept before the first one, see extent_map_grow().
+	 */
+	char **extents;
+	/**
+	 * For each extent, NULL if it is of this file only, otherwise
+	 * shared with the clones: it is copied on the first write.
 	 */
-	struct block *last_block;
+	struct extent_share **shares;
+	/** The length of the map above. */
+	size_t extent_count;
+	size_t extent_capacity;
+	/** Size of the file, bytes. */
+	size_t size;
 	/** How many file descriptors are opened on the file. */
 	size_t refs;
-	/** File name. */
-	char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *prev;
-	struct file *next;
+	pthread_rwlock_t lock;
+	/** Odd while it is written, see "Thread safety". */
+	atomic_uint seq;
 
+	/** The entries, if it is a directory, otherwise NULL. */
+	struct dir *dir;
+	/** The directory it is in, and its place among the entries there. NULL for a ghost. */
+	struct dir *parent;
+	size_t parent_pos;
+
+	/**
+	 * The descriptor which has the data of the file in its write-back
+	 * buffer, -1 if none: so it is committed before the file is used
+	 * otherwise.
+	 */
+	int pending_fd;
 	/** `true` if the file should be deleted as soon as the last file descriptor is closed. */
 	bool ghost;
+	/** The next one to be freed, once it is deleted and closed, see reclaim_step(). */
+	struct file *next_dead;
+	/** The start of the data while there are no extents, see file_is_inline(). */
+	char inline_data[INLINE_SIZE];
+	/** File name, in the same allocation. */
+	char name[];
+};
+
+/** A slot of the file table: empty if `file` is NULL. */
+struct file_slot {
+	/** Hash of the file name, compared before the name itself. */
+	size_t hash;
+	struct file *file;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+/** Marks a slot of a deleted file, which does not end the probing. */
+static struct file file_tombstone;
+
+/**
+ * Hash table of the files by name, with open addressing and linear
+ * probing. Deleted files (even if still open) are not in it. When
+ * it is filled to 3/4, the slots are moved to a table twice the
+ * count of the files not at once but a few on each operation:
+ * meanwhile the files are searched in both tables.
+ *
+ * The files are split among FILE_TABLE_SHARDS such tables by their
+ * hashes, each one has its lock.
+ */
+struct file_table {
+	struct file_slot *slots;
+	/** Number of slots, a power of two. */
+	size_t capacity;
+	/** Slots taken by files and tombstones. */
+	size_t used;
+	/** Number of files in both tables. */
+	size_t count;
+	/** The table being moved from, or NULL. */
+	struct file_slot *old;
+	size_t old_capacity;
+	/** The next slot of `old` to move. */
+	size_t old_pos;
+	pthread_mutex_t lock;
+};
 
 struct filedesc {
 	struct file *file;
 	bool open;
 
-	struct block *block;
-	size_t offset;
+	/** Position in the file. */
+	size_t pos;
+	/**
+	 * The least size the file was shrunk to since the position was
+	 * used, SIZE_MAX if none: see filedesc_apply_shrink().
+	 */
+	size_t shrunk_to;
 
 	permbits perm;
-};
 
-/**
- * An array of file descriptors. When a file descriptor is
- * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
- */
-static struct filedesc *file_descriptors = NULL;
-static int file_descriptor_count = 0;
-static int file_descriptor_capacity = 0;
+	/**
+	 * The write-back buffer, of WRITE_BUFFER_SIZE, NULL until the first
+	 * short write: `wb_len` bytes of the file at `wb_pos`, which are not
+	 * in its extents yet if `wb_len` is not 0.
+	 */
+	char *wb;
+	size_t wb_pos;
+	size_t wb_len;
+};
 
 enum ufs_error_code
 ufs_errno()
@@ -102,228 +293,2638 @@ static void mustrealloc(void **ptr, size_t sz) {
 	}
 }
 
-static struct block *new_block(struct block *prev, int idx) {
-	struct block *b = mustmalloc(sizeof (struct block) + BLOCK_SIZE);
-	b->idx = idx;
-	b->memory = (char *)(b + 1);
-	b->occupied = 0;
-	b->prev = prev;
-	b->next = NULL;
-	return b;
+/** Size of the extent `i` of a file. */
+static size_t extent_size(size_t i) {
+	return i < EXTENT_DOUBLINGS ? (size_t)BLOCK_SIZE << i : EXTENT_MAX;
 }
 
-static struct file *ins_new_file(char *name) {
-	struct file *f = mustmalloc(sizeof (struct file));
-	f->block_list = new_block(NULL, 0);
-	f->last_block = f->block_list;
-	f->refs = 0;
-	f->name = name;
-	f->prev = NULL;
-	f->next = file_list;
-	f->ghost = false;
-	if (file_list)
-		file_list->prev = f;
-	file_list = f;
-	return f;
+/** The extent of a file at the position `pos`, and the `*offset` in it. */
+static size_t extent_at(size_t pos, size_t *offset) {
+	if (pos < EXTENT_DOUBLING_SIZE) {
+		// The extent `i` starts at BLOCK_SIZE * (2^i - 1)
+		size_t i = 63 - __builtin_clzll(pos / BLOCK_SIZE + 1);
+		*offset = pos - BLOCK_SIZE * (((size_t)1 << i) - 1);
+		return i;
+	}
+	pos -= EXTENT_DOUBLING_SIZE;
+	*offset = pos % EXTENT_MAX;
+	return EXTENT_DOUBLINGS + pos / EXTENT_MAX;
 }
 
-static struct file *find_file(const char *name) {
-	struct file *f = file_list;
-	while (f && strcmp(f->name, name))
-		f = f->next;
-	return f;
+/**
+ * The memory of the extents. The small ones (up to SLAB_EXTENT_MAX)
+ * are carved from slabs, mapped in big chunks and never unmapped
+ * until ufs_destroy(): a freed one is kept for reuse. The big ones are
+ * mapped each, and kept for reuse up to EXTENT_POOL_MAX bytes. Either
+ * way, the data is aligned to a page or to its size, and the freed
+ * extents are listed by size, linked through their first bytes. No
+ * headers are there: what is known of an extent is in the map of its
+ * file.
+ *
+ * With UFS_NEW_HUGEPAGES all the extents up to SLAB_SIZE are carved
+ * from the slabs, which are then mapped at a HUGE_PAGE_SIZE boundary
+ * and asked for the transparent huge pages: a big file is the few huge
+ * pages of its slabs, and not hundreds of the TLB entries.
+ */
+struct extent_pool {
+	void *free[EXTENT_CLASSES];
+	/** The bytes of the free big extents. */
+	size_t bytes;
+	/**
+	 * The free big extents over EXTENT_POOL_MAX in a locked filesystem,
+	 * with their memory released but still mapped, see "Thread safety".
+	 */
+	void *released[EXTENT_CLASSES];
+	/** The rest of the slab the extents of each size are carved from. */
+	char *slab_pos[EXTENT_CLASSES];
+	size_t slab_left[EXTENT_CLASSES];
+	/** All the slabs, to be unmapped. */
+	char **slabs;
+	size_t slab_count;
+	size_t slab_capacity;
+	pthread_mutex_t lock;
+};
+
+/** The size class of the extent `i`, in the pool. */
+static size_t extent_class(size_t i) {
+	return MIN(i, (size_t)EXTENT_DOUBLINGS);
 }
 
-int ins_new_fd(struct file *f, permbits perm) {
-	f->refs++;
-	struct filedesc *fd;
-	int i;
-	for (i = 0, fd = file_descriptors; i < file_descriptor_count; ++i, ++fd) {
-		if (!fd->open)
-			break;
+static void *mustmmap(size_t size) {
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		perror("Mmap failed");
+		exit(EXIT_FAILURE);
 	}
-	if (i == file_descriptor_count) {
-		if (file_descriptor_count == file_descriptor_capacity) {
-			file_descriptor_capacity = 1 + file_descriptor_capacity * 2;
-			mustrealloc((void *)&file_descriptors, file_descriptor_capacity * sizeof (struct filedesc));
+	return ptr;
+}
+
+/** The first bytes of an image, see ufs_mount(). */
+struct ufs_superblock {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t block_count;
+	uint64_t bitmap_offset;
+	uint64_t data_offset;
+	/** The first block of the inode table, and its size in bytes. */
+	uint64_t table_block;
+	uint64_t table_size;
+	uint64_t table_checksum;
+};
+
+enum {
+	IMAGE_VERSION = 2,
+	IMAGE_PAGE = 4096,
+	/** The block index of a hole, in the inode table. */
+	IMAGE_HOLE = -1,
+	/** The kinds of the entries of the inode table. */
+	IMAGE_FILE = 0,
+	IMAGE_DIR = 1,
+};
 
-			fd = &file_descriptors[i];
+static const char image_magic[8] = "userfs\0\1";
+
+/**
+ * The full extents of the files by the hash of their data, chained in
+ * the buckets, see file_dedup(). The extents there are shared, so they
+ * are never written; a share which may be in it is only dropped under
+ * the lock, so the one found is alive. The lock is taken before
+ * extent_pool.lock.
+ */
+struct dedup_table {
+	struct extent_share **buckets;
+	/** A power of two, grown as the count reaches it. */
+	size_t capacity;
+	size_t count;
+	pthread_mutex_t lock;
+};
+
+/**
+ * The mounted image, if `base` is not NULL. Then all the extents are
+ * its data blocks, allocated in its bitmap, under extent_pool.lock.
+ */
+struct ufs_image {
+	char *base;
+	size_t size;
+	int fd;
+	struct ufs_superblock *sb;
+	uint64_t *bitmap;
+	char *data;
+	size_t block_count;
+	/** Where to look for free blocks first. */
+	size_t hint;
+};
+
+/**
+ * A filesystem: the files and the descriptors in it are its own, the
+ * same as the memory of its extents.
+ */
+struct ufs {
+	struct file_table file_tables[FILE_TABLE_SHARDS];
+	/**
+	 * An array of file descriptors. When a file descriptor is
+	 * created, its pointer drops here. When a file descriptor is
+	 * closed, its place in this array is marked closed and can be
+	 * taken by next ufs_open() call: the lowest one is taken.
+	 */
+	struct filedesc *file_descriptors;
+	/** One more than the last open descriptor. */
+	int file_descriptor_count;
+	/** A multiple of FD_WORD_BITS. */
+	int file_descriptor_capacity;
+	/**
+	 * Which descriptors are open, a bit per each, and which words of
+	 * those bits are full, a bit per word: so the lowest closed one is
+	 * found in a word of the second per FD_WORD_BITS^2 descriptors.
+	 */
+	uint64_t *fd_open_bits;
+	uint64_t *fd_full_bits;
+	pthread_rwlock_t fd_lock;
+	/** Odd while the descriptors are opened or closed, see "Thread safety". */
+	atomic_uint fd_seq;
+	/**
+	 * The tables of descriptors before they have grown, in a locked
+	 * filesystem: it is never shrunk, so there are at most as many as
+	 * the doublings of an `int`.
+	 */
+	struct filedesc *fd_retired[32];
+	int fd_retired_count;
+	/** The deleted files with their extents still to free, see reclaim_step(). */
+	struct file *dead;
+	pthread_mutex_t reclaim_lock;
+	struct extent_pool extent_pool;
+	struct dedup_table dedup;
+	struct ufs_image image;
+	/** The files and the directories with no '/' in the name. */
+	struct dir root;
+	/** `false` if it is used by a single thread, see ufs_new(). */
+	bool is_locked;
+	/** `true` if the identical extents are shared, see UFS_NEW_DEDUP. */
+	bool is_dedup;
+	/** `true` if the memory is in huge pages, see UFS_NEW_HUGEPAGES. */
+	bool is_hugepages;
+};
+
+#define UFS_INITIALIZER {							\
+	.file_tables = {							\
+		[0 ... FILE_TABLE_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},	\
+	},									\
+	.fd_lock = PTHREAD_RWLOCK_INITIALIZER,					\
+	.reclaim_lock = PTHREAD_MUTEX_INITIALIZER,				\
+	.extent_pool = {.lock = PTHREAD_MUTEX_INITIALIZER},			\
+	.dedup = {.lock = PTHREAD_MUTEX_INITIALIZER},				\
+	.image = {.fd = -1},							\
+	.root = {.lock = PTHREAD_MUTEX_INITIALIZER},				\
+	.is_locked = true,							\
+}
+
+/** The filesystem of the functions without an instance. */
+static struct ufs ufs_default = UFS_INITIALIZER;
+
+/*
+ * The locks are taken only if the filesystem may be used by several
+ * threads.
+ */
+static void fs_mutex_lock(struct ufs *fs, pthread_mutex_t *m) {
+	if (fs->is_locked)
+		pthread_mutex_lock(m);
+}
+
+static void fs_mutex_unlock(struct ufs *fs, pthread_mutex_t *m) {
+	if (fs->is_locked)
+		pthread_mutex_unlock(m);
+}
+
+static void fs_rdlock(struct ufs *fs, pthread_rwlock_t *l) {
+	if (fs->is_locked)
+		pthread_rwlock_rdlock(l);
+}
+
+static void fs_wrlock(struct ufs *fs, pthread_rwlock_t *l) {
+	if (fs->is_locked)
+		pthread_rwlock_wrlock(l);
+}
+
+static void fs_unlock(struct ufs *fs, pthread_rwlock_t *l) {
+	if (fs->is_locked)
+		pthread_rwlock_unlock(l);
+}
+
+/*
+ * The seqlocks of the readers with no locks, see "Thread safety": made
+ * odd by the writer, which has the lock, before it writes anything.
+ */
+static void seq_write_begin(struct ufs *fs, atomic_uint *seq) {
+	if (!fs->is_locked)
+		return;
+	atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+	// Also before the copy of the positions which the readers store, see fd_table_resize()
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void seq_write_end(struct ufs *fs, atomic_uint *seq) {
+	if (fs->is_locked)
+		atomic_fetch_add_explicit(seq, 1, memory_order_release);
+}
+
+#if defined(__SANITIZE_THREAD__)
+#define UFS_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define UFS_TSAN 1
+#endif
+#endif
+
+/*
+ * Copy the data for a reader with no locks, which a writer may change
+ * meanwhile: the copy is thrown away then, by a look at `seq`. TSan
+ * does not see it, not to report the race which is meant, the fields
+ * it looks at around are atomic.
+ */
+#ifdef UFS_TSAN
+__attribute__((no_sanitize_thread, noinline))
+static void seq_read_copy(char *dst, const char *src, size_t size) {
+	const volatile char *from = src;
+	for (size_t i = 0; i < size; ++i)
+		dst[i] = from[i];
+}
+#else
+#define seq_read_copy memcpy
+#endif
+
+/** Lock `f` for writing, for the readers with no locks as well. */
+static void file_wrlock(struct ufs *fs, struct file *f) {
+	fs_wrlock(fs, &f->lock);
+	seq_write_begin(fs, &f->seq);
+}
+
+/** Unlock `f` locked either way: only a writer leaves `seq` odd. */
+static void file_unlock(struct ufs *fs, struct file *f) {
+	if (atomic_load_explicit(&f->seq, memory_order_relaxed) & 1)
+		seq_write_end(fs, &f->seq);
+	fs_unlock(fs, &f->lock);
+}
+
+/**
+ * Map `size` bytes for the extents. With UFS_NEW_HUGEPAGES a multiple of
+ * HUGE_PAGE_SIZE is aligned to it and asked for the huge pages, the
+ * normal pages are taken if there are none. Unmapped as usual.
+ */
+static char *fs_mmap(struct ufs *fs, size_t size) {
+	if (!fs->is_hugepages || size % HUGE_PAGE_SIZE != 0)
+		return mustmmap(size);
+	char *p = mustmmap(size + HUGE_PAGE_SIZE);
+	char *start = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~((uintptr_t)HUGE_PAGE_SIZE - 1));
+	if (start != p)
+		(void)munmap(p, start - p);
+	(void)munmap(start + size, p + HUGE_PAGE_SIZE - start);
+	(void)madvise(start, size, MADV_HUGEPAGE);
+	return start;
+}
+
+/** `true` if the extents of `size` are carved from the slabs, not mapped each. */
+static bool extent_is_slab(struct ufs *fs, size_t size) {
+	return size <= SLAB_EXTENT_MAX || (fs->is_hugepages && size <= SLAB_SIZE);
+}
+
+/** Carve an extent of `size` for the class `c` from its slab. */
+static char *slab_alloc(struct ufs *fs, size_t c, size_t size) {
+	struct extent_pool *pool = &fs->extent_pool;
+	if (pool->slab_left[c] < size) {
+		if (pool->slab_count == pool->slab_capacity) {
+			pool->slab_capacity = 1 + pool->slab_capacity * 2;
+			mustrealloc((void *)&pool->slabs, pool->slab_capacity * sizeof (char *));
 		}
+		char *slab = fs_mmap(fs, SLAB_SIZE);
+		pool->slabs[pool->slab_count++] = slab;
+		pool->slab_pos[c] = slab;
+		pool->slab_left[c] = SLAB_SIZE;
+	}
+	char *e = pool->slab_pos[c];
+	pool->slab_pos[c] += size;
+	pool->slab_left[c] -= size;
+	return e;
+}
 
-		++file_descriptor_count;
+/** `true` if the `n` blocks from `start` are all free. */
+static bool image_is_free(struct ufs *fs, size_t start, size_t n) {
+	for (size_t b = start; b < start + n; ) {
+		size_t bit = b % 64, len = MIN(64 - bit, start + n - b);
+		uint64_t mask = (len == 64 ? ~(uint64_t)0 : (((uint64_t)1 << len) - 1)) << bit;
+		if (fs->image.bitmap[b / 64] & mask)
+			return false;
+		b += len;
 	}
+	return true;
+}
 
-	fd->file = f;
-	fd->open = true;
-	fd->block = f->block_list;
-	fd->offset = 0;
-	fd->perm = perm;
-	return i;
+/** Mark the `n` blocks from `start` used or free. */
+static void image_mark(struct ufs *fs, size_t start, size_t n, bool is_used) {
+	for (size_t b = start; b < start + n; ) {
+		size_t bit = b % 64, len = MIN(64 - bit, start + n - b);
+		uint64_t mask = (len == 64 ? ~(uint64_t)0 : (((uint64_t)1 << len) - 1)) << bit;
+		if (is_used)
+			fs->image.bitmap[b / 64] |= mask;
+		else
+			fs->image.bitmap[b / 64] &= ~mask;
+		b += len;
+	}
 }
 
-int
-ufs_open(const char *filename, int flags)
-{
-	struct file *f = find_file(filename);
-	if (f == NULL) {
-		if (flags & UFS_CREATE) {
-			f = ins_new_file(strdup(filename));
-		} else {
-			ufs_error_code = UFS_ERR_NO_FILE;
-			return -1;
+/** Allocate `n` blocks at a multiple of `align`. Returns the first one, or SIZE_MAX if full. */
+static size_t image_alloc(struct ufs *fs, size_t n, size_t align) {
+	size_t from = fs->image.hint / align * align;
+	for (int pass = 0; pass < 2; ++pass) {
+		size_t end = pass ? MIN(from + n, fs->image.block_count) : fs->image.block_count;
+		for (size_t b = pass ? 0 : from; b + n <= end; b += align) {
+			// A full word is skipped at once
+			if (align < 64 && !~fs->image.bitmap[b / 64]) {
+				b = (b / 64 * 64 + 64 + align - 1) / align * align - align;
+				continue;
+			}
+			if (image_is_free(fs, b, n)) {
+				image_mark(fs, b, n, true);
+				fs->image.hint = b + n;
+				return b;
+			}
 		}
 	}
-	permbits perm;
-    if (flags & UFS_READ_WRITE) {
-        perm = PERM_RDWR;
-    } else if (flags & UFS_READ_ONLY) {
-        perm = PERM_RD;
-    } else if (flags & UFS_WRITE_ONLY) {
-        perm = PERM_WR;
-    } else {
-        perm = PERM_RDWR;
-    }
-	return ins_new_fd(f, perm);
-}
-
-static void seq_write(struct filedesc *fd, const char *buf, size_t *remaining) {
-	size_t cur = MIN(*remaining, BLOCK_SIZE - fd->offset);
-	memcpy(fd->block->memory + fd->offset, buf, cur);
-	if (fd->block->occupied < fd->offset + cur)
-		fd->block->occupied = fd->offset + cur;
-	*remaining -= cur;
-	if (*remaining && fd->block->idx + 1 < BLOCKS_PER_FILE) {
-		if (!fd->block->next)
-			fd->block->next = new_block(fd->block, fd->block->idx + 1);
-		fd->block = fd->block->next;
-		fd->offset = 0;
-		seq_write(fd, buf + cur, remaining);
+	return SIZE_MAX;
+}
+
+/** Memory for the extent `i`, not zeroed. NULL if the image is full. */
+static char *extent_alloc(struct ufs *fs, size_t i) {
+	size_t size = extent_size(i);
+	void **head = &fs->extent_pool.free[extent_class(i)];
+	void **released = &fs->extent_pool.released[extent_class(i)];
+	char *e;
+	fs_mutex_lock(fs, &fs->extent_pool.lock);
+	if (fs->image.base) {
+		size_t blocks = size / BLOCK_SIZE;
+		size_t b = image_alloc(fs, blocks, blocks);
+		e = b == SIZE_MAX ? NULL : fs->image.data + b * BLOCK_SIZE;
+	} else if (*head) {
+		e = *head;
+		memcpy(head, e, sizeof (void *));
+		if (!extent_is_slab(fs, size))
+			fs->extent_pool.bytes -= size;
+	} else if (*released) {
+		e = *released;
+		memcpy(released, e, sizeof (void *));
+	} else if (extent_is_slab(fs, size)) {
+		e = slab_alloc(fs, extent_class(i), size);
 	} else {
-		fd->offset += cur;
+		fs_mutex_unlock(fs, &fs->extent_pool.lock);
+		return fs_mmap(fs, size);
 	}
+	fs_mutex_unlock(fs, &fs->extent_pool.lock);
+	return e;
 }
 
-static void seq_read(struct filedesc *fd, char *buf, size_t *remaining) {
-	size_t cur = MIN(fd->block->occupied - fd->offset, *remaining);
-	memcpy(buf, fd->block->memory + fd->offset, cur);
-	*remaining -= cur;
-	if (*remaining && fd->block->next) {
-		fd->block = fd->block->next;
-		fd->offset = 0;
-		seq_read(fd, buf + cur, remaining);
-	} else {
-		fd->offset += cur;
+/**
+ * Return the memory of the extent `i` to the pool, or unmap it if the
+ * pool is full. In a locked filesystem the memory is only released
+ * then, the readers may still be there, see "Thread safety".
+ */
+static void extent_free(struct ufs *fs, size_t i, char *e) {
+	if (!e)
+		return;
+	size_t size = extent_size(i);
+	fs_mutex_lock(fs, &fs->extent_pool.lock);
+	if (fs->image.base) {
+		image_mark(fs, (e - fs->image.data) / BLOCK_SIZE, size / BLOCK_SIZE, false);
+		fs_mutex_unlock(fs, &fs->extent_pool.lock);
+		return;
+	}
+	void **head = &fs->extent_pool.free[extent_class(i)];
+	if (!extent_is_slab(fs, size)) {
+		if (fs->extent_pool.bytes + size <= EXTENT_POOL_MAX) {
+			fs->extent_pool.bytes += size;
+		} else if (fs->is_locked) {
+			(void)madvise(e, size, MADV_DONTNEED);
+			head = &fs->extent_pool.released[extent_class(i)];
+		} else {
+			fs_mutex_unlock(fs, &fs->extent_pool.lock);
+			(void)munmap(e, size);
+			return;
+		}
 	}
+	memcpy(e, head, sizeof (void *));
+	*head = e;
+	fs_mutex_unlock(fs, &fs->extent_pool.lock);
 }
 
-ssize_t
-ufs_write(int fdi, const char *buf, const size_t size)
-{
-	struct filedesc *fd = &file_descriptors[fdi];
-	if (fdi < 0 || fdi >= file_descriptor_count || !fd->open) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+/** Unmap all the extents, which are free by now. */
+static void extent_pool_destroy(struct ufs *fs) {
+	for (size_t c = 0; c < EXTENT_CLASSES; ++c) {
+		size_t size = extent_size(c);
+		void *lists[] = {fs->extent_pool.free[c], fs->extent_pool.released[c]};
+		for (int l = 0; l < 2; ++l) {
+			void *e = lists[l];
+			while (!extent_is_slab(fs, size) && e) {
+				void *n;
+				memcpy(&n, e, sizeof (void *));
+				(void)munmap(e, size);
+				e = n;
+			}
+		}
 	}
+	for (size_t i = 0; i < fs->extent_pool.slab_count; ++i)
+		(void)munmap(fs->extent_pool.slabs[i], SLAB_SIZE);
+	free(fs->extent_pool.slabs);
+	fs->extent_pool = (struct extent_pool){.lock = PTHREAD_MUTEX_INITIALIZER};
+}
 
-	if (!(fd->perm & PERM_WR)) {
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
+/**
+ * Make the map of `f` have at least `count` extents, the new ones are
+ * holes. A new map is published before the count which covers it, for
+ * the readers with no locks: the old one stays for them till
+ * extent_map_free(), and they sum up to less than the last one.
+ */
+static void extent_map_grow(struct file *f, size_t count) {
+	if (count <= f->extent_count)
+		return;
+	if (count > f->extent_capacity) {
+		f->extent_capacity = MAX(count, f->extent_capacity ? f->extent_capacity * 2 : 4);
+		char **map = mustmalloc((f->extent_capacity + 1) * sizeof (char *));
+		map[0] = (char *)f->extents;
+		if (f->extent_count)
+			memcpy(map + 1, f->extents, f->extent_count * sizeof (char *));
+		__atomic_store_n(&f->extents, map + 1, __ATOMIC_RELEASE);
+		mustrealloc((void *)&f->shares, f->extent_capacity * sizeof (struct extent_share *));
 	}
+	memset(f->extents + f->extent_count, 0, (count - f->extent_count) * sizeof (char *));
+	memset(f->shares + f->extent_count, 0,
+	       (count - f->extent_count) * sizeof (struct extent_share *));
+	__atomic_store_n(&f->extent_count, count, __ATOMIC_RELEASE);
+}
 
-	size_t remaining = size;
+/** Free the map of `f` and the ones before it. */
+static void extent_map_free(struct file *f) {
+	for (char **map = f->extents; map;) {
+		char **prev = (char **)map[-1];
+		free(map - 1);
+		map = prev;
+	}
+}
 
-	seq_write(fd, buf, &remaining);
+/** Take `share` out of the dedup table, under its lock. */
+static void dedup_remove(struct ufs *fs, struct extent_share *share) {
+	struct dedup_table *t = &fs->dedup;
+	struct extent_share **p = &t->buckets[share->hash & (t->capacity - 1)];
+	while (*p != share)
+		p = &(*p)->next;
+	*p = share->next;
+	t->count--;
+	share->is_indexed = false;
+}
 
-	if (size == remaining) {
-		ufs_error_code = UFS_ERR_NO_MEM;
-		return -1;
+/**
+ * Drop a reference of `share`. Returns `true` if it was the last one:
+ * then it is freed, and the extent is for the caller to free.
+ */
+static bool share_put(struct ufs *fs, struct extent_share *share) {
+	if (!fs->is_dedup) {
+		if (atomic_fetch_sub_explicit(&share->refs, 1, memory_order_acq_rel) > 1)
+			return false;
+		free(share);
+		return true;
 	}
-	return size - remaining;
+	fs_mutex_lock(fs, &fs->dedup.lock);
+	bool is_last = atomic_fetch_sub_explicit(&share->refs, 1, memory_order_acq_rel) == 1;
+	if (is_last && share->is_indexed)
+		dedup_remove(fs, share);
+	fs_mutex_unlock(fs, &fs->dedup.lock);
+	if (is_last)
+		free(share);
+	return is_last;
 }
 
-ssize_t
-ufs_read(int fdi, char *buf, const size_t size)
-{
-	struct filedesc *fd = &file_descriptors[fdi];
-	if (fdi < 0 || fdi >= file_descriptor_count || !fd->open) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+/**
+ * Free `share` if only the caller has it: the extent is its own then.
+ * Returns `false` if it is shared.
+ */
+static bool share_take(struct ufs *fs, struct extent_share *share) {
+	if (fs->is_dedup)
+		fs_mutex_lock(fs, &fs->dedup.lock);
+	bool is_own = atomic_load_explicit(&share->refs, memory_order_acquire) == 1;
+	if (is_own && share->is_indexed)
+		dedup_remove(fs, share);
+	if (fs->is_dedup)
+		fs_mutex_unlock(fs, &fs->dedup.lock);
+	if (is_own)
+		free(share);
+	return is_own;
+}
+
+/** Drop a reference to the extent `i` at `e`: it is freed with the last one. */
+static void extent_drop(struct ufs *fs, size_t i, char *e, struct extent_share *share) {
+	if (share && !share_put(fs, share))
+		return;
+	extent_free(fs, i, e);
+}
+
+/**
+ * Drop the extent `i` of `f`: it is freed unless the clones still
+ * share it.
+ */
+static void extent_release(struct ufs *fs, struct file *f, size_t i) {
+	struct extent_share *share = f->shares[i];
+	f->shares[i] = NULL;
+	extent_drop(fs, i, f->extents[i], share);
+}
+
+/**
+ * Make the extent `i` of `f` its own, to be written: a shared one is
+ * copied, unless the other files have dropped it already.
+ */
+static void extent_unshare(struct ufs *fs, struct file *f, size_t i) {
+	struct extent_share *share = f->shares[i];
+	if (!share)
+		return;
+	f->shares[i] = NULL;
+	if (share_take(fs, share))
+		return;
+	// Never fails: the extents are not shared with an image mounted
+	char *copy = extent_alloc(fs, i);
+	memcpy(copy, f->extents[i], extent_size(i));
+	// The others may have dropped it meanwhile
+	if (share_put(fs, share))
+		extent_free(fs, i, f->extents[i]);
+	__atomic_store_n(&f->extents[i], copy, __ATOMIC_RELAXED);
+}
+
+/**
+ * One more reference to the extent `i` of `f`, which is allocated. The
+ * file is written, as its share is created on the first one.
+ */
+static struct extent_share *extent_share(struct file *f, size_t i) {
+	struct extent_share *share = f->shares[i];
+	if (!share) {
+		share = mustmalloc(sizeof (*share));
+		*share = (struct extent_share){.is_indexed = false};
+		atomic_init(&share->refs, 1);
+		f->shares[i] = share;
 	}
+	atomic_fetch_add_explicit(&share->refs, 1, memory_order_relaxed);
+	return share;
+}
 
-	if (!(fd->perm & PERM_RD)) {
-		ufs_error_code = UFS_ERR_NO_PERMISSION;
-		return -1;
+/** Where the extent `i` of a file starts. */
+static size_t extent_start(size_t i) {
+	if (i < EXTENT_DOUBLINGS)
+		return BLOCK_SIZE * (((size_t)1 << i) - 1);
+	return EXTENT_DOUBLING_SIZE + (i - EXTENT_DOUBLINGS) * EXTENT_MAX;
+}
+
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * The hash of the data of an extent, of `size` a multiple of 8: the
+ * rounds of xxHash64 on four lanes, not the same values though. Not
+ * for the attackers, the data is compared anyway.
+ */
+static uint64_t extent_hash(const char *e, size_t size) {
+	const uint64_t p1 = 11400714785074694791ULL, p2 = 14029467366897019727ULL;
+	uint64_t lanes[4] = {p1 + p2, p2, 0, -p1};
+	size_t pos = 0;
+	for (; pos + 32 <= size; pos += 32) {
+		for (int k = 0; k < 4; ++k) {
+			uint64_t w;
+			memcpy(&w, e + pos + k * 8, sizeof (w));
+			lanes[k] = rotl64(lanes[k] + w * p2, 31) * p1;
+		}
 	}
+	uint64_t hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) +
+			rotl64(lanes[3], 18) + size;
+	for (; pos < size; pos += 8) {
+		uint64_t w;
+		memcpy(&w, e + pos, sizeof (w));
+		hash = rotl64(hash ^ (rotl64(w * p2, 31) * p1), 27) * p1;
+	}
+	hash ^= hash >> 33;
+	hash *= p2;
+	return hash ^ (hash >> 29);
+}
 
-	size_t remaining = size;
-	seq_read(fd, buf, &remaining);
-	return size - remaining;
+/** Twice the buckets of the dedup table, under its lock. */
+static void dedup_grow(struct dedup_table *t) {
+	size_t capacity = t->capacity ? t->capacity * 2 : DEDUP_TABLE_MIN;
+	struct extent_share **buckets = mustmalloc(capacity * sizeof (*buckets));
+	memset(buckets, 0, capacity * sizeof (*buckets));
+	for (size_t b = 0; b < t->capacity; ++b) {
+		for (struct extent_share *share = t->buckets[b], *next; share; share = next) {
+			next = share->next;
+			share->next = buckets[share->hash & (capacity - 1)];
+			buckets[share->hash & (capacity - 1)] = share;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->capacity = capacity;
 }
 
-static void destroy_file(struct file *f) {
-	struct block *b = f->block_list;
-	while (b) {
-		struct block *n = b->next;
-		free(b);
-		b = n;
+/**
+ * The share of the extent in the dedup table with the same `size` bytes
+ * as `e`, or NULL. Under its lock.
+ */
+static struct extent_share *dedup_find(struct dedup_table *t, const char *e, size_t size,
+				       uint64_t hash) {
+	if (!t->capacity)
+		return NULL;
+	struct extent_share *share = t->buckets[hash & (t->capacity - 1)];
+	for (; share; share = share->next) {
+		// The same hash of another data is verified away
+		if (share->hash == hash && share->size == size && !memcmp(share->extent, e, size))
+			return share;
 	}
-	free(f->name);
-	free(f);
+	return NULL;
 }
 
-int
-ufs_close(int fdi)
-{
-	struct filedesc *fd = &file_descriptors[fdi];
-	if (fdi < 0 || fdi >= file_descriptor_count || !fd->open) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+/**
+ * Share the full extents of `f` which are its own with the identical
+ * ones in the dedup table, or put them there for the next ones. Once
+ * there, an extent is not hashed again until it is written, as it is
+ * copied then. Under the write lock of the file.
+ */
+static void file_dedup(struct ufs *fs, struct file *f) {
+	struct dedup_table *t = &fs->dedup;
+	for (size_t i = 0; i < f->extent_count; ++i) {
+		size_t size = extent_size(i);
+		if (extent_start(i) + size > f->size)
+			break;
+		char *e = f->extents[i];
+		struct extent_share *own = f->shares[i];
+		// A share left by ufs_map() with no one else is still its own
+		if (!e || (own && (own->is_indexed ||
+				   atomic_load_explicit(&own->refs, memory_order_acquire) > 1)))
+			continue;
+		uint64_t hash = extent_hash(e, size);
+		fs_mutex_lock(fs, &t->lock);
+		struct extent_share *share = dedup_find(t, e, size, hash);
+		if (share) {
+			atomic_fetch_add_explicit(&share->refs, 1, memory_order_relaxed);
+			__atomic_store_n(&f->extents[i], share->extent, __ATOMIC_RELAXED);
+			f->shares[i] = share;
+		} else {
+			if (t->count == t->capacity)
+				dedup_grow(t);
+			if (!own) {
+				own = mustmalloc(sizeof (*own));
+				atomic_init(&own->refs, 1);
+				f->shares[i] = own;
+			}
+			own->is_indexed = true;
+			own->extent = e;
+			own->size = size;
+			own->hash = hash;
+			own->next = t->buckets[hash & (t->capacity - 1)];
+			t->buckets[hash & (t->capacity - 1)] = own;
+			t->count++;
+		}
+		fs_mutex_unlock(fs, &t->lock);
+		if (share) {
+			if (own)
+				free(own);
+			extent_free(fs, i, e);
+		}
 	}
+}
 
-	fd->open = false;
-	fd->file->refs--;
+/** FNV-1a of the first `len` bytes of the file name. */
+static size_t name_hash(const char *name, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+	return (size_t)hash;
+}
 
-	if (!fd->file->refs && fd->file->ghost)
-		destroy_file(fd->file);
+/** The slot of `len` bytes of `name` among `capacity` slots, or NULL if it is not there. */
+static struct file_slot *slots_find(struct file_slot *slots, size_t capacity, const char *name,
+		size_t len, size_t hash) {
+	if (!capacity)
+		return NULL;
+	for (size_t i = hash & (capacity - 1); slots[i].file; i = (i + 1) & (capacity - 1)) {
+		struct file_slot *slot = &slots[i];
+		if (slot->hash == hash && slot->file != &file_tombstone &&
+		    !strncmp(slot->file->name, name, len) && !slot->file->name[len])
+			return slot;
+	}
+	return NULL;
+}
 
-	return 0;
+/**
+ * Put `f` to the first free slot of the new table `t` (it is known not
+ * to be in the table already).
+ */
+static void slots_insert(struct file_table *t, struct file *f, size_t hash) {
+	size_t mask = t->capacity - 1;
+	size_t i = hash & mask;
+	while (t->slots[i].file && t->slots[i].file != &file_tombstone)
+		i = (i + 1) & mask;
+	if (!t->slots[i].file)
+		++t->used;
+	t->slots[i] = (struct file_slot){.hash = hash, .file = f};
 }
 
-int
-ufs_delete(const char *filename)
-{
-	struct file *f = find_file(filename);
-	if (!f) {
-		ufs_error_code = UFS_ERR_NO_FILE;
-		return -1;
+/** Move up to `n` slots of the old table of `t` to the new one. */
+static void file_table_migrate(struct file_table *t, size_t n) {
+	if (!t->old)
+		return;
+	for (; n && t->old_pos < t->old_capacity; --n, ++t->old_pos) {
+		struct file_slot *slot = &t->old[t->old_pos];
+		if (slot->file && slot->file != &file_tombstone) {
+			slots_insert(t, slot->file, slot->hash);
+			// Not to be found (and deleted) there anymore, yet to continue the probing
+			slot->file = &file_tombstone;
+		}
 	}
+	if (t->old_pos == t->old_capacity) {
+		free(t->old);
+		t->old = NULL;
+		t->old_capacity = 0;
+	}
+}
 
-	struct file *prev = f->prev, *next = f->next;
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
-	f->prev = f->next = NULL;
+/**
+ * Make room for one more file in `t`: start moving to a bigger table
+ * if this one is 3/4 full.
+ */
+static void file_table_reserve(struct file_table *t) {
+	if ((t->used + 1) * 4 <= t->capacity * 3)
+		return;
+	// Still moving from the previous one: finish it first
+	file_table_migrate(t, SIZE_MAX);
+	size_t capacity = FILE_TABLE_MIN;
+	while (capacity < (t->count + 1) * 2)
+		capacity *= 2;
+	t->old = t->slots;
+	t->old_capacity = t->capacity;
+	t->old_pos = 0;
+	t->slots = mustmalloc(capacity * sizeof (struct file_slot));
+	memset(t->slots, 0, capacity * sizeof (struct file_slot));
+	t->capacity = capacity;
+	t->used = 0;
+	file_table_migrate(t, FILE_TABLE_MIGRATE);
+}
 
-	if (f == file_list)
-		file_list = next;
+/** The table of the files with the name hash `hash`. */
+static struct file_table *file_table_of(struct ufs *fs, size_t hash) {
+	// The low bits choose the slot
+	return &fs->file_tables[(hash >> (sizeof (size_t) * 8 - 8)) % FILE_TABLE_SHARDS];
+}
 
-	if (!f->refs)
-		destroy_file(f);
-	else
-		f->ghost = true;
+/** The slot of the file of `len` bytes of `name` in either of the tables of `t`, or NULL. */
+static struct file_slot *file_table_find(struct file_table *t, const char *name, size_t len,
+		size_t hash) {
+	file_table_migrate(t, FILE_TABLE_MIGRATE);
+	struct file_slot *slot = slots_find(t->slots, t->capacity, name, len, hash);
+	if (!slot && t->old)
+		slot = slots_find(t->old, t->old_capacity, name, len, hash);
+	return slot;
+}
 
-	return 0;
+/** A new empty file, not in any table yet. */
+static struct file *file_new(const char *name) {
+	size_t name_size = strlen(name) + 1;
+	struct file *f = mustmalloc(sizeof (struct file) + name_size);
+	f->extents = NULL;
+	f->shares = NULL;
+	f->extent_count = f->extent_capacity = 0;
+	f->size = 0;
+	f->refs = 0;
+	memcpy(f->name, name, name_size);
+	pthread_rwlock_init(&f->lock, NULL);
+	atomic_init(&f->seq, 0);
+	f->dir = NULL;
+	f->parent = NULL;
+	f->pending_fd = -1;
+	f->ghost = false;
+	return f;
 }
 
-void
-ufs_destroy(void)
-{
-	free(file_descriptors);
-	struct file *f = file_list;
-	while (f) {
-		struct file *n = f->next;
-		free(f);
-		f = n;
-	}
+static void file_table_insert(struct file_table *t, struct file *f, size_t hash) {
+	file_table_reserve(t);
+	slots_insert(t, f, hash);
+	++t->count;
+}
+
+static struct file *ins_new_file(struct file_table *t, const char *name, size_t hash) {
+	struct file *f = file_new(name);
+	file_table_insert(t, f, hash);
+	return f;
+}
+
+/**
+ * `true` if `name` may be given to a new file: not empty, and with no
+ * empty components (no '/' at the ends, no "//").
+ */
+static bool name_is_valid(const char *name) {
+	return *name && *name != '/' && name[strlen(name) - 1] != '/' && !strstr(name, "//");
+}
+
+/** The length of the path of the directory of `name`, 0 for the root. */
+static size_t parent_len(const char *name) {
+	const char *slash = strrchr(name, '/');
+	return slash ? (size_t)(slash - name) : 0;
+}
+
+/** The table of the directory of `name`, NULL for the root. */
+static struct file_table *parent_table(struct ufs *fs, const char *name) {
+	size_t len = parent_len(name);
+	return len ? file_table_of(fs, name_hash(name, len)) : NULL;
+}
+
+/** The directory of `name`, or NULL if there is none. Under the lock of parent_table(). */
+static struct dir *parent_dir(struct ufs *fs, const char *name) {
+	size_t len = parent_len(name);
+	if (!len)
+		return &fs->root;
+	size_t hash = name_hash(name, len);
+	struct file_slot *slot = file_table_find(file_table_of(fs, hash), name, len, hash);
+	return slot ? slot->file->dir : NULL;
+}
+
+static struct dir *dir_new(void) {
+	struct dir *d = mustmalloc(sizeof (*d));
+	*d = (struct dir){.entries = NULL};
+	pthread_mutex_init(&d->lock, NULL);
+	return d;
+}
+
+static void dir_add(struct ufs *fs, struct dir *d, struct file *f) {
+	fs_mutex_lock(fs, &d->lock);
+	if (d->count == d->capacity) {
+		d->capacity = d->capacity ? d->capacity * 2 : 4;
+		mustrealloc((void *)&d->entries, d->capacity * sizeof (struct file *));
+	}
+	f->parent = d;
+	f->parent_pos = d->count;
+	d->entries[d->count++] = f;
+	fs_mutex_unlock(fs, &d->lock);
+}
+
+static size_t dir_count(struct ufs *fs, struct dir *d) {
+	fs_mutex_lock(fs, &d->lock);
+	size_t count = d->count;
+	fs_mutex_unlock(fs, &d->lock);
+	return count;
+}
+
+/** Remove `f` from its directory. */
+static void dir_remove(struct ufs *fs, struct file *f) {
+	struct dir *d = f->parent;
+	fs_mutex_lock(fs, &d->lock);
+	struct file *last = d->entries[--d->count];
+	d->entries[f->parent_pos] = last;
+	last->parent_pos = f->parent_pos;
+	fs_mutex_unlock(fs, &d->lock);
+	f->parent = NULL;
+}
+
+static void dir_free(struct dir *d) {
+	free(d->entries);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+/**
+ * The tables of a few names, to be locked at once: in the order of the
+ * shards, each one once. NULL ones are skipped.
+ */
+struct table_set {
+	struct file_table *tables[3];
+};
+
+static void tables_lock(struct ufs *fs, struct table_set *set) {
+	struct file_table **t = set->tables;
+	enum { N = sizeof(set->tables) / sizeof(*set->tables) };
+	for (int i = 1; i < N; ++i) {
+		for (int j = i; j > 0 && (uintptr_t)t[j - 1] > (uintptr_t)t[j]; --j) {
+			struct file_table *tmp = t[j];
+			t[j] = t[j - 1];
+			t[j - 1] = tmp;
+		}
+	}
+	for (int i = 0; i < N; ++i) {
+		if (t[i] && (!i || t[i] != t[i - 1]))
+			fs_mutex_lock(fs, &t[i]->lock);
+	}
+}
+
+static void tables_unlock(struct ufs *fs, struct table_set *set) {
+	struct file_table **t = set->tables;
+	enum { N = sizeof(set->tables) / sizeof(*set->tables) };
+	for (int i = N - 1; i >= 0; --i) {
+		if (t[i] && (!i || t[i] != t[i - 1]))
+			fs_mutex_unlock(fs, &t[i]->lock);
+	}
+}
+
+/**
+ * Resize the table of descriptors to `capacity`, keeping the first
+ * `file_descriptor_count`. In a locked filesystem it only grows, and
+ * the old table is kept for the readers with no locks, which may still
+ * store the positions there: they look at fd_seq after that.
+ */
+static void fd_table_resize(struct ufs *fs, int capacity) {
+	int words = capacity / FD_WORD_BITS, old_words = fs->file_descriptor_capacity / FD_WORD_BITS;
+	int full_words = (words + FD_WORD_BITS - 1) / FD_WORD_BITS;
+	int old_full_words = (old_words + FD_WORD_BITS - 1) / FD_WORD_BITS;
+	if (fs->is_locked && fs->file_descriptors) {
+		struct filedesc *table = mustmalloc(capacity * sizeof (struct filedesc));
+		memcpy(table, fs->file_descriptors,
+		       fs->file_descriptor_count * sizeof (struct filedesc));
+		fs->fd_retired[fs->fd_retired_count++] = fs->file_descriptors;
+		__atomic_store_n(&fs->file_descriptors, table, __ATOMIC_RELEASE);
+	} else {
+		mustrealloc((void *)&fs->file_descriptors, capacity * sizeof (struct filedesc));
+	}
+	mustrealloc((void *)&fs->fd_open_bits, words * sizeof (uint64_t));
+	mustrealloc((void *)&fs->fd_full_bits, full_words * sizeof (uint64_t));
+	if (words > old_words)
+		memset(fs->fd_open_bits + old_words, 0, (words - old_words) * sizeof (uint64_t));
+	if (full_words > old_full_words)
+		memset(fs->fd_full_bits + old_full_words, 0,
+		       (full_words - old_full_words) * sizeof (uint64_t));
+	fs->file_descriptor_capacity = capacity;
+}
+
+/** The lowest closed descriptor, may be the capacity of the table. */
+static int fd_lowest_closed(struct ufs *fs) {
+	int words = fs->file_descriptor_capacity / FD_WORD_BITS;
+	int full_words = (words + FD_WORD_BITS - 1) / FD_WORD_BITS;
+	for (int i = 0; i < full_words; ++i) {
+		if (~fs->fd_full_bits[i]) {
+			int w = i * FD_WORD_BITS + __builtin_ctzll(~fs->fd_full_bits[i]);
+			if (w >= words)
+				break;
+			return w * FD_WORD_BITS + __builtin_ctzll(~fs->fd_open_bits[w]);
+		}
+	}
+	return fs->file_descriptor_capacity;
+}
+
+int ins_new_fd(struct ufs *fs, struct file *f, permbits perm) {
+	f->refs++;
+	seq_write_begin(fs, &fs->fd_seq);
+	int i = fd_lowest_closed(fs);
+	if (i == fs->file_descriptor_capacity)
+		fd_table_resize(fs, fs->file_descriptor_capacity ? fs->file_descriptor_capacity * 2 :
+				FD_CAPACITY_MIN);
+	int w = i / FD_WORD_BITS;
+	fs->fd_open_bits[w] |= (uint64_t)1 << (i % FD_WORD_BITS);
+	if (!~fs->fd_open_bits[w])
+		fs->fd_full_bits[w / FD_WORD_BITS] |= (uint64_t)1 << (w % FD_WORD_BITS);
+	struct filedesc *fd = &fs->file_descriptors[i];
+	// Atomic for the readers with no locks, which check fd_seq after
+	__atomic_store_n(&fd->file, f, __ATOMIC_RELAXED);
+	__atomic_store_n(&fd->open, true, __ATOMIC_RELAXED);
+	fd->pos = 0;
+	__atomic_store_n(&fd->shrunk_to, SIZE_MAX, __ATOMIC_RELAXED);
+	__atomic_store_n(&fd->perm, perm, __ATOMIC_RELAXED);
+	fd->wb = NULL;
+	fd->wb_len = 0;
+	// After the table which has it, for the readers with no locks
+	if (i >= fs->file_descriptor_count)
+		__atomic_store_n(&fs->file_descriptor_count, i + 1, __ATOMIC_RELEASE);
+	seq_write_end(fs, &fs->fd_seq);
+	return i;
+}
+
+/**
+ * Mark the descriptor `i` closed. If it was the last one, shrink the
+ * table when it is at most a quarter used, but in a locked filesystem,
+ * see fd_table_resize().
+ */
+static void del_fd(struct ufs *fs, int i) {
+	seq_write_begin(fs, &fs->fd_seq);
+	__atomic_store_n(&fs->file_descriptors[i].open, false, __ATOMIC_RELAXED);
+	int w = i / FD_WORD_BITS;
+	fs->fd_open_bits[w] &= ~((uint64_t)1 << (i % FD_WORD_BITS));
+	fs->fd_full_bits[w / FD_WORD_BITS] &= ~((uint64_t)1 << (w % FD_WORD_BITS));
+	if (i + 1 == fs->file_descriptor_count) {
+		while (w >= 0 && !fs->fd_open_bits[w])
+			--w;
+		int count = w < 0 ? 0 :
+			w * FD_WORD_BITS + FD_WORD_BITS - __builtin_clzll(fs->fd_open_bits[w]);
+		__atomic_store_n(&fs->file_descriptor_count, count, __ATOMIC_RELAXED);
+		int capacity = fs->file_descriptor_capacity;
+		while (!fs->is_locked && capacity > FD_CAPACITY_MIN &&
+		       fs->file_descriptor_count <= capacity / 4)
+			capacity /= 2;
+		if (capacity < fs->file_descriptor_capacity)
+			fd_table_resize(fs, capacity);
+	}
+	seq_write_end(fs, &fs->fd_seq);
+}
+
+static void file_free(struct ufs *fs, struct file *f) {
+	for (size_t i = 0; i < f->extent_count; ++i)
+		extent_release(fs, f, i);
+	extent_map_free(f);
+	free(f->shares);
+	pthread_rwlock_destroy(&f->lock);
+	free(f);
+}
+
+/**
+ * Free `f`, which no one has: a big one only along the next operations,
+ * see reclaim_step(), for the caller not to stall on its extents.
+ */
+static void destroy_file(struct ufs *fs, struct file *f) {
+	if (extent_start(f->extent_count) <= RECLAIM_BYTES) {
+		file_free(fs, f);
+		return;
+	}
+	fs_mutex_lock(fs, &fs->reclaim_lock);
+	f->next_dead = fs->dead;
+	__atomic_store_n(&fs->dead, f, __ATOMIC_RELAXED);
+	fs_mutex_unlock(fs, &fs->reclaim_lock);
+}
+
+/**
+ * Free about RECLAIM_BYTES of the extents of the deleted files, from
+ * the end of the first one, and that file once it has none: so the
+ * memory of a big file is freed in bounded pieces by the opens, the
+ * closes and the writes after it, and soon reused by them.
+ */
+static void reclaim_step(struct ufs *fs) {
+	if (!__atomic_load_n(&fs->dead, __ATOMIC_RELAXED))
+		return;
+	fs_mutex_lock(fs, &fs->reclaim_lock);
+	for (size_t bytes = 0; fs->dead && bytes < RECLAIM_BYTES;) {
+		struct file *f = fs->dead;
+		if (f->extent_count) {
+			bytes += extent_size(--f->extent_count);
+			extent_release(fs, f, f->extent_count);
+			continue;
+		}
+		__atomic_store_n(&fs->dead, f->next_dead, __ATOMIC_RELAXED);
+		file_free(fs, f);
+	}
+	fs_mutex_unlock(fs, &fs->reclaim_lock);
+}
+
+int
+ufs_open_in(struct ufs *fs, const char *filename, int flags)
+{
+	reclaim_step(fs);
+	size_t len = strlen(filename), hash = name_hash(filename, len);
+	struct file_table *t = file_table_of(fs, hash);
+	// The directory must not be removed while the file is put there
+	struct table_set set = {{t, flags & UFS_CREATE ? parent_table(fs, filename) : NULL}};
+	tables_lock(fs, &set);
+	int fd = -1;
+	struct file_slot *slot = file_table_find(t, filename, len, hash);
+	struct file *f = slot ? slot->file : NULL;
+	if (f && f->dir) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	if (f == NULL) {
+		if (!(flags & UFS_CREATE)) {
+			ufs_error_code = UFS_ERR_NO_FILE;
+			goto out;
+		}
+		if (!name_is_valid(filename)) {
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+			goto out;
+		}
+		struct dir *parent = parent_dir(fs, filename);
+		if (!parent) {
+			ufs_error_code = UFS_ERR_NO_FILE;
+			goto out;
+		}
+		f = ins_new_file(t, filename, hash);
+		dir_add(fs, parent, f);
+	}
+	permbits perm;
+    if (flags & UFS_READ_WRITE) {
+        perm = PERM_RDWR;
+    } else if (flags & UFS_READ_ONLY) {
+        perm = PERM_RD;
+    } else if (flags & UFS_WRITE_ONLY) {
+        perm = PERM_WR;
+    } else {
+        perm = PERM_RDWR;
+    }
+	// Not to be deleted before it is referenced
+	fs_wrlock(fs, &fs->fd_lock);
+	fd = ins_new_fd(fs, f, perm);
+	fs_unlock(fs, &fs->fd_lock);
+out:
+	tables_unlock(fs, &set);
+	return fd;
+}
+
+/**
+ * `true` if the data of `f` up to INLINE_SIZE is in `f->inline_data`:
+ * until the extents are needed. Never so in an image, which has no
+ * place for it.
+ */
+static bool file_is_inline(const struct ufs *fs, const struct file *f) {
+	return !f->extent_count && !fs->image.base;
+}
+
+/** Zero the allocated extents of `f` from `from` to `to`. */
+static void file_zero(struct ufs *fs, struct file *f, size_t from, size_t to) {
+	if (file_is_inline(fs, f)) {
+		if (from < INLINE_SIZE)
+			memset(f->inline_data + from, 0, MIN(to, (size_t)INLINE_SIZE) - from);
+		return;
+	}
+	size_t offset;
+	size_t i = extent_at(from, &offset);
+	for (; from < to && i < f->extent_count; ++i, offset = 0) {
+		size_t cur = MIN(to - from, extent_size(i) - offset);
+		if (f->extents[i]) {
+			extent_unshare(fs, f, i);
+			memset(f->extents[i] + offset, 0, cur);
+		}
+		from += cur;
+	}
+}
+
+/** Extend `f` to `size`, the new part reads as zeros. */
+static void file_extend(struct ufs *fs, struct file *f, size_t size) {
+	file_zero(fs, f, f->size, size);
+	__atomic_store_n(&f->size, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write `size` bytes at `pos` of `f`, which fit into the file. Returns
+ * how many are written: less if the image is full.
+ */
+static size_t file_write(struct ufs *fs, struct file *f, size_t pos, const char *buf, size_t size) {
+	if (!size)
+		return 0;
+	reclaim_step(fs);
+	if (pos > f->size)
+		file_extend(fs, f, pos);
+	if (file_is_inline(fs, f)) {
+		if (pos + size <= INLINE_SIZE) {
+			memcpy(f->inline_data + pos, buf, size);
+			__atomic_store_n(&f->size, MAX(f->size, pos + size), __ATOMIC_RELAXED);
+			return size;
+		}
+		// Outgrown: the inline data is moved to the extents
+		size_t moved = MIN(f->size, (size_t)INLINE_SIZE);
+		char data[INLINE_SIZE];
+		memcpy(data, f->inline_data, moved);
+		extent_map_grow(f, 1);
+		file_write(fs, f, 0, data, moved);
+	}
+	size_t offset, last_offset;
+	size_t i = extent_at(pos, &offset);
+	extent_map_grow(f, extent_at(pos + size - 1, &last_offset) + 1);
+	size_t written = 0;
+	while (size) {
+		size_t cur = MIN(size, extent_size(i) - offset);
+		if (!f->extents[i]) {
+			// A hole: the rest of it within the file must still read as zeros
+			__atomic_store_n(&f->extents[i], extent_alloc(fs, i), __ATOMIC_RELAXED);
+			// The image may be full of the deleted files yet
+			while (!f->extents[i] && __atomic_load_n(&fs->dead, __ATOMIC_RELAXED)) {
+				reclaim_step(fs);
+				__atomic_store_n(&f->extents[i], extent_alloc(fs, i),
+						 __ATOMIC_RELAXED);
+			}
+			if (!f->extents[i])
+				break;
+			memset(f->extents[i], 0, offset);
+			size_t end = pos + cur, extent_end = pos - offset + extent_size(i);
+			if (end < f->size)
+				memset(f->extents[i] + offset + cur, 0, MIN(f->size, extent_end) - end);
+		} else {
+			extent_unshare(fs, f, i);
+		}
+		memcpy(f->extents[i] + offset, buf, cur);
+		buf += cur;
+		size -= cur;
+		pos += cur;
+		written += cur;
+		++i;
+		offset = 0;
+	}
+	__atomic_store_n(&f->size, MAX(f->size, pos), __ATOMIC_RELAXED);
+	return written;
+}
+
+/** Read `size` bytes at `pos` of `f`, which are in the file. */
+static void file_read(const struct ufs *fs, const struct file *f, size_t pos, char *buf,
+		size_t size) {
+	if (file_is_inline(fs, f)) {
+		size_t cur = pos < INLINE_SIZE ? MIN(size, INLINE_SIZE - pos) : 0;
+		memcpy(buf, f->inline_data + pos, cur);
+		memset(buf + cur, 0, size - cur);
+		return;
+	}
+	size_t offset;
+	size_t i = extent_at(pos, &offset);
+	while (size) {
+		size_t cur = MIN(size, extent_size(i) - offset);
+		if (i < f->extent_count && f->extents[i])
+			memcpy(buf, f->extents[i] + offset, cur);
+		else
+			memset(buf, 0, cur);
+		buf += cur;
+		size -= cur;
+		++i;
+		offset = 0;
+	}
+}
+
+/**
+ * Commit the write-back buffer of `fd` to its file. Under the write
+ * lock of the file.
+ */
+static void filedesc_commit(struct ufs *fs, struct filedesc *fd) {
+	if (!fd->wb_len)
+		return;
+	// Can not fall short: there is no image, and the size was checked
+	(void)file_write(fs, fd->file, fd->wb_pos, fd->wb, fd->wb_len);
+	fd->wb_len = 0;
+	__atomic_store_n(&fd->file->pending_fd, -1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Commit the data of `f` in a write-back buffer, if there is any. Under
+ * fd_lock and the write lock of the file.
+ */
+static void file_commit(struct ufs *fs, struct file *f) {
+	if (f->pending_fd >= 0)
+		filedesc_commit(fs, &fs->file_descriptors[f->pending_fd]);
+}
+
+/**
+ * The open descriptor `fdi`, which has the permissions `perm`. Or NULL,
+ * and the error is set. Under fd_lock.
+ */
+static struct filedesc *check_filedesc(struct ufs *fs, int fdi, permbits perm) {
+	if (fdi < 0 || fdi >= fs->file_descriptor_count || !fs->file_descriptors[fdi].open) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	struct filedesc *fd = &fs->file_descriptors[fdi];
+	if ((fd->perm & perm) != perm) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return fd;
+}
+
+/**
+ * Move the position of `fd` to the end of its file if it was shrunk
+ * before it, see file_shrink(). Under the lock of the file.
+ */
+static void filedesc_apply_shrink(struct filedesc *fd) {
+	fd->pos = MIN(fd->pos, fd->shrunk_to);
+	__atomic_store_n(&fd->shrunk_to, SIZE_MAX, __ATOMIC_RELAXED);
+}
+
+/**
+ * Like check_filedesc(fs), and lock the descriptor for use, with its
+ * file locked for writing if `is_write`, otherwise for reading. To be
+ * released with put_filedesc(fs).
+ */
+static struct filedesc *lock_filedesc(struct ufs *fs, int fdi, permbits perm, bool is_write) {
+	fs_rdlock(fs, &fs->fd_lock);
+	struct filedesc *fd = check_filedesc(fs, fdi, perm);
+	if (!fd) {
+		fs_unlock(fs, &fs->fd_lock);
+		return NULL;
+	}
+	if (is_write)
+		file_wrlock(fs, fd->file);
+	else
+		fs_rdlock(fs, &fd->file->lock);
+	filedesc_apply_shrink(fd);
+	return fd;
+}
+
+/**
+ * Like lock_filedesc(fs), and commit the data of the file in a
+ * write-back buffer first, so it is seen. For the readers the lock is
+ * taken for writing meanwhile.
+ */
+static struct filedesc *get_filedesc(struct ufs *fs, int fdi, permbits perm, bool is_write) {
+	struct filedesc *fd = lock_filedesc(fs, fdi, perm, is_write);
+	if (!fd)
+		return NULL;
+	struct file *f = fd->file;
+	if (is_write)
+		file_commit(fs, f);
+	// It is only set under the write lock
+	while (!is_write && f->pending_fd >= 0) {
+		fs_unlock(fs, &f->lock);
+		file_wrlock(fs, f);
+		file_commit(fs, f);
+		file_unlock(fs, f);
+		fs_rdlock(fs, &f->lock);
+	}
+	return fd;
+}
+
+static void put_filedesc(struct ufs *fs, struct filedesc *fd) {
+	file_unlock(fs, fd->file);
+	fs_unlock(fs, &fs->fd_lock);
+}
+
+/** Write to the file of `fd` at `pos`, like ufs_pwrite(). */
+static ssize_t filedesc_write(struct ufs *fs, struct filedesc *fd, const char *buf, size_t size,
+		size_t pos) {
+	size_t count = MIN(size, MAX_FILE_SIZE - MIN(pos, MAX_FILE_SIZE));
+	if (!count) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	count = file_write(fs, fd->file, pos, buf, count);
+	if (!count) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return count;
+}
+
+/** Read from the file of `fd` at `pos`, like ufs_pread(). */
+static ssize_t filedesc_read(struct ufs *fs, struct filedesc *fd, char *buf, size_t size,
+		size_t pos) {
+	size_t count = MIN(size, fd->file->size - MIN(pos, fd->file->size));
+	file_read(fs, fd->file, pos, buf, count);
+	return count;
+}
+
+/**
+ * Write `size` bytes, less than WRITE_BUFFER_SIZE, to the write-back
+ * buffer of `fd`, like ufs_write(). The buffer is committed when the
+ * write is not right after it, and when it reaches the end of its
+ * aligned piece of the file. Under the write lock.
+ */
+static ssize_t filedesc_write_buffered(struct ufs *fs, int fdi, struct filedesc *fd,
+		const char *buf, size_t size) {
+	size_t count = MIN(size, MAX_FILE_SIZE - MIN(fd->pos, MAX_FILE_SIZE));
+	if (!count) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	if (fd->wb_len && fd->pos != fd->wb_pos + fd->wb_len)
+		filedesc_commit(fs, fd);
+	if (!fd->wb)
+		fd->wb = mustmalloc(WRITE_BUFFER_SIZE);
+	for (size_t done = 0; done < count;) {
+		if (!fd->wb_len)
+			fd->wb_pos = fd->pos;
+		size_t room = WRITE_BUFFER_SIZE - fd->wb_pos % WRITE_BUFFER_SIZE - fd->wb_len;
+		size_t cur = MIN(count - done, room);
+		memcpy(fd->wb + fd->wb_len, buf + done, cur);
+		fd->wb_len += cur;
+		fd->pos += cur;
+		done += cur;
+		__atomic_store_n(&fd->file->pending_fd, fdi, __ATOMIC_RELAXED);
+		if (cur == room)
+			filedesc_commit(fs, fd);
+	}
+	return count;
+}
+
+ssize_t
+ufs_write_in(struct ufs *fs, int fdi, const char *buf, const size_t size)
+{
+	struct filedesc *fd = lock_filedesc(fs, fdi, PERM_WR, true);
+	if (!fd)
+		return -1;
+	struct file *f = fd->file;
+	ssize_t rc;
+	// Not with an image: a failure to commit would be reported by no one
+	if (size && size < WRITE_BUFFER_SIZE && !fs->image.base) {
+		if (f->pending_fd >= 0 && f->pending_fd != fdi)
+			file_commit(fs, f);
+		rc = filedesc_write_buffered(fs, fdi, fd, buf, size);
+	} else {
+		file_commit(fs, f);
+		rc = filedesc_write(fs, fd, buf, size, fd->pos);
+		if (rc > 0)
+			fd->pos += rc;
+	}
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+/**
+ * Read like filedesc_read() from the descriptor `fdi`, at `offset`, or
+ * at its position and past the bytes read if -1: with no locks, see
+ * "Thread safety". The file is taken between two looks at its `seq`,
+ * which are even and the same if no one has written it meanwhile, the
+ * descriptor between two of fd_seq. Returns `false` to go the locked
+ * way: if anyone has, if the descriptor is not valid, or there is work
+ * for the locks: the data in a write-back buffer, a shrink to apply.
+ * In a locked filesystem, the other one takes no locks anyway.
+ */
+static bool filedesc_read_optimistic(struct ufs *fs, int fdi, char *buf, size_t size,
+		off_t offset, ssize_t *rc) {
+	unsigned fd_seq = atomic_load_explicit(&fs->fd_seq, memory_order_acquire);
+	int count = __atomic_load_n(&fs->file_descriptor_count, __ATOMIC_ACQUIRE);
+	if ((fd_seq & 1) || fdi < 0 || fdi >= count)
+		return false;
+	struct filedesc *fd = __atomic_load_n(&fs->file_descriptors, __ATOMIC_ACQUIRE) + fdi;
+	struct file *f = __atomic_load_n(&fd->file, __ATOMIC_RELAXED);
+	bool is_open = __atomic_load_n(&fd->open, __ATOMIC_RELAXED);
+	permbits perm = __atomic_load_n(&fd->perm, __ATOMIC_RELAXED);
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&fs->fd_seq, memory_order_relaxed) != fd_seq || !is_open ||
+	    !(perm & PERM_RD))
+		return false;
+
+	// The file is alive while its descriptor is open, which only this thread may close
+	unsigned seq = atomic_load_explicit(&f->seq, memory_order_acquire);
+	if ((seq & 1) || __atomic_load_n(&f->pending_fd, __ATOMIC_RELAXED) >= 0 ||
+	    (offset < 0 && __atomic_load_n(&fd->shrunk_to, __ATOMIC_RELAXED) != SIZE_MAX))
+		return false;
+	size_t pos = offset < 0 ? fd->pos : (size_t)offset;
+	size_t file_size = __atomic_load_n(&f->size, __ATOMIC_RELAXED);
+	size_t left = MIN(size, file_size - MIN(pos, file_size));
+	// The count first: the map is at least as long, see extent_map_grow()
+	size_t extent_count = __atomic_load_n(&f->extent_count, __ATOMIC_ACQUIRE);
+	char **extents = __atomic_load_n(&f->extents, __ATOMIC_ACQUIRE);
+	if (!extent_count && !fs->image.base) {
+		size_t cur = pos < INLINE_SIZE ? MIN(left, INLINE_SIZE - pos) : 0;
+		seq_read_copy(buf, f->inline_data + pos, cur);
+		memset(buf + cur, 0, left - cur);
+	} else {
+		size_t from;
+		char *to = buf;
+		for (size_t i = extent_at(pos, &from), n = left; n; ++i, from = 0) {
+			size_t cur = MIN(n, extent_size(i) - from);
+			char *e = i < extent_count ? __atomic_load_n(&extents[i], __ATOMIC_RELAXED) : NULL;
+			if (e)
+				seq_read_copy(to, e + from, cur);
+			else
+				memset(to, 0, cur);
+			to += cur;
+			n -= cur;
+		}
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&f->seq, memory_order_relaxed) != seq)
+		return false;
+
+	if (offset < 0) {
+		fd->pos = pos + left;
+		// The table may have been copied before the store, see fd_table_resize()
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&fs->fd_seq, memory_order_relaxed) != fd_seq) {
+			fs_rdlock(fs, &fs->fd_lock);
+			fs->file_descriptors[fdi].pos = pos + left;
+			fs_unlock(fs, &fs->fd_lock);
+		}
+	}
+	*rc = left;
+	return true;
+}
+
+ssize_t
+ufs_read_in(struct ufs *fs, int fdi, char *buf, const size_t size)
+{
+	ssize_t rc;
+	if (fs->is_locked && filedesc_read_optimistic(fs, fdi, buf, size, -1, &rc))
+		return rc;
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_RD, false);
+	if (!fd)
+		return -1;
+	rc = filedesc_read(fs, fd, buf, size, fd->pos);
+	fd->pos += rc;
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+ssize_t
+ufs_writev_in(struct ufs *fs, int fdi, const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_WR, true);
+	if (!fd)
+		return -1;
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i)
+		total += iov[i].iov_len;
+	size_t count = MIN(total, MAX_FILE_SIZE - MIN(fd->pos, MAX_FILE_SIZE));
+	if (total && !count) {
+		put_filedesc(fs, fd);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	size_t left = count;
+	for (int i = 0; i < iovcnt && left; ++i) {
+		size_t cur = MIN(iov[i].iov_len, left);
+		size_t written = file_write(fs, fd->file, fd->pos, iov[i].iov_base, cur);
+		fd->pos += written;
+		left -= written;
+		if (written < cur) {
+			// The image is full
+			count -= left;
+			break;
+		}
+	}
+	put_filedesc(fs, fd);
+	if (total && !count) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	return count;
+}
+
+ssize_t
+ufs_readv_in(struct ufs *fs, int fdi, const struct iovec *iov, int iovcnt)
+{
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_RD, false);
+	if (!fd)
+		return -1;
+	size_t count = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		ssize_t rc = filedesc_read(fs, fd, iov[i].iov_base, iov[i].iov_len, fd->pos);
+		fd->pos += rc;
+		count += rc;
+		if ((size_t)rc < iov[i].iov_len)
+			break;
+	}
+	put_filedesc(fs, fd);
+	return count;
+}
+
+ssize_t
+ufs_pwrite_in(struct ufs *fs, int fdi, const char *buf, size_t size, off_t offset)
+{
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_WR, true);
+	if (!fd)
+		return -1;
+	ssize_t rc;
+	if (offset < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		rc = -1;
+	} else {
+		rc = filedesc_write(fs, fd, buf, size, offset);
+	}
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+ssize_t
+ufs_pread_in(struct ufs *fs, int fdi, char *buf, size_t size, off_t offset)
+{
+	ssize_t rc;
+	if (fs->is_locked && offset >= 0 &&
+	    filedesc_read_optimistic(fs, fdi, buf, size, offset, &rc))
+		return rc;
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_RD, false);
+	if (!fd)
+		return -1;
+	if (offset < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		rc = -1;
+	} else {
+		rc = filedesc_read(fs, fd, buf, size, offset);
+	}
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+/** Read by ufs_map() in the holes. Never written. */
+static char extent_zeros[EXTENT_MAX];
+
+/** The extent of an iovec of ufs_map(), which is kept till ufs_unmap(). */
+struct extent_pin {
+	char *extent;
+	size_t index;
+	struct extent_share *share;
+};
+
+/**
+ * What ufs_map() returns `iov` of: the extents of the iovecs follow
+ * them, and then the copy of the inline data, if it is mapped.
+ */
+struct ufs_mapping {
+	struct ufs *fs;
+	struct extent_pin *pins;
+	struct iovec iov[];
+};
+
+ssize_t
+ufs_map_in(struct ufs *fs, int fdi, off_t offset, size_t len, struct iovec **iov, int *iovcnt)
+{
+	// Written, as the shares are put to it
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_RD, true);
+	if (!fd)
+		return -1;
+	if (offset < 0 || fs->image.base) {
+		// The blocks of an image are not shared, see file_clone()
+		ufs_error_code = offset < 0 ? UFS_ERR_INVALID_ARG : UFS_ERR_NOT_IMPLEMENTED;
+		put_filedesc(fs, fd);
+		return -1;
+	}
+	struct file *f = fd->file;
+	size_t pos = offset, count = MIN(len, f->size - MIN(pos, f->size)), n = 0;
+	size_t extent_offset, i = extent_at(pos, &extent_offset);
+	bool is_inline = file_is_inline(fs, f);
+	if (count && is_inline) {
+		n = 1;
+	} else if (count) {
+		size_t last_offset;
+		n = extent_at(pos + count - 1, &last_offset) - i + 1;
+	}
+	size_t size = sizeof (struct ufs_mapping) + n * (sizeof (struct iovec) +
+		      sizeof (struct extent_pin)) + (is_inline ? count : 0);
+	struct ufs_mapping *m = mustmalloc(size);
+	m->fs = fs;
+	m->pins = (struct extent_pin *)(m->iov + n);
+	if (is_inline && count) {
+		// Copied, it is cheaper than to pin the file
+		char *copy = (char *)(m->pins + n);
+		file_read(fs, f, pos, copy, count);
+		m->pins[0] = (struct extent_pin){.share = NULL};
+		m->iov[0] = (struct iovec){copy, count};
+	}
+	size_t rest = count;
+	for (size_t k = 0; k < n && !is_inline; ++k, ++i, extent_offset = 0) {
+		size_t cur = MIN(rest, extent_size(i) - extent_offset);
+		char *e = i < f->extent_count ? f->extents[i] : NULL;
+		m->pins[k] = (struct extent_pin){e, i, e ? extent_share(f, i) : NULL};
+		m->iov[k] = (struct iovec){(e ? e : extent_zeros) + extent_offset, cur};
+		rest -= cur;
+	}
+	put_filedesc(fs, fd);
+	*iov = m->iov;
+	*iovcnt = n;
+	return count;
+}
+
+void
+ufs_unmap(struct iovec *iov)
+{
+	struct ufs_mapping *m = (struct ufs_mapping *)((char *)iov - offsetof(struct ufs_mapping, iov));
+	size_t n = (struct iovec *)m->pins - m->iov;
+	for (size_t k = 0; k < n; ++k) {
+		if (m->pins[k].share)
+			extent_drop(m->fs, m->pins[k].index, m->pins[k].extent, m->pins[k].share);
+	}
+	free(m);
+}
+
+/**
+ * The operations of ufs_submit() and their results. A submitted one
+ * is a completed one: so `sq_tail - cq_head`, the count of both, never
+ * exceeds `mask + 1`.
+ */
+struct ufs_ring {
+	struct ufs *fs;
+	unsigned mask;
+	unsigned sq_head, sq_tail;
+	unsigned cq_head, cq_tail;
+	struct ufs_sqe *sq;
+	struct ufs_cqe *cq;
+};
+
+struct ufs_ring *
+ufs_ring_new_in(struct ufs *fs, unsigned entries)
+{
+	unsigned size = 1;
+	while (size < entries)
+		size *= 2;
+	struct ufs_ring *ring = mustmalloc(sizeof (*ring));
+	*ring = (struct ufs_ring){.fs = fs, .mask = size - 1};
+	ring->sq = mustmalloc(size * sizeof (*ring->sq));
+	ring->cq = mustmalloc(size * sizeof (*ring->cq));
+	return ring;
+}
+
+void
+ufs_ring_free(struct ufs_ring *ring)
+{
+	free(ring->sq);
+	free(ring->cq);
+	free(ring);
+}
+
+struct ufs_sqe *
+ufs_get_sqe(struct ufs_ring *ring)
+{
+	if (ring->sq_tail - ring->cq_head > ring->mask)
+		return NULL;
+	struct ufs_sqe *sqe = &ring->sq[ring->sq_tail++ & ring->mask];
+	*sqe = (struct ufs_sqe){.fd = -1, .offset = -1};
+	return sqe;
+}
+
+static void ring_complete(struct ufs_ring *ring, const struct ufs_sqe *sqe, ssize_t res) {
+	ring->cq[ring->cq_tail++ & ring->mask] = (struct ufs_cqe){
+		.user_data = sqe->user_data,
+		.res = res,
+		.error = res < 0 ? ufs_error_code : UFS_ERR_NO_ERR,
+	};
+}
+
+/**
+ * Do the reads and the writes from the head of the ring, up to another
+ * operation: under one fd_lock, and a file stays locked while the next
+ * operation is on it too.
+ */
+static void ring_rw(struct ufs_ring *ring) {
+	struct ufs *fs = ring->fs;
+	struct file *locked = NULL;
+	bool is_locked_write = false;
+	fs_rdlock(fs, &fs->fd_lock);
+	for (; ring->sq_head != ring->sq_tail; ++ring->sq_head) {
+		const struct ufs_sqe *sqe = &ring->sq[ring->sq_head & ring->mask];
+		bool is_write = sqe->op == UFS_OP_WRITE;
+		if (!is_write && sqe->op != UFS_OP_READ)
+			break;
+		ssize_t res = -1;
+		struct filedesc *fd = check_filedesc(fs, sqe->fd, is_write ? PERM_WR : PERM_RD);
+		if (fd && (fd->file != locked || is_write > is_locked_write)) {
+			if (locked)
+				file_unlock(fs, locked);
+			locked = fd->file;
+			is_locked_write = is_write;
+			if (is_write)
+				file_wrlock(fs, locked);
+			else
+				fs_rdlock(fs, &locked->lock);
+		}
+		if (fd && locked->pending_fd >= 0) {
+			// The data in a write-back buffer, see ufs_write_in()
+			if (!is_locked_write) {
+				fs_unlock(fs, &locked->lock);
+				file_wrlock(fs, locked);
+				is_locked_write = true;
+			}
+			file_commit(fs, locked);
+		}
+		if (fd)
+			filedesc_apply_shrink(fd);
+		if (fd && sqe->offset < -1) {
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+		} else if (fd) {
+			size_t pos = sqe->offset == -1 ? fd->pos : (size_t)sqe->offset;
+			res = is_write ? filedesc_write(fs, fd, sqe->buf, sqe->len, pos) :
+					 filedesc_read(fs, fd, sqe->buf, sqe->len, pos);
+			if (res > 0 && sqe->offset == -1)
+				fd->pos += res;
+		}
+		ring_complete(ring, sqe, res);
+	}
+	if (locked)
+		file_unlock(fs, locked);
+	fs_unlock(fs, &fs->fd_lock);
+}
+
+int
+ufs_submit(struct ufs_ring *ring)
+{
+	int count = ring->sq_tail - ring->sq_head;
+	while (ring->sq_head != ring->sq_tail) {
+		const struct ufs_sqe *sqe = &ring->sq[ring->sq_head & ring->mask];
+		ssize_t res;
+		switch (sqe->op) {
+		case UFS_OP_READ:
+		case UFS_OP_WRITE:
+			ring_rw(ring);
+			continue;
+		case UFS_OP_OPEN:
+			res = ufs_open_in(ring->fs, sqe->path, sqe->flags);
+			break;
+		case UFS_OP_CLOSE:
+			res = ufs_close_in(ring->fs, sqe->fd);
+			break;
+		default:
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+			res = -1;
+		}
+		ring_complete(ring, sqe, res);
+		++ring->sq_head;
+	}
+	return count;
+}
+
+int
+ufs_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count)
+{
+	int n = 0;
+	for (; n < count && ring->cq_head != ring->cq_tail; ++n)
+		cqes[n] = ring->cq[ring->cq_head++ & ring->mask];
+	return n;
+}
+
+off_t
+ufs_seek_in(struct ufs *fs, int fdi, off_t offset, int whence)
+{
+	struct filedesc *fd = get_filedesc(fs, fdi, 0, false);
+	if (!fd)
+		return -1;
+	off_t base, rc = -1;
+	switch (whence) {
+	case UFS_SEEK_SET: base = 0; break;
+	case UFS_SEEK_CUR: base = fd->pos; break;
+	case UFS_SEEK_END: base = fd->file->size; break;
+	default:
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	if (offset < -base) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	fd->pos = base + offset;
+	rc = fd->pos;
+out:
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+/**
+ * Free `f` on the teardown. The extents in the slabs or in the image
+ * are not touched: they go with the whole slabs or the mapping, only
+ * the big ones are unmapped.
+ */
+static void file_teardown(struct ufs *fs, struct file *f) {
+	for (size_t i = 0; i < f->extent_count && !fs->image.base; ++i) {
+		if (!f->extents[i])
+			continue;
+		struct extent_share *share = f->shares[i];
+		if (share && atomic_fetch_sub_explicit(&share->refs, 1, memory_order_acq_rel) > 1)
+			continue;
+		free(share);
+		if (!extent_is_slab(fs, extent_size(i)))
+			(void)munmap(f->extents[i], extent_size(i));
+	}
+	extent_map_free(f);
+	free(f->shares);
+	if (f->dir)
+		dir_free(f->dir);
+	pthread_rwlock_destroy(&f->lock);
+	free(f);
+}
+
+/** Tear down the slots of a table. A file is in either of its arrays. */
+static void slots_teardown(struct ufs *fs, struct file_slot *slots, size_t capacity) {
+	for (size_t i = 0; i < capacity; ++i) {
+		struct file *f = slots[i].file;
+		if (f && f != &file_tombstone)
+			file_teardown(fs, f);
+	}
+	free(slots);
+}
+
+/** Tear down all the files of the tables. */
+static void file_tables_teardown(struct ufs *fs) {
+	for (int i = 0; i < FILE_TABLE_SHARDS; ++i) {
+		struct file_table *t = &fs->file_tables[i];
+		slots_teardown(fs, t->slots, t->capacity);
+		slots_teardown(fs, t->old, t->old_capacity);
+		*t = (struct file_table){.lock = PTHREAD_MUTEX_INITIALIZER};
+	}
+	free(fs->root.entries);
+	fs->root = (struct dir){.lock = PTHREAD_MUTEX_INITIALIZER};
+}
+
+int
+ufs_close_in(struct ufs *fs, int fdi)
+{
+	reclaim_step(fs);
+	// Before fd_lock is taken for writing, the rest go on meanwhile
+	if (fs->is_dedup && !fs->image.base) {
+		struct filedesc *fd = get_filedesc(fs, fdi, 0, true);
+		if (!fd)
+			return -1;
+		if (fd->perm & PERM_WR)
+			file_dedup(fs, fd->file);
+		put_filedesc(fs, fd);
+	}
+	fs_wrlock(fs, &fs->fd_lock);
+	struct filedesc *fd = check_filedesc(fs, fdi, 0);
+	if (!fd) {
+		fs_unlock(fs, &fs->fd_lock);
+		return -1;
+	}
+
+	struct file *f = fd->file;
+	// No one else locks the file under fd_lock for writing, but the readers with no locks
+	seq_write_begin(fs, &f->seq);
+	filedesc_commit(fs, fd);
+	seq_write_end(fs, &f->seq);
+	free(fd->wb);
+	del_fd(fs, fdi);
+	f->refs--;
+
+	if (!f->refs && f->ghost)
+		destroy_file(fs, f);
+
+	fs_unlock(fs, &fs->fd_lock);
+	return 0;
+}
+
+/**
+ * Make `dst` share the extents of `src`. With an image mounted they are
+ * copied instead, as its table has no place for the sharing. Returns
+ * `false` if the image is full.
+ */
+static bool file_clone(struct ufs *fs, struct file *dst, struct file *src) {
+	extent_map_grow(dst, src->extent_count);
+	dst->size = src->size;
+	if (file_is_inline(fs, src))
+		memcpy(dst->inline_data, src->inline_data, MIN(src->size, (size_t)INLINE_SIZE));
+	for (size_t i = 0; i < src->extent_count; ++i) {
+		if (!src->extents[i])
+			continue;
+		if (fs->image.base) {
+			dst->extents[i] = extent_alloc(fs, i);
+			if (!dst->extents[i])
+				return false;
+			memcpy(dst->extents[i], src->extents[i], extent_size(i));
+			continue;
+		}
+		dst->shares[i] = extent_share(src, i);
+		dst->extents[i] = src->extents[i];
+	}
+	return true;
+}
+
+int
+ufs_clone_in(struct ufs *fs, const char *src, const char *dst)
+{
+	size_t src_len = strlen(src), src_hash = name_hash(src, src_len);
+	size_t dst_len = strlen(dst), dst_hash = name_hash(dst, dst_len);
+	struct file_table *src_t = file_table_of(fs, src_hash), *dst_t = file_table_of(fs, dst_hash);
+	struct table_set set = {{src_t, dst_t, parent_table(fs, dst)}};
+	tables_lock(fs, &set);
+
+	int rc = -1;
+	struct file_slot *slot = file_table_find(src_t, src, src_len, src_hash);
+	struct dir *parent = parent_dir(fs, dst);
+	if (!slot || !parent) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		goto out;
+	}
+	if (slot->file->dir || !name_is_valid(dst) || file_table_find(dst_t, dst, dst_len, dst_hash)) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		goto out;
+	}
+	struct file *f = slot->file, *clone = file_new(dst);
+	// Written, as the shares are put to it. The descriptors may have its data
+	fs_rdlock(fs, &fs->fd_lock);
+	file_wrlock(fs, f);
+	file_commit(fs, f);
+	bool is_cloned = file_clone(fs, clone, f);
+	file_unlock(fs, f);
+	fs_unlock(fs, &fs->fd_lock);
+	if (!is_cloned) {
+		destroy_file(fs, clone);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	file_table_insert(dst_t, clone, dst_hash);
+	dir_add(fs, parent, clone);
+	rc = 0;
+out:
+	tables_unlock(fs, &set);
+	return rc;
+}
+
+int
+ufs_delete_in(struct ufs *fs, const char *filename)
+{
+	size_t len = strlen(filename), hash = name_hash(filename, len);
+	struct file_table *t = file_table_of(fs, hash);
+	fs_mutex_lock(fs, &t->lock);
+	struct file_slot *slot = file_table_find(t, filename, len, hash);
+	if (!slot || slot->file->dir) {
+		fs_mutex_unlock(fs, &t->lock);
+		ufs_error_code = slot ? UFS_ERR_INVALID_ARG : UFS_ERR_NO_FILE;
+		return -1;
+	}
+	struct file *f = slot->file;
+	// Not findable anymore, even if it lives on as a ghost
+	slot->file = &file_tombstone;
+	--t->count;
+	dir_remove(fs, f);
+
+	fs_wrlock(fs, &fs->fd_lock);
+	if (!f->refs)
+		destroy_file(fs, f);
+	else
+		f->ghost = true;
+	fs_unlock(fs, &fs->fd_lock);
+	fs_mutex_unlock(fs, &t->lock);
+
+	return 0;
+}
+
+int
+ufs_mkdir_in(struct ufs *fs, const char *path)
+{
+	size_t len = strlen(path), hash = name_hash(path, len);
+	struct file_table *t = file_table_of(fs, hash);
+	struct table_set set = {{t, parent_table(fs, path)}};
+	tables_lock(fs, &set);
+	int rc = -1;
+	struct dir *parent = parent_dir(fs, path);
+	if (!parent) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	} else if (!name_is_valid(path) || file_table_find(t, path, len, hash)) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	} else {
+		struct file *f = ins_new_file(t, path, hash);
+		f->dir = dir_new();
+		dir_add(fs, parent, f);
+		rc = 0;
+	}
+	tables_unlock(fs, &set);
+	return rc;
+}
+
+int
+ufs_rmdir_in(struct ufs *fs, const char *path)
+{
+	size_t len = strlen(path), hash = name_hash(path, len);
+	struct file_table *t = file_table_of(fs, hash);
+	fs_mutex_lock(fs, &t->lock);
+	struct file_slot *slot = file_table_find(t, path, len, hash);
+	struct file *f = slot ? slot->file : NULL;
+	int rc = -1;
+	if (!f) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+	} else if (!f->dir) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+	} else if (dir_count(fs, f->dir)) {
+		// An entry is only added under the lock of this table, so it stays empty
+		ufs_error_code = UFS_ERR_NOT_EMPTY;
+	} else {
+		slot->file = &file_tombstone;
+		--t->count;
+		dir_remove(fs, f);
+		file_teardown(fs, f);
+		rc = 0;
+	}
+	fs_mutex_unlock(fs, &t->lock);
+	return rc;
+}
+
+struct ufs_dir *
+ufs_opendir_in(struct ufs *fs, const char *path)
+{
+	size_t len = strlen(path), hash = name_hash(path, len);
+	struct file_table *t = file_table_of(fs, hash);
+	fs_mutex_lock(fs, &t->lock);
+	struct dir *d = &fs->root;
+	if (len) {
+		struct file_slot *slot = file_table_find(t, path, len, hash);
+		d = slot ? slot->file->dir : NULL;
+		if (!d) {
+			fs_mutex_unlock(fs, &t->lock);
+			ufs_error_code = slot ? UFS_ERR_INVALID_ARG : UFS_ERR_NO_FILE;
+			return NULL;
+		}
+	}
+	// A snapshot, in one allocation: the entries, then their names
+	fs_mutex_lock(fs, &d->lock);
+	size_t names_size = 0, skip = len ? len + 1 : 0;
+	for (size_t i = 0; i < d->count; ++i)
+		names_size += strlen(d->entries[i]->name) - skip + 1;
+	struct ufs_dir *res = mustmalloc(sizeof (*res) + d->count * sizeof (struct ufs_dirent) +
+					 names_size);
+	res->count = d->count;
+	res->pos = 0;
+	char *names = (char *)(res->entries + d->count);
+	for (size_t i = 0; i < d->count; ++i) {
+		const char *name = d->entries[i]->name + skip;
+		size_t size = strlen(name) + 1;
+		memcpy(names, name, size);
+		res->entries[i] = (struct ufs_dirent){.name = names, .is_dir = d->entries[i]->dir != NULL};
+		names += size;
+	}
+	fs_mutex_unlock(fs, &d->lock);
+	fs_mutex_unlock(fs, &t->lock);
+	return res;
+}
+
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir)
+{
+	return dir->pos < dir->count ? &dir->entries[dir->pos++] : NULL;
+}
+
+void
+ufs_closedir(struct ufs_dir *dir)
+{
+	free(dir);
+}
+
+#ifdef NEED_RESIZE
+
+/** Shrink `f` to `size`, which is less than its size. */
+static void file_shrink(struct ufs *fs, struct file *f, size_t size) {
+	size_t keep = 0;
+	if (size) {
+		size_t offset;
+		keep = MIN(extent_at(size - 1, &offset) + 1, f->extent_count);
+	}
+	for (size_t i = keep; i < f->extent_count; ++i)
+		extent_release(fs, f, i);
+	__atomic_store_n(&f->extent_count, keep, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->size, size, __ATOMIC_RELAXED);
+
+	/*
+	 * The descriptors past the end proceed from it, on their next use:
+	 * their readers with no locks store the positions meanwhile.
+	 */
+	for (int i = 0; i < fs->file_descriptor_count; ++i) {
+		struct filedesc *fd = &fs->file_descriptors[i];
+		if (fd->open && fd->file == f)
+			__atomic_store_n(&fd->shrunk_to, MIN(fd->shrunk_to, size), __ATOMIC_RELAXED);
+	}
+}
+
+int
+ufs_resize_in(struct ufs *fs, int fdi, size_t new_size)
+{
+	struct filedesc *fd = get_filedesc(fs, fdi, PERM_WR, true);
+	if (!fd)
+		return -1;
+	int rc = 0;
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		rc = -1;
+	} else if (new_size < fd->file->size) {
+		file_shrink(fs, fd->file, new_size);
+	} else {
+		file_extend(fs, fd->file, new_size);
+	}
+	put_filedesc(fs, fd);
+	return rc;
+}
+
+#endif
+
+/*
+ * The image is
+ *
+ *     superblock             struct ufs_superblock, in a page
+ *     block bitmap           a bit per block, set if used, in pages
+ *     data blocks            of BLOCK_SIZE
+ *
+ * The inode table is in data blocks too: a u64 count of the files and
+ * the directories, then for each one its u64 kind (IMAGE_FILE or
+ * IMAGE_DIR), u64 size, u64 count of extents, u64 length of the name,
+ * the name padded to 8 bytes, and the u64 first block of each extent
+ * (IMAGE_HOLE for a hole). A directory is written before its entries,
+ * and has no extents. An extent of size S takes S /
+ * BLOCK_SIZE blocks, aligned to their count.
+ *
+ * The data is written right into the mapped image. ufs_sync() writes
+ * a new inode table into free blocks, msync()s the image, then points
+ * the superblock to the new table, and frees the old one. So after a
+ * crash the last synced table is found, and the bitmap is rebuilt from
+ * it on mount.
+ */
+
+/** FNV-1a of the inode table. */
+static uint64_t image_checksum(const char *data, size_t size) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; ++i)
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/** Append `len` bytes of `src`, padded to 8, to `*buf` of `*size` and `*capacity` bytes. */
+static void table_put(char **buf, size_t *size, size_t *capacity, const void *src, size_t len) {
+	size_t padded = (len + 7) & ~(size_t)7;
+	if (*size + padded > *capacity) {
+		*capacity = MAX(*size + padded, *capacity * 2);
+		mustrealloc((void **)buf, *capacity);
+	}
+	memcpy(*buf + *size, src, len);
+	memset(*buf + *size + len, 0, padded - len);
+	*size += padded;
+}
+
+static void table_put_u64(char **buf, size_t *size, size_t *capacity, uint64_t value) {
+	table_put(buf, size, capacity, &value, sizeof(value));
+}
+
+/** Serialize the entries of `d` and of its subdirectories, counting them in `*count`. */
+static void image_table_dir(struct ufs *fs, struct dir *d, char **buf, size_t *size,
+		size_t *capacity, size_t *count) {
+	for (size_t i = 0; i < d->count; ++i) {
+		struct file *f = d->entries[i];
+		fs_rdlock(fs, &f->lock);
+		table_put_u64(buf, size, capacity, f->dir ? IMAGE_DIR : IMAGE_FILE);
+		table_put_u64(buf, size, capacity, f->size);
+		table_put_u64(buf, size, capacity, f->extent_count);
+		table_put_u64(buf, size, capacity, strlen(f->name));
+		table_put(buf, size, capacity, f->name, strlen(f->name));
+		for (size_t k = 0; k < f->extent_count; ++k) {
+			uint64_t b = f->extents[k] ?
+				(uint64_t)(f->extents[k] - fs->image.data) / BLOCK_SIZE :
+				(uint64_t)IMAGE_HOLE;
+			table_put_u64(buf, size, capacity, b);
+		}
+		fs_unlock(fs, &f->lock);
+		++*count;
+		if (f->dir)
+			image_table_dir(fs, f->dir, buf, size, capacity, count);
+	}
+}
+
+/** Serialize the files and the directories, parents first, allocated. */
+static char *image_table(struct ufs *fs, size_t *size) {
+	size_t capacity = IMAGE_PAGE, count = 0;
+	char *buf = mustmalloc(capacity);
+	*size = 0;
+	table_put_u64(&buf, size, &capacity, 0);
+	image_table_dir(fs, &fs->root, &buf, size, &capacity, &count);
+	memcpy(buf, &(uint64_t){count}, sizeof(uint64_t));
+	return buf;
+}
+
+int
+ufs_sync_in(struct ufs *fs)
+{
+	if (!fs->image.base)
+		return 0;
+	// Nothing changes meanwhile
+	for (int i = 0; i < FILE_TABLE_SHARDS; ++i)
+		fs_mutex_lock(fs, &fs->file_tables[i].lock);
+	fs_wrlock(fs, &fs->fd_lock);
+
+	int rc = -1;
+	size_t size;
+	char *table = image_table(fs, &size);
+	fs_mutex_lock(fs, &fs->extent_pool.lock);
+	size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t b = image_alloc(fs, blocks, 1);
+	fs_mutex_unlock(fs, &fs->extent_pool.lock);
+	if (b == SIZE_MAX) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		goto out;
+	}
+	memcpy(fs->image.data + b * BLOCK_SIZE, table, size);
+	if (msync(fs->image.base, fs->image.size, MS_SYNC) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		goto out;
+	}
+	struct ufs_superblock *sb = fs->image.sb;
+	size_t old_block = sb->table_block, old_blocks = (sb->table_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	sb->table_block = b;
+	sb->table_size = size;
+	sb->table_checksum = image_checksum(table, size);
+	if (msync(fs->image.base, IMAGE_PAGE, MS_SYNC) != 0) {
+		ufs_error_code = UFS_ERR_IO;
+		goto out;
+	}
+	if (old_blocks) {
+		fs_mutex_lock(fs, &fs->extent_pool.lock);
+		image_mark(fs, old_block, old_blocks, false);
+		fs_mutex_unlock(fs, &fs->extent_pool.lock);
+	}
+	rc = 0;
+out:
+	free(table);
+	fs_unlock(fs, &fs->fd_lock);
+	for (int i = FILE_TABLE_SHARDS - 1; i >= 0; --i)
+		fs_mutex_unlock(fs, &fs->file_tables[i].lock);
+	return rc;
+}
+
+/** Reading of the inode table of the image. */
+struct table_reader {
+	const char *pos, *end;
+	bool is_bad;
+};
+
+static uint64_t table_get_u64(struct table_reader *r) {
+	uint64_t value = 0;
+	if (r->end - r->pos < (ptrdiff_t)sizeof(value)) {
+		r->is_bad = true;
+		return 0;
+	}
+	memcpy(&value, r->pos, sizeof(value));
+	r->pos += sizeof(value);
+	return value;
+}
+
+/** Create the files of the inode table of the image. Returns `false` if it is damaged. */
+static bool image_load_table(struct ufs *fs) {
+	const struct ufs_superblock *sb = fs->image.sb;
+	if (!sb->table_size)
+		return true;
+	size_t blocks = (sb->table_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (sb->table_block >= fs->image.block_count || blocks > fs->image.block_count - sb->table_block)
+		return false;
+	const char *table = fs->image.data + sb->table_block * BLOCK_SIZE;
+	if (image_checksum(table, sb->table_size) != sb->table_checksum)
+		return false;
+	image_mark(fs, sb->table_block, blocks, true);
+
+	struct table_reader r = {table, table + sb->table_size, false};
+	uint64_t count = table_get_u64(&r);
+	for (uint64_t n = 0; n < count && !r.is_bad; ++n) {
+		uint64_t kind = table_get_u64(&r), size = table_get_u64(&r);
+		uint64_t extents = table_get_u64(&r), name_len = table_get_u64(&r);
+		size_t offset;
+		if (r.is_bad || kind > IMAGE_DIR || size > MAX_FILE_SIZE ||
+		    name_len > (uint64_t)(r.end - r.pos) || (kind == IMAGE_DIR && extents) ||
+		    extents > (size ? extent_at(size - 1, &offset) + 1 : 0) || memchr(r.pos, 0, name_len))
+			return false;
+		char *name = mustmalloc(name_len + 1);
+		memcpy(name, r.pos, name_len);
+		name[name_len] = 0;
+		r.pos += (name_len + 7) & ~(uint64_t)7;
+		size_t hash = name_hash(name, name_len);
+		struct file_table *t = file_table_of(fs, hash);
+		// The directory is loaded before
+		struct dir *parent = name_is_valid(name) ? parent_dir(fs, name) : NULL;
+		bool is_bad = r.pos > r.end || !parent || file_table_find(t, name, name_len, hash);
+		struct file *f = is_bad ? NULL : ins_new_file(t, name, hash);
+		free(name);
+		if (is_bad)
+			return false;
+		if (kind == IMAGE_DIR)
+			f->dir = dir_new();
+		dir_add(fs, parent, f);
+		extent_map_grow(f, extents);
+		f->size = size;
+		for (size_t i = 0; i < extents; ++i) {
+			uint64_t b = table_get_u64(&r);
+			if (b == (uint64_t)IMAGE_HOLE)
+				continue;
+			size_t blocks = extent_size(i) / BLOCK_SIZE;
+			if (r.is_bad || b % blocks || b >= fs->image.block_count ||
+			    blocks > fs->image.block_count - b || !image_is_free(fs, b, blocks))
+				return false;
+			image_mark(fs, b, blocks, true);
+			f->extents[i] = fs->image.data + b * BLOCK_SIZE;
+		}
+	}
+	return !r.is_bad;
+}
+
+/** Unmap the image, without syncing. */
+static void image_unmap(struct ufs *fs) {
+	if (fs->image.base)
+		(void)munmap(fs->image.base, fs->image.size);
+	if (fs->image.fd >= 0)
+		(void)close(fs->image.fd);
+	fs->image = (struct ufs_image){.fd = -1};
+}
+
+int
+ufs_mount_in(struct ufs *fs, const char *path)
+{
+	bool is_empty = !fs->image.base && !fs->file_descriptor_count;
+	for (int i = 0; i < FILE_TABLE_SHARDS && is_empty; ++i)
+		is_empty = !fs->file_tables[i].count;
+	if (!is_empty) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	ufs_error_code = UFS_ERR_IO;
+	fs->image.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	struct stat st;
+	if (fs->image.fd < 0 || fstat(fs->image.fd, &st) != 0)
+		goto fail;
+
+	struct ufs_superblock sb;
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		// A sparse file: the blocks take the disk space only when written
+		sb = (struct ufs_superblock){.version = IMAGE_VERSION, .block_size = BLOCK_SIZE,
+					     .block_count = UFS_IMAGE_SIZE / BLOCK_SIZE,
+					     .bitmap_offset = IMAGE_PAGE};
+		memcpy(sb.magic, image_magic, sizeof(image_magic));
+		size_t bitmap_size = (sb.block_count + 63) / 64 * sizeof(uint64_t);
+		sb.data_offset = (sb.bitmap_offset + bitmap_size + IMAGE_PAGE - 1) / IMAGE_PAGE * IMAGE_PAGE;
+		st.st_size = sb.data_offset + sb.block_count * BLOCK_SIZE;
+		if (ftruncate(fs->image.fd, st.st_size) != 0)
+			goto fail;
+	} else if (st.st_size < IMAGE_PAGE || pread(fs->image.fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+		goto fail;
+	}
+	if (memcmp(sb.magic, image_magic, sizeof(image_magic)) || sb.version != IMAGE_VERSION ||
+	    sb.block_size != BLOCK_SIZE || sb.bitmap_offset < sizeof(sb) ||
+	    sb.data_offset < sb.bitmap_offset + (sb.block_count + 63) / 64 * sizeof(uint64_t) ||
+	    sb.data_offset % IMAGE_PAGE || (uint64_t)st.st_size < sb.data_offset ||
+	    ((uint64_t)st.st_size - sb.data_offset) / BLOCK_SIZE < sb.block_count)
+		goto fail;
+
+	fs->image.size = st.st_size;
+	fs->image.base = mmap(NULL, fs->image.size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->image.fd, 0);
+	if (fs->image.base == MAP_FAILED) {
+		fs->image.base = NULL;
+		goto fail;
+	}
+	fs->image.sb = (struct ufs_superblock *)fs->image.base;
+	fs->image.bitmap = (uint64_t *)(fs->image.base + sb.bitmap_offset);
+	fs->image.data = fs->image.base + sb.data_offset;
+	fs->image.block_count = sb.block_count;
+	if (is_new)
+		*fs->image.sb = sb;
+	// Rebuilt from the inode table: the blocks allocated after the last sync are free
+	memset(fs->image.bitmap, 0, (sb.block_count + 63) / 64 * sizeof(uint64_t));
+	if (!image_load_table(fs)) {
+		file_tables_teardown(fs);
+		goto fail;
+	}
+	ufs_error_code = UFS_ERR_NO_ERR;
+	return 0;
+
+fail:
+	image_unmap(fs);
+	return -1;
+}
+
+/** Free everything of `fs`, it is to be initialized anew to be used again. */
+static void fs_destroy(struct ufs *fs) {
+	// The files stay in the image
+	if (fs->image.base)
+		(void)ufs_sync_in(fs);
+	for (struct file *f = fs->dead, *next; f; f = next) {
+		next = f->next_dead;
+		file_teardown(fs, f);
+	}
+	fs->dead = NULL;
+	// The deleted files which are still open are only known by their descriptors
+	for (int i = 0; i < fs->file_descriptor_count; ++i) {
+		struct filedesc *fd = &fs->file_descriptors[i];
+		if (fd->open)
+			free(fd->wb);
+		if (fd->open && fd->file->ghost && !--fd->file->refs)
+			file_teardown(fs, fd->file);
+	}
+	free(fs->file_descriptors);
+	for (int i = 0; i < fs->fd_retired_count; ++i)
+		free(fs->fd_retired[i]);
+	fs->fd_retired_count = 0;
+	free(fs->fd_open_bits);
+	free(fs->fd_full_bits);
+	fs->file_descriptors = NULL;
+	fs->fd_open_bits = fs->fd_full_bits = NULL;
+	fs->file_descriptor_count = fs->file_descriptor_capacity = 0;
+	file_tables_teardown(fs);
+	// The shares there are gone with the files
+	free(fs->dedup.buckets);
+	fs->dedup = (struct dedup_table){.lock = PTHREAD_MUTEX_INITIALIZER};
+	image_unmap(fs);
+	extent_pool_destroy(fs);
+}
+
+struct ufs *
+ufs_new(int flags)
+{
+	struct ufs *fs = mustmalloc(sizeof (*fs));
+	*fs = (struct ufs)UFS_INITIALIZER;
+	fs->is_locked = !(flags & UFS_NEW_SINGLE_THREAD);
+	fs->is_dedup = flags & UFS_NEW_DEDUP;
+	fs->is_hugepages = flags & UFS_NEW_HUGEPAGES;
+	return fs;
+}
+
+void
+ufs_free(struct ufs *fs)
+{
+	fs_destroy(fs);
+	free(fs);
+}
+
+void
+ufs_destroy(void)
+{
+	fs_destroy(&ufs_default);
+	ufs_default = (struct ufs)UFS_INITIALIZER;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	return ufs_open_in(&ufs_default, filename, flags);
+}
+
+ssize_t
+ufs_write(int fdi, const char *buf, const size_t size)
+{
+	return ufs_write_in(&ufs_default, fdi, buf, size);
+}
+
+ssize_t
+ufs_read(int fdi, char *buf, const size_t size)
+{
+	return ufs_read_in(&ufs_default, fdi, buf, size);
+}
+
+ssize_t
+ufs_writev(int fdi, const struct iovec *iov, int iovcnt)
+{
+	return ufs_writev_in(&ufs_default, fdi, iov, iovcnt);
+}
+
+ssize_t
+ufs_readv(int fdi, const struct iovec *iov, int iovcnt)
+{
+	return ufs_readv_in(&ufs_default, fdi, iov, iovcnt);
+}
+
+ssize_t
+ufs_pwrite(int fdi, const char *buf, size_t size, off_t offset)
+{
+	return ufs_pwrite_in(&ufs_default, fdi, buf, size, offset);
+}
+
+ssize_t
+ufs_pread(int fdi, char *buf, size_t size, off_t offset)
+{
+	return ufs_pread_in(&ufs_default, fdi, buf, size, offset);
+}
+
+off_t
+ufs_seek(int fdi, off_t offset, int whence)
+{
+	return ufs_seek_in(&ufs_default, fdi, offset, whence);
+}
+
+ssize_t
+ufs_map(int fdi, off_t offset, size_t len, struct iovec **iov, int *iovcnt)
+{
+	return ufs_map_in(&ufs_default, fdi, offset, len, iov, iovcnt);
+}
+
+struct ufs_ring *
+ufs_ring_new(unsigned entries)
+{
+	return ufs_ring_new_in(&ufs_default, entries);
+}
+
+int
+ufs_close(int fdi)
+{
+	return ufs_close_in(&ufs_default, fdi);
+}
+
+int
+ufs_clone(const char *src, const char *dst)
+{
+	return ufs_clone_in(&ufs_default, src, dst);
+}
+
+int
+ufs_delete(const char *filename)
+{
+	return ufs_delete_in(&ufs_default, filename);
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	return ufs_mkdir_in(&ufs_default, path);
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	return ufs_rmdir_in(&ufs_default, path);
+}
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+	return ufs_opendir_in(&ufs_default, path);
+}
+
+#ifdef NEED_RESIZE
+
+int
+ufs_resize(int fdi, size_t new_size)
+{
+	return ufs_resize_in(&ufs_default, fdi, new_size);
+}
+
+#endif
+
+int
+ufs_sync(void)
+{
+	return ufs_sync_in(&ufs_default);
+}
+
+int
+ufs_mount(const char *path)
+{
+	return ufs_mount_in(&ufs_default, path);
 }
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * has an unique path: the names of the directories it is in and
+ * its own name, separated by '/', such as "dir/subdir/file". A
+ * path is resolved at once, not a directory after another, so
+ * the depth costs nothing but the length of the path.
  */
 
 /**
@@ -15,6 +20,7 @@
  * allow advanced flags, do this here:
  *
  *     #define NEED_OPEN_FLAGS
+#define NEED_RESIZE
  *
  * To allow resize() functions define this:
  *
@@ -25,6 +31,7 @@
  */
 
 #define NEED_OPEN_FLAGS
+#define NEED_RESIZE
 
 /**
  * Flags for ufs_open call.
@@ -62,6 +69,12 @@ enum ufs_error_code {
 	UFS_ERR_NO_FILE,
 	UFS_ERR_NO_MEM,
 	UFS_ERR_NOT_IMPLEMENTED,
+	/** A negative offset or count, or an unknown `whence`. */
+	UFS_ERR_INVALID_ARG,
+	/** The image can not be read or written, or it is damaged. */
+	UFS_ERR_IO,
+	/** The directory has entries. */
+	UFS_ERR_NOT_EMPTY,
 
 #ifdef NEED_OPEN_FLAGS
 
@@ -81,13 +94,20 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no directory to create it in.
+ *     - UFS_ERR_INVALID_ARG - it is a directory, or the name to
+ *       create has an empty component.
  */
 int
 ufs_open(const char *filename, int flags);
 
 /**
  * Write data to the file.
+ *
+ * The short writes are gathered by the descriptor and put to the file
+ * in bigger pieces, but not in an image: that is invisible, any other
+ * use of the file gets the data first.
+ *
  * @param fd File descriptor from ufs_open().
  * @param buf Buffer to write.
  * @param size Size of @a buf.
@@ -114,6 +134,211 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write the buffers of @a iov one after another to the file, like
+ * ufs_write() of each of them, with a single call.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of @a iov.
+ *
+ * @retval >= 0 How many bytes were written, in total.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read from the file into the buffers of @a iov one after another,
+ * like ufs_read() into each of them, with a single call.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Number of @a iov.
+ *
+ * @retval > 0 How many bytes were read, in total.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** Where ufs_seek() counts the offset from. */
+enum ufs_seek_whence {
+	/** The start of the file. */
+	UFS_SEEK_SET,
+	/** The current position. */
+	UFS_SEEK_CUR,
+	/** The end of the file. */
+	UFS_SEEK_END,
+};
+
+/**
+ * Set the position of the file descriptor, for the next ufs_read()
+ * and ufs_write(). It may be past the end of the file: a write there
+ * fills the gap with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset from @a whence.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - unknown @a whence, or the position
+ *       would be negative.
+ */
+off_t
+ufs_seek(int fd, off_t offset, int whence);
+
+/**
+ * Write data to the file at the offset, without using or changing
+ * the position of the descriptor.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Where to write, may be past the end of the file.
+ *
+ * @retval > 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARG - negative @a offset.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, off_t offset);
+
+/**
+ * Read data from the file at the offset, without using or changing
+ * the position of the descriptor.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Where to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a offset.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * Borrow the data of the file at the offset, instead of copying it
+ * like ufs_pread() does: @a iov is set to the pieces of the block
+ * memory holding it, in order. They stay valid, and keep the data of
+ * the time of the call, until ufs_unmap(): a write to the file
+ * meanwhile goes to a copy of the block it changes, the same as to a
+ * clone. A hole is mapped as zeros. The memory must not be written.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Where to start.
+ * @param len Maximum bytes to map.
+ * @param[out] iov The pieces, to be released with ufs_unmap().
+ * @param[out] iovcnt Number of @a iov.
+ *
+ * @retval >= 0 How many bytes were mapped, 0 on EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a offset.
+ *     - UFS_ERR_NOT_IMPLEMENTED - an image is mounted, see
+ *       ufs_mount().
+ */
+ssize_t
+ufs_map(int fd, off_t offset, size_t len, struct iovec **iov, int *iovcnt);
+
+/**
+ * Release the data borrowed by ufs_map(). Can be done after the file
+ * is closed or deleted, but not after ufs_destroy().
+ * @param iov The pieces from ufs_map().
+ */
+void
+ufs_unmap(struct iovec *iov);
+
+/**
+ * Batches of operations, in the way of io_uring: they are put to the
+ * submission ring with ufs_get_sqe(), done at once by ufs_submit(),
+ * and their results are taken from the completion ring with
+ * ufs_reap(). The reads and the writes of a batch share the locking,
+ * so a batch costs less than the same calls one by one. A ring is to
+ * be used by one thread at a time.
+ */
+struct ufs_ring;
+
+/** Operations of the rings. */
+enum ufs_op {
+	/** ufs_open() of @a path with @a flags. */
+	UFS_OP_OPEN,
+	/** ufs_close() of @a fd. */
+	UFS_OP_CLOSE,
+	/** ufs_pread() of @a fd, or ufs_read() if @a offset is -1. */
+	UFS_OP_READ,
+	/** ufs_pwrite() of @a fd, or ufs_write() if @a offset is -1. */
+	UFS_OP_WRITE,
+};
+
+/** A submitted operation. */
+struct ufs_sqe {
+	enum ufs_op op;
+	int fd;
+	const char *path;
+	int flags;
+	void *buf;
+	size_t len;
+	off_t offset;
+	/** Passed to the completion as is. */
+	uint64_t user_data;
+};
+
+/** A completed operation. */
+struct ufs_cqe {
+	uint64_t user_data;
+	/** What the call returns. */
+	ssize_t res;
+	/** What ufs_errno() is after the call, if @a res is negative. */
+	enum ufs_error_code error;
+};
+
+/**
+ * Create a ring.
+ * @param entries How many operations can be submitted and not yet
+ *        reaped, rounded up to a power of 2.
+ * @retval The ring, to be freed with ufs_ring_free().
+ */
+struct ufs_ring *
+ufs_ring_new(unsigned entries);
+
+void
+ufs_ring_free(struct ufs_ring *ring);
+
+/**
+ * A new operation in the ring, to be filled in. It is a read at the
+ * position of the descriptor until it is set otherwise.
+ * @retval NULL The ring is full: submit, and reap the completions.
+ */
+struct ufs_sqe *
+ufs_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Do the operations put to the ring since the last submission, in
+ * order. Each one has its completion in the ring when it returns.
+ * @retval The count of the operations.
+ */
+int
+ufs_submit(struct ufs_ring *ring);
+
+/**
+ * Take the completions from the ring, in the order of the operations.
+ * @param cqes Where to put them.
+ * @param count Maximum to take.
+ * @retval How many are taken.
+ */
+int
+ufs_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -135,16 +360,96 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_INVALID_ARG - it is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a file @a dst with the content of @a src. The data is not
+ * copied: both files refer to the same blocks, and a block is copied
+ * only on the first write to it by either file. So a clone costs
+ * about as much as the list of the blocks.
+ *
+ * @param src Name of the file to clone.
+ * @param dst Name of the new file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src, or no directory for
+ *       @a dst.
+ *     - UFS_ERR_INVALID_ARG - @a dst exists already, or @a src is a
+ *       directory.
+ *     - UFS_ERR_NO_MEM - the mounted image is full.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Create a directory. Its parent must exist: "a/b" needs "a".
+ * A directory and a file can not have the same path.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_INVALID_ARG - @a path exists already, or has an
+ *       empty component.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_INVALID_ARG - it is a file.
+ *     - UFS_ERR_NOT_EMPTY - it has entries.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** An entry of a directory, from ufs_readdir(). */
+struct ufs_dirent {
+	/** The name in the directory, without the path of it. */
+	const char *name;
+	bool is_dir;
+};
+
+struct ufs_dir;
+
+/**
+ * List a directory. The entries are the ones at the time of the
+ * call, in no particular order.
+ *
+ * @param path Path of the directory, "" for the root.
+ * @retval The listing, to be freed with ufs_closedir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_INVALID_ARG - it is a file.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * The next entry of the listing, valid until ufs_closedir().
+ * @retval NULL There are no more.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+void
+ufs_closedir(struct ufs_dir *dir);
+
 #ifdef NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
+ * file size is less than @a new_size, then the file is extended
+ * with a hole, which reads as zeros and takes no memory until it
+ * is written, and positions of opened file descriptors are not
  * changed. If the current size is bigger than @a new_size, then
  * the blocks are truncated. Opened file descriptors behind the
  * new file size should proceed from the new file end.
@@ -154,18 +459,163 @@ ufs_delete(const char *filename);
  * @retval 0 Success.
  * @retval -1 Error occurred.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
- *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
- *       @a new_size is bigger than the current size.
+ *     - UFS_ERR_NO_MEM - @a new_size is bigger than the maximal
+ *       file size.
  */
 int
 ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Back the filesystem with the image file @a path: its files are
+ * loaded from there, and the new data is written right to it. If the
+ * file is empty or does not exist, a new image is created there, to
+ * hold UFS_IMAGE_SIZE bytes of data (it is sparse on the disk). The
+ * data blocks are mapped with mmap(), so mounting reads nothing but
+ * the list of the files. The list is written to the image by
+ * ufs_sync() and ufs_destroy(): the files changed after the last of
+ * them are lost on a crash.
+ *
+ * Can only be done when there are no files and no descriptors.
+ *
+ * @param path Path of the image.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - there are files already, or an image is
+ *       mounted already.
+ *     - UFS_ERR_IO - the image can not be opened or mapped, or it is
+ *       damaged.
+ */
+int
+ufs_mount(const char *path);
+
+/**
+ * Write the list of the files to the mounted image, and flush the
+ * data written since the last sync. Does nothing if there is no image.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - the image is full.
+ *     - UFS_ERR_IO - failed to flush.
+ */
+int
+ufs_sync(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * If an image is mounted, it is synced and unmapped, and the files remain
+ * there.
  */
 void
 ufs_destroy(void);
+
+/**
+ * Independent filesystems. The functions above work with the default
+ * one; each of them has a version taking the filesystem first, e.g.
+ * ufs_open_in(fs, filename, flags) for ufs_open(filename, flags).
+ * The files, the descriptors and the memory of a filesystem are its
+ * own: a descriptor of one is not valid in another, and an image is
+ * mounted to one. The error code is common, per thread.
+ */
+struct ufs;
+
+/** Flags for ufs_new(). */
+enum ufs_new_flags {
+	/**
+	 * The filesystem is only used by one thread at a time, and no
+	 * locks are taken.
+	 */
+	UFS_NEW_SINGLE_THREAD = 1,
+	/**
+	 * The identical data is stored once: when a descriptor opened for
+	 * writing is closed, the full extents of its file are hashed and
+	 * shared with the same ones of any file, like by ufs_clone(), and
+	 * copied again on a write. Not while an image is mounted.
+	 */
+	UFS_NEW_DEDUP = 2,
+	/**
+	 * The data is in the transparent huge pages, where the kernel has
+	 * them: fewer TLB misses on the big files. The memory of the
+	 * deleted files is then kept for the new ones until ufs_free().
+	 */
+	UFS_NEW_HUGEPAGES = 4,
+};
+
+/**
+ * Create an empty filesystem.
+ * @param flags Bitwise combination of ufs_new_flags.
+ * @retval The filesystem, to be freed with ufs_free().
+ */
+struct ufs *
+ufs_new(int flags);
+
+/**
+ * Free the filesystem, like ufs_destroy() does to the default one.
+ * @param fs Filesystem from ufs_new().
+ */
+void
+ufs_free(struct ufs *fs);
+
+int
+ufs_open_in(struct ufs *fs, const char *filename, int flags);
+
+ssize_t
+ufs_write_in(struct ufs *fs, int fd, const char *buf, size_t size);
+
+ssize_t
+ufs_read_in(struct ufs *fs, int fd, char *buf, size_t size);
+
+ssize_t
+ufs_writev_in(struct ufs *fs, int fd, const struct iovec *iov, int iovcnt);
+
+ssize_t
+ufs_readv_in(struct ufs *fs, int fd, const struct iovec *iov, int iovcnt);
+
+off_t
+ufs_seek_in(struct ufs *fs, int fd, off_t offset, int whence);
+
+ssize_t
+ufs_pwrite_in(struct ufs *fs, int fd, const char *buf, size_t size, off_t offset);
+
+ssize_t
+ufs_pread_in(struct ufs *fs, int fd, char *buf, size_t size, off_t offset);
+
+ssize_t
+ufs_map_in(struct ufs *fs, int fd, off_t offset, size_t len, struct iovec **iov, int *iovcnt);
+
+struct ufs_ring *
+ufs_ring_new_in(struct ufs *fs, unsigned entries);
+
+int
+ufs_close_in(struct ufs *fs, int fd);
+
+int
+ufs_delete_in(struct ufs *fs, const char *filename);
+
+int
+ufs_clone_in(struct ufs *fs, const char *src, const char *dst);
+
+int
+ufs_mkdir_in(struct ufs *fs, const char *path);
+
+int
+ufs_rmdir_in(struct ufs *fs, const char *path);
+
+struct ufs_dir *
+ufs_opendir_in(struct ufs *fs, const char *path);
+
+#ifdef NEED_RESIZE
+
+int
+ufs_resize_in(struct ufs *fs, int fd, size_t new_size);
+
+#endif
+
+int
+ufs_mount_in(struct ufs *fs, const char *path);
+
+int
+ufs_sync_in(struct ufs *fs);
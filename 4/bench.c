@@ -0,0 +1,502 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Benchmark of the thread pool.
+ *
+ * The throughput of empty tasks for 1, 2, 4, ..., 64 threads: batches
+ * of BENCH_BATCH tasks pushed at once with thread_pool_push_tasks() and
+ * joined one by one, in tasks/s as min/median/max of the runs.
+ *
+ * The latency from thread_pool_push_task() to the start of the task,
+ * and from the end of the task to the return of thread_task_join(),
+ * as percentiles, for a task at a time into an idle pool.
+ *
+ * A fork-join recursive Fibonacci: fib(n) computes fib(n - 1) and
+ * fib(n - 2) in a parallel reduction of two pieces, which computes its
+ * pieces the same way, down to BENCH_FIB_CUTOFF computed serially. The
+ * time of each thread count, and the speedup against the serial one.
+ *
+ * Several producer threads at once pushing empty tasks one by one into
+ * a pool of BENCH_PRODUCER_WORKERS threads, each joining its tasks
+ * every BENCH_BATCH, in tasks/s, for 1, 2, 4 and 8 producers.
+ *
+ * False sharing, as in bonus/task_eng.txt (7): 1, 2 and 3 threads each
+ * incrementing its own uint64_t BENCH_FS_INCREMENTS times, the counters
+ * either next to each other or BENCH_FS_STRIDE of them apart, which
+ * puts each into its own cache line. The reason the hot fields of the
+ * pool and of the tasks are in separate cache lines.
+ *
+ * Usage: ./bench [--runs R] [--json FILE] [--fib N]. The JSON file gets
+ * the same numbers, to compare between the commits.
+ */
+
+enum {
+	BENCH_RUNS_DEFAULT = 5,
+	BENCH_RUNS_MAX = 100,
+	BENCH_MAX_THREADS = 64,
+	BENCH_BATCH = 1000,
+	/** Tasks of each run of the throughput. */
+	BENCH_TASKS = 200000,
+	BENCH_LATENCY_SAMPLES = 20000,
+	BENCH_LATENCY_THREADS = 4,
+	BENCH_FIB_DEFAULT = 38,
+	BENCH_FIB_CUTOFF = 24,
+	BENCH_PRODUCER_WORKERS = 4,
+	BENCH_MAX_PRODUCERS = 8,
+	/** Tasks pushed by all the producers together. */
+	BENCH_PRODUCER_TASKS = 200000,
+	BENCH_FS_INCREMENTS = 100000000,
+	BENCH_FS_MAX_THREADS = 3,
+	/** 8 * sizeof(uint64_t) is a cache line. */
+	BENCH_FS_STRIDE = 8,
+};
+
+static void
+bench_fail(const char *what, int err)
+{
+	printf("Error: %s failed with %d\n", what, err);
+	exit(-1);
+}
+
+/** A pool of @a threads, above TPOOL_MAX_THREADS if need be. */
+static struct thread_pool *
+bench_pool_new(int threads)
+{
+	struct thread_pool_options opts;
+	thread_pool_options_init(&opts, threads);
+	struct thread_pool *pool;
+	int err = thread_pool_new_ext(&opts, &pool);
+	if (err != 0)
+		bench_fail("thread_pool_new_ext", err);
+	return pool;
+}
+
+static void
+bench_pool_delete(struct thread_pool *pool)
+{
+	int err = thread_pool_delete(pool);
+	if (err != 0)
+		bench_fail("thread_pool_delete", err);
+}
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_join_all(struct thread_task **tasks, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		void *result;
+		int err = thread_task_join(tasks[i], &result);
+		if (err != 0)
+			bench_fail("thread_task_join", err);
+	}
+}
+
+/** Tasks/s of empty tasks pushed in batches into a pool of @a threads. */
+static double
+bench_throughput(int threads)
+{
+	struct thread_pool *pool = bench_pool_new(threads);
+	struct thread_task *tasks[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_new(&tasks[i], bench_empty_f, NULL);
+	double start = bench_now();
+	for (int done = 0; done < BENCH_TASKS; done += BENCH_BATCH) {
+		int err = thread_pool_push_tasks(pool, tasks, BENCH_BATCH);
+		if (err != 0)
+			bench_fail("thread_pool_push_tasks", err);
+		bench_join_all(tasks, BENCH_BATCH);
+	}
+	double elapsed = bench_now() - start;
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_delete(tasks[i]);
+	bench_pool_delete(pool);
+	return BENCH_TASKS / elapsed;
+}
+
+struct bench_stamps {
+	double start;
+	double end;
+};
+
+static void *
+bench_stamp_f(void *arg)
+{
+	struct bench_stamps *stamps = arg;
+	stamps->start = bench_now();
+	stamps->end = bench_now();
+	return arg;
+}
+
+/**
+ * Push a task at a time into an idle pool, the latencies of its start
+ * and of its join go to @a push_ns and @a join_ns.
+ */
+static void
+bench_latency(double *push_ns, double *join_ns)
+{
+	struct thread_pool *pool = bench_pool_new(BENCH_LATENCY_THREADS);
+	struct bench_stamps stamps;
+	struct thread_task *task;
+	thread_task_new(&task, bench_stamp_f, &stamps);
+	for (int i = 0; i < BENCH_LATENCY_SAMPLES; ++i) {
+		double pushed = bench_now();
+		int err = thread_pool_push_task(pool, task);
+		if (err != 0)
+			bench_fail("thread_pool_push_task", err);
+		bench_join_all(&task, 1);
+		double joined = bench_now();
+		push_ns[i] = (stamps.start - pushed) * 1e9;
+		join_ns[i] = (joined - stamps.end) * 1e9;
+	}
+	thread_task_delete(task);
+	bench_pool_delete(pool);
+	bench_sort(push_ns, BENCH_LATENCY_SAMPLES);
+	bench_sort(join_ns, BENCH_LATENCY_SAMPLES);
+}
+
+static uint64_t
+bench_fib_serial(int n)
+{
+	return n < 2 ? (uint64_t)n : bench_fib_serial(n - 1) +
+	       bench_fib_serial(n - 2);
+}
+
+struct bench_fib {
+	struct thread_pool *pool;
+	int n;
+};
+
+static uint64_t
+bench_fib(struct thread_pool *pool, int n);
+
+static void *
+bench_fib_map(size_t begin, size_t end, void *ctx)
+{
+	const struct bench_fib *fib = ctx;
+	uint64_t sum = 0;
+	for (size_t i = begin; i < end; ++i)
+		sum += bench_fib(fib->pool, fib->n - 1 - (int)i);
+	return (void *)(uintptr_t)sum;
+}
+
+static void *
+bench_fib_combine(void *a, void *b, void *ctx)
+{
+	(void)ctx;
+	return (void *)((uintptr_t)a + (uintptr_t)b);
+}
+
+/** fib(n - 1) and fib(n - 2) in parallel, each the same way. */
+static uint64_t
+bench_fib(struct thread_pool *pool, int n)
+{
+	if (n < BENCH_FIB_CUTOFF)
+		return bench_fib_serial(n);
+	struct bench_fib fib = {pool, n};
+	void *result;
+	int err = thread_pool_parallel_reduce(pool, 0, 2, 1, bench_fib_map,
+					      bench_fib_combine, &fib, &result);
+	if (err != 0)
+		bench_fail("thread_pool_parallel_reduce", err);
+	return (uintptr_t)result;
+}
+
+/** Seconds of fib(@a n) in a pool of @a threads. */
+static double
+bench_fork_join(int threads, int n, uint64_t expected)
+{
+	struct thread_pool *pool = bench_pool_new(threads);
+	double start = bench_now();
+	uint64_t result = bench_fib(pool, n);
+	double elapsed = bench_now() - start;
+	bench_pool_delete(pool);
+	if (result != expected) {
+		printf("Error: fib(%d) is %llu, not %llu\n", n,
+		       (unsigned long long)result,
+		       (unsigned long long)expected);
+		exit(-1);
+	}
+	return elapsed;
+}
+
+struct bench_producer {
+	pthread_t tid;
+	struct thread_pool *pool;
+	int count;
+	/** Set once all the producers are created, so that they start together. */
+	const int *go;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_producer *p = arg;
+	struct thread_task *tasks[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_new(&tasks[i], bench_empty_f, NULL);
+	while (__atomic_load_n(p->go, __ATOMIC_ACQUIRE) == 0)
+		;
+	for (int done = 0; done < p->count; done += BENCH_BATCH) {
+		for (int i = 0; i < BENCH_BATCH; ++i) {
+			int err = thread_pool_push_task(p->pool, tasks[i]);
+			if (err != 0)
+				bench_fail("thread_pool_push_task", err);
+		}
+		bench_join_all(tasks, BENCH_BATCH);
+	}
+	for (int i = 0; i < BENCH_BATCH; ++i)
+		thread_task_delete(tasks[i]);
+	return NULL;
+}
+
+/** Tasks/s of @a producers threads pushing into one pool at once. */
+static double
+bench_producers(int producers)
+{
+	struct thread_pool *pool = bench_pool_new(BENCH_PRODUCER_WORKERS);
+	struct bench_producer p[BENCH_MAX_PRODUCERS];
+	int go = 0;
+	int per_producer = BENCH_PRODUCER_TASKS / producers;
+	for (int i = 0; i < producers; ++i) {
+		p[i].pool = pool;
+		p[i].count = per_producer;
+		p[i].go = &go;
+		if (pthread_create(&p[i].tid, NULL, bench_producer_f, &p[i]) != 0)
+			bench_fail("pthread_create", -1);
+	}
+	double start = bench_now();
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < producers; ++i)
+		pthread_join(p[i].tid, NULL);
+	double elapsed = bench_now() - start;
+	bench_pool_delete(pool);
+	return (double)per_producer * producers / elapsed;
+}
+
+/**
+ * Checked in the loop of the false sharing, as in the task, so it is not
+ * folded into one addition. The counters are volatile too, for each
+ * increment to be a store into the cache line.
+ */
+static volatile bool bench_fs_stop = false;
+
+struct bench_fs_counter {
+	pthread_t tid;
+	volatile uint64_t *value;
+};
+
+static void *
+bench_fs_f(void *arg)
+{
+	volatile uint64_t *value = ((struct bench_fs_counter *)arg)->value;
+	while (*value < BENCH_FS_INCREMENTS && !bench_fs_stop)
+		++*value;
+	return NULL;
+}
+
+/** Seconds of @a threads incrementing counters @a stride apart. */
+static double
+bench_false_sharing(int threads, int stride)
+{
+	_Alignas(64) static uint64_t values[BENCH_FS_MAX_THREADS *
+					    BENCH_FS_STRIDE];
+	struct bench_fs_counter c[BENCH_FS_MAX_THREADS];
+	memset(values, 0, sizeof(values));
+	double start = bench_now();
+	for (int i = 0; i < threads; ++i) {
+		c[i].value = &values[i * stride];
+		if (pthread_create(&c[i].tid, NULL, bench_fs_f, &c[i]) != 0)
+			bench_fail("pthread_create", -1);
+	}
+	for (int i = 0; i < threads; ++i)
+		pthread_join(c[i].tid, NULL);
+	return bench_now() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	int runs = BENCH_RUNS_DEFAULT;
+	int fib_n = BENCH_FIB_DEFAULT;
+	const char *json_path = NULL;
+	while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--runs") == 0) {
+			runs = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--json") == 0) {
+			json_path = argv[2];
+		} else if (strcmp(argv[1], "--fib") == 0) {
+			fib_n = strtol(argv[2], NULL, 10);
+		} else {
+			printf("Unknown option %s\n", argv[1]);
+			return -1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (runs < 1 || runs > BENCH_RUNS_MAX) {
+		printf("The number of runs must be in [1, %d]\n", BENCH_RUNS_MAX);
+		return -1;
+	}
+	if (fib_n < BENCH_FIB_CUTOFF || fib_n > 60) {
+		printf("The Fibonacci number must be in [%d, 60]\n",
+		       BENCH_FIB_CUTOFF);
+		return -1;
+	}
+
+	FILE *json = NULL;
+	if (json_path != NULL) {
+		json = fopen(json_path, "w");
+		if (json == NULL) {
+			perror("fopen of the JSON file");
+			return -1;
+		}
+		fprintf(json, "{\"runs\": %d, \"batch\": %d", runs, BENCH_BATCH);
+	}
+
+	printf("Empty tasks in batches of %d, %d runs, min/median/max tasks/s:\n",
+	       BENCH_BATCH, runs);
+	if (json != NULL)
+		fprintf(json, ",\n \"throughput\": [");
+	for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+		double tps[BENCH_RUNS_MAX];
+		for (int i = 0; i < runs; ++i)
+			tps[i] = bench_throughput(threads);
+		bench_sort(tps, runs);
+		printf("%3d threads: %12.0f %12.0f %12.0f\n", threads, tps[0],
+		       bench_median(tps, runs), tps[runs - 1]);
+		fflush(stdout);
+		if (json == NULL)
+			continue;
+		fprintf(json, "%s\n  {\"threads\": %d, ",
+			threads == 1 ? "" : ",", threads);
+		bench_json_stat(json, "tasks_per_s", tps, runs);
+		fprintf(json, "}");
+	}
+	if (json != NULL)
+		fprintf(json, "\n ]");
+
+	static double push_ns[BENCH_LATENCY_SAMPLES];
+	static double join_ns[BENCH_LATENCY_SAMPLES];
+	bench_latency(push_ns, join_ns);
+	printf("Latency of a task at a time, %d threads, ns:\n",
+	       BENCH_LATENCY_THREADS);
+	const char *names[] = {"push to run", "end to join"};
+	const double *latencies[] = {push_ns, join_ns};
+	for (int i = 0; i < 2; ++i) {
+		const double *l = latencies[i];
+		int n = BENCH_LATENCY_SAMPLES;
+		printf("%12s: p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n",
+		       names[i], bench_percentile(l, n, 0.5),
+		       bench_percentile(l, n, 0.9), bench_percentile(l, n, 0.99),
+		       bench_percentile(l, n, 0.999), l[n - 1]);
+	}
+	if (json != NULL) {
+		fprintf(json, ",\n \"latency\": {\"threads\": %d, ",
+			BENCH_LATENCY_THREADS);
+		bench_json_percentiles(json, "push_to_run_ns", push_ns,
+				       BENCH_LATENCY_SAMPLES);
+		fprintf(json, ", ");
+		bench_json_percentiles(json, "end_to_join_ns", join_ns,
+				       BENCH_LATENCY_SAMPLES);
+		fprintf(json, "}");
+	}
+
+	double start = bench_now();
+	uint64_t expected = bench_fib_serial(fib_n);
+	double serial = bench_now() - start;
+	printf("fib(%d) fork-join down to %d, serial %.3f s, seconds and speedup:\n",
+	       fib_n, BENCH_FIB_CUTOFF, serial);
+	if (json != NULL)
+		fprintf(json, ",\n \"fib\": {\"n\": %d, \"cutoff\": %d, "
+			"\"serial_s\": %.6f, \"results\": [", fib_n,
+			BENCH_FIB_CUTOFF, serial);
+	for (int threads = 1; threads <= BENCH_MAX_PRODUCERS; threads *= 2) {
+		double secs[BENCH_RUNS_MAX];
+		for (int i = 0; i < runs; ++i)
+			secs[i] = bench_fork_join(threads, fib_n, expected);
+		bench_sort(secs, runs);
+		double median = bench_median(secs, runs);
+		printf("%3d threads: %8.3f s, %.2fx\n", threads, median,
+		       serial / median);
+		fflush(stdout);
+		if (json == NULL)
+			continue;
+		fprintf(json, "%s\n  {\"threads\": %d, ",
+			threads == 1 ? "" : ",", threads);
+		bench_json_stat(json, "seconds", secs, runs);
+		fprintf(json, "}");
+	}
+	if (json != NULL)
+		fprintf(json, "\n ]}");
+
+	printf("Producers pushing at once into %d threads, min/median/max tasks/s:\n",
+	       BENCH_PRODUCER_WORKERS);
+	if (json != NULL)
+		fprintf(json, ",\n \"producers\": {\"threads\": %d, \"results\": [",
+			BENCH_PRODUCER_WORKERS);
+	for (int producers = 1; producers <= BENCH_MAX_PRODUCERS;
+	     producers *= 2) {
+		double tps[BENCH_RUNS_MAX];
+		for (int i = 0; i < runs; ++i)
+			tps[i] = bench_producers(producers);
+		bench_sort(tps, runs);
+		printf("%3d producers: %12.0f %12.0f %12.0f\n", producers,
+		       tps[0], bench_median(tps, runs), tps[runs - 1]);
+		fflush(stdout);
+		if (json == NULL)
+			continue;
+		fprintf(json, "%s\n  {\"producers\": %d, ",
+			producers == 1 ? "" : ",", producers);
+		bench_json_stat(json, "tasks_per_s", tps, runs);
+		fprintf(json, "}");
+	}
+	if (json != NULL)
+		fprintf(json, "\n ]}");
+
+	printf("False sharing, %d increments each, min/median/max seconds:\n",
+	       BENCH_FS_INCREMENTS);
+	if (json != NULL)
+		fprintf(json, ",\n \"false_sharing\": {\"increments\": %d, "
+			"\"results\": [", BENCH_FS_INCREMENTS);
+	for (int threads = 1; threads <= BENCH_FS_MAX_THREADS; ++threads) {
+		for (int stride = 1; stride <= BENCH_FS_STRIDE;
+		     stride *= BENCH_FS_STRIDE) {
+			if (threads == 1 && stride != 1)
+				continue;
+			double secs[BENCH_RUNS_MAX];
+			for (int i = 0; i < runs; ++i)
+				secs[i] = bench_false_sharing(threads, stride);
+			bench_sort(secs, runs);
+			const char *layout = stride == 1 ? "close" : "distant";
+			printf("%3d threads, %7s: %8.3f %8.3f %8.3f\n", threads,
+			       layout, secs[0], bench_median(secs, runs),
+			       secs[runs - 1]);
+			fflush(stdout);
+			if (json == NULL)
+				continue;
+			fprintf(json, "%s\n  {\"threads\": %d, \"layout\": "
+				"\"%s\", ", threads == 1 ? "" : ",", threads,
+				layout);
+			bench_json_stat(json, "seconds", secs, runs);
+			fprintf(json, "}");
+		}
+	}
+	if (json != NULL) {
+		fprintf(json, "\n ]}\n}\n");
+		fclose(json);
+	}
+	return 0;
+}
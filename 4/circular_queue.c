@@ -1,5 +1,4 @@
 #include <stdlib.h>
-#include <string.h>
 
 #include "circular_queue.h"
 
@@ -7,80 +6,87 @@ enum {
     CQ_ERR_NO_MEM = 1,
 };
 
-// The only error that may be reported is OOM
-static unsigned char circular_queue_realloc(struct circular_queue *queue, size_t new_capacity) {
-    void **new = (void **)malloc(new_capacity * sizeof (void *));
-    if (!new)
-        return CQ_ERR_NO_MEM;
-
-    if (queue->head <= queue->tail) {
-        memcpy(new, queue->data + queue->head, (queue->tail - queue->head) * sizeof (void *));
-        queue->tail = queue->tail - queue->head;
-        queue->head = 0;
-    } else {
-        size_t first = (queue->dcapacity - queue->head);
-        size_t second = queue->tail;
-        memcpy(new, queue->data + queue->head, first * sizeof (void *));
-        memcpy(new + first, queue->data, second * sizeof (void *));
-        queue->tail = first + second;
-        queue->head = 0;
-    }
-    free(queue->data);
-    queue->data = new;
+// The spare segment if there is one, a new one otherwise. NULL on OOM
+static struct circular_queue_segment *circular_queue_segment_get(struct circular_queue *queue) {
+    struct circular_queue_segment *seg = queue->spare;
+    if (seg)
+        queue->spare = NULL;
+    else
+        seg = (struct circular_queue_segment *)malloc(sizeof (*seg));
+    if (seg)
+        seg->next = NULL;
+    return seg;
+}
 
-    queue->dcapacity = new_capacity;
-    return 0;
+// Keep `seg` as the spare one, unless there already is one
+static void circular_queue_segment_put(struct circular_queue *queue,
+        struct circular_queue_segment *seg) {
+    if (queue->spare)
+        free(seg);
+    else
+        queue->spare = seg;
 }
 
 // The only error that may be reported is OOM
 unsigned char circular_queue_init(struct circular_queue *queue) {
-    queue->dcapacity = 0;
+    queue->spare = NULL;
     queue->head = queue->tail = 0;
-    queue->data = NULL;
-    return circular_queue_realloc(queue, 8);  // 8: default initial capacity
+    queue->size = 0;
+    queue->head_seg = queue->tail_seg = circular_queue_segment_get(queue);
+    if (!queue->head_seg)
+        return CQ_ERR_NO_MEM;
+    return 0;
 }
 
 void circular_queue_destroy(struct circular_queue *queue) {
-    free(queue->data);
+    struct circular_queue_segment *seg = queue->head_seg;
+    while (seg) {
+        struct circular_queue_segment *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+    free(queue->spare);
 }
 
-#define NEXT(queue, field) (((queue)->field)+1) % ((queue)->dcapacity)
-
 void *circular_queue_pop(struct circular_queue *queue) {
-    void *res = queue->data[queue->head];
-    queue->head = NEXT(queue, head);
+    void *res = queue->head_seg->data[queue->head++];
+    --queue->size;
+    if (queue->head_seg == queue->tail_seg) {
+        // The last segment: start it over once it's empty, rather than moving to another one
+        if (queue->head == queue->tail)
+            queue->head = queue->tail = 0;
+    } else if (queue->head == CQ_SEGMENT_SIZE) {
+        struct circular_queue_segment *seg = queue->head_seg;
+        queue->head_seg = seg->next;
+        queue->head = 0;
+        circular_queue_segment_put(queue, seg);
+    }
     return res;
 }
 
 // The only error that may be reported is OOM
 unsigned char circular_queue_push(struct circular_queue *queue, void *val) {
-    if (NEXT(queue, tail) == queue->head) {
-        int err = circular_queue_realloc(queue, queue->dcapacity * 2);
-        if (err)
-            return err;
+    if (queue->tail == CQ_SEGMENT_SIZE) {
+        struct circular_queue_segment *seg = circular_queue_segment_get(queue);
+        if (!seg)
+            return CQ_ERR_NO_MEM;
+        queue->tail_seg->next = seg;
+        queue->tail_seg = seg;
+        queue->tail = 0;
     }
 
-    queue->data[queue->tail] = val;
-    queue->tail = NEXT(queue, tail);
+    queue->tail_seg->data[queue->tail++] = val;
+    ++queue->size;
     return 0;
 }
 
-/*
-void circular_queue_unpush(struct circular_queue *queue) {
-    --queue->tail;
-    if (queue->tail < 0)
-        queue->tail += queue->dcapacity;
-}
-*/
-
 __attribute__((pure))
 size_t circular_queue_capacity(const struct circular_queue *queue) {
-    return queue->dcapacity - 1;
+    // How many values the queue can hold without allocating
+    return queue->size + (CQ_SEGMENT_SIZE - queue->tail) + (queue->spare ? CQ_SEGMENT_SIZE : 0);
 }
 
 __attribute__((pure))
 size_t circular_queue_size(const struct circular_queue *queue) {
-    if (queue->head <= queue->tail)
-        return queue->tail - queue->head;
-    return queue->dcapacity - queue->head + queue->tail;
+    return queue->size;
 }
@@ -1,22 +1,39 @@
 #pragma once
 
+#include <stddef.h>
+
+enum {
+    /// Values in a segment of `struct circular_queue`
+    CQ_SEGMENT_SIZE = 256,
+};
+
+struct circular_queue_segment {
+    struct circular_queue_segment *next;
+    void *data[CQ_SEGMENT_SIZE];
+};
+
 /**
  * Implements a circular queue. Stores values of type `void *`.
  */
 struct circular_queue {
     /*
-     * Actual memory allocated to `data` is `(sizeof (void *)) * dcapacity`, maximum number of
-     * elements that can be stored in a queue is `dcapacity-1` (one element is reserved for
-     * empty/full disambiguation).
+     * The values are stored in a list of segments, from `head_seg` to `tail_seg`. A full queue
+     * grows by a segment at its tail, and a segment emptied at its head is recycled, so a push
+     * never moves the values already stored.
      *
-     * `head` points at the first element in the queue`, `tail` points one index beyond last
-     * element in the queue. For example, `head == tail` means the queue is empty,
-     * `(tail + 1) % dcapacity == head` means the queue is full (next push will cause reallocation).
+     * `head` is the index of the first element in `head_seg`, `tail` is the index one beyond
+     * the last element in `tail_seg`. For example, `head_seg == tail_seg && head == tail` means
+     * the queue is empty.
      */
 
-    size_t dcapacity;
+    struct circular_queue_segment *head_seg, *tail_seg;
     size_t head, tail;
-    void **data;
+    size_t size;
+    /*
+     * A free segment kept for the next one needed, or NULL. Only one, so that the memory of a
+     * burst is given back as the queue drains.
+     */
+    struct circular_queue_segment *spare;
 };
 
 
@@ -30,8 +47,6 @@ void *circular_queue_pop(struct circular_queue *queue);
 // The only error this function may return is OOM
 unsigned char circular_queue_push(struct circular_queue *queue, void *val);
 
-//void circular_queue_unpush(struct circular_queue *queue);
-
 size_t circular_queue_capacity(const struct circular_queue *queue) __attribute__((pure));
 
 size_t circular_queue_size(const struct circular_queue *queue) __attribute__((pure));
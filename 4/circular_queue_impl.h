@@ -0,0 +1,170 @@
+/*
+ * A circular queue of the values of any type, stored right in its buffer: a "template" to be
+ * included after defining
+ *
+ *   CQ_NAME - the name of the struct and the prefix of the functions, e.g. `task_queue` for
+ *             `struct task_queue` and `task_queue_push`;
+ *   CQ_TYPE - the type of the values.
+ *
+ * It defines the struct and, all `inline static`:
+ *
+ *   void          NAME_init(struct NAME *queue);
+ *   void          NAME_destroy(struct NAME *queue);
+ *   unsigned char NAME_reserve(struct NAME *queue, size_t count);
+ *   unsigned char NAME_push(struct NAME *queue, TYPE val);
+ *   unsigned char NAME_push_many(struct NAME *queue, const TYPE *vals, size_t count);
+ *   TYPE          NAME_pop(struct NAME *queue);
+ *   size_t        NAME_pop_many(struct NAME *queue, TYPE *vals, size_t count);
+ *   size_t        NAME_capacity(const struct NAME *queue);
+ *   size_t        NAME_size(const struct NAME *queue);
+ *
+ * and undefines the parameters, so that it can be included again for another type. Unlike
+ * `struct circular_queue`, the values are not boxed behind `void *`, the capacity is a power of
+ * two, so that the index is a mask rather than a modulo, and a push or a pop of many values
+ * copies them at most in two pieces. A full queue doubles its buffer, which moves the values: do
+ * not keep pointers into it across a push.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(CQ_NAME) || !defined(CQ_TYPE)
+#error "CQ_NAME and CQ_TYPE must be defined before including circular_queue_impl.h"
+#endif
+
+#ifndef CQ_IMPL_COMMON
+#define CQ_IMPL_COMMON
+
+// The capacity of the first buffer, a power of two. Can be tuned with -DCQ_MIN_CAPACITY=...
+#ifndef CQ_MIN_CAPACITY
+#define CQ_MIN_CAPACITY 16
+#endif
+
+#define CQ_CAT_(a, b) a##_##b
+#define CQ_CAT(a, b) CQ_CAT_(a, b)
+
+#endif
+
+#define CQ_FN(name) CQ_CAT(CQ_NAME, name)
+
+struct CQ_NAME {
+    /*
+     * `head` and `tail` count the values ever popped and pushed, so `tail - head` is the size and
+     * `head & (capacity - 1)` is the index of the first value. `data` is NULL until the first
+     * push, so an empty queue costs no allocation.
+     */
+
+    CQ_TYPE *data;
+    size_t capacity;
+    size_t head, tail;
+};
+
+inline static void CQ_FN(init)(struct CQ_NAME *queue) {
+    queue->data = NULL;
+    queue->capacity = 0;
+    queue->head = queue->tail = 0;
+}
+
+/// Frees the buffer. The values still there are dropped
+inline static void CQ_FN(destroy)(struct CQ_NAME *queue) {
+    free(queue->data);
+    queue->data = NULL;
+    queue->capacity = 0;
+}
+
+__attribute__((pure))
+inline static size_t CQ_FN(size)(const struct CQ_NAME *queue) {
+    return queue->tail - queue->head;
+}
+
+__attribute__((pure))
+inline static size_t CQ_FN(capacity)(const struct CQ_NAME *queue) {
+    // How many values the queue can hold without allocating
+    return queue->capacity;
+}
+
+// Copies `count` values between `vals` and the buffer from `pos` on, wrapping around
+inline static void CQ_FN(copy)(const struct CQ_NAME *queue, size_t pos, CQ_TYPE *vals,
+        size_t count, int is_push) {
+    size_t at = pos & (queue->capacity - 1);
+    size_t first = count < queue->capacity - at ? count : queue->capacity - at;
+    if (is_push) {
+        memcpy(queue->data + at, vals, first * sizeof (CQ_TYPE));
+        memcpy(queue->data, vals + first, (count - first) * sizeof (CQ_TYPE));
+    } else {
+        memcpy(vals, queue->data + at, first * sizeof (CQ_TYPE));
+        memcpy(vals + first, queue->data, (count - first) * sizeof (CQ_TYPE));
+    }
+}
+
+/**
+ * Makes room for `count` more values, so that pushing them does not allocate. The buffer grows
+ * to the next power of two that fits, and the values are moved to its beginning.
+ *
+ * The only error this function may return is OOM, in which case the queue is left as it was.
+ */
+inline static unsigned char CQ_FN(reserve)(struct CQ_NAME *queue, size_t count) {
+    size_t size = CQ_FN(size)(queue);
+    if (count > SIZE_MAX / sizeof (CQ_TYPE) / 2 - size)
+        return 1;
+    if (size + count <= queue->capacity)
+        return 0;
+
+    size_t capacity = queue->capacity ? queue->capacity : CQ_MIN_CAPACITY;
+    while (capacity < size + count)
+        capacity *= 2;
+    CQ_TYPE *data = (CQ_TYPE *)malloc(capacity * sizeof (CQ_TYPE));
+    if (!data)
+        return 1;
+    if (size > 0)
+        CQ_FN(copy)(queue, queue->head, data, size, 0);
+    free(queue->data);
+    queue->data = data;
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->tail = size;
+    return 0;
+}
+
+// The only error this function may return is OOM
+inline static unsigned char CQ_FN(push)(struct CQ_NAME *queue, CQ_TYPE val) {
+    if (queue->tail - queue->head == queue->capacity && CQ_FN(reserve)(queue, 1))
+        return 1;
+    queue->data[queue->tail++ & (queue->capacity - 1)] = val;
+    return 0;
+}
+
+/// Pushes all of `count` values, or none of them. The only error this function may return is OOM
+inline static unsigned char CQ_FN(push_many)(struct CQ_NAME *queue, const CQ_TYPE *vals,
+        size_t count) {
+    if (count == 0)
+        return 0;
+    if (CQ_FN(reserve)(queue, count))
+        return 1;
+    CQ_FN(copy)(queue, queue->tail, (CQ_TYPE *)vals, count, 1);
+    queue->tail += count;
+    return 0;
+}
+
+/// Pops the first value. The queue must not be empty
+inline static CQ_TYPE CQ_FN(pop)(struct CQ_NAME *queue) {
+    return queue->data[queue->head++ & (queue->capacity - 1)];
+}
+
+/// Pops at most `count` values to `vals`. Returns how many there were
+inline static size_t CQ_FN(pop_many)(struct CQ_NAME *queue, CQ_TYPE *vals, size_t count) {
+    size_t size = CQ_FN(size)(queue);
+    if (count > size)
+        count = size;
+    if (count == 0)
+        return 0;
+    CQ_FN(copy)(queue, queue->head, vals, count, 0);
+    queue->head += count;
+    return count;
+}
+
+#undef CQ_FN
+#undef CQ_NAME
+#undef CQ_TYPE
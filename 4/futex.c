@@ -38,6 +38,11 @@ inline static struct timespec timespec_diff(const struct timespec a, const struc
 }
 
 long futexp_timed_wait_for(uint32_t *uaddr, uint32_t wait_for, const struct timespec *timeout) {
+    return futexp_flagged_wait_for(uaddr, wait_for, 0, timeout);
+}
+
+long futexp_flagged_wait_for(uint32_t *uaddr, uint32_t wait_for, uint32_t flag,
+        const struct timespec *timeout) {
     struct timespec remaining, start, now;
 
     if (timeout) {
@@ -49,8 +54,15 @@ long futexp_timed_wait_for(uint32_t *uaddr, uint32_t wait_for, const struct time
     while (1) {
         /* The value must have been assigned with memory order release */
         uint32_t cur = __atomic_load_n(uaddr, __ATOMIC_ACQUIRE);
-        if (cur == wait_for)
+        if ((cur & ~flag) == wait_for)
             return 0;
+        /* Tell the waker that there is somebody to wake up. If the value changes first, reread it */
+        if (flag && !(cur & flag)) {
+            if (!__atomic_compare_exchange_n(uaddr, &cur, cur | flag, false, __ATOMIC_RELAXED,
+                        __ATOMIC_RELAXED))
+                continue;
+            cur |= flag;
+        }
 
         if (timeout) {
             int err = clock_gettime(CLOCK_MONOTONIC, &now);
@@ -79,3 +91,124 @@ long futexp_timed_wait_for(uint32_t *uaddr, uint32_t wait_for, const struct time
         }
     }
 }
+
+enum {
+    /// The most a mutex locker spins before it sleeps
+    FUTEX_MUTEX_MAX_SPINS = 100,
+};
+
+#define EC_WAITER ((uint64_t)1)
+#define EC_WAKING ((uint64_t)1 << 32)
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void futex_mutex_init(struct futex_mutex *mutex) {
+    mutex->state = 0;
+    mutex->spins = 0;
+}
+
+int futex_mutex_trylock(struct futex_mutex *mutex) {
+    uint32_t unlocked = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &unlocked, 1, false, __ATOMIC_ACQUIRE,
+                __ATOMIC_RELAXED))
+        return 0;
+    return EBUSY;
+}
+
+void futex_mutex_lock(struct futex_mutex *mutex) {
+    if (futex_mutex_trylock(mutex) == 0)
+        return;
+
+    /* Spin up to twice as long as the others did lately, then sleep */
+    uint32_t spins = __atomic_load_n(&mutex->spins, __ATOMIC_RELAXED);
+    uint32_t max_spins = spins * 2 + 10;
+    if (max_spins > FUTEX_MUTEX_MAX_SPINS)
+        max_spins = FUTEX_MUTEX_MAX_SPINS;
+    for (uint32_t i = 0; i < max_spins; ++i) {
+        cpu_relax();
+        if (__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) == 0 &&
+                futex_mutex_trylock(mutex) == 0) {
+            /* Only an estimate: a racing update lost does no harm */
+            __atomic_store_n(&mutex->spins, spins + ((int32_t)(i - spins) / 8),
+                    __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_store_n(&mutex->spins, spins + ((int32_t)(max_spins - spins) / 8), __ATOMIC_RELAXED);
+
+    /*
+     * Marked as contended from now on, even if it's taken by me in the end: there might be other
+     * sleepers, which was not known.
+     */
+    while (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0)
+        (void)futexp_wait(&mutex->state, 2);
+}
+
+void futex_mutex_unlock(struct futex_mutex *mutex) {
+    if (__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2)
+        (void)futexp_wake(&mutex->state, 1);
+}
+
+void futex_eventcount_init(struct futex_eventcount *ec) {
+    ec->waiters = 0;
+    ec->seq = 0;
+}
+
+uint32_t futex_eventcount_prepare(struct futex_eventcount *ec) {
+    /*
+     * The sequence is read before, so a notification in between is not lost: the futex wait
+     * returns right away. The fence pairs that of the notifier: either it sees me, or I see
+     * the condition it has made hold.
+     */
+    uint32_t key = __atomic_load_n(&ec->seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&ec->waiters, EC_WAITER, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return key;
+}
+
+long futex_eventcount_wait(struct futex_eventcount *ec, uint32_t key,
+        const struct timespec *timeout) {
+    return futexp_timed_wait(&ec->seq, key, timeout);
+}
+
+void futex_eventcount_leave(struct futex_eventcount *ec) {
+    /*
+     * Whether I was woken up or not, one wake-up is done with: it either was mine or its waiter
+     * is to leave too, so the count only errs on waking too many.
+     */
+    uint64_t old = __atomic_load_n(&ec->waiters, __ATOMIC_RELAXED), new;
+    do {
+        new = old - EC_WAITER - (old >= EC_WAKING ? EC_WAKING : 0);
+    } while (!__atomic_compare_exchange_n(&ec->waiters, &old, new, true, __ATOMIC_RELAXED,
+                __ATOMIC_RELAXED));
+}
+
+void futex_eventcount_notify(struct futex_eventcount *ec, uint32_t count) {
+    /* Pairs with the fence of a waiter, see `futex_eventcount_prepare` */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    futex_eventcount_notify_sc(ec, count);
+}
+
+void futex_eventcount_notify_sc(struct futex_eventcount *ec, uint32_t count) {
+    uint64_t old = __atomic_load_n(&ec->waiters, __ATOMIC_SEQ_CST);
+    while ((uint32_t)old > (old >> 32)) {
+        /* Only the waiters nobody is waking up yet */
+        uint64_t idle = (uint32_t)old - (old >> 32);
+        uint64_t wake = count < idle ? count : idle;
+        if (__atomic_compare_exchange_n(&ec->waiters, &old, old + wake * EC_WAKING, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&ec->seq, 1, __ATOMIC_RELEASE);
+            (void)futexp_wake(&ec->seq, (uint32_t)wake);
+            break;
+        }
+    }
+}
+
+void futex_eventcount_notify_all(struct futex_eventcount *ec) {
+    __atomic_add_fetch(&ec->seq, 1, __ATOMIC_RELEASE);
+    (void)futexp_wake(&ec->seq, INT_MAX);
+}
@@ -28,3 +28,80 @@ long futexp_wait_for(uint32_t *uaddr, uint32_t wait_for);
  * No spurious wakups, even for `EINTR`.
  */
 long futexp_timed_wait_for(uint32_t *uaddr, uint32_t wait_for, const struct timespec *timeout);
+
+/**
+ * Analogous to `futexp_timed_wait_for` but the `flag` bits are not compared, and are set before
+ * sleeping. So a waker may skip the wake-up syscall unless they are set, clearing them.
+ */
+long futexp_flagged_wait_for(uint32_t *uaddr, uint32_t wait_for, uint32_t flag,
+        const struct timespec *timeout);
+
+/**
+ * A mutex on a futex, after "Futexes Are Tricky" by U. Drepper: `state` is 0 when unlocked, 1
+ * when locked, 2 when locked and somebody may be sleeping on it, so that the unlock makes a
+ * syscall only then. Before sleeping, a locker spins for about as long as it took to get the
+ * mutex lately (like glibc's adaptive mutexes), as the critical sections are short.
+ */
+struct futex_mutex {
+    uint32_t state;
+    /// The average spin count of the latest lockers, atomic
+    uint32_t spins;
+};
+
+#define FUTEX_MUTEX_INITIALIZER {0, 0}
+
+void futex_mutex_init(struct futex_mutex *mutex);
+
+/// Returns 0 if the mutex is taken, `EBUSY` otherwise
+int futex_mutex_trylock(struct futex_mutex *mutex);
+
+void futex_mutex_lock(struct futex_mutex *mutex);
+
+void futex_mutex_unlock(struct futex_mutex *mutex);
+
+/**
+ * An eventcount, to sleep until some condition holds without a lock, and for the notifier to
+ * make no syscall when nobody sleeps. A waiter calls `futex_eventcount_prepare`, checks the
+ * condition once again, and either calls `futex_eventcount_wait` or not, then always
+ * `futex_eventcount_leave`. A notifier makes the condition hold and calls
+ * `futex_eventcount_notify`: either it sees the waiter, or the waiter sees the condition. A
+ * notification after the preparation is not lost either: the wait returns right away.
+ */
+struct futex_eventcount {
+    /**
+     * The waiters, prepared and not yet left (the low half), and how many of them are being
+     * notified (the high half). A notification wakes a waiter only if there are more of them
+     * than wake-ups, so a burst of notifications does not make a syscall each.
+     */
+    uint64_t waiters;
+    /// The futex of the waiters. Bumped to wake them up
+    uint32_t seq;
+};
+
+void futex_eventcount_init(struct futex_eventcount *ec);
+
+/// Announce a waiter. Returns the key for `futex_eventcount_wait`
+uint32_t futex_eventcount_prepare(struct futex_eventcount *ec);
+
+/**
+ * Sleep unless notified since `key` was prepared, for at most `timeout` unless it's NULL.
+ * Returns as `futexp_timed_wait`.
+ */
+long futex_eventcount_wait(struct futex_eventcount *ec, uint32_t key,
+        const struct timespec *timeout);
+
+/// Leave the waiters, after `futex_eventcount_prepare`, whether waited or not
+void futex_eventcount_leave(struct futex_eventcount *ec);
+
+/// Wake up to `count` waiters, after the condition is made to hold
+void futex_eventcount_notify(struct futex_eventcount *ec, uint32_t count);
+
+/**
+ * Like `futex_eventcount_notify`, for a condition made to hold with a sequentially consistent
+ * atomic operation, which orders it before the look at the waiters already: no fence is needed,
+ * which is cheaper when nobody waits.
+ */
+void futex_eventcount_notify_sc(struct futex_eventcount *ec, uint32_t count);
+
+/// Wake up all the waiters, even the ones being notified already
+void futex_eventcount_notify_all(struct futex_eventcount *ec);
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mpmc_queue.h"
+
+enum {
+    MQ_ERR_NO_MEM = 1,
+};
+
+// The only error that may be reported is OOM
+unsigned char mpmc_queue_init(struct mpmc_queue *queue, size_t capacity) {
+    queue->capacity = capacity;
+    queue->cells = (struct mpmc_queue_cell *)malloc(capacity * sizeof (struct mpmc_queue_cell));
+    if (!queue->cells)
+        return MQ_ERR_NO_MEM;
+    for (size_t i = 0; i < capacity; ++i)
+        queue->cells[i].seq = i;
+    queue->head = queue->tail = 0;
+    return 0;
+}
+
+void mpmc_queue_destroy(struct mpmc_queue *queue) {
+    free(queue->cells);
+}
+
+bool mpmc_queue_push(struct mpmc_queue *queue, void *val) {
+    return mpmc_queue_push_many(queue, &val, 1) == 1;
+}
+
+size_t mpmc_queue_push_many(struct mpmc_queue *queue, void *const *vals, size_t count) {
+    size_t done = 0;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (done < count) {
+        /* The run of cells free for `pos` onwards, each for its own position */
+        size_t run = 0;
+        while (done + run < count) {
+            struct mpmc_queue_cell *cell = &queue->cells[(pos + run) % queue->capacity];
+            /* Acquire: the consumer which freed the cell must have taken its value */
+            size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            if (seq != pos + run)
+                break;
+            ++run;
+        }
+        if (run == 0) {
+            struct mpmc_queue_cell *cell = &queue->cells[pos % queue->capacity];
+            size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff < 0)  /* The cell still holds the value of the previous lap: full */
+                break;
+            /* Another producer has claimed `pos`, or the cell has been freed meanwhile */
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+            continue;
+        }
+        /* Claim the whole run at once (`pos` is updated on failure) */
+        if (!__atomic_compare_exchange_n(&queue->tail, &pos, pos + run, true, __ATOMIC_RELAXED,
+                    __ATOMIC_RELAXED))
+            continue;
+        for (size_t i = 0; i < run; ++i) {
+            struct mpmc_queue_cell *cell = &queue->cells[(pos + i) % queue->capacity];
+            cell->data = vals[done + i];
+            /* Release: the value is written before the consumer can see the cell is full */
+            __atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+        }
+        done += run;
+        pos += run;
+    }
+    return done;
+}
+
+bool mpmc_queue_pop(struct mpmc_queue *queue, void **val) {
+    struct mpmc_queue_cell *cell;
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (1) {
+        cell = &queue->cells[pos % queue->capacity];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                        __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            /* Nothing has been pushed at `pos` yet: empty */
+            return false;
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    *val = cell->data;
+    /* The cell is free for the producer of the next lap */
+    __atomic_store_n(&cell->seq, pos + queue->capacity, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t mpmc_queue_size(const struct mpmc_queue *queue) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    /* The head is read first, so it is at most the tail, unless both moved in between */
+    return tail > head ? tail - head : 0;
+}
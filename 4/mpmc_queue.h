@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A bounded lock-free queue of `void *` for many producers and many consumers, after Dmitry
+ * Vyukov's design. Each cell has a sequence number telling whose turn it is: the cell at position
+ * `pos` is free for the producer of `pos` when its sequence is `pos`, and holds the value for the
+ * consumer of `pos` when it is `pos + 1`. After the value is taken, the sequence becomes
+ * `pos + capacity`, the position of the next producer of the cell.
+ *
+ * So a push or a pop is one compare-and-swap of `tail` or `head`, which are on their own cache
+ * lines, and neither ever waits for the other.
+ */
+struct mpmc_queue_cell {
+    size_t seq;
+    void *data;
+};
+
+struct mpmc_queue {
+    size_t capacity;
+    struct mpmc_queue_cell *cells;
+
+    /// The position of the next pop
+    _Alignas(64) size_t head;
+    /// The position of the next push
+    _Alignas(64) size_t tail;
+};
+
+// The only error this function may return is OOM
+unsigned char mpmc_queue_init(struct mpmc_queue *queue, size_t capacity);
+
+void mpmc_queue_destroy(struct mpmc_queue *queue);
+
+/// Returns `false` if the queue is full
+bool mpmc_queue_push(struct mpmc_queue *queue, void *val);
+
+/**
+ * Push `count` values, claiming the runs of free cells with one compare-and-swap each, which is
+ * one for the whole batch unless other producers interleave. Returns how many were pushed, in
+ * order: fewer than `count` if the queue got full
+ */
+size_t mpmc_queue_push_many(struct mpmc_queue *queue, void *const *vals, size_t count);
+
+/// Returns `false` if the queue is empty
+bool mpmc_queue_pop(struct mpmc_queue *queue, void **val);
+
+/// The size at some moment during the call, as the queue can change meanwhile
+size_t mpmc_queue_size(const struct mpmc_queue *queue);
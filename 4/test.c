@@ -1,8 +1,24 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "circular_queue.h"
 #include "unit.h"
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+struct test_cq_elem {
+	uint32_t id;
+	char tag[12];
+};
+
+#define CQ_NAME test_cq
+#define CQ_TYPE struct test_cq_elem
+#include "circular_queue_impl.h"
 
 static void
 test_new(void)
@@ -243,6 +259,1006 @@ test_thread_pool_max_tasks(void)
 }
 
 
+struct push_ctx {
+	struct thread_pool *pool;
+	int *arg;
+};
+
+static void *
+push_many_f(void *arg)
+{
+	struct push_ctx *ctx = (struct push_ctx *) arg;
+	enum { count = 10000 };
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	map_reduce_inc(ctx->pool, tasks, count, ctx->arg);
+	free(tasks);
+	return NULL;
+}
+
+static void
+test_concurrent_push(void)
+{
+	unit_test_start();
+
+	/*
+	 * Several threads push and join at once, there is no lock to
+	 * serialize them.
+	 */
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int arg = 0;
+	struct push_ctx ctx = {p, &arg};
+	pthread_t threads[4];
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, push_many_f, &ctx) != 0);
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+	unit_check(arg == 4 * 10000, "all the tasks are done");
+	unit_check(thread_pool_thread_count(p) <= 4, "no more threads than max");
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+struct spawn_ctx {
+	struct thread_pool *pool;
+	int *arg;
+	int depth;
+};
+
+static void *
+task_spawn_f(void *arg)
+{
+	/*
+	 * A binary tree of tasks, each one pushing its children from its
+	 * worker and detaching them, the leaves count themselves.
+	 */
+	struct spawn_ctx *ctx = (struct spawn_ctx *) arg;
+	if (ctx->depth == 0) {
+		__atomic_add_fetch(ctx->arg, 1, __ATOMIC_RELAXED);
+		free(ctx);
+		return NULL;
+	}
+	for (int i = 0; i < 2; ++i) {
+		struct spawn_ctx *child = malloc(sizeof(*child));
+		*child = *ctx;
+		--child->depth;
+		struct thread_task *t;
+		unit_fail_if(thread_task_new(&t, task_spawn_f, child) != 0);
+		unit_fail_if(thread_pool_push_task(ctx->pool, t) != 0);
+		unit_fail_if(thread_task_detach(t) != 0);
+	}
+	free(ctx);
+	return NULL;
+}
+
+static void
+test_push_from_task(void)
+{
+#ifdef NEED_DETACH
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int arg = 0;
+	struct spawn_ctx *ctx = malloc(sizeof(*ctx));
+	*ctx = (struct spawn_ctx){p, &arg, 10};
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_spawn_f, ctx) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_detach(t) != 0);
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != 1 << 10)
+		usleep(1000);
+	unit_check(true, "the tasks pushed by the tasks are done");
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { count = 1000 };
+	struct thread_task **tasks = malloc(sizeof(*tasks) * count);
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	unit_check(thread_pool_push_tasks(p, tasks, TPOOL_MAX_TASKS + 1) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too big batch");
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0, "push batch");
+	bool ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && thread_task_join(tasks[i], &result) == 0;
+	unit_check(ok, "join the batch");
+	unit_check(arg == count, "all the tasks are done");
+	unit_check(thread_pool_thread_count(p) <= 4, "no more threads than max");
+
+	/* A batch with a pushed task in it is not pushed at all. */
+	unit_fail_if(thread_pool_push_task(p, tasks[count / 2]) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, count) ==
+		   TPOOL_ERR_INVALID_REPUSH, "batch with a pushed task");
+	unit_fail_if(thread_task_join(tasks[count / 2], &result) != 0);
+	unit_check(arg == count + 1, "the other tasks are not pushed");
+
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0, "repush batch");
+	ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && thread_task_join(tasks[i], &result) == 0;
+	unit_check(ok && arg == 2 * count + 1, "repushed batch is done");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	free(tasks);
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void
+test_task_init(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	enum { count = 100 };
+	struct thread_task_storage storage[count];
+	struct thread_task *tasks[count];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_init(&tasks[i], &storage[i], task_incr_f,
+					      &arg) != 0);
+	unit_check(thread_pool_push_tasks(p, tasks, count) == 0,
+		   "push tasks in the caller's storage");
+	bool ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && thread_task_join(tasks[i], &result) == 0 &&
+		     result == &arg;
+	unit_check(ok && arg == count, "join them");
+	unit_check(thread_task_delete(tasks[0]) == 0, "delete one");
+	unit_fail_if(thread_task_init(&tasks[0], &storage[0], task_incr_f,
+				      &arg) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+#ifdef NEED_DETACH
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_detach(tasks[i]) != 0);
+	while (__atomic_load_n(&arg, __ATOMIC_RELAXED) != 2 * count)
+		usleep(100);
+	unit_check(true, "detached tasks in the caller's storage are done");
+	/* The storage can go once the pool is deleted. */
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+#else
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+#endif
+
+	unit_test_finish();
+}
+
+static void *
+task_load_f(void *arg)
+{
+	return (void *)(intptr_t)__atomic_load_n((int *)arg, __ATOMIC_RELAXED);
+}
+
+static void
+test_then(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	int arg = 0;
+	void *result;
+	struct thread_task *t, *next;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_new(&next, task_load_f, &arg) != 0);
+	unit_check(thread_task_when_all(&t, 0, next) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "wait for no tasks");
+	unit_check(thread_task_then(t, next) == 0, "then before push");
+	unit_check(thread_task_then(t, next) == TPOOL_ERR_INVALID_REPUSH,
+		   "the successor is pushed");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(next, &result) != 0);
+	unit_check(result == (void *)1, "the successor runs after the task");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+
+	/* A finished task is not waited for. */
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	while (!thread_task_is_finished(t))
+		usleep(100);
+	unit_check(thread_task_then(t, next) == 0, "then a finished task");
+	unit_fail_if(thread_task_join(next, &result) != 0);
+	unit_check(result == (void *)2, "the successor runs");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+
+	enum { count = 100 };
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_check(thread_task_when_all(tasks, count, next) == 0, "when all");
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	unit_fail_if(thread_task_join(next, &result) != 0);
+	unit_check(result == (void *)(2 + count),
+		   "the successor runs after all the tasks");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+
+	/* A chain, each task pushed by the previous one's worker. */
+	for (int i = 0; i + 1 < count; ++i)
+		unit_fail_if(thread_task_then(tasks[i], tasks[i + 1]) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[count - 1], &result) != 0);
+	unit_check(arg == 2 + 2 * count, "chain of tasks");
+	for (int i = 0; i + 1 < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_delete(next) != 0);
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void
+test_idle(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_set_idle(p, -1, 0) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "negative min thread count");
+	unit_check(thread_pool_set_idle(p, 5, 0) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "min thread count over max");
+	unit_check(thread_pool_set_idle(p, 2, -1) == 0 &&
+		   thread_pool_thread_count(p) == 2,
+		   "min threads are spawned right away");
+	unit_fail_if(thread_pool_set_idle(p, 1, 0.01) != 0);
+
+	enum { count = 4 };
+	struct thread_task *tasks[count];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f, &arg) != 0);
+	for (int round = 0; round < 2; ++round) {
+		__atomic_store_n(&arg, 0, __ATOMIC_RELAXED);
+		unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+		while (thread_pool_thread_count(p) != count)
+			usleep(100);
+		__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < count; ++i)
+			unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		/* The idle threads exit, one stays. */
+		for (int i = 0; i < 1000 && thread_pool_thread_count(p) != 1; ++i)
+			usleep(1000);
+		unit_check(thread_pool_thread_count(p) == 1,
+			   "idle threads exit down to min");
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void *
+task_placement_f(void *arg)
+{
+	(void)arg;
+	char name[16];
+	if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0 ||
+	    strncmp(name, "tpool/", 6) != 0)
+		return NULL;
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0 ||
+	    CPU_COUNT(&set) != 1 || !CPU_ISSET(0, &set))
+		return NULL;
+	return (void *)1;
+}
+
+static void
+test_options(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options opts;
+	int cpus[] = {0};
+	thread_pool_options_init(&opts, 3);
+	opts.cpus = cpus;
+	unit_check(thread_pool_new_ext(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no CPUs");
+	opts.cpus = NULL;
+	opts.numa_node = 1 << 20;
+	unit_check(thread_pool_new_ext(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no such NUMA node");
+	opts.numa_node = TPOOL_NUMA_NONE;
+	opts.stack_size = 1;
+	unit_check(thread_pool_new_ext(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "too small stack");
+
+	opts.cpus = cpus;
+	opts.cpu_count = 1;
+	opts.numa_node = TPOOL_NUMA_SPREAD;
+	opts.stack_size = 1 << 20;
+	opts.name = "tpool";
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+	enum { count = 10 };
+	struct thread_task *tasks[count];
+	void *result;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_placement_f, NULL) != 0);
+		/* Including nodes which don't exist. */
+		thread_task_set_node(tasks[i], i % 3 - 1);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		ok = ok && result == (void *)1;
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(ok, "threads are named and run on the CPUs");
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+struct order_ctx {
+	int *order;
+	int *pos;
+	int id;
+};
+
+static void *
+task_order_f(void *arg)
+{
+	struct order_ctx *ctx = (struct order_ctx *) arg;
+	ctx->order[__atomic_fetch_add(ctx->pos, 1, __ATOMIC_RELAXED)] = ctx->id;
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	/* One thread, busy while the tasks are pushed, takes them by priority. */
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	enum { count = 15, aged_count = 40 };
+	struct thread_task *blocker, *tasks[aged_count];
+	struct order_ctx ctxs[aged_count];
+	int order[aged_count], pos = 0, arg = 0;
+	void *result;
+	unit_fail_if(thread_task_new(&blocker, task_wait_for_f, &arg) != 0);
+	unit_check(thread_task_set_priority(blocker, TPOOL_PRIORITY_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no such priority");
+	for (int i = 0; i < aged_count; ++i) {
+		ctxs[i] = (struct order_ctx){order, &pos, i};
+		unit_fail_if(thread_task_new(&tasks[i], task_order_f, &ctxs[i]) != 0);
+	}
+
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	/* Low ones first, high ones last. */
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_set_priority(tasks[i],
+			TPOOL_PRIORITY_LOW - i / 5) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_pool_queue_depth(p, TPOOL_PRIORITY_HIGH) == 5 &&
+		   thread_pool_queue_depth(p, TPOOL_PRIORITY_NORMAL) == 5 &&
+		   thread_pool_queue_depth(p, TPOOL_PRIORITY_LOW) == 5,
+		   "queue depth of each priority");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && order[i] / 5 == 2 - i / 5;
+	unit_check(ok, "higher priorities first");
+
+	/* A low one is not starved by the high ones. */
+	__atomic_store_n(&arg, 0, __ATOMIC_RELAXED);
+	pos = 0;
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_running(blocker))
+		usleep(100);
+	for (int i = 0; i < aged_count; ++i) {
+		unit_fail_if(thread_task_set_priority(tasks[i], i == 0 ?
+			TPOOL_PRIORITY_LOW : TPOOL_PRIORITY_HIGH) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < aged_count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	int low_pos = 0;
+	while (order[low_pos] != 0)
+		++low_pos;
+	unit_check(low_pos < aged_count - 1, "low priority is not starved");
+
+	for (int i = 0; i < aged_count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void
+for_mark_f(size_t begin, size_t end, void *ctx)
+{
+	int *marks = ctx;
+	for (size_t i = begin; i < end; ++i)
+		__atomic_add_fetch(&marks[i], 1, __ATOMIC_RELAXED);
+}
+
+/* A range as a result: its bounds, so that the order of combining is seen. */
+static void *
+map_range_f(size_t begin, size_t end, void *ctx)
+{
+	(void)ctx;
+	return (void *)(uintptr_t)(begin << 20 | end);
+}
+
+static void *
+combine_range_f(void *a, void *b, void *ctx)
+{
+	bool *ok = ctx;
+	uintptr_t left = (uintptr_t)a, right = (uintptr_t)b;
+	if ((left & 0xfffff) != right >> 20)
+		__atomic_store_n(ok, false, __ATOMIC_RELAXED);
+	return (void *)((left >> 20) << 20 | (right & 0xfffff));
+}
+
+struct nested_for_ctx {
+	struct thread_pool *pool;
+	int *marks;
+};
+
+static void *
+task_nested_for_f(void *arg)
+{
+	struct nested_for_ctx *ctx = arg;
+	int err = thread_pool_parallel_for(ctx->pool, 0, 1000, 10, for_mark_f,
+					   ctx->marks);
+	return (void *)(intptr_t)err;
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { count = 100000 };
+	int *marks = calloc(count, sizeof(*marks));
+	unit_fail_if(marks == NULL);
+
+	unit_fail_if(thread_pool_parallel_for(p, 0, count, 0, for_mark_f, marks) != 0);
+	bool ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && marks[i] == 1;
+	unit_check(ok, "each index once");
+	unit_fail_if(thread_pool_parallel_for(p, 10, 20, 1, for_mark_f, marks) != 0);
+	unit_fail_if(thread_pool_parallel_for(p, 5, 5, 1, for_mark_f, marks) != 0);
+	ok = true;
+	for (int i = 0; i < count; ++i)
+		ok = ok && marks[i] == (i >= 10 && i < 20 ? 2 : 1);
+	unit_check(ok, "a subrange, an empty range");
+	unit_check(thread_pool_parallel_for(p, 2, 1, 0, for_mark_f, marks) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "reversed range");
+
+	void *result;
+	ok = true;
+	unit_fail_if(thread_pool_parallel_reduce(p, 3, count, 7, map_range_f,
+						 combine_range_f, &ok, &result) != 0);
+	unit_check(ok && (uintptr_t)result == (3 << 20 | count),
+		   "reduce combines left to right");
+	unit_fail_if(thread_pool_parallel_reduce(p, 3, 3, 7, map_range_f,
+						 combine_range_f, &ok, &result) != 0);
+	unit_check(result == NULL, "reduce of an empty range");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* From a task of a single thread: it must help, not block. */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	memset(marks, 0, count * sizeof(*marks));
+	struct nested_for_ctx ctx = {p, marks};
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_nested_for_f, &ctx) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	ok = result == NULL;
+	for (int i = 0; i < 1000; ++i)
+		ok = ok && marks[i] == 1;
+	unit_check(ok, "nested in a task");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	free(marks);
+
+	unit_test_finish();
+}
+
+#ifdef NEED_STATS
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	enum { count = 10 };
+	struct thread_task *tasks[count], *slow;
+	int arg = 0, flag = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_task_new(&slow, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_pool_push_task(p, slow) != 0);
+	usleep(5000);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(slow, &result) != 0);
+
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	uint64_t waited = 0, ran = 0, long_ran = 0, worker_tasks = 0, busy = 0;
+	for (int i = 0; i < TPOOL_STATS_BUCKETS; ++i) {
+		waited += stats.wait_hist[i];
+		ran += stats.run_hist[i];
+		if (i >= 22)
+			long_ran += stats.run_hist[i];
+	}
+	for (size_t i = 0; i < stats.worker_count; ++i) {
+		struct thread_pool_worker_stats worker;
+		unit_fail_if(thread_pool_worker_stats(p, i, &worker) != 0);
+		worker_tasks += worker.task_count;
+		busy += worker.busy_ns;
+	}
+	unit_check(waited == count + 1 && ran == count + 1 &&
+		   worker_tasks == count + 1, "each task counted once");
+	unit_check(long_ran >= 1 && busy >= 4000000, "the slow task is seen");
+	unit_check(stats.max_task_count == count, "high-water mark");
+	unit_check(stats.worker_count >= 1 && stats.worker_count <= 2 &&
+		   stats.spawn_count == stats.worker_count, "spawn count");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(slow) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+#endif
+
+#ifdef NEED_TRACE
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	enum { count = 10 };
+	struct thread_task *tasks[count];
+	int arg = 0;
+	void *result;
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+
+	char path[] = "/tmp/tpool_trace_XXXXXX";
+	int fd = mkstemp(path);
+	unit_fail_if(fd < 0);
+	close(fd);
+	unit_check(thread_pool_trace_dump(p, path) == 0, "dump");
+	FILE *f = fopen(path, "r");
+	unit_fail_if(f == NULL);
+	char line[512];
+	int pushes = 0, starts = 0, finishes = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		pushes += strstr(line, "\"name\":\"push\"") != NULL;
+		starts += strstr(line, "\"name\":\"task\",\"ph\":\"B\"") != NULL;
+		finishes += strstr(line, "\"ph\":\"E\"") != NULL &&
+			    strstr(line, "\"tid\":2}") == NULL;
+	}
+	fclose(f);
+	unlink(path);
+	unit_check(pushes == count && starts == count, "each push and start traced once");
+	unit_check(finishes >= count, "the finishes are traced");
+	unit_check(thread_pool_trace_dump(p, "/nonexistent/trace.json") ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "a file which can not be written");
+
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+#endif
+
+struct release_ctx {
+	int *flag;
+	useconds_t delay;
+};
+
+static void *
+release_after_f(void *arg)
+{
+	struct release_ctx *ctx = arg;
+	usleep(ctx->delay);
+	__atomic_store_n(ctx->flag, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void
+test_limits(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	struct thread_pool *p;
+	thread_pool_options_init(&opts, TPOOL_MAX_THREADS + 5);
+	opts.max_task_count = 0;
+	unit_check(thread_pool_new_ext(&opts, &p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no room for tasks");
+	opts.max_task_count = 3;
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+
+	enum { count = 3 };
+	struct thread_task *tasks[count], *extra;
+	int flag = 0;
+	void *result;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f, &flag) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_new(&extra, task_wait_for_f, &flag) != 0);
+	unit_check(thread_pool_push_task(p, extra) == TPOOL_ERR_TOO_MANY_TASKS,
+		   "the limit of tasks");
+	unit_check(thread_pool_push_task_timed(p, extra, 0.01) == TPOOL_ERR_TIMEOUT,
+		   "timed push times out");
+
+	/* Waits for the others to finish. */
+	pthread_t releaser;
+	struct release_ctx ctx = {&flag, 10000};
+	unit_fail_if(pthread_create(&releaser, NULL, release_after_f, &ctx) != 0);
+	unit_check(thread_pool_push_task_timed(p, extra, 10) == 0,
+		   "timed push waits for room");
+	unit_fail_if(pthread_join(releaser, NULL) != 0);
+	unit_fail_if(thread_task_join(extra, &result) != 0);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(thread_pool_push_task_timed(p, extra, 0) == 0,
+		   "timed push with room");
+	unit_fail_if(thread_task_join(extra, &result) != 0);
+	unit_fail_if(thread_task_delete(extra) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+/*
+ * The successors of a task are counted over the limit when it is done,
+ * and may find the queue of their priority, or of their node, full.
+ */
+static void
+test_successors_at_limit(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options opts;
+	struct thread_pool *p;
+	thread_pool_options_init(&opts, 1);
+	opts.max_task_count = 2;
+	unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+
+	/* Released by the worker: the rest go to its deque. */
+	enum { count = 3, spilled = 5 };
+	struct thread_task *a, *high, *succs[spilled];
+	int flag = 0, done = 0;
+	void *result;
+	unit_fail_if(thread_task_new(&a, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	while (!thread_task_is_running(a))
+		usleep(100);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&succs[i], task_incr_f, &done) != 0);
+		unit_fail_if(thread_task_set_priority(succs[i],
+						      TPOOL_PRIORITY_HIGH) != 0);
+		unit_fail_if(thread_task_then(a, succs[i]) != 0);
+	}
+	unit_fail_if(thread_task_new(&high, task_incr_f, &done) != 0);
+	unit_fail_if(thread_task_set_priority(high, TPOOL_PRIORITY_HIGH) != 0);
+	unit_fail_if(thread_pool_push_task(p, high) != 0);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join(a, &result) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(succs[i], &result) != 0);
+	unit_fail_if(thread_task_join(high, &result) != 0);
+	unit_check(done == count + 1, "high successors over the limit run");
+	unit_fail_if(thread_task_delete(a) != 0);
+	unit_fail_if(thread_task_delete(high) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(succs[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/*
+	 * Released by a thread helping while it joins, with the worker
+	 * busy: the rest are run by the helper itself. Of high priority,
+	 * then normal ones of a node (of the normal queue with one node).
+	 */
+	opts.max_task_count = 4;
+	opts.numa_node = TPOOL_NUMA_SPREAD;
+	for (int normal = 0; normal < 2; ++normal) {
+		struct thread_task *blocker;
+		int marks[100] = {0};
+		flag = done = 0;
+		unit_fail_if(thread_pool_new_ext(&opts, &p) != 0);
+		unit_fail_if(thread_task_new(&blocker, task_wait_for_f,
+					     &flag) != 0);
+		unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+		while (!thread_task_is_running(blocker))
+			usleep(100);
+		unit_fail_if(thread_task_new(&a, task_incr_f, &done) != 0);
+		unit_fail_if(thread_task_set_priority(a,
+						      TPOOL_PRIORITY_HIGH) != 0);
+		unit_fail_if(thread_task_new(&high, task_incr_f, &done) != 0);
+		for (int i = 0; i < spilled; ++i) {
+			unit_fail_if(thread_task_new(&succs[i], task_incr_f,
+						     &done) != 0);
+			unit_fail_if(thread_task_then(a, succs[i]) != 0);
+		}
+		for (int i = 0; i <= spilled; ++i) {
+			struct thread_task *t = i < spilled ? succs[i] : high;
+			if (normal)
+				thread_task_set_node(t, 0);
+			else
+				unit_fail_if(thread_task_set_priority(t,
+					TPOOL_PRIORITY_HIGH) != 0);
+		}
+		unit_fail_if(thread_pool_push_task(p, a) != 0);
+		unit_fail_if(thread_pool_push_task(p, high) != 0);
+		/* A piece to reach the limit, then helps with a first. */
+		unit_fail_if(thread_pool_parallel_for(p, 0, 100, 10,
+						      for_mark_f, marks) != 0);
+		unit_fail_if(thread_task_join(a, &result) != 0);
+		int run = __atomic_load_n(&done, __ATOMIC_RELAXED);
+		unit_check(run >= 1 + 2, normal ?
+			   "normal successors over the limit run by the helper" :
+			   "high successors over the limit run by the helper");
+		__atomic_store_n(&flag, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < spilled; ++i) {
+			unit_fail_if(thread_task_join(succs[i], &result) != 0);
+			unit_fail_if(thread_task_delete(succs[i]) != 0);
+		}
+		unit_fail_if(thread_task_join(high, &result) != 0);
+		unit_fail_if(thread_task_join(blocker, &result) != 0);
+		bool ok = done == spilled + 2;
+		for (int i = 0; i < 100; ++i)
+			ok = ok && marks[i] == 1;
+		unit_check(ok, "all the tasks run once");
+		unit_fail_if(thread_task_delete(a) != 0);
+		unit_fail_if(thread_task_delete(high) != 0);
+		unit_fail_if(thread_task_delete(blocker) != 0);
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+
+	unit_test_finish();
+}
+
+static void *
+task_wait_cancel_f(void *arg)
+{
+	__atomic_store_n((int *)arg, 1, __ATOMIC_RELAXED);
+	while (!thread_task_self_is_cancelled())
+		usleep(100);
+	return arg;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	enum { count = 5 };
+	struct thread_task *blocker, *tasks[count];
+	int started = 0, arg = 0;
+	void *result;
+	unit_fail_if(thread_task_new(&blocker, task_wait_cancel_f, &started) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &arg) != 0);
+	unit_check(thread_task_cancel(tasks[0]) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "cancel a task not pushed");
+	unit_check(!thread_task_self_is_cancelled(), "not in a task");
+
+	/* A queued one is skipped, a running one is told. */
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (__atomic_load_n(&started, __ATOMIC_RELAXED) == 0)
+		usleep(100);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_cancel(tasks[0]) != 0);
+	unit_fail_if(thread_task_cancel(blocker) != 0);
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(result == NULL && arg == 0 && thread_task_is_cancelled(tasks[0]) &&
+		   thread_task_is_cancelled(blocker), "cancel");
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(thread_task_join(tasks[0], &result) != 0);
+	unit_check(result == &arg && arg == 1 && !thread_task_is_cancelled(tasks[0]),
+		   "a repush runs");
+
+	/* Drain: the queued ones are run, the new ones are refused. */
+	int flag = 0;
+	struct thread_task *waiter;
+	unit_fail_if(thread_task_new(&waiter, task_wait_for_f, &flag) != 0);
+	unit_fail_if(thread_pool_push_task(p, waiter) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	pthread_t releaser;
+	struct release_ctx ctx = {&flag, 10000};
+	unit_fail_if(pthread_create(&releaser, NULL, release_after_f, &ctx) != 0);
+	unit_check(thread_pool_shutdown(p, -1) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no such mode");
+	unit_fail_if(thread_pool_shutdown(p, TPOOL_SHUTDOWN_DRAIN) != 0);
+	unit_fail_if(pthread_join(releaser, NULL) != 0);
+	unit_check(arg == 1 + count, "drain runs the tasks");
+	unit_check(thread_pool_push_task(p, blocker) == TPOOL_ERR_SHUT_DOWN,
+		   "no pushes after shutdown");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+	unit_fail_if(thread_task_join(waiter, &result) != 0);
+	unit_fail_if(thread_task_delete(waiter) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* Abort: the running one is told, the queued ones are skipped. */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	started = arg = 0;
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (__atomic_load_n(&started, __ATOMIC_RELAXED) == 0)
+		usleep(100);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	unit_fail_if(thread_pool_shutdown(p, TPOOL_SHUTDOWN_ABORT) != 0);
+	bool ok = arg == 0;
+	unit_fail_if(thread_task_join(blocker, &result) != 0);
+	ok = ok && thread_task_is_cancelled(blocker);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i], &result) != 0);
+		ok = ok && result == NULL && thread_task_is_cancelled(tasks[i]);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(ok, "abort cancels the tasks");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+task_now_f(void *arg)
+{
+	*(double *)arg = now_seconds();
+	return arg;
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	struct thread_task *t, *periodic;
+	void *result;
+	double ran = 0;
+	int runs = 0;
+	unit_fail_if(thread_task_new(&t, task_now_f, &ran) != 0);
+	unit_fail_if(thread_task_new(&periodic, task_incr_f, &runs) != 0);
+	unit_check(thread_pool_push_after(p, t, -1) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative delay");
+	unit_check(thread_pool_push_every(p, t, 0) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "zero period");
+
+	double pushed = now_seconds();
+	unit_fail_if(thread_pool_push_after(p, t, 0.05) != 0);
+	unit_check(thread_pool_push_after(p, t, 0.05) ==
+		   TPOOL_ERR_INVALID_REPUSH, "a delayed task is pushed");
+	unit_check(thread_pool_thread_count(p) == 0,
+		   "no thread waits for a delayed task");
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(ran - pushed >= 0.05, "run after the delay");
+
+	/* The earlier timer is not held up by the later one. */
+	double ran_late = 0;
+	struct thread_task *late;
+	unit_fail_if(thread_task_new(&late, task_now_f, &ran_late) != 0);
+	unit_fail_if(thread_pool_push_after(p, late, 10) != 0);
+	pushed = now_seconds();
+	unit_fail_if(thread_pool_push_after(p, t, 0.01) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(ran - pushed >= 0.01 && ran - pushed < 5,
+		   "an earlier timer wakes the timer thread");
+
+	unit_fail_if(thread_pool_push_every(p, periodic, 0.005) != 0);
+	while (__atomic_load_n(&runs, __ATOMIC_RELAXED) < 3)
+		usleep(1000);
+	unit_fail_if(thread_task_cancel(periodic) != 0);
+	unit_fail_if(thread_task_join(periodic, &result) != 0);
+	int total = runs;
+	usleep(20000);
+	unit_check(total >= 3 && runs == total, "periodic runs until cancelled");
+
+	/* Abort skips the delayed tasks, drain runs a periodic one once more. */
+	runs = 0;
+	unit_fail_if(thread_pool_push_every(p, periodic, 0.005) != 0);
+	unit_fail_if(thread_pool_shutdown(p, TPOOL_SHUTDOWN_ABORT) != 0);
+	unit_fail_if(thread_task_join(late, &result) != 0);
+	unit_check(result == NULL && ran_late == 0 &&
+		   thread_task_is_cancelled(late), "abort skips the timers");
+	unit_fail_if(thread_task_join(periodic, &result) != 0);
+	unit_check(runs <= 1, "abort stops the periodic task");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	runs = 0;
+	unit_fail_if(thread_pool_push_every(p, periodic, 0.005) != 0);
+	unit_fail_if(thread_pool_shutdown(p, TPOOL_SHUTDOWN_DRAIN) != 0);
+	unit_check(runs == 1, "drain runs a periodic task once more");
+	unit_fail_if(thread_task_join(periodic, &result) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_task_delete(late) != 0);
+	unit_fail_if(thread_task_delete(periodic) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_timed_join(void)
 {
@@ -352,6 +1368,192 @@ test_detach_long(void)
 #endif
 }
 
+static void *
+task_scratch_f(void *arg)
+{
+	(void)arg;
+	/* A big one too, beyond the first chunk. */
+	char *small = thread_pool_worker_scratch(100);
+	char *big = thread_pool_worker_scratch(1 << 20);
+	if (small == NULL || big == NULL || (uintptr_t)small % _Alignof(max_align_t) != 0)
+		return NULL;
+	memset(small, 1, 100);
+	memset(big, 2, 1 << 20);
+	if (small[99] != 1)
+		return NULL;
+	return small;
+}
+
+static int worker_value_destroyed = 0;
+
+static void
+worker_value_destroy(void *value)
+{
+	__atomic_add_fetch(&worker_value_destroyed, 1, __ATOMIC_RELAXED);
+	free(value);
+}
+
+static void *
+task_worker_value_f(void *arg)
+{
+	int key = *(int *)arg;
+	int *count = thread_pool_worker_get(key);
+	if (count == NULL) {
+		count = calloc(1, sizeof(*count));
+		if (count == NULL || thread_pool_worker_set(key, count) != 0)
+			return NULL;
+	}
+	++*count;
+	return count;
+}
+
+static void
+test_worker_local(void)
+{
+	unit_test_start();
+
+	unit_check(thread_pool_worker_scratch(1) == NULL, "no scratch outside of a worker");
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *t;
+	void *first, *result;
+	unit_fail_if(thread_task_new(&t, task_scratch_f, NULL) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &first) != 0);
+	unit_check(first != NULL, "scratch in a task");
+	/* The chunks grow for a couple of tasks, then one fits them all. */
+	bool is_reused = true;
+	for (int i = 0; i < 10; ++i) {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		is_reused = i < 5 || (is_reused && result == first);
+		first = result;
+	}
+	unit_check(is_reused, "the next tasks of the worker reuse the scratch");
+	unit_fail_if(thread_task_delete(t) != 0);
+
+	int key;
+	unit_fail_if(thread_pool_worker_key_create(worker_value_destroy, &key) != 0);
+	unit_check(thread_pool_worker_get(key) == NULL &&
+		   thread_pool_worker_set(key, &key) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no worker values outside of a worker");
+	unit_check(thread_pool_worker_set(TPOOL_MAX_WORKER_KEYS, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no such key");
+	unit_fail_if(thread_task_new(&t, task_worker_value_f, &key) != 0);
+	int *count = NULL;
+	for (int i = 0; i < 5; ++i) {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, (void **)&count) != 0);
+	}
+	unit_check(count != NULL && *count == 5, "the value is kept by the worker");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+	unit_check(worker_value_destroyed == 1, "the value is destroyed with the worker");
+
+	unit_test_finish();
+}
+
+static void
+test_circular_queue(void)
+{
+	unit_test_start();
+
+	struct circular_queue q;
+	unit_fail_if(circular_queue_init(&q) != 0);
+	unit_check(circular_queue_size(&q) == 0 &&
+		   circular_queue_capacity(&q) == CQ_SEGMENT_SIZE,
+		   "one segment at first");
+
+	/* Over 3 segments, then a drain: the values are not moved. */
+	enum { count = CQ_SEGMENT_SIZE * 3 + 10 };
+	bool is_ok = true;
+	for (uintptr_t i = 0; i < count; ++i)
+		is_ok = is_ok && circular_queue_push(&q, (void *)i) == 0;
+	unit_check(is_ok, "push across the segments");
+	unit_check(circular_queue_size(&q) == count, "size");
+	unit_check(circular_queue_capacity(&q) == CQ_SEGMENT_SIZE * 4,
+		   "grown by segments");
+	for (uintptr_t i = 0; i < CQ_SEGMENT_SIZE; ++i)
+		is_ok = is_ok && circular_queue_pop(&q) == (void *)i;
+	unit_check(is_ok, "pop the first segment in order");
+	unit_check(circular_queue_capacity(&q) == CQ_SEGMENT_SIZE * 4,
+		   "the emptied segment is kept as the spare one");
+	for (uintptr_t i = count; i < count + CQ_SEGMENT_SIZE; ++i)
+		is_ok = is_ok && circular_queue_push(&q, (void *)i) == 0;
+	unit_check(circular_queue_capacity(&q) == CQ_SEGMENT_SIZE * 4,
+		   "the spare segment is recycled");
+	for (uintptr_t i = CQ_SEGMENT_SIZE; i < count + CQ_SEGMENT_SIZE; ++i)
+		is_ok = is_ok && circular_queue_pop(&q) == (void *)i;
+	unit_check(is_ok, "drain in order");
+	unit_check(circular_queue_size(&q) == 0, "empty");
+	unit_check(circular_queue_capacity(&q) == CQ_SEGMENT_SIZE * 2,
+		   "one spare segment is left of the burst");
+
+	/* The last segment starts over once empty. */
+	for (uintptr_t i = 0; i < 10; ++i) {
+		is_ok = is_ok && circular_queue_push(&q, (void *)i) == 0 &&
+			circular_queue_pop(&q) == (void *)i;
+	}
+	unit_check(is_ok && circular_queue_capacity(&q) == CQ_SEGMENT_SIZE * 2,
+		   "an empty queue does not grow");
+	circular_queue_destroy(&q);
+
+	unit_test_finish();
+}
+
+static void
+test_typed_queue(void)
+{
+	unit_test_start();
+
+	struct test_cq q;
+	test_cq_init(&q);
+	unit_check(test_cq_size(&q) == 0 && test_cq_capacity(&q) == 0,
+		   "an empty queue allocates nothing");
+
+	/* Pushes and pops interleaved, so that the values wrap around. */
+	uint32_t pushed = 0, popped = 0;
+	bool is_ok = true;
+	for (int round = 0; round < 100; ++round) {
+		for (int i = 0; i < round % 7 + 3; ++i) {
+			struct test_cq_elem e = {.id = pushed++};
+			snprintf(e.tag, sizeof(e.tag), "%u", (unsigned)e.id);
+			is_ok = is_ok && test_cq_push(&q, e) == 0;
+		}
+		for (int i = 0; i < round % 5 + 1 && test_cq_size(&q) > 0; ++i) {
+			struct test_cq_elem e = test_cq_pop(&q);
+			char tag[12];
+			snprintf(tag, sizeof(tag), "%u", (unsigned)popped);
+			is_ok = is_ok && e.id == popped++ && strcmp(e.tag, tag) == 0;
+		}
+	}
+	unit_check(is_ok, "push and pop keep the order");
+	unit_check(test_cq_size(&q) == pushed - popped, "size");
+	size_t cap = test_cq_capacity(&q);
+	unit_check(cap >= test_cq_size(&q) && (cap & (cap - 1)) == 0,
+		   "the capacity is a power of two");
+
+	/* In bulk, across the wrap and a growth. */
+	struct test_cq_elem in[300], out[1024];
+	for (int i = 0; i < 300; ++i)
+		in[i] = (struct test_cq_elem){.id = pushed++};
+	unit_check(test_cq_push_many(&q, in, 300) == 0, "push many");
+	size_t n = test_cq_pop_many(&q, out, 1024);
+	unit_check(n == pushed - popped, "pop many takes all there is");
+	is_ok = true;
+	for (size_t i = 0; i < n; ++i)
+		is_ok = is_ok && out[i].id == popped++;
+	unit_check(is_ok, "pop many keeps the order");
+	unit_check(test_cq_pop_many(&q, out, 1) == 0, "nothing to pop");
+	unit_check(test_cq_reserve(&q, SIZE_MAX / 2) != 0, "too big a reserve fails");
+	unit_check(test_cq_push_many(&q, in, 1) == 0 && test_cq_pop(&q).id == in[0].id,
+		   "still usable after a failed reserve");
+
+	test_cq_destroy(&q);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -361,9 +1563,31 @@ main(void)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_concurrent_push();
+	test_push_from_task();
+	test_push_tasks();
+	test_task_init();
+	test_then();
+	test_idle();
+	test_options();
+	test_priority();
+	test_parallel_for();
+#ifdef NEED_STATS
+	test_stats();
+#endif
+#ifdef NEED_TRACE
+	test_trace();
+#endif
+	test_limits();
+	test_successors_at_limit();
+	test_cancel();
+	test_timers();
 	test_timed_join();
+	test_worker_local();
 	test_detach_stress();
 	test_detach_long();
+	test_circular_queue();
+	test_typed_queue();
 
 	unit_test_finish();
 	return 0;
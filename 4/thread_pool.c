@@ -1,15 +1,24 @@
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <assert.h>
 #include <limits.h>
 #include <float.h>
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
+#include <inttypes.h>
 
-#include "circular_queue.h"
 #include "futex.h"
+#include "mpmc_queue.h"
+#include "ws_deque.h"
+#include "topology.h"
+#include "timer_wheel.h"
 #include "thread_pool.h"
+#include "perf_region.h"
 
 /**
  * Possible states of `thread_task`. Only the following transitions are
@@ -27,6 +36,11 @@
  * allows for implementation of some operations as a sequence of atomic operations without
  * locks.
  *
+ * The exception is a periodic task, see `thread_pool_push_every`, which is re-armed after it runs:
+ * TASK_STATE_RUNNING       -> TASK_STATE_PUSHED,
+ * TASK_STATE_RUNNING_GHOST -> TASK_STATE_PUSHED_GHOST.
+ * Only the worker running it does that, so the others only need to retry when they see it.
+ *
  * Another possible transition is
  * TASK_STATE_JOINED -> TASK_STATE_CREATED
  * but it's up to the library's user to ensure that this transition does not happen while
@@ -44,38 +58,626 @@ enum task_state {
     TASK_STATE_JOINED,
 };
 
+/**
+ * Set in `thread_task.state` by a thread going to wait for it to change, cleared by a change:
+ * with no waiters, the change is done without the wake-up syscall
+ */
+#define TASK_HAS_WAITERS ((uint32_t)1 << 31)
+
+#ifdef NEED_STATS
+
+/// The counters of the tasks run by a worker, or by the other threads helping a pool
+struct run_stats {
+    /// Only the tasks are counted for the threads which are not the workers
+    struct thread_pool_worker_stats total;
+    uint64_t wait_hist[TPOOL_STATS_BUCKETS];
+    uint64_t run_hist[TPOOL_STATS_BUCKETS];
+};
+
+#endif
+
+/**
+ * Two cache lines, aligned: the fields set by the push and read by the worker in the first one,
+ * those written by the worker and the joiners while the task is in the pool in the second one. So
+ * the workers and the joiners of the neighbour tasks never share a line, neither do a joiner
+ * spinning on `state` and the worker reading the function of the task.
+ */
 struct thread_task {
     thread_task_f function;
     void *arg;
-    void *ret;
+    /// The pool the task is pushed into, where its successors go
+    struct thread_pool *pool;
+    /// The NUMA node to run the task on, -1 for any, see `thread_task_set_node`
+    int node;
+    /// One of `TPOOL_PRIORITY_*`, see `thread_task_set_priority`
+    int priority;
+    /// Whether the task is in the storage of the caller, see `thread_task_init`
+    bool is_embedded;
+    /// The ticks between the runs of a periodic task, 0 if it is not one
+    uint64_t period_ticks;
+    /// In `thread_pool.timers` while the task waits to be queued, under `timer_lock`
+    struct timer_node timer;
 
     /**
-     * Current task state. Can be used as a futex.
-     * On every change (except for when intialized via `thread_task_new`), `FUTEX_WAKE_PRIVATE`
-     * shall be performed for `INT_MAX` waiters.
+     * Current task state, an `enum task_state` or-ed with `TASK_HAS_WAITERS`. Can be used as a
+     * futex. On every change (except for when intialized via `thread_task_new`), if there are
+     * waiters, `FUTEX_WAKE_PRIVATE` shall be performed for `INT_MAX` of them.
      *
      * Must be assigned and fetched using `__atomic_*` functions with acquire and release memory
      * orders, respectively, to ensure consistent state transitions.
      */
-    enum task_state state;
+    _Alignas(64) uint32_t state;
+    /// Set by `thread_task_cancel` or an aborting shutdown, reset by a push, atomic
+    bool is_cancelled;
+    void *ret;
+    /**
+     * The tasks to run after this one, see `thread_task_when_all`. Atomic: added with a
+     * compare-and-swap, and replaced with `TASK_LINKS_CLOSED` by the worker when the task is
+     * finished, so each is either released by the worker or sees the task finished.
+     */
+    struct task_link *successors;
+    /// How many tasks this one still waits for to be queued, atomic, see `thread_task_when_all`
+    size_t pending;
+    /// The next free task in a cache, see `thread_task_alloc`
+    struct thread_task *next_free;
+    /// The next batch of free tasks in the depot, in the first task of a batch
+    struct thread_task *next_batch;
+#ifdef NEED_STATS
+    /// When the task was last queued, in nanoseconds of `CLOCK_MONOTONIC`
+    uint64_t push_ns;
+#endif
+};
+
+/// An edge of the task graph: `task` waits for the one whose `successors` it is on
+struct task_link {
+    struct thread_task *task;
+    struct task_link *next;
+};
+
+/// The successors of a task which has finished and is not joined yet: no waiting for it
+#define TASK_LINKS_CLOSED ((struct task_link *)-1)
+
+_Static_assert(sizeof (struct thread_task) <= sizeof (struct thread_task_storage),
+        "`struct thread_task_storage` must fit a task");
+_Static_assert(_Alignof(struct thread_task) <= _Alignof(struct thread_task_storage),
+        "`struct thread_task_storage` must be aligned as a task");
+
+enum {
+    /// How many times an idle worker looks into the queue before it parks on the futex
+    TPOOL_SPIN_COUNT = 100,
+    /// How many times a join looks at the task before it parks on the futex
+    TPOOL_JOIN_SPIN_COUNT = 100,
+    /// A worker looks for the lower priority tasks first once in this many tasks
+    TPOOL_AGING_PERIOD = 16,
+    /// The tasks moved between a thread's cache and the depot at once
+    TPOOL_TASK_BATCH = 64,
+    /// The most batches of free tasks in the depot, the rest are freed
+    TPOOL_DEPOT_MAX_BATCHES = 64,
+    /// An automatic grain of a parallel loop gives each thread this many pieces to balance
+    TPOOL_PIECES_PER_THREAD = 8,
+    /// The most pieces of a range split off by one task at once, the rest is done by itself
+    TPOOL_MAX_SPLITS = 64,
+    /// The most tasks nested in a thread helping while it joins, see `thread_pool_help_join`
+    TPOOL_MAX_HELP_DEPTH = 8,
+    /// The first chunk of the scratch memory of a worker, the next ones twice the previous
+    TPOOL_SCRATCH_CHUNK = 64 * 1024,
+    /// The granularity of the delayed tasks, in nanoseconds
+    TPOOL_TIMER_TICK_NS = 1000000,
+};
+
+/**
+ * The freed tasks are kept for the next ones, so that creating and deleting a task allocates
+ * nothing most of the time. Each thread has a cache of them, accessed without any
+ * synchronization. A cache of more than two batches gives a batch to the depot, shared by all
+ * the threads, and an empty cache takes one from there. So the workers deleting detached tasks
+ * feed the threads creating them, one lock per batch.
+ *
+ * The tasks are cached only while there are pools: the last pool deleted frees the depot and the
+ * cache of its thread, and a thread frees its cache when it exits, so that nothing is left
+ * allocated once the pools are gone.
+ */
+struct task_cache {
+    struct thread_task *head;
+    size_t count;
+    /// Whether the cache is to be freed when the thread exits
+    bool is_registered;
+};
+
+static __thread struct task_cache task_cache;
+/// Key to free the cache of a thread when it exits
+static pthread_key_t task_cache_key;
+static pthread_once_t task_cache_once = PTHREAD_ONCE_INIT;
+
+static struct futex_mutex task_depot_lock = FUTEX_MUTEX_INITIALIZER;
+/// Batches of `TPOOL_TASK_BATCH` free tasks, under `task_depot_lock`
+static struct thread_task *task_depot;
+static size_t task_depot_count;
+/// The number of pools, under `task_depot_lock`, read atomically
+static size_t pool_count;
+
+/**
+ * The scratch memory of a worker, see `thread_pool_worker_scratch`: a stack of chunks, allocated
+ * from the top one. A task gives back all it has taken when it returns, the chunks it has added
+ * are freed but the biggest, which is kept for the next ones. As each chunk is twice the previous,
+ * the tasks soon fit the one kept, and then the scratch allocates nothing.
+ */
+struct scratch_chunk {
+    struct scratch_chunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+struct worker_scratch {
+    struct scratch_chunk *top;
+    /// A chunk given back, to be used before a new one is allocated
+    struct scratch_chunk *spare;
+};
+
+/// Where the scratch was before a task, see `scratch_release`
+struct scratch_mark {
+    struct scratch_chunk *chunk;
+    size_t used;
+};
+
+/// The destructors of the keys of `thread_pool_worker_key_create`, under `worker_key_lock`
+static void (*worker_key_destructors[TPOOL_MAX_WORKER_KEYS])(void *);
+/// The number of keys, written under `worker_key_lock`, read atomically
+static int worker_key_count;
+static struct futex_mutex worker_key_lock = FUTEX_MUTEX_INITIALIZER;
+
+/// What happened in a trace, see `thread_pool_trace_dump`
+enum trace_type {
+    TRACE_PUSH,
+    TRACE_START,
+    TRACE_FINISH,
+    TRACE_PARK,
+    TRACE_WAKE,
+};
+
+#ifdef NEED_TRACE
+
+struct trace_event {
+    uint64_t ns;
+    uintptr_t task;
+    uint32_t type;
+};
+
+/**
+ * The last `TPOOL_TRACE_EVENTS` events of a thread, or of several under a lock. The fields are
+ * stored and loaded atomically, for a dump to read them while they are written.
+ */
+struct trace_ring {
+    struct trace_event *events;
+    /// Events ever added
+    uint64_t head;
+};
+
+#endif
+
+struct thread_pool_worker {
+    struct thread_pool *pool;
+    pthread_t thread;
+    size_t index;
+    /// The node of the pool the worker runs on, -1 if the pool has none
+    int node;
+    /// The number of tasks the worker has taken, for the aging of priorities
+    size_t tick;
+    /**
+     * Tasks pushed by the tasks this worker runs. It takes them from the bottom, the latest
+     * first, as their data is likely still in its cache. The idle workers steal from the top.
+     */
+    struct ws_deque deque;
+    /**
+     * Whether the worker has exited after being idle for too long, under `spawn_lock`. Its
+     * deque is left empty, and its thread is joined when the slot is reused.
+     */
+    bool is_retired;
+    /// Of the worker only, see `thread_pool_worker_scratch`. Empty when it is not running
+    struct worker_scratch scratch;
+    /// See `thread_pool_worker_get`. All NULL when it is not running
+    void *values[TPOOL_MAX_WORKER_KEYS];
+#ifdef NEED_TRACE
+    /// Written by the worker only
+    struct trace_ring trace;
+#endif
+#ifdef NEED_STATS
+    /// Written by the worker only, read atomically
+    struct run_stats stats;
+    /// When the worker last started waiting for a task
+    uint64_t idle_since_ns;
+#endif
 };
 
+/// The worker of the current thread, NULL if it is not a worker of a pool
+static __thread struct thread_pool_worker *current_worker;
+/// The task the current thread runs, the innermost one, see `thread_task_self_is_cancelled`
+static __thread struct thread_task *current_task;
+
+/**
+ * The fields read by every push and every worker and rarely written come first, then each of those
+ * written on every push or every task in a cache line of its own, so that the writes of one do not
+ * invalidate the others in the caches of the other threads. The cold ones are at the end.
+ */
 struct thread_pool {
     size_t tmax;
-    pthread_t *threads;
+    /// `tmax` workers, the first `spawned_count` of which are spawned
+    struct thread_pool_worker *workers;
+    /// The most tasks at once, see `struct thread_pool_options`
+    size_t task_limit;
+    /**
+     * The number of worker slots used, of the workers running or retired. Written under
+     * `spawn_lock`, read atomically: with acquire to look into the deques of the workers
+     */
+    size_t spawned_count;
+    /// The number of running workers. Written under `spawn_lock`, read atomically
+    size_t thread_count;
+    /// The number of workers not to retire. Written under `spawn_lock`, read atomically
+    size_t tmin;
+    /// How long a worker waits for a task before it retires, in nanoseconds, atomic. -1 for ever
+    int64_t idle_timeout_ns;
+    /// Set when the pool is deleted, for the workers to exit
+    bool is_stopping;
+    /// Set by `thread_pool_shutdown`, for the pushes from outside to fail, atomic
+    bool is_shut_down;
+    /// Set by an aborting `thread_pool_shutdown`, for the tasks to be cancelled, atomic
+    bool is_aborting;
+    /**
+     * The NUMA nodes the workers are spread over, the worker `i` on the node `i % node_count`.
+     * None if the workers run anywhere.
+     */
+    struct topology_node *nodes;
+    int node_count;
+    /// The tasks to run on each of `nodes`, if there are several, of `task_limit` cells each
+    struct mpmc_queue *node_queues;
 
-    pthread_mutex_t queue_lock;
-    /// Signalled (with taken `queue_lock`) when new tasks are pushed into the queue
-    pthread_cond_t queue_push_cond;
-    /// Tasks queue. Protected with `queue_lock`
-    struct circular_queue queue;
+    /**
+     * The number of tasks pushed and not yet finished: queued or running. Incremented before a
+     * task is queued, decremented before it is declared finished, so that the pool can be
+     * deleted as soon as its tasks are joined.
+     */
+    _Alignas(64) size_t task_count;
+    /// The number of workers not running a task, atomic
+    _Alignas(64) size_t free_count;
+    /// The parked workers, notified by the pushes
+    _Alignas(64) struct futex_eventcount parked;
+    /// The pushers waiting for room, see `thread_pool_push_task_timed`
+    _Alignas(64) struct futex_eventcount room;
+    /**
+     * Tasks of each priority, of `task_limit` cells each. The normal ones pushed from
+     * outside of the workers, and all the others. Each end of each is in a line of its own
+     */
+    struct mpmc_queue queues[TPOOL_PRIORITY_COUNT];
 
-    /// The number of spawned threads. Protected with `queue_lock`
-    size_t spawned_count;
-    /// The number of free workers. Protected with `queue_lock`
-    size_t free_count;
+    /// Taken to spawn a worker, which is rare: never on the common path of a push
+    _Alignas(64) struct futex_mutex spawn_lock;
+    /// Attributes of the worker threads, see `struct thread_pool_options`
+    size_t stack_size;
+    char name[16];
+
+    /**
+     * The tasks waiting for their time to be queued, see `thread_pool_push_after`. Under
+     * `timer_lock`, in ticks of `TPOOL_TIMER_TICK_NS` of `CLOCK_MONOTONIC`
+     */
+    struct timer_wheel *timers;
+    struct futex_mutex timer_lock;
+    /// The thread queueing the tasks when their time comes, spawned with the first of them
+    pthread_t timer_thread;
+    bool has_timer_thread;
+    /**
+     * The futex the timer thread sleeps on until the next expiry. Changed under `timer_lock`,
+     * atomic, when it is to wake up earlier: for an earlier timer, an abort or the deletion
+     */
+    uint32_t timer_seq;
+
+#ifdef NEED_TRACE
+    /// The events of the threads which are not the workers, under `trace_lock`
+    struct trace_ring outside_trace;
+    struct futex_mutex trace_lock;
+    /// The time 0 of the trace
+    uint64_t trace_start_ns;
+#endif
+#ifdef NEED_STATS
+    /// The tasks run by the threads helping while they join, atomic
+    struct run_stats helper_stats;
+    /// See `struct thread_pool_stats`, atomic
+    size_t max_task_count;
+    uint64_t spawn_count;
+    uint64_t spawn_contended_count;
+#endif
 };
 
+/*
+ * The statistics: each of the functions does nothing without `NEED_STATS`, so that the pool
+ * only pays for them when they are asked for.
+ */
+
+/// Nanoseconds of `CLOCK_MONOTONIC`
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    int err = clock_gettime(CLOCK_MONOTONIC, &ts);
+    assert(!err);
+    (void)err;
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Uncount `count` tasks which leave `pool` or were counted in vain, and wake up the pushers
+ * waiting for room if there are any.
+ */
+static void thread_pool_unreserve(struct thread_pool *pool, size_t count) {
+    /* The syscall is only made when somebody waits */
+    __atomic_sub_fetch(&pool->task_count, count, __ATOMIC_SEQ_CST);
+    futex_eventcount_notify_sc(&pool->room, count < INT_MAX ? (uint32_t)count : INT_MAX);
+}
+
+static void stats_task_count(struct thread_pool *pool, size_t task_count);
+
+/**
+ * Count `count` more tasks in `pool` to be queued by the current thread: within the limit,
+ * unless `is_unbounded`, and not after a shutdown, unless it is a worker of the pool finishing
+ * its work. Returns 0 or the error of the push.
+ */
+static int thread_pool_reserve(struct thread_pool *pool, size_t count, bool is_unbounded) {
+    /*
+     * Sequentially consistent, as with the shutdown setting the flag and then looking at the
+     * count: either it waits for my tasks, or I see it
+     */
+    size_t task_count = __atomic_add_fetch(&pool->task_count, count, __ATOMIC_SEQ_CST);
+    if (task_count > pool->task_limit && !is_unbounded) {
+        thread_pool_unreserve(pool, count);
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    }
+    struct thread_pool_worker *self = current_worker;
+    if (__atomic_load_n(&pool->is_shut_down, __ATOMIC_SEQ_CST) && !(self && self->pool == pool)) {
+        thread_pool_unreserve(pool, count);
+        return TPOOL_ERR_SHUT_DOWN;
+    }
+    stats_task_count(pool, task_count);
+    return 0;
+}
+
+#ifdef NEED_STATS
+
+/// Count a task which took `ns` nanoseconds into `hist`
+static void stats_hist_add(uint64_t *hist, uint64_t ns) {
+    int bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= TPOOL_STATS_BUCKETS)
+        bucket = TPOOL_STATS_BUCKETS - 1;
+    __atomic_add_fetch(&hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/// The counters for the current thread to run the tasks of `pool` with
+static struct run_stats *stats_of(struct thread_pool *pool) {
+    struct thread_pool_worker *self = current_worker;
+    return self && self->pool == pool ? &self->stats : &pool->helper_stats;
+}
+
+#endif
+
+/// Note the number of tasks in `pool`, just increased to `task_count`, for the high-water mark
+static void stats_task_count(struct thread_pool *pool, size_t task_count) {
+#ifdef NEED_STATS
+    size_t max = __atomic_load_n(&pool->max_task_count, __ATOMIC_RELAXED);
+    while (task_count > max && !__atomic_compare_exchange_n(&pool->max_task_count, &max,
+                task_count, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+#else
+    (void)pool;
+    (void)task_count;
+#endif
+}
+
+/// Note that `task` is queued now
+static void stats_task_pushed(struct thread_task *task) {
+#ifdef NEED_STATS
+    task->push_ns = monotonic_ns();
+#else
+    (void)task;
+#endif
+}
+
+/**
+ * Note that `task` of `pool` is started now, by a worker free until now if `is_outer`. Returns
+ * the time to be passed to `stats_task_finished`.
+ */
+static uint64_t stats_task_started(struct thread_pool *pool, const struct thread_task *task,
+        bool is_outer) {
+#ifdef NEED_STATS
+    struct run_stats *stats = stats_of(pool);
+    uint64_t now = monotonic_ns();
+    stats_hist_add(stats->wait_hist, now - task->push_ns);
+    if (is_outer) {
+        struct thread_pool_worker *self = current_worker;
+        __atomic_add_fetch(&stats->total.idle_ns, now - self->idle_since_ns, __ATOMIC_RELAXED);
+    }
+    return now;
+#else
+    (void)pool;
+    (void)task;
+    (void)is_outer;
+    return 0;
+#endif
+}
+
+/// Note that a task of `pool` started at `start_ns` is finished now, see `stats_task_started`
+static void stats_task_finished(struct thread_pool *pool, uint64_t start_ns, bool is_outer) {
+#ifdef NEED_STATS
+    struct run_stats *stats = stats_of(pool);
+    uint64_t now = monotonic_ns();
+    stats_hist_add(stats->run_hist, now - start_ns);
+    __atomic_add_fetch(&stats->total.task_count, 1, __ATOMIC_RELAXED);
+    if (is_outer) {
+        __atomic_add_fetch(&stats->total.busy_ns, now - start_ns, __ATOMIC_RELAXED);
+        current_worker->idle_since_ns = now;
+    }
+#else
+    (void)pool;
+    (void)start_ns;
+    (void)is_outer;
+#endif
+}
+
+#ifdef NEED_TRACE
+
+static void trace_ring_init(struct trace_ring *ring) {
+    ring->events = calloc(TPOOL_TRACE_EVENTS, sizeof ring->events[0]);
+    assert(ring->events);
+    ring->head = 0;
+}
+
+static void trace_ring_add(struct trace_ring *ring, enum trace_type type,
+        const struct thread_task *task) {
+    uint64_t head = ring->head;
+    struct trace_event *event = &ring->events[head & (TPOOL_TRACE_EVENTS - 1)];
+    __atomic_store_n(&event->ns, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&event->task, (uintptr_t)task, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
+
+/// Note the event `type` of `task` of `pool` in the trace, by the current thread
+static void trace_event(struct thread_pool *pool, enum trace_type type,
+        const struct thread_task *task) {
+#ifdef NEED_TRACE
+    struct thread_pool_worker *self = current_worker;
+    if (self && self->pool == pool) {
+        trace_ring_add(&self->trace, type, task);
+    } else {
+        futex_mutex_lock(&pool->trace_lock);
+        trace_ring_add(&pool->outside_trace, type, task);
+        futex_mutex_unlock(&pool->trace_lock);
+    }
+#else
+    (void)pool;
+    (void)type;
+    (void)task;
+#endif
+}
+
+/// Take `spawn_lock`, counting whether another thread has it
+static void thread_pool_lock_spawn(struct thread_pool *pool) {
+#ifdef NEED_STATS
+    if (futex_mutex_trylock(&pool->spawn_lock) == 0)
+        return;
+    __atomic_add_fetch(&pool->spawn_contended_count, 1, __ATOMIC_RELAXED);
+#endif
+    futex_mutex_lock(&pool->spawn_lock);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void task_list_free(struct thread_task *task) {
+    while (task) {
+        struct thread_task *next = task->next_free;
+        free(task);
+        task = next;
+    }
+}
+
+static void task_cache_destructor(void *cachev) {
+    struct task_cache *cache = (struct task_cache *)cachev;
+    task_list_free(cache->head);
+    cache->head = NULL;
+    cache->count = 0;
+    /* Registered again on the next use: the key is reset before its destructor is called */
+    cache->is_registered = false;
+}
+
+static void task_cache_key_create(void) {
+    int err = pthread_key_create(&task_cache_key, task_cache_destructor);
+    assert(!err);
+    (void)err;
+}
+
+/// Get the cache of the thread, to be freed when it exits
+static struct task_cache *task_cache_get(void) {
+    struct task_cache *cache = &task_cache;
+    if (!cache->is_registered) {
+        int err = pthread_once(&task_cache_once, task_cache_key_create);
+        assert(!err);
+        err = pthread_setspecific(task_cache_key, cache);
+        assert(!err);
+        (void)err;
+        cache->is_registered = true;
+    }
+    return cache;
+}
+
+static struct thread_task *thread_task_alloc(void) {
+    struct task_cache *cache = task_cache_get();
+    if (!cache->head && __atomic_load_n(&task_depot_count, __ATOMIC_RELAXED) != 0) {
+        futex_mutex_lock(&task_depot_lock);
+        if (task_depot) {
+            cache->head = task_depot;
+            cache->count = TPOOL_TASK_BATCH;
+            task_depot = task_depot->next_batch;
+            __atomic_store_n(&task_depot_count, task_depot_count - 1, __ATOMIC_RELAXED);
+        }
+        futex_mutex_unlock(&task_depot_lock);
+    }
+
+    struct thread_task *task = cache->head;
+    if (task) {
+        cache->head = task->next_free;
+        --cache->count;
+        return task;
+    }
+    task = aligned_alloc(_Alignof(struct thread_task), sizeof (struct thread_task));
+    assert(task);
+    return task;
+}
+
+static void task_links_free(struct task_link *link) {
+    while (link) {
+        struct task_link *next = link->next;
+        free(link);
+        link = next;
+    }
+}
+
+static void thread_task_free(struct thread_task *task) {
+    /* The successors of a task which has never run wait for nothing now, it's up to the user */
+    if (task->successors != TASK_LINKS_CLOSED)
+        task_links_free(task->successors);
+    if (task->is_embedded)
+        return;
+    if (__atomic_load_n(&pool_count, __ATOMIC_RELAXED) == 0) {
+        free(task);
+        return;
+    }
+
+    struct task_cache *cache = task_cache_get();
+    task->next_free = cache->head;
+    cache->head = task;
+    if (++cache->count < 2 * TPOOL_TASK_BATCH)
+        return;
+
+    /* Give the latest batch to the depot, keeping one to reuse */
+    struct thread_task *batch = cache->head, *last = batch;
+    for (int i = 1; i < TPOOL_TASK_BATCH; ++i)
+        last = last->next_free;
+    cache->head = last->next_free;
+    cache->count -= TPOOL_TASK_BATCH;
+    last->next_free = NULL;
+
+    futex_mutex_lock(&task_depot_lock);
+    if (pool_count != 0 && task_depot_count < TPOOL_DEPOT_MAX_BATCHES) {
+        batch->next_batch = task_depot;
+        task_depot = batch;
+        __atomic_store_n(&task_depot_count, task_depot_count + 1, __ATOMIC_RELAXED);
+        batch = NULL;
+    }
+    futex_mutex_unlock(&task_depot_lock);
+    task_list_free(batch);
+}
+
 static inline bool atomic_cex_state(struct thread_task *task, enum task_state old, enum task_state new) {
     /*
      * Success memory order is acquire+release because I want the task to have fully transitioned to
@@ -84,215 +686,1261 @@ static inline bool atomic_cex_state(struct thread_task *task, enum task_state ol
      * Failure memory order is relaxed because the unexpected old state is not reported and no actions
      * are taken based on it.
      */
-    bool succ = __atomic_compare_exchange_n(&task->state, &old, new, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
-    if (succ)  /* If successfully exchanged, wake up waiters! */
+    uint32_t cur = __atomic_load_n(&task->state, __ATOMIC_RELAXED);
+    do {
+        if ((cur & ~TASK_HAS_WAITERS) != old)
+            return false;
+    } while (!__atomic_compare_exchange_n(&task->state, &cur, new, true, __ATOMIC_ACQ_REL,
+                __ATOMIC_RELAXED));
+    if (cur & TASK_HAS_WAITERS)  /* If successfully exchanged, wake up waiters, if any! */
         (void)futexp_wake(&task->state, INT_MAX);
-    return succ;
+    return true;
 }
 
-static void deferred_mutex_unlock(void *mutexv) {
-    pthread_mutex_t *mutex = (pthread_mutex_t *)mutexv;
-    int err = pthread_mutex_unlock(mutex);
-    assert(!err);
+static inline enum task_state task_state_get(const struct thread_task *task, int memorder) {
+    return (enum task_state)(__atomic_load_n(&task->state, memorder) & ~TASK_HAS_WAITERS);
 }
 
-static void *thread_pool_worker(void *poolv) {
-    struct thread_pool *pool = (struct thread_pool *)poolv;
+/**
+ * Wait for `task` to complete, for at most `timeout` unless it's NULL. Spin for a while first,
+ * as short tasks are done soon. Returns as `futexp_timed_wait_for`
+ */
+static long thread_task_wait_completed(struct thread_task *task, const struct timespec *timeout) {
+    for (int i = 0; i < TPOOL_JOIN_SPIN_COUNT; ++i) {
+        if (task_state_get(task, __ATOMIC_ACQUIRE) == TASK_STATE_COMPLETED)
+            return 0;
+        cpu_relax();
+    }
+    return futexp_flagged_wait_for(&task->state, TASK_STATE_COMPLETED, TASK_HAS_WAITERS, timeout);
+}
+
+/**
+ * A task for `self` (NULL if the caller is not a worker): from its own deque, or pushed from
+ * outside, or stolen from another worker. Returns NULL if there are none.
+ */
+static struct thread_task *thread_pool_find_normal(struct thread_pool *pool,
+        struct thread_pool_worker *self) {
+    void *task;
+    if (self && ws_deque_take(&self->deque, &task))
+        return (struct thread_task *)task;
+    if (self && pool->node_queues && mpmc_queue_pop(&pool->node_queues[self->node], &task))
+        return (struct thread_task *)task;
+    if (mpmc_queue_pop(&pool->queues[TPOOL_PRIORITY_NORMAL], &task))
+        return (struct thread_task *)task;
+    /* Starting from the next one, so that the thieves spread over the victims */
+    size_t count = __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE);
+    size_t start = self ? self->index + 1 : 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct thread_pool_worker *victim = &pool->workers[(start + i) % count];
+        if (victim != self && ws_deque_steal(&victim->deque, &task))
+            return (struct thread_task *)task;
+    }
+    /* The other nodes might have no workers, or not enough */
+    for (int i = 0; pool->node_queues && i < pool->node_count; ++i) {
+        if (mpmc_queue_pop(&pool->node_queues[i], &task))
+            return (struct thread_task *)task;
+    }
+    return NULL;
+}
+
+/**
+ * A task for `self` (NULL if the caller is not a worker), of the highest priority there is.
+ * Returns NULL if there are none.
+ *
+ * Once in `TPOOL_AGING_PERIOD` tasks, the priorities are looked at the other way round, so
+ * that a stream of higher priority tasks does not starve the lower ones: they get at least
+ * that share of the workers.
+ */
+static struct thread_task *thread_pool_find_task(struct thread_pool *pool,
+        struct thread_pool_worker *self) {
+    void *task;
+    struct thread_task *normal;
+    if (self && self->tick % TPOOL_AGING_PERIOD == TPOOL_AGING_PERIOD - 1) {
+        if (mpmc_queue_pop(&pool->queues[TPOOL_PRIORITY_LOW], &task))
+            return (struct thread_task *)task;
+        if ((normal = thread_pool_find_normal(pool, self)) != NULL)
+            return normal;
+    }
+    if (mpmc_queue_pop(&pool->queues[TPOOL_PRIORITY_HIGH], &task))
+        return (struct thread_task *)task;
+    if ((normal = thread_pool_find_normal(pool, self)) != NULL)
+        return normal;
+    if (mpmc_queue_pop(&pool->queues[TPOOL_PRIORITY_LOW], &task))
+        return (struct thread_task *)task;
+    return NULL;
+}
+
+/// Whether there are tasks queued anywhere in the pool, at some moment during the call
+static bool thread_pool_has_tasks(struct thread_pool *pool) {
+    for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i) {
+        if (mpmc_queue_size(&pool->queues[i]) != 0)
+            return true;
+    }
+    for (int i = 0; pool->node_queues && i < pool->node_count; ++i) {
+        if (mpmc_queue_size(&pool->node_queues[i]) != 0)
+            return true;
+    }
+    size_t count = __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; ++i) {
+        if (ws_deque_size(&pool->workers[i].deque) > 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Retire `self`, idle for too long, unless the pool is down to its minimum. Returns `false` if
+ * the worker is to keep working.
+ */
+static bool thread_pool_retire(struct thread_pool_worker *self) {
+    struct thread_pool *pool = self->pool;
+    thread_pool_lock_spawn(pool);
+    bool is_retired = pool->thread_count > pool->tmin;
+    if (is_retired) {
+        __atomic_store_n(&pool->thread_count, pool->thread_count - 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&pool->free_count, 1, __ATOMIC_SEQ_CST);
+        /*
+         * A pusher queues a task before it checks for a free worker, and I leave the free ones
+         * before the last look for a task: either it spawns a worker, or I see its task and stay.
+         */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (thread_pool_has_tasks(pool)) {
+            __atomic_store_n(&pool->thread_count, pool->thread_count + 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool->free_count, 1, __ATOMIC_RELAXED);
+            is_retired = false;
+        }
+    }
+    self->is_retired = is_retired;
+    futex_mutex_unlock(&pool->spawn_lock);
+    return is_retired;
+}
+
+/**
+ * The next task for `self`. Spin for a while first, as a task is often pushed soon, then
+ * park until a push wakes me up. Returns NULL when the pool is being deleted, or when the worker
+ * retires after being idle for too long.
+ */
+static struct thread_task *thread_pool_next_task(struct thread_pool_worker *self) {
+    struct thread_pool *pool = self->pool;
+    struct thread_task *task;
+    while (1) {
+        for (int i = 0; i < TPOOL_SPIN_COUNT; ++i) {
+            if ((task = thread_pool_find_task(pool, self)) != NULL)
+                return task;
+            if (__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE))
+                return NULL;
+            cpu_relax();
+        }
+
+        /*
+         * Announce myself as parked before the last look for a task. A pusher queues the task
+         * before it notifies, so either it sees me and wakes me up, or I see its task.
+         */
+        uint32_t key = futex_eventcount_prepare(&pool->parked);
+        task = thread_pool_find_task(pool, self);
+        bool is_timed_out = false;
+        if (!task && !__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE)) {
+            /* The minimum workers don't wake up to see they stay */
+            int64_t timeout = __atomic_load_n(&pool->idle_timeout_ns, __ATOMIC_RELAXED);
+            trace_event(pool, TRACE_PARK, NULL);
+            if (timeout < 0 || __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED) <=
+                    __atomic_load_n(&pool->tmin, __ATOMIC_RELAXED)) {
+                (void)futex_eventcount_wait(&pool->parked, key, NULL);
+            } else {
+                struct timespec ts = {timeout / 1000000000, timeout % 1000000000};
+                is_timed_out = futex_eventcount_wait(&pool->parked, key, &ts) == -1 &&
+                    errno == ETIMEDOUT;
+            }
+            trace_event(pool, TRACE_WAKE, NULL);
+        }
+        futex_eventcount_leave(&pool->parked);
+        if (task)
+            return task;
+        if (is_timed_out && thread_pool_retire(self))
+            return NULL;
+    }
+}
+
+static size_t thread_task_release_successors(struct thread_task *task, struct task_link **kept);
+static void thread_pool_maybe_spawn(struct thread_pool *pool, size_t want);
+static void thread_pool_wake(struct thread_pool *pool, size_t count);
+static void thread_pool_arm(struct thread_pool *pool, struct thread_task *task, uint64_t expiry);
+static void thread_pool_timer_kick(struct thread_pool *pool);
+
+/**
+ * Put a periodic task just run back to wait for its next run, unless it is cancelled or the pool
+ * is shut down. Returns whether it is: then it stays in the pool, and it is not finished.
+ */
+static bool thread_pool_rearm(struct thread_pool *pool, struct thread_task *task,
+        bool is_worker_free_after) {
+    if (__atomic_load_n(&task->is_cancelled, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&pool->is_shut_down, __ATOMIC_RELAXED))
+        return false;
+    if (is_worker_free_after)
+        __atomic_add_fetch(&pool->free_count, 1, __ATOMIC_RELAXED);
+
+    /* Pushed again before it is armed: otherwise the timer thread could queue it still running */
+    bool ok = atomic_cex_state(task, TASK_STATE_RUNNING, TASK_STATE_PUSHED) ||
+        atomic_cex_state(task, TASK_STATE_RUNNING_GHOST, TASK_STATE_PUSHED_GHOST);
+    assert(ok);  /* Only the worker running a task takes it out of a running state */
+    (void)ok;
+
+    /* The runs missed while it was late are skipped, not made up for */
+    uint64_t now = monotonic_ns() / TPOOL_TIMER_TICK_NS;
+    uint64_t expiry = task->timer.expiry + task->period_ticks;
+    if (expiry <= now)
+        expiry = now + task->period_ticks - (now - task->timer.expiry) % task->period_ticks;
+    thread_pool_arm(pool, task, expiry);
+    return true;
+}
+
+static struct scratch_mark scratch_mark(const struct worker_scratch *scratch) {
+    return (struct scratch_mark){.chunk = scratch->top, .used = scratch->top ? scratch->top->used : 0};
+}
+
+/// Give back all taken from `scratch` since `mark`
+static void scratch_release(struct worker_scratch *scratch, struct scratch_mark mark) {
+    while (scratch->top != mark.chunk) {
+        struct scratch_chunk *chunk = scratch->top;
+        scratch->top = chunk->next;
+        if (scratch->spare && scratch->spare->size < chunk->size) {
+            free(scratch->spare);
+            scratch->spare = NULL;
+        }
+        if (!scratch->spare)
+            scratch->spare = chunk;
+        else
+            free(chunk);
+    }
+    if (mark.chunk)
+        mark.chunk->used = mark.used;
+}
+
+static void *scratch_alloc(struct worker_scratch *scratch, size_t size) {
+    const size_t align = _Alignof(max_align_t);
+    if (size > SIZE_MAX / 4)
+        return NULL;
+    size = (size + align - 1) & ~(align - 1);
+    struct scratch_chunk *chunk = scratch->top;
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (scratch->spare && scratch->spare->size >= size) {
+            chunk = scratch->spare;
+            scratch->spare = NULL;
+        } else {
+            size_t chunk_size = scratch->top ? 2 * scratch->top->size : TPOOL_SCRATCH_CHUNK;
+            if (scratch->spare && chunk_size < 2 * scratch->spare->size)
+                chunk_size = 2 * scratch->spare->size;
+            while (chunk_size < size)
+                chunk_size *= 2;
+            chunk = malloc(sizeof (*chunk) + chunk_size);
+            if (!chunk)
+                return NULL;
+            chunk->size = chunk_size;
+        }
+        chunk->used = 0;
+        chunk->next = scratch->top;
+        scratch->top = chunk;
+    }
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+/// Leave nothing of the worker when it exits: the values of the keys and the scratch
+static void thread_pool_worker_cleanup(struct thread_pool_worker *self) {
+    int key_count = __atomic_load_n(&worker_key_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < key_count; ++i) {
+        void *value = self->values[i];
+        self->values[i] = NULL;
+        if (value && worker_key_destructors[i])
+            worker_key_destructors[i](value);
+    }
+    scratch_release(&self->scratch, (struct scratch_mark){0});
+    free(self->scratch.spare);
+    self->scratch.spare = NULL;
+}
+
+/**
+ * Run a task taken from the queues of `pool`, by a worker or by a thread helping while it
+ * joins. `is_worker_free_after` tells whether the thread is a worker to become free after it.
+ */
+static void thread_pool_run_task(struct thread_pool *pool, struct thread_task *task,
+        bool is_worker_free_after) {
+    /*
+     * Warning: the order of condition checks is important. Task can turn from PUSHED to
+     * PUSHED_GHOST, but not vice versa.
+     */
+    bool ok = atomic_cex_state(task, TASK_STATE_PUSHED, TASK_STATE_RUNNING) ||
+        atomic_cex_state(task, TASK_STATE_PUSHED_GHOST, TASK_STATE_RUNNING_GHOST);
+    assert(ok);  /* Task popped from queue must have been pushed */
+    trace_event(pool, TRACE_START, task);
+
+    if (__atomic_load_n(&task->is_cancelled, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&pool->is_aborting, __ATOMIC_RELAXED)) {
+        /* Skipped, see `thread_task_cancel` */
+        __atomic_store_n(&task->is_cancelled, true, __ATOMIC_RELAXED);
+        task->ret = NULL;
+    } else {
+        struct thread_task *outer = current_task;
+        current_task = task;
+        /* The scratch of a task run while joining is on top of that of the outer one */
+        struct thread_pool_worker *worker = current_worker;
+        struct scratch_mark mark = worker ? scratch_mark(&worker->scratch) : (struct scratch_mark){0};
+        uint64_t start_ns = stats_task_started(pool, task, is_worker_free_after);
+        task->ret = task->function(task->arg);
+        stats_task_finished(pool, start_ns, is_worker_free_after);
+        if (worker)
+            scratch_release(&worker->scratch, mark);
+        current_task = outer;
+        /* Cancelled while it ran, by an abort which could not reach the task */
+        if (__atomic_load_n(&pool->is_aborting, __ATOMIC_RELAXED))
+            __atomic_store_n(&task->is_cancelled, true, __ATOMIC_RELAXED);
+    }
+    trace_event(pool, TRACE_FINISH, task);
+    /* The successors of a periodic task wait for its last run */
+    if (task->period_ticks != 0 && thread_pool_rearm(pool, task, is_worker_free_after))
+        return;
+
+    /*
+     * The successors are counted in the pool before the task leaves it, so that the pool
+     * can't be deleted in between. A worker takes the first of them itself, so the others are
+     * for the other workers.
+     */
+    struct task_link *kept;
+    size_t ready = thread_task_release_successors(task, &kept);
+    struct thread_pool_worker *self = current_worker;
+    size_t others = ready > 0 && self && self->pool == pool ? ready - 1 : ready;
+    if (others > 0) {
+        thread_pool_wake(pool, others);
+        thread_pool_maybe_spawn(pool, others);
+    }
+
+    /*
+     * Declare myself free (unless I'm still busy with an outer task) and the task gone from the
+     * pool before the task is finished.
+     * Otherwise, there's a race condition between when the task is joined and when the pool
+     * sees it's done with it (the pool could not be deleted right after the join), and a push
+     * right after the join could spawn a thread in vain.
+     */
+    if (is_worker_free_after)
+        __atomic_add_fetch(&pool->free_count, 1, __ATOMIC_RELAXED);
+    thread_pool_unreserve(pool, 1);
+
+    /*
+     * Warning: the checks order is important: task can turn from RUNNING to RUNNING_GHOST,
+     * but not vice versa.
+     */
+    if (atomic_cex_state(task, TASK_STATE_RUNNING, TASK_STATE_COMPLETED)) {
+        /* Success. Nothing else to do. */
+    } else if (atomic_cex_state(task, TASK_STATE_RUNNING_GHOST, TASK_STATE_JOINED)) {
+        /* A detached task has finished. Declare it joined and destroy. */
+        int err = thread_task_delete(task);
+        assert(!err);  /* Error indicates that a deatched task was repushed (which is UB) */
+        (void)err;
+    } else {
+        assert(false);  /* A task that I was performing is not in a running state */
+    }
+
+    /* The successors with no room in the queues, run here after it like a popped task */
+    while (kept) {
+        struct task_link *it = kept;
+        kept = it->next;
+        thread_pool_run_task(pool, it->task, false);
+        free(it);
+    }
+}
+
+static void *thread_pool_worker(void *workerv) {
+    struct thread_pool_worker *self = (struct thread_pool_worker *)workerv;
+    struct thread_pool *pool = self->pool;
+    current_worker = self;
+    if (pool->name[0]) {
+        /* Named before any task runs. The name is for debugging only, it's fine if it fails */
+        char name[32];
+        snprintf(name, sizeof name, "%s/%zu", pool->name, self->index);
+        name[15] = '\0';
+        (void)pthread_setname_np(pthread_self(), name);
+    }
+#ifdef NEED_STATS
+    self->idle_since_ns = monotonic_ns();
+#endif
+
+    /*
+     * The worker runs until `thread_pool_delete` sets `is_stopping` and wakes it up, or until it
+     * retires
+     */
+    struct thread_task *task;
+    while ((task = thread_pool_next_task(self)) != NULL) {
+        __atomic_sub_fetch(&pool->free_count, 1, __ATOMIC_RELAXED);
+        ++self->tick;
+
+        PERF_REGION_BEGIN(thread_pool_worker);
+        thread_pool_run_task(pool, task, true);
+        PERF_REGION_END(thread_pool_worker);
+    }
+    thread_pool_worker_cleanup(self);
+#ifdef NEED_STATS
+    __atomic_add_fetch(&self->stats.total.idle_ns, monotonic_ns() - self->idle_since_ns,
+            __ATOMIC_RELAXED);
+#endif
+    return NULL;
+}
+
+void
+thread_pool_options_init(struct thread_pool_options *opts, int max_thread_count)
+{
+    opts->max_thread_count = max_thread_count;
+    opts->max_task_count = TPOOL_MAX_TASKS;
+    opts->cpus = NULL;
+    opts->cpu_count = 0;
+    opts->numa_node = TPOOL_NUMA_NONE;
+    opts->stack_size = 0;
+    opts->name = NULL;
+}
+
+int
+thread_pool_new(int max_thread_count, struct thread_pool **poolp)
+{
+    if (max_thread_count > TPOOL_MAX_THREADS)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    struct thread_pool_options opts;
+    thread_pool_options_init(&opts, max_thread_count);
+    return thread_pool_new_ext(&opts, poolp);
+}
+
+int
+thread_pool_new_ext(const struct thread_pool_options *opts, struct thread_pool **poolp)
+{
+    int max_thread_count = opts->max_thread_count;
+    if (max_thread_count <= 0 || opts->max_task_count == 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (opts->numa_node < TPOOL_NUMA_NONE || (opts->cpus && opts->cpu_count <= 0) ||
+            (opts->stack_size != 0 && opts->stack_size < (size_t)PTHREAD_STACK_MIN))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    struct topology_node *nodes = NULL;
+    int node_count = 0;
+    if (opts->cpus || opts->numa_node != TPOOL_NUMA_NONE) {
+        nodes = malloc(TOPOLOGY_MAX_NODES * sizeof nodes[0]);
+        assert(nodes);
+        node_count = topology_nodes(opts->cpus, opts->cpu_count,
+                opts->numa_node == TPOOL_NUMA_SPREAD ? -1 : opts->numa_node, nodes,
+                TOPOLOGY_MAX_NODES);
+        if (node_count == 0) {
+            /* None of the CPUs asked for exist */
+            free(nodes);
+            return TPOOL_ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    *poolp = aligned_alloc(_Alignof(struct thread_pool), sizeof (struct thread_pool));
+    assert(*poolp);
+
+    struct thread_pool *pool = *poolp;
+
+    pool->tmax = max_thread_count;
+    pool->workers = aligned_alloc(_Alignof(struct thread_pool_worker),
+            max_thread_count * sizeof pool->workers[0]);
+    assert(pool->workers);
+
+    futex_mutex_init(&pool->spawn_lock);
+    int err;
+    for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i) {
+        err = mpmc_queue_init(&pool->queues[i], opts->max_task_count);
+        assert(!err);  // OOM only
+    }
+
+    pool->nodes = nodes;
+    pool->node_count = node_count;
+    pool->node_queues = NULL;
+    if (node_count > 1) {
+        pool->node_queues = aligned_alloc(_Alignof(struct mpmc_queue),
+                node_count * sizeof pool->node_queues[0]);
+        assert(pool->node_queues);
+        for (int i = 0; i < node_count; ++i) {
+            err = mpmc_queue_init(&pool->node_queues[i], opts->max_task_count);
+            assert(!err);  // OOM only
+        }
+    }
+    pool->stack_size = opts->stack_size;
+    pool->name[0] = '\0';
+    if (opts->name) {
+        /* Room for the number of a worker in a thread name of 15 characters */
+        snprintf(pool->name, sizeof pool->name - 3, "%s", opts->name);
+    }
+
+    pool->task_count = pool->spawned_count = pool->thread_count = pool->free_count = 0;
+    pool->task_limit = opts->max_task_count;
+    futex_eventcount_init(&pool->room);
+    futex_eventcount_init(&pool->parked);
+    pool->tmin = 0;
+    pool->idle_timeout_ns = -1;
+    pool->is_stopping = false;
+    pool->is_shut_down = pool->is_aborting = false;
+    pool->timers = NULL;
+    futex_mutex_init(&pool->timer_lock);
+    pool->has_timer_thread = false;
+    pool->timer_seq = 0;
+#ifdef NEED_TRACE
+    trace_ring_init(&pool->outside_trace);
+    futex_mutex_init(&pool->trace_lock);
+    pool->trace_start_ns = monotonic_ns();
+#endif
+#ifdef NEED_STATS
+    memset(&pool->helper_stats, 0, sizeof pool->helper_stats);
+    pool->max_task_count = 0;
+    pool->spawn_count = pool->spawn_contended_count = 0;
+#endif
+
+    futex_mutex_lock(&task_depot_lock);
+    __atomic_store_n(&pool_count, pool_count + 1, __ATOMIC_RELAXED);
+    futex_mutex_unlock(&task_depot_lock);
+
+    return 0;
+}
+
+int
+thread_pool_delete(struct thread_pool *pool)
+{
+    /* Acquire: the finished tasks are done with the pool */
+    if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) != 0)
+        return TPOOL_ERR_HAS_TASKS;
+
+    /* Should join all workers before destroying any resources it is using */
+    __atomic_store_n(&pool->is_stopping, true, __ATOMIC_RELEASE);
+    futex_eventcount_notify_all(&pool->parked);
+    if (pool->has_timer_thread) {
+        /* No tasks, so no timers left */
+        futex_mutex_lock(&pool->timer_lock);
+        thread_pool_timer_kick(pool);
+        futex_mutex_unlock(&pool->timer_lock);
+        int err = pthread_join(pool->timer_thread, NULL);
+        assert(!err);
+        (void)err;
+        free(pool->timers);
+    }
+    for (size_t i = 0; i < pool->spawned_count; ++i) {
+        int err = pthread_join(pool->workers[i].thread, NULL);
+        assert(!err);
+        (void)err;
+    }
+    /* Only once all are joined: the others might be stealing from this one until they are */
+    for (size_t i = 0; i < pool->spawned_count; ++i) {
+        ws_deque_destroy(&pool->workers[i].deque);
+#ifdef NEED_TRACE
+        free(pool->workers[i].trace.events);
+#endif
+    }
+    free(pool->workers);
+#ifdef NEED_TRACE
+    free(pool->outside_trace.events);
+#endif
+
+    for (int i = 0; i < TPOOL_PRIORITY_COUNT; ++i)
+        mpmc_queue_destroy(&pool->queues[i]);
+    for (int i = 0; pool->node_queues && i < pool->node_count; ++i)
+        mpmc_queue_destroy(&pool->node_queues[i]);
+    free(pool->node_queues);
+    free(pool->nodes);
+    free(pool);
+
+    /* The workers have freed their caches on exit. With the last pool, the rest go too */
+    futex_mutex_lock(&task_depot_lock);
+    __atomic_store_n(&pool_count, pool_count - 1, __ATOMIC_RELAXED);
+    bool is_last = pool_count == 0;
+    struct thread_task *depot = NULL;
+    if (is_last) {
+        depot = task_depot;
+        task_depot = NULL;
+        __atomic_store_n(&task_depot_count, 0, __ATOMIC_RELAXED);
+    }
+    futex_mutex_unlock(&task_depot_lock);
+    while (depot) {
+        struct thread_task *next = depot->next_batch;
+        task_list_free(depot);
+        depot = next;
+    }
+    if (is_last)
+        task_cache_destructor(&task_cache);
+
+    return 0;
+}
+
+int
+thread_pool_shutdown(struct thread_pool *pool, int mode)
+{
+    if (mode != TPOOL_SHUTDOWN_DRAIN && mode != TPOOL_SHUTDOWN_ABORT)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    struct thread_pool_worker *self = current_worker;
+    if (self && self->pool == pool)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+
+    if (mode == TPOOL_SHUTDOWN_ABORT)
+        __atomic_store_n(&pool->is_aborting, true, __ATOMIC_RELAXED);
+    /* Sequentially consistent, see `thread_pool_reserve` */
+    __atomic_store_n(&pool->is_shut_down, true, __ATOMIC_SEQ_CST);
+    /* The delayed tasks are not waited for when aborting: the timer thread queues them now */
+    if (mode == TPOOL_SHUTDOWN_ABORT) {
+        futex_mutex_lock(&pool->timer_lock);
+        if (pool->has_timer_thread)
+            thread_pool_timer_kick(pool);
+        futex_mutex_unlock(&pool->timer_lock);
+    }
+    /* The pushers waiting for room fail now */
+    futex_eventcount_notify_all(&pool->room);
+
+    /* Every task leaving the pool notifies the waiters for room, which I am one of now */
+    while (1) {
+        uint32_t key = futex_eventcount_prepare(&pool->room);
+        bool is_empty = __atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) == 0;
+        if (!is_empty)
+            (void)futex_eventcount_wait(&pool->room, key, NULL);
+        futex_eventcount_leave(&pool->room);
+        if (is_empty)
+            return 0;
+    }
+}
+
+__attribute__((pure))
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+    return __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+}
+
+size_t
+thread_pool_queue_depth(const struct thread_pool *pool, int priority)
+{
+    if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+        return 0;
+    size_t depth = mpmc_queue_size(&pool->queues[priority]);
+    if (priority != TPOOL_PRIORITY_NORMAL)
+        return depth;
+    /* The normal ones are in the deques and the queues of the nodes too */
+    for (int i = 0; pool->node_queues && i < pool->node_count; ++i)
+        depth += mpmc_queue_size(&pool->node_queues[i]);
+    size_t count = __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count; ++i) {
+        int64_t size = ws_deque_size(&pool->workers[i].deque);
+        depth += size > 0 ? (size_t)size : 0;
+    }
+    return depth;
+}
+
+#ifdef NEED_STATS
+
+void
+thread_pool_stats(const struct thread_pool *pool, struct thread_pool_stats *stats)
+{
+    memset(stats, 0, sizeof (*stats));
+    size_t count = __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i <= count; ++i) {
+        /* The workers, then the helpers */
+        const struct run_stats *run = i < count ? &pool->workers[i].stats : &pool->helper_stats;
+        for (int j = 0; j < TPOOL_STATS_BUCKETS; ++j) {
+            stats->wait_hist[j] += __atomic_load_n(&run->wait_hist[j], __ATOMIC_RELAXED);
+            stats->run_hist[j] += __atomic_load_n(&run->run_hist[j], __ATOMIC_RELAXED);
+        }
+    }
+    stats->worker_count = count;
+    stats->max_task_count = __atomic_load_n(&pool->max_task_count, __ATOMIC_RELAXED);
+    stats->spawn_count = __atomic_load_n(&pool->spawn_count, __ATOMIC_RELAXED);
+    stats->spawn_contended_count = __atomic_load_n(&pool->spawn_contended_count,
+            __ATOMIC_RELAXED);
+}
 
-    struct thread_task *task = NULL;
+int
+thread_pool_worker_stats(const struct thread_pool *pool, size_t index,
+        struct thread_pool_worker_stats *stats)
+{
+    if (index >= __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    const struct thread_pool_worker_stats *total = &pool->workers[index].stats.total;
+    stats->task_count = __atomic_load_n(&total->task_count, __ATOMIC_RELAXED);
+    stats->busy_ns = __atomic_load_n(&total->busy_ns, __ATOMIC_RELAXED);
+    stats->idle_ns = __atomic_load_n(&total->idle_ns, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    /*
-     * The worker will run forever until canceled with `pthread_cancel`.
-     * Note that the cancelation signal can only be sent by `thread_pool_delete` after it acquires the
-     * `pool->queue_lock` and makes sure all spawned workers are free. That can only be true when the worker
-     * is waiting for the next task in the `pthread_cond_wait` below, and that's the only place where the
-     * cancelation might be attempted (regardless of the thread's cancelation type (asynchronous/deferred)).
-     */
-    while (1) {
-        int err = pthread_mutex_lock(&pool->queue_lock);
-        assert(!err);
+#endif
 
-        /*
-         * Lock/unlock the mutex via a thread-cancelation clean-up handler - to maintain a proper lock state
-         * when the worker is canceled on pool deletion.
-         */
-        pthread_cleanup_push(deferred_mutex_unlock, &pool->queue_lock);
+#ifdef NEED_TRACE
 
-        /*
-         * Declare the previous task as finished only after taking the mutex. Otherwise,
-         * there's a race condition between when I report I'm done with the task
-         * and when I report I'm a free worker (it sometimes prevents the pool
-         * from being deleted).
-         */
-        if (task) {
-            /*
-             * Warning: the checks order is important: task can turn from RUNNING to RUNNING_GHOST,
-             * but not vice versa.
-             */
-            if (atomic_cex_state(task, TASK_STATE_RUNNING, TASK_STATE_COMPLETED)) {
-                /* Success. Nothing else to do. */
-            } else if (atomic_cex_state(task, TASK_STATE_RUNNING_GHOST, TASK_STATE_JOINED)) {
-                /* A detached task has finished. Declare it joined and destroy. */
-                err = thread_task_delete(task);
-                assert(!err);  /* Error indicates that a deatched task was repushed (which is UB) */
-            } else {
-                assert(false);  /* A task that I was performing is not in a running state */
-            }
+/// Write out the events of `ring` on the line `tid`, see `thread_pool_trace_dump`
+static bool trace_ring_dump(const struct thread_pool *pool, const struct trace_ring *ring,
+        size_t tid, const char *name, FILE *out) {
+    if (fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%zu,"
+            "\"args\":{\"name\":\"%s\"}}", tid, name) < 0)
+        return false;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TPOOL_TRACE_EVENTS ? head - TPOOL_TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; ++i) {
+        const struct trace_event *event = &ring->events[i & (TPOOL_TRACE_EVENTS - 1)];
+        uint64_t ns = __atomic_load_n(&event->ns, __ATOMIC_RELAXED);
+        uintptr_t task = __atomic_load_n(&event->task, __ATOMIC_RELAXED);
+        uint32_t type = __atomic_load_n(&event->type, __ATOMIC_RELAXED);
+        double ts = ns > pool->trace_start_ns ? (ns - pool->trace_start_ns) / 1000. : 0;
+        int rc = 0;
+        /* The flows of the pushes to the starts are bound to the slices around them */
+        switch (type) {
+        case TRACE_PUSH:
+            rc = fprintf(out, ",\n{\"name\":\"push\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                    "\"pid\":0,\"tid\":%zu,\"args\":{\"task\":\"%#" PRIxPTR "\"}}"
+                    ",\n{\"name\":\"queued\",\"cat\":\"task\",\"ph\":\"s\",\"id\":\"%#" PRIxPTR
+                    "\",\"ts\":%.3f,\"pid\":0,\"tid\":%zu}", ts, tid, task, task, ts, tid);
+            break;
+        case TRACE_START:
+            rc = fprintf(out, ",\n{\"name\":\"task\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":0,"
+                    "\"tid\":%zu,\"args\":{\"task\":\"%#" PRIxPTR "\"}}"
+                    ",\n{\"name\":\"queued\",\"cat\":\"task\",\"ph\":\"f\",\"bp\":\"e\","
+                    "\"id\":\"%#" PRIxPTR "\",\"ts\":%.3f,\"pid\":0,\"tid\":%zu}",
+                    ts, tid, task, task, ts, tid);
+            break;
+        case TRACE_FINISH:
+        case TRACE_WAKE:
+            rc = fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":0,\"tid\":%zu}", ts, tid);
+            break;
+        case TRACE_PARK:
+            rc = fprintf(out, ",\n{\"name\":\"parked\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":0,"
+                    "\"tid\":%zu}", ts, tid);
+            break;
         }
+        if (rc < 0)
+            return false;
+    }
+    return true;
+}
 
-        /*
-         * Now that I'm done with the previous task, I am free.
-         * Note: no need to synchronize on `pool->free_count`, as it is protected with `pool->queue_lock`
-         */
-        ++pool->free_count;
-        while (circular_queue_size(&pool->queue) == 0) {
-            err = pthread_cond_wait(&pool->queue_push_cond, &pool->queue_lock);
-            assert(!err);
-        }
-        --pool->free_count;
+int
+thread_pool_trace_dump(const struct thread_pool *pool, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    bool ok = fputs("{\"traceEvents\":[\n", out) >= 0;
+    size_t count = __atomic_load_n(&pool->spawned_count, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < count && ok; ++i) {
+        char name[32];
+        snprintf(name, sizeof name, "worker %zu", i);
+        ok = trace_ring_dump(pool, &pool->workers[i].trace, i, name, out) && fputs(",\n", out) >= 0;
+    }
+    /* Under the lock, as the other threads may still push */
+    futex_mutex_lock((struct futex_mutex *)&pool->trace_lock);
+    ok = ok && trace_ring_dump(pool, &pool->outside_trace, pool->tmax, "outside", out);
+    futex_mutex_unlock((struct futex_mutex *)&pool->trace_lock);
+    ok = fputs("\n]}\n", out) >= 0 && ok;
+    ok = fclose(out) == 0 && ok;
+    return ok ? 0 : TPOOL_ERR_INVALID_ARGUMENT;
+}
 
-        task = (struct thread_task *)circular_queue_pop(&pool->queue);
-        pthread_cleanup_pop(1);  /* Unlock the mutex */
+#endif
 
-        /*
-         * Warning: the order of condition checks is important. Task can turn from PUSHED to
-         * PUSHED_GHOST, but not vice versa.
-         */
-        bool ok = atomic_cex_state(task, TASK_STATE_PUSHED, TASK_STATE_RUNNING) ||
-            atomic_cex_state(task, TASK_STATE_PUSHED_GHOST, TASK_STATE_RUNNING_GHOST);
-        assert(ok);  /* Task popped from queue must have been pushed */
+/// Spawn a worker, under `spawn_lock`. Into the slot of a retired one if there is any
+static void thread_pool_spawn(struct thread_pool *pool) {
+    int err;
+    /* Counted as free from the start, so the next pushes don't spawn another one for nothing */
+    __atomic_add_fetch(&pool->free_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->thread_count, pool->thread_count + 1, __ATOMIC_RELAXED);
+    struct thread_pool_worker *worker = NULL;
+    for (size_t i = 0; i < pool->spawned_count && !worker; ++i) {
+        if (pool->workers[i].is_retired)
+            worker = &pool->workers[i];
+    }
+    if (worker) {
+        /* It has exited or is about to, and its deque is empty */
+        err = pthread_join(worker->thread, NULL);
+        assert(!err);
+        worker->is_retired = false;
+    } else {
+        worker = &pool->workers[pool->spawned_count];
+        worker->pool = pool;
+        worker->index = pool->spawned_count;
+        worker->node = pool->node_count ? (int)(worker->index % pool->node_count) : -1;
+        worker->tick = 0;
+        worker->is_retired = false;
+        worker->scratch = (struct worker_scratch){0};
+        memset(worker->values, 0, sizeof worker->values);
+#ifdef NEED_STATS
+        memset(&worker->stats, 0, sizeof worker->stats);
+#endif
+        err = ws_deque_init(&worker->deque);
+        assert(!err);  // OOM only
+#ifdef NEED_TRACE
+        trace_ring_init(&worker->trace);
+#endif
+        /* Release: the thieves see the deque initialized */
+        __atomic_store_n(&pool->spawned_count, pool->spawned_count + 1, __ATOMIC_RELEASE);
+    }
 
-        /* Run the task on this iteration of the loop, but declare as finished on the next one */
-        task->ret = task->function(task->arg);
+    pthread_attr_t attr;
+    err = pthread_attr_init(&attr);
+    assert(!err);
+    if (pool->stack_size) {
+        err = pthread_attr_setstacksize(&attr, pool->stack_size);
+        assert(!err);  /* Checked by `thread_pool_new_ext` */
+    }
+    if (worker->node != -1) {
+        err = pthread_attr_setaffinity_np(&attr, sizeof (cpu_set_t), &pool->nodes[worker->node].cpus);
+        assert(!err);
     }
+    err = pthread_create(&worker->thread, &attr, thread_pool_worker, (void *)worker);
+    assert(!err);  /* Unable to spawn new thread */
+#ifdef NEED_STATS
+    __atomic_add_fetch(&pool->spawn_count, 1, __ATOMIC_RELAXED);
+#endif
+    err = pthread_attr_destroy(&attr);
+    assert(!err);
+}
 
-    assert(false);  // Unreachable
+/// Spawn workers until `want` of them are free, as far as the limit allows
+static void thread_pool_maybe_spawn(struct thread_pool *pool, size_t want) {
+    if (__atomic_load_n(&pool->free_count, __ATOMIC_RELAXED) >= want ||
+            __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED) >= pool->tmax)
+        return;
+    thread_pool_lock_spawn(pool);
+    /* Checked again: another pusher might have spawned some meanwhile */
+    while (__atomic_load_n(&pool->free_count, __ATOMIC_RELAXED) < want &&
+            pool->thread_count < pool->tmax)
+        thread_pool_spawn(pool);
+    futex_mutex_unlock(&pool->spawn_lock);
 }
 
 int
-thread_pool_new(int max_thread_count, struct thread_pool **poolp)
+thread_pool_set_idle(struct thread_pool *pool, int min_thread_count, double idle_timeout)
 {
-    // For some reason this `_Static_assert` won't properly compile if on the global level
-    _Static_assert(sizeof (enum task_state) == sizeof (uint32_t),
-            "`enum task_state` must have the same size as `uint32_t` to be used as a futex");
+    if (min_thread_count < 0 || (size_t)min_thread_count > pool->tmax)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    int64_t timeout = idle_timeout < 0 ? -1 : (int64_t)(idle_timeout * 1e9);
+    thread_pool_lock_spawn(pool);
+    __atomic_store_n(&pool->tmin, min_thread_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->idle_timeout_ns, timeout, __ATOMIC_RELAXED);
+    while (pool->thread_count < pool->tmin)
+        thread_pool_spawn(pool);
+    futex_mutex_unlock(&pool->spawn_lock);
+
+    /* The parked workers park again, with the new timeout */
+    futex_eventcount_notify_all(&pool->parked);
+    return 0;
+}
 
+/// Wake up to `count` parked workers after a push, with one syscall
+static void thread_pool_wake(struct thread_pool *pool, size_t count) {
+    futex_eventcount_notify(&pool->parked, count < INT_MAX ? (uint32_t)count : INT_MAX);
+}
 
-    if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS) {
-        return TPOOL_ERR_INVALID_ARGUMENT;
+/// The index of the NUMA node `id` among those of the pool with a queue each, -1 if none
+static int thread_pool_node(const struct thread_pool *pool, int id) {
+    if (id == -1 || !pool->node_queues)
+        return -1;
+    for (int i = 0; i < pool->node_count; ++i) {
+        if (pool->nodes[i].id == id)
+            return i;
     }
+    return -1;
+}
 
-    *poolp = malloc(sizeof (struct thread_pool));
-    assert(*poolp);
+/**
+ * Queue a pushed task, already counted in `task_count`. A task pushed by a task goes to the
+ * deque of its worker, to be run by it in the first place.
+ *
+ * The shared queues have a cell for each of `task_limit`, so they have room for a task counted
+ * within the limit. A successor of a task is counted over it, and its queue may be full: then a
+ * worker of the pool puts it to its own deque, which is unbounded, and any other thread gets
+ * `false`, to run the task itself.
+ */
+static bool thread_pool_try_enqueue(struct thread_pool *pool, struct thread_task *task) {
+    task->pool = pool;
+    stats_task_pushed(task);
+    trace_event(pool, TRACE_PUSH, task);
+    struct thread_pool_worker *self = current_worker;
+    bool is_worker = self && self->pool == pool;
+    int node = thread_pool_node(pool, task->node);
+    bool ok;
+    if (task->priority != TPOOL_PRIORITY_NORMAL) {
+        /* Not to the deque: any worker is to see it before or after the normal ones */
+        ok = mpmc_queue_push(&pool->queues[task->priority], task);
+    } else if (node != -1 && !(is_worker && self->node == node)) {
+        ok = mpmc_queue_push(&pool->node_queues[node], task);
+    } else if (is_worker) {
+        int err = ws_deque_push(&self->deque, task);
+        assert(!err);  // OOM only
+        (void)err;
+        ok = true;
+    } else {
+        ok = mpmc_queue_push(&pool->queues[TPOOL_PRIORITY_NORMAL], task);
+    }
+    if (!ok && is_worker) {
+        int err = ws_deque_push(&self->deque, task);
+        assert(!err);  // OOM only
+        (void)err;
+        ok = true;
+    }
+    return ok;
+}
 
-    struct thread_pool *pool = *poolp;
+/// Queue a pushed task counted within the limit, see `thread_pool_try_enqueue`
+static void thread_pool_enqueue(struct thread_pool *pool, struct thread_task *task) {
+    bool ok = thread_pool_try_enqueue(pool, task);
+    assert(ok);  /* The queue has a cell for each of `task_count` */
+    (void)ok;
+}
 
-    pool->tmax = max_thread_count;
-    pool->threads = malloc(max_thread_count * sizeof pool->threads[0]);
-    assert(pool->threads);
+/**
+ * Queue the successors of @a task, just run by the current thread, which no longer wait for
+ * anything. Returns how many. The ones which did not fit into the queues are left in `*kept`,
+ * to be run by the caller, see `thread_pool_try_enqueue`
+ */
+static size_t thread_task_release_successors(struct thread_task *task, struct task_link **kept) {
+    /* Acquire: the successors are fully linked. Release: then-ers seeing it closed see the result */
+    struct task_link *link = __atomic_exchange_n(&task->successors, TASK_LINKS_CLOSED,
+            __ATOMIC_ACQ_REL);
+    size_t ready = 0;
+    *kept = NULL;
+    while (link) {
+        struct task_link *it = link;
+        link = it->next;
+        if (__atomic_sub_fetch(&it->task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            /* Not to be refused: the tasks it waited for are in the pool already */
+            stats_task_count(task->pool,
+                    __atomic_add_fetch(&task->pool->task_count, 1, __ATOMIC_RELAXED));
+            if (!thread_pool_try_enqueue(task->pool, it->task)) {
+                it->next = *kept;
+                *kept = it;
+                continue;
+            }
+            ++ready;
+        }
+        free(it);
+    }
+    return ready;
+}
 
-    int err = pthread_mutex_init(&pool->queue_lock, NULL);
-    assert(!err);
-    err = pthread_cond_init(&pool->queue_push_cond, NULL);
-    assert(!err);
-    err = circular_queue_init(&pool->queue);
-    assert(!err);  // OOM only
+int
+thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+    int err = thread_pool_reserve(pool, 1, false);
+    if (err != 0)
+        return err;
 
-    pool->spawned_count = pool->free_count = 0;
+    /*
+     * Pushed for the first time, or repushed. For the latter, it's up to the user to ensure that
+     * the task was joined earlier.
+     */
+    if (!atomic_cex_state(task, TASK_STATE_CREATED, TASK_STATE_PUSHED) &&
+            !atomic_cex_state(task, TASK_STATE_JOINED, TASK_STATE_PUSHED)) {
+        thread_pool_unreserve(pool, 1);
+        return TPOOL_ERR_INVALID_REPUSH;
+    }
+    __atomic_store_n(&task->is_cancelled, false, __ATOMIC_RELAXED);
+    task->period_ticks = 0;
 
+    thread_pool_enqueue(pool, task);
+    thread_pool_wake(pool, 1);
+    thread_pool_maybe_spawn(pool, 1);
     return 0;
 }
 
 int
-thread_pool_delete(struct thread_pool *pool)
+thread_pool_push_task_timed(struct thread_pool *pool, struct thread_task *task, double timeout)
 {
-    int err = pthread_mutex_lock(&pool->queue_lock);
-    assert(!err);
-    /* Note: `pool->spawned_count` and `pool->free_count` are also protected with `.queue_lock` */
-    int fail = circular_queue_size(&pool->queue) + (pool->spawned_count - pool->free_count);
-    err = pthread_mutex_unlock(&pool->queue_lock);
-    assert(!err);
-    if (fail)
-        return TPOOL_ERR_HAS_TASKS;
+    bool is_infinite = timeout >= (double)INT64_MAX / 1e9;
+    uint64_t deadline = is_infinite ? 0 :
+        monotonic_ns() + (uint64_t)(timeout > 0 ? timeout * 1e9 : 0);
+    while (1) {
+        int err = thread_pool_push_task(pool, task);
+        if (err != TPOOL_ERR_TOO_MANY_TASKS)
+            return err;
 
-    /* Should join all workers before destroying any resources it is using */
-    for (size_t i = 0; i < pool->spawned_count; ++i) {
-        err = pthread_cancel(pool->threads[i]);
-        assert(!err);
+        /* Registered first, then the count is looked at again, see `thread_pool_unreserve` */
+        uint32_t key = futex_eventcount_prepare(&pool->room);
+        bool is_timed_out = false;
+        if (__atomic_load_n(&pool->task_count, __ATOMIC_RELAXED) >= pool->task_limit) {
+            if (is_infinite) {
+                (void)futex_eventcount_wait(&pool->room, key, NULL);
+            } else {
+                uint64_t now = monotonic_ns();
+                is_timed_out = now >= deadline;
+                if (!is_timed_out) {
+                    struct timespec ts = {(deadline - now) / 1000000000,
+                        (deadline - now) % 1000000000};
+                    (void)futex_eventcount_wait(&pool->room, key, &ts);
+                }
+            }
+        }
+        futex_eventcount_leave(&pool->room);
+        if (is_timed_out)
+            return TPOOL_ERR_TIMEOUT;
     }
-    for (size_t i = 0; i < pool->spawned_count; ++i) {
-        err = pthread_join(pool->threads[i], NULL);
-        assert(!err);
+}
+
+/// The task of a timer of `thread_pool.timers`
+static struct thread_task *thread_task_of_timer(struct timer_node *timer) {
+    return (struct thread_task *)((char *)timer - offsetof(struct thread_task, timer));
+}
+
+/// Wake up the timer thread to look at `timers` again, under `timer_lock`
+static void thread_pool_timer_kick(struct thread_pool *pool) {
+    __atomic_store_n(&pool->timer_seq, pool->timer_seq + 1, __ATOMIC_RELAXED);
+    (void)futexp_wake(&pool->timer_seq, 1);
+}
+
+/**
+ * The timer thread: queues the tasks of `timers` as they expire, sleeping until the next expiry in
+ * between. All of them at once when the pool is aborting, to be skipped. Runs until the pool is
+ * deleted.
+ */
+static void *thread_pool_timer(void *poolv) {
+    struct thread_pool *pool = (struct thread_pool *)poolv;
+    if (pool->name[0]) {
+        /* See `thread_pool_worker` */
+        char name[32];
+        snprintf(name, sizeof name, "%s/timer", pool->name);
+        name[15] = '\0';
+        (void)pthread_setname_np(pthread_self(), name);
     }
-    free(pool->threads);
 
-    circular_queue_destroy(&pool->queue);
-    err = pthread_cond_destroy(&pool->queue_push_cond);
-    assert(!err);
-    err = pthread_mutex_destroy(&pool->queue_lock);
-    assert(!err);
+    futex_mutex_lock(&pool->timer_lock);
+    while (!__atomic_load_n(&pool->is_stopping, __ATOMIC_ACQUIRE)) {
+        uint64_t now_ns = monotonic_ns();
+        struct timer_node *due = __atomic_load_n(&pool->is_aborting, __ATOMIC_RELAXED) ?
+            timer_wheel_flush(pool->timers) :
+            timer_wheel_advance(pool->timers, now_ns / TPOOL_TIMER_TICK_NS);
+        uint64_t next = timer_wheel_next(pool->timers);
+        uint32_t seq = pool->timer_seq;
+        futex_mutex_unlock(&pool->timer_lock);
 
-    free(pool);
+        /* Already counted in `task_count`. A periodic one may be re-armed as soon as it's queued */
+        size_t count = 0;
+        while (due) {
+            struct timer_node *next_due = due->next;
+            thread_pool_enqueue(pool, thread_task_of_timer(due));
+            ++count;
+            due = next_due;
+        }
+        if (count > 0) {
+            thread_pool_wake(pool, count);
+            thread_pool_maybe_spawn(pool, count);
+        } else if (next == UINT64_MAX) {
+            (void)futexp_wait(&pool->timer_seq, seq);
+        } else {
+            uint64_t left = next * TPOOL_TIMER_TICK_NS - now_ns;
+            struct timespec ts = {left / 1000000000, left % 1000000000};
+            (void)futexp_timed_wait(&pool->timer_seq, seq, &ts);
+        }
+        futex_mutex_lock(&pool->timer_lock);
+    }
+    futex_mutex_unlock(&pool->timer_lock);
+    return NULL;
+}
+
+/**
+ * Have a pushed task counted in `pool` queued at the tick `expiry` by the timer thread, which is
+ * spawned with the first one
+ */
+static void thread_pool_arm(struct thread_pool *pool, struct thread_task *task, uint64_t expiry) {
+    task->pool = pool;
+    task->timer.expiry = expiry;
+    futex_mutex_lock(&pool->timer_lock);
+    if (!pool->has_timer_thread) {
+        pool->timers = malloc(sizeof *pool->timers);
+        assert(pool->timers);
+        timer_wheel_init(pool->timers, monotonic_ns() / TPOOL_TIMER_TICK_NS);
+        int err = pthread_create(&pool->timer_thread, NULL, thread_pool_timer, (void *)pool);
+        assert(!err);  /* Unable to spawn new thread */
+        (void)err;
+        pool->has_timer_thread = true;
+    }
+    uint64_t next = timer_wheel_next(pool->timers);
+    timer_wheel_add(pool->timers, &task->timer);
+    /* An abort flushes the timers it sees, but this one might be too late for that */
+    if (timer_wheel_next(pool->timers) < next || __atomic_load_n(&pool->is_aborting, __ATOMIC_RELAXED))
+        thread_pool_timer_kick(pool);
+    futex_mutex_unlock(&pool->timer_lock);
+}
 
+/// Seconds to nanoseconds, not to overflow the tick count
+static uint64_t seconds_to_ns(double seconds) {
+    return seconds >= (double)INT64_MAX / 1e9 ? (uint64_t)INT64_MAX : (uint64_t)(seconds * 1e9);
+}
+
+/**
+ * Push `task` into `pool` for the timer thread to queue after `delay_ns`, every `period_ns` after
+ * that if it's not 0
+ */
+static int thread_pool_push_delayed(struct thread_pool *pool, struct thread_task *task,
+        uint64_t delay_ns, uint64_t period_ns) {
+    int err = thread_pool_reserve(pool, 1, false);
+    if (err != 0)
+        return err;
+    /* See `thread_pool_push_task` */
+    if (!atomic_cex_state(task, TASK_STATE_CREATED, TASK_STATE_PUSHED) &&
+            !atomic_cex_state(task, TASK_STATE_JOINED, TASK_STATE_PUSHED)) {
+        thread_pool_unreserve(pool, 1);
+        return TPOOL_ERR_INVALID_REPUSH;
+    }
+    __atomic_store_n(&task->is_cancelled, false, __ATOMIC_RELAXED);
+    /* A period shorter than a tick is rounded up to it */
+    task->period_ticks = period_ns == 0 ? 0 :
+        (period_ns + TPOOL_TIMER_TICK_NS - 1) / TPOOL_TIMER_TICK_NS;
+
+    /* Rounded up too: never queued before the delay is over */
+    uint64_t expiry_ns = monotonic_ns() + delay_ns;
+    thread_pool_arm(pool, task, (expiry_ns + TPOOL_TIMER_TICK_NS - 1) / TPOOL_TIMER_TICK_NS);
     return 0;
 }
 
-__attribute__((pure))
 int
-thread_pool_thread_count(const struct thread_pool *pool)
+thread_pool_push_after(struct thread_pool *pool, struct thread_task *task, double delay)
 {
-    return pool->spawned_count;
+    if (!(delay >= 0))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    return thread_pool_push_delayed(pool, task, seconds_to_ns(delay), 0);
 }
 
 int
-thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+thread_pool_push_every(struct thread_pool *pool, struct thread_task *task, double period)
 {
-    int err = pthread_mutex_lock(&pool->queue_lock);
-    assert(!err);
+    if (!(period > 0))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    uint64_t period_ns = seconds_to_ns(period);
+    return thread_pool_push_delayed(pool, task, period_ns, period_ns);
+}
+
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks, size_t count)
+{
+    int err;
+    if (count == 0)
+        return 0;
+    if (count > pool->task_limit)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    if ((err = thread_pool_reserve(pool, count, false)) != 0)
+        return err;
 
-    int ret;
+    /*
+     * The tasks are checked before any is pushed, so that a failure leaves all of them as they
+     * were. A task which is not in a pool is the caller's, so its state can't change in between.
+     */
+    bool is_normal = true;
+    for (size_t i = 0; i < count; ++i) {
+        enum task_state state = task_state_get(tasks[i], __ATOMIC_ACQUIRE);
+        if (state != TASK_STATE_CREATED && state != TASK_STATE_JOINED) {
+            thread_pool_unreserve(pool, count);
+            return TPOOL_ERR_INVALID_REPUSH;
+        }
+        is_normal = is_normal && tasks[i]->priority == TPOOL_PRIORITY_NORMAL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        bool ok = atomic_cex_state(tasks[i], TASK_STATE_CREATED, TASK_STATE_PUSHED) ||
+            atomic_cex_state(tasks[i], TASK_STATE_JOINED, TASK_STATE_PUSHED);
+        assert(ok);  /* The task is listed twice or is pushed concurrently */
+        (void)ok;
+        __atomic_store_n(&tasks[i]->is_cancelled, false, __ATOMIC_RELAXED);
+        tasks[i]->period_ticks = 0;
+        tasks[i]->pool = pool;
+        stats_task_pushed(tasks[i]);
+    }
 
-    if (circular_queue_size(&pool->queue) >= TPOOL_MAX_TASKS) {
-        ret = TPOOL_ERR_TOO_MANY_TASKS;
+    struct thread_pool_worker *self = current_worker;
+    bool is_each = pool->node_queues || !is_normal;
+    for (size_t i = 0; i < count && !is_each; ++i)
+        trace_event(pool, TRACE_PUSH, tasks[i]);  /* As by `thread_pool_enqueue` otherwise */
+    if (is_each) {
+        /* Each to the queue of its node or priority */
+        for (size_t i = 0; i < count; ++i)
+            thread_pool_enqueue(pool, tasks[i]);
+    } else if (self && self->pool == pool) {
+        err = ws_deque_push_many(&self->deque, (void *const *)tasks, count);
+        assert(!err);  // OOM only
     } else {
-        if (atomic_cex_state(task, TASK_STATE_CREATED, TASK_STATE_PUSHED)) {
-            /* Success. Pushed task for the first time. */
-            ret = 0;
-            err = circular_queue_push(&pool->queue, task);
-            assert(!err);  // OOM only
-        } else if (atomic_cex_state(task, TASK_STATE_JOINED, TASK_STATE_PUSHED)) {
-            /* Success. Repushed the task. It's up to the user to ensure that it was joined earlier. */
-            ret = 0;
-            err = circular_queue_push(&pool->queue, task);
-            assert(!err);  // OOM only
-        } else {
-            ret = TPOOL_ERR_INVALID_REPUSH;
-        }
+        size_t pushed = mpmc_queue_push_many(&pool->queues[TPOOL_PRIORITY_NORMAL],
+                (void *const *)tasks, count);
+        assert(pushed == count);  /* The queue has a cell for each of `task_count` */
+        (void)pushed;
+    }
+
+    thread_pool_wake(pool, count);
+    thread_pool_maybe_spawn(pool, count);
+    return 0;
+}
+
+int
+thread_task_when_all(struct thread_task **tasks, size_t count, struct thread_task *next)
+{
+    if (count == 0)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    /* The successor is pushed from now on, to be joined or detached as such */
+    enum task_state old = TASK_STATE_CREATED;
+    if (!atomic_cex_state(next, TASK_STATE_CREATED, TASK_STATE_PUSHED)) {
+        old = TASK_STATE_JOINED;
+        if (!atomic_cex_state(next, TASK_STATE_JOINED, TASK_STATE_PUSHED))
+            return TPOOL_ERR_INVALID_REPUSH;
+    }
+    __atomic_store_n(&next->is_cancelled, false, __ATOMIC_RELAXED);
+    next->period_ticks = 0;
 
-        if (pool->free_count == 0 && pool->spawned_count < pool->tmax) {
-            err = pthread_create(&pool->threads[pool->spawned_count++], NULL,
-                    thread_pool_worker, (void *)pool);
-            assert(!err);  /* Unable to spawn new thread */
+    /* One more for myself, so that it is not queued until all the links are made */
+    __atomic_store_n(&next->pending, count + 1, __ATOMIC_RELAXED);
+    struct thread_pool *pool = NULL;
+    size_t finished = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct task_link *link = malloc(sizeof (*link));
+        assert(link);
+        link->task = next;
+        /* Release: the worker sees the link. Acquire: I see the result of a finished task */
+        link->next = __atomic_load_n(&tasks[i]->successors, __ATOMIC_ACQUIRE);
+        while (link->next != TASK_LINKS_CLOSED &&
+                !__atomic_compare_exchange_n(&tasks[i]->successors, &link->next, link, true,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            ;
+        if (link->next == TASK_LINKS_CLOSED) {
+            free(link);
+            pool = tasks[i]->pool;
+            ++finished;
         }
     }
+    if (__atomic_sub_fetch(&next->pending, finished + 1, __ATOMIC_ACQ_REL) != 0)
+        return 0;
 
-    err = pthread_cond_signal(&pool->queue_push_cond);
-    assert(!err);
-    err = pthread_mutex_unlock(&pool->queue_lock);
-    assert(!err);
-    return ret;
+    /*
+     * All of them have finished, the last ones while I was linking maybe: queue it myself, into
+     * the pool of one of them
+     */
+    if (!pool)
+        pool = tasks[0]->pool;
+    struct thread_pool_worker *self = current_worker;
+    /* A worker queues it to its own deque if its queue is full, see `thread_pool_try_enqueue` */
+    int err = thread_pool_reserve(pool, 1, self && self->pool == pool);
+    if (err != 0) {
+        bool ok = atomic_cex_state(next, TASK_STATE_PUSHED, old);
+        assert(ok);  /* Nobody else knows it's pushed yet */
+        (void)ok;
+        return err;
+    }
+    thread_pool_enqueue(pool, next);
+    thread_pool_wake(pool, 1);
+    thread_pool_maybe_spawn(pool, 1);
+    return 0;
 }
 
 int
-thread_task_new(struct thread_task **taskp, thread_task_f function, void *arg)
+thread_task_then(struct thread_task *task, struct thread_task *next)
 {
-    *taskp = malloc(sizeof (struct thread_task));
-    assert(*taskp);
-
-    struct thread_task *task = *taskp;
+    return thread_task_when_all(&task, 1, next);
+}
 
+/// Initialize a task, whose storage and `is_embedded` are already set
+static int thread_task_init_in(struct thread_task *task, thread_task_f function, void *arg) {
     task->function = function;
     task->arg = arg;
     // task->ret: uninitialized;
+    task->pool = NULL;
+    task->successors = NULL;
+    task->pending = 0;
+    task->node = -1;
+    task->priority = TPOOL_PRIORITY_NORMAL;
+    task->is_cancelled = false;
+    task->period_ticks = 0;
 
     /*
      * `task->state` is initialized last with memory order release: when accessed after task
@@ -304,12 +1952,44 @@ thread_task_new(struct thread_task **taskp, thread_task_f function, void *arg)
     return 0;
 }
 
+int
+thread_task_new(struct thread_task **taskp, thread_task_f function, void *arg)
+{
+    *taskp = thread_task_alloc();
+    (*taskp)->is_embedded = false;
+    return thread_task_init_in(*taskp, function, arg);
+}
+
+int
+thread_task_init(struct thread_task **taskp, struct thread_task_storage *storage,
+        thread_task_f function, void *arg)
+{
+    *taskp = (struct thread_task *)storage;
+    (*taskp)->is_embedded = true;
+    return thread_task_init_in(*taskp, function, arg);
+}
+
+void
+thread_task_set_node(struct thread_task *task, int node)
+{
+    task->node = node;
+}
+
+int
+thread_task_set_priority(struct thread_task *task, int priority)
+{
+    if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    task->priority = priority;
+    return 0;
+}
+
 int
 thread_task_delete(struct thread_task *task)
 {
-    enum task_state state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+    enum task_state state = task_state_get(task, __ATOMIC_ACQUIRE);
     if (state == TASK_STATE_CREATED || state == TASK_STATE_JOINED) {
-        free(task);
+        thread_task_free(task);
         return 0;
     } else {
         return TPOOL_ERR_TASK_IN_POOL;
@@ -324,7 +2004,7 @@ thread_task_is_finished(const struct thread_task *task)
      * the finishing operations to have completed, so the relaxed memory order is not
      * sufficient. Note that acquire is enough, as the state is set with release.
      */
-    return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_STATE_COMPLETED;
+    return task_state_get(task, __ATOMIC_ACQUIRE) == TASK_STATE_COMPLETED;
 }
 
 bool
@@ -338,13 +2018,83 @@ thread_task_is_running(const struct thread_task *task)
      * Therefore, need to ensure everything happening before the task gets into the running state is
      * finished, thus the memory order.
      */
-    return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_STATE_RUNNING;
+    return task_state_get(task, __ATOMIC_ACQUIRE) == TASK_STATE_RUNNING;
     /*
      * Note that `TASK_STATE_RUNING_GHOST` also corresponds to a running task but ghost tasks must never
      * be addressed - the behavior is undefined.
      */
 }
 
+int
+thread_task_cancel(struct thread_task *task)
+{
+    enum task_state state = task_state_get(task, __ATOMIC_ACQUIRE);
+    if (state == TASK_STATE_CREATED || state == TASK_STATE_JOINED)
+        return TPOOL_ERR_TASK_NOT_PUSHED;
+    /* Whoever takes it next sees the flag: there's no need to order anything else with it */
+    __atomic_store_n(&task->is_cancelled, true, __ATOMIC_RELAXED);
+    return 0;
+}
+
+bool
+thread_task_is_cancelled(const struct thread_task *task)
+{
+    return __atomic_load_n(&task->is_cancelled, __ATOMIC_RELAXED);
+}
+
+bool
+thread_task_self_is_cancelled(void)
+{
+    struct thread_task *task = current_task;
+    return task && (__atomic_load_n(&task->is_cancelled, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&task->pool->is_aborting, __ATOMIC_RELAXED));
+}
+
+void *
+thread_pool_worker_scratch(size_t size)
+{
+    struct thread_pool_worker *self = current_worker;
+    if (!self || !current_task)
+        return NULL;
+    return scratch_alloc(&self->scratch, size);
+}
+
+int
+thread_pool_worker_key_create(void (*destructor)(void *), int *key)
+{
+    futex_mutex_lock(&worker_key_lock);
+    int count = worker_key_count;
+    if (count < TPOOL_MAX_WORKER_KEYS) {
+        worker_key_destructors[count] = destructor;
+        /* Release: the exiting workers see the destructor */
+        __atomic_store_n(&worker_key_count, count + 1, __ATOMIC_RELEASE);
+    }
+    futex_mutex_unlock(&worker_key_lock);
+    if (count == TPOOL_MAX_WORKER_KEYS)
+        return TPOOL_ERR_TOO_MANY_KEYS;
+    *key = count;
+    return 0;
+}
+
+void *
+thread_pool_worker_get(int key)
+{
+    struct thread_pool_worker *self = current_worker;
+    if (!self || key < 0 || key >= TPOOL_MAX_WORKER_KEYS)
+        return NULL;
+    return self->values[key];
+}
+
+int
+thread_pool_worker_set(int key, void *value)
+{
+    struct thread_pool_worker *self = current_worker;
+    if (!self || key < 0 || key >= __atomic_load_n(&worker_key_count, __ATOMIC_ACQUIRE))
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    self->values[key] = value;
+    return 0;
+}
+
 int
 thread_task_join(struct thread_task *task, void **result) {
     /*
@@ -354,12 +2104,14 @@ thread_task_join(struct thread_task *task, void **result) {
      * If the task is not yet pushed but I receive the pushed state, there is no problem
      * in subscribing to the state early.
      */
-    if (__atomic_load_n(&task->state, __ATOMIC_RELAXED) == TASK_STATE_CREATED)
+    if (task_state_get(task, __ATOMIC_RELAXED) == TASK_STATE_CREATED)
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
-    int err = futexp_wait_for(&task->state, TASK_STATE_COMPLETED);
+    int err = thread_task_wait_completed(task, NULL);
     assert(!err);
 
+    /* A joined task is waited for until it is run again */
+    __atomic_store_n(&task->successors, NULL, __ATOMIC_RELAXED);
     bool succ = atomic_cex_state(task, TASK_STATE_COMPLETED, TASK_STATE_JOINED);
     assert(succ);  /* Task must not transition once completed until joined. */
 
@@ -375,7 +2127,7 @@ int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 {
     /* Relaxed memory order is sufficient here. See `thread_task_join` */
-    if (__atomic_load_n(&task->state, __ATOMIC_RELAXED) == TASK_STATE_CREATED)
+    if (task_state_get(task, __ATOMIC_RELAXED) == TASK_STATE_CREATED)
         return TPOOL_ERR_TASK_NOT_PUSHED;
 
     struct timespec ttm = {};
@@ -392,12 +2144,14 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
         ttm.tv_nsec = (long)((timeout - ttm.tv_sec) * 1e9);
     }
 
-    int err = futexp_timed_wait_for(&task->state, TASK_STATE_COMPLETED, ttmp);
+    int err = thread_task_wait_completed(task, ttmp);
     if (err != 0) {
         assert(errno == ETIMEDOUT);
         return TPOOL_ERR_TIMEOUT;
     }
 
+    /* A joined task is waited for until it is run again, see `thread_task_join` */
+    __atomic_store_n(&task->successors, NULL, __ATOMIC_RELAXED);
     bool succ = atomic_cex_state(task, TASK_STATE_COMPLETED, TASK_STATE_JOINED);
     assert(succ);  /* Task must not transition once completed until joined. */
 
@@ -415,18 +2169,175 @@ int
 thread_task_detach(struct thread_task *task)
 {
     /* Warning: the checks order is important */
-    if (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) == TASK_STATE_CREATED) {
+    if (task_state_get(task, __ATOMIC_ACQUIRE) == TASK_STATE_CREATED)
         return TPOOL_ERR_TASK_NOT_PUSHED;
-    } else if (atomic_cex_state(task, TASK_STATE_PUSHED, TASK_STATE_PUSHED_GHOST)) {
-        return 0;
-    } else if (atomic_cex_state(task, TASK_STATE_RUNNING, TASK_STATE_RUNNING_GHOST)) {
-        return 0;
-    } else if (atomic_cex_state(task, TASK_STATE_COMPLETED, TASK_STATE_JOINED)) {
-        thread_task_delete(task);
-        return 0;
-    } else {
-        assert(false);  // Other states/transitions are impossible
+    while (1) {
+        if (atomic_cex_state(task, TASK_STATE_PUSHED, TASK_STATE_PUSHED_GHOST)) {
+            return 0;
+        } else if (atomic_cex_state(task, TASK_STATE_RUNNING, TASK_STATE_RUNNING_GHOST)) {
+            return 0;
+        } else if (atomic_cex_state(task, TASK_STATE_COMPLETED, TASK_STATE_JOINED)) {
+            thread_task_delete(task);
+            return 0;
+        }
+        /* Other states/transitions are impossible, but a periodic task is re-armed meanwhile */
+        assert(task->period_ticks != 0);
     }
 }
 
 #endif
+
+/// A parallel loop, shared by all of its pieces
+struct parallel_job {
+    struct thread_pool *pool;
+    size_t grain;
+    /// Either `for_f` or `map_f` with `combine_f`
+    thread_pool_for_f for_f;
+    thread_pool_map_f map_f;
+    thread_pool_combine_f combine_f;
+    void *ctx;
+};
+
+/// A piece of a parallel loop split off to be stolen. Lives on the stack of the splitting task
+struct parallel_piece {
+    struct thread_task_storage storage;
+    struct thread_task *task;
+    const struct parallel_job *job;
+    size_t begin;
+    size_t end;
+    void *result;
+};
+
+static void *parallel_run(const struct parallel_job *job, size_t begin, size_t end);
+
+/// How many tasks the current thread runs nested in its joins, see `thread_pool_help_join`
+static __thread int help_depth;
+
+static void *parallel_piece_f(void *piecev) {
+    struct parallel_piece *piece = piecev;
+    piece->result = parallel_run(piece->job, piece->begin, piece->end);
+    return NULL;
+}
+
+/**
+ * Wait for `task` of `pool` to complete, running the other tasks of the pool meanwhile. The
+ * task is likely to be just taken back from my own deque, and otherwise a thief has given
+ * me work to steal back, so the thread never sits idle while there are tasks.
+ *
+ * Each task run so is nested on the stack, and the ones from the shared queues may split
+ * further and join again: past `TPOOL_MAX_HELP_DEPTH`, only the own deque is looked into. Its
+ * latest tasks are the pieces of mine, which are smaller and smaller.
+ */
+static void thread_pool_help_join(struct thread_pool *pool, struct thread_task *task) {
+    struct thread_pool_worker *self = current_worker;
+    if (self && self->pool != pool)
+        self = NULL;
+    while (task_state_get(task, __ATOMIC_ACQUIRE) != TASK_STATE_COMPLETED) {
+        struct thread_task *other = NULL;
+        void *taken;
+        if (help_depth < TPOOL_MAX_HELP_DEPTH)
+            other = thread_pool_find_task(pool, self);
+        else if (self && ws_deque_take(&self->deque, &taken))
+            other = (struct thread_task *)taken;
+        if (other == NULL) {
+            /* The task is being run by someone else */
+            int err = thread_task_wait_completed(task, NULL);
+            assert(!err);
+            (void)err;
+            break;
+        }
+        ++help_depth;
+        thread_pool_run_task(pool, other, false);
+        --help_depth;
+    }
+}
+
+/**
+ * Run `job` over [`begin`, `end`): split the right halves off as tasks, for the idle threads
+ * to steal, until the rest is no bigger than the grain; do the rest and join the halves
+ * (helping meanwhile). The results are combined left to right.
+ */
+static void *parallel_run(const struct parallel_job *job, size_t begin, size_t end) {
+    struct parallel_piece pieces[TPOOL_MAX_SPLITS];
+    size_t count = 0;
+    while (end - begin > job->grain && count < TPOOL_MAX_SPLITS) {
+        size_t mid = begin + (end - begin) / 2;
+        struct parallel_piece *piece = &pieces[count];
+        piece->job = job;
+        piece->begin = mid;
+        piece->end = end;
+        thread_task_init(&piece->task, &piece->storage, parallel_piece_f, piece);
+        if (thread_pool_push_task(job->pool, piece->task) != 0) {
+            /* Too many tasks, the pool is busy enough: do the rest myself */
+            thread_task_delete(piece->task);
+            break;
+        }
+        ++count;
+        end = mid;
+    }
+
+    void *result = NULL;
+    if (job->for_f)
+        job->for_f(begin, end, job->ctx);
+    else
+        result = job->map_f(begin, end, job->ctx);
+
+    while (count > 0) {
+        struct parallel_piece *piece = &pieces[--count];
+        thread_pool_help_join(job->pool, piece->task);
+        void *unused;
+        int err = thread_task_join(piece->task, &unused);
+        assert(!err);
+        err = thread_task_delete(piece->task);
+        assert(!err);
+        (void)err;
+        if (job->map_f)
+            result = job->combine_f(result, piece->result, job->ctx);
+    }
+    return result;
+}
+
+/// Run `job` over [`begin`, `end`) with the calling thread taking part, see `parallel_run`
+static int thread_pool_parallel(struct parallel_job *job, size_t begin, size_t end,
+        void **result) {
+    if (begin > end)
+        return TPOOL_ERR_INVALID_ARGUMENT;
+    if (job->grain == 0) {
+        job->grain = (end - begin) / (TPOOL_PIECES_PER_THREAD * job->pool->tmax);
+        if (job->grain == 0)
+            job->grain = 1;
+    }
+    void *ret = NULL;
+    if (begin < end)
+        ret = parallel_run(job, begin, end);
+    if (result)
+        *result = ret;
+    return 0;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+        thread_pool_for_f function, void *ctx)
+{
+    struct parallel_job job = {
+        .pool = pool,
+        .grain = grain,
+        .for_f = function,
+        .ctx = ctx,
+    };
+    return thread_pool_parallel(&job, begin, end, NULL);
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+        thread_pool_map_f map, thread_pool_combine_f combine, void *ctx, void **result)
+{
+    struct parallel_job job = {
+        .pool = pool,
+        .grain = grain,
+        .map_f = map,
+        .combine_f = combine,
+        .ctx = ctx,
+    };
+    return thread_pool_parallel(&job, begin, end, result);
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -14,10 +16,21 @@
  *
  * It is important to define these macros here, in the header, because it is
  * used by tests.
+ *
+ * NEED_STATS enables thread_pool_stats(). It is off by default: it reads the
+ * clock thrice per task, which costs about as much as a short task itself.
+ * Without it, the pool does not look at the clock or count anything.
+ *
+ * NEED_TRACE enables thread_pool_trace_dump(): each worker records the
+ * pushes, starts and finishes of the tasks and its parking in a ring of
+ * its own, to see whether the tasks wait in the queues or take long to
+ * run. Off by default for the same reason.
  */
 
 #define NEED_DETACH
 #define NEED_TIMED_JOIN
+/* #define NEED_STATS */
+/* #define NEED_TRACE */
 
 struct thread_pool;
 struct thread_task;
@@ -25,8 +38,22 @@ struct thread_task;
 typedef void *(*thread_task_f)(void *);
 
 enum {
+    /// The most threads of thread_pool_new, see `struct thread_pool_options` for more
     TPOOL_MAX_THREADS = 20,
+    /// The most tasks in a pool by default, see `struct thread_pool_options`
     TPOOL_MAX_TASKS = 100000,
+    /// Size of `struct thread_task_storage`, at least that of a task
+    TPOOL_TASK_STORAGE_SIZE = 128,
+    /// The most keys of thread_pool_worker_key_create
+    TPOOL_MAX_WORKER_KEYS = 16,
+};
+
+/**
+ * Storage for a task provided by the caller, see
+ * `thread_task_init`. Only its size and alignment matter.
+ */
+struct thread_task_storage {
+    _Alignas(64) unsigned char data[TPOOL_TASK_STORAGE_SIZE];
 };
 
 enum {
@@ -38,10 +65,86 @@ enum {
     TPOOL_ERR_NOT_IMPLEMENTED,
     TPOOL_ERR_TIMEOUT,
     TPOOL_ERR_INVALID_REPUSH,
+    TPOOL_ERR_SHUT_DOWN,
+    TPOOL_ERR_TOO_MANY_KEYS,
+};
+
+/** Modes of thread_pool_shutdown. */
+enum {
+    /** The tasks pushed already are run. */
+    TPOOL_SHUTDOWN_DRAIN,
+    /**
+     * The queued tasks are skipped, the running ones are
+     * cancelled.
+     */
+    TPOOL_SHUTDOWN_ABORT,
+};
+
+/** Priorities of the tasks, see thread_task_set_priority. */
+enum {
+    TPOOL_PRIORITY_HIGH,
+    TPOOL_PRIORITY_NORMAL,
+    TPOOL_PRIORITY_LOW,
+    TPOOL_PRIORITY_COUNT,
+};
+
+enum {
+    /** The threads of the pool run anywhere. */
+    TPOOL_NUMA_NONE = -2,
+    /** The threads of the pool are spread over the NUMA nodes. */
+    TPOOL_NUMA_SPREAD = -1,
 };
 
 /** Thread pool API. */
 
+/**
+ * Options of a new thread pool, see thread_pool_new_ext. To be
+ * initialized via thread_pool_options_init, for the fields not
+ * set to be the defaults.
+ */
+struct thread_pool_options {
+    /**
+     * Maximum pool size, as for thread_pool_new but not limited to
+     * TPOOL_MAX_THREADS.
+     */
+    int max_thread_count;
+    /**
+     * Maximum number of tasks pushed and not yet finished, beyond
+     * which a push fails or waits. TPOOL_MAX_TASKS by default.
+     */
+    size_t max_task_count;
+    /**
+     * CPUs for the threads to run on, @a cpu_count of them. NULL
+     * for any.
+     */
+    const int *cpus;
+    int cpu_count;
+    /**
+     * NUMA node number for the threads to run on, as in
+     * /sys/devices/system/node. Or TPOOL_NUMA_SPREAD for the
+     * threads to be spread over the nodes of the CPUs, each
+     * running on the CPUs of its node, so that a task can be run
+     * on the node of its data, see thread_task_set_node. By
+     * default, TPOOL_NUMA_NONE.
+     */
+    int numa_node;
+    /** Stack size of the threads, 0 for the default. */
+    size_t stack_size;
+    /**
+     * Name of the threads, followed by their numbers. Truncated to
+     * 12 characters. NULL for none.
+     */
+    const char *name;
+};
+
+/**
+ * Initialize @a opts to the defaults, as for thread_pool_new.
+ * @param[out] opts Options to initialize.
+ * @param max_thread_count Maximum pool size.
+ */
+void
+thread_pool_options_init(struct thread_pool_options *opts, int max_thread_count);
+
 /**
  * Create a new thread pool with maximum @a max_thread_count
  * threads.
@@ -56,6 +159,20 @@ enum {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+/**
+ * Create a new thread pool with @a opts.
+ * @param opts Options of the pool.
+ * @param[out] pool Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max thread or task count is
+ *       0, or none of the CPUs (of the node) may be run on, or
+ *       the stack size is too small.
+ */
+int
+thread_pool_new_ext(const struct thread_pool_options *opts, struct thread_pool **pool);
+
 /**
  * How many threads are created by this pool. Can be less than
  * max.
@@ -65,6 +182,127 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool);
 int
 thread_pool_thread_count(const struct thread_pool *pool) __attribute__((pure));
 
+/**
+ * How many tasks of @a priority are queued in @a pool, waiting
+ * for a thread. Approximate, as the queues change meanwhile.
+ * @param pool Thread pool to get the queue depth of.
+ * @param priority One of TPOOL_PRIORITY_*.
+ * @retval Queue depth, 0 for an invalid @a priority.
+ */
+size_t
+thread_pool_queue_depth(const struct thread_pool *pool, int priority);
+
+#ifdef NEED_STATS
+
+enum {
+    /// Buckets of the time histograms, see `struct thread_pool_stats`
+    TPOOL_STATS_BUCKETS = 40,
+};
+
+/** What a worker has done since it was first spawned. */
+struct thread_pool_worker_stats {
+    /// Tasks run
+    uint64_t task_count;
+    /// Nanoseconds spent running tasks
+    uint64_t busy_ns;
+    /// Nanoseconds spent waiting for tasks
+    uint64_t idle_ns;
+};
+
+/**
+ * What a pool has done since it was created. The bucket `i` of a
+ * histogram counts the tasks which took from 2^i to 2^(i + 1)
+ * nanoseconds, the last bucket also counts the longer ones.
+ */
+struct thread_pool_stats {
+    /// Time from a push to the start of a task
+    uint64_t wait_hist[TPOOL_STATS_BUCKETS];
+    /// Time from the start to the finish of a task
+    uint64_t run_hist[TPOOL_STATS_BUCKETS];
+    /// The most tasks pushed and not yet finished at once
+    size_t max_task_count;
+    /// Threads spawned, including the respawned ones
+    uint64_t spawn_count;
+    /// Times the spawning lock was found taken by another thread
+    uint64_t spawn_contended_count;
+    /// Worker slots used, see thread_pool_worker_stats
+    size_t worker_count;
+};
+
+/**
+ * Take the statistics of a pool. Each counter is read atomically,
+ * but they are not a snapshot of one moment as a whole.
+ * @param pool Thread pool to look at.
+ * @param[out] stats Its statistics.
+ */
+void
+thread_pool_stats(const struct thread_pool *pool, struct thread_pool_stats *stats);
+
+/**
+ * Take the statistics of a worker of a pool, read as in
+ * thread_pool_stats.
+ * @param pool Thread pool to look at.
+ * @param index Worker number, less than the worker count of the
+ *        pool statistics.
+ * @param[out] stats Its statistics.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such worker.
+ */
+int
+thread_pool_worker_stats(const struct thread_pool *pool, size_t index,
+        struct thread_pool_worker_stats *stats);
+
+#endif
+
+#ifdef NEED_TRACE
+
+enum {
+    /// The latest events kept of each worker, see thread_pool_trace_dump
+    TPOOL_TRACE_EVENTS = 1 << 16,
+};
+
+/**
+ * Write the trace of a pool to a file, in the Chrome trace format
+ * of Perfetto and chrome://tracing: a line per worker, with the runs
+ * of the tasks and the times it was parked, the pushes and an arrow
+ * from each push to the start of the task. The events of the threads
+ * which are not the workers of the pool, pushing or helping while
+ * they join, are on a line of their own. The last TPOOL_TRACE_EVENTS
+ * events of each line are kept. To be called when the pool is quiet,
+ * for the events not to be overwritten while they are written out.
+ * @param pool Thread pool to look at.
+ * @param path The file to write.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the file could not be written.
+ */
+int
+thread_pool_trace_dump(const struct thread_pool *pool, const char *path);
+
+#endif
+
+/**
+ * Let the threads of @a pool exit when they have had no tasks
+ * for @a idle_timeout seconds, down to @a min_thread_count of
+ * them, which are spawned right away if there are fewer. The
+ * threads are spawned again when needed. By default, the
+ * threads never exit until the pool is deleted.
+ * @param pool Thread pool to configure.
+ * @param min_thread_count Number of threads which never exit.
+ * @param idle_timeout Seconds without tasks for a thread to
+ *        exit after, negative for never.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - min_thread_count is
+ *       negative or more than the max thread count of the pool.
+ */
+int
+thread_pool_set_idle(struct thread_pool *pool, int min_thread_count, double idle_timeout);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -75,6 +313,23 @@ thread_pool_thread_count(const struct thread_pool *pool) __attribute__((pure));
 int
 thread_pool_delete(struct thread_pool *pool);
 
+/**
+ * Stop @a pool from taking tasks pushed from outside of it, and
+ * wait until it has none. The tasks of the pool may still push
+ * theirs, to finish their work. Then the pool only waits to be
+ * deleted, with its tasks which are not joined yet.
+ * @param pool Pool to shut down.
+ * @param mode TPOOL_SHUTDOWN_DRAIN to run all the tasks pushed, or
+ *        TPOOL_SHUTDOWN_ABORT to cancel them, as thread_task_cancel.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such mode, or called from a
+ *       task of the pool, which would wait for itself.
+ */
+int
+thread_pool_shutdown(struct thread_pool *pool, int mode);
+
 /**
  * Push @a task into thread pool queue.
  * @param pool Pool to push into.
@@ -86,10 +341,92 @@ thread_pool_delete(struct thread_pool *pool);
  *       already.
  *     - TPOOL_ERR_INVALID_REPUSH - attempt to push a task that
  *       has already been pushed but has not finished.
+ *     - TPOOL_ERR_SHUT_DOWN - the pool is shut down.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks into thread pool queue at once. Cheaper
+ * than pushing them one by one: the queue is claimed, the
+ * threads are spawned and the idle ones are woken up once for
+ * the whole batch. Either all the tasks are pushed, or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push, each listed once.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool can't take @a count
+ *       more tasks.
+ *     - TPOOL_ERR_INVALID_REPUSH - one of the tasks has already
+ *       been pushed but has not finished.
+ *     - TPOOL_ERR_SHUT_DOWN - the pool is shut down.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks, size_t count);
+
+/**
+ * Like thread_pool_push_task() but if the pool is full, wait for
+ * its tasks to finish to make room, no longer than the timeout.
+ * So that the producers are slowed down to the pace of the pool.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param timeout Timeout in seconds, as for thread_task_timed_join.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TIMEOUT - the pool is still full, nothing is
+ *       done.
+ *     - TPOOL_ERR_INVALID_REPUSH - attempt to push a task that
+ *       has not been joined.
+ */
+int
+thread_pool_push_task_timed(struct thread_pool *pool, struct thread_task *task, double timeout);
+
+/**
+ * Push @a task into thread pool, to be queued once @a delay is
+ * over, without taking a thread meanwhile. It is counted in the
+ * pool from now on. Delays are rounded up to milliseconds.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param delay Delay in seconds, 0 to be queued at once.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - delay is negative.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_INVALID_REPUSH - attempt to push a task that
+ *       has already been pushed but has not finished.
+ *     - TPOOL_ERR_SHUT_DOWN - the pool is shut down.
+ */
+int
+thread_pool_push_after(struct thread_pool *pool, struct thread_task *task, double delay);
+
+/**
+ * Push @a task into thread pool to run every @a period, the
+ * first time after one period. The runs missed while it is late
+ * are skipped. The task is finished, to be joined, only once it
+ * is cancelled (which takes effect at its next run) or the pool
+ * is shut down (after which it runs once more at most). The
+ * result is that of the last run.
+ * @param pool Thread pool to push into.
+ * @param task Task to push.
+ * @param period Period in seconds, rounded up to milliseconds.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - period is not positive.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
+ *       already.
+ *     - TPOOL_ERR_INVALID_REPUSH - attempt to push a task that
+ *       has already been pushed but has not finished.
+ *     - TPOOL_ERR_SHUT_DOWN - the pool is shut down.
+ */
+int
+thread_pool_push_every(struct thread_pool *pool, struct thread_task *task, double period);
+
 /** Thread pool task API. */
 
 /**
@@ -103,6 +440,55 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Create a new task in the storage provided by the caller, for
+ * example on its stack or embedded into its own object, so that
+ * nothing is allocated. The task is used like one created by
+ * thread_task_new, and deleted via thread_task_delete too,
+ * which frees nothing. The storage must outlive the task: if
+ * the task is detached, until its pool is deleted, as a worker
+ * can still access it after the task is finished.
+ * @param[out] task Pointer to store result task object.
+ * @param storage Storage for the task.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_init(struct thread_task **task, struct thread_task_storage *storage,
+        thread_task_f function, void *arg);
+
+/**
+ * Hint that @a task is best run on NUMA node @a node, where its
+ * data is, for the next pushes. Only a pool with its threads
+ * spread over the nodes (see struct thread_pool_options) takes
+ * it into account: the task is run by a thread of the node if
+ * it has any and they are not too busy.
+ * @param task Task to set the node of.
+ * @param node NUMA node number, -1 for any.
+ */
+void
+thread_task_set_node(struct thread_task *task, int node);
+
+/**
+ * Set the priority of @a task for the next pushes,
+ * TPOOL_PRIORITY_NORMAL by default. The threads take the tasks
+ * of higher priorities first, but now and then take the lower
+ * ones first too, so that they are not starved. The tasks of
+ * other than the normal priority are queued for any thread,
+ * even when pushed by a task, and regardless of their NUMA
+ * node.
+ * @param task Task to set the priority of.
+ * @param priority One of TPOOL_PRIORITY_*.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority.
+ */
+int
+thread_task_set_priority(struct thread_task *task, int priority);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -117,6 +503,89 @@ thread_task_is_finished(const struct thread_task *task);
 bool
 thread_task_is_running(const struct thread_task *task);
 
+/**
+ * Cancel a pushed task. If it is still queued, it is not run
+ * (its successors are): it finishes with a NULL result right away
+ * when a thread takes it. A running task is only told, see
+ * thread_task_self_is_cancelled, for it to stop early if it wants
+ * to. It is reset when the task is pushed again.
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Check if @a task was cancelled since it was pushed, by
+ * thread_task_cancel or by an aborting thread_pool_shutdown.
+ * @param task Task to check.
+ */
+bool
+thread_task_is_cancelled(const struct thread_task *task);
+
+/**
+ * Check if the task the calling thread is running is cancelled,
+ * for it to poll. False outside of a task.
+ */
+bool
+thread_task_self_is_cancelled(void);
+
+/** Worker-local memory, for the tasks not to allocate every run. */
+
+/**
+ * Allocate @a size bytes of scratch memory of the worker running
+ * the calling task, aligned as malloc's. It is valid until the task
+ * returns: then all the scratch it has taken is given back at once,
+ * and is reused by the next tasks of the worker. So the short-lived
+ * buffers of the tasks do not go to the allocator, whichever worker
+ * a task happens to run on. A task run while joining another one
+ * has its scratch on top of that of the outer task.
+ * @param size Bytes to allocate.
+ *
+ * @retval Memory, NULL if out of memory or not in a task run by a
+ *     worker of a pool.
+ */
+void *
+thread_pool_worker_scratch(size_t size);
+
+/**
+ * Create a key of a value each worker of each pool has of its own,
+ * like pthread_key_create but for the workers. Of at most
+ * TPOOL_MAX_WORKER_KEYS keys, which are never deleted.
+ * @param destructor Called for a value not NULL of a worker when
+ *     it exits: when it retires or its pool is deleted. May be NULL.
+ * @param[out] key The key.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TOO_MANY_KEYS - all the keys are taken.
+ */
+int
+thread_pool_worker_key_create(void (*destructor)(void *), int *key);
+
+/**
+ * The value of @a key of the worker running the calling task, NULL
+ * if not set or not in a worker.
+ * @param key Key of thread_pool_worker_key_create.
+ */
+void *
+thread_pool_worker_get(int key);
+
+/**
+ * Set the value of @a key of the worker running the calling task.
+ * @param key Key of thread_pool_worker_key_create.
+ * @param value The value.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - not in a worker, or no such key.
+ */
+int
+thread_pool_worker_set(int key, void *value);
+
 /**
  * Join the task. If it is not finished, then wait until it is.
  * Note, this function does not delete task object. It can be
@@ -131,6 +600,87 @@ thread_task_is_running(const struct thread_task *task);
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Run @a next after all of @a tasks are finished, without
+ * blocking any thread meanwhile. @a next is considered pushed
+ * from now on: it can be joined, or detached, like a pushed
+ * task. Once the last of @a tasks is finished, @a next is
+ * pushed into the pool of that task. So the pools must not be
+ * deleted until then, and the tasks must be pushed at some
+ * point: a task which is not pushed or is joined already is
+ * waited for until it is (re)pushed and finished. A task
+ * finished and not joined yet is not waited for.
+ * @param tasks Tasks to wait for.
+ * @param count Number of @a tasks.
+ * @param next Task to run after them.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a count is 0.
+ *     - TPOOL_ERR_INVALID_REPUSH - @a next has already been
+ *       pushed but has not finished.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the tasks are finished
+ *       already and their pool has too many tasks to push
+ *       @a next. Nothing is done.
+ *     - TPOOL_ERR_SHUT_DOWN - the tasks are finished already and
+ *       their pool is shut down. Nothing is done.
+ */
+int
+thread_task_when_all(struct thread_task **tasks, size_t count, struct thread_task *next);
+
+/**
+ * Run @a next after @a task is finished, the same as
+ * thread_task_when_all for one task.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/** A piece [@a begin, @a end) of a parallel loop. */
+typedef void (*thread_pool_for_f)(size_t begin, size_t end, void *ctx);
+
+/** A piece [@a begin, @a end) of a parallel reduction, returns its result. */
+typedef void *(*thread_pool_map_f)(size_t begin, size_t end, void *ctx);
+
+/** Combine the results of two adjacent pieces, @a a to the left of @a b. */
+typedef void *(*thread_pool_combine_f)(void *a, void *b, void *ctx);
+
+/**
+ * Call @a function over [@a begin, @a end) in @a pool, in pieces of
+ * at most @a grain indices. The range is split in halves which the
+ * idle threads steal, and the calling thread does its share and runs
+ * the other tasks of the pool while it waits, instead of blocking. So
+ * it may be called from a task of the same pool, too.
+ * @param pool Thread pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Most indices per call, 0 for a few pieces per thread.
+ * @param function Function to call for each piece.
+ * @param ctx Argument passed to @a function.
+ *
+ * @retval 0 Success, all the pieces are done.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a begin is after @a end.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+        thread_pool_for_f function, void *ctx);
+
+/**
+ * Like thread_pool_parallel_for() but reduce the results of the
+ * pieces: @a map gives a result for each one, and @a combine merges
+ * the results of adjacent pieces, left to right, so it need not be
+ * commutative.
+ * @param[out] result The result of the whole range, NULL if the range
+ *   is empty.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a begin is after @a end.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, size_t begin, size_t end, size_t grain,
+        thread_pool_map_f map, thread_pool_combine_f combine, void *ctx, void **result);
+
 #ifdef NEED_TIMED_JOIN
 
 /**
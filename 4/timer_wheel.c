@@ -0,0 +1,166 @@
+#include <stdbool.h>
+
+#include "timer_wheel.h"
+
+/// The number of ticks of a slot at `level`
+static uint64_t timer_wheel_span(int level) {
+    return (uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * level);
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+        wheel->counts[l] = 0;
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+            wheel->slots[l][i] = NULL;
+    }
+    wheel->overflow_count = 0;
+    wheel->overflow = NULL;
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *timer) {
+    if (timer->expiry <= wheel->now)
+        timer->expiry = wheel->now + 1;
+    uint64_t delta = timer->expiry - wheel->now;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+        if (delta < timer_wheel_span(l + 1)) {
+            struct timer_node **slot =
+                &wheel->slots[l][(timer->expiry >> (TIMER_WHEEL_SLOT_BITS * l)) % TIMER_WHEEL_SLOTS];
+            timer->next = *slot;
+            *slot = timer;
+            ++wheel->counts[l];
+            return;
+        }
+    }
+    timer->next = wheel->overflow;
+    wheel->overflow = timer;
+    ++wheel->overflow_count;
+}
+
+/**
+ * Re-add the timers of a list, now that they are closer than when they were added, moving the ones
+ * expiring at the current tick to `expired`
+ */
+static void timer_wheel_readd(struct timer_wheel *wheel, struct timer_node *list,
+                              struct timer_node **expired) {
+    while (list) {
+        struct timer_node *next = list->next;
+        if (list->expiry <= wheel->now) {
+            list->next = *expired;
+            *expired = list;
+        } else {
+            timer_wheel_add(wheel, list);
+        }
+        list = next;
+    }
+}
+
+/// The number of the lowest levels which are empty, up to all of them
+static int timer_wheel_empty_levels(const struct timer_wheel *wheel) {
+    int l = 0;
+    while (l < TIMER_WHEEL_LEVELS && wheel->counts[l] == 0)
+        ++l;
+    return l;
+}
+
+struct timer_node *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now) {
+    struct timer_node *expired = NULL;
+    while (wheel->now < now) {
+        /*
+         * Nothing can expire before the next boundary of the lowest non-empty level: jump to
+         * right before it
+         */
+        int empty = timer_wheel_empty_levels(wheel);
+        if (empty == TIMER_WHEEL_LEVELS && wheel->overflow_count == 0) {
+            wheel->now = now;
+            break;
+        }
+        if (empty > 0) {
+            uint64_t span = timer_wheel_span(empty);
+            uint64_t before = (wheel->now | (span - 1));
+            if (before >= now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = before;
+        }
+
+        uint64_t tick = ++wheel->now;
+        /* Cascade from the top down, at the boundaries of the levels */
+        for (int l = TIMER_WHEEL_LEVELS; l > 0; --l) {
+            if (tick % timer_wheel_span(l) != 0)
+                continue;
+            struct timer_node *list;
+            if (l == TIMER_WHEEL_LEVELS) {
+                list = wheel->overflow;
+                wheel->overflow = NULL;
+                wheel->overflow_count = 0;
+            } else {
+                size_t index = (tick >> (TIMER_WHEEL_SLOT_BITS * l)) % TIMER_WHEEL_SLOTS;
+                list = wheel->slots[l][index];
+                wheel->slots[l][index] = NULL;
+                for (struct timer_node *it = list; it; it = it->next)
+                    --wheel->counts[l];
+            }
+            timer_wheel_readd(wheel, list, &expired);
+        }
+
+        struct timer_node **slot = &wheel->slots[0][tick % TIMER_WHEEL_SLOTS];
+        while (*slot) {
+            struct timer_node *timer = *slot;
+            *slot = timer->next;
+            --wheel->counts[0];
+            timer->next = expired;
+            expired = timer;
+        }
+    }
+    return expired;
+}
+
+/// Move the timers of `list` to `expired`
+static void timer_wheel_splice(struct timer_node *list, struct timer_node **expired) {
+    while (list) {
+        struct timer_node *next = list->next;
+        list->next = *expired;
+        *expired = list;
+        list = next;
+    }
+}
+
+struct timer_node *timer_wheel_flush(struct timer_wheel *wheel) {
+    struct timer_node *expired = NULL;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS && wheel->counts[l] > 0; ++i) {
+            for (struct timer_node *it = wheel->slots[l][i]; it; it = it->next)
+                --wheel->counts[l];
+            timer_wheel_splice(wheel->slots[l][i], &expired);
+            wheel->slots[l][i] = NULL;
+        }
+    }
+    timer_wheel_splice(wheel->overflow, &expired);
+    wheel->overflow = NULL;
+    wheel->overflow_count = 0;
+    return expired;
+}
+
+uint64_t timer_wheel_next(const struct timer_wheel *wheel) {
+    int empty = timer_wheel_empty_levels(wheel);
+    if (empty == TIMER_WHEEL_LEVELS && wheel->overflow_count == 0)
+        return UINT64_MAX;
+    if (empty == 0) {
+        for (uint64_t tick = wheel->now + 1; ; ++tick) {
+            if (wheel->slots[0][tick % TIMER_WHEEL_SLOTS])
+                return tick;
+        }
+    }
+    /* The next cascade into the lower levels */
+    return (wheel->now | (timer_wheel_span(empty) - 1)) + 1;
+}
+
+__attribute__((pure))
+size_t timer_wheel_size(const struct timer_wheel *wheel) {
+    size_t size = wheel->overflow_count;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l)
+        size += wheel->counts[l];
+    return size;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    /// Slots of a level of `struct timer_wheel`, a power of 2
+    TIMER_WHEEL_SLOT_BITS = 6,
+    TIMER_WHEEL_SLOTS = 1 << TIMER_WHEEL_SLOT_BITS,
+    /// Levels of `struct timer_wheel`, each `TIMER_WHEEL_SLOTS` times coarser than the previous
+    TIMER_WHEEL_LEVELS = 4,
+};
+
+/// A timer, embedded into whatever is to be done when it expires
+struct timer_node {
+    struct timer_node *next;
+    /// The tick to expire at
+    uint64_t expiry;
+};
+
+/**
+ * A hierarchical timer wheel (Varghese and Lauck, "Hashed and Hierarchical Timing Wheels"). The
+ * level `l` has the timers which expire in less than `TIMER_WHEEL_SLOTS^(l + 1)` ticks, in the
+ * slot of their expiry tick at its granularity. When the lower levels wrap around, the next slot
+ * of the higher one is cascaded down, so adding a timer and expiring it are O(1). The timers too
+ * far ahead for all the levels wait in `overflow` for the top level to wrap around.
+ *
+ * Not synchronized.
+ */
+struct timer_wheel {
+    /// The last tick advanced to: the timers expiring up to it are expired
+    uint64_t now;
+    /// The timers in each level, to skip the empty ones when advancing
+    size_t counts[TIMER_WHEEL_LEVELS];
+    size_t overflow_count;
+    struct timer_node *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct timer_node *overflow;
+};
+
+/// Initialize an empty wheel at the tick `now`
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/// Add `timer`, with its `expiry` set. One expiring before the next tick expires at it
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_node *timer);
+
+/**
+ * Advance to the tick `now`, returning the timers expired meanwhile, linked through `next`, in no
+ * particular order
+ */
+struct timer_node *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+/// Remove all the timers, returning them as `timer_wheel_advance` does
+struct timer_node *timer_wheel_flush(struct timer_wheel *wheel);
+
+/**
+ * A tick not later than the next expiry, to advance to then. `UINT64_MAX` if there are no timers.
+ * It may be earlier than the expiry when a timer is to be cascaded down first.
+ */
+uint64_t timer_wheel_next(const struct timer_wheel *wheel);
+
+/// The number of timers in the wheel
+size_t timer_wheel_size(const struct timer_wheel *wheel) __attribute__((pure));
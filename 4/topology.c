@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "topology.h"
+
+/// Parse a CPU list like `0-3,8`, as in `/sys`, from `path` into `set`
+static bool cpulist_read(const char *path, cpu_set_t *set) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+    CPU_ZERO(set);
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(file);
+        if (c == '-') {
+            if (fscanf(file, "%d", &last) != 1)
+                break;
+            c = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, set);
+        if (c != ',')
+            break;
+    }
+    fclose(file);
+    return true;
+}
+
+int topology_nodes(const int *cpus, int cpu_count, int node, struct topology_node *nodes, int max) {
+    cpu_set_t allowed;
+    if (cpus) {
+        CPU_ZERO(&allowed);
+        for (int i = 0; i < cpu_count; ++i) {
+            if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+                CPU_SET(cpus[i], &allowed);
+        }
+    } else if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+        return 0;
+    }
+
+    int count = 0;
+    bool has_numa = false;
+    for (int id = 0; id < TOPOLOGY_MAX_NODES && count < max; ++id) {
+        char path[64];
+        snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", id);
+        cpu_set_t set;
+        if (!cpulist_read(path, &set))
+            continue;
+        has_numa = true;
+        if (node != -1 && id != node)
+            continue;
+        CPU_AND(&set, &set, &allowed);
+        if (CPU_COUNT(&set) == 0)
+            continue;
+        nodes[count].id = id;
+        nodes[count].cpus = set;
+        ++count;
+    }
+
+    if (!has_numa && (node == -1 || node == 0) && max > 0 && CPU_COUNT(&allowed) != 0) {
+        nodes[0].id = 0;
+        nodes[0].cpus = allowed;
+        count = 1;
+    }
+    return count;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+
+enum {
+    /// The most NUMA nodes looked up
+    TOPOLOGY_MAX_NODES = 64,
+};
+
+/// The CPUs of a NUMA node which a pool may run on
+struct topology_node {
+    /// The node number, as in `/sys/devices/system/node/node<id>`
+    int id;
+    cpu_set_t cpus;
+};
+
+/**
+ * Group the CPUs by NUMA node: `cpu_count` of `cpus`, or all those the process may run on if
+ * `cpus` is NULL, and only those of `node` unless it is -1. Without the NUMA information in
+ * `/sys`, all the CPUs are of node 0.
+ *
+ * Stores at most `max` nodes with some of the CPUs into `nodes`, returns how many.
+ */
+int topology_nodes(const int *cpus, int cpu_count, int node, struct topology_node *nodes, int max);
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+
+#include "ws_deque.h"
+
+enum {
+    WD_ERR_NO_MEM = 1,
+    WD_INITIAL_CAPACITY = 64,
+};
+
+static struct ws_deque_buffer *ws_deque_buffer_new(int64_t capacity) {
+    struct ws_deque_buffer *buffer = malloc(sizeof (*buffer) + capacity * sizeof (void *));
+    if (buffer) {
+        buffer->capacity = capacity;
+        buffer->prev = NULL;
+    }
+    return buffer;
+}
+
+static inline void **ws_deque_cell(struct ws_deque_buffer *buffer, int64_t i) {
+    /* The capacity is a power of 2 */
+    return &buffer->data[i & (buffer->capacity - 1)];
+}
+
+// The only error that may be reported is OOM
+unsigned char ws_deque_init(struct ws_deque *deque) {
+    deque->top = deque->bottom = 0;
+    deque->buffer = ws_deque_buffer_new(WD_INITIAL_CAPACITY);
+    return deque->buffer ? 0 : WD_ERR_NO_MEM;
+}
+
+void ws_deque_destroy(struct ws_deque *deque) {
+    for (struct ws_deque_buffer *buffer = deque->buffer, *prev; buffer; buffer = prev) {
+        prev = buffer->prev;
+        free(buffer);
+    }
+}
+
+// The only error that may be reported is OOM
+unsigned char ws_deque_push(struct ws_deque *deque, void *val) {
+    return ws_deque_push_many(deque, &val, 1);
+}
+
+// The only error that may be reported is OOM
+unsigned char ws_deque_push_many(struct ws_deque *deque, void *const *vals, size_t count) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    struct ws_deque_buffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+    if (bottom - top + (int64_t)count > buffer->capacity) {
+        /* Grown once, to fit the whole batch */
+        int64_t capacity = buffer->capacity * 2;
+        while (bottom - top + (int64_t)count > capacity)
+            capacity *= 2;
+        struct ws_deque_buffer *bigger = ws_deque_buffer_new(capacity);
+        if (!bigger)
+            return WD_ERR_NO_MEM;
+        for (int64_t i = top; i < bottom; ++i)
+            *ws_deque_cell(bigger, i) = __atomic_load_n(ws_deque_cell(buffer, i), __ATOMIC_RELAXED);
+        bigger->prev = buffer;
+        /* Release: a thief seeing the new buffer sees its contents */
+        __atomic_store_n(&deque->buffer, bigger, __ATOMIC_RELEASE);
+        buffer = bigger;
+    }
+    for (size_t i = 0; i < count; ++i)
+        __atomic_store_n(ws_deque_cell(buffer, bottom + (int64_t)i), vals[i], __ATOMIC_RELAXED);
+    /* Release: a thief seeing the new bottom sees the values, and what they point to */
+    __atomic_store_n(&deque->bottom, bottom + (int64_t)count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+bool ws_deque_take(struct ws_deque *deque, void **val) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    struct ws_deque_buffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+    /*
+     * The bottom is claimed before the top is read, and a thief reads them in the other order:
+     * sequentially consistent, so that they can't both get the last element.
+     */
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    bool ok = true;
+    if (top <= bottom) {
+        void *res = __atomic_load_n(ws_deque_cell(buffer, bottom), __ATOMIC_RELAXED);
+        if (top == bottom) {
+            /* The last one: race the thieves for it */
+            ok = __atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        }
+        if (ok)
+            *val = res;
+    } else {
+        ok = false;
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return ok;
+}
+
+bool ws_deque_steal(struct ws_deque *deque, void **val) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if (top >= bottom)
+        return false;
+    struct ws_deque_buffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+    void *res = __atomic_load_n(ws_deque_cell(buffer, top), __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                __ATOMIC_RELAXED))
+        return false;
+    *val = res;
+    return true;
+}
+
+int64_t ws_deque_size(const struct ws_deque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    return bottom > top ? bottom - top : 0;
+}
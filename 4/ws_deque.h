@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A work-stealing deque of `void *` after Chase and Lev ("Dynamic Circular Work-Stealing
+ * Deque"), with the memory orders of Lê et al. The owner pushes and takes at the bottom, like a
+ * stack, and the other threads steal from the top. Only a take racing a steal for the last
+ * element needs a compare-and-swap.
+ *
+ * The buffer grows when full. An old buffer can still be read by a thief, so it is kept until the
+ * deque is destroyed: all of them together are at most the size of the last one.
+ */
+struct ws_deque_buffer {
+    int64_t capacity;
+    /// The buffer before this one, to be freed with the deque
+    struct ws_deque_buffer *prev;
+    void *data[];
+};
+
+struct ws_deque {
+    _Alignas(64) int64_t top;
+    _Alignas(64) int64_t bottom;
+    struct ws_deque_buffer *buffer;
+};
+
+// The only error this function may return is OOM
+unsigned char ws_deque_init(struct ws_deque *deque);
+
+void ws_deque_destroy(struct ws_deque *deque);
+
+/// By the owner only. The only error this function may return is OOM
+unsigned char ws_deque_push(struct ws_deque *deque, void *val);
+
+/**
+ * By the owner only: push `count` values, which become visible to the thieves at once. The buffer
+ * grows at most once. The only error this function may return is OOM, in which case none is pushed
+ */
+unsigned char ws_deque_push_many(struct ws_deque *deque, void *const *vals, size_t count);
+
+/// By the owner only, the last pushed one. Returns `false` if the deque is empty
+bool ws_deque_take(struct ws_deque *deque, void **val);
+
+/// By any thread, the first pushed one. Returns `false` if the deque is empty or another thread won
+bool ws_deque_steal(struct ws_deque *deque, void **val);
+
+/// The size at some moment during the call, as the deque can change meanwhile
+int64_t ws_deque_size(const struct ws_deque *deque);
@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Load generator and latency benchmark of the chat server.
+ *
+ * C clients connect to a server, by default one of its own run by
+ * chat_server_update() in a thread, and P of them publish R messages per
+ * second together, S bytes each, evenly spread in time whatever the server
+ * does. Each message starts with the time it is fed at, so each client
+ * that gets it knows how long the broadcast took, from the feed to the
+ * receiver's chat_client_peek_next(). The clients are split between T
+ * threads, each updating its own ones as a chat_client_group.
+ *
+ * What is published in the first W seconds is left out, for the
+ * connections to settle. Then for D seconds: the broadcast latency as
+ * percentiles, in us, the messages the server has received per second and
+ * the messages and bytes all the clients have got per second.
+ *
+ * Usage: ./bench [--connections C] [--publishers P] [--rate R] [--size S]
+ * [--seconds D] [--warmup W] [--threads T] [--server-threads N]
+ * [--uring] [--coro] [--binary] [--low-latency] [--compress]
+ * [--coalesce US] [--connect HOST:PORT] [--json FILE]. --coro is CHAT_SERVER_BACKEND_CORO,
+ * with the bench built by `make bench_coro`. --low-latency is of chat_socket_options_low_latency(), for
+ * the server and the clients. --compress is of chat_server_set_compression()
+ * with CHAT_SERVER_COMPRESS_MIN and of the binary clients asking for it.
+ * --coalesce is of chat_client_set_coalescing() of the clients, in us.
+ * The JSON file gets the same numbers, to compare between the
+ * commits.
+ */
+
+enum {
+	BENCH_CONNECTIONS_DEFAULT = 32,
+	BENCH_PUBLISHERS_DEFAULT = 4,
+	BENCH_RATE_DEFAULT = 1000,
+	BENCH_SIZE_DEFAULT = 64,
+	BENCH_SECONDS_DEFAULT = 5,
+	BENCH_WARMUP_DEFAULT = 1,
+	BENCH_THREADS_DEFAULT = 4,
+	BENCH_MAX_THREADS = 64,
+	/** Hex digits of the feed time a message starts with. */
+	BENCH_STAMP_LEN = 16,
+	/** Most latencies kept by one thread, the rest are only counted. */
+	BENCH_MAX_SAMPLES = 4 * 1024 * 1024,
+	/** Most milliseconds a thread sleeps waiting. */
+	BENCH_POLL_MS = 10,
+};
+
+struct bench_options {
+	int connections;
+	int publishers;
+	double rate;
+	int size;
+	double seconds;
+	double warmup;
+	int threads;
+	int server_threads;
+	bool is_uring;
+	bool is_coro;
+	bool is_binary;
+	bool is_low_latency;
+	bool is_compressed;
+	/** Seconds the clients hold their output for, see chat_client_set_coalescing(). */
+	double coalesce;
+	const char *addr;
+	const char *json_path;
+};
+
+static void
+bench_fail(const char *what, int err)
+{
+	printf("Error: %s failed with %d\n", what, err);
+	exit(-1);
+}
+
+/** The feed time a message starts with, in seconds. */
+static double
+bench_stamp_parse(const char *data)
+{
+	char stamp[BENCH_STAMP_LEN + 1];
+	memcpy(stamp, data, BENCH_STAMP_LEN);
+	stamp[BENCH_STAMP_LEN] = '\0';
+	return strtoull(stamp, NULL, 16) / 1e9;
+}
+
+/** The server of the benchmark, when it is not an external one. */
+struct bench_server {
+	struct chat_server *server;
+	pthread_t tid;
+	/** Atomic: set to stop the thread. */
+	bool is_stopped;
+	/**
+	 * Atomic: the window the messages are measured in, by their feed time
+	 * in ns, known once the clients are connected.
+	 */
+	uint64_t measure_start;
+	uint64_t measure_end;
+	/** Messages taken of the measured window. */
+	uint64_t measured;
+};
+
+static void *
+bench_server_f(void *arg)
+{
+	struct bench_server *bs = arg;
+	struct chat_message_view view;
+	while (!__atomic_load_n(&bs->is_stopped, __ATOMIC_ACQUIRE)) {
+		int rc = chat_server_update(bs->server, BENCH_POLL_MS / 1000.0);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			bench_fail("chat_server_update", rc);
+		double start = __atomic_load_n(&bs->measure_start, __ATOMIC_RELAXED) / 1e9;
+		double end = __atomic_load_n(&bs->measure_end, __ATOMIC_RELAXED) / 1e9;
+		while (chat_server_peek_next(bs->server, &view)) {
+			if (view.data_size >= BENCH_STAMP_LEN) {
+				double fed = bench_stamp_parse(view.data);
+				bs->measured += fed >= start && fed < end;
+			}
+			chat_server_consume(bs->server);
+		}
+	}
+	return NULL;
+}
+
+/** A thread of the clients: some of them, the first ones publishing. */
+struct bench_worker {
+	const struct bench_options *opts;
+	pthread_t tid;
+	struct chat_client **clients;
+	int count;
+	int publishers;
+	/** When each publisher feeds its next message. */
+	double *next_feed;
+	/** Seconds between two messages of a publisher. */
+	double interval;
+	double measure_start;
+	double measure_end;
+	/** Seconds of the broadcasts of the measured window. */
+	double *samples;
+	size_t sample_count;
+	uint64_t delivered;
+	uint64_t delivered_bytes;
+	char *msg;
+};
+
+/** Feed what the publishers are due by now, each message with its time. */
+static void
+bench_worker_publish(struct bench_worker *w, double now)
+{
+	const struct bench_options *opts = w->opts;
+	for (int i = 0; i < w->publishers; ++i) {
+		while (w->next_feed[i] <= now && now < w->measure_end) {
+			char stamp[BENCH_STAMP_LEN + 1];
+			uint64_t ns = (uint64_t)(bench_now() * 1e9);
+			sprintf(stamp, "%016llx", (unsigned long long)ns);
+			memcpy(w->msg, stamp, BENCH_STAMP_LEN);
+			int rc = chat_client_feed(w->clients[i], w->msg,
+						  opts->size + 1);
+			if (rc != 0)
+				bench_fail("chat_client_feed", rc);
+			w->next_feed[i] += w->interval;
+		}
+	}
+}
+
+/** Take all the messages the client has got, with their latencies. */
+static void
+bench_worker_receive(struct bench_worker *w, struct chat_client *c)
+{
+	struct chat_message_view view;
+	while (chat_client_peek_next(c, &view)) {
+		double now = bench_now();
+		if (view.data_size >= BENCH_STAMP_LEN) {
+			double fed = bench_stamp_parse(view.data);
+			if (fed >= w->measure_start && fed < w->measure_end) {
+				++w->delivered;
+				w->delivered_bytes += view.data_size;
+				if (w->sample_count < BENCH_MAX_SAMPLES)
+					w->samples[w->sample_count++] = now - fed;
+			}
+		}
+		chat_client_consume(c);
+	}
+}
+
+static void *
+bench_worker_f(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct chat_client_group *group = chat_client_group_new();
+	if (!group)
+		bench_fail("chat_client_group_new", -1);
+	for (int i = 0; i < w->count; ++i) {
+		int rc = chat_client_group_add(group, w->clients[i]);
+		if (rc != 0)
+			bench_fail("chat_client_group_add", rc);
+	}
+	/* A second after the window, for the last ones to come */
+	double end = w->measure_end + 1;
+	double now;
+	while ((now = bench_now()) < end) {
+		bench_worker_publish(w, now);
+		int timeout = BENCH_POLL_MS;
+		for (int i = 0; i < w->publishers; ++i) {
+			double wait = (w->next_feed[i] - now) * 1000;
+			if (w->next_feed[i] < w->measure_end && wait < timeout)
+				timeout = wait > 0 ? (int)wait : 0;
+		}
+		int rc = chat_client_group_update(group, timeout / 1000.0);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			bench_fail("chat_client_group_update", rc);
+		struct chat_client *c;
+		while ((c = chat_client_group_next_ready(group, &rc)) != NULL) {
+			if (rc != 0)
+				bench_fail("chat_client_group_update", rc);
+			bench_worker_receive(w, c);
+		}
+	}
+	chat_client_group_delete(group);
+	return NULL;
+}
+
+static int
+bench_parse_options(int argc, char **argv, struct bench_options *opts)
+{
+	opts->connections = BENCH_CONNECTIONS_DEFAULT;
+	opts->publishers = BENCH_PUBLISHERS_DEFAULT;
+	opts->rate = BENCH_RATE_DEFAULT;
+	opts->size = BENCH_SIZE_DEFAULT;
+	opts->seconds = BENCH_SECONDS_DEFAULT;
+	opts->warmup = BENCH_WARMUP_DEFAULT;
+	opts->threads = BENCH_THREADS_DEFAULT;
+	opts->server_threads = 0;
+	opts->is_uring = false;
+	opts->is_coro = false;
+	opts->is_binary = false;
+	opts->is_low_latency = false;
+	opts->is_compressed = false;
+	opts->coalesce = 0;
+	opts->addr = NULL;
+	opts->json_path = NULL;
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--uring") == 0) {
+			opts->is_uring = true;
+			--argc;
+			++argv;
+			continue;
+		}
+		if (strcmp(argv[1], "--coro") == 0) {
+			opts->is_coro = true;
+			--argc;
+			++argv;
+			continue;
+		}
+		if (strcmp(argv[1], "--binary") == 0) {
+			opts->is_binary = true;
+			--argc;
+			++argv;
+			continue;
+		}
+		if (strcmp(argv[1], "--low-latency") == 0) {
+			opts->is_low_latency = true;
+			--argc;
+			++argv;
+			continue;
+		}
+		if (strcmp(argv[1], "--compress") == 0) {
+			opts->is_compressed = true;
+			opts->is_binary = true;
+			--argc;
+			++argv;
+			continue;
+		}
+		if (argc < 3) {
+			printf("No value of %s\n", argv[1]);
+			return -1;
+		}
+		if (strcmp(argv[1], "--connections") == 0) {
+			opts->connections = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--publishers") == 0) {
+			opts->publishers = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--rate") == 0) {
+			opts->rate = strtod(argv[2], NULL);
+		} else if (strcmp(argv[1], "--size") == 0) {
+			opts->size = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--seconds") == 0) {
+			opts->seconds = strtod(argv[2], NULL);
+		} else if (strcmp(argv[1], "--warmup") == 0) {
+			opts->warmup = strtod(argv[2], NULL);
+		} else if (strcmp(argv[1], "--threads") == 0) {
+			opts->threads = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--server-threads") == 0) {
+			opts->server_threads = strtol(argv[2], NULL, 10);
+		} else if (strcmp(argv[1], "--coalesce") == 0) {
+			opts->coalesce = strtod(argv[2], NULL) / 1e6;
+		} else if (strcmp(argv[1], "--connect") == 0) {
+			opts->addr = argv[2];
+		} else if (strcmp(argv[1], "--json") == 0) {
+			opts->json_path = argv[2];
+		} else {
+			printf("Unknown option %s\n", argv[1]);
+			return -1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (opts->connections < 2) {
+		printf("At least 2 connections are needed\n");
+		return -1;
+	}
+	if (opts->publishers < 1 || opts->publishers > opts->connections) {
+		printf("The publishers must be in [1, %d]\n", opts->connections);
+		return -1;
+	}
+	if (opts->rate <= 0 || opts->seconds <= 0 || opts->warmup < 0) {
+		printf("The rate and the seconds must be positive\n");
+		return -1;
+	}
+	if (opts->size < BENCH_STAMP_LEN) {
+		printf("The size must be at least %d\n", BENCH_STAMP_LEN);
+		return -1;
+	}
+	if (opts->threads < 1 || opts->threads > BENCH_MAX_THREADS) {
+		printf("The threads must be in [1, %d]\n", BENCH_MAX_THREADS);
+		return -1;
+	}
+	if (opts->threads > opts->connections)
+		opts->threads = opts->connections;
+	return 0;
+}
+
+/** Start the server of the benchmark, return the address of it. */
+static const char *
+bench_server_start(const struct bench_options *opts, struct bench_server *bs)
+{
+	bs->server = chat_server_new();
+	if (opts->server_threads > 0 &&
+			chat_server_set_threads(bs->server, opts->server_threads) != 0)
+		bench_fail("chat_server_set_threads", -1);
+	if (opts->is_uring &&
+			chat_server_set_backend(bs->server, CHAT_SERVER_BACKEND_URING) != 0)
+		bench_fail("chat_server_set_backend", -1);
+	if (opts->is_coro &&
+			chat_server_set_backend(bs->server, CHAT_SERVER_BACKEND_CORO) != 0)
+		bench_fail("chat_server_set_backend", -1);
+	struct chat_socket_options sock_opts;
+	if (opts->is_low_latency) {
+		chat_socket_options_low_latency(&sock_opts);
+		if (chat_server_set_socket_options(bs->server, &sock_opts) != 0)
+			bench_fail("chat_server_set_socket_options", -1);
+	}
+	if (opts->is_compressed &&
+			chat_server_set_compression(bs->server, CHAT_SERVER_COMPRESS_MIN) != 0)
+		bench_fail("chat_server_set_compression", -1);
+	int rc = chat_server_listen(bs->server, 0);
+	if (rc != 0)
+		bench_fail("chat_server_listen", rc);
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(chat_server_get_socket(bs->server),
+			(struct sockaddr *)&addr, &len) != 0)
+		bench_fail("getsockname", -1);
+	static char host[64];
+	sprintf(host, "localhost:%u", ntohs(addr.sin_port));
+	bs->is_stopped = false;
+	bs->measure_start = bs->measure_end = UINT64_MAX;
+	bs->measured = 0;
+	if (pthread_create(&bs->tid, NULL, bench_server_f, bs) != 0)
+		bench_fail("pthread_create", -1);
+	return host;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_options opts;
+	if (bench_parse_options(argc, argv, &opts) != 0)
+		return -1;
+
+	struct bench_server bs;
+	const char *addr = opts.addr;
+	if (addr == NULL)
+		addr = bench_server_start(&opts, &bs);
+
+	struct chat_client **clients = calloc(opts.connections, sizeof(*clients));
+	if (!clients)
+		abort();
+	struct chat_socket_options sock_opts;
+	chat_socket_options_init(&sock_opts);
+	if (opts.is_low_latency)
+		chat_socket_options_low_latency(&sock_opts);
+	for (int i = 0; i < opts.connections; ++i) {
+		char name[32];
+		sprintf(name, "bench_%d", i);
+		clients[i] = chat_client_new(name);
+		if (opts.is_binary &&
+				chat_client_set_protocol(clients[i], CHAT_PROTO_BINARY) != 0)
+			bench_fail("chat_client_set_protocol", -1);
+		if (opts.is_compressed && chat_client_set_compression(clients[i], true) != 0)
+			bench_fail("chat_client_set_compression", -1);
+		if (chat_client_set_socket_options(clients[i], &sock_opts) != 0)
+			bench_fail("chat_client_set_socket_options", -1);
+		if (chat_client_set_coalescing(clients[i], opts.coalesce, 0) != 0)
+			bench_fail("chat_client_set_coalescing", -1);
+		int rc = chat_client_connect(clients[i], addr);
+		if (rc != 0)
+			bench_fail("chat_client_connect", rc);
+	}
+
+	/*
+	 * The publishers are spread between the threads as evenly as the
+	 * clients are, and each one feeds at the same rate.
+	 */
+	struct bench_worker workers[BENCH_MAX_THREADS];
+	double start = bench_now();
+	double measure_start = start + opts.warmup;
+	double measure_end = measure_start + opts.seconds;
+	double interval = opts.publishers / opts.rate;
+	int next_client = 0, next_publisher = 0;
+	for (int t = 0; t < opts.threads; ++t) {
+		struct bench_worker *w = &workers[t];
+		w->opts = &opts;
+		w->count = opts.connections / opts.threads +
+			(t < opts.connections % opts.threads);
+		w->publishers = opts.publishers / opts.threads +
+			(t < opts.publishers % opts.threads);
+		if (w->publishers > w->count)
+			w->publishers = w->count;
+		w->clients = clients + next_client;
+		next_client += w->count;
+		w->interval = interval;
+		w->next_feed = calloc(w->publishers + 1, sizeof(*w->next_feed));
+		if (!w->next_feed)
+			abort();
+		/* The publishers take turns, not all at once */
+		for (int i = 0; i < w->publishers; ++i)
+			w->next_feed[i] = start + interval * (next_publisher++) /
+					  opts.publishers;
+		w->measure_start = measure_start;
+		w->measure_end = measure_end;
+		w->samples = malloc(sizeof(*w->samples) * BENCH_MAX_SAMPLES);
+		if (!w->samples)
+			abort();
+		w->sample_count = 0;
+		w->delivered = 0;
+		w->delivered_bytes = 0;
+		w->msg = malloc(opts.size + 1);
+		if (!w->msg)
+			abort();
+		memset(w->msg, 'x', opts.size);
+		w->msg[opts.size] = '\n';
+	}
+	if (opts.addr == NULL) {
+		__atomic_store_n(&bs.measure_start, (uint64_t)(measure_start * 1e9),
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&bs.measure_end, (uint64_t)(measure_end * 1e9),
+				 __ATOMIC_RELAXED);
+	}
+	for (int t = 0; t < opts.threads; ++t) {
+		if (pthread_create(&workers[t].tid, NULL, bench_worker_f,
+				   &workers[t]) != 0)
+			bench_fail("pthread_create", -1);
+	}
+
+	size_t sample_count = 0;
+	uint64_t delivered = 0, delivered_bytes = 0;
+	for (int t = 0; t < opts.threads; ++t) {
+		pthread_join(workers[t].tid, NULL);
+		sample_count += workers[t].sample_count;
+		delivered += workers[t].delivered;
+		delivered_bytes += workers[t].delivered_bytes;
+	}
+	double *samples = malloc(sizeof(*samples) * (sample_count + 1));
+	if (!samples)
+		abort();
+	size_t pos = 0;
+	for (int t = 0; t < opts.threads; ++t) {
+		struct bench_worker *w = &workers[t];
+		memcpy(samples + pos, w->samples, sizeof(*samples) * w->sample_count);
+		pos += w->sample_count;
+		free(w->samples);
+		free(w->next_feed);
+		free(w->msg);
+	}
+	qsort(samples, sample_count, sizeof(*samples), bench_double_cmp);
+
+	for (int i = 0; i < opts.connections; ++i)
+		chat_client_delete(clients[i]);
+	free(clients);
+	uint64_t server_measured = 0;
+	if (opts.addr == NULL) {
+		__atomic_store_n(&bs.is_stopped, true, __ATOMIC_RELEASE);
+		pthread_join(bs.tid, NULL);
+		server_measured = bs.measured;
+		chat_server_delete(bs.server);
+	}
+
+	double p50 = 0, p99 = 0, p999 = 0, max = 0;
+	if (sample_count > 0) {
+		p50 = bench_percentile(samples, sample_count, 0.5) * 1e6;
+		p99 = bench_percentile(samples, sample_count, 0.99) * 1e6;
+		p999 = bench_percentile(samples, sample_count, 0.999) * 1e6;
+		max = samples[sample_count - 1] * 1e6;
+	}
+	free(samples);
+	double expected = opts.rate * opts.seconds * (opts.connections - 1);
+	printf("Chat of %d connections, %d publishers, %.0f msg/s of %d bytes, "
+	       "%d threads, %.1f s%s%s:\n", opts.connections, opts.publishers,
+	       opts.rate, opts.size, opts.threads, opts.seconds,
+	       opts.is_low_latency ? ", low latency" : "",
+	       opts.is_compressed ? ", compressed" : "");
+	printf("broadcast latency, us: p50 %.0f, p99 %.0f, p99.9 %.0f, max %.0f\n",
+	       p50, p99, p999, max);
+	if (opts.addr == NULL)
+		printf("server received: %12.0f msg/s\n",
+		       server_measured / opts.seconds);
+	printf("clients got:     %12.0f msg/s, %.1f MB/s, %.2f%% of expected\n",
+	       delivered / opts.seconds, delivered_bytes / opts.seconds / 1e6,
+	       100.0 * delivered / expected);
+
+	if (opts.json_path == NULL)
+		return 0;
+	FILE *json = fopen(opts.json_path, "w");
+	if (json == NULL) {
+		perror("fopen of the JSON file");
+		return -1;
+	}
+	fprintf(json, "{\"connections\": %d, \"publishers\": %d, \"rate\": %.0f, "
+		"\"size\": %d, \"threads\": %d, \"seconds\": %.1f, "
+		"\"low_latency\": %s, \"compress\": %s,\n", opts.connections,
+		opts.publishers, opts.rate, opts.size, opts.threads, opts.seconds,
+		opts.is_low_latency ? "true" : "false",
+		opts.is_compressed ? "true" : "false");
+	fprintf(json, " \"latency_us\": {\"p50\": %.0f, \"p99\": %.0f, "
+		"\"p999\": %.0f, \"max\": %.0f},\n", p50, p99, p999, max);
+	if (opts.addr == NULL)
+		fprintf(json, " \"server_msgs_per_s\": %.0f,\n",
+			server_measured / opts.seconds);
+	fprintf(json, " \"delivered_msgs_per_s\": %.0f, "
+		"\"delivered_bytes_per_s\": %.0f, \"delivered_share\": %.4f}\n",
+		delivered / opts.seconds, delivered_bytes / opts.seconds,
+		delivered / expected);
+	fclose(json);
+	return 0;
+}
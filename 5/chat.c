@@ -1,7 +1,41 @@
 #include "chat.h"
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+/** Copy @a size bytes of @a src, 0-terminated. */
+static char *
+chat_memdup(const char *src, size_t size)
+{
+	char *res = malloc(size + 1);
+	if (!res)
+		abort();
+	memcpy(res, src, size);
+	res[size] = '\0';
+	return res;
+}
+
+struct chat_message *
+chat_message_new(const char *author, size_t author_size, const char *data,
+		 size_t data_size)
+{
+	struct chat_message *msg = malloc(sizeof(*msg));
+	if (!msg)
+		abort();
+#if NEED_AUTHOR
+	msg->author = chat_memdup(author, author_size);
+#else
+	(void)author;
+	(void)author_size;
+#endif
+	msg->data = chat_memdup(data, data_size);
+	msg->data_size = data_size;
+	return msg;
+}
 
 void
 chat_message_delete(struct chat_message *msg)
@@ -23,3 +57,54 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+void
+chat_socket_options_init(struct chat_socket_options *opts)
+{
+	opts->backlog = CHAT_LISTEN_BACKLOG;
+	opts->no_delay = false;
+	opts->quick_ack = false;
+	opts->send_buffer = 0;
+	opts->recv_buffer = 0;
+	opts->busy_poll_us = 0;
+	opts->prefer_busy_poll = false;
+	opts->defer_accept_s = 0;
+}
+
+void
+chat_socket_options_low_latency(struct chat_socket_options *opts)
+{
+	chat_socket_options_init(opts);
+	opts->no_delay = true;
+	opts->quick_ack = true;
+	opts->busy_poll_us = 50;
+}
+
+int
+chat_socket_options_check(const struct chat_socket_options *opts)
+{
+	if (opts->backlog <= 0 || opts->send_buffer < 0 || opts->recv_buffer < 0 ||
+	    opts->busy_poll_us < 0 || opts->defer_accept_s < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	return 0;
+}
+
+void
+chat_socket_options_apply(const struct chat_socket_options *opts, int fd)
+{
+	/* If any fails, ok */
+	if (opts->no_delay)
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+	if (opts->quick_ack)
+		(void)setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &(int){1}, sizeof(int));
+	if (opts->send_buffer > 0)
+		(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opts->send_buffer, sizeof(int));
+	if (opts->recv_buffer > 0)
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->recv_buffer, sizeof(int));
+	if (opts->busy_poll_us > 0)
+		(void)setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &opts->busy_poll_us, sizeof(int));
+#ifdef SO_PREFER_BUSY_POLL
+	if (opts->prefer_busy_poll)
+		(void)setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){1}, sizeof(int));
+#endif
+}
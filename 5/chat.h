@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #define NEED_AUTHOR 1
 #define NEED_SERVER_FEED 1
 
@@ -19,6 +22,28 @@ enum chat_events {
 	CHAT_EVENT_OUTPUT = 2,
 };
 
+enum chat_proto {
+	/** Lines: the author, then the message. The default. */
+	CHAT_PROTO_TEXT,
+	/**
+	 * Length-prefixed frames, with each author's name sent once and then
+	 * referred to by an id. Negotiated on connect, see chat_frame.h.
+	 */
+	CHAT_PROTO_BINARY,
+};
+
+/**
+ * Room commands, which a client sends as messages and the server doesn't
+ * broadcast. A peer is in one room at a time, the lobby at first, and what
+ * it sends goes to the peers in the same room. The server's feed goes to
+ * all the rooms. The server answers a command with a message of its own:
+ * CHAT_NOTE_JOINED and the room, or CHAT_NOTE_LOBBY.
+ */
+#define CHAT_CMD_JOIN "/join "
+#define CHAT_CMD_LEAVE "/leave"
+#define CHAT_NOTE_JOINED "joined "
+#define CHAT_NOTE_LOBBY "in the lobby"
+
 struct chat_message {
 #if NEED_AUTHOR
 	/** Author's name. */
@@ -26,10 +51,36 @@ struct chat_message {
 #endif
 	/** 0-terminate text. */
 	char *data;
+	/**
+	 * Size of data without the terminating 0. Counts the 0s a message of
+	 * a binary client may have, see chat_client_set_protocol().
+	 */
+	size_t data_size;
 
 	/* PUT HERE OTHER MEMBERS */
 };
 
+/**
+ * A message looked at right in the receive buffer, with no copies, see
+ * chat_client_peek_next() and chat_server_peek_next(). Not 0-terminated.
+ */
+struct chat_message_view {
+#if NEED_AUTHOR
+	const char *author;
+	size_t author_size;
+#endif
+	const char *data;
+	size_t data_size;
+};
+
+/**
+ * Create a message of copies of @a author and @a data, either of which may
+ * have '\0's in it. Without NEED_AUTHOR the author is ignored.
+ */
+struct chat_message *
+chat_message_new(const char *author, size_t author_size, const char *data,
+		 size_t data_size);
+
 /** Free message's memory. */
 void
 chat_message_delete(struct chat_message *msg);
@@ -37,3 +88,69 @@ chat_message_delete(struct chat_message *msg);
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+enum {
+	/** The listen() backlog of the server by default. */
+	CHAT_LISTEN_BACKLOG = 100,
+};
+
+/**
+ * Options of the TCP sockets, see chat_server_set_socket_options() and
+ * chat_client_set_socket_options(). Apart from the backlog they are hints:
+ * what the system doesn't allow, like SO_BUSY_POLL above its limit without
+ * CAP_NET_ADMIN, stays as it was.
+ */
+struct chat_socket_options {
+	/** Of listen(), the server only. */
+	int backlog;
+	/** TCP_NODELAY: the small writes are sent right away, without Nagle. */
+	bool no_delay;
+	/**
+	 * TCP_QUICKACK: no delayed acknowledgements, set on connecting and
+	 * accepting. The kernel may go back to delaying them on its own.
+	 */
+	bool quick_ack;
+	/** SO_SNDBUF and SO_RCVBUF, in bytes, 0 to keep the system's. */
+	int send_buffer;
+	int recv_buffer;
+	/** SO_BUSY_POLL: microseconds to poll the device on a read, 0 for none. */
+	int busy_poll_us;
+	/**
+	 * SO_PREFER_BUSY_POLL: with busy_poll_us, the device's interrupts are
+	 * held off while the application keeps polling it.
+	 */
+	bool prefer_busy_poll;
+	/**
+	 * TCP_DEFER_ACCEPT, the server only: seconds a connection may wait for
+	 * its first bytes before it is accepted, 0 to accept it right away.
+	 */
+	int defer_accept_s;
+};
+
+/** The options as they are without setting any: the system's. */
+void
+chat_socket_options_init(struct chat_socket_options *opts);
+
+/**
+ * For the small messages to go right away: TCP_NODELAY, TCP_QUICKACK and a
+ * short SO_BUSY_POLL.
+ */
+void
+chat_socket_options_low_latency(struct chat_socket_options *opts);
+
+/**
+ * Check the options, see chat_server_set_socket_options().
+ *
+ * @retval 0 Valid.
+ * @retval CHAT_ERR_INVALID_ARGUMENT - the backlog is not positive or a
+ *     size or time is negative.
+ */
+int
+chat_socket_options_check(const struct chat_socket_options *opts);
+
+/**
+ * Set the options but the backlog and TCP_DEFER_ACCEPT on the socket. Only
+ * the ones that aren't as by default, which costs nothing then.
+ */
+void
+chat_socket_options_apply(const struct chat_socket_options *opts, int fd);
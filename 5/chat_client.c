@@ -1,45 +1,470 @@
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_frame.h"
+#include "lz.h"
 #include "partial_message_queue.h"
+#include "shm_ring.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+enum {
+	/// Most connects to different addresses in flight at once
+	CHAT_CLIENT_MAX_ATTEMPTS = 4,
+	/// Of the resolved hosts kept, see chat_client_resolve()
+	CHAT_DNS_CACHE_SIZE = 64,
+	/// Bytes of each ring of a local client, see chat_client_connect_local()
+	CHAT_CLIENT_SHM_SIZE = 256 * 1024,
+};
+
+/// Seconds after which the next address is tried alongside, as in RFC 8305
+static const double CHAT_CLIENT_ATTEMPT_DELAY = 0.25;
+/// Seconds a resolved host is kept
+static const double CHAT_DNS_TTL = 60;
+
+struct chat_addr {
+	struct sockaddr_storage addr;
+	socklen_t len;
+};
 
 struct chat_client {
 	/** Socket connected to the server */
 	int socket;
 	/** Incoming messages queue */
 	struct partial_message_queue incoming;
+	/// How much to receive at once, see pmq_recv()
+	size_t recv_hint;
 	/** Outgoing messages queue */
 	struct partial_message_queue outgoing;
 
 #if NEED_AUTHOR
 	char *name;
+	/// Text protocol: the size of the author line found, with the '\n', or 0
+	size_t author_line;
 #endif
+	/// Text protocol: no '\n' is to be found in `incoming` before this offset
+	size_t text_scan;
+	/// Size of what chat_client_consume() takes, 0 if nothing is peeked
+	size_t peeked_size;
+
+	enum chat_proto proto;
+	/// Binary protocol only: what is fed, until whole lines are framed
+	struct partial_message_queue unframed;
+	/// Binary protocol only: whether the server has agreed to it. Until
+	/// then it sends the text one.
+	bool is_acked;
+	/// Binary protocol only: the names the server sent, by author id
+	char **authors;
+	size_t author_count;
+	/// Binary protocol only: the number of the last message taken, see
+	/// chat_client_resume(), and the one of the message peeked, or 0
+	uint64_t last_seq;
+	uint64_t pending_seq;
+	bool is_resuming;
+	/// Binary protocol only: whether to ask for CHAT_FRAME_PACKED, and
+	/// where the one peeked is decompressed to
+	bool is_packing;
+	char *unpacked;
+	size_t unpacked_capacity;
+	struct chat_socket_options socket_options;
+	/// See chat_client_set_coalescing(): how long and how much the output
+	/// is held, 0 for not at all, and when what is held now is due
+	double coalesce_delay;
+	size_t coalesce_size;
+	double coalesce_until;
+	/// Whether all that is queued goes now, see chat_client_flush()
+	bool is_flushing;
+
+	/**
+	 * While connecting, see chat_client_connect(): the addresses to try,
+	 * `next_addr` is the next one, and the attempts in flight but the one
+	 * on `socket`. When `socket` fails, another takes its descriptor.
+	 */
+	bool is_connecting;
+	struct chat_addr *addrs;
+	size_t addr_count;
+	size_t next_addr;
+	int attempts[CHAT_CLIENT_MAX_ATTEMPTS];
+	size_t attempt_count;
+	/// When the next address is tried if none has answered yet
+	double next_attempt_at;
+
+	/// Local only, see chat_client_connect_local(), NULL over TCP: the
+	/// channel, and the epoll of it and the socket, the descriptor then
+	struct shm_channel *shm;
+	int local_epoll_fd;
+
+	/// The group the client is in, see chat_client_group_add(), or NULL,
+	/// and its place in the group's clients
+	struct chat_client_group *group;
+	size_t group_pos;
+	/// In the group's lists of the clients fed and of the ones to report
+	bool is_dirty;
+	bool is_ready;
+	/// What the group has failed updating the client with, and the errno
+	int group_error;
+	int group_errno;
 };
 
+static double chat_client_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct chat_dns_entry {
+	char *host;
+	char *port;
+	struct chat_addr *addrs;
+	size_t count;
+	double expires_at;
+};
+
+/**
+ * The hosts resolved lately, shared by all the clients of the process: the
+ * bots connecting by the thousand to one host resolve it once. Freed with
+ * the last client.
+ */
+static struct {
+	pthread_mutex_t lock;
+	struct chat_dns_entry entries[CHAT_DNS_CACHE_SIZE];
+	size_t count;
+	/// The entry replaced next when full
+	size_t next_evicted;
+	/// The clients there are, which may use it
+	size_t client_count;
+} chat_dns_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void chat_dns_entry_free(struct chat_dns_entry *e) {
+	free(e->host);
+	free(e->port);
+	free(e->addrs);
+}
+
+static void chat_dns_cache_ref(void) {
+	pthread_mutex_lock(&chat_dns_cache.lock);
+	++chat_dns_cache.client_count;
+	pthread_mutex_unlock(&chat_dns_cache.lock);
+}
+
+/// Frees the entries when the last client is gone.
+static void chat_dns_cache_unref(void) {
+	pthread_mutex_lock(&chat_dns_cache.lock);
+	if (--chat_dns_cache.client_count == 0) {
+		for (size_t i = 0; i < chat_dns_cache.count; ++i)
+			chat_dns_entry_free(&chat_dns_cache.entries[i]);
+		chat_dns_cache.count = 0;
+		chat_dns_cache.next_evicted = 0;
+	}
+	pthread_mutex_unlock(&chat_dns_cache.lock);
+}
+
+/// Copies the addresses of `count` of `cached` to a new array in `*addrs`.
+static void chat_addrs_copy(const struct chat_addr *cached, size_t count, struct chat_addr **addrs) {
+	*addrs = malloc(sizeof(**addrs) * count);
+	if (!*addrs)
+		abort();
+	memcpy(*addrs, cached, sizeof(**addrs) * count);
+}
+
+/**
+ * The addresses of the stream sockets of the result, with the families
+ * taking turns from the first one's, the order RFC 8305 tries them in.
+ */
+static size_t chat_addrs_interleave(const struct addrinfo *result, struct chat_addr **addrs) {
+	size_t count = 0;
+	for (const struct addrinfo *ai = result; ai; ai = ai->ai_next)
+		++count;
+	*addrs = malloc(sizeof(**addrs) * (count ? count : 1));
+	if (!*addrs)
+		abort();
+	const struct addrinfo *next[2] = {result, result};
+	int family = result ? result->ai_family : AF_UNSPEC;
+	size_t pos = 0;
+	for (int turn = 0; pos < count; turn ^= 1) {
+		/* Turn 0 is of the first family, 1 of the others */
+		const struct addrinfo *ai = next[turn];
+		while (ai && (ai->ai_family == family) != (turn == 0))
+			ai = ai->ai_next;
+		if (ai) {
+			memcpy(&(*addrs)[pos].addr, ai->ai_addr, ai->ai_addrlen);
+			(*addrs)[pos++].len = ai->ai_addrlen;
+			ai = ai->ai_next;
+		}
+		next[turn] = ai;
+	}
+	return count;
+}
+
+/**
+ * Resolves `host`, by the cache unless it is a numeric address. Only a miss
+ * waits for getaddrinfo(), outside the lock.
+ */
+static int chat_client_resolve(const char *host, const char *port, struct chat_addr **addrs, size_t *count) {
+	struct addrinfo *result;
+	/* IPv4 only, as the server listens */
+	struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM,
+				 .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV};
+	if (getaddrinfo(host, port, &hints, &result) == 0) {
+		*count = chat_addrs_interleave(result, addrs);
+		freeaddrinfo(result);
+		return 0;
+	}
+
+	double now = chat_client_now();
+	pthread_mutex_lock(&chat_dns_cache.lock);
+	for (size_t i = 0; i < chat_dns_cache.count; ++i) {
+		struct chat_dns_entry *e = &chat_dns_cache.entries[i];
+		if (e->expires_at > now && strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0) {
+			chat_addrs_copy(e->addrs, e->count, addrs);
+			*count = e->count;
+			pthread_mutex_unlock(&chat_dns_cache.lock);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&chat_dns_cache.lock);
+
+	hints.ai_flags = 0;
+	if (getaddrinfo(host, port, &hints, &result) != 0)
+		return CHAT_ERR_NO_ADDR;
+	*count = chat_addrs_interleave(result, addrs);
+	freeaddrinfo(result);
+	if (*count == 0) {
+		free(*addrs);
+		return CHAT_ERR_NO_ADDR;
+	}
+
+	/* The same host expired, or resolved by another client meanwhile, is replaced */
+	pthread_mutex_lock(&chat_dns_cache.lock);
+	struct chat_dns_entry *e = NULL;
+	for (size_t i = 0; i < chat_dns_cache.count && !e; ++i) {
+		struct chat_dns_entry *old = &chat_dns_cache.entries[i];
+		if (strcmp(old->host, host) == 0 && strcmp(old->port, port) == 0)
+			e = old;
+	}
+	if (e) {
+		free(e->addrs);
+	} else {
+		if (chat_dns_cache.count < CHAT_DNS_CACHE_SIZE) {
+			e = &chat_dns_cache.entries[chat_dns_cache.count++];
+		} else {
+			e = &chat_dns_cache.entries[chat_dns_cache.next_evicted];
+			chat_dns_cache.next_evicted = (chat_dns_cache.next_evicted + 1) %
+						      CHAT_DNS_CACHE_SIZE;
+			chat_dns_entry_free(e);
+		}
+		e->host = strdup(host);
+		e->port = strdup(port);
+		if (!e->host || !e->port)
+			abort();
+	}
+	chat_addrs_copy(*addrs, *count, &e->addrs);
+	e->count = *count;
+	e->expires_at = now + CHAT_DNS_TTL;
+	pthread_mutex_unlock(&chat_dns_cache.lock);
+	return 0;
+}
+
+/**
+ * Starts a non-blocking connect to the next address. Returns its socket, or
+ * -1 with errno if it has failed right away. Sets `is_connected` if it is
+ * done already, as it may be to the same host.
+ */
+static int chat_client_start_attempt(struct chat_client *client, bool *is_connected) {
+	const struct chat_addr *a = &client->addrs[client->next_addr++];
+	*is_connected = false;
+	int fd = socket(a->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	/* Before connect(), for the buffers to count in the window scale */
+	chat_socket_options_apply(&client->socket_options, fd);
+	if (connect(fd, (const struct sockaddr *)&a->addr, a->len) == 0) {
+		*is_connected = true;
+		return fd;
+	}
+	if (errno == EINPROGRESS)
+		return fd;
+	int save_errno = errno;
+	(void)close(fd);
+	errno = save_errno;
+	return -1;
+}
+
+/// Drops the other attempts and the addresses, `socket` is the connection.
+static void chat_client_stop_connecting(struct chat_client *client) {
+	for (size_t i = 0; i < client->attempt_count; ++i)
+		(void)close(client->attempts[i]);
+	client->attempt_count = 0;
+	free(client->addrs);
+	client->addrs = NULL;
+	client->addr_count = 0;
+	client->is_connecting = false;
+}
+
+/// Moves the attempt `i` to the client's descriptor, whose one is over.
+static int chat_client_take_attempt(struct chat_client *client, size_t i) {
+	int fd = client->attempts[i];
+	client->attempts[i] = client->attempts[--client->attempt_count];
+	int rc = dup2(fd, client->socket) < 0 ? -1 : 0;
+	(void)close(fd);
+	return rc;
+}
+
+/// Whether the connect on `fd` is over, and how, in `err`.
+static bool chat_client_check_attempt(int fd, short revents, int *err) {
+	if (revents == 0)
+		return false;
+	socklen_t len = sizeof(*err);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, err, &len) != 0)
+		*err = errno;
+	return true;
+}
+
+/// Gives up on the connection, with `err` of the last attempt in errno.
+static int chat_client_fail_connect(struct chat_client *client, int err) {
+	chat_client_stop_connecting(client);
+	(void)close(client->socket);
+	client->socket = -1;
+	errno = err;
+	return CHAT_ERR_SYS;
+}
+
+/**
+ * Waits up to `timeout` for any of the attempts to connect, trying the
+ * next address each CHAT_CLIENT_ATTEMPT_DELAY or as soon as one fails.
+ * The first one to connect stays and takes the client's descriptor, the
+ * others are closed.
+ */
+static int chat_client_update_connect(struct chat_client *client, double timeout) {
+	double deadline = chat_client_now() + timeout;
+	for (;;) {
+		struct pollfd fds[CHAT_CLIENT_MAX_ATTEMPTS + 1];
+		fds[0] = (struct pollfd){.fd = client->socket, .events = POLLOUT};
+		for (size_t i = 0; i < client->attempt_count; ++i)
+			fds[i + 1] = (struct pollfd){.fd = client->attempts[i], .events = POLLOUT};
+		double now = chat_client_now();
+		bool has_more = client->next_addr < client->addr_count &&
+			client->attempt_count + 1 < CHAT_CLIENT_MAX_ATTEMPTS;
+		double until = has_more && client->next_attempt_at < deadline ?
+			client->next_attempt_at : deadline;
+		int wait_ms = until > now ? (int)((until - now) * 1000 + 0.999) : 0;
+		if (poll(fds, client->attempt_count + 1, wait_ms) < 0)
+			return CHAT_ERR_SYS;
+
+		int err = 0;
+		if (chat_client_check_attempt(client->socket, fds[0].revents, &err) && err == 0) {
+			chat_client_stop_connecting(client);
+			return 0;
+		}
+		bool is_socket_failed = err != 0;
+		/* Backwards, as a failed one takes the place of the last one */
+		for (size_t i = client->attempt_count; i-- > 0;) {
+			int attempt_err;
+			if (!chat_client_check_attempt(client->attempts[i], fds[i + 1].revents, &attempt_err))
+				continue;
+			if (attempt_err == 0) {
+				if (chat_client_take_attempt(client, i) != 0)
+					return CHAT_ERR_SYS;
+				chat_client_stop_connecting(client);
+				return 0;
+			}
+			err = attempt_err;
+			(void)close(client->attempts[i]);
+			client->attempts[i] = client->attempts[--client->attempt_count];
+		}
+		if (is_socket_failed && client->attempt_count > 0) {
+			if (chat_client_take_attempt(client, 0) != 0)
+				return CHAT_ERR_SYS;
+			is_socket_failed = false;
+		}
+
+		now = chat_client_now();
+		if ((is_socket_failed || now >= client->next_attempt_at) &&
+				client->next_addr < client->addr_count &&
+				client->attempt_count + 1 < CHAT_CLIENT_MAX_ATTEMPTS) {
+			bool is_connected;
+			int fd = chat_client_start_attempt(client, &is_connected);
+			client->next_attempt_at = now + CHAT_CLIENT_ATTEMPT_DELAY;
+			if (fd < 0) {
+				err = errno;
+				continue;
+			}
+			client->attempts[client->attempt_count++] = fd;
+			/* Done right away, it is the one, the rest aren't needed */
+			if (is_socket_failed || is_connected) {
+				if (chat_client_take_attempt(client, client->attempt_count - 1) != 0)
+					return CHAT_ERR_SYS;
+				is_socket_failed = false;
+			}
+			if (is_connected) {
+				chat_client_stop_connecting(client);
+				return 0;
+			}
+			continue;
+		}
+		if (is_socket_failed)
+			return chat_client_fail_connect(client, err);
+		if (now >= deadline)
+			return CHAT_ERR_TIMEOUT;
+	}
+}
+
 struct chat_client *
 chat_client_new(const char *name)
 {
 	struct chat_client *client = calloc(1, sizeof(*client));
+	chat_dns_cache_ref();
 	client->socket = -1;
+	client->is_connecting = false;
+	client->addrs = NULL;
+	client->addr_count = 0;
+	client->attempt_count = 0;
+	client->shm = NULL;
+	client->local_epoll_fd = -1;
 
 	pmq_init(&client->incoming, 16);
 	pmq_init(&client->outgoing, 16);
+	pmq_init(&client->unframed, 16);
+	client->recv_hint = PMQ_RECV_MIN;
+	client->proto = CHAT_PROTO_TEXT;
+	client->is_acked = false;
+	client->authors = NULL;
+	client->author_count = 0;
+	client->last_seq = 0;
+	client->pending_seq = 0;
+	client->is_resuming = false;
+	client->is_packing = false;
+	client->unpacked = NULL;
+	client->unpacked_capacity = 0;
+	chat_socket_options_init(&client->socket_options);
+	client->coalesce_delay = 0;
+	client->coalesce_size = 0;
+	client->coalesce_until = 0;
+	client->is_flushing = false;
+	client->group = NULL;
+	client->is_dirty = false;
+	client->is_ready = false;
+	client->group_error = 0;
 
 #if NEED_AUTHOR
 	assert(!strchr(name, '\n'));  // Client name with `'\n'`s are not allowed
 	client->name = strdup(name);
 	if (!client->name)
 		abort();
+	client->author_line = 0;
 #else
 	(void)name;
 #endif
@@ -50,22 +475,149 @@ chat_client_new(const char *name)
 void
 chat_client_delete(struct chat_client *client)
 {
+	if (client->group)
+		chat_client_group_remove(client->group, client);
 	if (client->socket >= 0)
 		(void)close(client->socket);
+	chat_client_stop_connecting(client);
+	if (client->shm) {
+		shm_channel_destroy(client->shm);
+		free(client->shm);
+		(void)close(client->local_epoll_fd);
+	}
 
 	pmq_destroy(&client->incoming);
 	pmq_destroy(&client->outgoing);
+	pmq_destroy(&client->unframed);
 #if NEED_AUTHOR
 	free(client->name);
 #endif
+	for (size_t i = 0; i < client->author_count; ++i)
+		free(client->authors[i]);
+	free(client->authors);
+	free(client->unpacked);
 
 	free(client);
+	chat_dns_cache_unref();
+}
+
+int
+chat_client_set_protocol(struct chat_client *client, enum chat_proto proto)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (proto != CHAT_PROTO_TEXT && proto != CHAT_PROTO_BINARY)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->proto = proto;
+	return 0;
+}
+
+int
+chat_client_set_socket_options(struct chat_client *client,
+			       const struct chat_socket_options *opts)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	int rc = chat_socket_options_check(opts);
+	if (rc != 0)
+		return rc;
+	client->socket_options = *opts;
+	return 0;
+}
+
+int
+chat_client_resume(struct chat_client *client, uint64_t seq)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (client->proto != CHAT_PROTO_BINARY)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->last_seq = seq;
+	client->is_resuming = true;
+	return 0;
+}
+
+uint64_t
+chat_client_get_last_seq(const struct chat_client *client)
+{
+	return client->last_seq;
+}
+
+int
+chat_client_set_compression(struct chat_client *client, bool is_enabled)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (client->proto != CHAT_PROTO_BINARY)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->is_packing = is_enabled;
+	return 0;
+}
+
+int
+chat_client_set_coalescing(struct chat_client *client, double delay, size_t max_size)
+{
+	if (!(delay >= 0))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->coalesce_delay = delay;
+	client->coalesce_size = max_size;
+	return 0;
+}
+
+/**
+ * Whether the output is held back now, see chat_client_set_coalescing():
+ * there is some, fed less than the delay ago, and less than the size.
+ */
+static bool chat_client_is_holding(const struct chat_client *client) {
+	if (client->coalesce_delay <= 0 || client->is_flushing ||
+			pmq_is_empty(&client->outgoing))
+		return false;
+	if (client->coalesce_size > 0 && pmq_size(&client->outgoing) >= client->coalesce_size)
+		return false;
+	return chat_client_now() < client->coalesce_until;
+}
+
+/// Milliseconds to wait for at most, for what is held to go in time.
+static int chat_client_hold_timeout(double until, double timeout) {
+	/* Rounded up: a wait cut short would find it still held */
+	double left = (until - chat_client_now()) * 1000 + 1;
+	return left < timeout * 1000 ? (int)left : (int)(timeout * 1000);
+}
+
+/// Queue a frame of `type` with the body `body` to send.
+static void chat_client_put_frame(struct chat_client *client, enum chat_frame_type type,
+				  const char *body, size_t body_size) {
+	char header[CHAT_FRAME_HEADER_MAX];
+	pmq_put(&client->outgoing, header, chat_frame_header(type, body_size, header));
+	pmq_put(&client->outgoing, body, body_size);
+}
+
+/// Queues what the server is told first, in the protocol chosen.
+static void chat_client_greet(struct chat_client *client) {
+	if (client->proto == CHAT_PROTO_BINARY) {
+		static const char offer[] = {CHAT_FRAME_MAGIC, CHAT_FRAME_VERSION};
+		pmq_put(&client->outgoing, offer, sizeof(offer));
+#if NEED_AUTHOR
+		chat_client_put_frame(client, CHAT_FRAME_NAME, client->name,
+				      strlen(client->name));
+#endif
+		if (client->is_resuming) {
+			char seq[CHAT_VARINT_MAX];
+			chat_client_put_frame(client, CHAT_FRAME_RESUME, seq,
+					      chat_varint_encode(client->last_seq, seq));
+		}
+		return;
+	}
+#if NEED_AUTHOR
+	chat_client_feed(client, client->name, strlen(client->name));
+	chat_client_feed(client, "\n", 1);
+#endif
 }
 
 int
 chat_client_connect(struct chat_client *client, const char *addr)
 {
-	if (client->socket > 0)
+	if (client->socket >= 0)
 		return CHAT_ERR_ALREADY_STARTED;
 
 	char *addr_dup = strdup(addr);
@@ -73,152 +625,536 @@ chat_client_connect(struct chat_client *client, const char *addr)
 	char *colon = strchr(addr_dup, ':');
 	assert(colon);
 	*colon = '\0';
+	int rc = chat_client_resolve(addr_dup, colon + 1, &client->addrs, &client->addr_count);
+	free(addr_dup);
+	if (rc != 0)
+		return rc;
 
-	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
-	 */
-
-	struct addrinfo *result, hints = {.ai_family = AF_INET};
-	int err = getaddrinfo(addr_dup, colon + 1, &hints, &result);
-	if (err != 0) {
+	/* The first address that doesn't fail right away, the rest later */
+	client->next_addr = 0;
+	client->attempt_count = 0;
+	int sockfd = -1;
+	bool is_connected = false;
+	while (sockfd < 0 && client->next_addr < client->addr_count)
+		sockfd = chat_client_start_attempt(client, &is_connected);
+	if (sockfd < 0) {
+		int save_errno = errno;
+		chat_client_stop_connecting(client);
+		errno = save_errno;
 		return CHAT_ERR_NO_ADDR;
 	}
+	client->socket = sockfd;
+	client->is_connecting = true;
+	client->next_attempt_at = chat_client_now() + CHAT_CLIENT_ATTEMPT_DELAY;
+	if (is_connected)
+		chat_client_stop_connecting(client);
+	chat_client_greet(client);
+	return 0;
+}
 
-	int sockfd;
-	struct addrinfo *aip;
-	for (aip = result; aip != NULL; aip = aip->ai_next) {
-		sockfd = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
-		if (sockfd < 0) {
-			if (errno == EAFNOSUPPORT || errno == EPROTONOSUPPORT || errno == EPROTOTYPE) {
-				continue;
-			}
-			return CHAT_ERR_SYS;
-		}
-		if (0 == connect(sockfd, aip->ai_addr, aip->ai_addrlen))
-			break;
-		(void)close(sockfd);
+/// Sets up the channel over the connected UNIX socket `sock`.
+static int chat_client_open_local(struct chat_client *client, int sock) {
+	struct shm_channel *ch = malloc(sizeof(*ch));
+	if (!ch)
+		abort();
+	int memfd = shm_channel_create(ch, CHAT_CLIENT_SHM_SIZE);
+	if (memfd < 0) {
+		free(ch);
+		return -1;
 	}
-	freeaddrinfo(result);
-	free(addr_dup);
+	int fds[] = {memfd, ch->wait_fd};
+	int rc = shm_send_fds(sock, fds, 2);
+	(void)close(memfd);
+	/* Level-triggered: the socket is readable once, for the answer */
+	int epoll_fd = rc == 0 ? epoll_create1(EPOLL_CLOEXEC) : -1;
+	if (epoll_fd < 0 ||
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock,
+				  &(struct epoll_event){.events = EPOLLIN | EPOLLRDHUP, .data.fd = sock}) != 0 ||
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ch->wait_fd,
+				  &(struct epoll_event){.events = EPOLLIN, .data.fd = ch->wait_fd}) != 0) {
+		int save_errno = errno;
+		if (epoll_fd >= 0)
+			(void)close(epoll_fd);
+		shm_channel_destroy(ch);
+		free(ch);
+		errno = save_errno;
+		return -1;
+	}
+	client->shm = ch;
+	client->local_epoll_fd = epoll_fd;
+	return 0;
+}
 
-	if (aip == NULL) {
+int
+chat_client_connect_local(struct chat_client *client, const char *path)
+{
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
 		return CHAT_ERR_NO_ADDR;
-	}
-	if (sockfd < 0)
+	strcpy(addr.sun_path, path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
 		return CHAT_ERR_SYS;
-	if (0 > fcntl(sockfd, F_SETFL, O_NONBLOCK)) {
-		close(sockfd);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			chat_client_open_local(client, sock) != 0) {
+		int save_errno = errno;
+		(void)close(sock);
+		errno = save_errno;
 		return CHAT_ERR_SYS;
 	}
-	client->socket = sockfd;
+	client->socket = sock;
+	chat_client_greet(client);
+	return 0;
+}
 
-#if NEED_AUTHOR
-	chat_client_feed(client, client->name, strlen(client->name));
-	chat_client_feed(client, "\n", 1);
-#endif
 
+static void chat_client_group_mark_dirty(struct chat_client *client);
+
+/**
+ * Whether the server has agreed to the binary protocol: its answer to the
+ * offer is at a message boundary and starts with a '\0', which no text
+ * message has, so the client reads text until it. Then the client asks for
+ * what the version has, which an older server wouldn't know.
+ */
+static bool chat_client_take_ack(struct chat_client *client) {
+	if (client->is_acked)
+		return true;
+	size_t len;
+	const char *data = pmq_data(&client->incoming, &len);
+	if (len < 2 || data[0] != CHAT_FRAME_MAGIC)
+		return false;
+	/* The frames of all the versions are read the same way */
+	uint8_t version = data[1];
+	pmq_consume(&client->incoming, 2);
+	client->is_acked = true;
+	if (client->is_packing && version >= 3) {
+		chat_client_put_frame(client, CHAT_FRAME_COMPRESS, "", 0);
+		chat_client_group_mark_dirty(client);
+	}
+	return true;
+}
+
+static void chat_client_set_author(struct chat_client *client, size_t id, const char *name, size_t name_size) {
+	if (id >= client->author_count) {
+		size_t count = client->author_count ? client->author_count : 16;
+		while (count <= id)
+			count *= 2;
+		char **authors = realloc(client->authors, sizeof(*authors) * count);
+		if (!authors)
+			abort();
+		memset(authors + client->author_count, 0,
+		       sizeof(*authors) * (count - client->author_count));
+		client->authors = authors;
+		client->author_count = count;
+	}
+	free(client->authors[id]);
+	client->authors[id] = strndup(name, name_size);
+	if (!client->authors[id])
+		abort();
+}
+
+/**
+ * Decompresses the message of a CHAT_FRAME_PACKED past its author id to
+ * `unpacked`, and makes it the body.
+ */
+static int chat_client_unpack(struct chat_client *client, struct chat_frame *frame) {
+	uint64_t size;
+	int rc = chat_varint_decode(frame->body, frame->body_size, &size);
+	if (rc <= 0 || size > CHAT_FRAME_MAX_SIZE)
+		return -1;
+	if (size > client->unpacked_capacity) {
+		char *unpacked = realloc(client->unpacked, size);
+		if (!unpacked)
+			abort();
+		client->unpacked = unpacked;
+		client->unpacked_capacity = size;
+	}
+	if (lz_decompress(frame->body + rc, frame->body_size - rc, client->unpacked,
+			  size) != (ssize_t)size)
+		return -1;
+	frame->body = client->unpacked;
+	frame->body_size = size;
 	return 0;
 }
 
-struct chat_message *
-chat_client_pop_next(struct chat_client *client)
-{
+/**
+ * Takes the frames up to the next message, remembering the authors' names
+ * and the number of the message.
+ */
+static bool chat_client_peek_frame(struct chat_client *client, struct chat_message_view *view) {
+	struct chat_frame frame;
+	ssize_t size;
+	for (;;) {
+		size_t len;
+		const char *data = pmq_data(&client->incoming, &len);
+		if ((size = chat_frame_decode(data, len, &frame)) <= 0)
+			break;
+		if (frame.type == CHAT_FRAME_SEQ) {
+			/* Of a message dropped for the overflow, the next one replaces it */
+			if (chat_varint_decode(frame.body, frame.body_size, &client->pending_seq) <= 0) {
+				size = -1;
+				break;
+			}
+			pmq_consume(&client->incoming, size);
+			continue;
+		}
+		uint32_t id;
+		if (chat_frame_take_id(&frame, &id) != 0) {
+			size = -1;
+			break;
+		}
+
+		if (frame.type == CHAT_FRAME_PACKED && chat_client_unpack(client, &frame) != 0) {
+			size = -1;
+			break;
+		}
+		if (frame.type == CHAT_FRAME_MESSAGE || frame.type == CHAT_FRAME_PACKED) {
 #if NEED_AUTHOR
-	const char *author = pmq_next_message(&client->incoming), *data = pmq_next_message(&client->incoming);
-	if (!author) {
-		return NULL;
+			const char *author = id < client->author_count && client->authors[id] ?
+				client->authors[id] : "";
+			view->author = author;
+			view->author_size = strlen(author);
+#endif
+			view->data = frame.body;
+			view->data_size = frame.body_size;
+			client->peeked_size = size;
+			return true;
+		}
+		if (frame.type == CHAT_FRAME_AUTHOR)
+			chat_client_set_author(client, id, frame.body, frame.body_size);
+		pmq_consume(&client->incoming, size);
 	}
-	assert(data);
-#else
-	const char *data = pmq_next_message(&client->incoming);
-	if (!data) {
-		return NULL;
+	if (size < 0) {
+		/* Malformed, nothing after it makes sense */
+		pmq_consume(&client->incoming, pmq_size(&client->incoming));
+	}
+	return false;
+}
+
+/**
+ * Finds the next line of the text protocol after `from` bytes of the data,
+ * starting the search where the last one has stopped. Returns its size with
+ * the '\n', or 0 if it hasn't come whole yet.
+ */
+static size_t chat_client_find_line(struct chat_client *client, const char *data, size_t len, size_t from) {
+	size_t scan = client->text_scan > from ? client->text_scan : from;
+	const char *lf = memchr(data + scan, '\n', len - scan);
+	if (!lf) {
+		client->text_scan = len;
+		return 0;
 	}
+	return lf + 1 - (data + from);
+}
+
+static bool chat_client_peek_text(struct chat_client *client, struct chat_message_view *view) {
+	size_t len;
+	const char *data = pmq_data(&client->incoming, &len);
+	size_t from = 0;
+#if NEED_AUTHOR
+	if (client->author_line == 0) {
+		client->author_line = chat_client_find_line(client, data, len, 0);
+		if (client->author_line == 0)
+			return false;
+	}
+	from = client->author_line;
+	view->author = data;
+	view->author_size = client->author_line - 1;
 #endif
+	size_t line = chat_client_find_line(client, data, len, from);
+	if (line == 0)
+		return false;
+	view->data = data + from;
+	view->data_size = line - 1;
+	client->peeked_size = from + line;
+	return true;
+}
 
-	struct chat_message *ret = malloc(sizeof *ret);
-	if (!ret)
-		abort();
+bool
+chat_client_peek_next(struct chat_client *client, struct chat_message_view *view)
+{
+	if (client->proto == CHAT_PROTO_BINARY && chat_client_take_ack(client))
+		return chat_client_peek_frame(client, view);
+	return chat_client_peek_text(client, view);
+}
 
+void
+chat_client_consume(struct chat_client *client)
+{
+	assert(client->peeked_size > 0);
+	pmq_consume(&client->incoming, client->peeked_size);
+	client->peeked_size = 0;
+	client->text_scan = 0;
+	if (client->pending_seq != 0)
+		client->last_seq = client->pending_seq;
+	client->pending_seq = 0;
 #if NEED_AUTHOR
-	ret->author = strdup(author);
-	if (!ret->author)
-		abort();
+	client->author_line = 0;
 #endif
-	ret->data = strdup(data);
-	if (!ret->data)
-		abort();
+}
+
+struct chat_message *
+chat_client_pop_next(struct chat_client *client)
+{
+	struct chat_message_view view;
+	if (!chat_client_peek_next(client, &view))
+		return NULL;
+#if NEED_AUTHOR
+	struct chat_message *ret = chat_message_new(view.author, view.author_size,
+						    view.data, view.data_size);
+#else
+	struct chat_message *ret = chat_message_new(NULL, 0, view.data, view.data_size);
+#endif
+	chat_client_consume(client);
 	return ret;
 }
 
+static int chat_client_flush_local(struct chat_client *client);
+
 int
 chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
 {
 	if (client->socket < 0)
 		return CHAT_ERR_NOT_STARTED;
-	pmq_put(&client->outgoing, msg, msg_size);
+	chat_client_group_mark_dirty(client);
+	if (client->coalesce_delay > 0 && pmq_is_empty(&client->outgoing))
+		client->coalesce_until = chat_client_now() + client->coalesce_delay;
+	if (client->proto == CHAT_PROTO_TEXT) {
+		pmq_put(&client->outgoing, msg, msg_size);
+	} else {
+		/* The messages are still fed as lines, but sent as frames */
+		pmq_put(&client->unframed, msg, msg_size);
+		char *line;
+		size_t len;
+		while ((line = pmq_next_message(&client->unframed, &len)))
+			chat_client_put_frame(client, CHAT_FRAME_MESSAGE, line, len);
+	}
+	/* Into the ring right away, no system call needed */
+	if (client->shm && !chat_client_is_holding(client))
+		return chat_client_flush_local(client);
 	return 0;
 }
 
+static int chat_client_send(struct chat_client *client);
+
 int
-chat_client_get_events(const struct chat_client *client)
+chat_client_flush(struct chat_client *client)
 {
 	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (pmq_is_empty(&client->outgoing))
+		return 0;
+	client->is_flushing = true;
+	/* The rest goes once connected, see chat_client_update_connect() */
+	if (client->is_connecting)
 		return 0;
+	return chat_client_send(client);
+}
 
-	// Abusing partial_message_queue implementation
+int
+chat_client_join(struct chat_client *client, const char *name)
+{
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	size_t len = strlen(name);
+	if (len == 0 || memchr(name, '\n', len))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	(void)chat_client_feed(client, CHAT_CMD_JOIN, strlen(CHAT_CMD_JOIN));
+	(void)chat_client_feed(client, name, len);
+	return chat_client_feed(client, "\n", 1);
+}
 
-	if (client->outgoing.read[0]) {
-		// There is data to send
+int
+chat_client_leave(struct chat_client *client)
+{
+	return chat_client_feed(client, CHAT_CMD_LEAVE "\n", strlen(CHAT_CMD_LEAVE) + 1);
+}
+
+int
+chat_client_get_events(const struct chat_client *client)
+{
+	if (client->socket < 0)
+		return 0;
+	/* The output goes on its own, see chat_client_connect_local() */
+	if (client->shm)
+		return CHAT_EVENT_INPUT;
+
+	if (client->is_connecting ||
+			(!pmq_is_empty(&client->outgoing) && !chat_client_is_holding(client))) {
+		// There is data to send, or a connect to be done
 		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
 	}
 	return CHAT_EVENT_INPUT;
 }
 
+/**
+ * Takes all the server has written to the ring of a local client, and what
+ * has come on the socket: the server's eventfd, and then only the end.
+ */
+static int chat_client_read_local(struct chat_client *client) {
+	struct shm_channel *ch = client->shm;
+	struct epoll_event events[2];
+	int count = epoll_wait(client->local_epoll_fd, events, 2, 0);
+	if (count < 0)
+		return CHAT_ERR_SYS;
+	for (int i = 0; i < count; ++i) {
+		if (events[i].data.fd == ch->wait_fd) {
+			/* Before the ring, for a notification after the look to stay */
+			shm_channel_clear(ch);
+		} else if (ch->notify_fd < 0) {
+			/* What is before it the server reads once it has the channel */
+			int got = shm_recv_fds(client->socket, &ch->notify_fd, 1);
+			if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return CHAT_ERR_SYS;
+		}
+	}
+	bool has_read = false;
+	for (;;) {
+		size_t room;
+		char *tail = pmq_tail(&client->incoming, PMQ_RECV_MIN, &room);
+		ssize_t got = shm_ring_read(&ch->in, tail, room);
+		if (got < 0)
+			return CHAT_ERR_SYS;
+		if (got == 0) {
+			if (shm_ring_wait_data(&ch->in))
+				break;
+			continue;
+		}
+		pmq_commit(&client->incoming, got);
+		has_read = true;
+	}
+	if (has_read && shm_ring_take_writer(&ch->in))
+		shm_channel_notify(ch);
+	return 0;
+}
+
+/// Writes what is queued to the ring of a local client until it is full, held or not.
+static int chat_client_flush_local(struct chat_client *client) {
+	struct shm_channel *ch = client->shm;
+	bool has_written = false;
+	/* Not held again, see chat_client_is_holding() */
+	client->coalesce_until = 0;
+	while (!pmq_is_empty(&client->outgoing)) {
+		size_t len;
+		const char *data = pmq_data(&client->outgoing, &len);
+		ssize_t written = shm_ring_write(&ch->out, data, len);
+		if (written < 0)
+			return CHAT_ERR_SYS;
+		pmq_consume(&client->outgoing, written);
+		has_written = has_written || written > 0;
+		/* Full: the server tells once it has read */
+		if (written == 0 && shm_ring_wait_room(&ch->out))
+			break;
+	}
+	if (has_written && shm_ring_take_reader(&ch->out))
+		shm_channel_notify(ch);
+	if (pmq_is_empty(&client->outgoing))
+		client->is_flushing = false;
+	return 0;
+}
+
+/// Receives all the socket has.
+static int chat_client_read(struct chat_client *client) {
+	if (client->shm)
+		return chat_client_read_local(client);
+	ssize_t got;
+	bool is_drained = false;
+	while (!is_drained && (got = pmq_recv(&client->incoming, client->socket,
+					      &client->recv_hint, &is_drained)) > 0)
+		{};
+	if (!is_drained && got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+/// Sends what is queued until the socket is full, held or not.
+static int chat_client_send(struct chat_client *client) {
+	if (client->shm)
+		return chat_client_flush_local(client);
+	client->coalesce_until = 0;
+	ssize_t sent = 1;
+	while (!pmq_is_empty(&client->outgoing) && sent > 0) {
+		size_t len;
+		const char *data = pmq_data(&client->outgoing, &len);
+		sent = send(client->socket, data, len, MSG_NOSIGNAL);
+		if (sent < 0)
+			break;
+		pmq_consume(&client->outgoing, sent);
+	}
+	if (pmq_is_empty(&client->outgoing))
+		client->is_flushing = false;
+	if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+/// Waits for the server on a local client, see chat_client_connect_local().
+static int chat_client_update_local(struct chat_client *client, double timeout) {
+	/* What didn't fit in the ring before, or is due */
+	size_t old_size = pmq_size(&client->outgoing);
+	bool is_holding = chat_client_is_holding(client);
+	int rc = is_holding ? 0 : chat_client_flush_local(client);
+	if (rc != 0)
+		return rc;
+	bool has_sent = pmq_size(&client->outgoing) != old_size;
+	struct pollfd fd = {.fd = client->local_epoll_fd, .events = POLLIN};
+	int res = poll(&fd, 1, has_sent ? 0 : is_holding ?
+		       chat_client_hold_timeout(client->coalesce_until, timeout) : timeout * 1000);
+	if (res < 0)
+		return CHAT_ERR_SYS;
+	if (res == 0 && (!is_holding || chat_client_is_holding(client)))
+		return has_sent ? 0 : CHAT_ERR_TIMEOUT;
+	if (res > 0 && (rc = chat_client_read_local(client)) != 0)
+		return rc;
+	return chat_client_is_holding(client) ? 0 : chat_client_flush_local(client);
+}
+
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
 	if (client->socket < 0)
 		return CHAT_ERR_NOT_STARTED;
+	if (client->is_connecting) {
+		int rc = chat_client_update_connect(client, timeout);
+		if (rc != 0)
+			return rc;
+		/* Connected, what is queued goes right away */
+		rc = chat_client_update(client, 0);
+		return rc == CHAT_ERR_TIMEOUT ? 0 : rc;
+	}
+	if (client->shm)
+		return chat_client_update_local(client, timeout);
 
+	/* Held output is not waited to be sent, but for when it is due */
+	bool is_holding = chat_client_is_holding(client);
 	struct pollfd fd = {.fd = client->socket,
 		.events = POLLIN | (chat_client_get_events(client) & CHAT_EVENT_OUTPUT ? POLLOUT : 0)
 	};
-	int res = poll(&fd, 1, timeout * 1000);
+	int res = poll(&fd, 1, is_holding ? chat_client_hold_timeout(client->coalesce_until, timeout) :
+		       timeout * 1000);
 	if (res < 0)
 		return CHAT_ERR_SYS;
-	else if (res == 0)
+	if (is_holding && !chat_client_is_holding(client)) {
+		int rc = res > 0 && (fd.revents & POLLIN) ? chat_client_read(client) : 0;
+		return rc != 0 ? rc : chat_client_send(client);
+	} else if (res == 0)
 		return CHAT_ERR_TIMEOUT;
 	else {
 		// Note: the input processing should preceed output to avoid SIGPIPE
 
 		if (fd.revents & POLLIN) {
-			const size_t bufsz = 1024;
-			char buf[bufsz];
-			ssize_t got;
-			while ((got = recv(client->socket, buf, bufsz, 0)) > 0) {
-				pmq_put(&client->incoming, buf, got);
-			}
-			if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-					return CHAT_ERR_SYS;
-			}
+			int rc = chat_client_read(client);
+			if (rc != 0)
+				return rc;
 		}
 
 		if (fd.revents & POLLOUT) {
-			// Abusing partial_message_queue implementation
-
-			ssize_t sent = 1;
-			while (*client->outgoing.read && sent > 0) {
-				sent = send(client->socket, client->outgoing.read, strlen(client->outgoing.read), 0);
-				if (sent < 0)
-					return CHAT_ERR_SYS;
-				client->outgoing.read += sent;
-			}
-			if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-				return CHAT_ERR_SYS;
-			}
+			int rc = chat_client_send(client);
+			if (rc != 0)
+				return rc;
 		}
 	}
 	return 0;
@@ -227,5 +1163,314 @@ chat_client_update(struct chat_client *client, double timeout)
 int
 chat_client_get_descriptor(const struct chat_client *client)
 {
-	return client->socket;
+	return client->shm ? client->local_epoll_fd : client->socket;
+}
+
+/// Clients of a group, in no particular order but for the ready ones.
+struct chat_client_list {
+	struct chat_client **items;
+	size_t count;
+	size_t capacity;
+};
+
+static void chat_client_list_push(struct chat_client_list *list, struct chat_client *client) {
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 16;
+		struct chat_client **items = realloc(list->items, sizeof(*items) * capacity);
+		if (!items)
+			abort();
+		list->items = items;
+		list->capacity = capacity;
+	}
+	list->items[list->count++] = client;
+}
+
+/// Removes `client` from `list` at `from` or after, if there, in order.
+static void chat_client_list_erase(struct chat_client_list *list, size_t from,
+				   struct chat_client *client) {
+	for (size_t i = from; i < list->count; ++i) {
+		if (list->items[i] != client)
+			continue;
+		memmove(&list->items[i], &list->items[i + 1],
+			sizeof(*list->items) * (list->count - i - 1));
+		--list->count;
+		return;
+	}
+}
+
+struct chat_client_group {
+	int epoll_fd;
+	/// Buffer for `epoll_wait`
+	struct epoll_event *events;
+	/// All the clients, by their `group_pos`
+	struct chat_client_list clients;
+	/// Still connecting: they are in the epoll by their first attempt only,
+	/// and each update looks at all their attempts
+	struct chat_client_list connecting;
+	/// Fed since the last update, which sends it before waiting
+	struct chat_client_list dirty;
+	/// Got something or failed, from `ready_pos` on
+	struct chat_client_list ready;
+	size_t ready_pos;
+};
+
+static void chat_client_group_mark_dirty(struct chat_client *client) {
+	if (!client->group || client->is_dirty)
+		return;
+	client->is_dirty = true;
+	chat_client_list_push(&client->group->dirty, client);
+}
+
+static void chat_client_group_mark_ready(struct chat_client_group *group, struct chat_client *client) {
+	if (client->is_ready)
+		return;
+	client->is_ready = true;
+	chat_client_list_push(&group->ready, client);
+}
+
+/**
+ * Stops updating the client and reports `err` with errno. It stays in the
+ * group until removed.
+ */
+static void chat_client_group_fail(struct chat_client_group *group, struct chat_client *client, int err) {
+	client->group_error = err;
+	client->group_errno = errno;
+	if (client->socket >= 0)
+		(void)epoll_ctl(group->epoll_fd, EPOLL_CTL_DEL,
+				chat_client_get_descriptor(client), NULL);
+	chat_client_group_mark_ready(group, client);
+}
+
+/**
+ * Puts the client's socket in the epoll, edge-triggered, so an EPOLLOUT
+ * comes only when the socket has room again. A connected one is put again:
+ * if another attempt has taken the descriptor, the epoll has dropped it.
+ */
+static int chat_client_group_watch(struct chat_client_group *group, struct chat_client *client) {
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+				 .data.ptr = client};
+	if (epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, chat_client_get_descriptor(client), &ev) != 0 &&
+			errno != EEXIST)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+/// Reads and sends what the client has now, reporting it if anything came.
+static int chat_client_group_do_io(struct chat_client_group *group, struct chat_client *client) {
+	size_t old_size = pmq_size(&client->incoming);
+	/* The input first, as in chat_client_update() */
+	int rc = chat_client_read(client);
+	if (pmq_size(&client->incoming) != old_size)
+		chat_client_group_mark_ready(group, client);
+	if (rc != 0)
+		return rc;
+	/* Held, the next update sends it when due */
+	if (chat_client_is_holding(client)) {
+		chat_client_group_mark_dirty(client);
+		return 0;
+	}
+	return chat_client_send(client);
+}
+
+/// Moves the connects on, returns how many are over.
+static int chat_client_group_connect(struct chat_client_group *group) {
+	int done = 0;
+	for (size_t i = 0; i < group->connecting.count;) {
+		struct chat_client *client = group->connecting.items[i];
+		int rc = chat_client_update_connect(client, 0);
+		if (rc == CHAT_ERR_TIMEOUT) {
+			++i;
+			continue;
+		}
+		group->connecting.items[i] = group->connecting.items[--group->connecting.count];
+		++done;
+		/* What came along with the connect had its edge already */
+		if (rc == 0 && (rc = chat_client_group_watch(group, client)) == 0)
+			rc = chat_client_group_do_io(group, client);
+		if (rc != 0)
+			chat_client_group_fail(group, client, rc);
+	}
+	return done;
+}
+
+struct chat_client_group *
+chat_client_group_new(void)
+{
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd < 0)
+		return NULL;
+	struct chat_client_group *group = calloc(1, sizeof(*group));
+	if (!group)
+		abort();
+	group->epoll_fd = epoll_fd;
+	group->events = malloc(sizeof(*group->events) * CHAT_CLIENT_GROUP_EVENT_BATCH);
+	if (!group->events)
+		abort();
+	return group;
+}
+
+void
+chat_client_group_delete(struct chat_client_group *group)
+{
+	for (size_t i = 0; i < group->clients.count; ++i) {
+		struct chat_client *client = group->clients.items[i];
+		client->group = NULL;
+		client->is_dirty = false;
+		client->is_ready = false;
+		client->group_error = 0;
+	}
+	free(group->clients.items);
+	free(group->connecting.items);
+	free(group->dirty.items);
+	free(group->ready.items);
+	free(group->events);
+	(void)close(group->epoll_fd);
+	free(group);
+}
+
+int
+chat_client_group_add(struct chat_client_group *group, struct chat_client *client)
+{
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (client->group)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (chat_client_group_watch(group, client) != 0)
+		return CHAT_ERR_SYS;
+	client->group = group;
+	client->group_pos = group->clients.count;
+	client->group_error = 0;
+	chat_client_list_push(&group->clients, client);
+	if (client->is_connecting)
+		chat_client_list_push(&group->connecting, client);
+	else if (!pmq_is_empty(&client->outgoing))
+		chat_client_group_mark_dirty(client);
+	return 0;
+}
+
+void
+chat_client_group_remove(struct chat_client_group *group, struct chat_client *client)
+{
+	assert(client->group == group);
+	if (client->socket >= 0 && client->group_error == 0)
+		(void)epoll_ctl(group->epoll_fd, EPOLL_CTL_DEL,
+				chat_client_get_descriptor(client), NULL);
+	struct chat_client *last = group->clients.items[--group->clients.count];
+	group->clients.items[client->group_pos] = last;
+	last->group_pos = client->group_pos;
+	chat_client_list_erase(&group->connecting, 0, client);
+	if (client->is_dirty)
+		chat_client_list_erase(&group->dirty, 0, client);
+	if (client->is_ready)
+		chat_client_list_erase(&group->ready, group->ready_pos, client);
+	client->group = NULL;
+	client->is_dirty = false;
+	client->is_ready = false;
+	client->group_error = 0;
+}
+
+/**
+ * Sends what the clients fed have, but the ones holding it, see
+ * chat_client_set_coalescing(), which stay dirty: `hold_until` is when
+ * the first of them is due, 0 if none. Returns how many have sent.
+ */
+static int chat_client_group_send_dirty(struct chat_client_group *group, double *hold_until) {
+	int done = 0;
+	size_t kept = 0;
+	*hold_until = 0;
+	for (size_t i = 0; i < group->dirty.count; ++i) {
+		struct chat_client *client = group->dirty.items[i];
+		if (client->group_error == 0 && !client->is_connecting &&
+				chat_client_is_holding(client)) {
+			if (*hold_until == 0 || client->coalesce_until < *hold_until)
+				*hold_until = client->coalesce_until;
+			group->dirty.items[kept++] = client;
+			continue;
+		}
+		client->is_dirty = false;
+		if (client->is_connecting || client->group_error != 0)
+			continue;
+		++done;
+		int rc = chat_client_send(client);
+		if (rc != 0)
+			chat_client_group_fail(group, client, rc);
+	}
+	group->dirty.count = kept;
+	return done;
+}
+
+int
+chat_client_group_update(struct chat_client_group *group, double timeout)
+{
+	double hold_until;
+	int done = chat_client_group_send_dirty(group, &hold_until);
+
+	/* Only the first attempts are in the epoll, the others are looked at */
+	if (group->connecting.count > 0 && timeout > CHAT_CLIENT_ATTEMPT_DELAY)
+		timeout = CHAT_CLIENT_ATTEMPT_DELAY;
+	if (done > 0)
+		timeout = 0;
+	int res = epoll_wait(group->epoll_fd, group->events, CHAT_CLIENT_GROUP_EVENT_BATCH,
+			     hold_until > 0 ? chat_client_hold_timeout(hold_until, timeout) :
+			     timeout * 1000);
+	if (res < 0)
+		return CHAT_ERR_SYS;
+	for (int i = 0; i < res; ++i) {
+		struct chat_client *client = group->events[i].data.ptr;
+		/* The connecting ones are below */
+		if (client->is_connecting || client->group_error != 0)
+			continue;
+		uint32_t events = group->events[i].events;
+		int rc = 0;
+		if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			size_t old_size = pmq_size(&client->incoming);
+			rc = chat_client_read(client);
+			if (pmq_size(&client->incoming) != old_size)
+				chat_client_group_mark_ready(group, client);
+		}
+		/* A local one has no EPOLLOUT, the server's room comes as input */
+		if (rc == 0 && ((events & EPOLLOUT) || client->shm) && !chat_client_is_holding(client))
+			rc = chat_client_send(client);
+		if (rc != 0)
+			chat_client_group_fail(group, client, rc);
+	}
+	done += res;
+	/* What has come due while waiting */
+	if (hold_until > 0 && chat_client_now() >= hold_until)
+		done += chat_client_group_send_dirty(group, &hold_until);
+	if (group->connecting.count > 0)
+		done += chat_client_group_connect(group);
+	return done > 0 ? 0 : CHAT_ERR_TIMEOUT;
+}
+
+struct chat_client *
+chat_client_group_next_ready(struct chat_client_group *group, int *error)
+{
+	if (group->ready_pos == group->ready.count) {
+		group->ready_pos = 0;
+		group->ready.count = 0;
+		return NULL;
+	}
+	struct chat_client *client = group->ready.items[group->ready_pos++];
+	client->is_ready = false;
+	*error = client->group_error;
+	if (client->group_error != 0)
+		errno = client->group_errno;
+	return client;
+}
+
+int
+chat_client_group_get_descriptor(const struct chat_client_group *group)
+{
+	return group->epoll_fd;
+}
+
+int
+chat_client_group_get_events(const struct chat_client_group *group)
+{
+	if (group->clients.count == 0)
+		return 0;
+	if (group->dirty.count > 0)
+		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
+	return CHAT_EVENT_INPUT;
 }
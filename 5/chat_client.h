@@ -1,5 +1,8 @@
 #pragma once
 
+#include "chat.h"
+
+#include <stdbool.h>
 #include <stdint.h>
 
 struct chat_client;
@@ -16,13 +19,117 @@ void
 chat_client_delete(struct chat_client *client);
 
 /**
- * Try to connect to the given address.
+ * Choose the protocol to talk to the server with. The text one is the
+ * default. With the binary one the messages may have '\0's in them, and
+ * the names of the authors come once instead of with every message.
+ *
+ * @param client Chat client, not connected yet.
+ * @param proto The protocol.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no such protocol.
+ */
+int
+chat_client_set_protocol(struct chat_client *client, enum chat_proto proto);
+
+/**
+ * Set the options of the socket, see chat_socket_options. The backlog and
+ * TCP_DEFER_ACCEPT are of the server only. The default is
+ * chat_socket_options_init().
+ *
+ * @param client Chat client, not connected yet.
+ * @param opts The options, copied.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_INVALID_ARGUMENT - see chat_socket_options_check().
+ */
+int
+chat_client_set_socket_options(struct chat_client *client,
+			       const struct chat_socket_options *opts);
+
+/**
+ * Catch up on the messages after the one numbered @a seq on connecting, as
+ * far as the server's history has them, see chat_server_set_history(). It
+ * is what chat_client_get_last_seq() has given before, of the connection
+ * lost.
+ *
+ * @param client Chat client, with the binary protocol, not connected yet.
+ * @param seq Number of the last message got, 0 for all the history.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not the binary protocol.
+ */
+int
+chat_client_resume(struct chat_client *client, uint64_t seq);
+
+/**
+ * Ask the server to send the big messages compressed, see
+ * chat_server_set_compression(). It is asked once the server has agreed to
+ * the protocol, if its version can, and the messages are decompressed to
+ * the client's own buffer before chat_client_peek_next() gives them.
+ *
+ * @param client Chat client, with the binary protocol, not connected yet.
+ * @param is_enabled Whether to ask, it doesn't by default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_INVALID_ARGUMENT - not the binary protocol.
+ */
+int
+chat_client_set_compression(struct chat_client *client, bool is_enabled);
+
+/**
+ * Hold the output back for a while, for many small messages fed one after
+ * another to go in one segment rather than one each: what is fed goes once
+ * @a delay seconds have passed since the first of it, or once @a max_size
+ * bytes are queued, or on chat_client_flush(). Until then the client asks
+ * for no CHAT_EVENT_OUTPUT, and chat_client_update() and
+ * chat_client_group_update() wait at most until it is due. It can be
+ * changed any time, and is off by default.
+ *
+ * @param client Chat client.
+ * @param delay Most seconds to hold the output for, 0 to send it at once.
+ * @param max_size Bytes queued that go without waiting more, 0 for any.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative delay.
+ */
+int
+chat_client_set_coalescing(struct chat_client *client, double delay,
+			   size_t max_size);
+
+/**
+ * Get the number of the last message taken, or the one to resume from if
+ * none yet. 0 if the server keeps no history.
+ */
+uint64_t
+chat_client_get_last_seq(const struct chat_client *client);
+
+/**
+ * Start connecting to the given address. It doesn't wait: the connection
+ * is made in chat_client_update(), and the messages fed meanwhile are sent
+ * once it is. If the name has several addresses, they are tried one after
+ * another, a new one every quarter of a second while the previous
+ * ones are still in progress, and the first to connect wins. The names
+ * resolved are cached for a minute, so the reconnects don't wait for DNS.
+ *
+ * The descriptor of chat_client_get_descriptor() stays the same number from
+ * here on, but it is another socket once connected, so an epoll has to be
+ * given it again then.
  *
  * @param client Chat client.
  * @param addr Address to connect to, like 'localhost:1234',
  *     '127.0.0.1:3313', '192.168.0.1:4567', etc.
  *
- * @retval 0 Success.
+ * @retval 0 Success, connecting.
  * @retval !=0 Error code.
  *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
  *     - CHAT_ERR_NO_ADDR - the addr couldn't be resolved to any IP.
@@ -31,6 +138,28 @@ chat_client_delete(struct chat_client *client);
 int
 chat_client_connect(struct chat_client *client, const char *addr);
 
+/**
+ * Connect to a server on the same host through its local socket, see
+ * chat_server_set_local_path(), instead of TCP. The connection is made
+ * right away, and the bytes then go through the shared memory. The output
+ * is written there right in chat_client_feed(), so the client never asks
+ * for CHAT_EVENT_OUTPUT: what doesn't fit goes in chat_client_update()
+ * once the server has made room, which comes as input. The descriptor of
+ * chat_client_get_descriptor() is an epoll then.
+ *
+ * @param client Chat client.
+ * @param path Path of the server's socket.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_NO_ADDR - the path is too long.
+ *     - CHAT_ERR_SYS - a system error, check errno: ENOENT or
+ *       ECONNREFUSED if nobody listens there.
+ */
+int
+chat_client_connect_local(struct chat_client *client, const char *path);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -44,7 +173,57 @@ struct chat_message *
 chat_client_pop_next(struct chat_client *client);
 
 /**
- * Wait for any update for the given timeout and do this update.
+ * Move to the room @a name, leaving the one the client is in, see
+ * CHAT_CMD_JOIN. The messages fed after this go there. It is fed as a
+ * message, so what is fed before has to end with a '\n'.
+ *
+ * @param client Chat client.
+ * @param name Room name, not empty and with no '\n'.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a bad name.
+ */
+int
+chat_client_join(struct chat_client *client, const char *name);
+
+/**
+ * Leave the room for the lobby, see CHAT_CMD_LEAVE.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ */
+int
+chat_client_leave(struct chat_client *client);
+
+/**
+ * Look at the next pending message without taking it or allocating
+ * anything: the view points into the receive buffer. It stays valid until
+ * chat_client_consume() or chat_client_update(), and peeking again before
+ * those gives the same message.
+ *
+ * @param client Chat client.
+ * @param view The message.
+ *
+ * @retval true There is a message, in @a view.
+ * @retval false No more messages yet.
+ */
+bool
+chat_client_peek_next(struct chat_client *client,
+		      struct chat_message_view *view);
+
+/**
+ * Take the message chat_client_peek_next() has given, which has to be
+ * there.
+ */
+void
+chat_client_consume(struct chat_client *client);
+
+/**
+ * Wait for any update for the given timeout and do this update. While
+ * connecting, see chat_client_connect(), that is the connection made.
  *
  * @param client Chat client.
  * @param timeout Timeout in seconds to wait for.
@@ -53,7 +232,9 @@ chat_client_pop_next(struct chat_client *client);
  * @retval !=0 Error code.
  *     - CHAT_ERR_TIMEOUT - no updates, timed out.
  *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
- *     - CHAT_ERR_SYS - a system error, check errno.
+ *     - CHAT_ERR_SYS - a system error, check errno. If none of the
+ *       addresses could be connected to, the client is not connected
+ *       any more and may connect again.
  */
 int
 chat_client_update(struct chat_client *client, double timeout);
@@ -93,3 +274,116 @@ chat_client_get_events(const struct chat_client *client);
 int
 chat_client_feed(struct chat_client *client, const char *msg,
 		 uint32_t msg_size);
+
+/**
+ * Send all that is fed now, even if held, see chat_client_set_coalescing(),
+ * as far as the socket takes it: the rest goes in chat_client_update() as
+ * without the coalescing. While connecting, all goes once connected.
+ *
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_client_flush(struct chat_client *client);
+
+/**
+ * A group of clients updated together, with one epoll for all of them:
+ * one system call waits for any of thousands of clients, and the output
+ * is sent right from chat_client_group_update(). The clients are used as
+ * usual otherwise, only chat_client_update() isn't called on them.
+ */
+struct chat_client_group;
+
+enum {
+	/** How many events chat_client_group_update() takes at once. */
+	CHAT_CLIENT_GROUP_EVENT_BATCH = 256,
+};
+
+/**
+ * Create a new group of no clients.
+ *
+ * @retval not-NULL The group.
+ * @retval NULL A system error, check errno.
+ */
+struct chat_client_group *
+chat_client_group_new(void);
+
+/** Free the group. The clients stay, out of any group. */
+void
+chat_client_group_delete(struct chat_client_group *group);
+
+/**
+ * Add the client to the group, to be updated by it. A client is in one group
+ * at most, and leaves it when deleted.
+ *
+ * @param group Client group.
+ * @param client Chat client, connected or connecting.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is in a group already.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_client_group_add(struct chat_client_group *group,
+		      struct chat_client *client);
+
+/** Remove the client from the group it is in. */
+void
+chat_client_group_remove(struct chat_client_group *group,
+			 struct chat_client *client);
+
+/**
+ * Send what the clients are fed, wait for any update on any of them for
+ * the given timeout and do the updates, as chat_client_update() does for
+ * one. The clients that have got something, or have failed, are then
+ * taken by chat_client_group_next_ready().
+ *
+ * @param group Client group.
+ * @param timeout Timeout in seconds to wait for.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_TIMEOUT - no updates, timed out.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_client_group_update(struct chat_client_group *group, double timeout);
+
+/**
+ * Take the next client that has got something to pop since it was taken
+ * before, or whose update has failed. A failed one isn't updated any more,
+ * and has to be removed to be connected again and added back.
+ *
+ * @param group Client group.
+ * @param error 0, or the error code of the client's update, like the ones
+ *     of chat_client_update(). With CHAT_ERR_SYS errno is its errno.
+ *
+ * @retval not-NULL A client.
+ * @retval NULL No more clients yet.
+ */
+struct chat_client *
+chat_client_group_next_ready(struct chat_client_group *group, int *error);
+
+/**
+ * Get the group's descriptor for the event loops like poll/epoll/kqueue,
+ * the epoll of all its clients.
+ */
+int
+chat_client_group_get_descriptor(const struct chat_client_group *group);
+
+/**
+ * Get a mask of chat_event values wanted by the group. CHAT_EVENT_OUTPUT
+ * means there is something fed to send, which chat_client_group_update()
+ * does without waiting, even though the descriptor is not writable.
+ *
+ * @retval !=0 Event mask to wait for.
+ * @retval 0 No events, no clients.
+ */
+int
+chat_client_group_get_events(const struct chat_client_group *group);
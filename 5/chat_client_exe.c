@@ -12,14 +12,33 @@
 int
 main(int argc, char **argv)
 {
+	/* --low-latency anywhere, see chat_socket_options_low_latency() */
+	bool is_low_latency = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--low-latency") != 0)
+			continue;
+		is_low_latency = true;
+		memmove(&argv[i], &argv[i + 1], sizeof(*argv) * (argc - i));
+		--argc;
+		break;
+	}
 	if (argc < 2) {
-		printf("Expected an address to connect to\n");
+		printf("Expected an address to connect to, or a path of a local server, and optionally a name, \"binary\" and --low-latency\n");
 		return -1;
 	}
 	const char *addr = argv[1];
 	const char *name = argc >= 3 ? argv[2] : "anon";
 	struct chat_client *cli = chat_client_new(name);
-	int rc = chat_client_connect(cli, addr);
+	if (is_low_latency) {
+		struct chat_socket_options opts;
+		chat_socket_options_low_latency(&opts);
+		(void)chat_client_set_socket_options(cli, &opts);
+	}
+	if (argc >= 4 && strcmp(argv[3], "binary") == 0)
+		(void)chat_client_set_protocol(cli, CHAT_PROTO_BINARY);
+	/* A path is of the server's local socket */
+	int rc = addr[0] == '/' ? chat_client_connect_local(cli, addr) :
+		chat_client_connect(cli, addr);
 	if (rc != 0) {
 		printf("Couldn't connect: %d\n", rc);
 		chat_client_delete(cli);
@@ -86,14 +105,15 @@ main(int argc, char **argv)
 			}
 		}
 		/* Flush all the pending messages to the standard output. */
-		struct chat_message *msg;
-		while ((msg = chat_client_pop_next(cli)) != NULL) {
+		struct chat_message_view msg;
+		while (chat_client_peek_next(cli, &msg)) {
 #if NEED_AUTHOR
-			printf("%s: %s\n", msg->author, msg->data);
+			printf("%.*s: %.*s\n", (int)msg.author_size, msg.author,
+			       (int)msg.data_size, msg.data);
 #else
-			printf("%s\n", msg->data);
+			printf("%.*s\n", (int)msg.data_size, msg.data);
 #endif
-			chat_message_delete(msg);
+			chat_client_consume(cli);
 		}
 	}
 	chat_client_delete(cli);
@@ -0,0 +1,79 @@
+#include "chat_frame.h"
+
+size_t
+chat_varint_encode(uint64_t value, char *buf)
+{
+	size_t size = 0;
+	while (value >= 0x80) {
+		buf[size++] = (char)(value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[size++] = (char)value;
+	return size;
+}
+
+int
+chat_varint_decode(const char *buf, size_t size, uint64_t *value)
+{
+	uint64_t res = 0;
+	for (size_t i = 0; i < size; ++i) {
+		if (i == CHAT_VARINT_MAX)
+			return -1;
+		uint8_t byte = buf[i];
+		res |= (uint64_t)(byte & 0x7f) << (7 * i);
+		if (!(byte & 0x80)) {
+			*value = res;
+			return i + 1;
+		}
+	}
+	return size >= CHAT_VARINT_MAX ? -1 : 0;
+}
+
+size_t
+chat_frame_header(enum chat_frame_type type, size_t body_size, char *buf)
+{
+	size_t size = chat_varint_encode(body_size + 1, buf);
+	buf[size++] = (char)type;
+	return size;
+}
+
+ssize_t
+chat_frame_decode(const char *buf, size_t size, struct chat_frame *frame)
+{
+	uint64_t frame_size;
+	int rc = chat_varint_decode(buf, size, &frame_size);
+	if (rc <= 0)
+		return rc;
+	if (frame_size == 0 || frame_size > CHAT_FRAME_MAX_SIZE)
+		return -1;
+	if (size - rc < frame_size)
+		return 0;
+	uint8_t type = buf[rc];
+	if (type < CHAT_FRAME_NAME || type > CHAT_FRAME_RELAY)
+		return -1;
+	frame->type = type;
+	frame->body = buf + rc + 1;
+	frame->body_size = frame_size - 1;
+	return rc + frame_size;
+}
+
+int
+chat_frame_take_id(struct chat_frame *frame, uint32_t *id)
+{
+	uint64_t value;
+	if (chat_frame_take_varint(frame, &value) != 0 || value > UINT32_MAX)
+		return -1;
+	*id = value;
+	return 0;
+}
+
+int
+chat_frame_take_varint(struct chat_frame *frame, uint64_t *value)
+{
+	int rc = chat_varint_decode(frame->body, frame->body_size, value);
+	if (rc <= 0)
+		return -1;
+	frame->body += rc;
+	frame->body_size -= rc;
+	return 0;
+}
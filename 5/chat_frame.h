@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The binary version of the chat protocol. A client offers it with the two
+ * bytes CHAT_FRAME_MAGIC, CHAT_FRAME_VERSION before anything else, which no
+ * text client sends: a name has no '\0'. The server answers with the same
+ * two bytes, and from then on both sides send frames:
+ *
+ *     varint size | type | body of (size - 1) bytes
+ *
+ * The sizes and ids are little-endian base-128 varints, and the bodies are
+ * any bytes, so nobody scans them. The frames are:
+ * - CHAT_FRAME_NAME, client to server: the name of the client, first.
+ * - CHAT_FRAME_MESSAGE, client to server: a message.
+ * - CHAT_FRAME_AUTHOR, server to client: varint id | name. Comes before
+ *   the first message of each author to each client: a name is sent once.
+ * - CHAT_FRAME_MESSAGE, server to client: varint author id | message.
+ *
+ * Since the version 2, for a server that keeps a history, see
+ * chat_server_set_history():
+ * - CHAT_FRAME_SEQ, server to client: varint sequence number of the message
+ *   that comes next. Of the messages dropped for the overflow, only the
+ *   numbers come.
+ * - CHAT_FRAME_RESUME, client to server: varint sequence number of the last
+ *   message the client has got before. Right after the name, for the
+ *   messages after it that the history still has.
+ *
+ * Since the version 3, for a server that compresses, see
+ * chat_server_set_compression():
+ * - CHAT_FRAME_COMPRESS, client to server: empty, once the version is
+ *   agreed on. The client takes CHAT_FRAME_PACKED from then on.
+ * - CHAT_FRAME_PACKED, server to client: varint author id | varint size of
+ *   the message | the message as an LZ4 block, see lz.h. Instead of a
+ *   CHAT_FRAME_MESSAGE of a big enough message, if it is smaller so.
+ *
+ * Since the version 4, between the servers of a cluster, see
+ * chat_server_set_node_id():
+ * - CHAT_FRAME_NODE, both ways: varint node id. The server linking to
+ *   another sends it instead of the name, and the other answers with its
+ *   own. Only these two frames go on such a link then.
+ * - CHAT_FRAME_RELAY, both ways: varint node id of the origin | varint
+ *   sequence number of the message there | varint author id there | varint
+ *   size of the name | name | varint size of the room name + 1, 0 for all
+ *   the rooms | room name | message. The room name is empty for the lobby.
+ *
+ * The versions are agreed on as the lower of the two.
+ */
+
+enum {
+	CHAT_FRAME_MAGIC = 0,
+	CHAT_FRAME_VERSION = 4,
+	/** Most bytes of a varint of 64 bits. */
+	CHAT_VARINT_MAX = 10,
+	/** Most bytes of a frame header: the size and the type. */
+	CHAT_FRAME_HEADER_MAX = CHAT_VARINT_MAX + 1,
+	/** Bigger frames are malformed. */
+	CHAT_FRAME_MAX_SIZE = 64 * 1024 * 1024,
+};
+
+enum chat_frame_type {
+	CHAT_FRAME_NAME = 1,
+	CHAT_FRAME_AUTHOR,
+	CHAT_FRAME_MESSAGE,
+	CHAT_FRAME_SEQ,
+	CHAT_FRAME_RESUME,
+	CHAT_FRAME_COMPRESS,
+	CHAT_FRAME_PACKED,
+	CHAT_FRAME_NODE,
+	CHAT_FRAME_RELAY,
+};
+
+struct chat_frame {
+	enum chat_frame_type type;
+	const char *body;
+	size_t body_size;
+};
+
+/** Write @a value to @a buf of CHAT_VARINT_MAX bytes, return its size. */
+size_t
+chat_varint_encode(uint64_t value, char *buf);
+
+/**
+ * Read a varint from @a buf of @a size bytes.
+ *
+ * @retval >0 Its size, the value is in @a value.
+ * @retval 0 More bytes are needed.
+ * @retval -1 Malformed.
+ */
+int
+chat_varint_decode(const char *buf, size_t size, uint64_t *value);
+
+/**
+ * Write the header of a frame of @a type with a body of @a body_size to
+ * @a buf of CHAT_FRAME_HEADER_MAX bytes, return its size.
+ */
+size_t
+chat_frame_header(enum chat_frame_type type, size_t body_size, char *buf);
+
+/**
+ * Read a frame from @a buf of @a size bytes. The body points into @a buf.
+ *
+ * @retval >0 The size of the whole frame.
+ * @retval 0 More bytes are needed.
+ * @retval -1 Malformed.
+ */
+ssize_t
+chat_frame_decode(const char *buf, size_t size, struct chat_frame *frame);
+
+/**
+ * Read the author id a body of CHAT_FRAME_AUTHOR, CHAT_FRAME_MESSAGE or
+ * CHAT_FRAME_PACKED starts with into @a id, and leave the rest as the body.
+ *
+ * @retval 0 Success.
+ * @retval -1 Malformed.
+ */
+int
+chat_frame_take_id(struct chat_frame *frame, uint32_t *id);
+
+/**
+ * Read a varint the body of @a frame starts with into @a value, and leave
+ * the rest as the body.
+ *
+ * @retval 0 Success.
+ * @retval -1 Malformed.
+ */
+int
+chat_frame_take_varint(struct chat_frame *frame, uint64_t *value);
@@ -1,13 +1,39 @@
+#define _GNU_SOURCE
 #include "chat.h"
+#include "chat_frame.h"
 #include "chat_server.h"
+#include "lz.h"
 #include "partial_message_queue.h"
+#include "shared_buffer.h"
+#include "shm_ring.h"
+#include "spsc_ring.h"
+#include "uring.h"
+#include "perf_region.h"
+#ifdef CHAT_SERVER_CORO
+#include "libcoro.h"
+#endif
+#ifdef CHAT_SERVER_TPOOL
+#include "thread_pool.h"
+#endif
 
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -15,101 +41,1100 @@
 struct chat_peer {
 	/** Client's socket. To read/write messages. */
 	int socket;
-	/// Outgoing message queue
-	struct partial_message_queue outgoing;
+	/// Of the slot in the shard's table, changed each time it is freed
+	uint32_t generation;
+	bool is_used;
+	/// Not used: the next free slot of the table, see chat_shard_new_peer()
+	uint32_t next_free;
+	/// Outgoing messages, shared with the other peers
+	struct shared_buffer_queue outgoing;
+	/// Over the peer output limit, with CHAT_SERVER_OVERFLOW_PAUSE_INPUT
+	bool is_over_limit;
+	/// Disconnected for the overflow: nothing is sent to it any more
+	bool is_shut;
+	/// Has input not read because of CHAT_SERVER_OVERFLOW_PAUSE_INPUT
+	bool is_input_paused;
+	/// In the shard's batch, with what it had queued before, see
+	/// chat_shard_end_batch()
+	bool is_batched;
+	size_t batch_old_size;
 	/// Incoming message queue
 	struct partial_message_queue incoming;
+	/// How much to receive at once, see pmq_recv()
+	size_t recv_hint;
+
+	/// Text until the peer offers the binary protocol with its first bytes
+	enum chat_proto proto;
+	bool is_proto_known;
+	/// Binary protocol only: the version agreed on, see CHAT_FRAME_VERSION
+	uint8_t version;
+	/// Takes CHAT_FRAME_PACKED, see CHAT_FRAME_COMPRESS
+	bool is_packing;
+	/// The messages of the history up to this one the peer has got already
+	uint64_t seen_seq;
+	/// Binary protocol only: bit per author id whose name the peer has got
+	uint8_t *known_authors;
+	size_t known_authors_size;
+
+	/// A link to another server of the cluster, see chat_server_set_node_id(),
+	/// in the shard's `links` and in no room, and the id of that node once
+	/// its CHAT_FRAME_NODE has come, 0 till then
+	bool is_link;
+	uint32_t node_id;
 
+	/// Unique in the server, 0 is the server itself
+	uint32_t author_id;
+	/// CHAT_FRAME_AUTHOR of the peer, made with its first message and
+	/// shared by all of them, NULL till then
+	struct shared_buffer *author_frame;
+	/// The room the peer is in and its place among the members there
+	uint32_t room;
+	uint32_t room_pos;
 #if NEED_AUTHOR
+	/// Without the '\n', in a buffer of `author_cap` kept by the slot
+	bool has_author;
 	char *author;
+	size_t author_len;
+	size_t author_cap;
 #endif
+	/// io_uring backend only, NULL with epoll
+	struct chat_peer_uring *uring;
+	/// Coroutine backend only: the peer's coroutine, and the events it is
+	/// woken up with, see chat_peer_coro_wait()
+	struct coro *coro;
+	uint32_t coro_events;
+	/// Accepted on the local socket, see chat_server_set_local_path(). It
+	/// talks through `shm` once it has sent the memfd, NULL till then.
+	bool is_local;
+	struct shm_channel *shm;
+};
 
-	struct chat_peer *prev, *next;
+/// What the ring does with a peer.
+struct chat_peer_uring {
+	/// Operations in flight: the armed recv and the send
+	int ops;
+	bool is_sending;
+	/// Freed once the last operation ends
+	bool is_closing;
+	/// The recv has ended while the input is paused, to be armed again
+	bool is_recv_stopped;
+	/// Of the send in flight
+	struct msghdr msg;
+	struct iovec iov[SBQ_IOV_MAX];
 };
 
-struct chat_peer *chat_peer_new(int socket, struct chat_peer *next) {
-	struct chat_peer *ret = malloc(sizeof *ret);
-	if (!ret)
-		abort();
-	ret->socket = socket;
-	pmq_init(&ret->outgoing, 16);
-	pmq_init(&ret->incoming, 16);
+enum {
+	/// Most bytes of the incoming queue a free slot keeps for the next peer
+	CHAT_PEER_KEEP_INCOMING = 64 * 1024,
+	/// No next free slot
+	CHAT_PEER_NONE = UINT32_MAX,
+	/// Of the handle of a local peer's eventfd, see chat_peer_notify_handle()
+	CHAT_PEER_NOTIFY = 1u << 31,
+};
+
+/// Makes a new slot of the peers table, with the memory of an empty peer.
+static void chat_peer_init(struct chat_peer *peer) {
+	peer->socket = -1;
+	peer->generation = 0;
+	peer->is_used = false;
+	peer->next_free = CHAT_PEER_NONE;
+	sbq_init(&peer->outgoing);
+	pmq_init(&peer->incoming, 16);
+	peer->coro = NULL;
+	peer->known_authors = NULL;
+	peer->known_authors_size = 0;
+	peer->author_frame = NULL;
 #if NEED_AUTHOR
-	ret->author = NULL;
+	peer->author = NULL;
+	peer->author_cap = 0;
 #endif
-	ret->prev = NULL;
-	ret->next = next;
-	next ? next->prev = ret : 0;
-	return ret;
+	peer->uring = NULL;
+	peer->is_local = false;
+	peer->shm = NULL;
 }
 
-struct chat_peer *chat_peer_delete(struct chat_peer *peer) {
-	(void)close(peer->socket);
-	pmq_destroy(&peer->outgoing);
+/// Frees the memory of a slot of the peers table, used or not.
+static void chat_peer_destroy(struct chat_peer *peer) {
+	if (peer->is_used)
+		(void)close(peer->socket);
+	sbq_destroy(&peer->outgoing);
 	pmq_destroy(&peer->incoming);
+	free(peer->known_authors);
+	if (peer->author_frame)
+		shared_buffer_unref(peer->author_frame);
 #if NEED_AUTHOR
 	free(peer->author);
 #endif
-	struct chat_peer *prev = peer->prev, *next = peer->next;
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
-	free(peer);
-	return next;
+	free(peer->uring);
+	if (peer->shm)
+		shm_channel_destroy(peer->shm);
+	free(peer->shm);
 }
 
-struct chat_server {
+#if NEED_AUTHOR
+/// Keeps the name of the peer, in the buffer of its slot.
+static void chat_peer_set_author(struct chat_peer *peer, const char *author, size_t len) {
+	if (len + 1 > peer->author_cap) {
+		char *buf = realloc(peer->author, len + 1);
+		if (!buf)
+			abort();
+		peer->author = buf;
+		peer->author_cap = len + 1;
+	}
+	memcpy(peer->author, author, len);
+	peer->author[len] = '\0';
+	peer->author_len = len;
+	peer->has_author = true;
+}
+#endif
+
+/// Marks the author's name sent to the peer, returns whether it was already.
+static bool chat_peer_learn_author(struct chat_peer *peer, uint32_t id) {
+	size_t byte = id / 8;
+	if (byte >= peer->known_authors_size) {
+		size_t size = 2 * (byte + 1);
+		uint8_t *known = realloc(peer->known_authors, size);
+		if (!known)
+			abort();
+		memset(known + peer->known_authors_size, 0, size - peer->known_authors_size);
+		peer->known_authors = known;
+		peer->known_authors_size = size;
+	}
+	uint8_t bit = 1 << (id % 8);
+	bool is_known = peer->known_authors[byte] & bit;
+	peer->known_authors[byte] |= bit;
+	return is_known;
+}
+
+/**
+ * A message as it is sent to the peers of either protocol. The buffers are
+ * made once and shared by all the peers.
+ */
+struct chat_broadcast {
+	/// The author line and the message line
+	struct shared_buffer *text;
+	/// CHAT_FRAME_AUTHOR, sent before `binary` to who doesn't know the name
+	struct shared_buffer *author;
+	/// CHAT_FRAME_MESSAGE
+	struct shared_buffer *binary;
+	/// CHAT_FRAME_PACKED instead of `binary`, NULL if not worth it
+	struct shared_buffer *packed;
+	uint32_t author_id;
+	/// Whose peers get it, CHAT_ROOM_ALL for all of them
+	uint32_t room;
+	/// CHAT_FRAME_SEQ before the rest and its number, NULL and 0 if not kept
+	struct shared_buffer *seq_frame;
+	uint64_t seq;
+	/// CHAT_FRAME_RELAY for the links, NULL if the server is not a node, and
+	/// the author id of the link it came on, which doesn't get it back, or 0
+	struct shared_buffer *relay;
+	uint32_t via;
+};
+
+/// Copies `size` bytes to `dst`, with the '\n's as ' ': no text line breaks.
+static void chat_copy_line(char *dst, const char *src, size_t size) {
+	memcpy(dst, src, size);
+	char *lf = dst, *end = dst + size;
+	while ((lf = memchr(lf, '\n', end - lf)))
+		*lf++ = ' ';
+}
+
+/// Makes the CHAT_FRAME_AUTHOR of an author, which its messages share.
+static struct shared_buffer *chat_author_frame_new(uint32_t author_id, const char *author,
+						   size_t author_len) {
+#if !NEED_AUTHOR
+	(void)author;
+	author_len = 0;
+#endif
+	char id[CHAT_VARINT_MAX];
+	size_t id_size = chat_varint_encode(author_id, id);
+	char header[CHAT_FRAME_HEADER_MAX];
+	size_t header_size = chat_frame_header(CHAT_FRAME_AUTHOR, id_size + author_len, header);
+	struct shared_buffer *frame = shared_buffer_new(header_size + id_size + author_len);
+	char *pos = frame->data;
+	memcpy(pos, header, header_size);
+	pos += header_size;
+	memcpy(pos, id, id_size);
+	pos += id_size;
+	memcpy(pos, author, author_len);
+	return frame;
+}
+
+/**
+ * Makes the buffers of a message, with the `author_frame` of the author's,
+ * see chat_author_frame_new(). Only a message of a binary peer can have
+ * '\n's, so only for it the text copy is searched for them, see `has_lf`.
+ */
+static void chat_broadcast_create(struct chat_broadcast *b, uint32_t author_id,
+				  uint32_t room, struct shared_buffer *author_frame,
+				  const char *author, size_t author_len,
+				  const char *msg, size_t msg_len, bool has_lf) {
+#if !NEED_AUTHOR
+	(void)author;
+	(void)author_len;
+#endif
+	char id[CHAT_VARINT_MAX];
+	size_t id_size = chat_varint_encode(author_id, id);
+	char msg_header[CHAT_FRAME_HEADER_MAX];
+	size_t msg_header_size = chat_frame_header(CHAT_FRAME_MESSAGE, id_size + msg_len, msg_header);
+
+	b->author_id = author_id;
+	b->room = room;
+	b->packed = NULL;
+	b->seq_frame = NULL;
+	b->seq = 0;
+	b->relay = NULL;
+	b->via = 0;
+	shared_buffer_ref(author_frame);
+	b->author = author_frame;
+	char *pos;
+	b->binary = shared_buffer_new(msg_header_size + id_size + msg_len);
+	pos = b->binary->data;
+	memcpy(pos, msg_header, msg_header_size);
+	pos += msg_header_size;
+	memcpy(pos, id, id_size);
+	pos += id_size;
+	memcpy(pos, msg, msg_len);
+
+#if NEED_AUTHOR
+	b->text = shared_buffer_new(author_len + 1 + msg_len + 1);
+	memcpy(b->text->data, author, author_len);
+	b->text->data[author_len] = '\n';
+	pos = b->text->data + author_len + 1;
+#else
+	b->text = shared_buffer_new(msg_len + 1);
+	pos = b->text->data;
+#endif
+	if (has_lf)
+		chat_copy_line(pos, msg, msg_len);
+	else
+		memcpy(pos, msg, msg_len);
+	pos[msg_len] = '\n';
+}
+
+/**
+ * Compresses the message for the peers that take CHAT_FRAME_PACKED, once
+ * for all of them, if it is at least `min_size` and gets smaller.
+ */
+static void chat_broadcast_pack(struct chat_broadcast *b, const char *msg, size_t msg_len,
+				size_t min_size) {
+	if (min_size == 0 || msg_len < min_size)
+		return;
+	char id[CHAT_VARINT_MAX], raw_size[CHAT_VARINT_MAX];
+	size_t id_size = chat_varint_encode(b->author_id, id);
+	size_t raw_size_size = chat_varint_encode(msg_len, raw_size);
+	if (msg_len <= raw_size_size)
+		return;
+	size_t capacity = msg_len - raw_size_size - 1;
+	char *block = malloc(capacity ? capacity : 1);
+	if (!block)
+		abort();
+	size_t block_size = lz_compress(msg, msg_len, block, capacity);
+	if (block_size == 0) {
+		free(block);
+		return;
+	}
+	char header[CHAT_FRAME_HEADER_MAX];
+	size_t body_size = id_size + raw_size_size + block_size;
+	size_t header_size = chat_frame_header(CHAT_FRAME_PACKED, body_size, header);
+	b->packed = shared_buffer_new(header_size + body_size);
+	char *pos = b->packed->data;
+	memcpy(pos, header, header_size);
+	pos += header_size;
+	memcpy(pos, id, id_size);
+	pos += id_size;
+	memcpy(pos, raw_size, raw_size_size);
+	pos += raw_size_size;
+	memcpy(pos, block, block_size);
+	free(block);
+}
+
+static void chat_broadcast_ref(const struct chat_broadcast *b) {
+	shared_buffer_ref(b->text);
+	shared_buffer_ref(b->author);
+	shared_buffer_ref(b->binary);
+	if (b->packed)
+		shared_buffer_ref(b->packed);
+	if (b->seq_frame)
+		shared_buffer_ref(b->seq_frame);
+	if (b->relay)
+		shared_buffer_ref(b->relay);
+}
+
+static void chat_broadcast_unref(const struct chat_broadcast *b) {
+	shared_buffer_unref(b->text);
+	shared_buffer_unref(b->author);
+	shared_buffer_unref(b->binary);
+	if (b->packed)
+		shared_buffer_unref(b->packed);
+	if (b->seq_frame)
+		shared_buffer_unref(b->seq_frame);
+	if (b->relay)
+		shared_buffer_unref(b->relay);
+}
+
+/**
+ * The last messages broadcast, numbered in a row from 1, for the binary
+ * peers to catch up on reconnecting, see chat_server_set_history(). A ring
+ * of the broadcasts, under a lock which is also what puts them in order.
+ */
+struct chat_history {
+	pthread_mutex_t lock;
+	/// `capacity` slots, the one of a number is (seq - 1) % capacity
+	struct chat_broadcast *msgs;
+	uint32_t capacity;
+	uint32_t count;
+	/// The number of the next message, the oldest one kept is `count` less
+	uint64_t next_seq;
+};
+
+/// Numbers `b` and keeps it, instead of the oldest one if full. Under the lock.
+static void chat_history_add(struct chat_history *h, struct chat_broadcast *b) {
+	b->seq = h->next_seq++;
+	char seq[CHAT_VARINT_MAX], header[CHAT_FRAME_HEADER_MAX];
+	size_t seq_size = chat_varint_encode(b->seq, seq);
+	size_t header_size = chat_frame_header(CHAT_FRAME_SEQ, seq_size, header);
+	b->seq_frame = shared_buffer_new(header_size + seq_size);
+	memcpy(b->seq_frame->data, header, header_size);
+	memcpy(b->seq_frame->data + header_size, seq, seq_size);
+
+	struct chat_broadcast *slot = &h->msgs[(b->seq - 1) % h->capacity];
+	if (h->count == h->capacity)
+		chat_broadcast_unref(slot);
+	else
+		++h->count;
+	chat_broadcast_ref(b);
+	*slot = *b;
+}
+
+/// Drops all the messages kept and the ring itself.
+static void chat_history_clear(struct chat_history *h) {
+	for (uint64_t seq = h->next_seq - h->count; seq < h->next_seq; ++seq)
+		chat_broadcast_unref(&h->msgs[(seq - 1) % h->capacity]);
+	free(h->msgs);
+	h->msgs = NULL;
+	h->capacity = 0;
+	h->count = 0;
+}
+
+enum {
+	/// Of the last numbers of a node's messages, see chat_node_take_seq()
+	CHAT_NODE_WINDOW = 1024,
+};
+
+/// Who is an author of another node here.
+struct chat_node_author {
+	/// 0 if not known yet
+	uint32_t id;
+	struct shared_buffer *frame;
+};
+
+/**
+ * Another server of the cluster, see chat_server_set_node_id(), as its
+ * messages come on the links, directly or through the others.
+ */
+struct chat_node {
+	uint32_t id;
+	/// The highest number of the node's messages taken, and a bit per each
+	/// of the CHAT_NODE_WINDOW before it and itself, by the number modulo
+	/// the window, set if taken
+	uint64_t top_seq;
+	uint64_t window[CHAT_NODE_WINDOW / 64];
+	/// By the author ids there, which are given in a row too
+	struct chat_node_author *authors;
+	uint32_t author_capacity;
+};
+
+/// The nodes whose messages have come, under a lock, as the links of all
+/// the shards take them.
+struct chat_nodes {
+	pthread_mutex_t lock;
+	struct chat_node *items;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+/**
+ * Marks the number `seq` of a node's message taken, returns whether it was
+ * new: not taken before, and not older than the window. The links of a
+ * cluster with loops bring a message several times, and in the threaded
+ * mode even the messages of one link may come out of order a bit.
+ */
+static bool chat_node_take_seq(struct chat_node *node, uint64_t seq) {
+	if (seq + CHAT_NODE_WINDOW <= node->top_seq)
+		return false;
+	if (seq > node->top_seq) {
+		/* The numbers skipped over are past the window, none taken yet */
+		if (seq - node->top_seq >= CHAT_NODE_WINDOW) {
+			memset(node->window, 0, sizeof(node->window));
+		} else {
+			for (uint64_t i = node->top_seq + 1; i < seq; ++i)
+				node->window[i / 64 % (CHAT_NODE_WINDOW / 64)] &= ~(1ull << (i % 64));
+		}
+		node->top_seq = seq;
+	} else if (node->window[seq / 64 % (CHAT_NODE_WINDOW / 64)] & (1ull << (seq % 64))) {
+		return false;
+	}
+	node->window[seq / 64 % (CHAT_NODE_WINDOW / 64)] |= 1ull << (seq % 64);
+	return true;
+}
+
+/// The node `id`, new if none of its messages has come yet. Under the lock.
+static struct chat_node *chat_nodes_find(struct chat_nodes *nodes, uint32_t id) {
+	for (uint32_t i = 0; i < nodes->count; ++i) {
+		if (nodes->items[i].id == id)
+			return &nodes->items[i];
+	}
+	if (nodes->count == nodes->capacity) {
+		nodes->capacity = nodes->capacity ? 2 * nodes->capacity : 4;
+		nodes->items = realloc(nodes->items, sizeof(*nodes->items) * nodes->capacity);
+		if (!nodes->items)
+			abort();
+	}
+	struct chat_node *node = &nodes->items[nodes->count++];
+	memset(node, 0, sizeof(*node));
+	node->id = id;
+	return node;
+}
+
+static void chat_nodes_destroy(struct chat_nodes *nodes) {
+	for (uint32_t i = 0; i < nodes->count; ++i) {
+		struct chat_node *node = &nodes->items[i];
+		for (uint32_t j = 0; j < node->author_capacity; ++j) {
+			if (node->authors[j].frame)
+				shared_buffer_unref(node->authors[j].frame);
+		}
+		free(node->authors);
+	}
+	free(nodes->items);
+	pthread_mutex_destroy(&nodes->lock);
+}
+
+/**
+ * Messages posted to an event loop by the other threads, see the threaded
+ * mode in chat_server_set_threads(). Any thread pushes to a lock-free
+ * stack, and the owner takes all of it at once. The one who pushes onto
+ * an empty stack wakes the owner up through the eventfd.
+ */
+struct chat_mail {
+	struct chat_mail *next;
+	struct chat_broadcast msg;
+};
+
+struct chat_mailbox {
+	struct chat_mail *head;
+	/// eventfd, readable when there may be mail
+	int fd;
+};
+
+static int chat_mailbox_init(struct chat_mailbox *box) {
+	box->head = NULL;
+	box->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return box->fd < 0 ? -1 : 0;
+}
+
+static void chat_mailbox_wake(struct chat_mailbox *box) {
+	(void)write(box->fd, &(uint64_t){1}, sizeof(uint64_t));
+}
+
+/// Posts `count` messages at once, with one wakeup at most.
+static void chat_mailbox_post_many(struct chat_mailbox *box, const struct chat_broadcast *msgs,
+				   size_t count) {
+	if (count == 0)
+		return;
+	/* A chain from the last one, as the stack has them */
+	struct chat_mail *first = NULL, *last = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		struct chat_mail *mail = malloc(sizeof *mail);
+		if (!mail)
+			abort();
+		chat_broadcast_ref(&msgs[i]);
+		mail->msg = msgs[i];
+		mail->next = first;
+		first = mail;
+		if (!last)
+			last = mail;
+	}
+	struct chat_mail *head = __atomic_load_n(&box->head, __ATOMIC_RELAXED);
+	do {
+		last->next = head;
+	} while (!__atomic_compare_exchange_n(&box->head, &head, first, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* Not `last->next`, the mail may be taken already */
+	if (!head)
+		chat_mailbox_wake(box);
+}
+
+static void chat_mailbox_post(struct chat_mailbox *box, const struct chat_broadcast *msg) {
+	chat_mailbox_post_many(box, msg, 1);
+}
+
+/// Takes all the mail in the order it was posted.
+static struct chat_mail *chat_mailbox_take(struct chat_mailbox *box) {
+	/* Before the exchange, or a wakeup for the mail after it is lost */
+	uint64_t count;
+	(void)read(box->fd, &count, sizeof count);
+	struct chat_mail *mail = __atomic_exchange_n(&box->head, NULL, __ATOMIC_ACQUIRE);
+	struct chat_mail *reversed = NULL;
+	while (mail) {
+		struct chat_mail *next = mail->next;
+		mail->next = reversed;
+		reversed = mail;
+		mail = next;
+	}
+	return reversed;
+}
+
+static void chat_mailbox_destroy(struct chat_mailbox *box) {
+	struct chat_mail *mail = chat_mailbox_take(box);
+	while (mail) {
+		struct chat_mail *next = mail->next;
+		chat_broadcast_unref(&mail->msg);
+		free(mail);
+		mail = next;
+	}
+	(void)close(box->fd);
+}
+
+enum {
+	/// Where every peer starts, and is after it leaves a room
+	CHAT_ROOM_LOBBY = 0,
+	/// A broadcast to each peer, whatever its room
+	CHAT_ROOM_ALL = UINT32_MAX,
+};
+
+struct chat_room_name {
+	/// NULL if the slot is free
+	char *name;
+	size_t len;
+	size_t hash;
+	uint32_t id;
+};
+
+/// A name of chat_room_names by its id, NULL if there is no such room.
+struct chat_room_ref {
+	const char *name;
+	size_t len;
+};
+
+/**
+ * The ids of the rooms by their names, shared by all the shards: a hash table
+ * with linear probing, under a lock, as a join is rare next to the
+ * messages. The ids are given in a row and never reused.
+ */
+struct chat_room_names {
+	pthread_mutex_t lock;
+	/// `capacity`, a power of two, at most 3/4 used
+	struct chat_room_name *slots;
+	size_t capacity;
+	uint32_t count;
+	/// The names by the ids, `id_capacity` of them, for the links, see
+	/// chat_server_room_name(). They point to the ones of `slots`.
+	struct chat_room_ref *by_id;
+	uint32_t id_capacity;
+};
+
+/// The peers of one room in one shard: the slots in the peers table.
+struct chat_room {
+	uint32_t *members;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+/**
+ * The counters of chat_server_loop_stats of a shard. Only its own loop
+ * writes them, with no read-modify-write between the threads, and they are
+ * summed up when read, see chat_server_get_loop_stats().
+ */
+struct chat_shard_metrics {
+	uint64_t updates;
+	uint64_t events;
+	uint64_t full_batches;
+	uint64_t busy_polls;
+	uint64_t busy_ns;
+	uint64_t max_busy_ns;
+	uint64_t accepted_peers;
+	uint64_t accept_errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t messages_received;
+	uint64_t broadcasts;
+	uint64_t deliveries;
+	uint64_t fanout_ns;
+	uint64_t queue_depths[CHAT_SERVER_QUEUE_DEPTH_BUCKETS];
+};
+
+/**
+ * One event loop: a listening socket, an epoll and the peers accepted on
+ * that socket. The server is one shard run by chat_server_update(), or in
+ * the threaded mode several, each with its own thread.
+ */
+struct chat_shard {
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket;
+	/// The first shard only: the local socket, see chat_server_set_local_path()
+	int local_socket;
 	/// epoll descriptor
 	int epoll_fd;
-	/// Peers array
+	/// Epoll backend only: kept open to shed a connection when out of
+	/// descriptors, see chat_shard_shed()
+	int spare_fd;
+	/**
+	 * Peers table: the first `peer_count` of `peer_capacity` slots have
+	 * been used, and the ones free again are a list from `free_peer`. A
+	 * free slot keeps the memory of its queues for the next peer, so the
+	 * peers come and go without the allocator, and a broadcast goes
+	 * through them in a row.
+	 */
 	struct chat_peer *peers;
+	uint32_t peer_count;
+	uint32_t peer_capacity;
+	uint32_t free_peer;
+	/**
+	 * By room id, `room_count` of them: the members here of each room, so
+	 * a message of a room costs just them, see chat_shard_broadcast().
+	 */
+	struct chat_room *rooms;
+	uint32_t room_count;
+	/// The peers that are links to the other nodes, see chat_peer::is_link
+	uint32_t *links;
+	uint32_t link_count;
+	uint32_t link_capacity;
 
 	/// Number of peers that have something to send
 	size_t pending_output_peers;
+	/// Peers queued to without sending yet, by index, see
+	/// chat_shard_end_batch()
+	uint32_t *batch;
+	uint32_t batch_count;
+	uint32_t batch_capacity;
+
+	/// Buffer for `epoll_wait`, see chat_server_set_event_batch()
+	struct epoll_event *events;
+	/// io_uring backend only, instead of the epoll
+	struct uring *ring;
+	struct uring_buf_ring recv_bufs;
+
+	/// Some peers have input not read, see CHAT_SERVER_OVERFLOW_PAUSE_INPUT
+	bool has_paused_input;
+	/// io_uring backend only: `recv_bufs` kept from the kernel while paused
+	uint16_t *held_bufs;
+	size_t held_buf_count;
+
+	/// Threaded mode only: broadcasts of the other shards and the feed. With
+	/// the offload pool it is woken up by the pool too.
+	struct chat_mailbox mailbox;
+	/**
+	 * Threaded mode without the history only: the broadcasts of the other
+	 * shards come here instead, a ring from each by its index, the own one
+	 * unused. Their doorbell is the mailbox.
+	 */
+	struct spsc_ring *inbox;
+	/// What is for the inboxes of the others, by their index, pushed after
+	/// each update, see chat_shard_flush_outbox()
+	struct chat_outbox *outbox;
+	/// Some of `outbox` is not pushed yet
+	bool has_outbox;
+	pthread_t thread;
+	bool is_stopped;
+	/// The received messages in the offload pool and the ones after them, in
+	/// the order they came, see chat_shard_offload()
+	struct chat_offload *offload_head;
+	struct chat_offload *offload_tail;
+
+	struct chat_shard_metrics metrics;
+};
+
+/// Broadcasts to one other shard, see chat_shard_post_others().
+struct chat_outbox {
+	struct chat_broadcast *msgs;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+enum {
+	/// Most peers accepted by an update, see chat_shard_accept()
+	CHAT_SHARD_ACCEPT_BATCH = 64,
+	/// Of each inbox ring of a shard, see chat_shard::inbox
+	CHAT_SHARD_INBOX_SIZE = 256,
+	/// Most broadcasts taken of an inbox ring at once
+	CHAT_SHARD_INBOX_BATCH = 64,
+	/// How soon a shard tries again to push an outbox the full ring didn't take
+	CHAT_SHARD_OUTBOX_RETRY_MS = 1,
+	/// Most text messages taken of a peer at once, see chat_peer_receive()
+	CHAT_PEER_RECEIVE_BATCH = 64,
+};
+
+/// The epoll events that aren't of the peers, see chat_peer_handle().
+enum chat_shard_event {
+	CHAT_SHARD_EVENT_LISTEN = 0,
+	CHAT_SHARD_EVENT_MAILBOX = 1,
+	CHAT_SHARD_EVENT_LOCAL = 2,
+};
+
+struct chat_server {
+	/// The shards, `shard_count` of them, once listening
+	struct chat_shard *shards;
+	uint32_t shard_count;
+	/// Event loop threads, 0 if the loop is run by chat_server_update()
+	uint32_t thread_count;
+	uint32_t event_batch;
+	/// See chat_server_set_busy_poll(): 0 not to spin, -1 not to pin, and
+	/// whether the loop run by chat_server_update() is pinned yet
+	uint32_t busy_poll_us;
+	int busy_poll_cpu;
+	bool is_loop_pinned;
+	enum chat_server_backend backend;
+	struct chat_socket_options socket_options;
+	/// Author ids given so far, atomic. Never reused.
+	uint32_t author_count;
+	struct chat_room_names room_names;
+	struct chat_history history;
+	/// See chat_server_set_node_id(), 0 if not in a cluster, and the number
+	/// of the next message relayed, atomic
+	uint32_t node_id;
+	uint64_t relay_seq;
+	struct chat_nodes nodes;
+	/// See chat_server_set_compression(), 0 to compress none
+	uint32_t pack_min_size;
+	/// See chat_server_set_offload(), NULL to compress in the loop
+	struct thread_pool *offload_pool;
+	uint32_t offload_min_size;
+	/// See chat_server_set_local_path(), NULL for none
+	char *local_path;
+	/// CHAT_FRAME_AUTHOR of the server itself, see chat_server_name
+	struct shared_buffer *author_frame;
+
+	/// See chat_server_set_output_limits(), 0 for no limit
+	size_t peer_output_limit;
+	size_t output_limit;
+	enum chat_server_overflow overflow;
+	/// Atomic: bytes queued for all the peers
+	size_t output_size;
+	/// Atomic: peers over `peer_output_limit`, with CHAT_SERVER_OVERFLOW_PAUSE_INPUT
+	size_t overflown_peers;
+	/// Atomic: some shards have stopped reading
+	bool is_input_paused;
+	/// Atomic: the counters of chat_server_output_stats
+	uint64_t dropped_bytes;
+	uint64_t dropped_messages;
+	uint64_t disconnected_peers;
+	uint64_t input_pauses;
 
-	/// Queue of received messages
+	/// Queue of received messages, as the frames of chat_broadcast
 	struct partial_message_queue received;
+	/// Size of what chat_server_consume() takes, 0 if nothing is peeked
+	size_t peeked_size;
+	/// Threaded mode only: the messages the shards received
+	struct chat_mailbox received_mail;
 };
 
+static uint64_t chat_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Adds to a counter of the shard's own, which the others only read.
+static void chat_metric_add(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static void chat_metric_max(uint64_t *counter, uint64_t value) {
+	if (value > __atomic_load_n(counter, __ATOMIC_RELAXED))
+		__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+/// Counts an update of the loop with `events`, busy since `start_ns`.
+static void chat_shard_count_update(struct chat_shard *shard, uint64_t events, uint64_t start_ns) {
+	struct chat_shard_metrics *m = &shard->metrics;
+	uint64_t busy_ns = chat_now_ns() - start_ns;
+	chat_metric_add(&m->updates, 1);
+	chat_metric_add(&m->events, events);
+	if (!shard->ring && events >= shard->server->event_batch)
+		chat_metric_add(&m->full_batches, 1);
+	chat_metric_add(&m->busy_ns, busy_ns);
+	chat_metric_max(&m->max_busy_ns, busy_ns);
+}
+
+/// The bucket of chat_server_loop_stats::queue_depths for `size` bytes queued.
+static int chat_queue_depth_bucket(size_t size) {
+	if (size <= 1024)
+		return 0;
+	int bucket = (63 - __builtin_clzll(size - 1) - 10) / 2 + 1;
+	return bucket < CHAT_SERVER_QUEUE_DEPTH_BUCKETS ? bucket : CHAT_SERVER_QUEUE_DEPTH_BUCKETS - 1;
+}
+
+static uint32_t chat_server_new_author_id(struct chat_server *server) {
+	return __atomic_add_fetch(&server->author_count, 1, __ATOMIC_RELAXED);
+}
+
+static size_t chat_room_hash(const char *name, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+	return (size_t)hash;
+}
+
+/// The free slot for `hash`, or the one of `name`.
+static struct chat_room_name *chat_room_names_find(struct chat_room_name *slots, size_t capacity,
+						   const char *name, size_t len, size_t hash) {
+	size_t i = hash & (capacity - 1);
+	for (; slots[i].name; i = (i + 1) & (capacity - 1)) {
+		struct chat_room_name *slot = &slots[i];
+		if (slot->hash == hash && slot->len == len && memcmp(slot->name, name, len) == 0)
+			break;
+	}
+	return &slots[i];
+}
+
+/// The slot of `name`, or the free one for it, growing the table. Under the lock.
+static struct chat_room_name *chat_room_names_slot(struct chat_room_names *names, const char *name,
+						   size_t len, size_t hash) {
+	if (4 * (names->count + 1) > 3 * names->capacity) {
+		size_t capacity = names->capacity ? 2 * names->capacity : 64;
+		struct chat_room_name *slots = calloc(capacity, sizeof(*slots));
+		if (!slots)
+			abort();
+		for (size_t i = 0; i < names->capacity; ++i) {
+			struct chat_room_name *old = &names->slots[i];
+			if (old->name)
+				*chat_room_names_find(slots, capacity, old->name, old->len, old->hash) = *old;
+		}
+		free(names->slots);
+		names->slots = slots;
+		names->capacity = capacity;
+	}
+	return chat_room_names_find(names->slots, names->capacity, name, len, hash);
+}
+
+/// Puts the name of a new `slot` by the id too. Under the lock.
+static void chat_room_names_index(struct chat_room_names *names, const struct chat_room_name *slot) {
+	if (slot->id >= names->id_capacity) {
+		uint32_t capacity = 2 * names->id_capacity > slot->id ? 2 * names->id_capacity : slot->id + 1;
+		struct chat_room_ref *by_id = realloc(names->by_id, sizeof(*by_id) * capacity);
+		if (!by_id)
+			abort();
+		memset(by_id + names->id_capacity, 0, sizeof(*by_id) * (capacity - names->id_capacity));
+		names->by_id = by_id;
+		names->id_capacity = capacity;
+	}
+	names->by_id[slot->id] = (struct chat_room_ref){.name = slot->name, .len = slot->len};
+}
+
+/// The name of the room `id`, which is kept till the server is deleted.
+static struct chat_room_ref chat_server_room_name(struct chat_server *server, uint32_t id) {
+	struct chat_room_names *names = &server->room_names;
+	pthread_mutex_lock(&names->lock);
+	struct chat_room_ref ref = id < names->id_capacity ? names->by_id[id] :
+		(struct chat_room_ref){.name = NULL, .len = 0};
+	pthread_mutex_unlock(&names->lock);
+	return ref;
+}
+
+/// The id of the room `name`, which is new if nobody has joined it yet.
+static uint32_t chat_server_room_id(struct chat_server *server, const char *name, size_t len) {
+	struct chat_room_names *names = &server->room_names;
+	size_t hash = chat_room_hash(name, len);
+	pthread_mutex_lock(&names->lock);
+	struct chat_room_name *slot = chat_room_names_slot(names, name, len, hash);
+	if (!slot->name) {
+		slot->name = malloc(len);
+		if (!slot->name)
+			abort();
+		memcpy(slot->name, name, len);
+		slot->len = len;
+		slot->hash = hash;
+		slot->id = ++names->count;
+		chat_room_names_index(names, slot);
+	}
+	uint32_t id = slot->id;
+	pthread_mutex_unlock(&names->lock);
+	return id;
+}
+
+/**
+ * Makes the CHAT_FRAME_RELAY of a message of this node for the links, see
+ * chat_server_set_node_id(): by the author `author_id` here, to the room of
+ * `b`.
+ */
+static void chat_broadcast_relay(struct chat_broadcast *b, struct chat_server *server,
+				 uint32_t author_id, const char *author, size_t author_len,
+				 const char *msg, size_t msg_len) {
+	struct chat_room_ref room = {.name = NULL, .len = 0};
+	if (b->room != CHAT_ROOM_ALL && b->room != CHAT_ROOM_LOBBY)
+		room = chat_server_room_name(server, b->room);
+	char head[5 * CHAT_VARINT_MAX];
+	size_t head_size = chat_varint_encode(server->node_id, head);
+	uint64_t seq = __atomic_fetch_add(&server->relay_seq, 1, __ATOMIC_RELAXED);
+	head_size += chat_varint_encode(seq, head + head_size);
+	head_size += chat_varint_encode(author_id, head + head_size);
+	head_size += chat_varint_encode(author_len, head + head_size);
+	char room_size[CHAT_VARINT_MAX];
+	size_t room_size_size = chat_varint_encode(b->room == CHAT_ROOM_ALL ? 0 : room.len + 1,
+						   room_size);
+	size_t body_size = head_size + author_len + room_size_size + room.len + msg_len;
+	char header[CHAT_FRAME_HEADER_MAX];
+	size_t header_size = chat_frame_header(CHAT_FRAME_RELAY, body_size, header);
+	b->relay = shared_buffer_new(header_size + body_size);
+	char *pos = b->relay->data;
+	memcpy(pos, header, header_size);
+	pos += header_size;
+	memcpy(pos, head, head_size);
+	pos += head_size;
+	if (author_len > 0)
+		memcpy(pos, author, author_len);
+	pos += author_len;
+	memcpy(pos, room_size, room_size_size);
+	pos += room_size_size;
+	if (room.len > 0)
+		memcpy(pos, room.name, room.len);
+	pos += room.len;
+	memcpy(pos, msg, msg_len);
+}
+
+/// The author of the feed and of what the server tells the peers.
+static const char chat_server_name[] = "server";
+
 struct chat_server *
 chat_server_new(void)
 {
 	struct chat_server *server = calloc(1, sizeof(*server));
-	server->socket = -1;
-	server->epoll_fd = -1;
-	server->peers = NULL;
-
-	server->pending_output_peers = 0;
+	server->shards = NULL;
+	server->shard_count = 0;
+	server->thread_count = 0;
+	server->event_batch = CHAT_SERVER_EVENT_BATCH;
+	server->busy_poll_us = 0;
+	server->busy_poll_cpu = -1;
+	server->pack_min_size = 0;
+	server->backend = CHAT_SERVER_BACKEND_EPOLL;
+	chat_socket_options_init(&server->socket_options);
+	server->author_count = 0;
+	server->peer_output_limit = 0;
+	server->output_limit = 0;
+	server->overflow = CHAT_SERVER_OVERFLOW_DROP_OLDEST;
+	pthread_mutex_init(&server->room_names.lock, NULL);
+	pthread_mutex_init(&server->history.lock, NULL);
+	server->history.next_seq = 1;
+	pthread_mutex_init(&server->nodes.lock, NULL);
 
 	pmq_init(&server->received, 16);
+	server->received_mail.fd = -1;
+	server->author_frame = chat_author_frame_new(0, chat_server_name, sizeof(chat_server_name) - 1);
 
 	return server;
 }
 
+static void chat_shard_drop_offloaded(struct chat_shard *shard);
+
+static void chat_shard_destroy(struct chat_shard *shard) {
+	/* Before the mailbox, the pool wakes it up */
+	chat_shard_drop_offloaded(shard);
+	if (shard->ring) {
+		/* First, for nothing in flight to touch the peers */
+		uring_buf_ring_destroy(shard->ring, &shard->recv_bufs);
+		uring_destroy(shard->ring);
+		free(shard->ring);
+	}
+	if (shard->socket >= 0)
+		close(shard->socket);
+	if (shard->local_socket >= 0)
+		close(shard->local_socket);
+	if (shard->epoll_fd >= 0)
+		close(shard->epoll_fd);
+	if (shard->spare_fd >= 0)
+		close(shard->spare_fd);
+	free(shard->events);
+	free(shard->held_bufs);
+	free(shard->batch);
+	if (shard->mailbox.fd >= 0)
+		chat_mailbox_destroy(&shard->mailbox);
+	uint32_t shard_count = shard->server->shard_count;
+	for (uint32_t i = 0; shard->inbox && i < shard_count; ++i) {
+		struct chat_broadcast b;
+		while (spsc_ring_pop(&shard->inbox[i], &b, 1) == 1)
+			chat_broadcast_unref(&b);
+		spsc_ring_destroy(&shard->inbox[i]);
+	}
+	free(shard->inbox);
+	for (uint32_t i = 0; shard->outbox && i < shard_count; ++i) {
+		struct chat_outbox *out = &shard->outbox[i];
+		for (uint32_t j = 0; j < out->count; ++j)
+			chat_broadcast_unref(&out->msgs[j]);
+		free(out->msgs);
+	}
+	free(shard->outbox);
+
+#ifdef CHAT_SERVER_CORO
+	/* Waiting for the events of their peers, which never come now */
+	for (uint32_t i = 0; i < shard->peer_count; ++i) {
+		if (shard->peers[i].coro)
+			coro_delete(shard->peers[i].coro);
+	}
+#endif
+	for (uint32_t i = 0; i < shard->peer_count; ++i)
+		chat_peer_destroy(&shard->peers[i]);
+	free(shard->peers);
+	for (uint32_t i = 0; i < shard->room_count; ++i)
+		free(shard->rooms[i].members);
+	free(shard->rooms);
+	free(shard->links);
+}
+
+/// Stops the first `thread_count` shard threads and frees all the shards.
+static void chat_server_stop(struct chat_server *server, uint32_t thread_count) {
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		__atomic_store_n(&shard->is_stopped, true, __ATOMIC_RELEASE);
+		chat_mailbox_wake(&shard->mailbox);
+		pthread_join(shard->thread, NULL);
+	}
+	if (server->shards[0].local_socket >= 0)
+		(void)unlink(server->local_path);
+	for (uint32_t i = 0; i < server->shard_count; ++i)
+		chat_shard_destroy(&server->shards[i]);
+	free(server->shards);
+	server->shards = NULL;
+	server->shard_count = 0;
+	server->output_size = 0;
+	server->overflown_peers = 0;
+	server->is_input_paused = false;
+	if (server->received_mail.fd >= 0)
+		chat_mailbox_destroy(&server->received_mail);
+	server->received_mail.fd = -1;
+}
+
 void
 chat_server_delete(struct chat_server *server)
 {
-	if (server->socket >= 0)
-		close(server->socket);
-	if (server->epoll_fd >= 0)
-		close(server->epoll_fd);
+	if (server->shard_count > 0)
+		chat_server_stop(server, server->thread_count);
 	pmq_destroy(&server->received);
-
-	while (server->peers)
-		server->peers = chat_peer_delete(server->peers);
+	struct chat_room_names *names = &server->room_names;
+	for (size_t i = 0; i < names->capacity; ++i)
+		free(names->slots[i].name);
+	free(names->slots);
+	free(names->by_id);
+	pthread_mutex_destroy(&names->lock);
+	chat_history_clear(&server->history);
+	pthread_mutex_destroy(&server->history.lock);
+	chat_nodes_destroy(&server->nodes);
+	free(server->local_path);
+	shared_buffer_unref(server->author_frame);
 
 	free(server);
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
-{
-	if (server->socket >= 0)
-		return CHAT_ERR_ALREADY_STARTED;
+static int chat_shard_uring_start(struct chat_shard *shard);
+static int chat_shard_start(struct chat_shard *shard);
 
+/**
+ * Listen on @a port with the shard's own socket and epoll, or ring. With
+ * @a reuse_port the other shards listen on the same port and the kernel
+ * spreads the connections between them.
+ */
+static int chat_shard_listen(struct chat_shard *shard, uint16_t port, bool reuse_port) {
 	/*
 	 * 1) Create a server socket (function socket()).
 	 * 2) Bind the server socket to addr (function bind()).
@@ -117,16 +1142,21 @@ chat_server_listen(struct chat_server *server, uint16_t port)
 	 * 4) Create epoll/kqueue if needed.
 	 */
 
-	server->socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (0 > server->socket) {
+	shard->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (0 > shard->socket) {
 		return CHAT_ERR_SYS;
 	}
-	if (0 > fcntl(server->socket, F_SETFL, O_NONBLOCK)) {
-	    (void)close(server->socket);
-	    server->socket = -1;
-	    return CHAT_ERR_SYS;
+	(void)setsockopt(shard->socket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof (int)); /* If fails, ok */
+	if (reuse_port &&
+			0 > setsockopt(shard->socket, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof (int))) {
+		return CHAT_ERR_SYS;
 	}
-	(void)setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof (int)); /* If fails, ok */
+	/* Before listen(), for the buffers to count in the window scale */
+	const struct chat_socket_options *opts = &shard->server->socket_options;
+	chat_socket_options_apply(opts, shard->socket);
+	if (opts->defer_accept_s > 0)
+		(void)setsockopt(shard->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				 &opts->defer_accept_s, sizeof(int));
 
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -134,240 +1164,2474 @@ chat_server_listen(struct chat_server *server, uint16_t port)
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	if (0 > bind(server->socket, (struct sockaddr *)&addr, sizeof addr)) {
-		int save_errno = errno;
-		(void)close(server->socket);
-		server->socket = -1;
-		errno = save_errno;
+	if (0 > bind(shard->socket, (struct sockaddr *)&addr, sizeof addr)) {
 		if (errno == EADDRINUSE)
 			return CHAT_ERR_PORT_BUSY;
+		return CHAT_ERR_SYS;
 	}
-	if (0 > listen(server->socket, 100) ||
-			0 > (server->epoll_fd = epoll_create(321))) {
-		int save_errno = errno;
-		(void)close(server->socket);
-		server->socket = -1;
-		errno = save_errno;
+	if (0 > listen(shard->socket, opts->backlog))
+		return CHAT_ERR_SYS;
+	return chat_shard_start(shard);
+}
+
+#ifndef EPIOCSPARAMS
+/// Of Linux 6.9, not in the older headers
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+enum {
+	/// Packets the epoll takes of the device per busy poll, the kernel's own default
+	CHAT_EPOLL_BUSY_POLL_BUDGET = 8,
+};
+
+/**
+ * With chat_socket_options::busy_poll_us, makes the epoll poll the device
+ * of the peers while waiting, as their reads do. An older kernel has no
+ * such ioctl, and then only the reads poll.
+ */
+static void chat_shard_epoll_busy_poll(struct chat_shard *shard) {
+	const struct chat_socket_options *opts = &shard->server->socket_options;
+	if (opts->busy_poll_us <= 0)
+		return;
+	struct epoll_params params = {
+		.busy_poll_usecs = opts->busy_poll_us,
+		.busy_poll_budget = CHAT_EPOLL_BUSY_POLL_BUDGET,
+		.prefer_busy_poll = opts->prefer_busy_poll,
+		.__pad = 0,
+	};
+	(void)ioctl(shard->epoll_fd, EPIOCSPARAMS, &params);
+}
+
+/// Makes the epoll, or the ring, of the shard listening on its socket.
+static int chat_shard_start(struct chat_shard *shard) {
+	if (shard->server->backend == CHAT_SERVER_BACKEND_URING)
+		return chat_shard_uring_start(shard);
+	if (0 > (shard->epoll_fd = epoll_create(321))) {
 		return CHAT_ERR_SYS;
 	}
+	chat_shard_epoll_busy_poll(shard);
+	shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-	if (0 > epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->socket,
-				&(struct epoll_event){.events = EPOLLIN, .data.ptr = NULL})) {
-		int save_errno = errno;
-		(void)close(server->epoll_fd);
-		(void)close(server->socket);
-		server->socket = server->epoll_fd = -1;
-		errno = save_errno;
+	/* Level-triggered: what chat_shard_accept() leaves is reported again */
+	if (0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->socket,
+				&(struct epoll_event){.events = EPOLLIN, .data.u64 = CHAT_SHARD_EVENT_LISTEN})) {
+		return CHAT_ERR_SYS;
+	}
+	if (shard->mailbox.fd >= 0 &&
+			0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->mailbox.fd,
+				&(struct epoll_event){.events = EPOLLIN | EPOLLET, .data.u64 = CHAT_SHARD_EVENT_MAILBOX})) {
 		return CHAT_ERR_SYS;
 	}
 
 	return 0;
 }
 
-static int broadcast_message(struct chat_server *server, const char *author, size_t author_len, const char *msg, size_t msg_len, const struct chat_peer *except)
-{
-#if !NEED_AUTHOR
-	(void)author;
-	(void)author_len;
-#endif
+/// Listens for the local clients too, see chat_server_set_local_path().
+static int chat_shard_listen_local(struct chat_shard *shard, const char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	shard->local_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (shard->local_socket < 0)
+		return CHAT_ERR_SYS;
+	/* Left by a server before, nobody listens there */
+	(void)unlink(path);
+	if (0 > bind(shard->local_socket, (struct sockaddr *)&addr, sizeof(addr)) ||
+			0 > listen(shard->local_socket, shard->server->socket_options.backlog))
+		return CHAT_ERR_SYS;
+	if (0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->local_socket,
+			  &(struct epoll_event){.events = EPOLLIN, .data.u64 = CHAT_SHARD_EVENT_LOCAL}))
+		return CHAT_ERR_SYS;
+	return 0;
+}
 
-	for (struct chat_peer *other = server->peers; other; other = other->next) {
-		if (other == except)
-			continue;
+/// Makes the inbox rings and the outboxes of a shard, see chat_shard::inbox.
+static void chat_shard_init_inbox(struct chat_shard *shard) {
+	struct chat_server *server = shard->server;
+	shard->inbox = calloc(server->shard_count, sizeof(*shard->inbox));
+	shard->outbox = calloc(server->shard_count, sizeof(*shard->outbox));
+	if (!shard->inbox || !shard->outbox)
+		abort();
+	for (uint32_t i = 0; i < server->shard_count; ++i) {
+		if (&server->shards[i] != shard &&
+				spsc_ring_init(&shard->inbox[i], CHAT_SHARD_INBOX_SIZE,
+					       sizeof(struct chat_broadcast), shard->mailbox.fd) != 0)
+			abort();
+	}
+}
 
-		if (!*other->outgoing.read) {
-			++server->pending_output_peers;
-			int err = epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD,
-				other->socket, &(struct epoll_event){
-					.events = EPOLLIN | EPOLLOUT,
-					.data.ptr = other
-				});
-			if (err)
-			    return CHAT_ERR_SYS;
-		}
-#if NEED_AUTHOR
-		pmq_put(&other->outgoing, author, author_len);
-#endif
-		pmq_put(&other->outgoing, msg, msg_len);
+/**
+ * Makes the `count` shards of the server and what their loops need but
+ * the sockets: the events, the mailboxes and the inboxes.
+ */
+static int chat_server_new_shards(struct chat_server *server, uint32_t count) {
+	bool is_threaded = server->thread_count > 0;
+	server->shards = calloc(count, sizeof(*server->shards));
+	if (!server->shards)
+		abort();
+	server->shard_count = count;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		shard->server = server;
+		shard->socket = -1;
+		shard->local_socket = -1;
+		shard->epoll_fd = -1;
+		shard->spare_fd = -1;
+		shard->mailbox.fd = -1;
+		shard->free_peer = CHAT_PEER_NONE;
+	}
+	if (is_threaded && chat_mailbox_init(&server->received_mail) != 0)
+		return CHAT_ERR_SYS;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		shard->events = malloc(sizeof(*shard->events) * server->event_batch);
+		if (!shard->events)
+			abort();
+		if ((is_threaded || server->offload_pool) && chat_mailbox_init(&shard->mailbox) != 0)
+			return CHAT_ERR_SYS;
+		if (is_threaded && server->history.capacity == 0)
+			chat_shard_init_inbox(shard);
 	}
 	return 0;
 }
 
+static void *chat_shard_f(void *arg);
+
 int
-chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
+chat_server_listen(struct chat_server *server, uint16_t port)
 {
-#if NEED_SERVER_FEED
-	if (server->socket < 0)
-		return CHAT_ERR_NOT_STARTED;
-
-	static const char server_s[] = "server\n";
-	static const size_t server_s_len = sizeof server_s - 1;
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->local_path && server->backend == CHAT_SERVER_BACKEND_URING)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	/* libcoro runs the coroutines of a thread, the local peers aren't its */
+	if (server->backend == CHAT_SERVER_BACKEND_CORO && (server->thread_count > 0 || server->local_path))
+		return CHAT_ERR_NOT_IMPLEMENTED;
 
-	return broadcast_message(server, server_s, server_s_len, msg, msg_size, NULL);
-#else
-	(void)server;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
-#endif
+	bool is_threaded = server->thread_count > 0;
+	uint32_t count = is_threaded ? server->thread_count : 1;
+	int rc = chat_server_new_shards(server, count);
+	for (uint32_t i = 0; i < count && rc == 0; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		rc = chat_shard_listen(shard, port, is_threaded);
+		if (rc == 0 && port == 0 && count > 1) {
+			/* The rest join the port the kernel has chosen */
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+			if (0 > getsockname(shard->socket, (struct sockaddr *)&addr, &len))
+				rc = CHAT_ERR_SYS;
+			port = ntohs(addr.sin_port);
+		}
+	}
+	if (rc == 0 && server->local_path)
+		rc = chat_shard_listen_local(&server->shards[0], server->local_path);
+	uint32_t started = 0;
+	for (; started < server->thread_count && rc == 0; ++started) {
+		struct chat_shard *shard = &server->shards[started];
+		int err = pthread_create(&shard->thread, NULL, chat_shard_f, shard);
+		if (err) {
+			errno = err;
+			rc = CHAT_ERR_SYS;
+			break;
+		}
+	}
+	if (rc != 0) {
+		int save_errno = errno;
+		chat_server_stop(server, started);
+		errno = save_errno;
+	}
+	return rc;
 }
 
 int
-chat_server_update(struct chat_server *server, double timeout)
+chat_server_set_event_batch(struct chat_server *server, uint32_t size)
 {
-	if (server->socket < 0)
-		return CHAT_ERR_NOT_STARTED;
-
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-
-	const size_t events_cnt = 10;
-	struct epoll_event events[events_cnt];
-	int res = epoll_wait(server->epoll_fd, events, events_cnt, timeout * 1000);
-	if (0 > res)
-		return CHAT_ERR_SYS;
-	else if (0 == res)
-		return CHAT_ERR_TIMEOUT;
-	else {
-		for (int i = 0; i < res; ++i) {
-			if (!events[i].data.ptr) {
-				// Server passive socket
-				int sock;
-				while (0 < (sock = accept(server->socket, NULL, NULL))) {
-				    if (0 > fcntl(sock, F_SETFL, O_NONBLOCK)) {
-					    (void)close(sock);
-					    return CHAT_ERR_SYS;
-				    }
-				    server->peers = chat_peer_new(sock, server->peers);
-				    if (0 > epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock,
-						      &(struct epoll_event){.events = EPOLLIN, .data.ptr = server->peers})) {
-					    // Failed to add to epoll...
-					    int save_errno = errno;
-					    server->peers = chat_peer_delete(server->peers);
-					    (void)close(sock);
-					    errno = save_errno;
-					    return CHAT_ERR_SYS;
-				    }
-				}
-				if (sock < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-					return CHAT_ERR_SYS;
-			} else {
-				// Peer
-				struct chat_peer *peer = events[i].data.ptr;
-				if (events[i].events & EPOLLIN) {
-					const size_t bufsz = 1024;
-					char buf[bufsz];
-
-					ssize_t got;
-					while ((got = recv(peer->socket, buf, bufsz, 0)) > 0) {
-						pmq_put(&peer->incoming, buf, got);
-					}
-					if (got == 0) {
-						// Disconnected...
-
-						if (*peer->outgoing.read)
-							--server->pending_output_peers;
-
-						int err = epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
-						if (err)
-							return CHAT_ERR_SYS;
-
-						if (server->peers == peer)
-							server->peers = chat_peer_delete(peer);
-						else
-							chat_peer_delete(peer);
-
-						continue;
-					} else if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-						return CHAT_ERR_SYS;
-					} else {
-						// Successful `recv`. Process the received data
-						char *msg;
-						while ((msg = pmq_next_message(&peer->incoming))) {
-							size_t len = strlen(msg);
-							msg[len++] = '\n';  // '\0' -> '\n'
-
-#if NEED_AUTHOR
-							if (!peer->author) {
-								peer->author = strndup(msg, len);
-								continue;
-							}
-
-                            char *author = peer->author;
-							size_t author_len = strlen(peer->author);
-							pmq_put(&server->received, peer->author, author_len);
-#else
-                            char *author = NULL;
-                            size_t author_len = 0;
-#endif
-							pmq_put(&server->received, msg, len);
-							int err = broadcast_message(server, author, author_len, msg, len, peer);
-							if (err)
-								return err;
-						}
-					}
-				}
-				if (events[i].events & EPOLLOUT) {
-					// Abusing partial_message_queue implementation
-					ssize_t sent = 1;
-					while (*peer->outgoing.read && sent > 0) {
-						sent = send(peer->socket, peer->outgoing.read, strlen(peer->outgoing.read), 0);
-						peer->outgoing.read += sent;
-					}
-					if (!*peer->outgoing.read) {
-						--server->pending_output_peers;
-						int err = epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD,
-							peer->socket, &(struct epoll_event){
-								.events = EPOLLIN,
-								.data.ptr = peer
-							});
-						if (err)
-						    return CHAT_ERR_SYS;
-					}
-					if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-						return CHAT_ERR_SYS;
-					}
-				}
-			}
-		}
+	if (size == 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->thread_count > 0 && server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	for (uint32_t i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		struct epoll_event *events = realloc(shard->events, sizeof(*events) * size);
+		if (!events)
+			abort();
+		shard->events = events;
 	}
+	server->event_batch = size;
 	return 0;
 }
 
-struct chat_message *
-chat_server_pop_next(struct chat_server *server)
+int
+chat_server_set_backend(struct chat_server *server, enum chat_server_backend backend)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+#ifndef CHAT_SERVER_CORO
+	if (backend == CHAT_SERVER_BACKEND_CORO)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+	if (backend != CHAT_SERVER_BACKEND_EPOLL && backend != CHAT_SERVER_BACKEND_URING &&
+			backend != CHAT_SERVER_BACKEND_CORO)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->backend = backend;
+	return 0;
+}
+
+int
+chat_server_set_socket_options(struct chat_server *server,
+			       const struct chat_socket_options *opts)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	int rc = chat_socket_options_check(opts);
+	if (rc != 0)
+		return rc;
+	server->socket_options = *opts;
+	return 0;
+}
+
+int
+chat_server_set_busy_poll(struct chat_server *server, uint32_t spin_us, int cpu)
 {
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (cpu < -1)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->busy_poll_us = spin_us;
+	server->busy_poll_cpu = cpu;
+	return 0;
+}
+
+int
+chat_server_set_threads(struct chat_server *server, uint32_t count)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (count > CHAT_SERVER_MAX_THREADS)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->thread_count = count;
+	return 0;
+}
+
+int
+chat_server_set_output_limits(struct chat_server *server, size_t peer_limit,
+			      size_t total_limit, enum chat_server_overflow policy)
+{
+	if (policy != CHAT_SERVER_OVERFLOW_DROP_OLDEST &&
+			policy != CHAT_SERVER_OVERFLOW_DISCONNECT &&
+			policy != CHAT_SERVER_OVERFLOW_PAUSE_INPUT)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->thread_count > 0 && server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->peer_output_limit = peer_limit;
+	server->output_limit = total_limit;
+	server->overflow = policy;
+	return 0;
+}
+
+int
+chat_server_set_compression(struct chat_server *server, uint32_t min_size)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->pack_min_size = min_size;
+	return 0;
+}
+
+int
+chat_server_set_offload(struct chat_server *server, struct thread_pool *pool,
+			uint32_t min_size)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+#ifdef CHAT_SERVER_TPOOL
+	server->offload_pool = pool;
+	server->offload_min_size = min_size;
+	return 0;
+#else
+	(void)pool;
+	(void)min_size;
+	return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+int
+chat_server_set_local_path(struct chat_server *server, const char *path)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (path && (path[0] == '\0' ||
+		     strlen(path) >= sizeof(((struct sockaddr_un *)NULL)->sun_path)))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	free(server->local_path);
+	server->local_path = NULL;
+	if (path && !(server->local_path = strdup(path)))
+		abort();
+	return 0;
+}
+
+int
+chat_server_set_history(struct chat_server *server, uint32_t count)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	struct chat_history *h = &server->history;
+	chat_history_clear(h);
+	if (count == 0)
+		return 0;
+	h->msgs = malloc(sizeof(*h->msgs) * count);
+	if (!h->msgs)
+		abort();
+	h->capacity = count;
+	return 0;
+}
+
+int
+chat_server_set_node_id(struct chat_server *server, uint32_t id)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (id == 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->node_id = id;
+	/* Past the numbers of before a restart, which the others have seen */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	server->relay_seq = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return 0;
+}
+
+void
+chat_server_get_output_stats(const struct chat_server *server,
+			     struct chat_server_output_stats *stats)
+{
+	stats->queued_bytes = __atomic_load_n(&server->output_size, __ATOMIC_RELAXED);
+	stats->dropped_bytes = __atomic_load_n(&server->dropped_bytes, __ATOMIC_RELAXED);
+	stats->dropped_messages = __atomic_load_n(&server->dropped_messages, __ATOMIC_RELAXED);
+	stats->disconnected_peers = __atomic_load_n(&server->disconnected_peers, __ATOMIC_RELAXED);
+	stats->input_pauses = __atomic_load_n(&server->input_pauses, __ATOMIC_RELAXED);
+}
+
+void
+chat_server_get_loop_stats(const struct chat_server *server,
+			   struct chat_server_loop_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (uint32_t i = 0; i < server->shard_count; ++i) {
+		const struct chat_shard_metrics *m = &server->shards[i].metrics;
+		stats->updates += __atomic_load_n(&m->updates, __ATOMIC_RELAXED);
+		stats->events += __atomic_load_n(&m->events, __ATOMIC_RELAXED);
+		stats->full_batches += __atomic_load_n(&m->full_batches, __ATOMIC_RELAXED);
+		stats->busy_polls += __atomic_load_n(&m->busy_polls, __ATOMIC_RELAXED);
+		stats->busy_ns += __atomic_load_n(&m->busy_ns, __ATOMIC_RELAXED);
+		uint64_t max_busy_ns = __atomic_load_n(&m->max_busy_ns, __ATOMIC_RELAXED);
+		if (max_busy_ns > stats->max_busy_ns)
+			stats->max_busy_ns = max_busy_ns;
+		stats->accepted_peers += __atomic_load_n(&m->accepted_peers, __ATOMIC_RELAXED);
+		stats->accept_errors += __atomic_load_n(&m->accept_errors, __ATOMIC_RELAXED);
+		stats->bytes_in += __atomic_load_n(&m->bytes_in, __ATOMIC_RELAXED);
+		stats->bytes_out += __atomic_load_n(&m->bytes_out, __ATOMIC_RELAXED);
+		stats->messages_received += __atomic_load_n(&m->messages_received, __ATOMIC_RELAXED);
+		stats->broadcasts += __atomic_load_n(&m->broadcasts, __ATOMIC_RELAXED);
+		stats->deliveries += __atomic_load_n(&m->deliveries, __ATOMIC_RELAXED);
+		stats->fanout_ns += __atomic_load_n(&m->fanout_ns, __ATOMIC_RELAXED);
+		for (int j = 0; j < CHAT_SERVER_QUEUE_DEPTH_BUCKETS; ++j)
+			stats->queue_depths[j] += __atomic_load_n(&m->queue_depths[j], __ATOMIC_RELAXED);
+	}
+}
+
+int
+chat_server_format_stats(const struct chat_server *server, char *buf, size_t size)
+{
+	struct chat_server_loop_stats loop;
+	struct chat_server_output_stats output;
+	chat_server_get_loop_stats(server, &loop);
+	chat_server_get_output_stats(server, &output);
+	int len = snprintf(buf, size,
+			   "updates %llu\nevents %llu\nfull_batches %llu\nbusy_polls %llu\n"
+			   "busy_ns %llu\nmax_busy_ns %llu\naccepted_peers %llu\naccept_errors %llu\n"
+			   "bytes_in %llu\nbytes_out %llu\nmessages_received %llu\n"
+			   "broadcasts %llu\ndeliveries %llu\nfanout_ns %llu\n"
+			   "queued_bytes %zu\ndropped_bytes %llu\ndropped_messages %llu\n"
+			   "disconnected_peers %llu\ninput_pauses %llu\n",
+			   (unsigned long long)loop.updates, (unsigned long long)loop.events,
+			   (unsigned long long)loop.full_batches, (unsigned long long)loop.busy_polls,
+			   (unsigned long long)loop.busy_ns,
+			   (unsigned long long)loop.max_busy_ns, (unsigned long long)loop.accepted_peers,
+			   (unsigned long long)loop.accept_errors,
+			   (unsigned long long)loop.bytes_in, (unsigned long long)loop.bytes_out,
+			   (unsigned long long)loop.messages_received, (unsigned long long)loop.broadcasts,
+			   (unsigned long long)loop.deliveries, (unsigned long long)loop.fanout_ns,
+			   output.queued_bytes, (unsigned long long)output.dropped_bytes,
+			   (unsigned long long)output.dropped_messages,
+			   (unsigned long long)output.disconnected_peers,
+			   (unsigned long long)output.input_pauses);
+	/* Each bucket by its upper bound, the last one by its lower one */
+	for (int i = 0; i < CHAT_SERVER_QUEUE_DEPTH_BUCKETS; ++i) {
+		bool is_last = i == CHAT_SERVER_QUEUE_DEPTH_BUCKETS - 1;
+		size_t bound = (size_t)1024 << 2 * (is_last ? i - 1 : i);
+		bool has_room = (size_t)len < size;
+		len += snprintf(has_room ? buf + len : NULL, has_room ? size - len : 0,
+				"queue_depth_%s%zu %llu\n", is_last ? "gt_" : "le_", bound,
+				(unsigned long long)loop.queue_depths[i]);
+	}
+	return len;
+}
+
+/// Whether the output is over a limit with CHAT_SERVER_OVERFLOW_PAUSE_INPUT.
+static bool chat_server_should_pause(struct chat_server *server) {
+	if (server->overflow != CHAT_SERVER_OVERFLOW_PAUSE_INPUT)
+		return false;
+	if (__atomic_load_n(&server->overflown_peers, __ATOMIC_SEQ_CST) > 0)
+		return true;
+	return server->output_limit != 0 &&
+		__atomic_load_n(&server->output_size, __ATOMIC_SEQ_CST) > server->output_limit;
+}
+
+/**
+ * Counts the change of the peer's queue from `old_size` bytes. A shorter
+ * queue may let the paused input go on. Each shard checks for that at the
+ * end of its update, see chat_shard_update(), but the others may be asleep.
+ */
+static void chat_shard_account(struct chat_shard *shard, struct chat_peer *peer, size_t old_size) {
+	struct chat_server *server = shard->server;
+	size_t size = peer->outgoing.size;
+	if (size == old_size)
+		return;
+	if (!shard->ring && old_size == 0)
+		++shard->pending_output_peers;
+	else if (!shard->ring && size == 0)
+		--shard->pending_output_peers;
+	if (size > old_size)
+		__atomic_add_fetch(&server->output_size, size - old_size, __ATOMIC_SEQ_CST);
+	else
+		__atomic_sub_fetch(&server->output_size, old_size - size, __ATOMIC_SEQ_CST);
+
+	bool is_over = server->peer_output_limit != 0 && size > server->peer_output_limit;
+	if (is_over != peer->is_over_limit) {
+		peer->is_over_limit = is_over;
+		if (is_over)
+			__atomic_add_fetch(&server->overflown_peers, 1, __ATOMIC_SEQ_CST);
+		else
+			__atomic_sub_fetch(&server->overflown_peers, 1, __ATOMIC_SEQ_CST);
+	}
+
+	if (size < old_size && __atomic_load_n(&server->is_input_paused, __ATOMIC_SEQ_CST) &&
+			!chat_server_should_pause(server) &&
+			__atomic_exchange_n(&server->is_input_paused, false, __ATOMIC_SEQ_CST)) {
+		for (uint32_t i = 0; i < server->thread_count; ++i) {
+			if (&server->shards[i] != shard)
+				chat_mailbox_wake(&server->shards[i].mailbox);
+		}
+	}
+}
+
+/// Leaves the peer's input to chat_shard_resume_input().
+static void chat_shard_pause_input(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_server *server = shard->server;
+	peer->is_input_paused = true;
+	shard->has_paused_input = true;
+	if (!__atomic_exchange_n(&server->is_input_paused, true, __ATOMIC_SEQ_CST))
+		__atomic_add_fetch(&server->input_pauses, 1, __ATOMIC_RELAXED);
+}
+
+static int chat_peer_flush_local(struct chat_peer *peer);
+
+/**
+ * Send what the peer has queued until the socket is full. The peers are in
+ * the epoll edge-triggered, so there will be an EPOLLOUT once the socket
+ * has room again, no need to ask for it.
+ */
+static int chat_peer_flush(struct chat_shard *shard, struct chat_peer *peer) {
+	if (peer->is_shut)
+		return 0;
+	size_t old_size = peer->outgoing.size;
+	int rc = 0;
+	if (peer->is_local) {
+		if (peer->shm)
+			rc = chat_peer_flush_local(peer);
+	} else {
+		ssize_t sent = 1;
+		while (!sbq_is_empty(&peer->outgoing) && sent > 0)
+			sent = sbq_send(&peer->outgoing, peer->socket);
+		if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			rc = CHAT_ERR_SYS;
+	}
+	chat_metric_add(&shard->metrics.bytes_out, old_size - peer->outgoing.size);
+	return rc;
+}
+
+/// Drops the oldest of the peer's output down to `size` bytes.
+static void chat_shard_drop_output(struct chat_shard *shard, struct chat_peer *peer, size_t size) {
+	struct chat_server *server = shard->server;
+	/* What the ring is sending is in use by the kernel */
+	size_t skip = peer->uring && peer->uring->is_sending ? peer->uring->msg.msg_iovlen : 0;
+	size_t old_size = peer->outgoing.size, count = 0;
+	size_t dropped = sbq_drop(&peer->outgoing, skip, size, &count);
+	if (dropped == 0)
+		return;
+	__atomic_add_fetch(&server->dropped_bytes, dropped, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&server->dropped_messages, count, __ATOMIC_RELAXED);
+	chat_shard_account(shard, peer, old_size);
+}
+
+/**
+ * Disconnects the peer for the overflow. The socket is only shut down, so
+ * the loop finds the peer gone as usual and frees it.
+ */
+static void chat_shard_disconnect(struct chat_shard *shard, struct chat_peer *peer) {
+	if (peer->is_shut)
+		return;
+	peer->is_shut = true;
+	(void)shutdown(peer->socket, SHUT_RDWR);
+	chat_shard_drop_output(shard, peer, 0);
+	__atomic_add_fetch(&shard->server->disconnected_peers, 1, __ATOMIC_RELAXED);
+}
+
+/// Applies the overflow policy to the peer, which has just got more to send.
+static void chat_shard_check_overflow(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_server *server = shard->server;
+	size_t size = peer->outgoing.size;
+	size_t target = SIZE_MAX;
+	if (server->peer_output_limit != 0 && size > server->peer_output_limit)
+		target = server->peer_output_limit;
+	size_t total = __atomic_load_n(&server->output_size, __ATOMIC_SEQ_CST);
+	if (server->output_limit != 0 && total > server->output_limit && size > 0) {
+		/* The peer is behind: what it has couldn't be sent right away */
+		size_t excess = total - server->output_limit;
+		size_t total_target = size > excess ? size - excess : 0;
+		if (total_target < target)
+			target = total_target;
+	}
+	if (target == SIZE_MAX)
+		return;
+	switch (server->overflow) {
+	case CHAT_SERVER_OVERFLOW_DROP_OLDEST:
+		chat_shard_drop_output(shard, peer, target);
+		break;
+	case CHAT_SERVER_OVERFLOW_DISCONNECT:
+		chat_shard_disconnect(shard, peer);
+		break;
+	case CHAT_SERVER_OVERFLOW_PAUSE_INPUT:
+		/* The readers check chat_server_should_pause() */
+		break;
+	}
+}
+
+static void chat_uring_send(struct chat_shard *shard, struct chat_peer *peer);
+
+/// Sends what is queued to the peer since it had `old_size` bytes, if it can.
+static void chat_shard_output(struct chat_shard *shard, struct chat_peer *peer, size_t old_size) {
+	if (shard->ring) {
+		chat_uring_send(shard, peer);
+	} else if (old_size == 0) {
+		/*
+		 * Most of the time the socket has room, so send right away. If it
+		 * fails, the peer's EPOLLIN finds out why and disconnects it. If
+		 * there was something queued, it waits for EPOLLOUT already.
+		 */
+		(void)chat_peer_flush(shard, peer);
+	}
+	chat_shard_account(shard, peer, old_size);
+	chat_shard_check_overflow(shard, peer);
+}
+
+/**
+ * Queues `buf` to the peer and sends it, if it can. Pinned, it is never
+ * dropped for the overflow, see sbq_push_pinned().
+ */
+static void chat_shard_send(struct chat_shard *shard, struct chat_peer *peer,
+			    struct shared_buffer *buf, bool is_pinned) {
+	if (peer->is_shut)
+		return;
+	size_t old_size = peer->outgoing.size;
+	if (is_pinned)
+		sbq_push_pinned(&peer->outgoing, buf);
+	else
+		sbq_push(&peer->outgoing, buf);
+	chat_shard_output(shard, peer, old_size);
+}
+
+/// Puts the peer among the members of `room` in the shard.
+static void chat_shard_room_add(struct chat_shard *shard, struct chat_peer *peer, uint32_t room) {
+	if (room >= shard->room_count) {
+		uint32_t count = 2 * shard->room_count > room ? 2 * shard->room_count : room + 1;
+		struct chat_room *rooms = realloc(shard->rooms, sizeof(*rooms) * count);
+		if (!rooms)
+			abort();
+		memset(rooms + shard->room_count, 0, sizeof(*rooms) * (count - shard->room_count));
+		shard->rooms = rooms;
+		shard->room_count = count;
+	}
+	struct chat_room *r = &shard->rooms[room];
+	if (r->count == r->capacity) {
+		uint32_t capacity = r->capacity ? 2 * r->capacity : 4;
+		uint32_t *members = realloc(r->members, sizeof(*members) * capacity);
+		if (!members)
+			abort();
+		r->members = members;
+		r->capacity = capacity;
+	}
+	peer->room = room;
+	peer->room_pos = r->count;
+	r->members[r->count++] = peer - shard->peers;
+}
+
+/// Takes the peer out of its room, the last member taking its place.
+static void chat_shard_room_remove(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_room *r = &shard->rooms[peer->room];
+	uint32_t last = r->members[--r->count];
+	r->members[peer->room_pos] = last;
+	shard->peers[last].room_pos = peer->room_pos;
+}
+
+/// Makes the peer a link to another node, out of its room.
+static void chat_shard_add_link(struct chat_shard *shard, struct chat_peer *peer) {
+	if (shard->link_count == shard->link_capacity) {
+		uint32_t capacity = shard->link_capacity ? 2 * shard->link_capacity : 4;
+		uint32_t *links = realloc(shard->links, sizeof(*links) * capacity);
+		if (!links)
+			abort();
+		shard->links = links;
+		shard->link_capacity = capacity;
+	}
+	chat_shard_room_remove(shard, peer);
+	peer->is_link = true;
+	shard->links[shard->link_count++] = peer - shard->peers;
+}
+
+/**
+ * Takes a slot of the peers table for a new peer on `socket`: a free one, or
+ * a new one. Growing the table moves the peers, so no pointer to them may be
+ * kept over this.
+ */
+static struct chat_peer *chat_shard_new_peer(struct chat_shard *shard, int socket) {
+	struct chat_peer *peer;
+	if (shard->free_peer != CHAT_PEER_NONE) {
+		peer = &shard->peers[shard->free_peer];
+		shard->free_peer = peer->next_free;
+	} else {
+		if (shard->peer_count == shard->peer_capacity) {
+			uint32_t capacity = shard->peer_capacity ? 2 * shard->peer_capacity : 16;
+			struct chat_peer *peers = realloc(shard->peers, sizeof(*peers) * capacity);
+			if (!peers)
+				abort();
+			shard->peers = peers;
+			shard->peer_capacity = capacity;
+		}
+		peer = &shard->peers[shard->peer_count++];
+		chat_peer_init(peer);
+	}
+	/* Generation 0 is never used, see chat_shard_peer() */
+	if (++peer->generation == 0)
+		++peer->generation;
+	peer->is_used = true;
+	peer->socket = socket;
+	chat_metric_add(&shard->metrics.accepted_peers, 1);
+	/* Most are inherited from the listening socket, but not all */
+	chat_socket_options_apply(&shard->server->socket_options, socket);
+	peer->is_over_limit = false;
+	peer->is_shut = false;
+	peer->is_input_paused = false;
+	peer->is_batched = false;
+	peer->recv_hint = PMQ_RECV_MIN;
+	peer->proto = CHAT_PROTO_TEXT;
+	peer->is_proto_known = false;
+	peer->version = 0;
+	peer->is_packing = false;
+	peer->seen_seq = 0;
+	peer->is_link = false;
+	peer->node_id = 0;
+	if (peer->known_authors)
+		memset(peer->known_authors, 0, peer->known_authors_size);
+	if (peer->author_frame)
+		shared_buffer_unref(peer->author_frame);
+	peer->author_frame = NULL;
+	peer->author_id = chat_server_new_author_id(shard->server);
 #if NEED_AUTHOR
-	char *author = pmq_next_message(&server->received), *data = pmq_next_message(&server->received);
-	if (!author) {
+	peer->has_author = false;
+	peer->author_len = 0;
+#endif
+	if (shard->ring && !peer->uring) {
+		peer->uring = malloc(sizeof(*peer->uring));
+		if (!peer->uring)
+			abort();
+	}
+	if (peer->uring)
+		memset(peer->uring, 0, sizeof(*peer->uring));
+	chat_shard_room_add(shard, peer, CHAT_ROOM_LOBBY);
+	return peer;
+}
+
+/// Frees the peer, with everything it has queued, and its slot.
+static void chat_shard_delete_peer(struct chat_shard *shard, struct chat_peer *peer) {
+	size_t old_size = peer->outgoing.size;
+	sbq_clear(&peer->outgoing);
+	chat_shard_account(shard, peer, old_size);
+	if (peer->is_link) {
+		uint32_t *link = shard->links;
+		while (*link != (uint32_t)(peer - shard->peers))
+			++link;
+		*link = shard->links[--shard->link_count];
+	} else {
+		chat_shard_room_remove(shard, peer);
+	}
+	(void)close(peer->socket);
+	if (peer->shm) {
+		/* Its eventfd leaves the epoll with it */
+		shm_channel_destroy(peer->shm);
+		free(peer->shm);
+		peer->shm = NULL;
+	}
+	peer->is_local = false;
+	pmq_clear(&peer->incoming, CHAT_PEER_KEEP_INCOMING);
+	/* The coroutine deletes its peer itself, and is freed as it ends */
+	peer->coro = NULL;
+	peer->is_used = false;
+	peer->next_free = shard->free_peer;
+	shard->free_peer = peer - shard->peers;
+}
+
+/**
+ * Identifies the peer in the epoll events: the slot and its generation,
+ * which a stale event of a peer since gone doesn't match. The listening
+ * socket and the mailbox are the generation 0, see chat_shard_event.
+ */
+static uint64_t chat_peer_handle(const struct chat_shard *shard, const struct chat_peer *peer) {
+	return (uint64_t)peer->generation << 32 | (uint32_t)(peer - shard->peers);
+}
+
+/// Identifies the eventfd of a local peer, like its socket is.
+static uint64_t chat_peer_notify_handle(const struct chat_shard *shard, const struct chat_peer *peer) {
+	return chat_peer_handle(shard, peer) | CHAT_PEER_NOTIFY;
+}
+
+/// The peer of chat_peer_handle() or of chat_peer_notify_handle(), NULL if it is gone.
+static struct chat_peer *chat_shard_peer(struct chat_shard *shard, uint64_t handle) {
+	uint32_t index = (uint32_t)handle & ~CHAT_PEER_NOTIFY;
+	if (index >= shard->peer_count)
 		return NULL;
+	struct chat_peer *peer = &shard->peers[index];
+	if (!peer->is_used || peer->generation != handle >> 32)
+		return NULL;
+	return peer;
+}
+
+/// Queues the frames of `msg` to a binary peer, without sending them.
+static void chat_peer_push_frames(struct chat_peer *peer, const struct chat_broadcast *msg) {
+	/* The number and the name are what the rest relies on, never dropped */
+	if (msg->seq_frame && peer->version >= 2)
+		sbq_push_pinned(&peer->outgoing, msg->seq_frame);
+	if (!chat_peer_learn_author(peer, msg->author_id))
+		sbq_push_pinned(&peer->outgoing, msg->author);
+	sbq_push(&peer->outgoing, msg->packed && peer->is_packing ? msg->packed : msg->binary);
+}
+
+/**
+ * Queues `msg` to the peer in its protocol, unless it has got it already,
+ * in the shard's batch: it is sent by chat_shard_end_batch().
+ */
+static void chat_shard_batch_message(struct chat_shard *shard, struct chat_peer *peer,
+				     const struct chat_broadcast *msg) {
+	if (peer->is_shut || (msg->seq != 0 && msg->seq <= peer->seen_seq))
+		return;
+	if (!peer->is_batched) {
+		if (shard->batch_count == shard->batch_capacity) {
+			uint32_t capacity = shard->batch_capacity ? shard->batch_capacity * 2 : 16;
+			uint32_t *batch = realloc(shard->batch, sizeof(*batch) * capacity);
+			if (!batch)
+				abort();
+			shard->batch = batch;
+			shard->batch_capacity = capacity;
+		}
+		shard->batch[shard->batch_count++] = peer - shard->peers;
+		peer->is_batched = true;
+		peer->batch_old_size = peer->outgoing.size;
+	}
+	chat_metric_add(&shard->metrics.deliveries, 1);
+	if (peer->is_link)
+		sbq_push(&peer->outgoing, msg->relay);
+	else if (peer->proto == CHAT_PROTO_TEXT)
+		sbq_push(&peer->outgoing, msg->text);
+	else
+		chat_peer_push_frames(peer, msg);
+}
+
+/**
+ * Sends what the batch has queued, once per peer whatever the number of
+ * the messages: one system call, and the limits checked once.
+ */
+static void chat_shard_end_batch(struct chat_shard *shard) {
+	for (uint32_t i = 0; i < shard->batch_count; ++i) {
+		struct chat_peer *peer = &shard->peers[shard->batch[i]];
+		peer->is_batched = false;
+		chat_metric_add(&shard->metrics.queue_depths[chat_queue_depth_bucket(peer->outgoing.size)], 1);
+		chat_shard_output(shard, peer, peer->batch_old_size);
+	}
+	shard->batch_count = 0;
+}
+
+/// Queues `msg` to the peer in its protocol, unless it has got it already.
+static void chat_shard_send_message(struct chat_shard *shard, struct chat_peer *peer, const struct chat_broadcast *msg) {
+	chat_shard_batch_message(shard, peer, msg);
+	chat_shard_end_batch(shard);
+}
+
+static void chat_shard_batch_to_room(struct chat_shard *shard, const struct chat_broadcast *msg) {
+	/* Every room goes to the other nodes, but back where it came from */
+	for (uint32_t i = 0; msg->relay && i < shard->link_count; ++i) {
+		struct chat_peer *link = &shard->peers[shard->links[i]];
+		if (link->author_id != msg->via)
+			chat_shard_batch_message(shard, link, msg);
+	}
+	if (msg->room == CHAT_ROOM_ALL) {
+		for (uint32_t i = 0; i < shard->peer_count; ++i) {
+			struct chat_peer *other = &shard->peers[i];
+			if (other->is_used && !other->is_link && other->author_id != msg->author_id)
+				chat_shard_batch_message(shard, other, msg);
+		}
+		return;
+	}
+	if (msg->room >= shard->room_count)
+		return;
+	const struct chat_room *room = &shard->rooms[msg->room];
+	for (uint32_t i = 0; i < room->count; ++i) {
+		struct chat_peer *other = &shard->peers[room->members[i]];
+		if (other->author_id != msg->author_id)
+			chat_shard_batch_message(shard, other, msg);
+	}
+}
+
+/// Queues `msg` to the shard's peers of its room but its author, in the batch.
+static void chat_shard_batch_broadcast(struct chat_shard *shard, const struct chat_broadcast *msg) {
+	uint64_t start_ns = chat_now_ns();
+	chat_shard_batch_to_room(shard, msg);
+	chat_metric_add(&shard->metrics.broadcasts, 1);
+	chat_metric_add(&shard->metrics.fanout_ns, chat_now_ns() - start_ns);
+}
+
+/// Queue `msg` to the shard's peers of its room but its author.
+static void chat_shard_broadcast(struct chat_shard *shard, const struct chat_broadcast *msg) {
+	chat_shard_batch_broadcast(shard, msg);
+	chat_shard_end_batch(shard);
+}
+
+/**
+ * Sends the peer the messages of the history after `seq` for its room, all
+ * queued at once to go out in as few system calls as they fit. The ones
+ * still on their way to the shard then are not sent again, see `seen_seq`.
+ */
+static void chat_shard_replay(struct chat_shard *shard, struct chat_peer *peer, uint64_t seq) {
+	struct chat_history *h = &shard->server->history;
+	if (h->capacity == 0 || peer->is_shut)
+		return;
+	size_t old_size = peer->outgoing.size;
+	pthread_mutex_lock(&h->lock);
+	uint64_t first = h->next_seq - h->count;
+	for (uint64_t i = seq >= first ? seq + 1 : first; i < h->next_seq; ++i) {
+		const struct chat_broadcast *msg = &h->msgs[(i - 1) % h->capacity];
+		if ((msg->room == peer->room || msg->room == CHAT_ROOM_ALL) &&
+				msg->author_id != peer->author_id)
+			chat_peer_push_frames(peer, msg);
+	}
+	peer->seen_seq = h->next_seq - 1;
+	pthread_mutex_unlock(&h->lock);
+	chat_shard_output(shard, peer, old_size);
+}
+
+/**
+ * Sends `msg` to the other shards, which broadcast it to their peers. With
+ * the inboxes it goes to the outboxes of `except`, the shard itself, for
+ * chat_shard_flush_outbox().
+ */
+static void chat_shard_post_others(struct chat_server *server, const struct chat_broadcast *msg, struct chat_shard *except) {
+	for (uint32_t i = 0; i < server->thread_count; ++i) {
+		if (&server->shards[i] == except)
+			continue;
+		if (!except || !except->outbox) {
+			chat_mailbox_post(&server->shards[i].mailbox, msg);
+			continue;
+		}
+		struct chat_outbox *out = &except->outbox[i];
+		if (out->count == out->capacity) {
+			out->capacity = out->capacity ? out->capacity * 2 : 16;
+			out->msgs = realloc(out->msgs, sizeof(*out->msgs) * out->capacity);
+			if (!out->msgs)
+				abort();
+		}
+		chat_broadcast_ref(msg);
+		out->msgs[out->count++] = *msg;
+		except->has_outbox = true;
+	}
+}
+
+/**
+ * Pushes the outboxes to the inboxes of the other shards, all the messages
+ * of an update at once. What a full ring doesn't take stays for the next
+ * time, after the messages before it.
+ */
+static void chat_shard_flush_outbox(struct chat_shard *shard) {
+	if (!shard->has_outbox)
+		return;
+	struct chat_server *server = shard->server;
+	uint32_t self = shard - server->shards;
+	shard->has_outbox = false;
+	for (uint32_t i = 0; i < server->shard_count; ++i) {
+		struct chat_outbox *out = &shard->outbox[i];
+		if (out->count == 0)
+			continue;
+		/* The references go with them */
+		uint32_t pushed = spsc_ring_push(&server->shards[i].inbox[self], out->msgs, out->count);
+		out->count -= pushed;
+		memmove(out->msgs, out->msgs + pushed, sizeof(*out->msgs) * out->count);
+		if (out->count > 0)
+			shard->has_outbox = true;
+	}
+}
+
+/// Tells the peer something from the server, as a message of its own.
+static void chat_shard_notify(struct chat_shard *shard, struct chat_peer *peer,
+			      const char *msg, size_t msg_len) {
+	struct chat_broadcast b;
+	chat_broadcast_create(&b, 0, peer->room, shard->server->author_frame, chat_server_name,
+			      sizeof(chat_server_name) - 1, msg, msg_len, false);
+	chat_shard_send_message(shard, peer, &b);
+	chat_broadcast_unref(&b);
+}
+
+static bool chat_is_prefix(const char *prefix, const char *msg, size_t msg_len) {
+	size_t len = strlen(prefix);
+	return msg_len >= len && memcmp(msg, prefix, len) == 0;
+}
+
+/**
+ * Does the room command of the peer, if the message is one, see
+ * CHAT_CMD_JOIN. The peer is told the room it is in then, which is also
+ * when its messages start going there.
+ */
+static bool chat_shard_command(struct chat_shard *shard, struct chat_peer *peer,
+			       const char *msg, size_t msg_len) {
+	uint32_t room;
+	if (msg_len > strlen(CHAT_CMD_JOIN) && chat_is_prefix(CHAT_CMD_JOIN, msg, msg_len)) {
+		const char *name = msg + strlen(CHAT_CMD_JOIN);
+		size_t len = msg_len - strlen(CHAT_CMD_JOIN);
+		room = chat_server_room_id(shard->server, name, len);
+	} else if (msg_len == strlen(CHAT_CMD_LEAVE) && chat_is_prefix(CHAT_CMD_LEAVE, msg, msg_len)) {
+		room = CHAT_ROOM_LOBBY;
+	} else {
+		return false;
+	}
+	if (room != peer->room) {
+		chat_shard_room_remove(shard, peer);
+		chat_shard_room_add(shard, peer, room);
+	}
+	if (room == CHAT_ROOM_LOBBY) {
+		chat_shard_notify(shard, peer, CHAT_NOTE_LOBBY, strlen(CHAT_NOTE_LOBBY));
+		return true;
+	}
+	/* The name may have a '\n' from a binary peer, not for a text line */
+	size_t note_len = strlen(CHAT_NOTE_JOINED) + msg_len - strlen(CHAT_CMD_JOIN);
+	char *note = malloc(note_len);
+	if (!note)
+		abort();
+	memcpy(note, CHAT_NOTE_JOINED, strlen(CHAT_NOTE_JOINED));
+	chat_copy_line(note + strlen(CHAT_NOTE_JOINED), msg + strlen(CHAT_CMD_JOIN),
+		       msg_len - strlen(CHAT_CMD_JOIN));
+	chat_shard_notify(shard, peer, note, note_len);
+	free(note);
+	return true;
+}
+
+/// Broadcasts a received message, packed already, and drops it.
+static void chat_shard_publish(struct chat_shard *shard, struct chat_broadcast *b) {
+	struct chat_server *server = shard->server;
+	struct chat_history *history = &server->history;
+	bool has_history = history->capacity > 0;
+	if (has_history) {
+		pthread_mutex_lock(&history->lock);
+		chat_history_add(history, b);
+	}
+	if (server->thread_count > 0) {
+		/*
+		 * The others first: what the server has is with them already. With
+		 * the history the own peers get it by mail too, under the lock, so
+		 * each shard has the messages in the order of their numbers.
+		 */
+		chat_shard_post_others(server, b, has_history ? NULL : shard);
+		chat_mailbox_post(&server->received_mail, b);
+	} else {
+		pmq_put(&server->received, b->author->data, b->author->size);
+		pmq_put(&server->received, b->binary->data, b->binary->size);
+	}
+	if (has_history)
+		pthread_mutex_unlock(&history->lock);
+	if (!has_history || server->thread_count == 0)
+		chat_shard_broadcast(shard, b);
+	chat_broadcast_unref(b);
+}
+
+#ifdef CHAT_SERVER_TPOOL
+
+/// A received message packed in the offload pool, see chat_shard_offload().
+struct chat_offload {
+	struct chat_offload *next;
+	struct chat_shard *shard;
+	struct chat_broadcast msg;
+	/// The text, at the end of the binary frame of `msg`
+	const char *text;
+	size_t text_len;
+	/// Atomic: packed, the task is only to be joined
+	bool is_done;
+	/// NULL if packed in the loop, waiting for the ones before it
+	struct thread_task *task;
+	struct thread_task_storage storage;
+};
+
+static void *chat_offload_f(void *arg) {
+	struct chat_offload *o = arg;
+	struct chat_shard *shard = o->shard;
+	chat_broadcast_pack(&o->msg, o->text, o->text_len, shard->server->pack_min_size);
+	/* Freed only after the join, which waits for the return */
+	__atomic_store_n(&o->is_done, true, __ATOMIC_RELEASE);
+	chat_mailbox_wake(&shard->mailbox);
+	return NULL;
+}
+
+#endif
+
+/// Publishes the offloaded messages from the first one, up to one not packed yet.
+static void chat_shard_publish_offloaded(struct chat_shard *shard) {
+#ifdef CHAT_SERVER_TPOOL
+	struct chat_offload *o;
+	while ((o = shard->offload_head) && __atomic_load_n(&o->is_done, __ATOMIC_ACQUIRE)) {
+		if (o->task) {
+			void *result;
+			(void)thread_task_join(o->task, &result);
+			(void)thread_task_delete(o->task);
+		}
+		shard->offload_head = o->next;
+		if (!shard->offload_head)
+			shard->offload_tail = NULL;
+		chat_shard_publish(shard, &o->msg);
+		free(o);
 	}
-	assert(data);
 #else
-	char *data = pmq_next_message(&server->received);
-	if (!data) {
-		return NULL;
+	(void)shard;
+#endif
+}
+
+/// Drops the offloaded messages, once the pool is done with them.
+static void chat_shard_drop_offloaded(struct chat_shard *shard) {
+#ifdef CHAT_SERVER_TPOOL
+	while (shard->offload_head) {
+		struct chat_offload *o = shard->offload_head;
+		if (o->task) {
+			void *result;
+			(void)thread_task_join(o->task, &result);
+			(void)thread_task_delete(o->task);
+		}
+		shard->offload_head = o->next;
+		chat_broadcast_unref(&o->msg);
+		free(o);
+	}
+	shard->offload_tail = NULL;
+#else
+	(void)shard;
+#endif
+}
+
+/**
+ * Packs `b` of a text of `msg_len` in the offload pool if it is big enough, see
+ * chat_server_set_offload(), or in the loop if the ones before it are still
+ * there. Either way it is queued after them, to be published in the order.
+ * Returns `false` if nothing is queued, for the caller to pack and publish.
+ */
+static bool chat_shard_offload(struct chat_shard *shard, struct chat_broadcast *b,
+			       size_t msg_len) {
+#ifdef CHAT_SERVER_TPOOL
+	struct chat_server *server = shard->server;
+	bool is_heavy = server->offload_pool && server->pack_min_size > 0 &&
+		msg_len >= server->pack_min_size && msg_len >= server->offload_min_size;
+	if (!is_heavy && !shard->offload_head)
+		return false;
+	struct chat_offload *o = malloc(sizeof(*o));
+	if (!o)
+		abort();
+	o->next = NULL;
+	o->shard = shard;
+	o->msg = *b;
+	/* The incoming queue moves on, the frame stays */
+	o->text = b->binary->data + b->binary->size - msg_len;
+	o->text_len = msg_len;
+	o->is_done = false;
+	o->task = NULL;
+	if (is_heavy) {
+		(void)thread_task_init(&o->task, &o->storage, chat_offload_f, o);
+		if (thread_pool_push_task(server->offload_pool, o->task) != 0) {
+			/* Too many tasks or shut down, then in the loop */
+			(void)thread_task_delete(o->task);
+			o->task = NULL;
+			is_heavy = false;
+		}
+	}
+	if (!is_heavy) {
+		chat_broadcast_pack(&o->msg, o->text, o->text_len, server->pack_min_size);
+		o->is_done = true;
+	}
+	if (shard->offload_tail)
+		shard->offload_tail->next = o;
+	else
+		shard->offload_head = o;
+	shard->offload_tail = o;
+	if (!is_heavy)
+		chat_shard_publish_offloaded(shard);
+	return true;
+#else
+	(void)shard;
+	(void)b;
+	(void)msg_len;
+	return false;
+#endif
+}
+
+/// Broadcasts a message of `from` and keeps it for chat_server_pop_next().
+static void chat_shard_receive(struct chat_shard *shard, struct chat_peer *from,
+			       const char *msg, size_t msg_len) {
+	chat_metric_add(&shard->metrics.messages_received, 1);
+	if (chat_shard_command(shard, from, msg, msg_len))
+		return;
+#if NEED_AUTHOR
+	const char *author = from->author;
+	size_t author_len = from->author_len;
+#else
+	const char *author = NULL;
+	size_t author_len = 0;
+#endif
+	/* After the name, which comes first */
+	if (!from->author_frame)
+		from->author_frame = chat_author_frame_new(from->author_id, author, author_len);
+	struct chat_broadcast b;
+	chat_broadcast_create(&b, from->author_id, from->room, from->author_frame, author,
+			      author_len, msg, msg_len, from->proto == CHAT_PROTO_BINARY);
+	if (shard->server->node_id != 0)
+		chat_broadcast_relay(&b, shard->server, from->author_id, author, author_len, msg, msg_len);
+	if (chat_shard_offload(shard, &b, msg_len))
+		return;
+	chat_broadcast_pack(&b, msg, msg_len, shard->server->pack_min_size);
+	chat_shard_publish(shard, &b);
+}
+
+int
+chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
+{
+	struct iovec part = {.iov_base = (void *)msg, .iov_len = msg_size};
+	return chat_server_feed_many(server, &part, 1);
+}
+
+int
+chat_server_feed_many(struct chat_server *server, const struct iovec *parts,
+		      int count)
+{
+#if NEED_SERVER_FEED
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+
+	/*
+	 * With the threads the messages are posted to every shard at once in
+	 * the end, without them they are queued to the peers as they go and
+	 * sent in the end.
+	 */
+	struct chat_broadcast *posted = NULL;
+	size_t posted_count = 0, posted_capacity = 0;
+	struct chat_shard *shard = &server->shards[0];
+	struct chat_history *history = &server->history;
+	if (history->capacity > 0)
+		pthread_mutex_lock(&history->lock);
+	for (int i = 0; i < count; ++i) {
+		/* A message a line, the last one may be without the '\n' */
+		const char *msg = parts[i].iov_base;
+		const char *end = msg + parts[i].iov_len;
+		while (msg < end) {
+			const char *lf = memchr(msg, '\n', end - msg);
+			size_t len = (lf ? lf : end) - msg;
+			struct chat_broadcast b;
+			chat_broadcast_create(&b, 0, CHAT_ROOM_ALL, server->author_frame,
+					      chat_server_name, sizeof(chat_server_name) - 1, msg, len,
+					      false);
+			chat_broadcast_pack(&b, msg, len, server->pack_min_size);
+			if (server->node_id != 0)
+				chat_broadcast_relay(&b, server, 0, chat_server_name,
+						     sizeof(chat_server_name) - 1, msg, len);
+			if (history->capacity > 0)
+				chat_history_add(history, &b);
+			msg += len + 1;
+			if (server->thread_count == 0) {
+				chat_shard_batch_broadcast(shard, &b);
+				chat_broadcast_unref(&b);
+				continue;
+			}
+			if (posted_count == posted_capacity) {
+				posted_capacity = posted_capacity ? posted_capacity * 2 : 16;
+				posted = realloc(posted, sizeof(*posted) * posted_capacity);
+				if (!posted)
+					abort();
+			}
+			posted[posted_count++] = b;
+		}
+	}
+	if (server->thread_count == 0) {
+		chat_shard_end_batch(shard);
+	} else {
+		for (uint32_t i = 0; i < server->thread_count; ++i)
+			chat_mailbox_post_many(&server->shards[i].mailbox, posted, posted_count);
+	}
+	/* The history is posted in its order, the numbers are not out of it */
+	if (history->capacity > 0)
+		pthread_mutex_unlock(&history->lock);
+	for (size_t i = 0; i < posted_count; ++i)
+		chat_broadcast_unref(&posted[i]);
+	free(posted);
+	if (shard->ring && server->thread_count == 0 && uring_submit(shard->ring) != 0)
+		return CHAT_ERR_SYS;
+	return 0;
+#else
+	(void)server;
+	(void)parts;
+	(void)count;
+	return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+/// Broadcasts what the other shards and the feed have posted to the shard.
+static void chat_shard_deliver_mail(struct chat_shard *shard) {
+	struct chat_mail *mail = chat_mailbox_take(&shard->mailbox);
+	/* After the take, for a wakeup of the pool after the look to stay */
+	chat_shard_publish_offloaded(shard);
+	while (mail) {
+		struct chat_mail *next = mail->next;
+		chat_shard_batch_broadcast(shard, &mail->msg);
+		chat_broadcast_unref(&mail->msg);
+		free(mail);
+		mail = next;
+	}
+	for (uint32_t i = 0; shard->inbox && i < shard->server->shard_count; ++i) {
+		/* Up to an empty pop, after which a push rings the doorbell again */
+		struct chat_broadcast msgs[CHAT_SHARD_INBOX_BATCH];
+		uint32_t count;
+		while ((count = spsc_ring_pop(&shard->inbox[i], msgs, CHAT_SHARD_INBOX_BATCH)) > 0) {
+			for (uint32_t j = 0; j < count; ++j) {
+				chat_shard_batch_broadcast(shard, &msgs[j]);
+				chat_broadcast_unref(&msgs[j]);
+			}
+		}
+	}
+	chat_shard_end_batch(shard);
+}
+
+/**
+ * Finds out the peer's protocol from its first bytes: the binary one is
+ * offered with CHAT_FRAME_MAGIC, which no name starts with, and is
+ * answered right away.
+ *
+ * @retval 1 Known.
+ * @retval 0 More bytes are needed.
+ * @retval -1 Malformed.
+ */
+static int chat_peer_negotiate(struct chat_shard *shard, struct chat_peer *peer) {
+	size_t len;
+	const char *data = pmq_data(&peer->incoming, &len);
+	if (len == 0)
+		return 0;
+	if (data[0] != CHAT_FRAME_MAGIC) {
+		if (peer->is_link)
+			return -1;
+		peer->is_proto_known = true;
+		return 1;
+	}
+	if (len < 2)
+		return 0;
+	uint8_t version = data[1];
+	if (version == 0)
+		return -1;
+	pmq_consume(&peer->incoming, 2);
+	peer->proto = CHAT_PROTO_BINARY;
+	peer->is_proto_known = true;
+	peer->version = version < CHAT_FRAME_VERSION ? version : CHAT_FRAME_VERSION;
+	/* A link of this server's own has offered it, this is the answer */
+	if (peer->is_link)
+		return 1;
+
+	struct shared_buffer *ack = shared_buffer_new(2);
+	ack->data[0] = CHAT_FRAME_MAGIC;
+	ack->data[1] = peer->version;
+	chat_shard_send(shard, peer, ack, true);
+	shared_buffer_unref(ack);
+	return 1;
+}
+
+/// Reads a varint size and as many bytes the body of @a frame starts with.
+static int chat_frame_take_bytes(struct chat_frame *frame, const char **bytes, size_t *size) {
+	uint64_t value;
+	if (chat_frame_take_varint(frame, &value) != 0 || value > frame->body_size)
+		return -1;
+	*bytes = frame->body;
+	*size = value;
+	frame->body += value;
+	frame->body_size -= value;
+	return 0;
+}
+
+/**
+ * Takes a frame of a link, or the CHAT_FRAME_NODE making a peer one: the
+ * message of CHAT_FRAME_RELAY is published as the peers' are, if it is new,
+ * by an author of its own here, and goes on to the other links as it came,
+ * `raw` of `raw_size`. Returns -1 if malformed.
+ */
+static int chat_peer_receive_link(struct chat_shard *shard, struct chat_peer *peer,
+				  struct chat_frame *frame, const char *raw, size_t raw_size) {
+	struct chat_server *server = shard->server;
+	uint64_t origin, seq, author_id, room_size;
+	if (frame->type == CHAT_FRAME_NODE) {
+#if NEED_AUTHOR
+		if (peer->has_author)
+			return -1;
+#endif
+		if (server->node_id == 0 || peer->version < 4 || peer->node_id != 0 ||
+				chat_frame_take_varint(frame, &origin) != 0 || frame->body_size != 0 ||
+				origin == 0 || origin > UINT32_MAX || origin == server->node_id)
+			return -1;
+		peer->node_id = origin;
+		if (peer->is_link)
+			return 0;
+		chat_shard_add_link(shard, peer);
+		char node[CHAT_FRAME_HEADER_MAX + CHAT_VARINT_MAX];
+		char id[CHAT_VARINT_MAX];
+		size_t id_size = chat_varint_encode(server->node_id, id);
+		size_t node_size = chat_frame_header(CHAT_FRAME_NODE, id_size, node);
+		memcpy(node + node_size, id, id_size);
+		struct shared_buffer *buf = shared_buffer_new(node_size + id_size);
+		memcpy(buf->data, node, node_size + id_size);
+		chat_shard_send(shard, peer, buf, true);
+		shared_buffer_unref(buf);
+		return 0;
+	}
+	const char *author, *room;
+	size_t author_len, room_len;
+	if (frame->type != CHAT_FRAME_RELAY || peer->node_id == 0 ||
+			chat_frame_take_varint(frame, &origin) != 0 || origin > UINT32_MAX ||
+			chat_frame_take_varint(frame, &seq) != 0 ||
+			chat_frame_take_varint(frame, &author_id) != 0 || author_id > UINT32_MAX ||
+			chat_frame_take_bytes(frame, &author, &author_len) != 0 ||
+			memchr(author, '\n', author_len) ||
+			chat_frame_take_varint(frame, &room_size) != 0 || room_size > frame->body_size + 1)
+		return -1;
+	room = frame->body;
+	room_len = room_size > 0 ? room_size - 1 : 0;
+	frame->body += room_len;
+	frame->body_size -= room_len;
+	chat_metric_add(&shard->metrics.messages_received, 1);
+	/* Its own, come back around a loop */
+	if (origin == server->node_id)
+		return 0;
+
+	struct chat_nodes *nodes = &server->nodes;
+	pthread_mutex_lock(&nodes->lock);
+	struct chat_node *node = chat_nodes_find(nodes, origin);
+	if (!chat_node_take_seq(node, seq)) {
+		pthread_mutex_unlock(&nodes->lock);
+		return 0;
+	}
+	if (author_id >= node->author_capacity) {
+		uint32_t capacity = 2 * node->author_capacity > author_id ?
+			2 * node->author_capacity : author_id + 1;
+		struct chat_node_author *authors = realloc(node->authors, sizeof(*authors) * capacity);
+		if (!authors)
+			abort();
+		memset(authors + node->author_capacity, 0,
+		       sizeof(*authors) * (capacity - node->author_capacity));
+		node->authors = authors;
+		node->author_capacity = capacity;
+	}
+	struct chat_node_author *here = &node->authors[author_id];
+	if (here->id == 0) {
+		here->id = chat_server_new_author_id(server);
+		here->frame = chat_author_frame_new(here->id, author, author_len);
+	}
+	uint32_t here_id = here->id;
+	struct shared_buffer *author_frame = here->frame;
+	shared_buffer_ref(author_frame);
+	pthread_mutex_unlock(&nodes->lock);
+
+	uint32_t room_id = room_size == 0 ? CHAT_ROOM_ALL : room_len == 0 ? CHAT_ROOM_LOBBY :
+		chat_server_room_id(server, room, room_len);
+	struct chat_broadcast b;
+	chat_broadcast_create(&b, here_id, room_id, author_frame, author, author_len,
+			      frame->body, frame->body_size, true);
+	shared_buffer_unref(author_frame);
+	b.relay = shared_buffer_new(raw_size);
+	memcpy(b.relay->data, raw, raw_size);
+	b.via = peer->author_id;
+	chat_broadcast_pack(&b, frame->body, frame->body_size, server->pack_min_size);
+	chat_shard_publish(shard, &b);
+	return 0;
+}
+
+/// Takes the whole frames the peer has sent. Returns -1 if malformed.
+static int chat_peer_receive_frames(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_frame frame;
+	ssize_t size;
+	for (;;) {
+		size_t len;
+		const char *data = pmq_data(&peer->incoming, &len);
+		if ((size = chat_frame_decode(data, len, &frame)) <= 0)
+			break;
+		if (peer->is_link || frame.type == CHAT_FRAME_NODE) {
+			if (chat_peer_receive_link(shard, peer, &frame, data, size) != 0)
+				return -1;
+		} else if (frame.type == CHAT_FRAME_NAME) {
+#if NEED_AUTHOR
+			/* Once, and a line for the text peers */
+			if (peer->has_author || memchr(frame.body, '\n', frame.body_size) ||
+					memchr(frame.body, '\0', frame.body_size))
+				return -1;
+			chat_peer_set_author(peer, frame.body, frame.body_size);
+#endif
+		} else if (frame.type == CHAT_FRAME_MESSAGE) {
+#if NEED_AUTHOR
+			if (!peer->has_author)
+				return -1;
+#endif
+			chat_shard_receive(shard, peer, frame.body, frame.body_size);
+		} else if (frame.type == CHAT_FRAME_RESUME && peer->version >= 2) {
+			uint64_t seq;
+			if (chat_varint_decode(frame.body, frame.body_size, &seq) <= 0)
+				return -1;
+			chat_shard_replay(shard, peer, seq);
+		} else if (frame.type == CHAT_FRAME_COMPRESS && peer->version >= 3) {
+			if (frame.body_size != 0)
+				return -1;
+			peer->is_packing = true;
+		} else {
+			return -1;
+		}
+		pmq_consume(&peer->incoming, size);
+	}
+	return size < 0 ? -1 : 0;
+}
+
+/**
+ * Takes the whole messages the peer has sent.
+ *
+ * @retval 0 Success.
+ * @retval -1 The peer has sent something malformed and is to be dropped.
+ */
+static int chat_peer_receive(struct chat_shard *shard, struct chat_peer *peer) {
+	if (!peer->is_proto_known) {
+		int rc = chat_peer_negotiate(shard, peer);
+		if (rc <= 0)
+			return rc;
+	}
+	if (peer->proto == CHAT_PROTO_BINARY)
+		return chat_peer_receive_frames(shard, peer);
+
+	/* All the messages of a receive are split at once, then handled */
+	struct pmq_message msgs[CHAT_PEER_RECEIVE_BATCH];
+	int count;
+	do {
+		count = pmq_next_messages(&peer->incoming, msgs, CHAT_PEER_RECEIVE_BATCH);
+		for (int i = 0; i < count; ++i) {
+#if NEED_AUTHOR
+			if (!peer->has_author) {
+				chat_peer_set_author(peer, msgs[i].data, msgs[i].len);
+				continue;
+			}
+#endif
+			chat_shard_receive(shard, peer, msgs[i].data, msgs[i].len);
+		}
+	} while (count == CHAT_PEER_RECEIVE_BATCH);
+	return 0;
+}
+
+static int chat_shard_update_uring(struct chat_shard *shard, int timeout_ms);
+
+/// Disconnects an epoll backend peer.
+static int chat_shard_drop_peer(struct chat_shard *shard, struct chat_peer *peer) {
+	int err = epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+	if (err)
+		return CHAT_ERR_SYS;
+
+	chat_shard_delete_peer(shard, peer);
+	return 0;
+}
+
+/*
+ * The local peers, see chat_server_set_local_path(). The socket only
+ * passes the descriptors of the channel and then tells when the peer is
+ * gone, the bytes go through the rings, and the peer's eventfd, in the
+ * epoll too, tells when there is something in them or room again.
+ */
+
+/// Writes what the local peer has queued to its ring until it is full.
+static int chat_peer_flush_local(struct chat_peer *peer) {
+	struct shm_channel *ch = peer->shm;
+	struct iovec iov[SBQ_IOV_MAX];
+	bool has_written = false;
+	int rc = 0;
+	while (!sbq_is_empty(&peer->outgoing)) {
+		int count = sbq_iov(&peer->outgoing, iov, SBQ_IOV_MAX);
+		ssize_t written = shm_ring_writev(&ch->out, iov, count);
+		if (written < 0) {
+			rc = CHAT_ERR_SYS;
+			break;
+		}
+		sbq_consume(&peer->outgoing, written);
+		has_written = has_written || written > 0;
+		/* Full: the peer tells once it has read, like an EPOLLOUT */
+		if (written == 0 && shm_ring_wait_room(&ch->out))
+			break;
+	}
+	if (has_written && shm_ring_take_reader(&ch->out))
+		shm_channel_notify(ch);
+	return rc;
+}
+
+/**
+ * Takes the memfd of the channel and the eventfd the local peer waits on
+ * from its first message, and answers with the one of this side.
+ *
+ * @retval 1 Done.
+ * @retval 0 Nothing has come yet.
+ * @retval -1 The peer has sent something else or is gone.
+ */
+static int chat_shard_open_local(struct chat_shard *shard, struct chat_peer *peer) {
+	int fds[2];
+	int got = shm_recv_fds(peer->socket, fds, 2);
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (got != 2) {
+		for (int i = 0; i < got; ++i)
+			(void)close(fds[i]);
+		return -1;
+	}
+	struct shm_channel *ch = malloc(sizeof(*ch));
+	if (!ch)
+		abort();
+	int rc = shm_channel_open(ch, fds[0]);
+	(void)close(fds[0]);
+	if (rc != 0) {
+		(void)close(fds[1]);
+		free(ch);
+		return -1;
+	}
+	ch->notify_fd = fds[1];
+	peer->shm = ch;
+	if (0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, ch->wait_fd,
+			  &(struct epoll_event){.events = EPOLLIN | EPOLLET,
+						.data.u64 = chat_peer_notify_handle(shard, peer)}) ||
+			shm_send_fds(peer->socket, &ch->wait_fd, 1) != 0)
+		return -1;
+	return 1;
+}
+
+/**
+ * Reads what the local peer has written to its ring, as chat_shard_read()
+ * does a socket, until the ring is empty. With `may_hup` the socket is
+ * looked at too: for the channel if it hasn't come yet, or else for the
+ * end.
+ */
+static int chat_shard_read_local(struct chat_shard *shard, struct chat_peer *peer, bool may_hup, bool *is_gone) {
+	*is_gone = false;
+	if (!peer->shm) {
+		int rc = may_hup ? chat_shard_open_local(shard, peer) : 0;
+		if (rc < 0) {
+			*is_gone = true;
+			return chat_shard_drop_peer(shard, peer);
+		}
+		if (rc == 0)
+			return 0;
+		/* What was broadcast before */
+		size_t old_size = peer->outgoing.size;
+		rc = chat_peer_flush(shard, peer);
+		chat_shard_account(shard, peer, old_size);
+		if (rc != 0)
+			return rc;
+	}
+	if (!peer->is_shut && chat_server_should_pause(shard->server)) {
+		chat_shard_pause_input(shard, peer);
+		return 0;
+	}
+
+	struct shm_channel *ch = peer->shm;
+	bool has_read = false;
+	for (;;) {
+		size_t room;
+		char *tail = pmq_tail(&peer->incoming, PMQ_RECV_MIN, &room);
+		ssize_t got = shm_ring_read(&ch->in, tail, room);
+		if (got == 0) {
+			if (shm_ring_wait_data(&ch->in))
+				break;
+			continue;
+		}
+		if (got > 0) {
+			pmq_commit(&peer->incoming, got);
+			chat_metric_add(&shard->metrics.bytes_in, got);
+		}
+		if (got < 0 || chat_peer_receive(shard, peer) != 0) {
+			// Malformed, the peer is not worth the trouble
+			*is_gone = true;
+			return chat_shard_drop_peer(shard, peer);
+		}
+		has_read = true;
+		if (!peer->is_shut && chat_server_should_pause(shard->server)) {
+			chat_shard_pause_input(shard, peer);
+			break;
+		}
+	}
+	if (has_read && shm_ring_take_writer(&ch->in))
+		shm_channel_notify(ch);
+	if (!may_hup)
+		return 0;
+	/* Past the channel the peer sends nothing, but the end */
+	char byte;
+	ssize_t got = recv(peer->socket, &byte, 1, MSG_DONTWAIT);
+	if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	*is_gone = true;
+	return chat_shard_drop_peer(shard, peer);
+}
+
+/**
+ * Read what an epoll backend peer has sent and take the whole messages,
+ * unless the input is paused. Sets `is_gone` if the peer is disconnected
+ * and freed. Reads until EAGAIN or the end if the peer may have shut down,
+ * by `may_hup`, or else until a short read: then the socket is drained, and
+ * the epoll reports any more data as a new event.
+ */
+static int chat_shard_read(struct chat_shard *shard, struct chat_peer *peer, bool may_hup, bool *is_gone) {
+	if (peer->is_local)
+		return chat_shard_read_local(shard, peer, may_hup, is_gone);
+	*is_gone = false;
+	/* A peer disconnected for the overflow is read to find it gone */
+	if (!peer->is_shut && chat_server_should_pause(shard->server)) {
+		chat_shard_pause_input(shard, peer);
+		return 0;
+	}
+
+	ssize_t got;
+	bool is_drained = false;
+	while ((may_hup || !is_drained) && (got = pmq_recv(&peer->incoming, peer->socket,
+							   &peer->recv_hint, &is_drained)) > 0) {
+		chat_metric_add(&shard->metrics.bytes_in, got);
+		if (chat_peer_receive(shard, peer) != 0) {
+			// Malformed, the peer is not worth the trouble
+			*is_gone = true;
+			return chat_shard_drop_peer(shard, peer);
+		}
+		/* What it has sent may be what has filled the output */
+		if (!peer->is_shut && chat_server_should_pause(shard->server)) {
+			chat_shard_pause_input(shard, peer);
+			return 0;
+		}
+	}
+	if (!may_hup && is_drained) {
+		return 0;
+	} else if (got == 0) {
+		// Disconnected...
+		*is_gone = true;
+		return chat_shard_drop_peer(shard, peer);
+	} else if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		return CHAT_ERR_SYS;
+	}
+	return 0;
+}
+
+static void chat_uring_resume(struct chat_shard *shard, struct chat_peer *peer);
+#ifdef CHAT_SERVER_CORO
+static void chat_shard_coro_start(struct chat_shard *shard, struct chat_peer *peer);
+static void chat_shard_coro_run(struct chat_shard *shard);
+static int chat_shard_update_coro(struct chat_shard *shard, int timeout_ms);
+#endif
+
+/// Reads what the peers have sent while the input was paused.
+static int chat_shard_resume_input(struct chat_shard *shard) {
+	shard->has_paused_input = false;
+	for (size_t i = 0; i < shard->held_buf_count; ++i)
+		uring_buf_ring_recycle(&shard->recv_bufs, shard->held_bufs[i]);
+	shard->held_buf_count = 0;
+
+	int rc = 0;
+	for (uint32_t i = 0; i < shard->peer_count; ++i) {
+		struct chat_peer *peer = &shard->peers[i];
+		if (!peer->is_used || !peer->is_input_paused)
+			continue;
+		peer->is_input_paused = false;
+		if (shard->ring) {
+			chat_uring_resume(shard, peer);
+			continue;
+		}
+#ifdef CHAT_SERVER_CORO
+		if (peer->coro) {
+			/* It reads on by itself */
+			coro_resume(peer->coro);
+			continue;
+		}
+#endif
+		/* Whatever came meanwhile has no new event */
+		bool is_gone;
+		int err = chat_shard_read(shard, peer, true, &is_gone);
+		if (err)
+			rc = err;
+	}
+	if (shard->ring && uring_submit(shard->ring) != 0)
+		rc = CHAT_ERR_SYS;
+#ifdef CHAT_SERVER_CORO
+	if (shard->server->backend == CHAT_SERVER_BACKEND_CORO)
+		chat_shard_coro_run(shard);
+#endif
+	return rc;
+}
+
+static int chat_shard_update_epoll(struct chat_shard *shard, int timeout_ms);
+
+/// Waits for the events of the shard on its backend, and handles them.
+static int chat_shard_poll(struct chat_shard *shard, int timeout_ms) {
+	if (shard->ring)
+		return chat_shard_update_uring(shard, timeout_ms);
+#ifdef CHAT_SERVER_CORO
+	if (shard->server->backend == CHAT_SERVER_BACKEND_CORO)
+		return chat_shard_update_coro(shard, timeout_ms);
+#endif
+	return chat_shard_update_epoll(shard, timeout_ms);
+}
+
+/**
+ * Busy-polls the shard for chat_server::busy_poll_us before it would wait
+ * `*timeout_ms`, see chat_server_set_busy_poll(). Returns what the update
+ * that has found something returns, or CHAT_ERR_TIMEOUT with the rest of
+ * `*timeout_ms` still to wait.
+ */
+static int chat_shard_spin(struct chat_shard *shard, int *timeout_ms) {
+	uint32_t spin_us = shard->server->busy_poll_us;
+	if (spin_us == 0 || *timeout_ms == 0)
+		return CHAT_ERR_TIMEOUT;
+	uint64_t start_ns = chat_now_ns();
+	uint64_t until_ns = start_ns + (uint64_t)spin_us * 1000;
+	int rc;
+	do
+		rc = chat_shard_poll(shard, 0);
+	while (rc == CHAT_ERR_TIMEOUT && chat_now_ns() < until_ns);
+	if (rc != CHAT_ERR_TIMEOUT) {
+		chat_metric_add(&shard->metrics.busy_polls, 1);
+		return rc;
 	}
+	if (*timeout_ms > 0) {
+		int spent_ms = (chat_now_ns() - start_ns) / 1000000;
+		*timeout_ms = *timeout_ms > spent_ms ? *timeout_ms - spent_ms : 0;
+	}
+	return CHAT_ERR_TIMEOUT;
+}
+
+/// Pins the calling thread, the loop of `shard`, see chat_server_set_busy_poll().
+static void chat_shard_pin(struct chat_shard *shard) {
+	int cpu = shard->server->busy_poll_cpu;
+	if (cpu < 0)
+		return;
+	cpu += shard - shard->server->shards;
+	if (cpu >= CPU_SETSIZE)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	/* A CPU not there or not allowed leaves the thread as it is */
+	(void)pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static int chat_shard_update(struct chat_shard *shard, int timeout_ms) {
+	int rc = chat_shard_spin(shard, &timeout_ms);
+	if (rc == CHAT_ERR_TIMEOUT)
+		rc = chat_shard_poll(shard, timeout_ms);
+	if (!shard->has_paused_input)
+		return rc;
+	/*
+	 * Before the check, or the shard that has made room could miss that
+	 * this one is paused, see chat_shard_account().
+	 */
+	__atomic_store_n(&shard->server->is_input_paused, true, __ATOMIC_SEQ_CST);
+	if (chat_server_should_pause(shard->server))
+		return rc;
+	int err = chat_shard_resume_input(shard);
+	if (err)
+		return err;
+	return rc == CHAT_ERR_TIMEOUT ? 0 : rc;
+}
+
+/**
+ * Out of descriptors, accepts the next connection into the spare one and
+ * closes it, for the level-triggered listening socket not to be reported
+ * again and again while nothing can be accepted.
+ */
+static void chat_shard_shed(struct chat_shard *shard, int sock) {
+	if (shard->spare_fd < 0)
+		return;
+	(void)close(shard->spare_fd);
+	int fd = accept(sock, NULL, NULL);
+	if (fd >= 0)
+		(void)close(fd);
+	shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Accepts the new peers on the listening `sock`, the local socket by
+ * `is_local`, at most CHAT_SHARD_ACCEPT_BATCH at once for the peers not to
+ * wait while a storm of them connects: the rest are reported by the next
+ * epoll_wait(). A connection failing is counted and left, only the errors
+ * of the socket itself are returned. A local peer is in the epoll by the
+ * socket for its channel to come, and for nothing to send yet.
+ */
+static int chat_shard_accept(struct chat_shard *shard, int sock, bool is_local) {
+	for (int i = 0; i < CHAT_SHARD_ACCEPT_BATCH; ++i) {
+		int fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			switch (errno) {
+			case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+			case EWOULDBLOCK:
+#endif
+				return 0;
+			case EBADF:
+			case EFAULT:
+			case EINVAL:
+			case ENOTSOCK:
+			case EOPNOTSUPP:
+				return CHAT_ERR_SYS;
+			case EMFILE:
+			case ENFILE:
+				chat_metric_add(&shard->metrics.accept_errors, 1);
+				chat_shard_shed(shard, sock);
+				return 0;
+			default:
+				/* Of the connection, or passing, as ENOBUFS */
+				chat_metric_add(&shard->metrics.accept_errors, 1);
+				continue;
+			}
+		}
+		struct chat_peer *peer = chat_shard_new_peer(shard, fd);
+		peer->is_local = is_local;
+		uint32_t events = is_local ? EPOLLIN | EPOLLRDHUP | EPOLLET :
+			EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		if (0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd,
+				  &(struct epoll_event){.events = events, .data.u64 = chat_peer_handle(shard, peer)})) {
+			chat_metric_add(&shard->metrics.accept_errors, 1);
+			chat_shard_delete_peer(shard, peer);
+		}
+#ifdef CHAT_SERVER_CORO
+		else if (shard->server->backend == CHAT_SERVER_BACKEND_CORO) {
+			chat_shard_coro_start(shard, peer);
+		}
 #endif
+	}
+	return 0;
+}
+
+/// Handles an event of the local peer's socket, or of its eventfd by `is_notify`.
+static int chat_shard_handle_local(struct chat_shard *shard, struct chat_peer *peer, bool is_notify) {
+	/* Before the rings, for a notification after the look to stay */
+	if (is_notify)
+		shm_channel_clear(peer->shm);
+	bool is_gone;
+	int err = chat_shard_read_local(shard, peer, !is_notify, &is_gone);
+	if (err || is_gone || !peer->shm || sbq_is_empty(&peer->outgoing))
+		return err;
+	/* The peer may have made room */
+	size_t old_size = peer->outgoing.size;
+	err = chat_peer_flush(shard, peer);
+	chat_shard_account(shard, peer, old_size);
+	return err;
+}
+
+/// Handles an event of the shard's epoll.
+static int chat_shard_handle_event(struct chat_shard *shard, const struct epoll_event *ev) {
+	if (ev->data.u64 == CHAT_SHARD_EVENT_LISTEN) {
+		// Server passive socket
+		return chat_shard_accept(shard, shard->socket, false);
+	} else if (ev->data.u64 == CHAT_SHARD_EVENT_LOCAL) {
+		return chat_shard_accept(shard, shard->local_socket, true);
+	} else if (ev->data.u64 == CHAT_SHARD_EVENT_MAILBOX) {
+		// Mailbox
+		chat_shard_deliver_mail(shard);
+	} else {
+		// Peer
+		struct chat_peer *peer = chat_shard_peer(shard, ev->data.u64);
+		if (!peer)
+			return 0;
+		if (peer->is_local)
+			return chat_shard_handle_local(shard, peer, ev->data.u64 & CHAT_PEER_NOTIFY);
+		if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			bool is_gone;
+			int err = chat_shard_read(shard, peer,
+						  ev->events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR),
+						  &is_gone);
+			if (err)
+				return err;
+			if (is_gone)
+				return 0;
+		}
+		if ((ev->events & EPOLLOUT) && !sbq_is_empty(&peer->outgoing)) {
+			size_t old_size = peer->outgoing.size;
+			int err = chat_peer_flush(shard, peer);
+			chat_shard_account(shard, peer, old_size);
+			return err;
+		}
+	}
+	return 0;
+}
+
+static int chat_shard_update_epoll(struct chat_shard *shard, int timeout_ms) {
+	/*
+	 * 1) Wait on epoll/kqueue/poll for update on any socket.
+	 * 2) Handle the update.
+	 * 2.1) If the update was on listen-socket, then you probably need to
+	 *     call accept() on it - a new client wants to join.
+	 * 2.2) If the update was on a client-socket, then you might want to
+	 *     read/write on it.
+	 */
+
+	struct epoll_event *events = shard->events;
+	int res = epoll_wait(shard->epoll_fd, events, shard->server->event_batch, timeout_ms);
+	if (0 > res)
+		return CHAT_ERR_SYS;
+	else if (0 == res)
+		return CHAT_ERR_TIMEOUT;
+	else {
+		uint64_t start_ns = chat_now_ns();
+		int rc = 0;
+		for (int i = 0; i < res && rc == 0; ++i)
+			rc = chat_shard_handle_event(shard, &events[i]);
+		chat_shard_count_update(shard, res, start_ns);
+		return rc;
+	}
+}
+
+#ifdef CHAT_SERVER_CORO
+
+/*
+ * The coroutine backend. The peers are in the epoll as with the epoll
+ * backend, but an event of a peer only wakes its coroutine up, and the
+ * coroutine goes through the protocol in order: it reads until the first
+ * bytes tell the protocol, then takes the messages as they come, and
+ * waits for more where the epoll backend would return to be called again.
+ * What the others broadcast is sent right away while the socket has room,
+ * as with epoll, and the rest by the coroutine once its EPOLLOUT comes.
+ */
+
+enum {
+	/// Of a peer's coroutine: a broadcast it makes packs with lz_compress(),
+	/// the table of which is on the stack. Only the pages touched take
+	/// memory, a few per peer, and the pool of libcoro keeps the stacks.
+	CHAT_PEER_CORO_STACK = 64 * 1024,
+};
+
+/// What the coroutine of a peer keeps on its stack.
+struct chat_peer_coro {
+	struct chat_shard *shard;
+	uint64_t handle;
+	/// Looked up again after each wait: the table may grow meanwhile
+	struct chat_peer *peer;
+	/// Had a short read: nothing to read until the next EPOLLIN
+	bool is_drained;
+	/// The peer may have shut down, so reading on till EAGAIN or the end
+	bool may_hup;
+};
+
+/// Waits for the next events of the peer, and sends what EPOLLOUT lets.
+static void chat_peer_coro_wait(struct chat_peer_coro *co) {
+	coro_suspend();
+	/* Nothing deletes the peer but this coroutine */
+	struct chat_peer *peer = co->peer = chat_shard_peer(co->shard, co->handle);
+	uint32_t events = peer->coro_events;
+	peer->coro_events = 0;
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		co->is_drained = false;
+	if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+		co->may_hup = true;
+	if ((events & EPOLLOUT) && !sbq_is_empty(&peer->outgoing)) {
+		size_t old_size = peer->outgoing.size;
+		/* A broken socket is found by the next read, as in chat_shard_output() */
+		(void)chat_peer_flush(co->shard, peer);
+		chat_shard_account(co->shard, peer, old_size);
+	}
+}
+
+/**
+ * Reads more of the peer's input into `incoming`, waiting until there is
+ * some and while the input is paused, see CHAT_SERVER_OVERFLOW_PAUSE_INPUT.
+ * Returns the bytes read, 0 if the peer has shut down, -1 on an error.
+ */
+static ssize_t chat_peer_coro_read(struct chat_peer_coro *co) {
+	for (;;) {
+		struct chat_peer *peer = co->peer;
+		/* A peer disconnected for the overflow is read to find it gone */
+		if (!peer->is_shut && chat_server_should_pause(co->shard->server)) {
+			chat_shard_pause_input(co->shard, peer);
+			chat_peer_coro_wait(co);
+			continue;
+		}
+		if (!co->is_drained) {
+			bool is_drained;
+			ssize_t got = pmq_recv(&peer->incoming, peer->socket, &peer->recv_hint, &is_drained);
+			if (got > 0) {
+				co->is_drained = is_drained && !co->may_hup;
+				chat_metric_add(&co->shard->metrics.bytes_in, got);
+				return got;
+			}
+			if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return got;
+			co->is_drained = true;
+		}
+		chat_peer_coro_wait(co);
+	}
+}
+
+/**
+ * The life of a peer: the protocol, then its messages, until it is gone or
+ * has sent something malformed, the errors of its socket included.
+ */
+static long long chat_peer_coro_f(void *arg) {
+	struct chat_peer_coro co = *(struct chat_peer_coro *)arg;
+	free(arg);
+	co.peer = chat_shard_peer(co.shard, co.handle);
+	int rc = 0;
+	while (rc == 0 && chat_peer_coro_read(&co) > 0)
+		rc = chat_peer_negotiate(co.shard, co.peer);
+	/* What has come after the first bytes is taken before reading on */
+	if (rc > 0) {
+		while (chat_peer_receive(co.shard, co.peer) == 0 && chat_peer_coro_read(&co) > 0)
+			;
+	}
+	/* Closing the socket takes it out of the epoll */
+	chat_shard_delete_peer(co.shard, co.peer);
+	return 0;
+}
 
-	struct chat_message *ret = malloc(sizeof *ret);
-	if (!ret)
+/// Starts the coroutine of a peer just accepted, to run in chat_shard_coro_run().
+static void chat_shard_coro_start(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_peer_coro *co = malloc(sizeof(*co));
+	if (!co)
 		abort();
+	co->shard = shard;
+	co->handle = chat_peer_handle(shard, peer);
+	co->peer = NULL;
+	/* What has come with the connection has no event of its own */
+	co->is_drained = false;
+	co->may_hup = false;
+	peer->coro_events = 0;
+	peer->coro = coro_new_ex(chat_peer_coro_f, co, CHAT_PEER_CORO_STACK);
+}
 
-#if NEED_AUTHOR
-	ret->author = strdup(author);
-	if (!ret->author)
+/// Runs the coroutines until all of them wait, and frees the ones finished.
+static void chat_shard_coro_run(struct chat_shard *shard) {
+	(void)shard;
+	if (!coro_this())
+		coro_sched_init();
+	struct coro *c;
+	while ((c = coro_sched_wait()))
+		coro_delete(c);
+}
+
+static int chat_shard_update_coro(struct chat_shard *shard, int timeout_ms) {
+	struct epoll_event *events = shard->events;
+	int res = epoll_wait(shard->epoll_fd, events, shard->server->event_batch, timeout_ms);
+	if (0 > res)
+		return CHAT_ERR_SYS;
+	else if (0 == res)
+		return CHAT_ERR_TIMEOUT;
+	uint64_t start_ns = chat_now_ns();
+	int rc = 0;
+	/* All of them, an edge-triggered event not handled never comes again */
+	for (int i = 0; i < res; ++i) {
+		if (events[i].data.u64 == CHAT_SHARD_EVENT_LISTEN) {
+			int err = chat_shard_accept(shard, shard->socket, false);
+			if (err)
+				rc = err;
+			continue;
+		}
+		if (events[i].data.u64 == CHAT_SHARD_EVENT_MAILBOX) {
+			chat_shard_deliver_mail(shard);
+			continue;
+		}
+		struct chat_peer *peer = chat_shard_peer(shard, events[i].data.u64);
+		if (!peer)
+			continue;
+		peer->coro_events |= events[i].events;
+		coro_resume(peer->coro);
+	}
+	chat_shard_coro_run(shard);
+	chat_shard_count_update(shard, res, start_ns);
+	return rc;
+}
+
+#endif /* CHAT_SERVER_CORO */
+
+/*
+ * The io_uring backend. Instead of waiting for readiness and then doing the
+ * system calls, the shard keeps a multishot accept on its socket and a
+ * multishot recv on each peer, into buffers it provides to the kernel, and
+ * at most one sendmsg per peer of all it has queued. The CQEs tell what is
+ * done, by the tag in the low bits of their user data.
+ */
+
+enum {
+	CHAT_URING_ENTRIES = 256,
+	CHAT_URING_BUF_COUNT = 256,
+	CHAT_URING_BUF_SIZE = 4096,
+	CHAT_URING_BGID = 0,
+};
+
+enum chat_uring_op {
+	CHAT_URING_ACCEPT,
+	CHAT_URING_RECV,
+	CHAT_URING_SEND,
+	CHAT_URING_MAILBOX,
+	CHAT_URING_CANCEL,
+	CHAT_URING_OP_BITS = 3,
+	CHAT_URING_OP_MASK = (1 << CHAT_URING_OP_BITS) - 1,
+};
+
+/**
+ * The peer's slot index and the op. A slot isn't reused until all its ops
+ * have ended, so unlike with the epoll no generation is needed, see
+ * chat_peer_handle().
+ */
+static uint64_t chat_uring_data(uint32_t index, enum chat_uring_op op) {
+	return (uint64_t)index << CHAT_URING_OP_BITS | op;
+}
+
+static void chat_uring_arm_accept(struct chat_shard *shard) {
+	struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = chat_uring_data(0, CHAT_URING_ACCEPT);
+}
+
+static void chat_uring_arm_recv(struct chat_shard *shard, struct chat_peer *peer) {
+	struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = peer->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BGID;
+	sqe->user_data = chat_uring_data(peer - shard->peers, CHAT_URING_RECV);
+	++peer->uring->ops;
+}
+
+static void chat_uring_arm_mailbox(struct chat_shard *shard) {
+	struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->mailbox.fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = chat_uring_data(0, CHAT_URING_MAILBOX);
+}
+
+/// Sends all the peer has queued, or as much of it as fits in a sendmsg.
+static void chat_uring_send(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_peer_uring *u = peer->uring;
+	if (u->is_sending || u->is_closing || peer->is_shut || sbq_is_empty(&peer->outgoing))
+		return;
+	memset(&u->msg, 0, sizeof(u->msg));
+	u->msg.msg_iov = u->iov;
+	u->msg.msg_iovlen = sbq_iov(&peer->outgoing, u->iov, SBQ_IOV_MAX);
+	struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = peer->socket;
+	sqe->addr = (uintptr_t)&u->msg;
+	sqe->len = 1;
+	/* The next sendmsg follows this one's completion, as in sbq_send() */
+	sqe->msg_flags = MSG_NOSIGNAL |
+			 (u->msg.msg_iovlen < peer->outgoing.count ? MSG_MORE : 0);
+	sqe->user_data = chat_uring_data(peer - shard->peers, CHAT_URING_SEND);
+	u->is_sending = true;
+	++u->ops;
+}
+
+/**
+ * Cancels what is in flight for the peer. It is freed once the CQEs of all
+ * of that are taken, see chat_shard_update_uring().
+ */
+static void chat_uring_close(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_peer_uring *u = peer->uring;
+	if (u->is_closing)
+		return;
+	u->is_closing = true;
+	if (u->ops == 0)
+		return;
+	struct io_uring_sqe *sqe = uring_get_sqe(shard->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = peer->socket;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = chat_uring_data(0, CHAT_URING_CANCEL);
+}
+
+static int chat_shard_uring_start(struct chat_shard *shard) {
+	struct uring *ring = malloc(sizeof(*ring));
+	if (!ring)
 		abort();
-#endif
-	ret->data = strdup(data);
-	if (!ret->data)
+	if (uring_init(ring, CHAT_URING_ENTRIES) != 0) {
+		free(ring);
+		return CHAT_ERR_SYS;
+	}
+	if (uring_buf_ring_init(ring, &shard->recv_bufs, CHAT_URING_BGID,
+				CHAT_URING_BUF_COUNT, CHAT_URING_BUF_SIZE) != 0) {
+		int save_errno = errno;
+		uring_destroy(ring);
+		free(ring);
+		errno = save_errno;
+		return CHAT_ERR_SYS;
+	}
+	shard->ring = ring;
+	shard->held_bufs = malloc(sizeof(*shard->held_bufs) * CHAT_URING_BUF_COUNT);
+	if (!shard->held_bufs)
 		abort();
+	chat_uring_arm_accept(shard);
+	if (shard->mailbox.fd >= 0)
+		chat_uring_arm_mailbox(shard);
+	return uring_submit(ring) == 0 ? 0 : CHAT_ERR_SYS;
+}
+
+static void chat_uring_on_accept(struct chat_shard *shard, const struct io_uring_cqe *cqe) {
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		chat_uring_arm_accept(shard);
+	if (cqe->res < 0)
+		return;
+	struct chat_peer *peer = chat_shard_new_peer(shard, cqe->res);
+	chat_uring_arm_recv(shard, peer);
+}
+
+static void chat_uring_on_recv(struct chat_shard *shard, struct chat_peer *peer, const struct io_uring_cqe *cqe) {
+	struct chat_peer_uring *u = peer->uring;
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		--u->ops;
+	if (cqe->res > 0) {
+		chat_metric_add(&shard->metrics.bytes_in, cqe->res);
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		pmq_put(&peer->incoming, uring_buf_ring_data(&shard->recv_bufs, bid), cqe->res);
+		if (!u->is_closing && !peer->is_shut && chat_server_should_pause(shard->server)) {
+			/* Kept from the kernel, which runs out of them and stops */
+			shard->held_bufs[shard->held_buf_count++] = bid;
+			chat_shard_pause_input(shard, peer);
+		} else {
+			uring_buf_ring_recycle(&shard->recv_bufs, bid);
+			if (!u->is_closing && chat_peer_receive(shard, peer) != 0)
+				chat_uring_close(shard, peer);
+		}
+	}
+	if (u->is_closing || cqe->flags & IORING_CQE_F_MORE)
+		return;
+	/*
+	 * Ended: out of buffers, which are back by now unless the input is
+	 * paused, or disconnected.
+	 */
+	if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+		if (shard->has_paused_input) {
+			u->is_recv_stopped = true;
+			chat_shard_pause_input(shard, peer);
+		} else {
+			chat_uring_arm_recv(shard, peer);
+		}
+	} else {
+		chat_uring_close(shard, peer);
+	}
+}
+
+static void chat_uring_on_send(struct chat_shard *shard, struct chat_peer *peer, const struct io_uring_cqe *cqe) {
+	struct chat_peer_uring *u = peer->uring;
+	--u->ops;
+	u->is_sending = false;
+	if (cqe->res > 0) {
+		chat_metric_add(&shard->metrics.bytes_out, cqe->res);
+		size_t old_size = peer->outgoing.size;
+		sbq_consume(&peer->outgoing, cqe->res);
+		chat_shard_account(shard, peer, old_size);
+	}
+	if (u->is_closing)
+		return;
+	if (cqe->res < 0)
+		chat_uring_close(shard, peer);
+	else
+		chat_uring_send(shard, peer);
+}
+
+/// Takes what the peer has sent while the input was paused.
+static void chat_uring_resume(struct chat_shard *shard, struct chat_peer *peer) {
+	struct chat_peer_uring *u = peer->uring;
+	if (!u->is_closing && chat_peer_receive(shard, peer) != 0)
+		chat_uring_close(shard, peer);
+	if (u->is_recv_stopped && !u->is_closing) {
+		u->is_recv_stopped = false;
+		chat_uring_arm_recv(shard, peer);
+	}
+	/* With nothing in flight, no CQE is to come for it to be freed */
+	if (u->is_closing && u->ops == 0)
+		chat_shard_delete_peer(shard, peer);
+}
+
+static int chat_shard_update_uring(struct chat_shard *shard, int timeout_ms) {
+	struct uring *ring = shard->ring;
+	if (uring_wait(ring, timeout_ms) != 0)
+		return errno == ETIME ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+
+	uint64_t start_ns = chat_now_ns();
+	uint64_t count = 0;
+	struct io_uring_cqe *next;
+	while ((next = uring_peek_cqe(ring))) {
+		++count;
+		struct io_uring_cqe cqe = *next;
+		uring_cqe_seen(ring);
+		uint32_t index = cqe.user_data >> CHAT_URING_OP_BITS;
+		switch (cqe.user_data & CHAT_URING_OP_MASK) {
+		case CHAT_URING_ACCEPT:
+			chat_uring_on_accept(shard, &cqe);
+			break;
+		case CHAT_URING_RECV:
+		case CHAT_URING_SEND: {
+			struct chat_peer *peer = &shard->peers[index];
+			if ((cqe.user_data & CHAT_URING_OP_MASK) == CHAT_URING_RECV)
+				chat_uring_on_recv(shard, peer, &cqe);
+			else
+				chat_uring_on_send(shard, peer, &cqe);
+			if (!peer->uring->is_closing || peer->uring->ops > 0)
+				break;
+			chat_shard_delete_peer(shard, peer);
+			break;
+		}
+		case CHAT_URING_MAILBOX:
+			chat_shard_deliver_mail(shard);
+			if (!(cqe.flags & IORING_CQE_F_MORE))
+				chat_uring_arm_mailbox(shard);
+			break;
+		default:
+			break;
+		}
+	}
+	int rc = uring_submit(ring) == 0 ? 0 : CHAT_ERR_SYS;
+	chat_shard_count_update(shard, count, start_ns);
+	return rc;
+}
+
+/// Event loop thread of a shard in the threaded mode.
+static void *chat_shard_f(void *arg) {
+	struct chat_shard *shard = arg;
+	chat_shard_pin(shard);
+	/*
+	 * The errors are of single peers or of the epoll itself, neither of
+	 * which there is anybody to report to. The loop goes on.
+	 */
+	while (!__atomic_load_n(&shard->is_stopped, __ATOMIC_ACQUIRE)) {
+		PERF_REGION_BEGIN(chat_shard_update);
+		(void)chat_shard_update(shard, shard->has_outbox ? CHAT_SHARD_OUTBOX_RETRY_MS : -1);
+		PERF_REGION_END(chat_shard_update);
+		chat_shard_flush_outbox(shard);
+	}
+	return NULL;
+}
+
+/// Moves the messages received by the shard threads to `received`.
+static bool chat_server_take_received(struct chat_server *server) {
+	struct chat_mail *mail = chat_mailbox_take(&server->received_mail);
+	bool has_any = mail != NULL;
+	while (mail) {
+		struct chat_mail *next = mail->next;
+		pmq_put(&server->received, mail->msg.author->data, mail->msg.author->size);
+		pmq_put(&server->received, mail->msg.binary->data, mail->msg.binary->size);
+		chat_broadcast_unref(&mail->msg);
+		free(mail);
+		mail = next;
+	}
+	return has_any;
+}
+
+int
+chat_server_update(struct chat_server *server, double timeout)
+{
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->thread_count == 0) {
+		if (!server->is_loop_pinned) {
+			chat_shard_pin(&server->shards[0]);
+			server->is_loop_pinned = true;
+		}
+		PERF_REGION_BEGIN(chat_server_update);
+		int rc = chat_shard_update(&server->shards[0], timeout * 1000);
+		PERF_REGION_END(chat_server_update);
+		return rc;
+	}
+
+	/* The shards run themselves, only wait for what they receive */
+	struct pollfd fd = {.fd = server->received_mail.fd, .events = POLLIN};
+	int res = poll(&fd, 1, timeout * 1000);
+	if (0 > res)
+		return CHAT_ERR_SYS;
+	if (!chat_server_take_received(server))
+		return CHAT_ERR_TIMEOUT;
+	return 0;
+}
+
+bool
+chat_server_peek_next(struct chat_server *server, struct chat_message_view *view)
+{
+	/* As a chat_broadcast puts them, both frames are there and valid */
+	size_t len;
+	const char *data = pmq_data(&server->received, &len);
+	struct chat_frame author, msg;
+	ssize_t author_size = chat_frame_decode(data, len, &author);
+	if (author_size <= 0)
+		return false;
+	ssize_t msg_size = chat_frame_decode(data + author_size, len - author_size, &msg);
+	uint32_t id;
+	int rc = chat_frame_take_id(&author, &id) | chat_frame_take_id(&msg, &id);
+	assert(msg_size > 0 && rc == 0);
+	(void)rc;
+
+#if NEED_AUTHOR
+	view->author = author.body;
+	view->author_size = author.body_size;
+#endif
+	view->data = msg.body;
+	view->data_size = msg.body_size;
+	server->peeked_size = author_size + msg_size;
+	return true;
+}
+
+void
+chat_server_consume(struct chat_server *server)
+{
+	assert(server->peeked_size > 0);
+	pmq_consume(&server->received, server->peeked_size);
+	server->peeked_size = 0;
+}
+
+struct chat_message *
+chat_server_pop_next(struct chat_server *server)
+{
+	struct chat_message_view view;
+	if (!chat_server_peek_next(server, &view))
+		return NULL;
+#if NEED_AUTHOR
+	struct chat_message *ret = chat_message_new(view.author, view.author_size,
+						    view.data, view.data_size);
+#else
+	struct chat_message *ret = chat_message_new(NULL, 0, view.data, view.data_size);
+#endif
+	chat_server_consume(server);
 	return ret;
 }
 
@@ -387,8 +3651,17 @@ chat_server_get_descriptor(const struct chat_server *server)
 	 * poll() on the epoll's descriptor, then on return from poll() you can
 	 * be sure epoll_wait() can return something useful for some of those
 	 * sockets.
+	 *
+	 * In the threaded mode the shards wait for their sockets themselves,
+	 * and the eventfd of the received messages is what is left to wait for.
 	 */
-	return server->epoll_fd;
+	if (server->shard_count == 0)
+		return -1;
+	if (server->thread_count > 0)
+		return server->received_mail.fd;
+	if (server->shards[0].ring)
+		return server->shards[0].ring->fd;
+	return server->shards[0].epoll_fd;
 #else
 	(void)server;
 	return -1;
@@ -398,15 +3671,432 @@ chat_server_get_descriptor(const struct chat_server *server)
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	if (server->shard_count == 0)
+		return -1;
+	return server->shards[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-    	if (server->socket < 0)
+    	if (server->shard_count == 0)
 	    return 0;
-	if (server->pending_output_peers)
+	if (server->thread_count == 0 && server->shards[0].pending_output_peers)
 		return CHAT_EVENT_INPUT | CHAT_EVENT_OUTPUT;
 	return CHAT_EVENT_INPUT;
 }
+
+int
+chat_server_link(struct chat_server *server, const char *addr)
+{
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->node_id == 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->thread_count > 0 || server->backend != CHAT_SERVER_BACKEND_EPOLL)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	const char *colon = strrchr(addr, ':');
+	if (!colon)
+		return CHAT_ERR_NO_ADDR;
+	char *host = strndup(addr, colon - addr);
+	if (!host)
+		abort();
+	/* IPv4 only, as the servers listen */
+	struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *result;
+	int rc = getaddrinfo(host, colon + 1, &hints, &result);
+	free(host);
+	if (rc != 0)
+		return CHAT_ERR_NO_ADDR;
+	int fd = -1;
+	for (struct addrinfo *ai = result; ai && fd < 0; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+			int save_errno = errno;
+			close(fd);
+			errno = save_errno;
+			fd = -1;
+		}
+	}
+	freeaddrinfo(result);
+	if (fd < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+		if (fd >= 0)
+			close(fd);
+		return CHAT_ERR_SYS;
+	}
+
+	struct chat_shard *shard = &server->shards[0];
+	struct chat_peer *peer = chat_shard_new_peer(shard, fd);
+	chat_shard_add_link(shard, peer);
+	if (0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd,
+			  &(struct epoll_event){.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+						.data.u64 = chat_peer_handle(shard, peer)})) {
+		int save_errno = errno;
+		chat_shard_delete_peer(shard, peer);
+		errno = save_errno;
+		return CHAT_ERR_SYS;
+	}
+	/* The offer and the node, as a client offers the protocol and the name */
+	char hello[2 + CHAT_FRAME_HEADER_MAX + CHAT_VARINT_MAX] = {CHAT_FRAME_MAGIC, CHAT_FRAME_VERSION};
+	char id[CHAT_VARINT_MAX];
+	size_t id_size = chat_varint_encode(server->node_id, id);
+	size_t hello_size = 2 + chat_frame_header(CHAT_FRAME_NODE, id_size, hello + 2);
+	memcpy(hello + hello_size, id, id_size);
+	hello_size += id_size;
+	struct shared_buffer *buf = shared_buffer_new(hello_size);
+	memcpy(buf->data, hello, hello_size);
+	chat_shard_send(shard, peer, buf, true);
+	shared_buffer_unref(buf);
+	return 0;
+}
+
+/*
+ * Hot restart, see chat_server_handoff(). On the socket there go the
+ * header with the listening socket, the room names, and the peers, each a
+ * chat_handoff_peer with its socket and then the bytes of its name, of
+ * its `known_authors`, of its incoming and outgoing queues, in that order.
+ * Both sides are the same build, so the records are as they are in memory.
+ */
+
+enum {
+	/// "CHH1", of the first bytes
+	CHAT_HANDOFF_MAGIC = 0x43484831,
+};
+
+struct chat_handoff_header {
+	uint32_t magic;
+	uint32_t author_count;
+	uint32_t room_count;
+	uint32_t peer_count;
+	uint64_t next_seq;
+};
+
+/// Followed by the `len` bytes of the name.
+struct chat_handoff_room {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct chat_handoff_peer {
+	uint64_t seen_seq;
+	uint64_t incoming_size;
+	uint64_t outgoing_size;
+	uint32_t author_id;
+	uint32_t room;
+	uint32_t author_len;
+	uint32_t known_authors_size;
+	uint8_t proto;
+	uint8_t version;
+	bool is_proto_known;
+	bool is_packing;
+	bool has_author;
+};
+
+/// Writes all of `iov`, with `pass_fd` in SCM_RIGHTS if it isn't -1.
+static int chat_handoff_writev(int fd, struct iovec *iov, int count, int pass_fd) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	while (count > 0) {
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+		if (pass_fd >= 0) {
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof(control.buf);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+		}
+		ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pass_fd = -1;
+		for (; count > 0 && (size_t)sent >= iov->iov_len; ++iov, --count)
+			sent -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+static int chat_handoff_write(int fd, const void *data, size_t size, int pass_fd) {
+	struct iovec iov = {.iov_base = (void *)data, .iov_len = size};
+	return chat_handoff_writev(fd, &iov, size > 0, pass_fd);
+}
+
+/**
+ * Reads all the `size` bytes, and the descriptor that comes with them to
+ * `got_fd` if it isn't NULL, -1 if none comes. Any other is closed.
+ */
+static int chat_handoff_read(int fd, void *data, size_t size, int *got_fd) {
+	if (got_fd)
+		*got_fd = -1;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * 4)];
+	} control;
+	while (size > 0) {
+		struct iovec iov = {.iov_base = data, .iov_len = size};
+		struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+				     .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+		ssize_t got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got == 0)
+			errno = ECONNRESET;
+		if (got <= 0)
+			return -1;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < fd_count; ++i) {
+				int passed;
+				memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (got_fd && *got_fd < 0)
+					*got_fd = passed;
+				else
+					close(passed);
+			}
+		}
+		data = (char *)data + got;
+		size -= got;
+	}
+	return 0;
+}
+
+/// Whether the peer goes to the new server: not the one disconnected already,
+/// nor a link to another node, which is closed with this one.
+static bool chat_peer_is_handed(const struct chat_peer *peer) {
+	return peer->is_used && !peer->is_shut && !peer->is_link;
+}
+
+static int chat_handoff_send_peer(int fd, const struct chat_peer *peer) {
+	size_t incoming_size;
+	const char *incoming = pmq_data(&peer->incoming, &incoming_size);
+	struct chat_handoff_peer rec = {
+		.seen_seq = peer->seen_seq,
+		.incoming_size = incoming_size,
+		.outgoing_size = peer->outgoing.size,
+		.author_id = peer->author_id,
+		.room = peer->room,
+		.known_authors_size = peer->known_authors_size,
+		.proto = peer->proto,
+		.version = peer->version,
+		.is_proto_known = peer->is_proto_known,
+		.is_packing = peer->is_packing,
+	};
+	struct iovec iov[SBQ_IOV_MAX];
+	int count = 0;
+	iov[count++] = (struct iovec){.iov_base = &rec, .iov_len = sizeof(rec)};
+#if NEED_AUTHOR
+	rec.has_author = peer->has_author;
+	rec.author_len = peer->has_author ? peer->author_len : 0;
+	iov[count++] = (struct iovec){.iov_base = peer->author, .iov_len = rec.author_len};
+#endif
+	iov[count++] = (struct iovec){.iov_base = peer->known_authors, .iov_len = rec.known_authors_size};
+	iov[count++] = (struct iovec){.iov_base = (void *)incoming, .iov_len = incoming_size};
+	/* The socket with the record, the outgoing bytes in batches after it */
+	int pass_fd = peer->socket;
+	const struct shared_buffer_queue *q = &peer->outgoing;
+	for (size_t i = 0; i < q->count; ++i) {
+		if (count == SBQ_IOV_MAX) {
+			if (chat_handoff_writev(fd, iov, count, pass_fd) != 0)
+				return -1;
+			pass_fd = -1;
+			count = 0;
+		}
+		const struct shared_buffer_view *view = &q->views[(q->head + i) & (q->capacity - 1)];
+		iov[count++] = (struct iovec){.iov_base = view->buf->data + view->offset,
+					      .iov_len = view->buf->size - view->offset};
+	}
+	return chat_handoff_writev(fd, iov, count, pass_fd);
+}
+
+int
+chat_server_handoff(struct chat_server *server, int fd)
+{
+	if (server->shard_count == 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->thread_count > 0 || server->backend != CHAT_SERVER_BACKEND_EPOLL ||
+	    server->local_path)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	struct chat_shard *shard = &server->shards[0];
+	struct chat_room_names *names = &server->room_names;
+	pthread_mutex_lock(&server->history.lock);
+	uint64_t next_seq = server->history.next_seq;
+	pthread_mutex_unlock(&server->history.lock);
+	struct chat_handoff_header header = {
+		.magic = CHAT_HANDOFF_MAGIC,
+		.author_count = __atomic_load_n(&server->author_count, __ATOMIC_RELAXED),
+		.room_count = names->count,
+		.next_seq = next_seq,
+	};
+	for (uint32_t i = 0; i < shard->peer_count; ++i)
+		header.peer_count += chat_peer_is_handed(&shard->peers[i]);
+	if (chat_handoff_write(fd, &header, sizeof(header), shard->socket) != 0)
+		return CHAT_ERR_SYS;
+	int rc = 0;
+	pthread_mutex_lock(&names->lock);
+	for (size_t i = 0; i < names->capacity && rc == 0; ++i) {
+		const struct chat_room_name *slot = &names->slots[i];
+		if (!slot->name)
+			continue;
+		struct chat_handoff_room room = {.id = slot->id, .len = slot->len};
+		struct iovec iov[2] = {
+			{.iov_base = &room, .iov_len = sizeof(room)},
+			{.iov_base = slot->name, .iov_len = slot->len},
+		};
+		rc = chat_handoff_writev(fd, iov, 2, -1);
+	}
+	pthread_mutex_unlock(&names->lock);
+	for (uint32_t i = 0; i < shard->peer_count && rc == 0; ++i) {
+		if (chat_peer_is_handed(&shard->peers[i]))
+			rc = chat_handoff_send_peer(fd, &shard->peers[i]);
+	}
+	if (rc != 0)
+		return CHAT_ERR_SYS;
+	/* The connections are the new server's now, only the descriptors close */
+	chat_server_stop(server, 0);
+	return 0;
+}
+
+/// Takes a peer of chat_handoff_send_peer() into the shard.
+static int chat_handoff_take_peer(struct chat_shard *shard, int fd) {
+	struct chat_handoff_peer rec;
+	int sock;
+	if (chat_handoff_read(fd, &rec, sizeof(rec), &sock) != 0)
+		return CHAT_ERR_SYS;
+	if (sock < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	struct chat_peer *peer = chat_shard_new_peer(shard, sock);
+	peer->author_id = rec.author_id;
+	peer->seen_seq = rec.seen_seq;
+	peer->proto = rec.proto;
+	peer->version = rec.version;
+	peer->is_proto_known = rec.is_proto_known;
+	peer->is_packing = rec.is_packing;
+	if (rec.room != CHAT_ROOM_LOBBY) {
+		chat_shard_room_remove(shard, peer);
+		chat_shard_room_add(shard, peer, rec.room);
+	}
+	int rc = 0;
+	char *author = malloc(rec.author_len + 1);
+	uint8_t *known = realloc(peer->known_authors, rec.known_authors_size + 1);
+	if (!author || !known)
+		abort();
+	peer->known_authors = known;
+	peer->known_authors_size = rec.known_authors_size;
+	if (chat_handoff_read(fd, author, rec.author_len, NULL) != 0 ||
+	    chat_handoff_read(fd, known, rec.known_authors_size, NULL) != 0)
+		rc = CHAT_ERR_SYS;
+#if NEED_AUTHOR
+	if (rc == 0 && rec.has_author)
+		chat_peer_set_author(peer, author, rec.author_len);
+#endif
+	free(author);
+	/* Through a buffer of the queue's own, as pmq_recv() fills it */
+	if (rc == 0 && rec.incoming_size > 0) {
+		char *incoming = malloc(rec.incoming_size);
+		if (!incoming)
+			abort();
+		if (chat_handoff_read(fd, incoming, rec.incoming_size, NULL) == 0)
+			pmq_put(&peer->incoming, incoming, rec.incoming_size);
+		else
+			rc = CHAT_ERR_SYS;
+		free(incoming);
+	}
+	if (rc == 0 && rec.outgoing_size > 0) {
+		/* Pinned: it may start in the middle of a frame */
+		struct shared_buffer *outgoing = shared_buffer_new(rec.outgoing_size);
+		if (chat_handoff_read(fd, outgoing->data, rec.outgoing_size, NULL) == 0) {
+			sbq_push_pinned(&peer->outgoing, outgoing);
+			chat_shard_account(shard, peer, 0);
+		} else {
+			rc = CHAT_ERR_SYS;
+		}
+		shared_buffer_unref(outgoing);
+	}
+	/* Edge-triggered, but what is there already is reported once added */
+	if (rc == 0 && 0 > epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, sock,
+				     &(struct epoll_event){.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+							   .data.u64 = chat_peer_handle(shard, peer)}))
+		rc = CHAT_ERR_SYS;
+	if (rc != 0)
+		chat_shard_delete_peer(shard, peer);
+	return rc;
+}
+
+int
+chat_server_takeover(struct chat_server *server, int fd)
+{
+	if (server->shard_count > 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->thread_count > 0 || server->backend != CHAT_SERVER_BACKEND_EPOLL ||
+	    server->local_path)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	struct chat_handoff_header header;
+	int sock;
+	if (chat_handoff_read(fd, &header, sizeof(header), &sock) != 0)
+		return CHAT_ERR_SYS;
+	if (header.magic != CHAT_HANDOFF_MAGIC || sock < 0) {
+		if (sock >= 0)
+			close(sock);
+		return CHAT_ERR_INVALID_ARGUMENT;
+	}
+	int rc = chat_server_new_shards(server, 1);
+	struct chat_shard *shard = &server->shards[0];
+	shard->socket = sock;
+	if (rc == 0)
+		rc = chat_shard_start(shard);
+
+	struct chat_room_names *names = &server->room_names;
+	for (uint32_t i = 0; i < header.room_count && rc == 0; ++i) {
+		struct chat_handoff_room room;
+		if (chat_handoff_read(fd, &room, sizeof(room), NULL) != 0) {
+			rc = CHAT_ERR_SYS;
+			break;
+		}
+		char *name = malloc(room.len ? room.len : 1);
+		if (!name)
+			abort();
+		if (chat_handoff_read(fd, name, room.len, NULL) != 0) {
+			free(name);
+			rc = CHAT_ERR_SYS;
+			break;
+		}
+		size_t hash = chat_room_hash(name, room.len);
+		pthread_mutex_lock(&names->lock);
+		struct chat_room_name *slot = chat_room_names_slot(names, name, room.len, hash);
+		if (slot->name) {
+			free(name);
+		} else {
+			*slot = (struct chat_room_name){.name = name, .len = room.len, .hash = hash, .id = room.id};
+			++names->count;
+			chat_room_names_index(names, slot);
+		}
+		pthread_mutex_unlock(&names->lock);
+	}
+	for (uint32_t i = 0; i < header.peer_count && rc == 0; ++i)
+		rc = chat_handoff_take_peer(shard, fd);
+	if (rc != 0) {
+		int save_errno = errno;
+		chat_server_stop(server, 0);
+		errno = save_errno;
+		return rc;
+	}
+	/* After the peers, which have taken new ids to be replaced */
+	__atomic_store_n(&server->author_count, header.author_count, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&server->history.lock);
+	if (header.next_seq > server->history.next_seq)
+		server->history.next_seq = header.next_seq;
+	pthread_mutex_unlock(&server->history.lock);
+	return 0;
+}
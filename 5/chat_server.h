@@ -1,8 +1,12 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
+struct chat_message_view;
+struct thread_pool;
 
 /**
  * Create a new chat server. No bind, no listen, just allocate and
@@ -25,11 +29,57 @@ chat_server_delete(struct chat_server *server);
  * @retval !=0 Error code.
  *     - CHAT_ERR_PORT_BUSY - the port is already busy.
  *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - a local path with the io_uring
+ *       backend, see chat_server_set_local_path().
  *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int
 chat_server_listen(struct chat_server *server, uint16_t port);
 
+/**
+ * Hot restart, the old side: hand the listening socket and the peers over
+ * to the server of a new process, see chat_server_takeover(), on @a fd, a
+ * connected UNIX stream socket. The sockets go with SCM_RIGHTS, and with
+ * each peer its state: the protocol, name and room, the ids of the authors
+ * it knows, what it has sent and isn't handled yet and what is queued to
+ * it and isn't sent yet. The room names, the author ids and the message
+ * numbers go on from where they are, the history itself is not handed.
+ *
+ * Then, the server is stopped, as if it never listened, and the clients
+ * don't see a thing: their connections are the new server's. The messages
+ * not popped yet stay. On a failure the server goes on as it was.
+ *
+ * @param server Chat server, listening, with no threads, see
+ *     chat_server_set_threads(), on the epoll backend and with no local
+ *     path, see chat_server_set_local_path().
+ * @param fd The socket, left open.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the server is of the kind not handed.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_handoff(struct chat_server *server, int fd);
+
+/**
+ * Hot restart, the new side: instead of chat_server_listen(), take the
+ * listening socket and the peers the old process sends with
+ * chat_server_handoff() on @a fd. The server is set up as for listening
+ * first, with the same limits as chat_server_handoff() has.
+ *
+ * @retval 0 Success, the server is listening.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the server is of the kind not handed.
+ *     - CHAT_ERR_INVALID_ARGUMENT - what came is not a handoff.
+ *     - CHAT_ERR_SYS - a system error, check errno. Also when the old
+ *       side has closed before the end.
+ */
+int
+chat_server_takeover(struct chat_server *server, int fd);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -42,6 +92,418 @@ chat_server_listen(struct chat_server *server, uint16_t port);
 struct chat_message *
 chat_server_pop_next(struct chat_server *server);
 
+/**
+ * Look at the next pending message without taking it or allocating
+ * anything: the view points into the receive buffer. It stays valid until
+ * chat_server_consume() or chat_server_update(), and peeking again before
+ * those gives the same message.
+ *
+ * @param server Chat server.
+ * @param view The message.
+ *
+ * @retval true There is a message, in @a view.
+ * @retval false No more messages yet.
+ */
+bool
+chat_server_peek_next(struct chat_server *server,
+		      struct chat_message_view *view);
+
+/**
+ * Take the message chat_server_peek_next() has given, which has to be
+ * there.
+ */
+void
+chat_server_consume(struct chat_server *server);
+
+enum {
+	/** How many events chat_server_update() takes at once by default. */
+	CHAT_SERVER_EVENT_BATCH = 256,
+	/** Most event loop threads of chat_server_set_threads(). */
+	CHAT_SERVER_MAX_THREADS = 256,
+};
+
+enum chat_server_backend {
+	/** Readiness with epoll, then the system calls. The default. */
+	CHAT_SERVER_BACKEND_EPOLL,
+	/**
+	 * io_uring: a multishot accept, a multishot recv into provided
+	 * buffers per peer and one sendmsg per peer of all it has queued, with
+	 * no system calls per event. Needs Linux 6.0 or newer.
+	 */
+	CHAT_SERVER_BACKEND_URING,
+	/**
+	 * A coroutine of libcoro per peer, reading and writing as if it was
+	 * blocking, over the same epoll as CHAT_SERVER_BACKEND_EPOLL: the
+	 * events only wake the coroutines up. Only with the server built with
+	 * CHAT_SERVER_CORO and linked with libcoro of the assignment 1, see
+	 * `make test_coro`. chat_server_update() is the scheduler of libcoro
+	 * then, to be called not from a coroutine, and the server takes the
+	 * run-queue of the thread: it is run till all the coroutines wait.
+	 */
+	CHAT_SERVER_BACKEND_CORO,
+};
+
+/**
+ * Choose how the server waits for and does its IO. With io_uring the
+ * descriptor of chat_server_get_descriptor() is the ring's, and the event
+ * batch does not matter: all the completions are taken at once.
+ *
+ * @param server Chat server, not listening yet.
+ * @param backend The backend.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no such backend.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the coroutines, not built with them.
+ *
+ * If the kernel has no io_uring, chat_server_listen() fails with
+ * CHAT_ERR_SYS. With the coroutines it is CHAT_ERR_NOT_IMPLEMENTED
+ * together with the threads or the local socket.
+ */
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_server_backend backend);
+
+struct chat_socket_options;
+
+/**
+ * Set the options of the listening socket and of the clients' ones, see
+ * chat_socket_options. The default is chat_socket_options_init().
+ *
+ * @param server Chat server, not listening yet.
+ * @param opts The options, copied.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - see chat_socket_options_check().
+ */
+int
+chat_server_set_socket_options(struct chat_server *server,
+			       const struct chat_socket_options *opts);
+
+/**
+ * Listen for the clients on the same host on the UNIX socket @a path too,
+ * see chat_client_connect_local(). A local client sends the server a memfd
+ * over it, and then the bytes go through the shared memory, a ring each
+ * way, with an eventfd each side to wake the other one only when it waits.
+ * The protocols are the same as over TCP. A file at @a path is replaced,
+ * and removed once the server stops. The local clients are all of the
+ * first thread, see chat_server_set_threads().
+ *
+ * @param server Chat server, not listening yet.
+ * @param path Path of the socket, NULL for none, which is the default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the path is empty or too long.
+ *
+ * With the io_uring backend chat_server_listen() fails with
+ * CHAT_ERR_NOT_IMPLEMENTED.
+ */
+int
+chat_server_set_local_path(struct chat_server *server, const char *path);
+
+/**
+ * Run the server on @a count event loop threads instead of in
+ * chat_server_update(). Each thread listens on its own socket bound to the
+ * same port with SO_REUSEPORT, so the kernel spreads the clients between
+ * them, and each has its own epoll and peers. The messages one thread
+ * receives get to the others through their mailboxes.
+ *
+ * chat_server_update() then only waits for the received messages, to be
+ * taken by chat_server_pop_next() as usual, and chat_server_feed() may
+ * be called any time. The event batch can't be changed once listening.
+ *
+ * @param server Chat server, not listening yet.
+ * @param count Number of threads, 0 to run the loop in
+ *     chat_server_update(), which is the default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - more than CHAT_SERVER_MAX_THREADS.
+ */
+int
+chat_server_set_threads(struct chat_server *server, uint32_t count);
+
+/**
+ * Set how many events one chat_server_update() takes from the kernel at
+ * most. A bigger batch handles more peers per system call when many of
+ * them are active at once.
+ *
+ * @param server Chat server.
+ * @param size Number of events, at least 1.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the size is 0.
+ *     - CHAT_ERR_ALREADY_STARTED - the threads are already running, see
+ *       chat_server_set_threads().
+ */
+int
+chat_server_set_event_batch(struct chat_server *server, uint32_t size);
+
+/**
+ * Busy-poll for the events before waiting for them: an update of a loop
+ * spins on taking them without blocking for up to @a spin_us microseconds,
+ * and only then waits for the rest of its timeout. What comes meanwhile is
+ * handled with no wakeup of a sleeping thread, at the price of a core busy
+ * all along. With busy_poll_us of the socket options, see
+ * chat_server_set_socket_options(), the epoll also polls the device itself
+ * while waiting (EPIOCSPARAMS, Linux 6.9), where the driver can.
+ *
+ * The loop is pinned to @a cpu, best an isolated one (isolcpus=), and the
+ * threads of chat_server_set_threads() each to the next one after it. With
+ * no threads the loop is the thread calling chat_server_update(), pinned
+ * at its first call. A CPU not there leaves the thread as it is.
+ *
+ * @param server Chat server, not listening yet.
+ * @param spin_us Microseconds to spin, 0 for none, which is the default.
+ * @param cpu The first CPU, -1 for no pinning, which is the default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the cpu is negative but -1.
+ */
+int
+chat_server_set_busy_poll(struct chat_server *server, uint32_t spin_us, int cpu);
+
+/** What the server does when the output queued for the peers is too big. */
+enum chat_server_overflow {
+	/**
+	 * Drop the oldest messages not sent yet, of the peer over its limit,
+	 * or of the peers that are behind while over the total limit.
+	 */
+	CHAT_SERVER_OVERFLOW_DROP_OLDEST,
+	/** Disconnect the peer, over its limit or behind over the total. */
+	CHAT_SERVER_OVERFLOW_DISCONNECT,
+	/**
+	 * Stop reading from all the peers until the output is within the
+	 * limits again. Nothing is lost, but one peer that doesn't read
+	 * stops the whole chat, and the producers wait in their sockets.
+	 */
+	CHAT_SERVER_OVERFLOW_PAUSE_INPUT,
+};
+
+/**
+ * Limit the output queued for the peers, which grows when they don't read
+ * as fast as the others write.
+ *
+ * @param server Chat server.
+ * @param peer_limit Most bytes queued for one peer, 0 for no limit, which
+ *     is the default.
+ * @param total_limit Most bytes queued for all the peers together, 0 for no
+ *     limit, which is the default.
+ * @param policy What to do over a limit.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - no such policy.
+ *     - CHAT_ERR_ALREADY_STARTED - the threads are already running, see
+ *       chat_server_set_threads().
+ */
+int
+chat_server_set_output_limits(struct chat_server *server, size_t peer_limit,
+			      size_t total_limit,
+			      enum chat_server_overflow policy);
+
+/**
+ * Keep the last @a count messages broadcast, numbered, for the binary
+ * clients to catch up on what they have missed while reconnecting, see
+ * chat_client_resume(). The clients get the numbers with the messages, and
+ * a resuming one gets all the messages after its last one at once, of its
+ * room and of the feed, but for its own. Older messages than the history
+ * has are lost, and the text clients don't get the numbers.
+ *
+ * @param server Chat server, not listening yet.
+ * @param count Number of messages, 0 to keep none, which is the default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_history(struct chat_server *server, uint32_t count);
+
+/**
+ * Make the server a node of a cluster, the id @a id unique in it: the
+ * nodes linked with chat_server_link() relay the messages to each other,
+ * so the clients of any node get the ones of all, of their room and of the
+ * feed, with the names of the authors. A message goes to each link, as
+ * CHAT_FRAME_RELAY batched with the rest, with the id of the node it is
+ * from and a number of its own there, so the loops of the links bring it
+ * to a node only once. The ones relayed are as the clients' own on the
+ * node for chat_server_pop_next() and the history too. A server that is
+ * not a node takes no links.
+ *
+ * @param server Chat server, not listening yet.
+ * @param id Node id, not 0.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the id is 0.
+ */
+int
+chat_server_set_node_id(struct chat_server *server, uint32_t id);
+
+/**
+ * Link to another node of the cluster at @a addr, see
+ * chat_server_set_node_id(): a connection both ways, made right away and
+ * waited for. A node needs to link only to the ones up before it, the
+ * later ones link to it. A link lost is not made again: the node coming
+ * back links to the others, and a handed over server, see
+ * chat_server_handoff(), doesn't hand the links.
+ *
+ * @param server Chat server, a node, listening, with no threads, see
+ *     chat_server_set_threads(), on the epoll backend. The others take the
+ *     links in any mode.
+ * @param addr Address of the other node, like 'localhost:1234'.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the server is not a node.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the server is of the kind not linking.
+ *     - CHAT_ERR_NO_ADDR - the addr couldn't be resolved.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_link(struct chat_server *server, const char *addr);
+
+enum {
+	/** A fair chat_server_set_compression() size: smaller is rarely worth it. */
+	CHAT_SERVER_COMPRESS_MIN = 256,
+};
+
+/**
+ * Compress the messages of at least @a min_size bytes for the binary
+ * clients that take it, see chat_client_set_compression(). A message is
+ * compressed once for all of them, as an LZ4 block, and only goes so if it
+ * gets smaller. The others get it as it is.
+ *
+ * @param server Chat server, not listening yet.
+ * @param min_size Least size of a message to compress, 0 to compress none,
+ *     which is the default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_compression(struct chat_server *server, uint32_t min_size);
+
+enum {
+	/** A fair chat_server_set_offload() size: a smaller one packs faster than it goes there. */
+	CHAT_SERVER_OFFLOAD_MIN = 64 * 1024,
+};
+
+/**
+ * Compress the received messages of at least @a min_size bytes in @a pool
+ * of the assignment 4 instead of the event loop, which goes on meanwhile.
+ * A compressed message comes back through the eventfd of the loop, in its
+ * epoll or ring, and is broadcast from there: so the messages a loop
+ * receives after it wait for it, and are broadcast in the order they came.
+ * Nothing is done without the compression, see
+ * chat_server_set_compression(). The messages of chat_server_feed() are
+ * compressed by the caller as before. Only with the server built with
+ * CHAT_SERVER_TPOOL and linked with the thread pool, see `make test_tpool`.
+ *
+ * @param server Chat server, not listening yet.
+ * @param pool The pool, to outlive the server, NULL to compress in the
+ *     loop, which is the default.
+ * @param min_size Least size of a message to compress in the pool.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - not built with CHAT_SERVER_TPOOL.
+ */
+int
+chat_server_set_offload(struct chat_server *server, struct thread_pool *pool,
+			uint32_t min_size);
+
+struct chat_server_output_stats {
+	/** Bytes queued for the peers now. */
+	size_t queued_bytes;
+	/**
+	 * Bytes and messages never sent: the oldest ones dropped, or all a
+	 * disconnected peer had queued.
+	 */
+	uint64_t dropped_bytes;
+	uint64_t dropped_messages;
+	/** Peers disconnected by CHAT_SERVER_OVERFLOW_DISCONNECT. */
+	uint64_t disconnected_peers;
+	/** Times CHAT_SERVER_OVERFLOW_PAUSE_INPUT stopped reading. */
+	uint64_t input_pauses;
+};
+
+/** Get the counters of the output, which any thread may do any time. */
+void
+chat_server_get_output_stats(const struct chat_server *server,
+			     struct chat_server_output_stats *stats);
+
+enum {
+	/** Buckets of chat_server_loop_stats::queue_depths. */
+	CHAT_SERVER_QUEUE_DEPTH_BUCKETS = 8,
+};
+
+/**
+ * The counters of the event loops, since listen. Each loop keeps its own,
+ * for them to cost next to nothing, and they are summed up when read.
+ */
+struct chat_server_loop_stats {
+	/** Updates of the loops with something to do, and its events. */
+	uint64_t updates;
+	uint64_t events;
+	/** Updates which have taken the whole event batch, epoll only. */
+	uint64_t full_batches;
+	/** Updates which have found their events busy-polling, see chat_server_set_busy_poll(). */
+	uint64_t busy_polls;
+	/** Nanoseconds the loops have spent on the events, and the most an update took. */
+	uint64_t busy_ns;
+	uint64_t max_busy_ns;
+	uint64_t accepted_peers;
+	/** Connections failed at accept, or shed out of descriptors. */
+	uint64_t accept_errors;
+	/** Bytes received from the peers and sent to them. */
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	/** Messages and commands received from the peers. */
+	uint64_t messages_received;
+	/**
+	 * Messages broadcast, once by each loop in the threaded mode, and
+	 * queued to a peer, and nanoseconds spent queuing them.
+	 */
+	uint64_t broadcasts;
+	uint64_t deliveries;
+	uint64_t fanout_ns;
+	/**
+	 * How many bytes the peers had queued once something was for them: up
+	 * to 1KB, 4KB, 16KB, and so on by 4 times, the last bucket is more.
+	 */
+	uint64_t queue_depths[CHAT_SERVER_QUEUE_DEPTH_BUCKETS];
+};
+
+/** Get the counters of the loops, which any thread may do any time. */
+void
+chat_server_get_loop_stats(const struct chat_server *server,
+			   struct chat_server_loop_stats *stats);
+
+/**
+ * Print the counters of the loops and of the output to @a buf of @a size
+ * bytes, "<name> <value>" a line, as snprintf() does.
+ *
+ * @return The length of all the text, even if it doesn't fit.
+ */
+int
+chat_server_format_stats(const struct chat_server *server, char *buf,
+			 size_t size);
+
 /**
  * Wait for any update on any of the sockets for the given timeout
  * and do this update.
@@ -104,3 +566,25 @@ chat_server_get_events(const struct chat_server *server);
 int
 chat_server_feed(struct chat_server *server, const char *msg,
 		 uint32_t msg_size);
+
+struct iovec;
+
+/**
+ * Feed several buffers to the server at once, each like a
+ * chat_server_feed() one. The messages of all of them are queued to every
+ * peer before anything is sent, so a peer gets them in one send instead
+ * of one a message, and the other threads are woken once.
+ *
+ * @param server Chat server.
+ * @param parts The buffers.
+ * @param count Number of the buffers.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - not implemented.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_feed_many(struct chat_server *server, const struct iovec *parts,
+		      int count);
@@ -2,13 +2,20 @@
 #include "chat_server.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <poll.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -26,41 +33,296 @@ port_from_str(const char *str, uint16_t *port)
 	return 0;
 }
 
+struct stats_ctx {
+	struct chat_server *server;
+	int socket;
+};
+
+/**
+ * Answers each connection to the stats socket with the counters of the
+ * server, as an HTTP response for curl to take as well as nc.
+ */
+static void *
+stats_f(void *arg)
+{
+	struct stats_ctx *ctx = arg;
+	char buf[4096];
+	while (true) {
+		int fd = accept(ctx->socket, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		/* The request, whatever it is, for the close not to reset */
+		struct timeval timeout = {.tv_sec = 1};
+		(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		(void)recv(fd, buf, sizeof(buf), 0);
+		static const char head[] =
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+		int len = chat_server_format_stats(ctx->server, buf, sizeof(buf));
+		if ((size_t)len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+		(void)send(fd, head, sizeof(head) - 1, MSG_NOSIGNAL | MSG_MORE);
+		(void)send(fd, buf, len, MSG_NOSIGNAL);
+		close(fd);
+	}
+	return NULL;
+}
+
+/** Listen for the stats on localhost:@a port, in a thread of its own. */
+static int
+stats_start(struct stats_ctx *ctx, struct chat_server *server, uint16_t port)
+{
+	ctx->server = server;
+	ctx->socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (ctx->socket < 0)
+		return -1;
+	int on = 1;
+	(void)setsockopt(ctx->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	pthread_t thread;
+	if (bind(ctx->socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(ctx->socket, 16) != 0 ||
+	    pthread_create(&thread, NULL, stats_f, ctx) != 0) {
+		close(ctx->socket);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/** The address of the restart socket at @a path, or -1 if too long. */
+static int
+restart_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -1;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/**
+ * Takes the clients over from the server running with the same
+ * --restart=<path>, if there is one. Returns 1 if there isn't, then it is
+ * for chat_server_listen().
+ */
+static int
+restart_takeover(struct chat_server *server, const char *path)
+{
+	struct sockaddr_un addr;
+	if (restart_addr(path, &addr) != 0)
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+	}
+	int rc = chat_server_takeover(server, fd);
+	close(fd);
+	return rc;
+}
+
+/**
+ * Listens on @a path for the next server, see restart_takeover(). The old
+ * one has handed over and closed its socket by now, only the file is left.
+ */
+static int
+restart_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	if (restart_addr(path, &addr) != 0)
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	(void)unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Hands the clients over to the next server connecting. 0 if done. */
+static int
+restart_handoff(struct chat_server *server, int listen_fd)
+{
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return -1;
+	int rc = chat_server_handoff(server, fd);
+	close(fd);
+	if (rc != 0)
+		printf("Couldn't hand over: %d\n", rc);
+	return rc;
+}
+
+static int
+usage(void)
+{
+	printf("Expected a port to listen on, and optionally a number of threads and \"uring\", --low-latency, --local=<path>, --stats=<port>, --restart=<path>, --node=<id>, --link=<addr> (at most 16) and --busy-poll=<us>[,<cpu>]\n");
+	return -1;
+}
+
 int
 main(int argc, char **argv)
 {
-	if (argc < 2) {
-		printf("Expected a port to listen on\n");
-		return -1;
+	/*
+	 * The options go anywhere, the rest are the port, the threads and
+	 * "uring" in this order:
+	 * --low-latency, see chat_socket_options_low_latency();
+	 * --local=<path>, see chat_server_set_local_path();
+	 * --stats=<port>, see chat_server_format_stats();
+	 * --restart=<path>: a server started with the same path takes the
+	 * clients over from this one, which exits then, see
+	 * chat_server_handoff();
+	 * --node=<id>, see chat_server_set_node_id(), with --link=<addr> of
+	 * each node up already, see chat_server_link();
+	 * --busy-poll=<us>[,<cpu>], see chat_server_set_busy_poll().
+	 */
+	bool is_low_latency = false;
+	const char *local_path = NULL;
+	const char *stats_port_str = NULL;
+	const char *restart_path = NULL;
+	const char *node_str = NULL;
+	enum { max_links = 16 };
+	const char *links[max_links];
+	int link_count = 0;
+	const char *busy_poll_str = NULL;
+	int arg_count = 1;
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--", 2) != 0)
+			argv[arg_count++] = argv[i];
+		else if (strcmp(arg, "--low-latency") == 0)
+			is_low_latency = true;
+		else if (strncmp(arg, "--local=", 8) == 0)
+			local_path = arg + 8;
+		else if (strncmp(arg, "--stats=", 8) == 0)
+			stats_port_str = arg + 8;
+		else if (strncmp(arg, "--restart=", 10) == 0)
+			restart_path = arg + 10;
+		else if (strncmp(arg, "--node=", 7) == 0)
+			node_str = arg + 7;
+		else if (strncmp(arg, "--link=", 7) == 0 && link_count < max_links)
+			links[link_count++] = arg + 7;
+		else if (strncmp(arg, "--busy-poll=", 12) == 0)
+			busy_poll_str = arg + 12;
+		else
+			return usage();
 	}
+	argc = arg_count;
+	argv[argc] = NULL;
+	if (argc < 2)
+		return usage();
 	uint16_t port = 0;
 	int rc = port_from_str(argv[1], &port);
-	if (rc != 0) {
+	uint16_t stats_port = 0;
+	if (rc != 0 || (stats_port_str && port_from_str(stats_port_str, &stats_port) != 0)) {
 		printf("Invalid port\n");
 		return -1;
 	}
 	struct chat_server *serv = chat_server_new();
-	rc = chat_server_listen(serv, port);
+	if (is_low_latency) {
+		struct chat_socket_options opts;
+		chat_socket_options_low_latency(&opts);
+		(void)chat_server_set_socket_options(serv, &opts);
+	}
+	if (busy_poll_str) {
+		char *end;
+		unsigned long spin_us = strtoul(busy_poll_str, &end, 10);
+		long cpu = *end == ',' ? strtol(end + 1, &end, 10) : -1;
+		if (end == busy_poll_str || *end != '\0' || spin_us > UINT32_MAX || cpu < -1 ||
+		    cpu > INT_MAX || chat_server_set_busy_poll(serv, spin_us, cpu) != 0) {
+			printf("Invalid busy poll\n");
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
+	if (argc > 2) {
+		/* Optional number of event loop threads */
+		uint16_t threads = 0;
+		if (port_from_str(argv[2], &threads) != 0 ||
+		    chat_server_set_threads(serv, threads) != 0) {
+			printf("Invalid number of threads\n");
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
+	if (argc > 3 && strcmp(argv[3], "uring") == 0)
+		(void)chat_server_set_backend(serv, CHAT_SERVER_BACKEND_URING);
+	if (local_path && chat_server_set_local_path(serv, local_path) != 0) {
+		printf("Invalid local path\n");
+		chat_server_delete(serv);
+		return -1;
+	}
+	if (node_str) {
+		char *end;
+		unsigned long node_id = strtoul(node_str, &end, 10);
+		if (end == node_str || *end != '\0' || node_id > UINT32_MAX ||
+		    chat_server_set_node_id(serv, node_id) != 0) {
+			printf("Invalid node id\n");
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
+	rc = restart_path ? restart_takeover(serv, restart_path) : 1;
+	if (rc < 0) {
+		printf("Couldn't take over: %d\n", rc);
+		chat_server_delete(serv);
+		return -1;
+	} else if (rc == 0) {
+		puts("Taken over");
+	} else {
+		rc = chat_server_listen(serv, port);
+	}
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
 		chat_server_delete(serv);
 		return -1;
 	}
-#if NEED_SERVER_FEED
-	struct pollfd poll_fds[2] = {[0] = {.fd = STDIN_FILENO, .events = POLLIN}};
-
+	for (int i = 0; i < link_count; ++i) {
+		rc = chat_server_link(serv, links[i]);
+		if (rc != 0)
+			printf("Couldn't link to %s: %d\n", links[i], rc);
+	}
+	int restart_fd = -1;
+	if (restart_path && (restart_fd = restart_listen(restart_path)) < 0) {
+		printf("Couldn't listen for the restart: %s\n", strerror(errno));
+		chat_server_delete(serv);
+		return -1;
+	}
+	struct stats_ctx stats;
+	if (stats_port_str && stats_start(&stats, serv, stats_port) != 0) {
+		printf("Couldn't listen for the stats: %s\n", strerror(errno));
+		chat_server_delete(serv);
+		return -1;
+	}
+	/* The stdin only with the feed, the restart socket only if asked */
+	struct pollfd poll_fds[3] = {
+		[0] = {.fd = -1, .events = POLLIN},
+		[1] = {.fd = chat_server_get_descriptor(serv)},
+		[2] = {.fd = restart_fd, .events = POLLIN},
+	};
 	struct pollfd *poll_stdin = &poll_fds[0], *poll_server_queue = &poll_fds[1];
-	poll_server_queue->fd = chat_server_get_descriptor(serv);
+	struct pollfd *poll_restart = &poll_fds[2];
+#if NEED_SERVER_FEED
+	poll_stdin->fd = STDIN_FILENO;
 #endif
-	/*
-	 * The basic implementation without server messages. Just serving
-	 * clients.
-	 */
 	while (true) {
-#if NEED_SERVER_FEED
 		poll_server_queue->events = chat_events_to_poll_events(chat_server_get_events(serv));
 
-		int rc = poll(poll_fds, 2, -1);
+		int rc = poll(poll_fds, 3, -1);
 		if (rc < 0) {
 			printf("poll failed: %d\n", rc);
 			break;
@@ -84,30 +346,34 @@ main(int argc, char **argv)
 			}
 		}
 
-		if (poll_server_queue->revents) {
-			// Let the server handle it
-#endif
+		if (poll_restart->revents && restart_handoff(serv, restart_fd) == 0) {
+			puts("Handed over. Exiting");
+			break;
+		}
+		if (!poll_server_queue->revents)
+			continue;
 
-		int rc = chat_server_update(serv, -1);
+		// Let the server handle it
+		rc = chat_server_update(serv, -1);
 		if (rc != 0) {
 			printf("Update error: %d\n", rc);
 			break;
 		}
 		/* Flush all the pending messages to the standard output. */
-		struct chat_message *msg;
-		while ((msg = chat_server_pop_next(serv)) != NULL) {
+		struct chat_message_view msg;
+		while (chat_server_peek_next(serv, &msg)) {
 #if NEED_AUTHOR
-			printf("%s: %s\n", msg->author, msg->data);
+			printf("%.*s: %.*s\n", (int)msg.author_size, msg.author,
+			       (int)msg.data_size, msg.data);
 #else
-			printf("%s\n", msg->data);
+			printf("%.*s\n", (int)msg.data_size, msg.data);
 #endif
-			chat_message_delete(msg);
+			chat_server_consume(serv);
 		}
-
-#if NEED_SERVER_FEED
-		}
-#endif
 	}
+	/* The socket file is the next server's by now, if there is one */
+	if (restart_fd >= 0)
+		close(restart_fd);
 	chat_server_delete(serv);
 	return 0;
 }
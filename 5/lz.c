@@ -0,0 +1,152 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+enum {
+	/// Positions of the 4-byte sequences seen, by their hash.
+	LZ_HASH_LOG = 12,
+	LZ_MIN_MATCH = 4,
+	LZ_MAX_OFFSET = 65535,
+	/// A match starts this far from the end at least, and ends
+	/// LZ_LAST_LITERALS before it at most, as the format wants.
+	LZ_MATCH_LIMIT = 12,
+	LZ_LAST_LITERALS = 5,
+};
+
+static uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t seq) {
+	return (seq * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/// Writes the rest of a length of 15 or more after its token.
+static bool lz_put_length(uint8_t **op, const uint8_t *end, size_t len) {
+	for (len -= 15; ; len -= 255) {
+		if (*op == end)
+			return false;
+		if (len < 255) {
+			*(*op)++ = len;
+			return true;
+		}
+		*(*op)++ = 255;
+	}
+}
+
+/**
+ * Writes a sequence of `lit_len` literals from `lit` and, if `match_len`
+ * isn't 0, the match at `offset` after them.
+ */
+static bool lz_put_sequence(uint8_t **op, const uint8_t *end, const uint8_t *lit, size_t lit_len,
+			    size_t offset, size_t match_len) {
+	if (*op == end)
+		return false;
+	uint8_t *token = (*op)++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15 && !lz_put_length(op, end, lit_len))
+		return false;
+	if ((size_t)(end - *op) < lit_len)
+		return false;
+	memcpy(*op, lit, lit_len);
+	*op += lit_len;
+	if (match_len == 0)
+		return true;
+	if (end - *op < 2)
+		return false;
+	*(*op)++ = offset;
+	*(*op)++ = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	*token |= match_len < 15 ? match_len : 15;
+	return match_len < 15 || lz_put_length(op, end, match_len);
+}
+
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity) {
+	const uint8_t *in = (const uint8_t *)src;
+	uint8_t *op = (uint8_t *)dst, *end = op + capacity;
+	uint32_t table[1 << LZ_HASH_LOG];
+	memset(table, 0, sizeof(table));
+	size_t anchor = 0, pos = 0;
+	if (size > LZ_MATCH_LIMIT) {
+		size_t match_limit = size - LZ_MATCH_LIMIT;
+		size_t match_end = size - LZ_LAST_LITERALS;
+		while (pos < match_limit) {
+			uint32_t seq = lz_read32(in + pos);
+			uint32_t h = lz_hash(seq);
+			size_t cand = table[h];
+			table[h] = pos;
+			if (cand >= pos || pos - cand > LZ_MAX_OFFSET || lz_read32(in + cand) != seq) {
+				++pos;
+				continue;
+			}
+			size_t len = LZ_MIN_MATCH;
+			while (pos + len < match_end && in[cand + len] == in[pos + len])
+				++len;
+			if (!lz_put_sequence(&op, end, in + anchor, pos - anchor, pos - cand, len))
+				return 0;
+			pos += len;
+			anchor = pos;
+		}
+	}
+	if (!lz_put_sequence(&op, end, in + anchor, size - anchor, 0, 0))
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/// Reads the rest of a length of 15 after its token.
+static bool lz_take_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+	uint8_t byte;
+	do {
+		if (*ip == end)
+			return false;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+ssize_t lz_decompress(const char *src, size_t size, char *dst, size_t capacity) {
+	const uint8_t *ip = (const uint8_t *)src, *in_end = ip + size;
+	uint8_t *out = (uint8_t *)dst, *op = out, *out_end = out + capacity;
+	while (ip < in_end) {
+		uint8_t token = *ip++;
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !lz_take_length(&ip, in_end, &lit_len))
+			return -1;
+		if (lit_len > (size_t)(in_end - ip) || lit_len > (size_t)(out_end - op))
+			return -1;
+		memcpy(op, ip, lit_len);
+		ip += lit_len;
+		op += lit_len;
+		if (ip == in_end)
+			break;
+		if (in_end - ip < 2)
+			return -1;
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - out))
+			return -1;
+		size_t match_len = token & 15;
+		if (match_len == 15 && !lz_take_length(&ip, in_end, &match_len))
+			return -1;
+		match_len += LZ_MIN_MATCH;
+		if (match_len > (size_t)(out_end - op))
+			return -1;
+		/*
+		 * The match may overlap what it makes, then it repeats with the
+		 * period of the offset: copied by whole periods, twice as many
+		 * each time, from what is made already.
+		 */
+		uint8_t *match_end = op + match_len;
+		for (size_t dist = offset; op < match_end; dist *= 2) {
+			size_t chunk = (size_t)(match_end - op) < dist ? (size_t)(match_end - op) : dist;
+			memcpy(op, op - dist, chunk);
+			op += chunk;
+		}
+	}
+	return op - out;
+}
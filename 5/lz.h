@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * The LZ4 block format, compressed and decompressed in one go, with no
+ * library: the chat packs big messages with it once per broadcast, see
+ * CHAT_FRAME_PACKED. A block is sequences of
+ *
+ *     token | [literal length] | literals | offset | [match length]
+ *
+ * the token's high 4 bits the literal length and the low ones the match
+ * length - 4, each 15 followed by bytes to add up to the rest while 255.
+ * The offset is 2 bytes little-endian back in the output. The last
+ * sequence is of literals only, and the last 5 bytes are always literals.
+ */
+
+/**
+ * Compresses `size` bytes of `src` to `dst` of `capacity` bytes. Returns the
+ * size of the block, or 0 if it doesn't fit: with the capacity less than
+ * the size, whether compressing is any good.
+ */
+size_t lz_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * Decompresses the block `src` of `size` bytes to `dst` of `capacity`
+ * bytes. Returns the size decompressed, or -1 if the block is malformed or
+ * doesn't fit.
+ */
+ssize_t lz_decompress(const char *src, size_t size, char *dst, size_t capacity);
@@ -1,55 +1,197 @@
-#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/socket.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "partial_message_queue.h"
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 void pmq_init(struct partial_message_queue *pmq, size_t init_cap) {
 	pmq->base = malloc(sizeof (char) * init_cap);
 	if (!pmq->base)
 		abort();
-	pmq->read = pmq->base;
-	pmq->read[0] = '\0';
 	pmq->capacity = init_cap;
+	pmq->head = 0;
+	pmq->tail = 0;
+	pmq->scan = 0;
 }
 
 void pmq_destroy(struct partial_message_queue *pmq) {
 	free(pmq->base);
 }
 
-static void pmq_rebuf(struct partial_message_queue *pmq, size_t min_len) {
-	size_t new_sz = MAX(min_len, 2 * pmq->capacity);
-	size_t read_shift = pmq->read - pmq->base;
-	pmq->base = realloc(pmq->base, sizeof (char) * new_sz);
-	if (!pmq->base)
+void pmq_clear(struct partial_message_queue *pmq, size_t max_cap) {
+	pmq->head = 0;
+	pmq->tail = 0;
+	pmq->scan = 0;
+	if (pmq->capacity <= max_cap)
+		return;
+	char *base = realloc(pmq->base, max_cap);
+	if (!base)
 		abort();
-	pmq->read = pmq->base + read_shift;
+	pmq->base = base;
+	pmq->capacity = max_cap;
 }
 
-char *pmq_next_message(struct partial_message_queue *pmq) {
-	char *lf = strchrnul(pmq->read, '\n');
-	if (*lf) {
-		*lf = '\0';
-		char *ret = pmq->read;
-		pmq->read = lf + 1;
-		return ret;
+/// Makes room for `count` more bytes at `tail`.
+static void pmq_reserve(struct partial_message_queue *pmq, size_t count) {
+	if (pmq->tail + count <= pmq->capacity)
+		return;
+	size_t unread = pmq->tail - pmq->head;
+	if (unread + count <= pmq->capacity / 2) {
+		/* Half of the memory is read already, reuse it */
+		(void)memmove(pmq->base, pmq->base + pmq->head, unread);
+	} else {
+		size_t new_cap = MAX(unread + count, 2 * pmq->capacity);
+		char *new_base = malloc(sizeof (char) * new_cap);
+		if (!new_base)
+			abort();
+		memcpy(new_base, pmq->base + pmq->head, unread);
+		free(pmq->base);
+		pmq->base = new_base;
+		pmq->capacity = new_cap;
 	}
-	return NULL;
+	pmq->scan -= pmq->head;
+	pmq->tail = unread;
+	pmq->head = 0;
 }
 
-void pmq_put(struct partial_message_queue *pmq, const char *buf, size_t put_len) {
-	size_t readable_len = strlen(pmq->read);
+/// Starts from the beginning of the memory once everything is read.
+static void pmq_drop_read(struct partial_message_queue *pmq) {
+	if (pmq->head == pmq->tail) {
+		pmq->head = 0;
+		pmq->tail = 0;
+		pmq->scan = 0;
+	}
+}
+
+char *pmq_next_message(struct partial_message_queue *pmq, size_t *len) {
+	struct pmq_message msg;
+	if (pmq_next_messages(pmq, &msg, 1) == 0)
+		return NULL;
+	if (len)
+		*len = msg.len;
+	return msg.data;
+}
+
+#if defined(__SSE2__)
+enum {
+	/// The bytes scanned at once, a bit of the mask each
+	PMQ_SCAN_BLOCK = 64,
+};
 
-	/* Shift everything back to use all the available space */
-	(void)memmove(pmq->base, pmq->read, readable_len + 1);
-	pmq->read = pmq->base;
+/// The bit mask of the '\n's of the PMQ_SCAN_BLOCK bytes at `p`.
+static inline uint64_t pmq_scan_block(const char *p) {
+	const __m128i lf = _mm_set1_epi8('\n');
+	uint64_t bits = 0;
+	for (int i = 0; i < PMQ_SCAN_BLOCK / 16; ++i) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+		bits |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)) << (16 * i);
+	}
+	return bits;
+}
+#endif
 
-	if (readable_len + put_len + 1 > pmq->capacity) {
-		pmq_rebuf(pmq, readable_len + put_len + 1);
+/*
+ * The '\n's are found a block of bytes at a time by a bit mask of them, and
+ * all the messages ending in a block are taken from its mask: so the short
+ * messages cost a bit each. A block with none is a long message, the rest
+ * of it is found by memchr(), which is faster over long runs. So is the
+ * tail shorter than a block, and all of the data without SSE2.
+ */
+int pmq_next_messages(struct partial_message_queue *pmq, struct pmq_message *msgs, int count) {
+	char *start = pmq->base + pmq->head;
+	char *p = pmq->base + pmq->scan, *end = pmq->base + pmq->tail;
+	int n = 0;
+	while (n < count) {
+#if defined(__SSE2__)
+		uint64_t bits = end - p >= PMQ_SCAN_BLOCK ? pmq_scan_block(p) : 0;
+		if (bits != 0) {
+			for (; bits != 0 && n < count; bits &= bits - 1) {
+				char *at = p + __builtin_ctzll(bits);
+				*at = '\0';
+				msgs[n++] = (struct pmq_message){start, at - start};
+				start = at + 1;
+			}
+			/* Out of room for the rest of the block: it is scanned again */
+			p = bits != 0 ? start : p + PMQ_SCAN_BLOCK;
+			continue;
+		}
+		if (end - p >= PMQ_SCAN_BLOCK)
+			p += PMQ_SCAN_BLOCK;
+#endif
+		char *at = memchr(p, '\n', end - p);
+		if (!at) {
+			p = end;
+			break;
+		}
+		*at = '\0';
+		msgs[n++] = (struct pmq_message){start, at - start};
+		p = start = at + 1;
 	}
+	/*
+	 * The messages stay valid: the memory is reused only on a put, and
+	 * each ends with the '\0' written over its '\n'.
+	 */
+	pmq->head = start - pmq->base;
+	pmq->scan = p - pmq->base;
+	pmq_drop_read(pmq);
+	return n;
+}
+
+void pmq_put(struct partial_message_queue *pmq, const char *buf, size_t put_len) {
+	pmq_reserve(pmq, put_len);
+	memcpy(pmq->base + pmq->tail, buf, put_len);
+	pmq->tail += put_len;
+}
+
+char *pmq_tail(struct partial_message_queue *pmq, size_t count, size_t *room) {
+	pmq_reserve(pmq, count);
+	*room = pmq->capacity - pmq->tail;
+	return pmq->base + pmq->tail;
+}
+
+void pmq_commit(struct partial_message_queue *pmq, size_t count) {
+	assert(pmq->tail + count <= pmq->capacity);
+	pmq->tail += count;
+}
+
+ssize_t pmq_recv(struct partial_message_queue *pmq, int fd, size_t *hint, bool *is_drained) {
+	size_t room;
+	char *dst = pmq_tail(pmq, *hint, &room);
+	/* Not more than the hint, so that one receive takes a bounded bite */
+	room = MIN(room, *hint);
+	ssize_t got = recv(fd, dst, room, 0);
+	*is_drained = got > 0 && (size_t)got < room;
+	if (got <= 0)
+		return got;
+	pmq_commit(pmq, got);
+	if ((size_t)got == room)
+		*hint = MIN(2 * *hint, PMQ_RECV_MAX);
+	else if ((size_t)got < *hint / 4)
+		*hint = MAX(*hint / 2, PMQ_RECV_MIN);
+	return got;
+}
+
+const char *pmq_data(const struct partial_message_queue *pmq, size_t *len) {
+	*len = pmq->tail - pmq->head;
+	return pmq->base + pmq->head;
+}
+
+void pmq_consume(struct partial_message_queue *pmq, size_t count) {
+	assert(count <= pmq->tail - pmq->head);
+	pmq->head += count;
+	pmq->scan = MAX(pmq->scan, pmq->head);
+	pmq_drop_read(pmq);
+}
 
-	memcpy(pmq->read + readable_len, buf, put_len);
-	pmq->read[readable_len + put_len] = '\0';
+size_t pmq_size(const struct partial_message_queue *pmq) {
+	return pmq->tail - pmq->head;
 }
@@ -1,37 +1,125 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 
+/**
+ * Bytes put in the order they came and taken as lf-terminated messages, or
+ * as raw data. The unread bytes are [`head`; `tail`) of `base`: reads only
+ * move `head`, and puts append at `tail`, moving the unread bytes back to
+ * the beginning only when there is no room left at the end and less than
+ * half of the memory is in use, so each byte is copied O(1) times.
+ */
 struct partial_message_queue {
-	/// Pointer to allocated memory. The pointer value shall not change.
+	/// Pointer to allocated memory. Changes when the queue grows.
 	char *base;
-	/// Pointer shifted `base` to where the next read shall happen.
-	char *read;
 	/// Capacity of allocated memory (corresponds to `base`).
 	size_t capacity;
+	/// Offset of the first unread byte.
+	size_t head;
+	/// Offset past the last byte put.
+	size_t tail;
+	/// Offset in [`head`; `tail`] before which there is no `'\n'` to
+	/// look for after `head`.
+	size_t scan;
 };
 
 void pmq_init(struct partial_message_queue *pmq, size_t init_cap);
 
 void pmq_destroy(struct partial_message_queue *pmq);
 
+/**
+ * Drops all the data, keeping the memory for whoever uses the queue next,
+ * up to `max_cap` bytes of it.
+ */
+void pmq_clear(struct partial_message_queue *pmq, size_t max_cap);
+
 /**
  * Returns pointer to a NULL-terminated string that represents exactly one message
  * (without the trailing `'\n'`) or `NULL` if there are no complete messages.
+ * If `len` is not `NULL`, the length of the message is stored there, which
+ * counts the `'\0'` characters the message may contain.
  *
  * Note that the returned pointer is non-constant but edits to memory beyond the
  * NULL-terminated string lead to undefined behavior.
  *
  * Pointers returned by this method are invalidated on the next `pmq_put` operation.
  */
-char *pmq_next_message(struct partial_message_queue *pmq);
+char *pmq_next_message(struct partial_message_queue *pmq, size_t *len);
+
+/// A message of `pmq_next_messages`, `'\0'`-terminated like the ones of `pmq_next_message`.
+struct pmq_message {
+	char *data;
+	size_t len;
+};
+
+/**
+ * Takes at most `count` messages at once to `msgs`, like so many calls of
+ * `pmq_next_message`, and returns how many there were. The data is scanned
+ * once for all of them, a vector of bytes at a time, so many short messages
+ * of a big receive are found much faster than one by one. The messages stay
+ * valid until the next `pmq_put` too.
+ */
+int pmq_next_messages(struct partial_message_queue *pmq, struct pmq_message *msgs, int count);
 
 /**
  * Copies the given buffer (which may be one lf-terminated message, or several
  * messages, or a partial message, or several message with last one being partial)
- * to the queue. If there are `'\0'` characters in the range [`buf`; `buf+count`),
- * the behavior is undefined.
+ * to the queue. The buffer may contain `'\0'` characters.
  *
- * Invalidates all pointers previously returned by `pmq_next_message`.
+ * Invalidates all pointers previously returned by `pmq_next_message` and
+ * `pmq_data`.
  */
 void pmq_put(struct partial_message_queue *pmq, const char *buf, size_t count);
+
+/**
+ * Returns room for at least `count` more bytes after the data, to receive
+ * into directly and then `pmq_commit`, and stores its size, which may be
+ * bigger, in `room`. The room is lost on the next put.
+ *
+ * Invalidates all pointers previously returned by `pmq_next_message` and
+ * `pmq_data`.
+ */
+char *pmq_tail(struct partial_message_queue *pmq, size_t count, size_t *room);
+
+/// Appends the first `count` bytes written to the room of `pmq_tail`.
+void pmq_commit(struct partial_message_queue *pmq, size_t count);
+
+enum {
+	/// Bounds of the adaptive size of `pmq_recv`.
+	PMQ_RECV_MIN = 4096,
+	PMQ_RECV_MAX = 256 * 1024,
+};
+
+/**
+ * Receives at most `*hint` bytes from the socket `fd` straight into the
+ * room after the data. The hint adapts to the traffic: it doubles, up to
+ * `PMQ_RECV_MAX`, when a receive takes all of it, and halves, down to
+ * `PMQ_RECV_MIN`, when it is mostly left unused. Start it at `PMQ_RECV_MIN`.
+ *
+ * A receive shorter than the hint means the socket has nothing more for
+ * now, which is stored in `is_drained`: no need to try again for EAGAIN.
+ * Unless the peer has shut down too, which the next receive would tell.
+ *
+ * @retval >0 The number of bytes received.
+ * @retval 0 The peer has shut down.
+ * @retval -1 Error in `errno`.
+ */
+ssize_t pmq_recv(struct partial_message_queue *pmq, int fd, size_t *hint, bool *is_drained);
+
+/**
+ * Returns pointer to all the unread data, whole messages or not, and stores
+ * its length in `len`. Meant to send the queue as is, see `pmq_consume`.
+ */
+const char *pmq_data(const struct partial_message_queue *pmq, size_t *len);
+
+/// Drops the first `count` bytes of the unread data, at most `pmq_size`.
+void pmq_consume(struct partial_message_queue *pmq, size_t count);
+
+/// Returns the number of unread bytes.
+size_t pmq_size(const struct partial_message_queue *pmq);
+
+static inline bool pmq_is_empty(const struct partial_message_queue *pmq) {
+	return pmq_size(pmq) == 0;
+}
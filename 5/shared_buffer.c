@@ -0,0 +1,163 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "shared_buffer.h"
+
+enum {
+	SBQ_INIT_CAP = 16,
+};
+
+struct shared_buffer *shared_buffer_new(size_t size) {
+	struct shared_buffer *buf = malloc(sizeof *buf + size);
+	if (!buf)
+		abort();
+	buf->refs = 1;
+	buf->size = size;
+	return buf;
+}
+
+void shared_buffer_ref(struct shared_buffer *buf) {
+	__atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void shared_buffer_unref(struct shared_buffer *buf) {
+	assert(__atomic_load_n(&buf->refs, __ATOMIC_RELAXED) > 0);
+	/* Whoever frees it has to see all the others are done */
+	if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(buf);
+}
+
+void sbq_init(struct shared_buffer_queue *sbq) {
+	sbq->views = NULL;
+	sbq->capacity = 0;
+	sbq->head = 0;
+	sbq->count = 0;
+	sbq->size = 0;
+}
+
+void sbq_destroy(struct shared_buffer_queue *sbq) {
+	for (size_t i = 0; i < sbq->count; ++i)
+		shared_buffer_unref(sbq->views[(sbq->head + i) & (sbq->capacity - 1)].buf);
+	free(sbq->views);
+}
+
+void sbq_clear(struct shared_buffer_queue *sbq) {
+	for (size_t i = 0; i < sbq->count; ++i)
+		shared_buffer_unref(sbq->views[(sbq->head + i) & (sbq->capacity - 1)].buf);
+	sbq->head = 0;
+	sbq->count = 0;
+	sbq->size = 0;
+}
+
+/// Doubles the ring, unwrapping it to start at 0.
+static void sbq_grow(struct shared_buffer_queue *sbq) {
+	size_t new_cap = sbq->capacity ? 2 * sbq->capacity : SBQ_INIT_CAP;
+	struct shared_buffer_view *views = malloc(sizeof *views * new_cap);
+	if (!views)
+		abort();
+	for (size_t i = 0; i < sbq->count; ++i)
+		views[i] = sbq->views[(sbq->head + i) & (sbq->capacity - 1)];
+	free(sbq->views);
+	sbq->views = views;
+	sbq->capacity = new_cap;
+	sbq->head = 0;
+}
+
+static void sbq_push_view(struct shared_buffer_queue *sbq, struct shared_buffer *buf, bool is_pinned) {
+	if (buf->size == 0)
+		return;
+	if (sbq->count == sbq->capacity)
+		sbq_grow(sbq);
+	shared_buffer_ref(buf);
+	struct shared_buffer_view *view =
+		&sbq->views[(sbq->head + sbq->count) & (sbq->capacity - 1)];
+	view->buf = buf;
+	view->offset = 0;
+	view->is_pinned = is_pinned;
+	++sbq->count;
+	sbq->size += buf->size;
+}
+
+void sbq_push(struct shared_buffer_queue *sbq, struct shared_buffer *buf) {
+	sbq_push_view(sbq, buf, false);
+}
+
+void sbq_push_pinned(struct shared_buffer_queue *sbq, struct shared_buffer *buf) {
+	sbq_push_view(sbq, buf, true);
+}
+
+size_t sbq_drop(struct shared_buffer_queue *sbq, size_t skip, size_t size, size_t *count) {
+	size_t mask = sbq->capacity - 1;
+	if (skip == 0 && sbq->count > 0 && sbq->views[sbq->head].offset > 0)
+		skip = 1;  // A part is sent, the rest has to follow
+	/* Find how far the oldest droppable ones go */
+	size_t end = skip, dropped = 0, dropped_count = 0;
+	for (; end < sbq->count && sbq->size - dropped > size; ++end) {
+		const struct shared_buffer_view *view = &sbq->views[(sbq->head + end) & mask];
+		if (!view->is_pinned) {
+			dropped += view->buf->size;
+			++dropped_count;
+		}
+	}
+	if (dropped_count == 0)
+		return 0;
+	/*
+	 * Move the kept ones of [0; end) towards `end`, which are few: the
+	 * skipped and the pinned. The rest of the queue stays where it is.
+	 */
+	size_t to = end;
+	for (size_t from = end; from-- > 0;) {
+		struct shared_buffer_view *view = &sbq->views[(sbq->head + from) & mask];
+		if (from >= skip && !view->is_pinned)
+			shared_buffer_unref(view->buf);
+		else
+			sbq->views[(sbq->head + --to) & mask] = *view;
+	}
+	sbq->head = (sbq->head + dropped_count) & mask;
+	sbq->count -= dropped_count;
+	sbq->size -= dropped;
+	*count += dropped_count;
+	return dropped;
+}
+
+int sbq_iov(const struct shared_buffer_queue *sbq, struct iovec *iov, int count) {
+	int iov_cnt = 0;
+	for (size_t i = 0; i < sbq->count && iov_cnt < count; ++i) {
+		const struct shared_buffer_view *view =
+			&sbq->views[(sbq->head + i) & (sbq->capacity - 1)];
+		iov[iov_cnt].iov_base = view->buf->data + view->offset;
+		iov[iov_cnt].iov_len = view->buf->size - view->offset;
+		++iov_cnt;
+	}
+	return iov_cnt;
+}
+
+void sbq_consume(struct shared_buffer_queue *sbq, size_t size) {
+	assert(size <= sbq->size);
+	sbq->size -= size;
+	while (size > 0) {
+		struct shared_buffer_view *view = &sbq->views[sbq->head];
+		size_t view_len = view->buf->size - view->offset;
+		if (size < view_len) {
+			view->offset += size;
+			break;
+		}
+		size -= view_len;
+		shared_buffer_unref(view->buf);
+		sbq->head = (sbq->head + 1) & (sbq->capacity - 1);
+		--sbq->count;
+	}
+}
+
+ssize_t sbq_send(struct shared_buffer_queue *sbq, int fd) {
+	struct iovec iov[SBQ_SEND_IOV_MAX];
+	struct msghdr msg = {.msg_iov = iov};
+	msg.msg_iovlen = sbq_iov(sbq, iov, SBQ_SEND_IOV_MAX);
+	int flags = MSG_NOSIGNAL | (msg.msg_iovlen < sbq->count ? MSG_MORE : 0);
+	ssize_t sent = sendmsg(fd, &msg, flags);
+	if (sent > 0)
+		sbq_consume(sbq, sent);
+	return sent;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Bytes shared by several queues, such as a message broadcast to all the
+ * peers: stored once and freed when the last queue is done with them. The
+ * queues may belong to different threads.
+ */
+struct shared_buffer {
+	/// Number of owners, the one who created it and the queues. Atomic.
+	size_t refs;
+	size_t size;
+	char data[];
+};
+
+/// Creates a buffer of `size` bytes with one reference, to be filled.
+struct shared_buffer *shared_buffer_new(size_t size);
+
+void shared_buffer_ref(struct shared_buffer *buf);
+
+/// Drops a reference, freeing the buffer if it was the last one.
+void shared_buffer_unref(struct shared_buffer *buf);
+
+/// Part of a shared buffer still to be sent by one queue.
+struct shared_buffer_view {
+	struct shared_buffer *buf;
+	/// How many first bytes of `buf` are already sent.
+	size_t offset;
+	/// Never dropped by `sbq_drop`, see `sbq_push_pinned`.
+	bool is_pinned;
+};
+
+/**
+ * Queue of references to shared buffers, sent in the order they are
+ * pushed. Pushing a buffer costs one pointer whatever its size.
+ */
+struct shared_buffer_queue {
+	/// Ring of `capacity` views, a power of two, `count` of them from `head`.
+	struct shared_buffer_view *views;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	/// Bytes left to send in all the views.
+	size_t size;
+};
+
+void sbq_init(struct shared_buffer_queue *sbq);
+
+/// Drops the references to all the buffers still in the queue.
+void sbq_destroy(struct shared_buffer_queue *sbq);
+
+/// Like `sbq_destroy`, but the queue stays usable, with its memory.
+void sbq_clear(struct shared_buffer_queue *sbq);
+
+/// Appends `buf` to the queue, taking a reference to it.
+void sbq_push(struct shared_buffer_queue *sbq, struct shared_buffer *buf);
+
+/**
+ * Like `sbq_push`, but `buf` is never dropped by `sbq_drop`: what comes
+ * after it relies on it being sent.
+ */
+void sbq_push_pinned(struct shared_buffer_queue *sbq, struct shared_buffer *buf);
+
+/**
+ * Drops the oldest buffers not sent at all and not pinned, but for the
+ * first `skip` ones, until there are at most `size` bytes left or nothing
+ * more to drop. Adds the number of the buffers dropped to `*count` and
+ * returns the number of their bytes.
+ */
+size_t sbq_drop(struct shared_buffer_queue *sbq, size_t skip, size_t size, size_t *count);
+
+enum {
+	/// At most this many buffers are in an iovec kept around, as the
+	/// io_uring one of each peer is.
+	SBQ_IOV_MAX = 64,
+	/// At most this many buffers are given to one `sbq_send`, the UIO_MAXIOV
+	/// of Linux.
+	SBQ_SEND_IOV_MAX = 1024,
+};
+
+struct iovec;
+
+/**
+ * Fills `iov` with the first at most `count` unsent parts of the queue, to
+ * send on one's own and then `sbq_consume`. Returns the number of parts.
+ */
+int sbq_iov(const struct shared_buffer_queue *sbq, struct iovec *iov, int count);
+
+/// Drops the first `size` bytes of the queue, which are sent.
+void sbq_consume(struct shared_buffer_queue *sbq, size_t size);
+
+/**
+ * Sends as much of the queue as one `sendmsg` takes to the socket `fd`,
+ * straight from the shared buffers, and drops what is sent. With MSG_MORE
+ * if more is queued than one call takes, for the kernel to fill the
+ * segments across the calls, and with no SIGPIPE.
+ *
+ * @retval >= 0 The number of bytes sent.
+ * @retval -1 Error in `errno`, the queue is intact.
+ */
+ssize_t sbq_send(struct shared_buffer_queue *sbq, int fd);
+
+static inline bool sbq_is_empty(const struct shared_buffer_queue *sbq) {
+	return sbq->count == 0;
+}
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+enum {
+	SHM_CHANNEL_MAGIC = 0x43485331, /* "CHS1" */
+	SHM_MAX_FDS = 4,
+};
+
+/// The start of the memfd, followed by the data of the two rings.
+struct shm_channel_header {
+	uint32_t magic;
+	uint32_t capacity;
+	/// From the side that has created the channel, and to it
+	struct shm_ring_shared rings[2];
+};
+
+ssize_t shm_ring_write(struct shm_ring *ring, const char *src, size_t size) {
+	uint32_t capacity = ring->mask + 1;
+	uint32_t used = ring->pos - __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+	if (used > capacity) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (size > capacity - used)
+		size = capacity - used;
+	size_t at = ring->pos & ring->mask;
+	size_t first = size < capacity - at ? size : capacity - at;
+	memcpy(ring->data + at, src, first);
+	memcpy(ring->data, src + first, size - first);
+	ring->pos += size;
+	/* Ordered before the look at `reader_waits`, see shm_ring_take_reader() */
+	__atomic_store_n(&ring->shared->head, ring->pos, __ATOMIC_SEQ_CST);
+	return size;
+}
+
+ssize_t shm_ring_writev(struct shm_ring *ring, const struct iovec *iov, int count) {
+	size_t total = 0;
+	for (int i = 0; i < count; ++i) {
+		ssize_t written = shm_ring_write(ring, iov[i].iov_base, iov[i].iov_len);
+		if (written < 0)
+			return -1;
+		total += written;
+		if ((size_t)written < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+ssize_t shm_ring_read(struct shm_ring *ring, char *dst, size_t size) {
+	uint32_t capacity = ring->mask + 1;
+	uint32_t ready = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE) - ring->pos;
+	if (ready > capacity) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (size > ready)
+		size = ready;
+	size_t at = ring->pos & ring->mask;
+	size_t first = size < capacity - at ? size : capacity - at;
+	memcpy(dst, ring->data + at, first);
+	memcpy(dst + first, ring->data, size - first);
+	ring->pos += size;
+	__atomic_store_n(&ring->shared->tail, ring->pos, __ATOMIC_SEQ_CST);
+	return size;
+}
+
+/*
+ * The waits are the two sides of a Dekker check: the one who waits sets its
+ * flag and then looks at the other side's position, the other one moves
+ * its position and then looks at the flag. With both in the total order of
+ * the seq_cst operations at least one of them sees the other, so a wakeup is
+ * never lost: either the waiter sees the data, or the writer sees it wait.
+ */
+
+bool shm_ring_wait_data(struct shm_ring *ring) {
+	__atomic_store_n(&ring->shared->reader_waits, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ring->shared->head, __ATOMIC_SEQ_CST) == ring->pos;
+}
+
+bool shm_ring_wait_room(struct shm_ring *ring) {
+	__atomic_store_n(&ring->shared->writer_waits, 1, __ATOMIC_SEQ_CST);
+	return ring->pos - __atomic_load_n(&ring->shared->tail, __ATOMIC_SEQ_CST) >= ring->mask + 1;
+}
+
+bool shm_ring_take_reader(struct shm_ring *ring) {
+	return __atomic_load_n(&ring->shared->reader_waits, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&ring->shared->reader_waits, 0, __ATOMIC_SEQ_CST);
+}
+
+bool shm_ring_take_writer(struct shm_ring *ring) {
+	return __atomic_load_n(&ring->shared->writer_waits, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&ring->shared->writer_waits, 0, __ATOMIC_SEQ_CST);
+}
+
+/// Points the rings of this side into the mapping, `is_creator` or not.
+static void shm_channel_map(struct shm_channel *ch, void *map, size_t map_size, uint32_t capacity,
+			    bool is_creator) {
+	struct shm_channel_header *header = map;
+	char *data = (char *)map + sizeof(*header);
+	ch->map = map;
+	ch->map_size = map_size;
+	int out = is_creator ? 0 : 1;
+	ch->out = (struct shm_ring){.shared = &header->rings[out], .data = data + out * (size_t)capacity,
+				    .mask = capacity - 1, .pos = header->rings[out].head};
+	ch->in = (struct shm_ring){.shared = &header->rings[!out], .data = data + !out * (size_t)capacity,
+				   .mask = capacity - 1, .pos = header->rings[!out].tail};
+	ch->notify_fd = -1;
+}
+
+int shm_channel_create(struct shm_channel *ch, uint32_t capacity) {
+	size_t size = sizeof(struct shm_channel_header) + 2 * (size_t)capacity;
+	int fd = memfd_create("chat", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+	void *map = MAP_FAILED;
+	if (ftruncate(fd, size) != 0 ||
+			fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+			(map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto fail;
+	/* The memfd is zeroed, the rings are empty */
+	struct shm_channel_header *header = map;
+	header->magic = SHM_CHANNEL_MAGIC;
+	header->capacity = capacity;
+	header->rings[0].reader_waits = 1;
+	header->rings[1].reader_waits = 1;
+	shm_channel_map(ch, map, size, capacity, true);
+	if ((ch->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	return fd;
+fail:;
+	int save_errno = errno;
+	if (map != MAP_FAILED)
+		(void)munmap(map, size);
+	(void)close(fd);
+	errno = save_errno;
+	return -1;
+}
+
+int shm_channel_open(struct shm_channel *ch, int memfd) {
+	struct stat st;
+	if (fstat(memfd, &st) != 0)
+		return -1;
+	/* Shrunk under the mapping, it would be a SIGBUS */
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK) ||
+			(size_t)st.st_size < sizeof(struct shm_channel_header)) {
+		errno = EPROTO;
+		return -1;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	/* Read once: the other side may change it, but not the rings here */
+	const struct shm_channel_header *header = map;
+	uint32_t capacity = __atomic_load_n(&header->capacity, __ATOMIC_RELAXED);
+	if (header->magic != SHM_CHANNEL_MAGIC || capacity == 0 || capacity > SHM_RING_MAX ||
+			(capacity & (capacity - 1)) != 0 ||
+			(size_t)st.st_size < sizeof(*header) + 2 * (size_t)capacity) {
+		(void)munmap(map, st.st_size);
+		errno = EPROTO;
+		return -1;
+	}
+	shm_channel_map(ch, map, st.st_size, capacity, false);
+	if ((ch->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		int save_errno = errno;
+		(void)munmap(map, st.st_size);
+		errno = save_errno;
+		return -1;
+	}
+	return 0;
+}
+
+void shm_channel_destroy(struct shm_channel *ch) {
+	(void)munmap(ch->map, ch->map_size);
+	(void)close(ch->wait_fd);
+	if (ch->notify_fd >= 0)
+		(void)close(ch->notify_fd);
+}
+
+void shm_channel_notify(struct shm_channel *ch) {
+	if (ch->notify_fd >= 0)
+		(void)write(ch->notify_fd, &(uint64_t){1}, sizeof(uint64_t));
+}
+
+void shm_channel_clear(struct shm_channel *ch) {
+	uint64_t count;
+	(void)read(ch->wait_fd, &count, sizeof(count));
+}
+
+int shm_send_fds(int sock, const int *fds, int count) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SHM_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {.iov_base = "", .iov_len = 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+			     .msg_controllen = CMSG_SPACE(sizeof(int) * count)};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int shm_recv_fds(int sock, int *fds, int count) {
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SHM_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	char byte;
+	struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+			     .msg_controllen = sizeof(control.buf)};
+	for (int i = 0; i < count; ++i)
+		fds[i] = -1;
+	ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (got <= 0)
+		return got;
+	int taken = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < n; ++i) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+			if (taken < count)
+				fds[taken++] = fd;
+			else
+				(void)close(fd);
+		}
+	}
+	if (taken == 0 || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int i = 0; i < taken; ++i)
+			(void)close(fds[i]);
+		errno = EPROTO;
+		return -1;
+	}
+	return taken;
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * A channel between two processes on the same host: a memfd mapped by both,
+ * with a single-producer single-consumer byte ring each way, and an eventfd
+ * each side waits on. The chat's local clients talk to the server through
+ * it instead of a TCP socket, see chat_server_set_local_path().
+ *
+ * A side notifies the other only when it waits: the reader once it has
+ * found its ring empty, the writer once it has found it full. So a busy
+ * channel moves the bytes with no system calls at all.
+ */
+
+/// What a ring's two sides share, each of them writing only its own line.
+struct shm_ring_shared {
+	/// Bytes ever written, by the writer
+	_Alignas(64) uint32_t head;
+	/// The reader is going to wait for more, see shm_ring_wait_data()
+	uint32_t reader_waits;
+	/// Bytes ever read, by the reader
+	_Alignas(64) uint32_t tail;
+	/// The writer is going to wait for room, see shm_ring_wait_room()
+	uint32_t writer_waits;
+};
+
+/// One side of a ring.
+struct shm_ring {
+	struct shm_ring_shared *shared;
+	char *data;
+	/// The capacity - 1, a power of two
+	uint32_t mask;
+	/// This side's head or tail, kept here for the other side not to move it
+	uint32_t pos;
+};
+
+struct iovec;
+
+/**
+ * Copies at most `size` bytes of `src` to the ring. Returns how many fit,
+ * or -1 if the other side has broken the ring.
+ */
+ssize_t shm_ring_write(struct shm_ring *ring, const char *src, size_t size);
+
+/// Like `shm_ring_write`, of `count` parts in a row.
+ssize_t shm_ring_writev(struct shm_ring *ring, const struct iovec *iov, int count);
+
+/**
+ * Copies at most `size` bytes of the ring to `dst`. Returns how many there
+ * were, or -1 if the other side has broken the ring.
+ */
+ssize_t shm_ring_read(struct shm_ring *ring, char *dst, size_t size);
+
+/**
+ * Tells the reader of the empty ring is going to wait. Returns false if
+ * there is data after all, to read instead.
+ */
+bool shm_ring_wait_data(struct shm_ring *ring);
+
+/**
+ * Tells the writer of the full ring is going to wait. Returns false if
+ * there is room after all, to write instead.
+ */
+bool shm_ring_wait_room(struct shm_ring *ring);
+
+/// After a write: whether the reader waits and is to be notified.
+bool shm_ring_take_reader(struct shm_ring *ring);
+
+/// After a read: whether the writer waits and is to be notified.
+bool shm_ring_take_writer(struct shm_ring *ring);
+
+enum {
+	/// Most bytes of a ring `shm_channel_open` takes from the other side
+	SHM_RING_MAX = 64 * 1024 * 1024,
+};
+
+struct shm_channel {
+	void *map;
+	size_t map_size;
+	/// This side's rings
+	struct shm_ring in;
+	struct shm_ring out;
+	/// eventfd this side waits on, and the other side's, or -1 if unknown
+	int wait_fd;
+	int notify_fd;
+};
+
+/**
+ * Creates a channel of two rings of `capacity` bytes, a power of two, and
+ * this side's eventfd. Returns the memfd, sealed against resizing, to be
+ * sent to the other side and closed, or -1 with errno.
+ */
+int shm_channel_create(struct shm_channel *ch, uint32_t capacity);
+
+/**
+ * Maps the channel of the other side's `memfd` and creates this side's
+ * eventfd. The memfd is checked to be of a channel, and not to be resized
+ * under the mapping. Returns 0, or -1 with errno: EPROTO if it is not a
+ * channel.
+ */
+int shm_channel_open(struct shm_channel *ch, int memfd);
+
+/// Unmaps the channel and closes both eventfds.
+void shm_channel_destroy(struct shm_channel *ch);
+
+/// Wakes up the other side, if it is known.
+void shm_channel_notify(struct shm_channel *ch);
+
+/// Takes the notifications of this side, before looking at the rings.
+void shm_channel_clear(struct shm_channel *ch);
+
+/**
+ * Sends a byte and `count` descriptors over the UNIX socket `sock`. Returns
+ * 0 or -1 with errno.
+ */
+int shm_send_fds(int sock, const int *fds, int count);
+
+/**
+ * Receives what `shm_send_fds` has sent, up to `count` descriptors, to
+ * `fds`. The ones not sent are -1.
+ *
+ * @retval >0 The number of descriptors received.
+ * @retval 0 The other side has shut down.
+ * @retval -1 Error in errno, EPROTO if it has sent something else.
+ */
+int shm_recv_fds(int sock, int *fds, int count);
@@ -0,0 +1,77 @@
+#include "spsc_ring.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int spsc_ring_init(struct spsc_ring *ring, uint32_t capacity, size_t elem_size, int doorbell) {
+	memset(ring, 0, sizeof(*ring));
+	ring->data = malloc(elem_size * capacity);
+	if (!ring->data)
+		return -1;
+	ring->mask = capacity - 1;
+	ring->elem_size = elem_size;
+	ring->doorbell = doorbell;
+	return 0;
+}
+
+void spsc_ring_destroy(struct spsc_ring *ring) {
+	free(ring->data);
+	ring->data = NULL;
+}
+
+/// Copies `count` elements between `elems` and the ring from `pos` on, wrapping around.
+static void spsc_ring_copy(struct spsc_ring *ring, uint32_t pos, void *elems, uint32_t count,
+			   bool is_push) {
+	uint32_t at = pos & ring->mask;
+	uint32_t first = count < ring->mask + 1 - at ? count : ring->mask + 1 - at;
+	char *slot = ring->data + (size_t)at * ring->elem_size;
+	size_t first_size = (size_t)first * ring->elem_size;
+	size_t rest_size = (size_t)(count - first) * ring->elem_size;
+	if (is_push) {
+		memcpy(slot, elems, first_size);
+		memcpy(ring->data, (char *)elems + first_size, rest_size);
+	} else {
+		memcpy(elems, slot, first_size);
+		memcpy((char *)elems + first_size, ring->data, rest_size);
+	}
+}
+
+uint32_t spsc_ring_push(struct spsc_ring *ring, const void *elems, uint32_t count) {
+	uint32_t capacity = ring->mask + 1;
+	uint32_t head = ring->head;
+	if (head - ring->tail_seen + count > capacity)
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t room = capacity - (head - ring->tail_seen);
+	if (count > room)
+		count = room;
+	if (count == 0)
+		return 0;
+	spsc_ring_copy(ring, head, (void *)elems, count, true);
+	/*
+	 * Ordered before the look at `tail`, as the consumer's store of `tail`
+	 * is before its look at `head`, see spsc_ring_pop(): either it sees
+	 * these, or this sees it has taken all before them and waits.
+	 */
+	__atomic_store_n(&ring->head, head + count, __ATOMIC_SEQ_CST);
+	ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+	if (ring->tail_seen == head && ring->doorbell >= 0)
+		(void)write(ring->doorbell, &(uint64_t){1}, sizeof(uint64_t));
+	return count;
+}
+
+uint32_t spsc_ring_pop(struct spsc_ring *ring, void *elems, uint32_t count) {
+	uint32_t tail = ring->tail;
+	/* After the store of `tail` of the previous pop, see spsc_ring_push() */
+	if (ring->head_seen - tail < count)
+		ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+	uint32_t used = ring->head_seen - tail;
+	if (count > used)
+		count = used;
+	if (count == 0)
+		return 0;
+	spsc_ring_copy(ring, tail, elems, count, false);
+	__atomic_store_n(&ring->tail, tail + count, __ATOMIC_SEQ_CST);
+	return count;
+}
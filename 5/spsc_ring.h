@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A ring of fixed size elements from one thread to another, with no locks:
+ * the producer only moves `head`, the consumer only moves `tail`, each on
+ * its own cache line, and each keeps a copy of the other's to look at the
+ * other side, loading the shared line only when the copy says there is not
+ * enough room or elements. Both sides take and give many elements at once,
+ * for one pair of atomics for all of them.
+ *
+ * The consumer waits on an eventfd, the doorbell, which the producer rings
+ * only when it has found the ring empty: so the consumer, which takes
+ * everything there is once woken, is woken once per batch, not per push.
+ * The doorbell may be shared by several rings of one consumer.
+ */
+struct spsc_ring {
+	/// Elements ever pushed, by the producer
+	_Alignas(64) uint32_t head;
+	/// The producer's copy of `tail`
+	uint32_t tail_seen;
+	/// Elements ever popped, by the consumer
+	_Alignas(64) uint32_t tail;
+	/// The consumer's copy of `head`
+	uint32_t head_seen;
+	/// What neither changes
+	_Alignas(64) char *data;
+	/// The capacity - 1, a power of two
+	uint32_t mask;
+	uint32_t elem_size;
+	/// eventfd, or -1 for none. Not owned by the ring
+	int doorbell;
+};
+
+/**
+ * Makes an empty ring of `capacity` elements of `elem_size` bytes each,
+ * the capacity a power of two. The `doorbell` is rung on a push to the
+ * empty ring, -1 for none. Returns 0, or -1 if out of memory.
+ */
+int spsc_ring_init(struct spsc_ring *ring, uint32_t capacity, size_t elem_size, int doorbell);
+
+/// Frees the memory. The elements still there are the caller's to pop first.
+void spsc_ring_destroy(struct spsc_ring *ring);
+
+/**
+ * Producer: copies at most `count` elements of `elems` to the ring, and
+ * rings the doorbell if it was empty. Returns how many fit.
+ */
+uint32_t spsc_ring_push(struct spsc_ring *ring, const void *elems, uint32_t count);
+
+/// Consumer: copies at most `count` elements to `elems`. Returns how many there were.
+uint32_t spsc_ring_pop(struct spsc_ring *ring, void *elems, uint32_t count);
@@ -1,12 +1,26 @@
 #include "unit.h"
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_frame.h"
 #include "chat_server.h"
+#include "lz.h"
+#include "partial_message_queue.h"
+#include "shared_buffer.h"
+#include "spsc_ring.h"
+#ifdef CHAT_SERVER_TPOOL
+#include "thread_pool.h"
+#endif
 
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 #include <pthread.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -151,6 +165,325 @@ author_is_eq(const struct chat_message *msg, const char *name)
 #endif
 }
 
+static bool
+view_is_eq(const struct chat_message_view *view, const char *author,
+	   const char *data)
+{
+#if NEED_AUTHOR
+	if (view->author_size != strlen(author) ||
+	    memcmp(view->author, author, view->author_size) != 0)
+		return false;
+#else
+	(void)author;
+#endif
+	return view->data_size == strlen(data) &&
+	       memcmp(view->data, data, view->data_size) == 0;
+}
+
+static void
+test_partial_message_queue(void)
+{
+	unit_test_start();
+
+	struct partial_message_queue pmq;
+	pmq_init(&pmq, 4);
+	size_t len;
+	unit_check(pmq_next_message(&pmq, &len) == NULL, "empty");
+	//
+	// Messages split between the puts, with zeros inside.
+	//
+	pmq_put(&pmq, "ab", 2);
+	unit_check(pmq_next_message(&pmq, &len) == NULL, "partial");
+	pmq_put(&pmq, "c\nd\0e\nf", 7);
+	char *msg = pmq_next_message(&pmq, &len);
+	unit_check(msg != NULL && len == 3 && strcmp(msg, "abc") == 0,
+		   "first");
+	msg = pmq_next_message(&pmq, &len);
+	unit_check(msg != NULL && len == 3 && memcmp(msg, "d\0e", 4) == 0,
+		   "binary");
+	unit_check(pmq_next_message(&pmq, &len) == NULL, "rest is partial");
+	unit_check(pmq_size(&pmq) == 1, "one byte left");
+	//
+	// Many messages through a small queue keep their order, both when
+	// the read memory is reused and when the queue grows.
+	//
+	pmq_consume(&pmq, 1);
+	unit_check(pmq_is_empty(&pmq), "consumed");
+	char buf[32];
+	int next = 0;
+	bool is_ok = true;
+	for (int i = 0; i < 1000 && is_ok; ++i) {
+		int n = sprintf(buf, "%d\n", i);
+		pmq_put(&pmq, buf, n);
+		if (i % 3 != 0)
+			continue;
+		while ((msg = pmq_next_message(&pmq, &len)) != NULL) {
+			sprintf(buf, "%d", next++);
+			is_ok = is_ok && strcmp(msg, buf) == 0 &&
+				len == strlen(buf);
+		}
+	}
+	unit_check(is_ok && next == 1000, "order");
+	//
+	// Taken in batches, across the blocks of the scan and the puts.
+	//
+	struct pmq_message msgs[7];
+	next = 0;
+	is_ok = true;
+	for (int i = 0; i < 300 && is_ok; ++i) {
+		int n = sprintf(buf, "%0*d\n", 1 + i % 24, i);
+		pmq_put(&pmq, buf, n);
+		if (i % 17 != 16 && i != 299)
+			continue;
+		int count;
+		do {
+			count = pmq_next_messages(&pmq, msgs, 7);
+			for (int k = 0; k < count && is_ok; ++k, ++next) {
+				int size = sprintf(buf, "%0*d", 1 + next % 24, next);
+				is_ok = msgs[k].len == (size_t)size &&
+					strcmp(msgs[k].data, buf) == 0;
+			}
+		} while (count == 7 && is_ok);
+	}
+	unit_check(is_ok && next == 300 && pmq_is_empty(&pmq), "batches");
+	pmq_put(&pmq, "a\nb\nc", 5);
+	unit_check(pmq_next_messages(&pmq, msgs, 7) == 2 &&
+		   strcmp(msgs[0].data, "a") == 0 && strcmp(msgs[1].data, "b") == 0 &&
+		   pmq_next_message(&pmq, &len) == NULL, "the partial one is left");
+	pmq_consume(&pmq, 1);
+	//
+	// Raw data is consumed in parts.
+	//
+	pmq_put(&pmq, "xyz\n", 4);
+	const char *data = pmq_data(&pmq, &len);
+	unit_check(len == 4 && memcmp(data, "xyz\n", 4) == 0, "data");
+	pmq_consume(&pmq, 2);
+	msg = pmq_next_message(&pmq, &len);
+	unit_check(msg != NULL && strcmp(msg, "z") == 0, "after consume");
+	unit_check(pmq_is_empty(&pmq), "empty again");
+	//
+	// Received straight from a socket, the hint grows with the flood.
+	//
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+				fds) != 0);
+	unit_fail_if(write(fds[0], "ab\ncd", 5) != 5);
+	size_t hint = PMQ_RECV_MIN;
+	bool is_drained;
+	ssize_t got = pmq_recv(&pmq, fds[1], &hint, &is_drained);
+	msg = pmq_next_message(&pmq, &len);
+	unit_check(got == 5 && is_drained && hint == PMQ_RECV_MIN &&
+		   msg != NULL && strcmp(msg, "ab") == 0, "recv short");
+	char *flood = malloc(3 * PMQ_RECV_MIN);
+	memset(flood, 'x', 3 * PMQ_RECV_MIN);
+	flood[3 * PMQ_RECV_MIN - 1] = '\n';
+	unit_fail_if(write(fds[0], flood, 3 * PMQ_RECV_MIN) !=
+		     3 * PMQ_RECV_MIN);
+	got = pmq_recv(&pmq, fds[1], &hint, &is_drained);
+	unit_check(got == PMQ_RECV_MIN && !is_drained &&
+		   hint == 2 * PMQ_RECV_MIN, "recv full, hint grows");
+	while (pmq_recv(&pmq, fds[1], &hint, &is_drained) > 0 && !is_drained)
+		;
+	msg = pmq_next_message(&pmq, &len);
+	unit_check(msg != NULL && len == 3 * PMQ_RECV_MIN + 1 &&
+		   memcmp(msg, "cd", 2) == 0, "recv all");
+	close(fds[0]);
+	unit_check(pmq_recv(&pmq, fds[1], &hint, &is_drained) == 0,
+		   "recv end");
+	close(fds[1]);
+	free(flood);
+	//
+	// Cleared for reuse, with some of the memory.
+	//
+	pmq_put(&pmq, "abc", 3);
+	pmq_clear(&pmq, 8);
+	unit_check(pmq_is_empty(&pmq) && pmq.capacity == 8, "cleared");
+	pmq_put(&pmq, "abc\n", 4);
+	msg = pmq_next_message(&pmq, &len);
+	unit_check(msg != NULL && strcmp(msg, "abc") == 0, "after clear");
+	pmq_destroy(&pmq);
+
+	unit_test_finish();
+}
+
+static void
+test_shared_buffer_queue(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	struct shared_buffer_queue a, b;
+	sbq_init(&a);
+	sbq_init(&b);
+	//
+	// One buffer in two queues, freed by the last one.
+	//
+	struct shared_buffer *buf = shared_buffer_new(4);
+	memcpy(buf->data, "abc\n", 4);
+	sbq_push(&a, buf);
+	sbq_push(&b, buf);
+	shared_buffer_unref(buf);
+	unit_check(buf->refs == 2 && a.size == 4, "shared");
+	for (int i = 0; i < 100; ++i) {
+		buf = shared_buffer_new(2);
+		buf->data[0] = '0' + i % 10;
+		buf->data[1] = '\n';
+		sbq_push(&a, buf);
+		shared_buffer_unref(buf);
+	}
+	unit_check(a.count == 101 && a.size == 204, "many");
+	//
+	// Sent in order, in parts.
+	//
+	char expected[204], got[204];
+	memcpy(expected, "abc\n", 4);
+	for (int i = 0; i < 100; ++i) {
+		expected[4 + 2 * i] = '0' + i % 10;
+		expected[5 + 2 * i] = '\n';
+	}
+	size_t total = 0;
+	while (!sbq_is_empty(&a)) {
+		ssize_t sent = sbq_send(&a, fds[0]);
+		unit_fail_if(sent <= 0);
+		total += sent;
+	}
+	unit_check(total == sizeof(expected) && a.size == 0, "all sent");
+	size_t n = 0;
+	while (n < total) {
+		ssize_t rc = recv(fds[1], got + n, total - n, 0);
+		unit_fail_if(rc <= 0);
+		n += rc;
+	}
+	unit_check(memcmp(got, expected, total) == 0, "in order");
+	//
+	// More than one send takes.
+	//
+	for (int i = 0; i < SBQ_SEND_IOV_MAX + 1; ++i) {
+		buf = shared_buffer_new(1);
+		buf->data[0] = 'x';
+		sbq_push(&a, buf);
+		shared_buffer_unref(buf);
+	}
+	unit_check(sbq_send(&a, fds[0]) == SBQ_SEND_IOV_MAX && a.count == 1,
+		   "one send at most");
+	unit_check(sbq_send(&a, fds[0]) == 1 && sbq_is_empty(&a), "the rest");
+	for (n = 0; n < SBQ_SEND_IOV_MAX + 1;) {
+		ssize_t rc = recv(fds[1], got, sizeof(got), 0);
+		unit_fail_if(rc <= 0);
+		n += rc;
+	}
+	//
+	// Dropped from the oldest, but for the one partly sent and the pinned.
+	//
+	for (int i = 0; i < 4; ++i) {
+		buf = shared_buffer_new(2);
+		buf->data[0] = '0' + i;
+		buf->data[1] = '\n';
+		if (i == 1)
+			sbq_push_pinned(&a, buf);
+		else
+			sbq_push(&a, buf);
+		shared_buffer_unref(buf);
+	}
+	sbq_consume(&a, 1);
+	size_t count = 0;
+	unit_check(sbq_drop(&a, 0, 2, &count) == 4 && count == 2 &&
+		   a.size == 3, "dropped");
+	struct iovec iov[4];
+	unit_check(sbq_iov(&a, iov, 4) == 2 &&
+		   memcmp(iov[0].iov_base, "\n", 1) == 0 &&
+		   memcmp(iov[1].iov_base, "1\n", 2) == 0, "kept in order");
+	//
+	// Cleared for reuse.
+	//
+	buf = shared_buffer_new(2);
+	sbq_push(&a, buf);
+	sbq_clear(&a);
+	unit_check(sbq_is_empty(&a) && a.size == 0 && buf->refs == 1,
+		   "cleared");
+	sbq_push(&a, buf);
+	shared_buffer_unref(buf);
+	unit_check(a.count == 1 && a.size == 2, "after clear");
+	sbq_destroy(&a);
+	sbq_destroy(&b);
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+enum {
+	TEST_SPSC_COUNT = 200000,
+};
+
+static void *
+test_spsc_ring_producer_f(void *arg)
+{
+	struct spsc_ring *ring = arg;
+	uint32_t batch[7];
+	uint32_t next = 0;
+	while (next < TEST_SPSC_COUNT) {
+		uint32_t count = 0;
+		for (; count < 7 && next + count < TEST_SPSC_COUNT; ++count)
+			batch[count] = next + count;
+		uint32_t done = 0;
+		while (done < count)
+			done += spsc_ring_push(ring, batch + done, count - done);
+		next += count;
+	}
+	return NULL;
+}
+
+static void
+test_spsc_ring(void)
+{
+	unit_test_start();
+
+	int bell = eventfd(0, EFD_NONBLOCK);
+	unit_fail_if(bell < 0);
+	struct spsc_ring ring;
+	unit_fail_if(spsc_ring_init(&ring, 8, sizeof(uint64_t), bell) != 0);
+	uint64_t in[10] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10}, out[10], rung;
+	unit_check(spsc_ring_pop(&ring, out, 10) == 0, "empty");
+	unit_check(spsc_ring_push(&ring, in, 3) == 3, "push");
+	unit_check(read(bell, &rung, sizeof(rung)) == sizeof(rung), "rung when empty");
+	unit_check(spsc_ring_push(&ring, in + 3, 7) == 5, "full");
+	unit_check(read(bell, &rung, sizeof(rung)) < 0, "not rung when not empty");
+	unit_check(spsc_ring_pop(&ring, out, 6) == 6 && memcmp(out, in, 6 * sizeof(*in)) == 0,
+		   "popped in order");
+	/* Across the end of the memory */
+	unit_check(spsc_ring_push(&ring, in + 8, 2) == 2, "wrapped");
+	unit_check(spsc_ring_pop(&ring, out, 10) == 4 && out[0] == 7 && out[1] == 8 &&
+		   out[2] == 9 && out[3] == 10, "the rest");
+	unit_check(read(bell, &rung, sizeof(rung)) < 0, "still not rung");
+	spsc_ring_destroy(&ring);
+
+	/* Another thread, the consumer sleeping on the doorbell once empty */
+	unit_fail_if(spsc_ring_init(&ring, 64, sizeof(uint32_t), bell) != 0);
+	pthread_t tid;
+	unit_fail_if(pthread_create(&tid, NULL, test_spsc_ring_producer_f, &ring) != 0);
+	uint32_t next = 0, batch[16];
+	bool is_ok = true;
+	while (next < TEST_SPSC_COUNT && is_ok) {
+		uint32_t count = spsc_ring_pop(&ring, batch, 16);
+		for (uint32_t i = 0; i < count; ++i)
+			is_ok = is_ok && batch[i] == next++;
+		if (count > 0)
+			continue;
+		struct pollfd pfd = {.fd = bell, .events = POLLIN};
+		/* A lost wakeup would hang here */
+		is_ok = poll(&pfd, 1, 5000) == 1;
+		(void)read(bell, &rung, sizeof(rung));
+	}
+	pthread_join(tid, NULL);
+	unit_check(is_ok && next == TEST_SPSC_COUNT, "all in order through a thread");
+	spsc_ring_destroy(&ring);
+	close(bell);
+
+	unit_test_finish();
+}
+
 static void
 test_basic(void)
 {
@@ -231,6 +564,53 @@ test_basic(void)
 	unit_check(chat_server_pop_next(s) == NULL, "no more messages");
 	chat_client_delete(c1);
 	chat_server_delete(s);
+	//
+	// Connect to nobody: it fails in update, and may be tried again.
+	//
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_check(chat_client_get_descriptor(c1) >= 0, "connecting");
+	unit_check(chat_client_feed(c1, "lost\n", 5) == 0, "feed meanwhile");
+	while ((rc = chat_client_update(c1, 1)) == 0)
+		;
+	unit_check(rc == CHAT_ERR_SYS && errno == ECONNREFUSED, "refused");
+	unit_check(chat_client_get_descriptor(c1) < 0 &&
+		   chat_client_update(c1, 0) == CHAT_ERR_NOT_STARTED,
+		   "not connected");
+	unit_check(chat_client_connect(c1, make_addr_str(port)) == 0,
+		   "connect again");
+	chat_client_delete(c1);
+	//
+	// Socket options.
+	//
+	struct chat_socket_options opts;
+	chat_socket_options_low_latency(&opts);
+	opts.backlog = 0;
+	s = chat_server_new();
+	c1 = chat_client_new("c1");
+	unit_check(chat_server_set_socket_options(s, &opts) ==
+		   CHAT_ERR_INVALID_ARGUMENT &&
+		   chat_client_set_socket_options(c1, &opts) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad socket options");
+	opts.backlog = 16;
+	opts.recv_buffer = 64 * 1024;
+	unit_fail_if(chat_server_set_socket_options(s, &opts) != 0);
+	unit_fail_if(chat_client_set_socket_options(c1, &opts) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_socket_options(s, &opts) ==
+		   CHAT_ERR_ALREADY_STARTED, "options are set before listen");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(server_get_port(s))) != 0);
+	int value = 0;
+	socklen_t len = sizeof(value);
+	getsockopt(chat_client_get_descriptor(c1), IPPROTO_TCP, TCP_NODELAY,
+		   &value, &len);
+	unit_check(value != 0, "client has no Nagle");
+	unit_fail_if(chat_client_feed(c1, "fast\n", 5) != 0);
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "fast") == 0, "msg data");
+	chat_message_delete(msg);
+	chat_client_delete(c1);
+	chat_server_delete(s);
 
 	unit_test_finish();
 }
@@ -334,140 +714,1367 @@ test_multi_feed(void)
 }
 
 static void
-test_multi_client(void)
+test_coalescing(void)
 {
 	unit_test_start();
 
 	struct chat_server *s = chat_server_new();
 	unit_fail_if(chat_server_listen(s, 0) != 0);
 	uint16_t port = server_get_port(s);
-	int client_count = 20;
-	int msg_count = 100;
-	uint32_t len = 1024;
-	struct test_msg *test_msg = test_msg_new(len);
-	struct chat_message *msg;
-	struct chat_client *cli;
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_set_coalescing(c1, -1, 0) == CHAT_ERR_INVALID_ARGUMENT,
+		   "negative delay");
+	unit_fail_if(chat_client_set_coalescing(c1, 3600, 100) != 0);
+	unit_check(chat_client_flush(c1) == CHAT_ERR_NOT_STARTED, "flush not started");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	/* The greeting is not held, see chat_client_set_coalescing() */
+	while (chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) {
+		chat_client_update(c1, 0);
+		chat_server_update(s, 0);
+	}
+	server_consume_events(s);
 
-	unit_msg("Connect clients");
-	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
-	for (int i = 0; i < client_count; ++i) {
-		char name[128];
-		sprintf(name, "cli_%d", i);
-		cli = chat_client_new(name);
-		unit_fail_if(chat_client_connect(
-			cli, make_addr_str(port)) != 0);
-		server_consume_events(s);
-		clis[i] = cli;
+	// Held until the size is reached
+	unit_fail_if(chat_client_feed(c1, "msg1\n", 5) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0, "output is held");
+	client_consume_events(c1);
+	server_consume_events(s);
+	unit_check(chat_server_pop_next(s) == NULL, "nothing sent");
+	int count = 1;
+	for (; count < 20; ++count)
+		unit_fail_if(chat_client_feed(c1, "msgN\n", 5) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0, "size reached");
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+		is_ok = is_ok && strcmp(msg->data, i == 0 ? "msg1" : "msgN") == 0;
+		chat_message_delete(msg);
 	}
-	unit_msg("Say hello");
-	cli = clis[client_count - 1];
-	unit_fail_if(chat_client_feed(cli, "hello\n", 6) != 0);
-	msg = server_pop_next_blocking_from(s, cli);
-	unit_fail_if(strcmp(msg->data, "hello") != 0);
+	unit_check(is_ok, "all msgs got once the size is reached");
+
+	// Or until flushed
+	unit_fail_if(chat_client_feed(c1, "msg2\n", 5) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+	unit_check(chat_server_pop_next(s) == NULL, "held again");
+	unit_check(chat_client_flush(c1) == 0, "flush");
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0, "flushed");
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "msg2") == 0, "flushed msg");
 	chat_message_delete(msg);
-	for (int i = 0; i < client_count - 1; ++i) {
-		cli = clis[i];
-		msg = client_pop_next_blocking(cli, s);
-		unit_fail_if(strcmp(msg->data, "hello") != 0);
-		chat_message_delete(msg);
+
+	// Or until the delay has passed, which the update waits for
+	unit_fail_if(chat_client_set_coalescing(c1, 0.05, 0) != 0);
+	unit_fail_if(chat_client_feed(c1, "msg3\n", 5) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0, "held for the delay");
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unit_check(chat_client_update(c1, 10) == 0, "update sends when due");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double took = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	unit_check(took >= 0.04 && took < 5, "waited for the delay");
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "msg3") == 0, "delayed msg");
+	chat_message_delete(msg);
+
+	// The same in a group
+	struct chat_client_group *group = chat_client_group_new();
+	unit_fail_if(chat_client_group_add(group, c1) != 0);
+	unit_fail_if(chat_client_feed(c1, "msg4\n", 5) != 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_group_update(group, 10);
+		chat_server_update(s, 0);
 	}
-	unit_msg("Send messages");
-	for (int mi = 0; mi < msg_count; ++mi) {
-		for (int ci = 0; ci < client_count; ++ci) {
-			test_msg_set_id(test_msg, ci, mi);
-			unit_fail_if(chat_client_feed(
-				clis[ci], test_msg->data, test_msg->size) != 0);
-			chat_client_update(clis[ci], 0);
-		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	took = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	unit_check(strcmp(msg->data, "msg4") == 0, "group delayed msg");
+	unit_check(took >= 0.04 && took < 5, "group waited for the delay");
+	chat_message_delete(msg);
+
+	chat_client_group_delete(group);
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/** Wait for a message to client @a i, updating all @a count of @a clis. */
+static struct chat_message *
+clients_pop_next_blocking(struct chat_client **clis, int count, int i,
+			  struct chat_server *s)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(clis[i])) == NULL) {
+		for (int j = 0; j < count; ++j)
+			chat_client_update(clis[j], 0);
 		chat_server_update(s, 0);
 	}
-	unit_msg("Consume all events");
-	while (true)
-	{
-		bool have_events = false;
-		for (int i = 0; i < client_count; ++i) {
-			if (chat_client_update(clis[i], 0) == 0)
-				have_events = true;
+	return msg;
+}
+
+static void
+test_binary(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+
+	unit_msg("Connect clients of both protocols");
+	struct chat_client *clis[3];
+	const char *names[3] = {"bin1", "text", "bin2"};
+	for (int i = 0; i < 3; ++i) {
+		clis[i] = chat_client_new(names[i]);
+		if (i != 1) {
+			unit_fail_if(chat_client_set_protocol(clis[i],
+				CHAT_PROTO_BINARY) != 0);
 		}
-		if (chat_server_update(s, 0) == 0)
-			have_events = true;
-		if (!have_events)
-			break;
+		unit_fail_if(chat_client_connect(clis[i],
+			make_addr_str(port)) != 0);
 	}
-	unit_msg("Check all is delivered");
-	test_msg_clear_id(test_msg);
-	int *msg_counts = calloc(client_count, sizeof(msg_counts[0]));
-	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
-		msg = chat_server_pop_next(s);
-		unit_fail_if(msg == NULL);
-		int cli_id = -1;
-		int msg_id = -1;
-		chat_message_extract_id(msg, &cli_id, &msg_id);
-		unit_fail_if(cli_id > client_count || cli_id < 0);
-		unit_fail_if(msg_id > msg_count || msg_id < 0);
-		unit_fail_if(msg_counts[cli_id] != msg_id);
-		++msg_counts[cli_id];
-
-		char name[128];
-		sprintf(name, "cli_%d", cli_id);
-		test_msg_check_data(test_msg, msg->data);
-		unit_fail_if(!author_is_eq(msg, name));
+	unit_check(chat_client_set_protocol(clis[0], CHAT_PROTO_TEXT) ==
+		   CHAT_ERR_ALREADY_STARTED, "protocol is set before connect");
+	struct chat_client *c = chat_client_new("c");
+	unit_check(chat_client_set_protocol(c, 123) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no such protocol");
+	chat_client_delete(c);
 
+	unit_msg("Send a message with a 0 in it");
+	unit_fail_if(chat_client_feed(clis[0], "a\0b\n", 4) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, clis[0]);
+	unit_check(msg->data_size == 3 && memcmp(msg->data, "a\0b", 4) == 0 &&
+		   author_is_eq(msg, "bin1"), "server got it whole");
+	chat_message_delete(msg);
+	bool ok = true;
+	for (int i = 1; i < 3; ++i) {
+		msg = clients_pop_next_blocking(clis, 3, i, s);
+		ok = ok && msg->data_size == 3 &&
+			memcmp(msg->data, "a\0b", 4) == 0 &&
+			author_is_eq(msg, "bin1");
 		chat_message_delete(msg);
 	}
-	for (int ci = 0; ci < client_count; ++ci) {
-		memset(msg_counts, 0, client_count * sizeof(msg_counts[0]));
-		cli = clis[ci];
-		// -1 because own messages are not delivered to self.
-		int total_msg_count = msg_count * (client_count - 1);
-		for (int mi = 0; mi < total_msg_count; ++mi) {
-			msg = client_pop_next_blocking(cli, s);
-			int cli_id = -1;
-			int msg_id = -1;
-			chat_message_extract_id(msg, &cli_id, &msg_id);
-			unit_fail_if(cli_id > client_count || cli_id < 0);
-			unit_fail_if(msg_id > msg_count || msg_id < 0);
-			unit_fail_if(msg_counts[cli_id] != msg_id);
-			++msg_counts[cli_id];
+	unit_check(ok, "text and binary clients got it whole");
 
-			char name[128];
-			sprintf(name, "cli_%d", cli_id);
-			test_msg_check_data(test_msg, msg->data);
-			unit_fail_if(!author_is_eq(msg, name));
+	unit_msg("The author is known now");
+	unit_fail_if(chat_client_feed(clis[0], "again\n", 6) != 0);
+	msg = clients_pop_next_blocking(clis, 3, 2, s);
+	unit_check(strcmp(msg->data, "again") == 0 &&
+		   author_is_eq(msg, "bin1"), "binary client got it");
+	chat_message_delete(msg);
 
+	unit_msg("Text to binary");
+	unit_fail_if(chat_client_feed(clis[1], "from text\n", 10) != 0);
+	ok = true;
+	for (int i = 0; i < 3; i += 2) {
+		msg = clients_pop_next_blocking(clis, 3, i, s);
+		ok = ok && strcmp(msg->data, "from text") == 0 &&
+			author_is_eq(msg, "text");
+		chat_message_delete(msg);
+	}
+	unit_check(ok, "binary clients got it");
+
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "feed\n", 5) != 0);
+	msg = clients_pop_next_blocking(clis, 3, 0, s);
+	unit_check(strcmp(msg->data, "feed") == 0 &&
+		   author_is_eq(msg, "server"), "binary client got the feed");
+	chat_message_delete(msg);
+	/* Up to the feed, what the others haven't taken */
+	for (int i = 1; i < 3; ++i) {
+		do {
+			msg = clients_pop_next_blocking(clis, 3, i, s);
+			ok = strcmp(msg->data, "feed") == 0;
 			chat_message_delete(msg);
-		}
-		unit_fail_if(msg_counts[ci] != 0);
+		} while (!ok);
 	}
-	for (int i = 0; i < client_count; ++i)
+#else
+	/* "again", which only the other binary one has taken */
+	chat_message_delete(clients_pop_next_blocking(clis, 3, 1, s));
+#endif
+
+	unit_msg("Peek without copies");
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(clis[1], "peek 1\npeek 2\n", 14) != 0);
+	struct chat_message_view view;
+	while (!chat_client_peek_next(clis[2], &view)) {
+		for (int i = 0; i < 3; ++i)
+			chat_client_update(clis[i], 0);
+		chat_server_update(s, 0);
+	}
+	ok = view_is_eq(&view, "text", "peek 1");
+	unit_check(chat_client_peek_next(clis[2], &view) &&
+		   view_is_eq(&view, "text", "peek 1") && ok,
+		   "binary client peeks the same twice");
+	chat_client_consume(clis[2]);
+	unit_fail_if(chat_client_feed(clis[0], "peek 3\n", 7) != 0);
+	while (!chat_client_peek_next(clis[1], &view)) {
+		for (int i = 0; i < 3; ++i)
+			chat_client_update(clis[i], 0);
+		chat_server_update(s, 0);
+	}
+	ok = view_is_eq(&view, "bin1", "peek 3");
+	chat_client_consume(clis[1]);
+	unit_check(ok && !chat_client_peek_next(clis[1], &view),
+		   "text client peeks");
+	server_consume_events(s);
+	ok = true;
+	const char *expected[] = {"peek 1", "peek 2", "peek 3"};
+	const char *authors[] = {"text", "text", "bin1"};
+	for (int i = 0; i < 3; ++i) {
+		ok = ok && chat_server_peek_next(s, &view) &&
+			view_is_eq(&view, authors[i], expected[i]);
+		chat_server_consume(s);
+	}
+	unit_check(ok && !chat_server_peek_next(s, &view), "server peeks");
+
+	for (int i = 0; i < 3; ++i)
 		chat_client_delete(clis[i]);
-	free(clis);
-	free(msg_counts);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
 	chat_server_delete(s);
-	test_msg_delete(test_msg);
 
 	unit_test_finish();
 }
 
-struct test_stress_ctx {
-	int msg_count;
-	uint32_t msg_len;
-	int thread_idx;
-	uint16_t port;
-	bool is_running;
-};
+static bool
+message_is_eq(struct chat_message *msg, const char *author, const char *data)
+{
+	bool ok = strcmp(msg->data, data) == 0 && author_is_eq(msg, author);
+	chat_message_delete(msg);
+	return ok;
+}
 
-static void *
-test_stress_worker_f(void *arg)
+static void
+test_compression(void)
 {
-	struct test_stress_ctx *ctx = arg;
-	int thread_idx = __atomic_fetch_add(
-		&ctx->thread_idx, 1, __ATOMIC_RELAXED);
-	struct test_msg *test_msg = test_msg_new(ctx->msg_len);
-	char name[128];
-	sprintf(name, "cli_%d", thread_idx);
-	struct chat_client *cli = chat_client_new(name);
-	unit_fail_if(chat_client_connect(cli, make_addr_str(ctx->port)) != 0);
+	unit_test_start();
+
+	unit_msg("LZ4 blocks");
+	enum { big_size = 3000 };
+	char *big = malloc(big_size + 1);
+	char *block = malloc(big_size);
+	char *out = malloc(big_size);
+	for (int i = 0; i < big_size; ++i)
+		big[i] = "chat\0compressed "[i % 16];
+	big[big_size] = '\n';
+	size_t block_size = lz_compress(big, big_size, block, big_size - 1);
+	unit_check(block_size > 0 && block_size < big_size / 10, "compressed");
+	unit_check(lz_decompress(block, block_size, out, big_size) == big_size &&
+		   memcmp(out, big, big_size) == 0, "decompressed");
+	unit_check(lz_decompress(block, block_size, out, big_size - 1) == -1 &&
+		   lz_decompress(block, block_size - 1, out, big_size) == -1,
+		   "too small or cut is malformed");
+	char noise[512];
+	for (size_t i = 0; i < sizeof(noise); ++i) {
+		/* One line */
+		noise[i] = rand();
+		if (noise[i] == '\n')
+			noise[i] = 0;
+	}
+	unit_check(lz_compress(noise, sizeof(noise), out, sizeof(noise) - 1) == 0,
+		   "noise doesn't get smaller");
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_compression(s, CHAT_SERVER_COMPRESS_MIN) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_compression(s, 0) == CHAT_ERR_ALREADY_STARTED,
+		   "compression is set before listen");
+	uint16_t port = server_get_port(s);
+
+	unit_msg("Connect a compressing client and a text one");
+	struct chat_client *clis[2];
+	clis[0] = chat_client_new("packed");
+	unit_check(chat_client_set_compression(clis[0], true) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "compression is of binary only");
+	unit_fail_if(chat_client_set_protocol(clis[0], CHAT_PROTO_BINARY) != 0);
+	unit_fail_if(chat_client_set_compression(clis[0], true) != 0);
+	clis[1] = chat_client_new("text");
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+	unit_check(chat_client_set_compression(clis[0], false) ==
+		   CHAT_ERR_ALREADY_STARTED, "compression is set before connect");
+
+	unit_msg("And one by hand, to see the frames");
+	int raw = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+				   .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	unit_fail_if(connect(raw, (struct sockaddr *)&addr, sizeof(addr)) != 0);
+	char hello[64];
+	size_t hello_size = 0;
+	hello[hello_size++] = CHAT_FRAME_MAGIC;
+	hello[hello_size++] = CHAT_FRAME_VERSION;
+#if NEED_AUTHOR
+	hello_size += chat_frame_header(CHAT_FRAME_NAME, 3, hello + hello_size);
+	memcpy(hello + hello_size, "raw", 3);
+	hello_size += 3;
+#endif
+	hello_size += chat_frame_header(CHAT_FRAME_COMPRESS, 0, hello + hello_size);
+	unit_fail_if(send(raw, hello, hello_size, 0) != (ssize_t)hello_size);
+	/* Before anything is sent to it as text */
+	server_consume_events(s);
+
+	unit_msg("Agree on the version and on compressing");
+	unit_fail_if(chat_client_feed(clis[1], "hi\n", 3) != 0);
+	unit_check(message_is_eq(clients_pop_next_blocking(clis, 2, 0, s),
+				 "text", "hi"), "small message as is");
+	unit_fail_if(chat_client_feed(clis[0], "ok\n", 3) != 0);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) == NULL ||
+	       strcmp(msg->data, "ok") != 0) {
+		if (msg != NULL)
+			chat_message_delete(msg);
+		for (int i = 0; i < 2; ++i)
+			chat_client_update(clis[i], 0);
+		chat_server_update(s, 0);
+	}
+	chat_message_delete(msg);
+
+	unit_msg("A big message goes compressed once");
+	unit_fail_if(chat_client_feed(clis[1], big, big_size + 1) != 0);
+	msg = clients_pop_next_blocking(clis, 2, 0, s);
+	/* The text client has sent the '\0' as is, and the '\n's as ' ' */
+	unit_check(msg->data_size == big_size &&
+		   memcmp(msg->data, big, big_size) == 0, "compressing client got it");
+	chat_message_delete(msg);
+	char *got = malloc(2 * big_size);
+	size_t got_size = 0;
+	struct chat_frame frame;
+	bool is_packed = false, is_whole = false;
+	while (!is_packed && !is_whole) {
+		chat_server_update(s, 0);
+		ssize_t rc = recv(raw, got + got_size, 2 * big_size - got_size,
+				  MSG_DONTWAIT);
+		if (rc > 0)
+			got_size += rc;
+		/* After the answer to the offer */
+		ssize_t size;
+		for (size_t pos = 2; pos < got_size && (size = chat_frame_decode(
+				got + pos, got_size - pos, &frame)) > 0; pos += size) {
+			is_whole = frame.type == CHAT_FRAME_MESSAGE &&
+				   frame.body_size > big_size;
+			is_packed = frame.type == CHAT_FRAME_PACKED;
+			if (is_packed || is_whole)
+				break;
+		}
+	}
+	uint32_t id;
+	uint64_t size;
+	bool ok = is_packed && frame.body_size < big_size / 10 &&
+		  chat_frame_take_id(&frame, &id) == 0;
+	int rc = ok ? chat_varint_decode(frame.body, frame.body_size, &size) : 0;
+	ok = ok && rc > 0 && size == big_size &&
+	     lz_decompress(frame.body + rc, frame.body_size - rc, out, big_size) ==
+	     big_size && memcmp(out, big, big_size) == 0;
+	unit_check(ok, "it is a packed frame on the wire");
+
+	unit_msg("Noise goes as is");
+	unit_fail_if(chat_client_feed(clis[0], noise, sizeof(noise)) != 0);
+	unit_fail_if(chat_client_feed(clis[0], "\n", 1) != 0);
+	/* After the big one */
+	chat_message_delete(server_pop_next_blocking_from(s, clis[0]));
+	msg = server_pop_next_blocking_from(s, clis[0]);
+	unit_check(msg->data_size == sizeof(noise) &&
+		   memcmp(msg->data, noise, sizeof(noise)) == 0, "server got noise");
+	chat_message_delete(msg);
+	/* Up to the noise, what the text client hasn't taken */
+	do {
+		msg = clients_pop_next_blocking(clis, 2, 1, s);
+		ok = msg->data_size == sizeof(noise);
+		chat_message_delete(msg);
+	} while (!ok);
+
+	close(raw);
+	free(got);
+	free(big);
+	free(block);
+	free(out);
+	for (int i = 0; i < 2; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+check_rooms(struct chat_server *s)
+{
+	uint16_t port = server_get_port(s);
+	struct chat_client *clis[3];
+	const char *names[3] = {"a1", "a2", "lobby"};
+	for (int i = 0; i < 3; ++i) {
+		clis[i] = chat_client_new(names[i]);
+		if (i == 1) {
+			unit_fail_if(chat_client_set_protocol(clis[i],
+				CHAT_PROTO_BINARY) != 0);
+		}
+		unit_fail_if(chat_client_connect(clis[i],
+			make_addr_str(port)) != 0);
+	}
+	unit_check(chat_client_join(clis[0], "") == CHAT_ERR_INVALID_ARGUMENT &&
+		   chat_client_join(clis[0], "a\nb") == CHAT_ERR_INVALID_ARGUMENT,
+		   "bad room names");
+
+	bool ok = true;
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(chat_client_join(clis[i], "a") != 0);
+		ok = ok && message_is_eq(clients_pop_next_blocking(clis, 3, i, s),
+					 "server", CHAT_NOTE_JOINED "a");
+	}
+	unit_check(ok, "joined");
+
+	unit_fail_if(chat_client_feed(clis[0], "in a\n", 5) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 3, 1, s), "a1",
+			   "in a");
+	unit_check(ok, "the room got it");
+	ok = message_is_eq(server_pop_next_blocking_from(s, clis[0]), "a1",
+			   "in a");
+	unit_check(ok, "the server got it, not the commands");
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "f1\n", 3) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 3, 2, s), "server",
+			   "f1");
+	unit_check(ok, "the lobby didn't, but the feed is to all");
+	for (int i = 0; i < 2; ++i)
+		chat_message_delete(clients_pop_next_blocking(clis, 3, i, s));
+#endif
+
+	unit_fail_if(chat_client_leave(clis[1]) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 3, 1, s), "server",
+			   CHAT_NOTE_LOBBY);
+	unit_fail_if(chat_client_feed(clis[2], "back\n", 5) != 0);
+	ok = ok && message_is_eq(clients_pop_next_blocking(clis, 3, 1, s),
+				 "lobby", "back");
+	unit_check(ok, "left for the lobby");
+	chat_message_delete(server_pop_next_blocking_from(s, clis[2]));
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "f2\n", 3) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 3, 0, s), "server",
+			   "f2");
+	unit_check(ok, "the room didn't get the lobby");
+#endif
+
+	for (int i = 0; i < 3; ++i)
+		chat_client_delete(clis[i]);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+}
+
+static void
+test_rooms(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_rooms(s);
+	chat_server_delete(s);
+
+	unit_msg("Rooms across threads");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_rooms(s);
+	chat_server_delete(s);
+
+	unit_msg("Rooms with io_uring");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s,
+					     CHAT_SERVER_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_rooms(s);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/**
+ * A binary client that takes a message, reconnects after some more and
+ * catches up on what the history of 4 still has.
+ */
+static void
+check_history(struct chat_server *s)
+{
+	uint16_t port = server_get_port(s);
+	struct chat_client *w = chat_client_new("w");
+	unit_fail_if(chat_client_connect(w, make_addr_str(port)) != 0);
+	struct chat_client *clis[2] = {chat_client_new("r"), w};
+	unit_check(chat_client_resume(clis[0], 0) == CHAT_ERR_INVALID_ARGUMENT,
+		   "no resume for the text protocol");
+	unit_fail_if(chat_client_set_protocol(clis[0], CHAT_PROTO_BINARY) != 0);
+	unit_fail_if(chat_client_connect(clis[0], make_addr_str(port)) != 0);
+	unit_check(chat_client_resume(clis[0], 0) == CHAT_ERR_ALREADY_STARTED,
+		   "resume is before connect");
+	/* Once its message is there, the server knows its protocol */
+	unit_fail_if(chat_client_feed(clis[0], "hi\n", 3) != 0);
+	chat_message_delete(clients_pop_next_blocking(clis, 2, 1, s));
+	chat_message_delete(server_pop_next_blocking_from(s, clis[0]));
+
+	unit_fail_if(chat_client_feed(w, "m1\n", 3) != 0);
+	bool ok = message_is_eq(clients_pop_next_blocking(clis, 2, 0, s), "w",
+				"m1");
+	uint64_t seq = chat_client_get_last_seq(clis[0]);
+	unit_check(ok && seq == 2, "the message has its number");
+	chat_message_delete(server_pop_next_blocking_from(s, w));
+	chat_client_delete(clis[0]);
+
+	char buf[16];
+	for (int i = 2; i <= 6; ++i) {
+		int len = sprintf(buf, "m%d\n", i);
+		unit_fail_if(chat_client_feed(w, buf, len) != 0);
+		chat_message_delete(server_pop_next_blocking_from(s, w));
+	}
+	clis[0] = chat_client_new("r");
+	unit_fail_if(chat_client_set_protocol(clis[0], CHAT_PROTO_BINARY) != 0);
+	unit_fail_if(chat_client_resume(clis[0], seq) != 0);
+	unit_fail_if(chat_client_connect(clis[0], make_addr_str(port)) != 0);
+	ok = true;
+	for (int i = 3; i <= 6; ++i) {
+		sprintf(buf, "m%d", i);
+		ok = ok && message_is_eq(clients_pop_next_blocking(clis, 2, 0, s),
+					 "w", buf);
+	}
+	unit_check(ok && chat_client_get_last_seq(clis[0]) == 7,
+		   "caught up on what the history has");
+	unit_fail_if(chat_client_feed(w, "m7\n", 3) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 2, 0, s), "w", "m7");
+	unit_check(ok && chat_client_get_last_seq(clis[0]) == 8 &&
+		   chat_client_get_last_seq(w) == 0, "and goes on from there");
+
+	for (int i = 0; i < 2; ++i)
+		chat_client_delete(clis[i]);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+}
+
+static void
+test_history(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_history(s, 4) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_history(s, 8) == CHAT_ERR_ALREADY_STARTED,
+		   "history is set before listen");
+	check_history(s);
+	chat_server_delete(s);
+
+	unit_msg("History across threads");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_fail_if(chat_server_set_history(s, 4) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_history(s);
+	chat_server_delete(s);
+
+	unit_msg("History with io_uring");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s,
+					     CHAT_SERVER_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_set_history(s, 4) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_history(s);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+enum { cluster_size = 3 };
+
+/** Update the unthreaded servers and the clients of a cluster once. */
+static void
+cluster_update(struct chat_server **servs, struct chat_client **clis)
+{
+	for (int i = 0; i < cluster_size; ++i) {
+		chat_server_update(servs[i], 0);
+		chat_client_update(clis[i], 0);
+	}
+}
+
+/** Wait for a message to client @a i of a cluster. */
+static struct chat_message *
+cluster_pop_next_blocking(struct chat_server **servs, struct chat_client **clis, int i)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(clis[i])) == NULL)
+		cluster_update(servs, clis);
+	return msg;
+}
+
+/** Whether none of the clients of a cluster gets anything more. */
+static bool
+cluster_is_quiet(struct chat_server **servs, struct chat_client **clis)
+{
+	for (int round = 0; round < 100; ++round) {
+		cluster_update(servs, clis);
+		usleep(1000);
+	}
+	bool ok = true;
+	for (int i = 0; i < cluster_size; ++i) {
+		struct chat_message *msg = chat_client_pop_next(clis[i]);
+		ok = ok && msg == NULL;
+		if (msg)
+			chat_message_delete(msg);
+	}
+	return ok;
+}
+
+static void
+test_cluster(void)
+{
+	unit_test_start();
+
+	/* A loop of links, s0 -> s1, s2 -> s0, s2 -> s1, the s1 threaded */
+	struct chat_server *servs[cluster_size];
+	uint16_t ports[cluster_size];
+	for (int i = 0; i < cluster_size; ++i) {
+		servs[i] = chat_server_new();
+		unit_fail_if(chat_server_set_node_id(servs[i], i + 1) != 0);
+	}
+	unit_check(chat_server_set_node_id(servs[0], 0) == CHAT_ERR_INVALID_ARGUMENT,
+		   "node id 0");
+	unit_check(chat_server_link(servs[0], "localhost:1") == CHAT_ERR_NOT_STARTED,
+		   "link before listen");
+	unit_fail_if(chat_server_set_threads(servs[1], 2) != 0);
+	for (int i = 0; i < cluster_size; ++i) {
+		unit_fail_if(chat_server_listen(servs[i], 0) != 0);
+		ports[i] = server_get_port(servs[i]);
+	}
+	unit_check(chat_server_set_node_id(servs[0], 5) == CHAT_ERR_ALREADY_STARTED,
+		   "node id after listen");
+	unit_check(chat_server_link(servs[1], make_addr_str(ports[0])) ==
+		   CHAT_ERR_NOT_IMPLEMENTED, "no links of a threaded one");
+	struct chat_server *plain = chat_server_new();
+	unit_fail_if(chat_server_listen(plain, 0) != 0);
+	unit_check(chat_server_link(plain, make_addr_str(ports[0])) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no links of a non-node");
+	chat_server_delete(plain);
+	unit_check(chat_server_link(servs[0], make_addr_str(ports[1])) == 0 &&
+		   chat_server_link(servs[2], make_addr_str(ports[0])) == 0 &&
+		   chat_server_link(servs[2], make_addr_str(ports[1])) == 0, "linked");
+
+	struct chat_client *clis[cluster_size];
+	const char *names[cluster_size] = {"n0", "n1", "n2"};
+	for (int i = 0; i < cluster_size; ++i) {
+		clis[i] = chat_client_new(names[i]);
+		if (i == 1) {
+			unit_fail_if(chat_client_set_protocol(clis[i],
+				CHAT_PROTO_BINARY) != 0);
+		}
+		unit_fail_if(chat_client_connect(clis[i],
+			make_addr_str(ports[i])) != 0);
+	}
+
+	unit_fail_if(chat_client_feed(clis[0], "hello\n", 6) != 0);
+	bool ok = true;
+	for (int i = 1; i < cluster_size; ++i) {
+		ok = ok && message_is_eq(cluster_pop_next_blocking(servs, clis, i),
+					 "n0", "hello");
+	}
+	unit_check(ok, "the other nodes got it");
+	unit_check(cluster_is_quiet(servs, clis), "once each");
+
+	/* The rooms are by the names across the nodes */
+	for (int i = 1; i < cluster_size; ++i) {
+		unit_fail_if(chat_client_join(clis[i], "r") != 0);
+		ok = ok && message_is_eq(cluster_pop_next_blocking(servs, clis, i),
+					 "server", CHAT_NOTE_JOINED "r");
+	}
+	unit_check(ok, "joined");
+	unit_fail_if(chat_client_feed(clis[2], "in r\n", 5) != 0);
+	ok = message_is_eq(cluster_pop_next_blocking(servs, clis, 1), "n2", "in r");
+	unit_check(ok, "the room of another node got it");
+	unit_check(cluster_is_quiet(servs, clis), "not the lobby");
+	ok = message_is_eq(server_pop_next_blocking_from(servs[0], clis[0]), "n0", "hello") &&
+	     message_is_eq(server_pop_next_blocking_from(servs[0], clis[0]), "n2", "in r");
+	unit_check(ok, "the server got the relayed one too");
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(servs[2], "news\n", 5) != 0);
+	ok = true;
+	for (int i = 0; i < cluster_size; ++i) {
+		ok = ok && message_is_eq(cluster_pop_next_blocking(servs, clis, i),
+					 "server", "news");
+	}
+	unit_check(ok, "the feed goes to all the nodes");
+	unit_check(cluster_is_quiet(servs, clis), "the feed once each");
+#endif
+
+	for (int i = 0; i < cluster_size; ++i) {
+		chat_client_delete(clis[i]);
+		chat_server_delete(servs[i]);
+	}
+
+	unit_test_finish();
+}
+
+struct test_handoff_ctx {
+	struct chat_server *server;
+	int fd;
+	int rc;
+};
+
+static void *
+test_handoff_f(void *arg)
+{
+	struct test_handoff_ctx *ctx = arg;
+	ctx->rc = chat_server_handoff(ctx->server, ctx->fd);
+	return NULL;
+}
+
+/**
+ * The clients of a room, text and binary, stay connected while the server
+ * hands them over. What one has sent to the old server, and nobody has
+ * read yet, reaches the new one, and a new client there gets an author id
+ * of its own.
+ */
+static void
+test_handoff(void)
+{
+	unit_test_start();
+
+	struct chat_server *old = chat_server_new();
+	unit_check(chat_server_handoff(old, -1) == CHAT_ERR_NOT_STARTED,
+		   "handoff is of a listening server");
+	unit_fail_if(chat_server_listen(old, 0) != 0);
+	uint16_t port = server_get_port(old);
+	struct chat_client *clis[3] = {chat_client_new("a"),
+				       chat_client_new("b"),
+				       chat_client_new("c")};
+	unit_fail_if(chat_client_set_protocol(clis[1], CHAT_PROTO_BINARY) != 0);
+	for (int i = 0; i < 2; ++i) {
+		unit_fail_if(chat_client_connect(clis[i],
+			make_addr_str(port)) != 0);
+		unit_fail_if(chat_client_join(clis[i], "r") != 0);
+		chat_message_delete(clients_pop_next_blocking(clis, 2, i, old));
+	}
+	unit_fail_if(chat_client_feed(clis[0], "m1\n", 3) != 0);
+	bool ok = message_is_eq(clients_pop_next_blocking(clis, 2, 1, old), "a",
+				"m1");
+	unit_check(ok, "the old server serves");
+	chat_message_delete(server_pop_next_blocking_from(old, clis[0]));
+	/* Sent and not read by the old one */
+	unit_fail_if(chat_client_feed(clis[0], "m2\n", 3) != 0);
+	client_consume_events(clis[0]);
+
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	struct chat_server *next = chat_server_new();
+	struct test_handoff_ctx ctx = {.server = old, .fd = fds[0]};
+	pthread_t tid;
+	unit_fail_if(pthread_create(&tid, NULL, test_handoff_f, &ctx) != 0);
+	int rc = chat_server_takeover(next, fds[1]);
+	pthread_join(tid, NULL);
+	close(fds[0]);
+	close(fds[1]);
+	unit_check(ctx.rc == 0 && rc == 0, "handed over");
+	unit_check(chat_server_get_socket(old) == -1 &&
+		   server_get_port(next) == port, "the new one listens instead");
+	unit_check(chat_server_takeover(next, -1) == CHAT_ERR_ALREADY_STARTED,
+		   "only once");
+
+	ok = message_is_eq(clients_pop_next_blocking(clis, 2, 1, next), "a",
+			   "m2");
+	unit_check(ok, "what was on the way got to the new one");
+	chat_message_delete(server_pop_next_blocking_from(next, clis[0]));
+	unit_fail_if(chat_client_feed(clis[1], "m3\n", 3) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 2, 0, next), "b",
+			   "m3");
+	unit_check(ok, "the binary one goes on");
+	chat_message_delete(server_pop_next_blocking_from(next, clis[1]));
+
+	unit_fail_if(chat_client_connect(clis[2], make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_join(clis[2], "r") != 0);
+	chat_message_delete(clients_pop_next_blocking(clis, 3, 2, next));
+	unit_fail_if(chat_client_feed(clis[2], "m4\n", 3) != 0);
+	ok = message_is_eq(clients_pop_next_blocking(clis, 3, 1, next), "c",
+			   "m4");
+	unit_check(ok, "a new client is in the same room, with its own id");
+	for (int i = 0; i < 3; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(old);
+	chat_server_delete(next);
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_check(chat_server_takeover(s, -1) == CHAT_ERR_NOT_IMPLEMENTED,
+		   "no takeover by threads");
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+/**
+ * A client that doesn't read, with a small receive buffer, and one that
+ * sends @a count messages to it. Returns the ids of the messages the slow
+ * one gets in the end, and the server's output stats once the fast one is
+ * done, or stuck with the input paused.
+ */
+static int
+test_overflow_run(enum chat_server_backend backend,
+		  enum chat_server_overflow policy, size_t peer_limit,
+		  size_t total_limit, int count, int *ids,
+		  struct chat_server_output_stats *stats)
+{
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s, backend) != 0);
+	unit_fail_if(chat_server_set_output_limits(s, peer_limit, total_limit,
+						   policy) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *slow = chat_client_new("slow");
+	struct chat_client *fast = chat_client_new("fast");
+	unit_fail_if(chat_client_connect(slow, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(fast, make_addr_str(port)) != 0);
+	int fd = chat_client_get_descriptor(slow);
+	unit_fail_if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){256 * 1024},
+				sizeof(int)) != 0);
+	/* The slow one's name reaches the server before the flood */
+	client_consume_events(slow);
+	server_consume_events(s);
+
+	struct test_msg *test_msg = test_msg_new(32 * 1024);
+	for (int i = 0; i < count; ++i) {
+		test_msg_set_id(test_msg, 0, i);
+		unit_fail_if(chat_client_feed(fast, test_msg->data,
+					      test_msg->size) != 0);
+	}
+	int rc1, rc2;
+	do {
+		rc1 = chat_client_update(fast, 0);
+		unit_fail_if(rc1 != 0 && rc1 != CHAT_ERR_TIMEOUT);
+		rc2 = chat_server_update(s, 0);
+		unit_fail_if(rc2 != 0 && rc2 != CHAT_ERR_TIMEOUT);
+	} while (rc1 == 0 || rc2 == 0);
+	chat_server_get_output_stats(s, stats);
+
+	/* Now read all, while the fast one finishes if it is paused */
+	int got = 0;
+	for (int i = 0; i < 100000; ++i) {
+		chat_client_update(slow, 0);
+		chat_client_update(fast, 0);
+		chat_server_update(s, 0);
+		struct chat_message *msg;
+		while ((msg = chat_client_pop_next(slow)) != NULL) {
+			int cli_id;
+			chat_message_extract_id(msg, &cli_id, &ids[got++]);
+			chat_message_delete(msg);
+		}
+		if (got > 0 && ids[got - 1] == count - 1)
+			break;
+		if (policy == CHAT_SERVER_OVERFLOW_DISCONNECT &&
+		    stats->disconnected_peers > 0)
+			break;
+	}
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	test_msg_delete(test_msg);
+	chat_client_delete(slow);
+	chat_client_delete(fast);
+	chat_server_delete(s);
+	return got;
+}
+
+static void
+test_overflow(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_output_limits(s, 1, 1, 123) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no such policy");
+	chat_server_delete(s);
+
+	/* Much more than the socket buffers of the slow client take */
+	const int count = 400;
+	const size_t limit = 256 * 1024;
+	int *ids = malloc(sizeof(*ids) * count);
+	struct chat_server_output_stats stats;
+
+	unit_msg("Drop the oldest");
+	int got = test_overflow_run(CHAT_SERVER_BACKEND_EPOLL,
+				    CHAT_SERVER_OVERFLOW_DROP_OLDEST, limit, 0,
+				    count, ids, &stats);
+	unit_check(stats.dropped_messages > 0 && stats.dropped_bytes > 0 &&
+		   stats.queued_bytes <= limit, "dropped, within the limit");
+	bool is_ordered = true;
+	for (int i = 1; i < got; ++i)
+		is_ordered = is_ordered && ids[i - 1] < ids[i];
+	unit_check(got < count && is_ordered && ids[got - 1] == count - 1,
+		   "the newest are kept");
+
+	unit_msg("Disconnect");
+	test_overflow_run(CHAT_SERVER_BACKEND_EPOLL,
+			  CHAT_SERVER_OVERFLOW_DISCONNECT, 0, limit, count,
+			  ids, &stats);
+	unit_check(stats.disconnected_peers == 1 && stats.queued_bytes == 0,
+		   "disconnected");
+
+	unit_msg("Pause the input");
+	got = test_overflow_run(CHAT_SERVER_BACKEND_EPOLL,
+				CHAT_SERVER_OVERFLOW_PAUSE_INPUT, limit, limit,
+				count, ids, &stats);
+	/* Over by at most the messages of one receive before the pause */
+	unit_check(stats.input_pauses > 0 && stats.dropped_messages == 0 &&
+		   stats.queued_bytes < 2 * limit + PMQ_RECV_MAX, "paused");
+	is_ordered = got == count;
+	for (int i = 0; i < got; ++i)
+		is_ordered = is_ordered && ids[i] == i;
+	unit_check(is_ordered, "nothing is lost");
+
+	free(ids);
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_loop_stats stats;
+	chat_server_get_loop_stats(s, &stats);
+	unit_check(stats.updates == 0 && stats.accepted_peers == 0,
+		   "nothing before listen");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+
+	enum { client_count = 3 };
+	struct chat_client *clis[client_count];
+	for (int i = 0; i < client_count; ++i) {
+		char name[16];
+		sprintf(name, "stats_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+	}
+	unit_fail_if(chat_client_feed(clis[0], "counted\n", 8) != 0);
+	for (int i = 1; i < client_count; ++i) {
+		struct chat_message *msg =
+			clients_pop_next_blocking(clis, client_count, i, s);
+		unit_fail_if(!message_is_eq(msg, "stats_0", "counted"));
+	}
+	chat_message_delete(server_pop_next_blocking_from(s, clis[0]));
+
+	chat_server_get_loop_stats(s, &stats);
+	unit_check(stats.accepted_peers == client_count, "accepted");
+	unit_check(stats.updates > 0 && stats.events >= stats.updates &&
+		   stats.busy_ns >= stats.max_busy_ns && stats.max_busy_ns > 0,
+		   "updates");
+	unit_check(stats.messages_received == 1 && stats.broadcasts == 1 &&
+		   stats.deliveries == client_count - 1, "fan-out");
+	uint64_t depths = 0;
+	for (int i = 0; i < CHAT_SERVER_QUEUE_DEPTH_BUCKETS; ++i)
+		depths += stats.queue_depths[i];
+	unit_check(depths == client_count - 1 && stats.queue_depths[0] == depths,
+		   "queue depths");
+	unit_check(stats.bytes_in >= 8 && stats.bytes_out >= 2 * 8, "bytes");
+
+	unit_msg("Text snapshot");
+	char buf[2048];
+	int len = chat_server_format_stats(s, buf, sizeof(buf));
+	unit_check(len > 0 && (size_t)len == strlen(buf), "formatted");
+	unit_check(strstr(buf, "accepted_peers 3\n") != NULL &&
+		   strstr(buf, "deliveries 2\n") != NULL &&
+		   strstr(buf, "queue_depth_le_1024 2\n") != NULL, "has the counters");
+	char small[16];
+	unit_check(chat_server_format_stats(s, small, sizeof(small)) == len &&
+		   strlen(small) == sizeof(small) - 1, "truncated");
+
+	unit_msg("An accept storm");
+	enum { storm_count = 90 };
+	int socks[storm_count];
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port),
+				   .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	for (int i = 0; i < storm_count; ++i) {
+		socks[i] = socket(AF_INET, SOCK_STREAM, 0);
+		unit_fail_if(connect(socks[i], (void *)&addr, sizeof(addr)) != 0);
+	}
+	uint64_t before = stats.accepted_peers;
+	unit_fail_if(chat_server_update(s, 1) != 0);
+	chat_server_get_loop_stats(s, &stats);
+	unit_check(stats.accepted_peers - before < storm_count, "a batch at a time");
+	while (stats.accepted_peers - before < storm_count) {
+		unit_fail_if(chat_server_update(s, 1) != 0);
+		chat_server_get_loop_stats(s, &stats);
+	}
+	unit_check(stats.accepted_peers - before == storm_count &&
+		   stats.accept_errors == 0, "all accepted");
+	for (int i = 0; i < storm_count; ++i)
+		close(socks[i]);
+	server_consume_events(s);
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_busy_poll(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_busy_poll(s, 100, -2) == CHAT_ERR_INVALID_ARGUMENT,
+		   "no such cpu");
+	/* The spin is long enough for the whole exchange, not pinned */
+	unit_fail_if(chat_server_set_busy_poll(s, 500 * 1000, -1) != 0);
+	struct chat_socket_options opts;
+	chat_socket_options_low_latency(&opts);
+	opts.prefer_busy_poll = true;
+	unit_fail_if(chat_server_set_socket_options(s, &opts) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_busy_poll(s, 0, -1) == CHAT_ERR_ALREADY_STARTED,
+		   "set before listen");
+
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(server_get_port(s))) != 0);
+	unit_fail_if(chat_client_feed(c1, "spun\n", 5) != 0);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_update(c1, 0);
+		chat_server_update(s, 1);
+	}
+	unit_check(strcmp(msg->data, "spun") == 0, "received");
+	chat_message_delete(msg);
+	struct chat_server_loop_stats stats;
+	chat_server_get_loop_stats(s, &stats);
+	unit_check(stats.busy_polls > 0 && stats.busy_polls <= stats.updates,
+		   "found spinning");
+	unit_check(chat_server_update(s, 0) == CHAT_ERR_TIMEOUT, "no spin without a timeout");
+	char buf[2048];
+	unit_fail_if(chat_server_format_stats(s, buf, sizeof(buf)) <= 0);
+	unit_check(strstr(buf, "busy_polls ") != NULL, "formatted");
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_msg("The threads, pinned");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_fail_if(chat_server_set_busy_poll(s, 1000, 0) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *clis[2];
+	for (int i = 0; i < 2; ++i) {
+		char name[16];
+		sprintf(name, "spin_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+	}
+	unit_fail_if(chat_client_feed(clis[0], "across\n", 7) != 0);
+	msg = clients_pop_next_blocking(clis, 2, 1, s);
+	unit_check(message_is_eq(msg, "spin_0", "across"), "delivered");
+	chat_message_delete(server_pop_next_blocking_from(s, clis[0]));
+	for (int i = 0; i < 2; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_event_batch(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_event_batch(s, 0) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no empty event batch");
+	/* An event at a time, the rest must wait in the epoll. */
+	unit_fail_if(chat_server_set_event_batch(s, 1) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	enum { CLIENT_COUNT = 5 };
+	struct chat_client *clis[CLIENT_COUNT];
+	for (int i = 0; i < CLIENT_COUNT; ++i) {
+		char name[16];
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		server_consume_events(s);
+	}
+	/* All of them are ready at once, and taken one per update. */
+	for (int i = 0; i < CLIENT_COUNT; ++i) {
+		unit_fail_if(chat_client_feed(clis[i], "msg\n", 4) != 0);
+		chat_client_update(clis[i], 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < CLIENT_COUNT; ++i) {
+		struct chat_message *msg =
+			server_pop_next_blocking_from(s, clis[i]);
+		is_ok = is_ok && strcmp(msg->data, "msg") == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "the server got each message");
+	is_ok = true;
+	for (int i = 0; i < CLIENT_COUNT; ++i) {
+		for (int j = 0; j < CLIENT_COUNT - 1; ++j) {
+			struct chat_message *msg =
+				client_pop_next_blocking(clis[i], s);
+			is_ok = is_ok && strcmp(msg->data, "msg") == 0;
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(is_ok, "each client got the others' messages");
+
+	for (int i = 0; i < CLIENT_COUNT; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_multi_client(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	int client_count = 20;
+	int msg_count = 100;
+	uint32_t len = 1024;
+	struct test_msg *test_msg = test_msg_new(len);
+	struct chat_message *msg;
+	struct chat_client *cli;
+
+	unit_msg("Connect clients");
+	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
+	for (int i = 0; i < client_count; ++i) {
+		char name[128];
+		sprintf(name, "cli_%d", i);
+		cli = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			cli, make_addr_str(port)) != 0);
+		server_consume_events(s);
+		clis[i] = cli;
+	}
+	unit_msg("Say hello");
+	cli = clis[client_count - 1];
+	unit_fail_if(chat_client_feed(cli, "hello\n", 6) != 0);
+	msg = server_pop_next_blocking_from(s, cli);
+	unit_fail_if(strcmp(msg->data, "hello") != 0);
+	chat_message_delete(msg);
+	for (int i = 0; i < client_count - 1; ++i) {
+		cli = clis[i];
+		msg = client_pop_next_blocking(cli, s);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_msg("Send messages");
+	for (int mi = 0; mi < msg_count; ++mi) {
+		for (int ci = 0; ci < client_count; ++ci) {
+			test_msg_set_id(test_msg, ci, mi);
+			unit_fail_if(chat_client_feed(
+				clis[ci], test_msg->data, test_msg->size) != 0);
+			chat_client_update(clis[ci], 0);
+		}
+		chat_server_update(s, 0);
+	}
+	unit_msg("Consume all events");
+	while (true)
+	{
+		bool have_events = false;
+		for (int i = 0; i < client_count; ++i) {
+			if (chat_client_update(clis[i], 0) == 0)
+				have_events = true;
+		}
+		if (chat_server_update(s, 0) == 0)
+			have_events = true;
+		if (!have_events)
+			break;
+	}
+	unit_msg("Check all is delivered");
+	test_msg_clear_id(test_msg);
+	int *msg_counts = calloc(client_count, sizeof(msg_counts[0]));
+	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
+		msg = chat_server_pop_next(s);
+		unit_fail_if(msg == NULL);
+		int cli_id = -1;
+		int msg_id = -1;
+		chat_message_extract_id(msg, &cli_id, &msg_id);
+		unit_fail_if(cli_id > client_count || cli_id < 0);
+		unit_fail_if(msg_id > msg_count || msg_id < 0);
+		unit_fail_if(msg_counts[cli_id] != msg_id);
+		++msg_counts[cli_id];
+
+		char name[128];
+		sprintf(name, "cli_%d", cli_id);
+		test_msg_check_data(test_msg, msg->data);
+		unit_fail_if(!author_is_eq(msg, name));
+
+		chat_message_delete(msg);
+	}
+	for (int ci = 0; ci < client_count; ++ci) {
+		memset(msg_counts, 0, client_count * sizeof(msg_counts[0]));
+		cli = clis[ci];
+		// -1 because own messages are not delivered to self.
+		int total_msg_count = msg_count * (client_count - 1);
+		for (int mi = 0; mi < total_msg_count; ++mi) {
+			msg = client_pop_next_blocking(cli, s);
+			int cli_id = -1;
+			int msg_id = -1;
+			chat_message_extract_id(msg, &cli_id, &msg_id);
+			unit_fail_if(cli_id > client_count || cli_id < 0);
+			unit_fail_if(msg_id > msg_count || msg_id < 0);
+			unit_fail_if(msg_counts[cli_id] != msg_id);
+			++msg_counts[cli_id];
+
+			char name[128];
+			sprintf(name, "cli_%d", cli_id);
+			test_msg_check_data(test_msg, msg->data);
+			unit_fail_if(!author_is_eq(msg, name));
+
+			chat_message_delete(msg);
+		}
+		unit_fail_if(msg_counts[ci] != 0);
+	}
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	free(msg_counts);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+static void
+test_client_group(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client_group *g = chat_client_group_new();
+	unit_fail_if(g == NULL);
+	unit_check(chat_client_group_get_descriptor(g) >= 0, "group has descriptor");
+	unit_check(chat_client_group_get_events(g) == 0, "empty group no events");
+	struct chat_client *cli = chat_client_new("alone");
+	unit_check(chat_client_group_add(g, cli) == CHAT_ERR_NOT_STARTED,
+		   "no group for not connected");
+	chat_client_delete(cli);
+
+	unit_msg("Connect clients of both protocols");
+	enum { client_count = 10 };
+	struct chat_client *clis[client_count];
+	for (int i = 0; i < client_count; ++i) {
+		char name[32];
+		sprintf(name, "grp_%d", i);
+		clis[i] = chat_client_new(name);
+		if (i % 2 == 1)
+			unit_fail_if(chat_client_set_protocol(clis[i], CHAT_PROTO_BINARY) != 0);
+		unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+		unit_fail_if(chat_client_group_add(g, clis[i]) != 0);
+	}
+	unit_check(chat_client_group_add(g, clis[0]) == CHAT_ERR_ALREADY_STARTED,
+		   "one group at a time");
+	unit_check(chat_client_group_get_events(g) & CHAT_EVENT_INPUT,
+		   "group needs input");
+
+	unit_msg("Broadcast through the group");
+	unit_fail_if(chat_client_feed(clis[0], "hello\n", 6) != 0);
+	unit_check(chat_client_group_get_events(g) & CHAT_EVENT_OUTPUT,
+		   "group has output");
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) == NULL) {
+		chat_client_group_update(g, 0);
+		chat_server_update(s, 0);
+	}
+	unit_check(message_is_eq(msg, "grp_0", "hello"), "server got it");
+	int got = 0;
+	bool is_from_self = false;
+	while (got < client_count - 1) {
+		chat_client_group_update(g, 0);
+		chat_server_update(s, 0);
+		int err;
+		while ((cli = chat_client_group_next_ready(g, &err)) != NULL) {
+			unit_fail_if(err != 0);
+			if (cli == clis[0])
+				is_from_self = true;
+			while ((msg = chat_client_pop_next(cli)) != NULL) {
+				unit_fail_if(!message_is_eq(msg, "grp_0", "hello"));
+				++got;
+			}
+		}
+	}
+	unit_check(got == client_count - 1 && !is_from_self,
+		   "all but the author got it");
+
+	unit_msg("All feed");
+	for (int i = 0; i < client_count; ++i)
+		unit_fail_if(chat_client_feed(clis[i], "bye\n", 4) != 0);
+	got = 0;
+	while (got < client_count) {
+		chat_client_group_update(g, 0);
+		chat_server_update(s, 0);
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			unit_fail_if(strcmp(msg->data, "bye") != 0);
+			chat_message_delete(msg);
+			++got;
+		}
+	}
+	unit_check(got == client_count, "server got all");
+
+	unit_msg("A failed connect is reported");
+	struct chat_server *gone = chat_server_new();
+	unit_fail_if(chat_server_listen(gone, 0) != 0);
+	uint16_t gone_port = server_get_port(gone);
+	chat_server_delete(gone);
+	cli = chat_client_new("nobody");
+	unit_fail_if(chat_client_connect(cli, make_addr_str(gone_port)) != 0);
+	unit_fail_if(chat_client_group_add(g, cli) != 0);
+	int err = 0;
+	struct chat_client *ready;
+	do {
+		chat_client_group_update(g, 0.1);
+		while ((ready = chat_client_group_next_ready(g, &err)) != NULL &&
+		       ready != cli)
+			while ((msg = chat_client_pop_next(ready)) != NULL)
+				chat_message_delete(msg);
+	} while (ready == NULL);
+	unit_check(err == CHAT_ERR_SYS && errno == ECONNREFUSED, "refused");
+	chat_client_group_remove(g, cli);
+	chat_client_delete(cli);
+
+	unit_msg("Delete a client in the group, then the group");
+	chat_client_delete(clis[0]);
+	chat_client_group_delete(g);
+	for (int i = 1; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+struct test_stress_ctx {
+	int msg_count;
+	uint32_t msg_len;
+	int thread_idx;
+	uint16_t port;
+	bool is_running;
+};
+
+static void *
+test_stress_worker_f(void *arg)
+{
+	struct test_stress_ctx *ctx = arg;
+	int thread_idx = __atomic_fetch_add(
+		&ctx->thread_idx, 1, __ATOMIC_RELAXED);
+	struct test_msg *test_msg = test_msg_new(ctx->msg_len);
+	char name[128];
+	sprintf(name, "cli_%d", thread_idx);
+	struct chat_client *cli = chat_client_new(name);
+	unit_fail_if(chat_client_connect(cli, make_addr_str(ctx->port)) != 0);
 	for (int i = 0; i < ctx->msg_count; ++i) {
 		test_msg_set_id(test_msg, thread_idx, i);
 		unit_fail_if(chat_client_feed(cli,
@@ -483,6 +2090,587 @@ test_stress_worker_f(void *arg)
 	return NULL;
 }
 
+static void
+check_threads_broadcast(struct chat_server *s)
+{
+	uint16_t port = server_get_port(s);
+	enum { client_count = 8 };
+	struct chat_client *clis[client_count];
+	struct chat_message *msg;
+	char name[128];
+
+	unit_msg("Connect clients");
+	for (int i = 0; i < client_count; ++i) {
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		unit_fail_if(chat_client_feed(clis[i], "hello\n", 6) != 0);
+	}
+	/* Once each hello is received, all the peers are in their threads. */
+	for (int i = 0; i < client_count; ++i) {
+		msg = server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_msg("Broadcast across the threads");
+	for (int i = 0; i < client_count; ++i) {
+		sprintf(name, "msg_%d\n", i);
+		unit_fail_if(chat_client_feed(clis[i], name, strlen(name)) != 0);
+	}
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "feed\n", 5) != 0);
+#endif
+	bool is_ok = true;
+	for (int i = 0; i < client_count; ++i) {
+		int got = 0;
+		bool got_feed = !NEED_SERVER_FEED;
+		while (got < client_count - 1 || !got_feed) {
+			/* All the clients, for each to send its own message. */
+			for (int j = 0; j < client_count; ++j)
+				chat_client_update(clis[j], 0);
+			chat_server_update(s, 0);
+			if ((msg = chat_client_pop_next(clis[i])) == NULL)
+				continue;
+			if (strcmp(msg->data, "feed") == 0) {
+				is_ok = is_ok && author_is_eq(msg, "server");
+				got_feed = true;
+			} else if (strncmp(msg->data, "msg_", 4) == 0) {
+				int from = atoi(msg->data + 4);
+				sprintf(name, "cli_%d", from);
+				is_ok = is_ok && author_is_eq(msg, name) &&
+					from != i;
+				++got;
+			}
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(is_ok, "all delivered");
+	for (int i = 0; i < client_count; ++i) {
+		msg = server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strncmp(msg->data, "msg_", 4) != 0);
+		chat_message_delete(msg);
+	}
+	unit_check(chat_server_pop_next(s) == NULL, "server got all");
+
+#if NEED_SERVER_FEED
+	unit_msg("Batched feed");
+	struct iovec parts[] = {
+		{.iov_base = "b1\nb2", .iov_len = 5},
+		{.iov_base = "", .iov_len = 0},
+		{.iov_base = "b3\n", .iov_len = 3},
+	};
+	unit_fail_if(chat_server_feed_many(s, parts, 3) != 0);
+	unit_fail_if(chat_server_feed_many(s, parts, 0) != 0);
+	for (int i = 0; i < client_count; ++i) {
+		for (int j = 1; j <= 3; ++j) {
+			msg = client_pop_next_blocking(clis[i], s);
+			sprintf(name, "b%d", j);
+			is_ok = is_ok && strcmp(msg->data, name) == 0 &&
+				author_is_eq(msg, "server");
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(is_ok, "each part split, all in order");
+#endif
+
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_threads(s, CHAT_SERVER_MAX_THREADS + 1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "too many threads");
+	unit_fail_if(chat_server_set_threads(s, 3) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_threads(s, 2) == CHAT_ERR_ALREADY_STARTED,
+		   "threads are set before listen");
+	unit_check(chat_server_set_event_batch(s, 16) ==
+		   CHAT_ERR_ALREADY_STARTED, "so is the event batch");
+	check_threads_broadcast(s);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_uring(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_backend(s, 100) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no such backend");
+	unit_fail_if(chat_server_set_backend(s,
+					     CHAT_SERVER_BACKEND_URING) != 0);
+	int rc = chat_server_listen(s, 0);
+	if (rc == CHAT_ERR_SYS && (errno == ENOSYS || errno == EPERM ||
+				   errno == EINVAL)) {
+		unit_msg("No io_uring in this kernel, skipped");
+		chat_server_delete(s);
+		unit_test_finish();
+		return;
+	}
+	unit_fail_if(rc != 0);
+	uint16_t port = server_get_port(s);
+	enum { client_count = 5 };
+	struct chat_client *clis[client_count];
+	struct chat_message *msg;
+	char name[128];
+
+	unit_msg("Connect clients");
+	for (int i = 0; i < client_count; ++i) {
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		/* Once the hello is received, the peer is accepted. */
+		unit_fail_if(chat_client_feed(clis[i], "hello\n", 6) != 0);
+		msg = server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_msg("Broadcast a big message");
+	struct test_msg *test_msg = test_msg_new(100 * 1024);
+	unit_fail_if(chat_client_feed(clis[0], test_msg->data,
+				      test_msg->size) != 0);
+	msg = server_pop_next_blocking_from(s, clis[0]);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	bool is_ok = true;
+	for (int i = 1; i < client_count; ++i) {
+		while (strcmp((msg = client_pop_next_blocking(clis[i], s))->data,
+			      "hello") == 0)
+			chat_message_delete(msg);
+		test_msg_check_data(test_msg, msg->data);
+		is_ok = is_ok && author_is_eq(msg, "cli_0");
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "all clients got it");
+	test_msg_delete(test_msg);
+
+	unit_msg("Disconnect a client");
+	chat_client_delete(clis[1]);
+	clis[1] = NULL;
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "feed\n", 5) != 0);
+	is_ok = true;
+	for (int i = 0; i < client_count; ++i) {
+		if (clis[i] == NULL)
+			continue;
+		while (strcmp((msg = client_pop_next_blocking(clis[i], s))->data,
+			      "hello") == 0)
+			chat_message_delete(msg);
+		is_ok = is_ok && strcmp(msg->data, "feed") == 0 &&
+			author_is_eq(msg, "server");
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "feed after a disconnect");
+#endif
+
+	/* Takes the slot of the one gone, with nothing left of it */
+	clis[1] = chat_client_new("cli_new");
+	unit_fail_if(chat_client_connect(clis[1], make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(clis[1], "new\n", 4) != 0);
+	chat_client_update(clis[1], 0);
+	while (strcmp((msg = client_pop_next_blocking(clis[0], s))->data,
+		      "hello") == 0)
+		chat_message_delete(msg);
+	unit_check(strcmp(msg->data, "new") == 0 &&
+		   author_is_eq(msg, "cli_new"), "a new client in a free slot");
+	chat_message_delete(msg);
+	for (int i = 0; i < client_count; ++i) {
+		if (clis[i] != NULL)
+			chat_client_delete(clis[i]);
+	}
+	chat_server_delete(s);
+
+	unit_msg("Threads with io_uring");
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s,
+					     CHAT_SERVER_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	check_threads_broadcast(s);
+	chat_server_delete(s);
+
+	unit_msg("Overflow with io_uring");
+	const int count = 400;
+	int *ids = malloc(sizeof(*ids) * count);
+	struct chat_server_output_stats stats;
+	int got = test_overflow_run(CHAT_SERVER_BACKEND_URING,
+				    CHAT_SERVER_OVERFLOW_DROP_OLDEST,
+				    256 * 1024, 0, count, ids, &stats);
+	unit_check(stats.dropped_messages > 0 && got < count &&
+		   ids[got - 1] == count - 1, "dropped the oldest");
+	got = test_overflow_run(CHAT_SERVER_BACKEND_URING,
+				CHAT_SERVER_OVERFLOW_PAUSE_INPUT, 0,
+				256 * 1024, count, ids, &stats);
+	bool is_ordered = got == count;
+	for (int i = 0; i < got; ++i)
+		is_ordered = is_ordered && ids[i] == i;
+	unit_check(stats.input_pauses > 0 && is_ordered, "paused, nothing lost");
+	free(ids);
+
+	unit_test_finish();
+}
+
+#ifdef CHAT_SERVER_TPOOL
+
+static void
+test_offload_threads(uint32_t thread_count)
+{
+	unit_msg("With %u threads of the loop", thread_count);
+	struct chat_server *s = chat_server_new();
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(2, &pool) != 0);
+	unit_fail_if(chat_server_set_threads(s, thread_count) != 0);
+	unit_fail_if(chat_server_set_compression(s, CHAT_SERVER_COMPRESS_MIN) != 0);
+	unit_fail_if(chat_server_set_offload(s, pool, 4096) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_offload(s, NULL, 0) == CHAT_ERR_ALREADY_STARTED,
+		   "offload is set before listen");
+	uint16_t port = server_get_port(s);
+
+	unit_msg("Connect a sender and a compressing receiver");
+	struct chat_client *clis[2];
+	clis[0] = chat_client_new("sender");
+	clis[1] = chat_client_new("receiver");
+	unit_fail_if(chat_client_set_protocol(clis[1], CHAT_PROTO_BINARY) != 0);
+	unit_fail_if(chat_client_set_compression(clis[1], true) != 0);
+	for (int i = 0; i < 2; ++i)
+		unit_fail_if(chat_client_connect(clis[i], make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(clis[1], "hi\n", 3) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, clis[1]);
+	unit_fail_if(strcmp(msg->data, "hi") != 0);
+	chat_message_delete(msg);
+	/* The sender gets the "hi" */
+	chat_message_delete(clients_pop_next_blocking(clis, 2, 0, s));
+
+	unit_msg("The big ones in the pool, the small ones after them");
+	enum { count = 8 };
+	struct test_msg *big = test_msg_new(100 * 1024);
+	for (int i = 0; i < count; ++i) {
+		if (i % 2 == 0) {
+			test_msg_set_id(big, 0, i);
+			unit_fail_if(chat_client_feed(clis[0], big->data, big->size) != 0);
+		} else {
+			char small[32];
+			int len = sprintf(small, "small %d\n", i);
+			unit_fail_if(chat_client_feed(clis[0], small, len) != 0);
+		}
+	}
+	bool is_ordered = true, is_received = true;
+	for (int i = 0; i < count; ++i) {
+		msg = clients_pop_next_blocking(clis, 2, 1, s);
+		if (i % 2 == 0) {
+			int cli_id, msg_id;
+			chat_message_extract_id(msg, &cli_id, &msg_id);
+			is_ordered = is_ordered && msg_id == i;
+			test_msg_clear_id(big);
+			test_msg_check_data(big, msg->data);
+		} else {
+			char small[32];
+			sprintf(small, "small %d", i);
+			is_ordered = is_ordered && strcmp(msg->data, small) == 0;
+		}
+		chat_message_delete(msg);
+	}
+	unit_check(is_ordered, "the receiver got them in order");
+	for (int i = 0; i < count; ++i) {
+		msg = server_pop_next_blocking_from(s, clis[0]);
+		is_received = is_received && (i % 2 == 0) == (strlen(msg->data) == big->len);
+		chat_message_delete(msg);
+	}
+	unit_check(is_received, "so did the server");
+
+	unit_msg("Delete the server with a message maybe in the pool");
+	test_msg_set_id(big, 0, count);
+	unit_fail_if(chat_client_feed(clis[0], big->data, big->size) != 0);
+	for (int i = 0; i < 3; ++i)
+		chat_server_update(s, 0);
+	test_msg_delete(big);
+	for (int i = 0; i < 2; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+	unit_fail_if(thread_pool_delete(pool) != 0);
+}
+
+#endif
+
+static void
+test_offload(void)
+{
+	unit_test_start();
+
+#ifndef CHAT_SERVER_TPOOL
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_offload(s, NULL, 0) == CHAT_ERR_NOT_IMPLEMENTED,
+		   "not built with the thread pool");
+	chat_server_delete(s);
+#else
+	test_offload_threads(0);
+	test_offload_threads(2);
+#endif
+
+	unit_test_finish();
+}
+
+static void
+test_coro(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+#ifndef CHAT_SERVER_CORO
+	unit_check(chat_server_set_backend(s, CHAT_SERVER_BACKEND_CORO) ==
+		   CHAT_ERR_NOT_IMPLEMENTED, "not built with the coroutines");
+	chat_server_delete(s);
+#else
+	unit_fail_if(chat_server_set_backend(s, CHAT_SERVER_BACKEND_CORO) != 0);
+	unit_fail_if(chat_server_set_threads(s, 2) != 0);
+	unit_check(chat_server_listen(s, 0) == CHAT_ERR_NOT_IMPLEMENTED,
+		   "not with the threads");
+	unit_fail_if(chat_server_set_threads(s, 0) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	enum { client_count = 6 };
+	struct chat_client *clis[client_count];
+	struct chat_message *msg;
+	char name[128];
+
+	unit_msg("Connect clients of both protocols");
+	for (int i = 0; i < client_count; ++i) {
+		sprintf(name, "cli_%d", i);
+		clis[i] = chat_client_new(name);
+		if (i % 2 != 0) {
+			unit_fail_if(chat_client_set_protocol(clis[i],
+				CHAT_PROTO_BINARY) != 0);
+		}
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		unit_fail_if(chat_client_feed(clis[i], "hello\n", 6) != 0);
+		msg = server_pop_next_blocking_from(s, clis[i]);
+		unit_fail_if(strcmp(msg->data, "hello") != 0);
+		chat_message_delete(msg);
+	}
+	unit_msg("Broadcast a big message");
+	struct test_msg *test_msg = test_msg_new(100 * 1024);
+	unit_fail_if(chat_client_feed(clis[1], test_msg->data,
+				      test_msg->size) != 0);
+	msg = server_pop_next_blocking_from(s, clis[1]);
+	test_msg_check_data(test_msg, msg->data);
+	chat_message_delete(msg);
+	bool is_ok = true;
+	for (int i = 0; i < client_count; ++i) {
+		if (i == 1)
+			continue;
+		while (strcmp((msg = client_pop_next_blocking(clis[i], s))->data,
+			      "hello") == 0)
+			chat_message_delete(msg);
+		test_msg_check_data(test_msg, msg->data);
+		is_ok = is_ok && author_is_eq(msg, "cli_1");
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "all clients got it");
+	test_msg_delete(test_msg);
+
+	unit_msg("Disconnect a client");
+	chat_client_delete(clis[2]);
+	clis[2] = chat_client_new("cli_new");
+	unit_fail_if(chat_client_connect(clis[2], make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(clis[2], "new\n", 4) != 0);
+	chat_client_update(clis[2], 0);
+	while (strcmp((msg = client_pop_next_blocking(clis[0], s))->data,
+		      "hello") == 0)
+		chat_message_delete(msg);
+	unit_check(strcmp(msg->data, "new") == 0 &&
+		   author_is_eq(msg, "cli_new"), "a new client in a free slot");
+	chat_message_delete(msg);
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "feed\n", 5) != 0);
+	msg = client_pop_next_blocking(clis[3], s);
+	while (strcmp(msg->data, "feed") != 0) {
+		chat_message_delete(msg);
+		msg = client_pop_next_blocking(clis[3], s);
+	}
+	unit_check(author_is_eq(msg, "server"), "feed");
+	chat_message_delete(msg);
+#endif
+	/* Some are left waiting in their coroutines */
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+
+	unit_msg("Overflow with the coroutines");
+	const int count = 400;
+	int *ids = malloc(sizeof(*ids) * count);
+	struct chat_server_output_stats stats;
+	int got = test_overflow_run(CHAT_SERVER_BACKEND_CORO,
+				    CHAT_SERVER_OVERFLOW_DROP_OLDEST,
+				    256 * 1024, 0, count, ids, &stats);
+	unit_check(stats.dropped_messages > 0 && got < count &&
+		   ids[got - 1] == count - 1, "dropped the oldest");
+	got = test_overflow_run(CHAT_SERVER_BACKEND_CORO,
+				CHAT_SERVER_OVERFLOW_PAUSE_INPUT, 0,
+				256 * 1024, count, ids, &stats);
+	bool is_ordered = got == count;
+	for (int i = 0; i < got; ++i)
+		is_ordered = is_ordered && ids[i] == i;
+	unit_check(stats.input_pauses > 0 && is_ordered, "paused, nothing lost");
+	free(ids);
+#endif
+
+	unit_test_finish();
+}
+
+static void
+test_local(void)
+{
+	unit_test_start();
+
+	char path[64];
+	sprintf(path, "/tmp/chat_test_%d.sock", (int)getpid());
+	struct chat_server *s = chat_server_new();
+	unit_check(chat_server_set_local_path(s, "") ==
+		   CHAT_ERR_INVALID_ARGUMENT, "empty path");
+	unit_fail_if(chat_server_set_local_path(s, path) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_local_path(s, NULL) ==
+		   CHAT_ERR_ALREADY_STARTED, "path before listen");
+	uint16_t port = server_get_port(s);
+
+	unit_msg("Connect over TCP and locally, of both protocols");
+	enum { client_count = 3 };
+	const char *names[client_count] = {"tcp", "local", "bin"};
+	struct chat_client *clis[client_count];
+	for (int i = 0; i < client_count; ++i)
+		clis[i] = chat_client_new(names[i]);
+	unit_fail_if(chat_client_connect(clis[0], make_addr_str(port)) != 0);
+	unit_check(chat_client_connect_local(clis[1], path) == 0,
+		   "connect locally");
+	unit_check(chat_client_connect_local(clis[1], path) ==
+		   CHAT_ERR_ALREADY_STARTED, "connect locally twice");
+	unit_fail_if(chat_client_set_protocol(clis[2], CHAT_PROTO_BINARY) != 0);
+	unit_fail_if(chat_client_connect_local(clis[2], path) != 0);
+	unit_check(chat_client_get_events(clis[1]) == CHAT_EVENT_INPUT,
+		   "local client needs only input");
+
+	unit_msg("Messages all ways");
+	char buf[64];
+	for (int i = 0; i < client_count; ++i) {
+		int len = sprintf(buf, "from %s\n", names[i]);
+		unit_fail_if(chat_client_feed(clis[i], buf, len) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < client_count; ++i) {
+		for (int j = 0; j < client_count - 1; ++j) {
+			struct chat_message *msg =
+				clients_pop_next_blocking(clis, client_count, i, s);
+			const char *from = msg->data + 5;
+			ok = ok && strncmp(msg->data, "from ", 5) == 0 &&
+			     strcmp(from, names[i]) != 0 && author_is_eq(msg, from);
+			chat_message_delete(msg);
+		}
+	}
+	unit_check(ok, "each got the other two");
+
+	unit_msg("Bigger than the rings");
+	struct test_msg *big = test_msg_new(1024 * 1024);
+	unit_fail_if(chat_client_feed(clis[1], big->data, big->size) != 0);
+	for (int i = 0; i < client_count; i += 2) {
+		struct chat_message *msg =
+			clients_pop_next_blocking(clis, client_count, i, s);
+		test_msg_check_data(big, msg->data);
+		unit_fail_if(!author_is_eq(msg, "local"));
+		chat_message_delete(msg);
+	}
+	unit_check(true, "from a local one to both");
+	unit_fail_if(chat_client_feed(clis[0], big->data, big->size) != 0);
+	for (int i = 1; i < client_count; ++i) {
+		struct chat_message *msg =
+			clients_pop_next_blocking(clis, client_count, i, s);
+		test_msg_check_data(big, msg->data);
+		unit_fail_if(!author_is_eq(msg, "tcp"));
+		chat_message_delete(msg);
+	}
+	unit_check(true, "to both local ones");
+	test_msg_delete(big);
+
+#if NEED_SERVER_FEED
+	unit_fail_if(chat_server_feed(s, "feed\n", 5) != 0);
+	for (int i = 0; i < client_count; ++i) {
+		struct chat_message *msg =
+			clients_pop_next_blocking(clis, client_count, i, s);
+		ok = ok && message_is_eq(msg, "server", "feed");
+	}
+	unit_check(ok, "server feed gets to all");
+#endif
+
+	unit_msg("A local client in a group");
+	struct chat_client_group *g = chat_client_group_new();
+	unit_fail_if(chat_client_group_add(g, clis[2]) != 0);
+	unit_fail_if(chat_client_feed(clis[2], "grouped\n", 8) != 0);
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(clis[0])) == NULL) {
+		chat_client_group_update(g, 0);
+		chat_client_update(clis[0], 0);
+		chat_client_update(clis[1], 0);
+		chat_server_update(s, 0);
+	}
+	unit_check(message_is_eq(msg, "bin", "grouped"), "sent by the group");
+	unit_fail_if(chat_client_feed(clis[0], "to group\n", 9) != 0);
+	msg = NULL;
+	while (msg == NULL) {
+		chat_client_group_update(g, 0);
+		chat_client_update(clis[0], 0);
+		chat_client_update(clis[1], 0);
+		chat_server_update(s, 0);
+		int err;
+		struct chat_client *ready;
+		while ((ready = chat_client_group_next_ready(g, &err)) != NULL) {
+			unit_fail_if(ready != clis[2] || err != 0);
+			msg = chat_client_pop_next(ready);
+		}
+	}
+	unit_check(message_is_eq(msg, "tcp", "to group"), "received by the group");
+	chat_client_group_delete(g);
+
+	unit_msg("Reconnect locally");
+	chat_client_delete(clis[1]);
+	clis[1] = chat_client_new("again");
+	unit_fail_if(chat_client_connect_local(clis[1], path) != 0);
+	unit_fail_if(chat_client_feed(clis[1], "back\n", 5) != 0);
+	msg = clients_pop_next_blocking(clis, client_count, 0, s);
+	unit_check(message_is_eq(msg, "again", "back"), "a new local client");
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+
+	unit_msg("Gone with the server");
+	struct chat_client *c = chat_client_new("late");
+	unit_check(chat_client_connect_local(c, path) == CHAT_ERR_SYS &&
+		   errno == ENOENT, "socket file is removed");
+	chat_client_delete(c);
+	s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s, CHAT_SERVER_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_set_local_path(s, path) != 0);
+	unit_check(chat_server_listen(s, 0) == CHAT_ERR_NOT_IMPLEMENTED,
+		   "not with io_uring");
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
 static void
 test_stress(void)
 {
@@ -550,10 +2738,30 @@ main(void)
 {
 	unit_test_start();
 
+	test_partial_message_queue();
+	test_shared_buffer_queue();
+	test_spsc_ring();
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
+	test_coalescing();
+	test_binary();
+	test_compression();
+	test_rooms();
+	test_history();
+	test_cluster();
+	test_handoff();
+	test_overflow();
+	test_stats();
+	test_busy_poll();
 	test_multi_client();
+	test_event_batch();
+	test_client_group();
+	test_threads();
+	test_uring();
+	test_coro();
+	test_offload();
+	test_local();
 	test_stress();
 
 	unit_test_finish();
@@ -0,0 +1,219 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags, const void *arg, size_t arg_size) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, arg_size);
+}
+
+static int uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * entries;
+	ring->fd = uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		/* Too old for a timed wait, and so for the rest */
+		(void)close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	if (ring->sq_ring == MAP_FAILED)
+		goto error;
+	if (ring->cq_ring_size == 0) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto error;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto error;
+
+	char *sq = ring->sq_ring, *cq = ring->cq_ring;
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sqe_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	/* The SQEs are used in order, so the index array is the identity */
+	for (unsigned i = 0; i < p.sq_entries; ++i)
+		ring->sq_array[i] = i;
+	return 0;
+
+error:;
+	int save_errno = errno;
+	uring_destroy(ring);
+	errno = save_errno;
+	return -1;
+}
+
+void uring_destroy(struct uring *ring) {
+	if (ring->sqes != MAP_FAILED)
+		(void)munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		(void)munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED)
+		(void)munmap(ring->sq_ring, ring->sq_ring_size);
+	(void)close(ring->fd);
+}
+
+/// Publishes the SQEs taken so far to the kernel.
+static unsigned uring_flush(struct uring *ring) {
+	unsigned tail = *ring->sq_tail;
+	unsigned count = ring->sqe_tail - tail;
+	if (count != 0)
+		__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	return count;
+}
+
+int uring_submit(struct uring *ring) {
+	unsigned count = uring_flush(ring);
+	while (count != 0) {
+		int rc = uring_enter(ring->fd, count, 0, 0, NULL, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			/* EAGAIN and EBUSY: the kernel takes them on the next enter */
+			return errno == EAGAIN || errno == EBUSY ? 0 : -1;
+		}
+		count -= rc;
+	}
+	return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	while (ring->sqe_tail - head > ring->sq_mask) {
+		(void)uring_submit(ring);
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	++ring->sqe_tail;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_wait(struct uring *ring, int timeout_ms) {
+	if (uring_peek_cqe(ring))
+		return uring_submit(ring);
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (long long)(timeout_ms % 1000) * 1000000,
+	};
+	struct io_uring_getevents_arg arg = {
+		.sigmask = 0,
+		.sigmask_sz = 0,
+		.pad = 0,
+		.ts = timeout_ms < 0 ? 0 : (uint64_t)(uintptr_t)&ts,
+	};
+	unsigned count = uring_flush(ring);
+	int rc;
+	while ((rc = uring_enter(ring->fd, count, 1,
+				 IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				 &arg, sizeof(arg))) < 0 && errno == EINTR) {
+		/* Whatever was submitted is in the queue already */
+		count = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+	if (uring_peek_cqe(ring))
+		return 0;
+	if (rc >= 0)
+		errno = ETIME;
+	return -1;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+			uint16_t bgid, unsigned entries, size_t buf_size) {
+	br->entries = entries;
+	br->buf_size = buf_size;
+	br->bgid = bgid;
+	size_t ring_size = entries * sizeof(struct io_uring_buf);
+	br->map_size = ring_size + entries * buf_size;
+	void *mem = mmap(NULL, br->map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	br->br = mem;
+	br->bufs = (char *)mem + ring_size;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)br->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		int save_errno = errno;
+		(void)munmap(mem, br->map_size);
+		errno = save_errno;
+		return -1;
+	}
+	br->br->tail = 0;
+	for (unsigned i = 0; i < entries; ++i)
+		uring_buf_ring_recycle(br, i);
+	return 0;
+}
+
+void uring_buf_ring_destroy(struct uring *ring, struct uring_buf_ring *br) {
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = br->bgid;
+	(void)uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	(void)munmap(br->br, br->map_size);
+}
+
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid) {
+	uint16_t tail = br->br->tail;
+	struct io_uring_buf *buf = &br->br->bufs[tail & (br->entries - 1)];
+	buf->addr = (uint64_t)(uintptr_t)uring_buf_ring_data(br, bid);
+	buf->len = br->buf_size;
+	buf->bid = bid;
+	__atomic_store_n(&br->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The least of io_uring the chat server needs, on the raw system calls:
+ * the rings mapped from the kernel, getting and submitting SQEs, waiting
+ * for CQEs with a timeout, and a ring of buffers provided to the kernel
+ * for receiving.
+ */
+struct uring {
+	int fd;
+	/// Submission queue: shared head, tail and index array, and the SQEs
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	struct io_uring_sqe *sqes;
+	/// SQEs taken but not yet in the shared tail
+	unsigned sqe_tail;
+	/// Completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+/**
+ * Create a ring of @a entries SQEs and 4x as many CQEs.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error in errno, such as ENOSYS when the kernel has no
+ *     io_uring, or EPERM when it is disabled.
+ */
+int uring_init(struct uring *ring, unsigned entries);
+
+void uring_destroy(struct uring *ring);
+
+/// Returns a zeroed SQE to fill, submitting the queued ones if it is full.
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/// Submits the queued SQEs. Returns 0 or -1 with errno.
+int uring_submit(struct uring *ring);
+
+/**
+ * Submits the queued SQEs and waits up to @a timeout_ms, or for ever if it
+ * is negative, for at least one CQE.
+ *
+ * @retval 0 There are CQEs.
+ * @retval -1 Error in errno, ETIME on the timeout.
+ */
+int uring_wait(struct uring *ring, int timeout_ms);
+
+/// Returns the next CQE or NULL. Must be marked seen before the next one.
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+/**
+ * Buffers provided to the kernel, which picks one for each receive with
+ * IOSQE_BUFFER_SELECT and tells which in the CQE flags.
+ */
+struct uring_buf_ring {
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	unsigned entries;
+	size_t buf_size;
+	uint16_t bgid;
+	size_t map_size;
+};
+
+/**
+ * Register @a entries, a power of two, buffers of @a buf_size bytes as
+ * the group @a bgid. Returns 0 or -1 with errno.
+ */
+int uring_buf_ring_init(struct uring *ring, struct uring_buf_ring *br,
+			uint16_t bgid, unsigned entries, size_t buf_size);
+
+void uring_buf_ring_destroy(struct uring *ring, struct uring_buf_ring *br);
+
+static inline char *uring_buf_ring_data(const struct uring_buf_ring *br, uint16_t bid) {
+	return br->bufs + (size_t)bid * br->buf_size;
+}
+
+/// Gives the buffer @a bid back to the kernel once its data is taken.
+void uring_buf_ring_recycle(struct uring_buf_ring *br, uint16_t bid);
@@ -0,0 +1,602 @@
+#include "bench.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The benchmarks of task_eng.txt, each through bench_loop(): the time per
+ * operation as min/median/max of the runs.
+ *
+ * clock: a clock_gettime() of CLOCK_REALTIME, CLOCK_MONOTONIC and
+ * CLOCK_MONOTONIC_RAW.
+ *
+ * socket: send() of packs of 100 B, 1 KB, 16 KB and 48 KB from a thread,
+ * recv() of them in 16 KB or the pack size, what is larger, over a
+ * non-blocking pair of a UNIX and of a TCP socket made by accept(). Also
+ * reported in GB/s.
+ *
+ * mutex: a pthread_mutex_lock() + unlock() with an atomic increment of a
+ * counter inside, in 1 to T threads at once.
+ *
+ * create_join: a pthread_create() + pthread_join() of an empty thread.
+ *
+ * atomic: an atomic increment of one counter in 1 to T threads at once,
+ * relaxed and sequentially consistent.
+ *
+ * condvar: a pthread_cond_signal() and a pthread_cond_broadcast() under
+ * the mutex, with 1 to T threads waiting.
+ *
+ * false_sharing: an increment of a counter of its own in 1 to T threads at
+ * once, the counters next to each other and 64 bytes apart.
+ *
+ * The operations of a multi-threaded run are split between its threads,
+ * the time is of all of them, so per operation it is the throughput. But
+ * for false_sharing, where each thread does them all.
+ *
+ * Usage: ./bench [--runs R] [--ops N] [--threads T] [--total BYTES]
+ * [--pack BYTES] [--cpu C] [--counters] [--json FILE] [name ...]. By
+ * default the ops of a run are scaled for it to take BENCH_RUN_TIME; --ops
+ * sets them, as --total does for the sockets. --pack is one pack size
+ * instead of the four. --cpu pins the single-threaded ones, --counters
+ * adds the cycles and such where perf_event_open() is allowed. The names
+ * are of the benchmarks to run, all by default.
+ */
+
+enum {
+	BENCH_RUNS_DEFAULT = 5,
+	BENCH_THREADS_DEFAULT = 3,
+	BENCH_MAX_THREADS = 64,
+	BENCH_RECV_SIZE = 16 * 1024,
+	BENCH_MAX_PACK = 1024 * 1024,
+	/** 8 * sizeof(uint64_t) is a cache line. */
+	BENCH_FS_STRIDE = 8,
+};
+
+static const double BENCH_RUN_TIME = 0.2;
+static const double BENCH_WARMUP_TIME = 0.1;
+
+static struct bench_config bench_cfg;
+static int bench_threads = BENCH_THREADS_DEFAULT;
+static long bench_total = 0;
+static int bench_pack = 0;
+static FILE *bench_json_file = NULL;
+static const char *bench_json_sep = "";
+
+static void
+bench_fail(const char *what)
+{
+	printf("Error: %s failed: %s\n", what, strerror(errno));
+	exit(-1);
+}
+
+/** Runs @a f, prints the result and adds it to the JSON. */
+static void
+bench_report(const char *name, bench_f f, void *arg,
+	     const struct bench_config *cfg, struct bench_stats *stats)
+{
+	bench_loop(name, f, arg, cfg, stats);
+	bench_print(stats);
+	if (bench_json_file == NULL)
+		return;
+	fprintf(bench_json_file, "%s\n  ", bench_json_sep);
+	bench_json(bench_json_file, stats);
+	bench_json_sep = ",";
+}
+
+/** The threads of a run, each with @a f and its part of the ops. */
+struct bench_group {
+	void *(*f)(void *);
+	long ops;
+	int index;
+	pthread_t tid;
+};
+
+static void
+bench_group_run(void *(*f)(void *), long ops, int threads)
+{
+	struct bench_group group[BENCH_MAX_THREADS];
+	for (int i = 0; i < threads; ++i) {
+		group[i].f = f;
+		group[i].ops = ops / threads + (i < ops % threads);
+		group[i].index = i;
+		if (pthread_create(&group[i].tid, NULL, f, &group[i]) != 0)
+			bench_fail("pthread_create");
+	}
+	for (int i = 0; i < threads; ++i)
+		pthread_join(group[i].tid, NULL);
+}
+
+/* (1) Clock */
+
+static void
+bench_clock_f(long ops, void *arg)
+{
+	clockid_t id = *(clockid_t *)arg;
+	struct timespec ts;
+	for (long i = 0; i < ops; ++i)
+		clock_gettime(id, &ts);
+}
+
+static void
+bench_clock(void)
+{
+	static const struct {
+		clockid_t id;
+		const char *name;
+	} clocks[] = {
+		{CLOCK_REALTIME, "clock/realtime"},
+		{CLOCK_MONOTONIC, "clock/monotonic"},
+		{CLOCK_MONOTONIC_RAW, "clock/monotonic_raw"},
+	};
+	struct bench_stats stats;
+	for (size_t i = 0; i < sizeof(clocks) / sizeof(*clocks); ++i) {
+		clockid_t id = clocks[i].id;
+		bench_report(clocks[i].name, bench_clock_f, &id, &bench_cfg,
+			     &stats);
+	}
+}
+
+/* (2) Socket throughput */
+
+struct bench_socket {
+	int client;
+	int server;
+	size_t pack;
+	long ops;
+	char *buf;
+};
+
+static void
+bench_socket_nonblock(int fd)
+{
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0)
+		bench_fail("fcntl");
+}
+
+static void
+bench_socket_wait(int fd, short events)
+{
+	struct pollfd pfd = {.fd = fd, .events = events};
+	if (poll(&pfd, 1, -1) < 0)
+		bench_fail("poll");
+}
+
+/**
+ * A connected pair of the @a family, by socket() + bind() + listen(),
+ * connect() and accept(), both non-blocking.
+ */
+static void
+bench_socket_pair(int family, int *client, int *server)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		snprintf(un->sun_path, sizeof(un->sun_path), "/tmp/bench_%d",
+			 (int)getpid());
+		unlink(un->sun_path);
+		len = sizeof(*un);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*in);
+	}
+	int listener = socket(family, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&addr, len) != 0 ||
+	    listen(listener, 1) != 0 ||
+	    getsockname(listener, (struct sockaddr *)&addr, &len) != 0)
+		bench_fail("listen");
+	*client = socket(family, SOCK_STREAM, 0);
+	if (*client < 0 || connect(*client, (struct sockaddr *)&addr, len) != 0)
+		bench_fail("connect");
+	*server = accept(listener, NULL, NULL);
+	if (*server < 0)
+		bench_fail("accept");
+	close(listener);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	bench_socket_nonblock(*client);
+	bench_socket_nonblock(*server);
+}
+
+static void *
+bench_socket_send_f(void *arg)
+{
+	struct bench_socket *s = arg;
+	for (long i = 0; i < s->ops; ++i) {
+		/* send() might send less than it was given. */
+		for (size_t done = 0; done < s->pack;) {
+			ssize_t rc = send(s->client, s->buf + done,
+					  s->pack - done, MSG_NOSIGNAL);
+			if (rc > 0)
+				done += rc;
+			else if (rc < 0 && errno == EAGAIN)
+				bench_socket_wait(s->client, POLLOUT);
+			else
+				bench_fail("send");
+		}
+	}
+	return NULL;
+}
+
+static void
+bench_socket_f(long ops, void *arg)
+{
+	struct bench_socket *s = arg;
+	s->ops = ops;
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, bench_socket_send_f, s) != 0)
+		bench_fail("pthread_create");
+	size_t size = s->pack > BENCH_RECV_SIZE ? s->pack : BENCH_RECV_SIZE;
+	char *buf = malloc(size);
+	for (size_t left = s->pack * ops; left > 0;) {
+		ssize_t rc = recv(s->server, buf,
+				  left < size ? left : size, 0);
+		if (rc > 0)
+			left -= rc;
+		else if (rc < 0 && errno == EAGAIN)
+			bench_socket_wait(s->server, POLLIN);
+		else
+			bench_fail("recv");
+	}
+	free(buf);
+	pthread_join(tid, NULL);
+}
+
+static void
+bench_socket(void)
+{
+	static const int packs[] = {100, 1024, 16 * 1024, 48 * 1024};
+	static const struct {
+		int family;
+		const char *name;
+	} families[] = {{AF_UNIX, "unix"}, {AF_INET, "tcp"}};
+	struct bench_socket s;
+	s.buf = calloc(1, BENCH_MAX_PACK);
+	for (size_t k = 0; k < sizeof(families) / sizeof(*families); ++k) {
+		bench_socket_pair(families[k].family, &s.client, &s.server);
+		for (size_t i = 0; i < sizeof(packs) / sizeof(*packs); ++i) {
+			if (bench_pack != 0 && i > 0)
+				break;
+			s.pack = bench_pack != 0 ? bench_pack : packs[i];
+			struct bench_config cfg = bench_cfg;
+			if (bench_total != 0)
+				cfg.iterations = (bench_total + s.pack - 1) /
+						 s.pack;
+			char name[64];
+			snprintf(name, sizeof(name), "socket/%s/%zu",
+				 families[k].name, s.pack);
+			struct bench_stats stats;
+			bench_report(name, bench_socket_f, &s, &cfg, &stats);
+			printf("%32s %12.2f GB/s\n", "", s.pack /
+			       bench_median(stats.ns_per_op, stats.runs));
+		}
+		close(s.client);
+		close(s.server);
+	}
+	free(s.buf);
+}
+
+/* (3) Pthread mutex lock */
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t bench_counter;
+
+static void *
+bench_mutex_thread_f(void *arg)
+{
+	struct bench_group *g = arg;
+	for (long i = 0; i < g->ops; ++i) {
+		pthread_mutex_lock(&bench_lock);
+		__atomic_add_fetch(&bench_counter, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&bench_lock);
+	}
+	return NULL;
+}
+
+static void
+bench_mutex_f(long ops, void *arg)
+{
+	bench_group_run(bench_mutex_thread_f, ops, *(int *)arg);
+}
+
+/* (4) Pthread create + join */
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_create_join_f(long ops, void *arg)
+{
+	(void)arg;
+	for (long i = 0; i < ops; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, bench_empty_f, NULL) != 0)
+			bench_fail("pthread_create");
+		pthread_join(tid, NULL);
+	}
+}
+
+/* (5) Atomic increment */
+
+static void *
+bench_atomic_relaxed_f(void *arg)
+{
+	struct bench_group *g = arg;
+	for (long i = 0; i < g->ops; ++i)
+		__atomic_add_fetch(&bench_counter, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static void *
+bench_atomic_seq_cst_f(void *arg)
+{
+	struct bench_group *g = arg;
+	for (long i = 0; i < g->ops; ++i)
+		__atomic_add_fetch(&bench_counter, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void
+bench_atomic_relaxed(long ops, void *arg)
+{
+	bench_group_run(bench_atomic_relaxed_f, ops, *(int *)arg);
+}
+
+static void
+bench_atomic_seq_cst(long ops, void *arg)
+{
+	bench_group_run(bench_atomic_seq_cst_f, ops, *(int *)arg);
+}
+
+/* (6) Pthread cond signaling */
+
+struct bench_cond {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool is_broadcast;
+	bool is_stopped;
+	int waiters;
+};
+
+static void *
+bench_cond_wait_f(void *arg)
+{
+	struct bench_cond *c = arg;
+	pthread_mutex_lock(&c->mutex);
+	while (!c->is_stopped)
+		pthread_cond_wait(&c->cond, &c->mutex);
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
+}
+
+static void
+bench_cond_f(long ops, void *arg)
+{
+	struct bench_cond *c = arg;
+	pthread_t tids[BENCH_MAX_THREADS];
+	c->is_stopped = false;
+	for (int i = 0; i < c->waiters; ++i) {
+		if (pthread_create(&tids[i], NULL, bench_cond_wait_f, c) != 0)
+			bench_fail("pthread_create");
+	}
+	for (long i = 0; i < ops; ++i) {
+		pthread_mutex_lock(&c->mutex);
+		if (c->is_broadcast)
+			pthread_cond_broadcast(&c->cond);
+		else
+			pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->mutex);
+	}
+	pthread_mutex_lock(&c->mutex);
+	c->is_stopped = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->mutex);
+	for (int i = 0; i < c->waiters; ++i)
+		pthread_join(tids[i], NULL);
+}
+
+/* (7) False sharing */
+
+static uint64_t bench_fs_counters[BENCH_MAX_THREADS * BENCH_FS_STRIDE];
+static int bench_fs_stride;
+/** Read in the loops, for them not to become one +=. */
+static volatile bool bench_fs_stop = false;
+
+static void *
+bench_fs_thread_f(void *arg)
+{
+	struct bench_group *g = arg;
+	uint64_t *counter = &bench_fs_counters[g->index * bench_fs_stride];
+	for (long i = 0; i < g->ops && !bench_fs_stop; ++i)
+		++*counter;
+	return NULL;
+}
+
+static void
+bench_fs_f(long ops, void *arg)
+{
+	int threads = *(int *)arg;
+	/* Each thread increments its own number to ops / threads. */
+	bench_group_run(bench_fs_thread_f, ops * threads, threads);
+}
+
+/* Multi-threaded ones, for 1 to bench_threads threads */
+
+static void
+bench_threaded(const char *name, bench_f f, void *arg, int *threads)
+{
+	struct bench_config cfg = bench_cfg;
+	/* Pinned, all the threads would be on the one CPU. */
+	cfg.cpu = -1;
+	struct bench_stats stats;
+	for (*threads = 1; *threads <= bench_threads; ++*threads) {
+		char full[64];
+		snprintf(full, sizeof(full), "%s/%d", name, *threads);
+		bench_report(full, f, arg, &cfg, &stats);
+	}
+}
+
+static void
+bench_mutex(void)
+{
+	int threads;
+	bench_threaded("mutex", bench_mutex_f, &threads, &threads);
+}
+
+static void
+bench_create_join(void)
+{
+	struct bench_stats stats;
+	bench_report("create_join", bench_create_join_f, NULL, &bench_cfg,
+		     &stats);
+}
+
+static void
+bench_atomic(void)
+{
+	int threads;
+	bench_threaded("atomic/relaxed", bench_atomic_relaxed, &threads,
+		       &threads);
+	bench_threaded("atomic/seq_cst", bench_atomic_seq_cst, &threads,
+		       &threads);
+}
+
+static void
+bench_cond_of(const char *name, bool is_broadcast)
+{
+	struct bench_cond c;
+	pthread_mutex_init(&c.mutex, NULL);
+	pthread_cond_init(&c.cond, NULL);
+	c.is_broadcast = is_broadcast;
+	bench_threaded(name, bench_cond_f, &c, &c.waiters);
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.mutex);
+}
+
+static void
+bench_cond(void)
+{
+	bench_cond_of("condvar/signal", false);
+	bench_cond_of("condvar/broadcast", true);
+}
+
+static void
+bench_false_sharing(void)
+{
+	int threads;
+	bench_fs_stride = 1;
+	bench_threaded("false_sharing/close", bench_fs_f, &threads, &threads);
+	bench_fs_stride = BENCH_FS_STRIDE;
+	bench_threaded("false_sharing/distant", bench_fs_f, &threads,
+		       &threads);
+}
+
+static const struct {
+	const char *name;
+	void (*f)(void);
+} benches[] = {
+	{"clock", bench_clock},
+	{"socket", bench_socket},
+	{"mutex", bench_mutex},
+	{"create_join", bench_create_join},
+	{"atomic", bench_atomic},
+	{"condvar", bench_cond},
+	{"false_sharing", bench_false_sharing},
+};
+
+static void
+bench_usage(void)
+{
+	printf("Usage: ./bench [--runs R] [--ops N] [--threads T] "
+	       "[--total BYTES] [--pack BYTES] [--cpu C] [--counters] "
+	       "[--json FILE] [name ...]\n");
+	exit(-1);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_config_default(&bench_cfg);
+	bench_cfg.runs = BENCH_RUNS_DEFAULT;
+	bench_cfg.run_time = BENCH_RUN_TIME;
+	bench_cfg.warmup_time = BENCH_WARMUP_TIME;
+	const char *json_path = NULL;
+	int i = 1;
+	for (; i < argc && strncmp(argv[i], "--", 2) == 0; ++i) {
+		if (strcmp(argv[i], "--counters") == 0) {
+			bench_cfg.counters = true;
+			continue;
+		}
+		if (i + 1 == argc)
+			bench_usage();
+		const char *value = argv[++i];
+		if (strcmp(argv[i - 1], "--runs") == 0)
+			bench_cfg.runs = atoi(value);
+		else if (strcmp(argv[i - 1], "--ops") == 0)
+			bench_cfg.iterations = atol(value);
+		else if (strcmp(argv[i - 1], "--threads") == 0)
+			bench_threads = atoi(value);
+		else if (strcmp(argv[i - 1], "--total") == 0)
+			bench_total = atol(value);
+		else if (strcmp(argv[i - 1], "--pack") == 0)
+			bench_pack = atoi(value);
+		else if (strcmp(argv[i - 1], "--cpu") == 0)
+			bench_cfg.cpu = atoi(value);
+		else if (strcmp(argv[i - 1], "--json") == 0)
+			json_path = value;
+		else
+			bench_usage();
+	}
+	if (bench_cfg.runs < 1 || bench_cfg.runs > BENCH_MAX_RUNS ||
+	    bench_threads < 1 || bench_threads > BENCH_MAX_THREADS ||
+	    bench_pack < 0 || bench_pack > BENCH_MAX_PACK || bench_total < 0)
+		bench_usage();
+	size_t count = sizeof(benches) / sizeof(*benches);
+	for (int j = i; j < argc; ++j) {
+		size_t k = 0;
+		while (k < count && strcmp(argv[j], benches[k].name) != 0)
+			++k;
+		if (k == count) {
+			printf("Unknown benchmark %s\n", argv[j]);
+			bench_usage();
+		}
+	}
+	if (json_path != NULL) {
+		bench_json_file = fopen(json_path, "w");
+		if (bench_json_file == NULL)
+			bench_fail("fopen");
+		fprintf(bench_json_file, "{\"runs\": %d, \"threads\": %d, "
+			"\"results\": [", bench_cfg.runs, bench_threads);
+	}
+	printf("%-32s %12s %12s %12s\n", "", "min", "median", "max");
+	for (size_t k = 0; k < count; ++k) {
+		bool is_wanted = i == argc;
+		for (int j = i; j < argc && !is_wanted; ++j)
+			is_wanted = strcmp(argv[j], benches[k].name) == 0;
+		if (is_wanted)
+			benches[k].f();
+	}
+	if (bench_json_file != NULL) {
+		fprintf(bench_json_file, "\n]}\n");
+		fclose(bench_json_file);
+	}
+	return 0;
+}
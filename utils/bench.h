@@ -0,0 +1,357 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * What the benchmarks of the tasks share, after bonus/task_eng.txt: the
+ * time by CLOCK_MONOTONIC, a loop run several times with the min, median
+ * and max of the runs, and the JSON of them to compare between the
+ * commits.
+ *
+ * bench_loop() does it all for a function of N iterations: warms it up
+ * while finding N for a run to take about bench_config.run_time, then
+ * times the runs, optionally on a CPU of its own and with the hardware
+ * counters of perf_event_open(). The benchmarks timing something else,
+ * like the latency of each operation, take the parts they need.
+ */
+
+enum {
+	BENCH_MAX_RUNS = 100,
+	/** Most iterations bench_loop() gives a run. */
+	BENCH_MAX_ITERATIONS = 1 << 30,
+};
+
+enum bench_counter {
+	BENCH_CYCLES,
+	BENCH_INSTRUCTIONS,
+	BENCH_CACHE_MISSES,
+	BENCH_COUNTER_COUNT,
+};
+
+static const char *const bench_counter_names[BENCH_COUNTER_COUNT] = {
+	"cycles", "instructions", "cache_misses",
+};
+
+/** perf_event_open() counters of the thread, -1 for the ones not there. */
+struct bench_counters {
+	int fds[BENCH_COUNTER_COUNT];
+};
+
+struct bench_config {
+	/** Timed runs, at most BENCH_MAX_RUNS. */
+	int runs;
+	/** Seconds a run is to take, the iterations are scaled to it. */
+	double run_time;
+	/** Iterations of a run instead, if not 0. */
+	long iterations;
+	/** Seconds the function runs before the timed runs. */
+	double warmup_time;
+	/** CPU to run on, or -1 for any. */
+	int cpu;
+	/** Count the cycles and the rest, where perf_event_open() allows. */
+	bool counters;
+};
+
+/** What bench_loop() has found, the per-run values are sorted. */
+struct bench_stats {
+	const char *name;
+	long iterations;
+	int runs;
+	double ns_per_op[BENCH_MAX_RUNS];
+	/** Of the run with the median time, -1 if not counted. */
+	double per_op[BENCH_COUNTER_COUNT];
+};
+
+/** Runs the thing timed @a iterations times. */
+typedef void (*bench_f)(long iterations, void *arg);
+
+static inline double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int
+bench_double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/** Sort @a values, they are the min, median and max then. */
+static inline void
+bench_sort(double *values, size_t count)
+{
+	qsort(values, count, sizeof(*values), bench_double_cmp);
+}
+
+static inline double
+bench_median(const double *sorted, size_t count)
+{
+	return count % 2 != 0 ? sorted[count / 2] :
+	       (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+static inline double
+bench_percentile(const double *sorted, size_t count, double p)
+{
+	return sorted[(size_t)(p * (count - 1))];
+}
+
+static inline void
+bench_json_stat(FILE *f, const char *name, const double *sorted, size_t count)
+{
+	fprintf(f, "\"%s\": {\"min\": %.3f, \"median\": %.3f, \"max\": %.3f}",
+		name, sorted[0], bench_median(sorted, count),
+		sorted[count - 1]);
+}
+
+static inline void
+bench_json_percentiles(FILE *f, const char *name, const double *sorted,
+		       size_t count)
+{
+	fprintf(f, "\"%s\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, "
+		"\"p999\": %.0f, \"max\": %.0f}", name,
+		bench_percentile(sorted, count, 0.5),
+		bench_percentile(sorted, count, 0.9),
+		bench_percentile(sorted, count, 0.99),
+		bench_percentile(sorted, count, 0.999), sorted[count - 1]);
+}
+
+/**
+ * Moves the calling thread to @a cpu. Returns 0, or -1 with errno, also
+ * where it can't be done.
+ */
+static inline int
+bench_pin_cpu(int cpu)
+{
+#ifdef __linux__
+	unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+	const int bits = 8 * sizeof(*mask);
+	if (cpu < 0 || cpu >= (int)sizeof(mask) * 8) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[cpu / bits] = 1UL << (cpu % bits);
+	return syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) == 0 ?
+	       0 : -1;
+#else
+	(void)cpu;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/**
+ * Opens the counters of the calling thread, stopped. Returns how many of
+ * them could be: none in a container or with perf_event_paranoid high.
+ */
+static inline int
+bench_counters_open(struct bench_counters *c)
+{
+	int count = 0;
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		c->fds[i] = -1;
+#ifdef __linux__
+		static const uint64_t configs[BENCH_COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+		};
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		c->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (c->fds[i] >= 0)
+			++count;
+#endif
+	}
+	return count;
+}
+
+static inline void
+bench_counters_close(struct bench_counters *c)
+{
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		if (c->fds[i] >= 0)
+			close(c->fds[i]);
+		c->fds[i] = -1;
+	}
+}
+
+/** Zeroes and starts the counters. */
+static inline void
+bench_counters_start(struct bench_counters *c)
+{
+#ifdef __linux__
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		if (c->fds[i] < 0)
+			continue;
+		ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#else
+	(void)c;
+#endif
+}
+
+/** Stops the counters, and reads them to @a values, -1 for the missing. */
+static inline void
+bench_counters_stop(struct bench_counters *c, double *values)
+{
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		values[i] = -1;
+#ifdef __linux__
+		uint64_t value;
+		if (c->fds[i] < 0)
+			continue;
+		ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(c->fds[i], &value, sizeof(value)) == sizeof(value))
+			values[i] = value;
+#endif
+	}
+}
+
+static inline void
+bench_config_default(struct bench_config *cfg)
+{
+	cfg->runs = 5;
+	cfg->run_time = 0.2;
+	cfg->iterations = 0;
+	cfg->warmup_time = 0.1;
+	cfg->cpu = -1;
+	cfg->counters = false;
+}
+
+/**
+ * Times @a f in @a cfg->runs runs to @a stats. The iterations of a run are
+ * the same for all of them, found during the warmup.
+ */
+static inline void
+bench_loop(const char *name, bench_f f, void *arg,
+	   const struct bench_config *cfg, struct bench_stats *stats)
+{
+	if (cfg->cpu >= 0 && bench_pin_cpu(cfg->cpu) != 0)
+		fprintf(stderr, "bench: can't run on CPU %d\n", cfg->cpu);
+	stats->name = name;
+	stats->runs = cfg->runs < 1 ? 1 :
+		      cfg->runs > BENCH_MAX_RUNS ? BENCH_MAX_RUNS : cfg->runs;
+
+	long iterations = 1;
+	double warmup_end = bench_now() + cfg->warmup_time;
+	if (cfg->iterations > 0) {
+		iterations = cfg->iterations;
+		while (bench_now() < warmup_end)
+			f(iterations, arg);
+	}
+	/* Growing the iterations till a run is long enough to be timed. */
+	while (cfg->iterations == 0) {
+		double start = bench_now();
+		f(iterations, arg);
+		double elapsed = bench_now() - start;
+		if (iterations >= BENCH_MAX_ITERATIONS)
+			break;
+		if (elapsed >= cfg->run_time / 10) {
+			double wanted = iterations * cfg->run_time / elapsed;
+			iterations = wanted > BENCH_MAX_ITERATIONS ?
+				     BENCH_MAX_ITERATIONS : (long)wanted + 1;
+			if (bench_now() >= warmup_end)
+				break;
+		} else {
+			iterations *= elapsed * 100 < cfg->run_time ? 10 : 2;
+		}
+	}
+	stats->iterations = iterations;
+
+	struct bench_counters counters;
+	bool has_counters = cfg->counters &&
+			    bench_counters_open(&counters) > 0;
+	double values[BENCH_MAX_RUNS][BENCH_COUNTER_COUNT];
+	double times[BENCH_MAX_RUNS];
+	for (int i = 0; i < stats->runs; ++i) {
+		if (has_counters)
+			bench_counters_start(&counters);
+		double start = bench_now();
+		f(iterations, arg);
+		times[i] = (bench_now() - start) * 1e9 / iterations;
+		if (has_counters)
+			bench_counters_stop(&counters, values[i]);
+		stats->ns_per_op[i] = times[i];
+	}
+	bench_sort(stats->ns_per_op, stats->runs);
+	for (int j = 0; j < BENCH_COUNTER_COUNT; ++j)
+		stats->per_op[j] = -1;
+	if (!has_counters)
+		return;
+	bench_counters_close(&counters);
+	double median = stats->ns_per_op[stats->runs / 2];
+	for (int i = 0; i < stats->runs; ++i) {
+		if (times[i] != median)
+			continue;
+		for (int j = 0; j < BENCH_COUNTER_COUNT; ++j) {
+			if (values[i][j] >= 0)
+				stats->per_op[j] = values[i][j] / iterations;
+		}
+		break;
+	}
+}
+
+/** Prints the line of a bench_loop(): ns per operation, min/median/max. */
+static inline void
+bench_print(const struct bench_stats *stats)
+{
+	printf("%-32s %12.2f %12.2f %12.2f ns/op", stats->name,
+	       stats->ns_per_op[0],
+	       bench_median(stats->ns_per_op, stats->runs),
+	       stats->ns_per_op[stats->runs - 1]);
+	for (int j = 0; j < BENCH_COUNTER_COUNT; ++j) {
+		if (stats->per_op[j] >= 0)
+			printf(", %.2f %s", stats->per_op[j],
+			       bench_counter_names[j]);
+	}
+	printf("\n");
+}
+
+/** The same as a JSON object. */
+static inline void
+bench_json(FILE *f, const struct bench_stats *stats)
+{
+	fprintf(f, "{\"name\": \"%s\", \"iterations\": %ld, \"runs\": %d, ",
+		stats->name, stats->iterations, stats->runs);
+	bench_json_stat(f, "ns_per_op", stats->ns_per_op, stats->runs);
+	for (int j = 0; j < BENCH_COUNTER_COUNT; ++j) {
+		if (stats->per_op[j] >= 0)
+			fprintf(f, ", \"%s_per_op\": %.3f",
+				bench_counter_names[j], stats->per_op[j]);
+	}
+	fprintf(f, "}");
+}
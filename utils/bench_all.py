@@ -0,0 +1,268 @@
+"""
+The benchmarks of all the tasks, compared with a baseline: `make bench-all`.
+
+Each benchmark of the top-level build is run (on the CPUs of --cpus, all
+the process may use by default) with its JSON to --out/<name>.json. The
+sorter has no benchmark of its own, so it is timed here: the thread pool
+sorter on the files of generator.py, the times it prints taken from the
+runs. With --save-baseline the results go to --baseline instead.
+
+Then each number of the results is compared with the same one of the
+baseline, if it is a time (`_ns`, `_us`, `_ms`, a cost `_per_op` and the
+like), lower the better, or a rate (`_per_s`), higher the better. The rest
+are the parameters and are skipped. A number is found by its path in the
+JSON, the elements of the arrays named by their "name" or their first field,
+like `coro/coroutines=100/yield_ns`.
+
+The benchmarks repeating their runs report the min, the median and the max
+of them: the range is taken as the confidence interval of the median, which
+for 5 runs it is at 94%. A median is a regression if it is worse than the
+median of the baseline by more than --threshold percent, and both intervals
+do not overlap: it is worse than each run of the baseline. A worse median
+within the spread of the runs is "noisy". Of the percentiles of a single
+run, p50 and p99 are compared by the threshold alone, p99.9 and max are
+too noisy. There is a table of them all, the regressions are printed last
+and the exit status is 1 if there are any, or if a benchmark has no baseline.
+"""
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+HIGHER_SUFFIXES = ('_per_s', '_share')
+LOWER_SUFFIXES = ('_ns', '_us', '_ms', '_per_op', '_per_gib', '_per_byte',
+		  '_per_file', '_per_coro')
+PERCENTILES = ('p50', 'p99')
+
+SORT_FILES = 4
+SORT_NUMBERS = 200000
+SORT_RUNS = 5
+SORT_LINE = re.compile(r'sorted in ([\d.]+)ms, merged in ([\d.]+)ms, '
+		       r'written in ([\d.]+)ms, total ([\d.]+)ms')
+
+
+def bench_commands(args, out):
+	"""The command lines of the benchmarks, by name, writing to `out`."""
+	b = lambda name: os.path.join(args.bin, name)
+	json_of = lambda name: os.path.join(out, name + '.json')
+	quick = args.quick
+	return {
+		'coro': [b('coro_bench'), '--runs', '5', '--json', json_of('coro')] +
+			(['1000'] if quick else []),
+		'shell': [b('shell_bench'), '--shell', b('shell'), '--json', json_of('shell')] +
+			(['--runs', '20', '--chain', '100'] if quick else []),
+		'ufs': [b('ufs_bench'), '--json', json_of('ufs')] +
+			(['--ops', '20000'] if quick else []),
+		'ufs_heap': [b('ufs_bench_heap'), '--json', json_of('ufs_heap')],
+		'tpool': [b('tpool_bench'), '--runs', '5', '--json', json_of('tpool')],
+		'chat': [b('chat_bench'), '--json', json_of('chat')] +
+			(['--seconds', '1', '--warmup', '0'] if quick else []),
+		'bonus': [b('bonus_bench'), '--runs', '5', '--cpu', str(min(args.cpus)),
+			  '--json', json_of('bonus')] +
+			 (['--ops', '100000', 'clock', 'mutex', 'atomic'] if quick else []),
+	}
+
+
+def pin(cpus):
+	return lambda: os.sched_setaffinity(0, cpus)
+
+
+def run(cmd, cpus, cwd=None):
+	"""Run `cmd` on `cpus`, its output to /dev/null. Returns its stdout if asked."""
+	print('$', ' '.join(cmd), flush=True)
+	res = subprocess.run(cmd, cwd=cwd, preexec_fn=pin(cpus), stdout=subprocess.PIPE,
+			     stderr=subprocess.DEVNULL, text=True)
+	if res.returncode != 0:
+		sys.exit('bench_all: %s failed with %d' % (cmd[0], res.returncode))
+	return res.stdout
+
+
+def stat(values):
+	values = sorted(values)
+	return {'min': values[0], 'median': values[len(values) // 2], 'max': values[-1]}
+
+
+def bench_sort(args, out):
+	"""Time the thread pool sorter on the files of generator.py, as a JSON like the others."""
+	threads = len(args.cpus)
+	runs = 2 if args.quick else SORT_RUNS
+	numbers = SORT_NUMBERS // 10 if args.quick else SORT_NUMBERS
+	with tempfile.TemporaryDirectory() as tmp:
+		files = []
+		for i in range(SORT_FILES):
+			files.append(os.path.join(tmp, 'test%d.txt' % i))
+			subprocess.run([sys.executable, os.path.join(ROOT, '1', 'generator.py'),
+					'-f', files[-1], '-c', str(numbers)], check=True)
+		cmd = [os.path.abspath(os.path.join(args.bin, 'sort_parallel')), '--thread-pool',
+		       '0', str(threads)] + files
+		times = [[], [], [], []]
+		for _ in range(runs):
+			m = SORT_LINE.search(run(cmd, args.cpus, cwd=tmp))
+			if not m:
+				sys.exit('bench_all: no times in the output of the sorter')
+			for t, value in zip(times, m.groups()):
+				t.append(float(value))
+	res = {'name': 'thread_pool', 'sort_ms': stat(times[0]), 'merge_ms': stat(times[1]),
+	       'write_ms': stat(times[2]), 'total_ms': stat(times[3])}
+	with open(os.path.join(out, 'sort.json'), 'w') as f:
+		json.dump({'files': SORT_FILES, 'numbers': numbers, 'threads': threads,
+			   'runs': runs, 'results': [res]}, f, indent=1)
+
+
+def direction(key):
+	"""1 if higher is better, -1 if lower is, 0 if `key` is not compared."""
+	if key.endswith(HIGHER_SUFFIXES):
+		return 1
+	if key.endswith(LOWER_SUFFIXES):
+		return -1
+	return 0
+
+
+def label(item, i):
+	"""The name of the `i`-th element of an array in the paths."""
+	if isinstance(item, dict):
+		if 'name' in item:
+			return str(item['name'])
+		for k, v in item.items():
+			if isinstance(v, (int, float, str)) and not isinstance(v, bool):
+				return '%s=%s' % (k, v)
+	return str(i)
+
+
+def metrics(obj, path, found):
+	"""
+	Add to `found` the numbers compared in `obj`, by their paths: (direction, median,
+	low, high), where low and high are the range of the runs, or None for one run.
+	"""
+	if isinstance(obj, list):
+		for i, item in enumerate(obj):
+			metrics(item, path + [label(item, i)], found)
+		return
+	if not isinstance(obj, dict):
+		return
+	for k, v in obj.items():
+		d = direction(k)
+		if isinstance(v, dict) and 'median' in v:
+			if d:
+				found['/'.join(path + [k])] = (d, v['median'], v['min'], v['max'])
+		elif isinstance(v, dict) and 'p50' in v:
+			for p in PERCENTILES:
+				if d and p in v:
+					found['/'.join(path + [k, p])] = (d, v[p], None, None)
+		elif isinstance(v, (dict, list)):
+			metrics(v, path + ([] if k == 'results' else [k]), found)
+		elif isinstance(v, (int, float)) and not isinstance(v, bool) and d:
+			found['/'.join(path + [k])] = (d, v, None, None)
+
+
+def load(path, name):
+	found = {}
+	with open(path) as f:
+		metrics(json.load(f), [name], found)
+	return found
+
+
+def verdict(base, cur, threshold):
+	"""The change of `cur` against `base` in percent, better if positive, and the verdict."""
+	d, b, b_low, b_high = base
+	_, c, c_low, c_high = cur
+	if b == 0:
+		return 0.0, ''
+	change = (c - b) / abs(b) * 100 * d
+	if change >= threshold:
+		return change, 'better'
+	if change > -threshold:
+		return change, ''
+	# The intervals of the runs overlap: not told from the noise
+	if b_low is not None and c_low is not None and \
+	   ((d < 0 and c_low <= b_high) or (d > 0 and c_high >= b_low)):
+		return change, 'noisy'
+	return change, 'REGRESSION'
+
+
+def compare(names, out, baseline, threshold):
+	"""Print the table of the results against the baseline. Returns the regressions."""
+	regressions = []
+	print('\n%-60s %12s %12s %8s' % ('', 'baseline', 'current', 'change'))
+	for name in names:
+		base = load(os.path.join(baseline, name + '.json'), name)
+		cur = load(os.path.join(out, name + '.json'), name)
+		for path, value in cur.items():
+			if path not in base:
+				print('%-60s %12s %12.3f' % (path, 'new', value[1]))
+				continue
+			change, what = verdict(base[path], value, threshold)
+			print('%-60s %12.3f %12.3f %+7.1f%% %s' % (path, base[path][1], value[1],
+								     change, what))
+			if what == 'REGRESSION':
+				regressions.append((path, change))
+		for path in base.keys() - cur.keys():
+			print('%-60s %12.3f %12s' % (path, base[path][1], 'gone'))
+	return regressions
+
+
+def main():
+	parser = argparse.ArgumentParser(description='Benchmarks of all the tasks against a baseline')
+	parser.add_argument('--bin', default='build/release/bin', help='where the programs are')
+	parser.add_argument('--out', default='build/release/bench', help='where the results go')
+	parser.add_argument('--baseline', default='bench/release', help='the results to compare with')
+	parser.add_argument('--threshold', type=float, default=10,
+			    help='the regression to fail on, percent')
+	parser.add_argument('--cpus', help='the CPUs to run on, like 0-3,6')
+	parser.add_argument('--quick', action='store_true', help='the short runs')
+	parser.add_argument('--save-baseline', action='store_true',
+			    help='run to the baseline, not to compare with it')
+	parser.add_argument('--no-run', action='store_true',
+			    help='compare the results there are, without running')
+	parser.add_argument('names', nargs='*', help='the benchmarks, all by default')
+	args = parser.parse_args()
+
+	if args.cpus:
+		spec, args.cpus = args.cpus, set()
+		for part in spec.split(','):
+			low, _, high = part.partition('-')
+			args.cpus.update(range(int(low), int(high or low) + 1))
+	else:
+		args.cpus = os.sched_getaffinity(0)
+	out = args.baseline if args.save_baseline else args.out
+	commands = bench_commands(args, out)
+	all_names = ['sort'] + list(commands)
+	names = args.names or all_names
+	for name in names:
+		if name not in all_names:
+			sys.exit('bench_all: unknown benchmark %s, there are %s' %
+				 (name, ', '.join(all_names)))
+	# Nothing to compare with is a failure, not a pass: found before the long runs
+	missing = [name for name in names
+		   if not os.path.exists(os.path.join(args.baseline, name + '.json'))]
+	if missing and not args.save_baseline:
+		sys.exit('bench_all: no baseline of %s in %s, store it with make bench-baseline' %
+			 (', '.join(missing), args.baseline))
+
+	if not args.no_run:
+		os.makedirs(out, exist_ok=True)
+		for name in names:
+			if name == 'sort':
+				bench_sort(args, out)
+			else:
+				run(commands[name], args.cpus)
+	if args.save_baseline:
+		print('The baseline is in %s' % out)
+		return
+
+	regressions = compare(names, out, args.baseline, args.threshold)
+	if regressions:
+		print('\n%d REGRESSIONS over %g%%:' % (len(regressions), args.threshold), file=sys.stderr)
+		for path, change in regressions:
+			print('  %-60s %+7.1f%%' % (path, change), file=sys.stderr)
+		sys.exit(1)
+	print('\nNo regressions over %g%%' % args.threshold)
+
+
+if __name__ == '__main__':
+	main()
@@ -3,8 +3,9 @@
 
 #include <dlfcn.h>
 #include <errno.h>
-#include <execinfo.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,6 +13,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <unwind.h>
 
 #if __APPLE__
 #define PLATFORM_IS_APPLE 1
@@ -24,6 +26,17 @@
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// Slots of a shard's allocation table at first. Always a power of 2.
+	ALLOCATION_TABLE_MIN_SIZE = 256,
+	// The allocations are in the shards by the top bits of the pointer
+	// hash, each shard with its own lock.
+	ALLOCATION_SHARD_BITS = 6,
+	ALLOCATION_SHARD_COUNT = 1 << ALLOCATION_SHARD_BITS,
+	// Unused allocation objects a thread takes from the pool at once. It
+	// gives them back once it has twice as many.
+	ALLOCATION_CACHE_SIZE = 16,
+	CALLSITE_BATCH_SIZE = 256,
+	CALLSITE_TABLE_MIN_SIZE = 1024,
 };
 
 enum report_mode {
@@ -37,10 +50,17 @@ enum report_mode {
 
 // Single allocation done on the heap by a user.
 struct allocation {
+	// The stack if sampled, see HHSAMPLE, or else just the caller.
 	void *trace[MAX_BACKTRACE_LEN];
 	int trace_size;
+	bool is_sampled;
+	// Of the heap function.
+	void *caller;
+	// Where it is counted in the profile, see HHPROFILE. NULL without it.
+	struct callsite *site;
 	void *mem;
 	size_t size;
+	// Next in the pool of unused allocation objects.
 	struct allocation *next;
 };
 
@@ -51,6 +71,50 @@ struct allocation_batch {
 	int used;
 };
 
+// Live allocations of a shard by their memory. Open addressing with linear
+// probing, in mmap()-ed memory for the same reason as the allocation
+// batches. The table is at most half full.
+struct allocation_shard {
+	_Alignas(64) bool lock;
+	struct allocation **table;
+	size_t size;
+	size_t count;
+};
+
+// Counters and unused allocation objects of a thread, which only it
+// changes, for the threads not to wait for each other. The counters are
+// summed up when read. There is no knowing when a thread ends without
+// pthread, so the objects are mmap()-ed and never freed: the counters of
+// the ended threads still count.
+struct heaph_thread {
+	int64_t alloc_count;
+	uint64_t alloc_count_total;
+	struct allocation *cache;
+	int cache_size;
+	// Allocations till the next one with its stack recorded.
+	int sample_countdown;
+	struct heaph_thread *next;
+};
+
+// The allocations of one stack, for the heap profile.
+struct callsite {
+	void *trace[MAX_BACKTRACE_LEN];
+	int trace_size;
+	uint64_t hash;
+	uint64_t live_bytes;
+	uint64_t alloc_bytes;
+	uint64_t alloc_count;
+	// The live bytes at the peak of all of them. Kept only once they
+	// change after the peak: till then they are the live bytes.
+	uint64_t peak_bytes;
+	uint64_t peak_epoch;
+};
+
+struct callsite_batch {
+	struct callsite sites[CALLSITE_BATCH_SIZE];
+	int used;
+};
+
 struct symbol {
 	const char *file;
 	const char *name;
@@ -62,29 +126,61 @@ static bool is_exit_done = false;
 static __thread int init_lock_count = 0;
 static __thread int depth = 0;
 static enum report_mode report_mode = MODE_LEAKS;
+// Stack of 1 in sample_rate allocations of each thread, at most trace_depth
+// frames. HHSAMPLE and HHDEPTH.
+static int sample_rate = 1;
+static int trace_depth = MAX_BACKTRACE_LEN;
 
 // Before the original heap functions are retrieved, there is a dummy static
 // allocator working. It is needed because on some platforms the original
 // functions getting via dlsym() itself can do allocations. Which means there
 // has to be some allocation technique before the symbols are known.
-static int static_size = 0;
+// What dlsym() allocates before the heap functions are found. In the data
+// segment, for mmap() to be found with them.
+static uint8_t static_buf[16 * 1024];
 static int static_used = 0;
-static uint8_t* static_buf = NULL;
 
-static bool allocs_lock = false;
-static int64_t alloc_count = 0;
-static uint64_t alloc_count_total = 0;
-static struct allocation *allocs = NULL;
-// Unused allocation objects. For re-use.
+static struct allocation_shard alloc_shards[ALLOCATION_SHARD_COUNT];
+// All the threads which have ever tracked anything.
+static bool threads_lock = false;
+static struct heaph_thread *threads = NULL;
+static __thread struct heaph_thread *thread = NULL;
+// Unused allocation objects. For re-use by the threads out of them.
+static bool alloc_pool_lock = false;
 static struct allocation *alloc_pool = NULL;
 // Freshly created allocation objects. Taken from here when the pool is empty.
 static struct allocation_batch *alloc_batch = NULL;
 
+// The heap profile, if HHPROFILE is set. The call sites by their stack,
+// open addressing like the allocations, all under one lock: the peak is of
+// all the threads together.
+static const char *profile_path = NULL;
+static bool profile_lock = false;
+static struct callsite **callsite_table = NULL;
+static size_t callsite_table_size = 0;
+static size_t callsite_count = 0;
+static struct callsite_batch *callsite_batch = NULL;
+static uint64_t profile_live_bytes = 0;
+static uint64_t profile_peak_bytes = 0;
+// Increased with each new peak.
+static uint64_t profile_peak_epoch = 0;
+// Set by the signal, the dump is done by the next heap function.
+static volatile sig_atomic_t profile_dump_requested = 0;
+
+// Mapped by the program and not unmapped yet. Not by the heap help itself,
+// which goes around the interception.
+static int64_t mmap_size = 0;
+
 static void *(*default_malloc)(size_t) = NULL;
 static void (*default_free)(void *) = NULL;
 static void *(*default_calloc)(size_t, size_t) = NULL;
 static void *(*default_realloc)(void *, size_t) = NULL;
 static char *(*default_strdup)(const char *) = NULL;
+static char *(*default_strndup)(const char *, size_t) = NULL;
+static int (*default_posix_memalign)(void **, size_t, size_t) = NULL;
+static void *(*default_aligned_alloc)(size_t, size_t) = NULL;
+static void *(*default_mmap)(void *, size_t, int, int, int, off_t) = NULL;
+static int (*default_munmap)(void *, size_t) = NULL;
 static ssize_t (*default_getline)(char **, size_t *, FILE *) = NULL;
 static int (*default_getaddrinfo)(
 	const char *, const char *, const struct addrinfo *,
@@ -143,15 +239,360 @@ spinlock_rel(bool *lock)
 	__atomic_clear(lock, __ATOMIC_SEQ_CST);
 }
 
+static uint64_t
+alloc_hash(const void *ptr)
+{
+	// Fibonacci hashing, the top bits are the most mixed.
+	return (uint64_t)(uintptr_t)ptr * 11400714819323198485ull;
+}
+
+static struct allocation_shard *
+alloc_shard(const void *ptr)
+{
+	return &alloc_shards[alloc_hash(ptr) >> (64 - ALLOCATION_SHARD_BITS)];
+}
+
+// The home slot, by the bits of the hash after the ones of the shard.
+static size_t
+alloc_table_slot(const struct allocation_shard *sh, const void *ptr)
+{
+	return (alloc_hash(ptr) << ALLOCATION_SHARD_BITS) >>
+		(64 - __builtin_ctzll(sh->size));
+}
+
+static void *
+heaph_mmap(size_t size)
+{
+	void *res = default_mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(res != MAP_FAILED);
+	return res;
+}
+
+static void
+heaph_munmap(void *ptr, size_t size)
+{
+	default_munmap(ptr, size);
+}
+
+static struct allocation **
+alloc_table_mmap(size_t size)
+{
+	return heaph_mmap(size * sizeof(struct allocation *));
+}
+
+// Slot of the pointer, or the empty one where it would be.
+static size_t
+alloc_table_find(const struct allocation_shard *sh, const void *ptr)
+{
+	size_t mask = sh->size - 1;
+	size_t i = alloc_table_slot(sh, ptr);
+	while (sh->table[i] != NULL && sh->table[i]->mem != ptr)
+		i = (i + 1) & mask;
+	return i;
+}
+
+static void
+alloc_table_grow(struct allocation_shard *sh)
+{
+	struct allocation **old = sh->table;
+	size_t old_size = sh->size;
+	sh->size = old_size == 0 ? ALLOCATION_TABLE_MIN_SIZE : old_size * 2;
+	sh->table = alloc_table_mmap(sh->size);
+	for (size_t i = 0; i < old_size; ++i) {
+		if (old[i] != NULL)
+			sh->table[alloc_table_find(sh, old[i]->mem)] = old[i];
+	}
+	if (old != NULL)
+		heaph_munmap(old, old_size * sizeof(*old));
+}
+
+// Empties the slot, moving back the ones after it which would not be found
+// past the hole otherwise. So there are no tombstones, and the lookups stay
+// short however many frees there were.
+static void
+alloc_table_remove(struct allocation_shard *sh, size_t i)
+{
+	size_t mask = sh->size - 1;
+	size_t hole = i;
+	while (true) {
+		i = (i + 1) & mask;
+		struct allocation *a = sh->table[i];
+		if (a == NULL)
+			break;
+		size_t home = alloc_table_slot(sh, a->mem);
+		// Stays if its home is cyclically in (hole, i].
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		sh->table[hole] = a;
+		hole = i;
+	}
+	sh->table[hole] = NULL;
+}
+
+static struct heaph_thread *
+heaph_thread_get(void)
+{
+	if (thread != NULL)
+		return thread;
+	struct heaph_thread *t = heaph_mmap(sizeof(*t));
+	spinlock_acq(&threads_lock);
+	t->next = threads;
+	threads = t;
+	spinlock_rel(&threads_lock);
+	thread = t;
+	return t;
+}
+
+// Only the thread itself changes them, the others read.
+static void
+heaph_thread_count(struct heaph_thread *t, int64_t count, uint64_t total)
+{
+	__atomic_store_n(&t->alloc_count, t->alloc_count + count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&t->alloc_count_total, t->alloc_count_total + total,
+			 __ATOMIC_RELAXED);
+}
+
+static struct allocation *
+alloc_object_new(struct heaph_thread *t)
+{
+	if (t->cache == NULL) {
+		spinlock_acq(&alloc_pool_lock);
+		for (int i = 0; i < ALLOCATION_CACHE_SIZE; ++i) {
+			struct allocation *a = alloc_pool;
+			if (a != NULL) {
+				alloc_pool = a->next;
+			} else {
+				if (alloc_batch == NULL ||
+				    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
+					alloc_batch = heaph_mmap(
+						sizeof(*alloc_batch));
+					alloc_batch->used = 0;
+				}
+				a = &alloc_batch->allocs[alloc_batch->used++];
+			}
+			a->next = t->cache;
+			t->cache = a;
+		}
+		spinlock_rel(&alloc_pool_lock);
+		t->cache_size = ALLOCATION_CACHE_SIZE;
+	}
+	struct allocation *a = t->cache;
+	t->cache = a->next;
+	--t->cache_size;
+	return a;
+}
+
+static void
+alloc_object_delete(struct heaph_thread *t, struct allocation *a)
+{
+	a->next = t->cache;
+	t->cache = a;
+	if (++t->cache_size < 2 * ALLOCATION_CACHE_SIZE)
+		return;
+	// Half of them back, for the threads which only allocate.
+	struct allocation *first = t->cache;
+	struct allocation *last = first;
+	for (int i = 1; i < ALLOCATION_CACHE_SIZE; ++i)
+		last = last->next;
+	t->cache = last->next;
+	t->cache_size -= ALLOCATION_CACHE_SIZE;
+	spinlock_acq(&alloc_pool_lock);
+	last->next = alloc_pool;
+	alloc_pool = first;
+	spinlock_rel(&alloc_pool_lock);
+}
+
 static bool
 alloc_is_static(const void *ptr)
 {
 	return ptr != NULL && ptr >= (void *)static_buf &&
-		ptr <= (void *)(static_buf + static_size);
+		ptr < (void *)(static_buf + sizeof(static_buf));
+}
+
+struct trace_ctx {
+	void **addrs;
+	int size;
+	int max_size;
+	// Frames of the tracing itself not to put in.
+	int skip;
+};
+
+static _Unwind_Reason_Code
+trace_step(struct _Unwind_Context *uctx, void *arg)
+{
+	struct trace_ctx *ctx = arg;
+	if (ctx->size == ctx->max_size)
+		return _URC_END_OF_STACK;
+	uintptr_t ip = _Unwind_GetIP(uctx);
+	if (ip == 0)
+		return _URC_END_OF_STACK;
+	if (ctx->skip > 0) {
+		--ctx->skip;
+		return _URC_NO_REASON;
+	}
+	ctx->addrs[ctx->size++] = (void *)ip;
+	return _URC_NO_REASON;
+}
+
+// Like backtrace(), but only as deep as asked: the unwinding is what costs,
+// a frame at a time. Not by the frame pointers, which the libraries the
+// allocations come through are often built without.
+static __attribute__((noinline)) int
+trace_collect(void **addrs, int max_size)
+{
+	struct trace_ctx ctx = {
+		.addrs = addrs, .size = 0, .max_size = max_size, .skip = 1,
+	};
+	_Unwind_Backtrace(trace_step, &ctx);
+	return ctx.size;
+}
+
+static uint64_t
+callsite_hash(void *const *trace, int size)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (int i = 0; i < size; ++i)
+		h = (h ^ (uint64_t)(uintptr_t)trace[i]) * 1099511628211ull;
+	return h;
+}
+
+static size_t
+callsite_table_find(struct callsite **table, size_t size, uint64_t hash,
+		    void *const *trace, int trace_size)
+{
+	size_t mask = size - 1;
+	size_t i = (hash * 11400714819323198485ull) >>
+		(64 - __builtin_ctzll(size));
+	for (; table[i] != NULL; i = (i + 1) & mask) {
+		const struct callsite *site = table[i];
+		if (site->hash == hash && site->trace_size == trace_size &&
+		    memcmp(site->trace, trace, trace_size * sizeof(*trace)) == 0)
+			break;
+	}
+	return i;
+}
+
+static void
+callsite_table_grow(void)
+{
+	size_t old_size = callsite_table_size;
+	struct callsite **old = callsite_table;
+	callsite_table_size = old_size == 0 ?
+		CALLSITE_TABLE_MIN_SIZE : old_size * 2;
+	callsite_table = heaph_mmap(callsite_table_size *
+				    sizeof(*callsite_table));
+	for (size_t i = 0; i < old_size; ++i) {
+		struct callsite *site = old[i];
+		if (site == NULL)
+			continue;
+		size_t j = callsite_table_find(callsite_table,
+			callsite_table_size, site->hash, site->trace,
+			site->trace_size);
+		callsite_table[j] = site;
+	}
+	if (old != NULL)
+		heaph_munmap(old, old_size * sizeof(*old));
+}
+
+// The site of the stack, a new one if it is the first time. Under the
+// profile lock.
+static struct callsite *
+callsite_get(void *const *trace, int trace_size)
+{
+	if (2 * (callsite_count + 1) > callsite_table_size)
+		callsite_table_grow();
+	uint64_t hash = callsite_hash(trace, trace_size);
+	size_t i = callsite_table_find(callsite_table, callsite_table_size,
+				       hash, trace, trace_size);
+	if (callsite_table[i] != NULL)
+		return callsite_table[i];
+	if (callsite_batch == NULL ||
+	    callsite_batch->used == CALLSITE_BATCH_SIZE) {
+		callsite_batch = heaph_mmap(sizeof(*callsite_batch));
+		callsite_batch->used = 0;
+	}
+	struct callsite *site = &callsite_batch->sites[callsite_batch->used++];
+	memcpy(site->trace, trace, trace_size * sizeof(*trace));
+	site->trace_size = trace_size;
+	site->hash = hash;
+	// It had nothing at the last peak.
+	site->peak_epoch = profile_peak_epoch;
+	callsite_table[i] = site;
+	++callsite_count;
+	return site;
+}
+
+// Before the live bytes of the site change: they are what it had at the
+// peak, if it is the first change since.
+static void
+callsite_touch(struct callsite *site)
+{
+	if (site->peak_epoch == profile_peak_epoch)
+		return;
+	site->peak_bytes = site->live_bytes;
+	site->peak_epoch = profile_peak_epoch;
 }
 
 static void
-alloc_trace_new(void *ptr, size_t size)
+profile_alloc(struct allocation *a)
+{
+	// From the caller on, for the sampled stacks and the callers alone of the
+	// other ones to add up.
+	int from = 0;
+	while (from < a->trace_size && a->trace[from] != a->caller)
+		++from;
+	if (from == a->trace_size)
+		from = 0;
+	spinlock_acq(&profile_lock);
+	struct callsite *site = callsite_get(a->trace + from,
+					     a->trace_size - from);
+	callsite_touch(site);
+	site->live_bytes += a->size;
+	site->alloc_bytes += a->size;
+	++site->alloc_count;
+	profile_live_bytes += a->size;
+	if (profile_live_bytes > profile_peak_bytes) {
+		profile_peak_bytes = profile_live_bytes;
+		++profile_peak_epoch;
+	}
+	spinlock_rel(&profile_lock);
+	a->site = site;
+}
+
+static void
+profile_free(const struct allocation *a)
+{
+	spinlock_acq(&profile_lock);
+	callsite_touch(a->site);
+	a->site->live_bytes -= a->size;
+	profile_live_bytes -= a->size;
+	spinlock_rel(&profile_lock);
+}
+
+static void
+profile_dump(void);
+
+static void
+profile_on_signal(int signo)
+{
+	(void)signo;
+	profile_dump_requested = 1;
+}
+
+// Not in the signal handler, where almost nothing is allowed.
+static void
+profile_check_dump(void)
+{
+	if (!profile_dump_requested ||
+	    !__atomic_exchange_n(&profile_dump_requested, 0, __ATOMIC_SEQ_CST))
+		return;
+	profile_dump();
+}
+
+static void
+alloc_trace_new(void *ptr, size_t size, void *caller)
 {
 	if (alloc_is_static(ptr))
 		return;
@@ -165,39 +606,45 @@ alloc_trace_new(void *ptr, size_t size)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = alloc_pool;
-	if (a != NULL) {
-		alloc_pool = a->next;
-	} else {
-		if (alloc_batch == NULL ||
-		    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			alloc_batch = mmap(NULL,
-				sizeof(*alloc_batch), PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_PRIVATE, -1, 0);
-			heaph_assert(alloc_batch != MAP_FAILED);
-			alloc_batch->used = 0;
-		} else {
-			heaph_assert(alloc_batch->used < ALLOCATION_BATCH_SIZE);
-		}
-		a = &alloc_batch->allocs[alloc_batch->used++];
-	}
-	spinlock_rel(&allocs_lock);
-
+	struct heaph_thread *t = heaph_thread_get();
+	struct allocation *a = alloc_object_new(t);
 	a->mem = ptr;
 	a->size = size;
-	if (depth == 1)
-		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
-	else
-		a->trace_size = 0;
+	a->caller = caller;
+	a->is_sampled = --t->sample_countdown <= 0;
+	if (a->is_sampled) {
+		t->sample_countdown = sample_rate;
+		a->trace_size = trace_collect(a->trace, trace_depth);
+	} else {
+		a->trace[0] = caller;
+		a->trace_size = 1;
+	}
 	heaph_assert(a->trace_size >= 0);
+	a->site = NULL;
+	if (profile_path != NULL)
+		profile_alloc(a);
 
-	spinlock_acq(&allocs_lock);
-	a->next = allocs;
-	allocs = a;
-	++alloc_count;
-	++alloc_count_total;
-	spinlock_rel(&allocs_lock);
+	struct allocation_shard *sh = alloc_shard(ptr);
+	spinlock_acq(&sh->lock);
+	if (2 * (sh->count + 1) > sh->size)
+		alloc_table_grow(sh);
+	size_t i = alloc_table_find(sh, ptr);
+	struct allocation *old = sh->table[i];
+	sh->table[i] = a;
+	if (old == NULL)
+		++sh->count;
+	spinlock_rel(&sh->lock);
+	if (old != NULL) {
+		// Freed untracked, inside another heap function. It is the new
+		// allocation now.
+		if (old->site != NULL)
+			profile_free(old);
+		alloc_object_delete(t, old);
+		heaph_thread_count(t, 0, 1);
+	} else {
+		heaph_thread_count(t, 1, 1);
+	}
+	profile_check_dump();
 }
 
 static void
@@ -210,39 +657,29 @@ alloc_free(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = allocs;
-	struct allocation *prev = NULL;
-	while (a != NULL) {
-		if (a->mem == ptr) {
-			if (prev == NULL)
-				allocs = a->next;
-			else
-				prev->next = a->next;
-			a->next = alloc_pool;
-			alloc_pool = a;
-			int64_t new_count = --alloc_count;
-			spinlock_rel(&allocs_lock);
-
-			heaph_assert(new_count >= 0 && "freeing bad memory");
-			return;
-		}
-		prev = a;
-		a = a->next;
+	struct allocation_shard *sh = alloc_shard(ptr);
+	spinlock_acq(&sh->lock);
+	struct allocation *a = NULL;
+	size_t i = 0;
+	if (sh->size != 0) {
+		i = alloc_table_find(sh, ptr);
+		a = sh->table[i];
 	}
-	spinlock_rel(&allocs_lock);
-	heaph_assert(!"freeing bad memory");
-}
-
-static void
-static_allocator_touch(void)
-{
-	if (static_buf != NULL)
+	if (a == NULL) {
+		spinlock_rel(&sh->lock);
+		heaph_assert(!"freeing bad memory");
 		return;
-	static_size = 16 * 1024;
-	static_buf = mmap(NULL, static_size, PROT_READ | PROT_WRITE,
-			  MAP_ANON | MAP_PRIVATE, -1, 0);
-	heaph_assert(static_buf != MAP_FAILED);
+	}
+	alloc_table_remove(sh, i);
+	--sh->count;
+	spinlock_rel(&sh->lock);
+
+	if (a->site != NULL)
+		profile_free(a);
+	struct heaph_thread *t = heaph_thread_get();
+	alloc_object_delete(t, a);
+	heaph_thread_count(t, -1, 0);
+	profile_check_dump();
 }
 
 static void *
@@ -250,9 +687,8 @@ static_malloc(size_t size)
 {
 	heaph_assert(!is_init_done);
 	heaph_assert(init_lock);
-	static_allocator_touch();
-	heaph_assert(static_size >= static_used);
-	heaph_assert(size < (size_t)(static_size - static_used));
+	heaph_assert((int)sizeof(static_buf) >= static_used);
+	heaph_assert(size < sizeof(static_buf) - static_used);
 	void *res = static_buf + static_used;
 	static_used += size;
 	return res;
@@ -263,7 +699,6 @@ static_free(void *ptr)
 {
 	heaph_assert(!is_init_done);
 	heaph_assert(init_lock);
-	static_allocator_touch();
 	if (ptr != NULL)
 		heaph_assert(alloc_is_static(ptr));
 	(void)ptr;
@@ -327,6 +762,21 @@ trace_sym_is_internal(const struct symbol *sym)
 	return false;
 }
 
+// What the C library allocates for itself is told by the functions up the
+// stack. Without the stack, or with the stack cut short by HHDEPTH, an
+// allocation by the library itself is taken for its own.
+static bool
+trace_sym_is_libc(const struct symbol *sym)
+{
+	if (sym == NULL || sym->file == NULL)
+		return false;
+	const char *name = strrchr(sym->file, '/');
+	name = name != NULL ? name + 1 : sym->file;
+	return strncmp(name, "libc.so", 7) == 0 ||
+		strncmp(name, "libpthread.so", 13) == 0 ||
+		strncmp(name, "libsystem_", 10) == 0;
+}
+
 static bool
 trace_is_internal(const struct symbol *syms, int count)
 {
@@ -353,6 +803,172 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 	}
 }
 
+enum profile_value {
+	PROFILE_LIVE_BYTES,
+	PROFILE_ALLOC_BYTES,
+	PROFILE_ALLOC_COUNT,
+	PROFILE_PEAK_BYTES,
+};
+
+struct profile_file {
+	int fd;
+	int used;
+	char buf[4096];
+};
+
+static void
+profile_file_flush(struct profile_file *f)
+{
+	for (int done = 0; done < f->used;) {
+		ssize_t rc = write(f->fd, f->buf + done, f->used - done);
+		if (rc <= 0)
+			break;
+		done += rc;
+	}
+	f->used = 0;
+}
+
+static void
+profile_file_write(struct profile_file *f, const char *str, size_t len)
+{
+	while (len > 0) {
+		if (f->used == (int)sizeof(f->buf))
+			profile_file_flush(f);
+		size_t part = sizeof(f->buf) - f->used;
+		if (part > len)
+			part = len;
+		memcpy(f->buf + f->used, str, part);
+		f->used += part;
+		str += part;
+		len -= part;
+	}
+}
+
+static uint64_t
+profile_site_value(const struct callsite *site, enum profile_value value)
+{
+	switch (value) {
+	case PROFILE_LIVE_BYTES:
+		return site->live_bytes;
+	case PROFILE_ALLOC_BYTES:
+		return site->alloc_bytes;
+	case PROFILE_ALLOC_COUNT:
+		return site->alloc_count;
+	case PROFILE_PEAK_BYTES:
+		if (site->peak_epoch == profile_peak_epoch)
+			return site->peak_bytes;
+		return site->live_bytes;
+	}
+	return 0;
+}
+
+// A line of the folded stacks, the outermost frame first: what the flame
+// graph tools take.
+static void
+profile_site_write(struct profile_file *f, const struct callsite *site,
+		   uint64_t value)
+{
+	char frame[256];
+	Dl_info info;
+	for (int i = site->trace_size - 1; i >= 0; --i) {
+		void *addr = site->trace[i];
+		int len;
+		if (dladdr(addr, &info) == 0) {
+			len = snprintf(frame, sizeof(frame), "%p", addr);
+		} else if (info.dli_sname != NULL) {
+			len = snprintf(frame, sizeof(frame), "%s",
+				       info.dli_sname);
+		} else {
+			const char *file = info.dli_fname != NULL ?
+				info.dli_fname : "?";
+			const char *name = strrchr(file, '/');
+			len = snprintf(frame, sizeof(frame), "%s+%#zx",
+				       name != NULL ? name + 1 : file,
+				       (size_t)((char *)addr -
+						(char *)info.dli_fbase));
+		}
+		if (len >= (int)sizeof(frame))
+			len = sizeof(frame) - 1;
+		profile_file_write(f, frame, len);
+		if (i > 0)
+			profile_file_write(f, ";", 1);
+	}
+	int len = snprintf(frame, sizeof(frame), " %llu\n",
+			   (unsigned long long)value);
+	profile_file_write(f, frame, len);
+}
+
+static void
+profile_dump_file(const char *suffix, enum profile_value value)
+{
+	char path[4096];
+	if (snprintf(path, sizeof(path), "%s.%s", profile_path, suffix) >=
+	    (int)sizeof(path))
+		return;
+	struct profile_file f;
+	f.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (f.fd < 0) {
+		heaph_printf("\nHH: can't open the profile %s\n", path);
+		return;
+	}
+	f.used = 0;
+	for (size_t i = 0; i < callsite_table_size; ++i) {
+		const struct callsite *site = callsite_table[i];
+		if (site == NULL)
+			continue;
+		uint64_t v = profile_site_value(site, value);
+		if (v != 0)
+			profile_site_write(&f, site, v);
+	}
+	profile_file_flush(&f);
+	close(f.fd);
+}
+
+// Each of the values to its own file, for the tools taking one per line.
+static void
+profile_dump(void)
+{
+	spinlock_acq(&profile_lock);
+	profile_dump_file("live_bytes", PROFILE_LIVE_BYTES);
+	profile_dump_file("alloc_bytes", PROFILE_ALLOC_BYTES);
+	profile_dump_file("alloc_count", PROFILE_ALLOC_COUNT);
+	profile_dump_file("peak_bytes", PROFILE_PEAK_BYTES);
+	spinlock_rel(&profile_lock);
+}
+
+// Sums up the counters of all the threads.
+static void
+heaph_counts(int64_t *count, uint64_t *total)
+{
+	*count = 0;
+	*total = 0;
+	spinlock_acq(&threads_lock);
+	for (const struct heaph_thread *t = threads; t != NULL; t = t->next) {
+		*count += __atomic_load_n(&t->alloc_count, __ATOMIC_RELAXED);
+		*total += __atomic_load_n(&t->alloc_count_total,
+					  __ATOMIC_RELAXED);
+	}
+	spinlock_rel(&threads_lock);
+}
+
+static void
+heaph_unlock_shards(void)
+{
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_rel(&alloc_shards[i].lock);
+}
+
+// Not a leak, the mappings go with the process, but may be forgotten too.
+static void
+heaph_report_mmap(void)
+{
+	int64_t size = __atomic_load_n(&mmap_size, __ATOMIC_RELAXED);
+	if (size > 0) {
+		heaph_printf("HH: mmap-ed bytes not unmapped - %lld\n",
+			     (long long)size);
+	}
+}
+
 static void
 heaph_atexit(void)
 {
@@ -360,21 +976,34 @@ heaph_atexit(void)
 	// manually filter out all calls except for the first one.
 	if (__atomic_test_and_set(&is_exit_done, __ATOMIC_SEQ_CST))
 		return;
+	if (profile_path != NULL) {
+		// The allocations of the dump itself are not to be profiled.
+		++depth;
+		profile_dump();
+		--depth;
+	}
 	if (report_mode == MODE_QUIET)
 		return;
-	spinlock_acq(&allocs_lock);
-	int64_t count = alloc_count;
+	int64_t unused;
+	uint64_t alloc_count_total;
+	heaph_counts(&unused, &alloc_count_total);
+	// All of them, for the threads still running not to change the tables.
+	int64_t count = 0;
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i) {
+		spinlock_acq(&alloc_shards[i].lock);
+		count += alloc_shards[i].count;
+	}
 	if (count == 0) {
-		spinlock_rel(&allocs_lock);
+		heaph_unlock_shards();
 		if (report_mode == MODE_VERBOSE) {
 			heaph_printf("\n");
 			heaph_printf("HH: found no leaks\n");
 			heaph_printf("HH: total allocation count - %llu\n",
 			       (long long)alloc_count_total);
+			heaph_report_mmap();
 		}
 		return;
 	}
-	const struct allocation *a = allocs;
 	const int report_limit = 10;
 	int report_count = 0;
 	int64_t total_count = count;
@@ -384,27 +1013,37 @@ heaph_atexit(void)
 	// makes it harder to read HH output unless the latter prepends itself
 	// with a line wrap.
 	const char *prefix = "\n";
-	for (; a != NULL; a = a->next) {
-		heaph_assert(count > 0);
-		if (a->trace_size == 0) {
-			--count;
-			continue;
+	for (int k = 0; k < ALLOCATION_SHARD_COUNT; ++k) {
+		const struct allocation_shard *sh = &alloc_shards[k];
+		for (size_t j = 0; j < sh->size; ++j) {
+			const struct allocation *a = sh->table[j];
+			if (a == NULL)
+				continue;
+			heaph_assert(count > 0);
+			trace_resolve(a->trace, a->trace_size, syms);
+			bool is_internal = trace_is_internal(syms,
+							     a->trace_size);
+			if (!is_internal && (!a->is_sampled ||
+					     a->trace_size == trace_depth)) {
+				struct symbol caller;
+				trace_resolve(&a->caller, 1, &caller);
+				is_internal = trace_sym_is_libc(&caller);
+			}
+			if (is_internal) {
+				--count;
+			} else if (report_count < report_limit) {
+				heaph_printf("%s", prefix), prefix = "";
+				heaph_printf("#### Leak %d (%zu bytes%s) ####\n",
+					     ++report_count, a->size,
+					     a->is_sampled ? "" : ", caller only");
+				for (int i = 0; i < a->trace_size; ++i)
+					heaph_printf("%d - %s\n", i, syms[i].name);
+			}
+			if (!is_internal)
+				leak_size += a->size;
 		}
-		trace_resolve(a->trace, a->trace_size, syms);
-		bool is_internal = trace_is_internal(syms, a->trace_size);
-		if (is_internal) {
-			--count;
-		} else if (report_count < report_limit) {
-			heaph_printf("%s", prefix), prefix = "";
-			heaph_printf("#### Leak %d (%zu bytes) ####\n",
-				     ++report_count, a->size);
-			for (int i = 0; i < a->trace_size; ++i)
-				heaph_printf("%d - %s\n", i, syms[i].name);
-		}
-		if (!is_internal)
-			leak_size += a->size;
 	}
-	spinlock_rel(&allocs_lock);
+	heaph_unlock_shards();
 
 	if (count == 0 && report_mode != MODE_VERBOSE)
 		return;
@@ -420,8 +1059,13 @@ heaph_atexit(void)
 		heaph_printf("HH: only first %d reports are shown\n",
 			     report_count);
 	}
+	if (sample_rate > 1) {
+		heaph_printf("HH: stacks of 1 in %d allocations are recorded\n",
+			     sample_rate);
+	}
 	heaph_printf("HH: total allocation count - %llu\n",
 		     (long long)alloc_count_total);
+	heaph_report_mmap();
 }
 
 static void
@@ -436,6 +1080,15 @@ heaph_init(void)
 	void *(*sym_calloc)(size_t, size_t) = dlsym(RTLD_NEXT, "calloc");
 	void *(*sym_realloc)(void *, size_t) = dlsym(RTLD_NEXT, "realloc");
 	char *(*sym_strdup)(const char *) = dlsym(RTLD_NEXT, "strdup");
+	char *(*sym_strndup)(const char *, size_t) =
+		dlsym(RTLD_NEXT, "strndup");
+	int (*sym_posix_memalign)(void **, size_t, size_t) =
+		dlsym(RTLD_NEXT, "posix_memalign");
+	void *(*sym_aligned_alloc)(size_t, size_t) =
+		dlsym(RTLD_NEXT, "aligned_alloc");
+	void *(*sym_mmap)(void *, size_t, int, int, int, off_t) =
+		dlsym(RTLD_NEXT, "mmap");
+	int (*sym_munmap)(void *, size_t) = dlsym(RTLD_NEXT, "munmap");
 	ssize_t (*sym_getline)(char **, size_t *, FILE *) =
 		dlsym(RTLD_NEXT, "getline");
 	int (*sym_getaddrinfo)(
@@ -449,6 +1102,11 @@ heaph_init(void)
 	default_calloc = sym_calloc;
 	default_realloc = sym_realloc;
 	default_strdup = sym_strdup;
+	default_strndup = sym_strndup;
+	default_posix_memalign = sym_posix_memalign;
+	default_aligned_alloc = sym_aligned_alloc;
+	default_mmap = sym_mmap;
+	default_munmap = sym_munmap;
 	default_getline = sym_getline;
 	default_getaddrinfo = sym_getaddrinfo;
 	default_freeaddrinfo = sym_freeaddrinfo;
@@ -462,6 +1120,23 @@ heaph_init(void)
 		else if (strcmp(hh_report, "q") == 0)
 			report_mode = MODE_QUIET;
 	}
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != NULL && atoi(hh_sample) > 0)
+		sample_rate = atoi(hh_sample);
+	const char *hh_depth = getenv("HHDEPTH");
+	if (hh_depth != NULL && atoi(hh_depth) > 0 &&
+	    atoi(hh_depth) < MAX_BACKTRACE_LEN)
+		trace_depth = atoi(hh_depth);
+	const char *hh_profile = getenv("HHPROFILE");
+	if (hh_profile != NULL && *hh_profile != 0) {
+		profile_path = hh_profile;
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = profile_on_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR2, &sa, NULL);
+	}
 	atexit(heaph_atexit);
 }
 
@@ -489,12 +1164,14 @@ getline(char **linep, size_t *linecapp, FILE *stream)
 	heaph_assert(!alloc_is_static(line_old));
 	ssize_t res = default_getline(linep, linecapp, stream);
 	if (line_old == NULL && *linep != NULL) {
-		alloc_trace_new(*linep, strlen(*linep) + 1);
+		alloc_trace_new(*linep, strlen(*linep) + 1,
+				__builtin_return_address(0));
 	} else if (line_old != NULL && *linep == NULL) {
 		heaph_assert(false);
 	} else if (line_old != NULL && *linep != NULL && line_old != *linep) {
 		alloc_free(line_old);
-		alloc_trace_new(*linep, strlen(*linep) + 1);
+		alloc_trace_new(*linep, strlen(*linep) + 1,
+				__builtin_return_address(0));
 	} else if (line_old != *linep) {
 		heaph_assert(false);
 	}
@@ -511,7 +1188,21 @@ strdup(const char *ptr)
 	++depth;
 	char *res = default_strdup(ptr);
 	if (res != NULL)
-		alloc_trace_new(res, strlen(res) + 1);
+		alloc_trace_new(res, strlen(res) + 1, __builtin_return_address(0));
+	--depth;
+	return res;
+}
+
+char *
+strndup(const char *ptr, size_t size)
+{
+	heaph_touch();
+	heaph_assert(!is_exit_done);
+	heaph_assert(!alloc_is_static(ptr));
+	++depth;
+	char *res = default_strndup(ptr, size);
+	if (res != NULL)
+		alloc_trace_new(res, strlen(res) + 1, __builtin_return_address(0));
 	--depth;
 	return res;
 }
@@ -523,7 +1214,7 @@ malloc(size_t size)
 	++depth;
 	void *res = default_malloc(size);
 	if (res != NULL)
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, __builtin_return_address(0));
 	--depth;
 	return res;
 }
@@ -535,13 +1226,13 @@ calloc(size_t num, size_t size)
 	++depth;
 	void *res = default_calloc(num, size);
 	if (res != NULL)
-		alloc_trace_new(res, num * size);
+		alloc_trace_new(res, num * size, __builtin_return_address(0));
 	--depth;
 	return res;
 }
 
-void *
-realloc(void *ptr, size_t size)
+static void *
+heaph_realloc(void *ptr, size_t size, void *caller)
 {
 	heaph_touch();
 	++depth;
@@ -549,13 +1240,56 @@ realloc(void *ptr, size_t size)
 		ptr = NULL;
 	void *res = default_realloc(ptr, size);
 	if (ptr == NULL && res != NULL) {
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, caller);
 	} else if (ptr != NULL && res == NULL) {
 		alloc_free(ptr);
 	} else if (ptr != NULL && res != ptr) {
 		alloc_free(ptr);
-		alloc_trace_new(res, size);
+		alloc_trace_new(res, size, caller);
+	}
+	--depth;
+	return res;
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	return heaph_realloc(ptr, size, __builtin_return_address(0));
+}
+
+// Not found by dlsym(): not everywhere, and anyway it is realloc() with the
+// overflow check.
+void *
+reallocarray(void *ptr, size_t count, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
 	}
+	return heaph_realloc(ptr, total, __builtin_return_address(0));
+}
+
+int
+posix_memalign(void **res, size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	int rc = default_posix_memalign(res, alignment, size);
+	if (rc == 0 && *res != NULL)
+		alloc_trace_new(*res, size, __builtin_return_address(0));
+	--depth;
+	return rc;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = default_aligned_alloc(alignment, size);
+	if (res != NULL)
+		alloc_trace_new(res, size, __builtin_return_address(0));
 	--depth;
 	return res;
 }
@@ -582,7 +1316,8 @@ getaddrinfo(const char *hostname, const char *servname,
 	++depth;
 	int rc = default_getaddrinfo(hostname, servname, hints, res);
 	if (rc == 0 && *res != NULL)
-		alloc_trace_new(*res, sizeof(**res));
+		alloc_trace_new(*res, sizeof(**res),
+				__builtin_return_address(0));
 	--depth;
 	return rc;
 }
@@ -600,11 +1335,38 @@ freeaddrinfo(struct addrinfo *ai)
 	--depth;
 }
 
+void *
+mmap(void *addr, size_t size, int prot, int flags, int fd, off_t offset)
+{
+	heaph_touch();
+	void *res = default_mmap(addr, size, prot, flags, fd, offset);
+	if (res != MAP_FAILED)
+		__atomic_add_fetch(&mmap_size, size, __ATOMIC_RELAXED);
+	return res;
+}
+
+int
+munmap(void *addr, size_t size)
+{
+	heaph_touch();
+	int rc = default_munmap(addr, size);
+	if (rc == 0)
+		__atomic_sub_fetch(&mmap_size, size, __ATOMIC_RELAXED);
+	return rc;
+}
+
+uint64_t
+heaph_get_mmap_size(void)
+{
+	int64_t res = __atomic_load_n(&mmap_size, __ATOMIC_RELAXED);
+	return res > 0 ? res : 0;
+}
+
 uint64_t
 heaph_get_alloc_count(void)
 {
-	spinlock_acq(&allocs_lock);
-	uint64_t res = alloc_count;
-	spinlock_rel(&allocs_lock);
-	return res;
+	int64_t count;
+	uint64_t total;
+	heaph_counts(&count, &total);
+	return count;
 }
@@ -4,3 +4,6 @@
 
 uint64_t
 heaph_get_alloc_count(void);
+
+uint64_t
+heaph_get_mmap_size(void);
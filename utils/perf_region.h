@@ -0,0 +1,234 @@
+#pragma once
+
+/*
+ * Hardware counters of code regions: the cycles, instructions, last level
+ * cache and data TLB misses, and context switches between
+ * PERF_REGION_BEGIN(name) and PERF_REGION_END(name), summed up over all
+ * the calls in all the threads and printed to stderr at exit, in total and
+ * per call.
+ *
+ * Built with -DPERF_REGIONS only, see `make PERF=1` of the tasks. Without
+ * it the macros are nothing at all. With it each end of a region is a
+ * read() of the thread's perf_event_open() counters, so a region is to be
+ * around something much longer than a system call. The counters are of
+ * the thread, with its coroutines or whatever else it runs inside the
+ * region. Where perf_event_open() is not allowed, only the calls are
+ * counted.
+ *
+ * The regions are listed per translation unit, a name is to be unique in
+ * it and used once in a function.
+ */
+
+#ifdef PERF_REGIONS
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+enum {
+	PERF_REGION_CYCLES,
+	PERF_REGION_INSTRUCTIONS,
+	PERF_REGION_LLC_MISSES,
+	PERF_REGION_DTLB_MISSES,
+	PERF_REGION_CONTEXT_SWITCHES,
+	PERF_REGION_COUNTERS,
+};
+
+struct perf_region {
+	const char *name;
+	uint64_t calls;
+	uint64_t totals[PERF_REGION_COUNTERS];
+	/** Bit of each counter some call has been counted with. */
+	unsigned counted;
+	bool is_listed;
+	struct perf_region *next;
+};
+
+/** The counters of a thread, read at once as a group. */
+struct perf_region_thread {
+	int fds[PERF_REGION_COUNTERS];
+	/** Where each one is in what the group's read() gives, or -1. */
+	int index[PERF_REGION_COUNTERS];
+	int count;
+	bool is_open;
+};
+
+static __thread struct perf_region_thread perf_region_thread;
+static struct perf_region *perf_region_list = NULL;
+static bool perf_region_is_reported = false;
+static pthread_key_t perf_region_key;
+static pthread_once_t perf_region_once = PTHREAD_ONCE_INIT;
+
+static inline void
+perf_region_thread_close(void *arg)
+{
+	struct perf_region_thread *t = arg;
+	for (int i = 0; i < PERF_REGION_COUNTERS; ++i) {
+		if (t->fds[i] >= 0)
+			close(t->fds[i]);
+		t->fds[i] = -1;
+	}
+}
+
+static inline void
+perf_region_key_create(void)
+{
+	(void)pthread_key_create(&perf_region_key, perf_region_thread_close);
+}
+
+static inline void
+perf_region_thread_open(struct perf_region_thread *t)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[PERF_REGION_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+		 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+	};
+	t->is_open = true;
+	t->count = 0;
+	int leader = -1;
+	for (int i = 0; i < PERF_REGION_COUNTERS; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		/* The switches are in the kernel, the rest only of the code. */
+		attr.exclude_kernel = events[i].type != PERF_TYPE_SOFTWARE;
+		t->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		t->index[i] = -1;
+		if (t->fds[i] < 0)
+			continue;
+		if (leader < 0)
+			leader = t->fds[i];
+		t->index[i] = t->count++;
+	}
+	pthread_once(&perf_region_once, perf_region_key_create);
+	(void)pthread_setspecific(perf_region_key, t);
+}
+
+/**
+ * The counters of the thread to @a values. Returns the bits of the ones
+ * there, 0 if none.
+ */
+static inline unsigned
+perf_region_read(uint64_t *values)
+{
+	struct perf_region_thread *t = &perf_region_thread;
+	if (!t->is_open)
+		perf_region_thread_open(t);
+	if (t->count == 0)
+		return 0;
+	uint64_t buf[1 + PERF_REGION_COUNTERS];
+	int leader = -1;
+	for (int i = 0; i < PERF_REGION_COUNTERS && leader < 0; ++i)
+		leader = t->fds[i];
+	ssize_t size = (1 + t->count) * sizeof(*buf);
+	if (read(leader, buf, size) != size)
+		return 0;
+	unsigned bits = 0;
+	for (int i = 0; i < PERF_REGION_COUNTERS; ++i) {
+		values[i] = t->index[i] >= 0 ? buf[1 + t->index[i]] : 0;
+		bits |= (t->index[i] >= 0) << i;
+	}
+	return bits;
+}
+
+static inline void
+perf_region_report(void)
+{
+	static const char *const names[PERF_REGION_COUNTERS] = {
+		"cycles", "instructions", "llc_misses", "dtlb_misses",
+		"context_switches",
+	};
+	struct perf_region *r = __atomic_load_n(&perf_region_list,
+						__ATOMIC_ACQUIRE);
+	for (; r != NULL; r = r->next) {
+		uint64_t calls = __atomic_load_n(&r->calls, __ATOMIC_RELAXED);
+		unsigned counted = __atomic_load_n(&r->counted,
+						   __ATOMIC_RELAXED);
+		fprintf(stderr, "perf: %s: %llu calls", r->name,
+			(unsigned long long)calls);
+		for (int i = 0; i < PERF_REGION_COUNTERS && calls != 0; ++i) {
+			if (!(counted & (1u << i)))
+				continue;
+			uint64_t total = __atomic_load_n(&r->totals[i],
+							 __ATOMIC_RELAXED);
+			fprintf(stderr, ", %s %llu (%.1f per call)", names[i],
+				(unsigned long long)total,
+				(double)total / calls);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+static inline void
+perf_region_list_add(struct perf_region *r)
+{
+	if (__atomic_exchange_n(&r->is_listed, true, __ATOMIC_ACQ_REL))
+		return;
+	r->next = __atomic_load_n(&perf_region_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&perf_region_list, &r->next, r,
+					    true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+	if (!__atomic_exchange_n(&perf_region_is_reported, true,
+				 __ATOMIC_ACQ_REL))
+		atexit(perf_region_report);
+}
+
+static inline void
+perf_region_begin(struct perf_region *r, uint64_t *start)
+{
+	if (!__atomic_load_n(&r->is_listed, __ATOMIC_RELAXED))
+		perf_region_list_add(r);
+	if (perf_region_read(start) == 0)
+		start[0] = UINT64_MAX;
+}
+
+static inline void
+perf_region_end(struct perf_region *r, const uint64_t *start)
+{
+	uint64_t end[PERF_REGION_COUNTERS];
+	__atomic_add_fetch(&r->calls, 1, __ATOMIC_RELAXED);
+	unsigned bits;
+	if (start[0] == UINT64_MAX || (bits = perf_region_read(end)) == 0)
+		return;
+	if ((__atomic_load_n(&r->counted, __ATOMIC_RELAXED) & bits) != bits)
+		__atomic_or_fetch(&r->counted, bits, __ATOMIC_RELAXED);
+	for (int i = 0; i < PERF_REGION_COUNTERS; ++i)
+		__atomic_add_fetch(&r->totals[i], end[i] - start[i],
+				   __ATOMIC_RELAXED);
+}
+
+#define PERF_REGION_BEGIN(region)						\
+	static struct perf_region perf_region_##region = {.name = #region};	\
+	uint64_t perf_region_start_##region[PERF_REGION_COUNTERS];		\
+	perf_region_begin(&perf_region_##region, perf_region_start_##region)
+
+#define PERF_REGION_END(region)						\
+	perf_region_end(&perf_region_##region, perf_region_start_##region)
+
+#else /* PERF_REGIONS */
+
+#define PERF_REGION_BEGIN(name) do { } while (0)
+#define PERF_REGION_END(name) do { } while (0)
+
+#endif /* PERF_REGIONS */